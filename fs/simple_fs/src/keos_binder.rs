@@ -5,9 +5,9 @@ use keos::{
     sync::{atomic::AtomicU32, spinlock::SpinLock},
 };
 
-/// The filesystem disk.
+/// The filesystem disk, with the identifier of the file system instance.
 #[derive(Debug)]
-pub struct FsDisk(usize);
+pub struct FsDisk(usize, u64);
 
 impl Disk for FsDisk {
     fn read(&self, sector: Sector, buf: &mut [u8; 512]) -> Result<(), Error> {
@@ -26,6 +26,24 @@ impl Disk for FsDisk {
             Err(Error::DiskError)
         }
     }
+    fn read_many(&self, sector: Sector, buf: &mut [u8]) -> Result<(), Error> {
+        let dev = abyss::dev::get_bdev(self.0).ok_or(Error::DiskError)?;
+        let mut bio = core::iter::once((keos::fs::Sector(sector.into_usize()), buf));
+        if dev.read_vectored(&mut bio) {
+            Ok(())
+        } else {
+            Err(Error::DiskError)
+        }
+    }
+    fn write_many(&self, sector: Sector, buf: &[u8]) -> Result<(), Error> {
+        let dev = abyss::dev::get_bdev(self.0).ok_or(Error::DiskError)?;
+        let mut bio = core::iter::once((keos::fs::Sector(sector.into_usize()), buf));
+        if dev.write_vectored(&mut bio) {
+            Ok(())
+        } else {
+            Err(Error::DiskError)
+        }
+    }
 }
 
 #[derive(Clone)]
@@ -34,7 +52,8 @@ pub struct FileSystem(Arc<super::SimpleFs<FsDisk>>);
 impl FileSystem {
     pub fn load(slot_idx: usize) -> Result<Self, super::Error> {
         abyss::dev::get_bdev(slot_idx).ok_or(Error::DiskError)?;
-        super::SimpleFs::load(FsDisk(slot_idx)).map(|o| FileSystem(Arc::new(o)))
+        super::SimpleFs::load(FsDisk(slot_idx, keos::fs::new_fs_id()))
+            .map(|o| FileSystem(Arc::new(o)))
     }
 }
 
@@ -104,6 +123,12 @@ impl keos::fs::traits::RegularFile for super::File<FsDisk> {
     fn writeback(&self) -> Result<(), keos::KernelError> {
         Ok(())
     }
+
+    /// The inode numbers are reused once the file system is dropped, so the
+    /// files are named apart by the instance.
+    fn fs_id(&self) -> Option<u64> {
+        Some(self.fs.t.1)
+    }
 }
 
 impl Drop for FsDisk {
@@ -34,7 +34,7 @@ mod keos_binder;
 pub use keos_binder::FileSystem;
 
 extern crate alloc;
-use alloc::{boxed::Box, string::String, sync::Arc};
+use alloc::{boxed::Box, collections::BTreeMap, string::String, sync::Arc};
 
 pub const FS_NAME: &str = "simple_fs";
 
@@ -135,6 +135,26 @@ pub trait Disk {
     fn read(&self, sector: Sector, buf: &mut [u8; 512]) -> Result<(), Error>;
     /// Write 512 bytes to disk starting from sector.
     fn write(&self, sector: Sector, buf: &[u8; 512]) -> Result<(), Error>;
+    /// Read the consecutive sectors starting from `sector` into `buf`, whose
+    /// length is a multiple of 512.
+    ///
+    /// The default reads the sectors one by one.
+    fn read_many(&self, sector: Sector, buf: &mut [u8]) -> Result<(), Error> {
+        for (i, b) in buf.as_chunks_mut::<512>().0.iter_mut().enumerate() {
+            self.read(Sector(sector.0 + i), b)?;
+        }
+        Ok(())
+    }
+    /// Write `buf`, whose length is a multiple of 512, to the consecutive
+    /// sectors starting from `sector`.
+    ///
+    /// The default writes the sectors one by one.
+    fn write_many(&self, sector: Sector, buf: &[u8]) -> Result<(), Error> {
+        for (i, b) in buf.as_chunks::<512>().0.iter().enumerate() {
+            self.write(Sector(sector.0 + i), b)?;
+        }
+        Ok(())
+    }
 }
 
 /// The root file system
@@ -142,6 +162,8 @@ pub trait Disk {
 pub struct SimpleFs<T: Disk> {
     t: T,
     size: usize,
+    /// Header sector and size of each file, by name.
+    index: BTreeMap<String, (Sector, usize)>,
 }
 
 impl<T: Disk> SimpleFs<T> {
@@ -155,7 +177,11 @@ impl<T: Disk> SimpleFs<T> {
         drop(rw);
         t.write(Sector(0), buf.as_ref())?;
 
-        let this = Self { t, size };
+        let this = Self {
+            t,
+            size,
+            index: BTreeMap::new(),
+        };
         this.write_file_header(Sector(1), "", size - 512 * 2)?;
 
         // Cleanup buf
@@ -174,7 +200,38 @@ impl<T: Disk> SimpleFs<T> {
             return Err(Error::FsError);
         }
         let size = rw.read_u64(8) as usize;
-        Ok(Self { t, size })
+        let mut this = Self {
+            t,
+            size,
+            index: BTreeMap::new(),
+        };
+        this.build_index()?;
+        Ok(this)
+    }
+
+    /// Indexes the files by walking the file headers once.
+    fn build_index(&mut self) -> Result<(), Error> {
+        let mut buf = Box::new([0; 512]);
+        let mut pos = 1;
+        while pos < self.size / 512 {
+            self.t.read(Sector(pos), buf.as_mut())?;
+            let rw = ByteRw::new(buf.as_mut());
+            let len = rw.read_u64(0) as usize;
+            let size = rw.read_u64(8) as usize;
+            if len > 512 - 16 {
+                return Err(Error::FsError);
+            }
+            if len != 0 {
+                let name =
+                    core::str::from_utf8(&rw.inner()[16..16 + len]).map_err(|_| Error::FsError)?;
+                // The first file of a name shadows the others.
+                self.index
+                    .entry(String::from(name))
+                    .or_insert((Sector(pos), size));
+            }
+            pos += 1 + size.div_ceil(512);
+        }
+        Ok(())
     }
 
     fn write_file_header(&self, sector: Sector, name: &str, size: usize) -> Result<(), Error> {
@@ -194,28 +251,13 @@ impl<T: Disk> SimpleFs<T> {
 
     /// Open a file with `name`.
     pub fn open(self: &Arc<Self>, name: &str) -> Option<File<T>> {
-        if name.len() == 0 {
-            return None;
-        }
-        let mut buf = Box::new([0; 512]);
-        let mut pos = 1;
-        while pos < self.size / 512 {
-            self.t.read(Sector(pos), buf.as_mut()).ok()?;
-            let rw = ByteRw::new(buf.as_mut());
-            let len = rw.read_u64(0) as usize;
-            let fname = core::str::from_utf8(&rw.inner()[16..16 + len]).ok()?;
-            if fname == name {
-                return Some(File {
-                    name: String::from(name),
-                    size: rw.read_u64(8) as usize,
-                    start_sector: Sector(pos),
-                    fs: self.clone(),
-                });
-            }
-            let this_segment_size = ((rw.read_u64(8) + 511) & !511) as usize;
-            pos += 1 + this_segment_size / 512;
-        }
-        None
+        let &(start_sector, size) = self.index.get(name)?;
+        Some(File {
+            name: String::from(name),
+            size,
+            start_sector,
+            fs: self.clone(),
+        })
     }
 
     /// Create a file that contains `contents`.
@@ -239,13 +281,13 @@ impl<T: Disk> SimpleFs<T> {
                 }
 
                 let mut content_pos = pos + 1;
-                let mut chunks = contents.chunks_exact(512);
-                while let Some(chunk) = chunks.next() {
-                    self.t
-                        .write(Sector(content_pos), chunk.try_into().unwrap())?;
-                    content_pos += 1;
-                }
+                let chunks = contents.chunks_exact(512);
                 let remainder = chunks.remainder();
+                let aligned = &contents[..contents.len() - remainder.len()];
+                if !aligned.is_empty() {
+                    self.t.write_many(Sector(content_pos), aligned)?;
+                    content_pos += aligned.len() / 512;
+                }
                 if remainder.len() != 0 {
                     buf[..remainder.len()].copy_from_slice(remainder);
                     buf[remainder.len()..].fill(0);
@@ -254,6 +296,13 @@ impl<T: Disk> SimpleFs<T> {
                 }
                 self.write_file_header(Sector(pos), name, file_size)?;
                 assert_eq!(content_pos, pos + 1 + required / 512);
+                let en = self
+                    .index
+                    .entry(String::from(name))
+                    .or_insert((Sector(pos), file_size));
+                if en.0 > Sector(pos) {
+                    *en = (Sector(pos), file_size);
+                }
                 return Ok(());
             } else {
                 pos += 1 + this_segment_size / 512;
@@ -310,13 +359,14 @@ impl<T: Disk> File<T> {
         }
 
         if len > sofs {
-            let mut chunks = contents[sofs..len].chunks_exact_mut(512);
-            while let Some(chunk) = chunks.next() {
-                self.fs.t.read(Sector(pos), buf.as_mut())?;
-                chunk.copy_from_slice(buf.as_ref());
-                pos += 1;
+            // Read the whole sectors straight into `contents`.
+            let (aligned, remainder) = contents[sofs..len].as_chunks_mut::<512>();
+            if !aligned.is_empty() {
+                self.fs
+                    .t
+                    .read_many(Sector(pos), aligned.as_flattened_mut())?;
+                pos += aligned.len();
             }
-            let remainder = chunks.into_remainder();
             if remainder.len() != 0 {
                 self.fs.t.read(Sector(pos), buf.as_mut())?;
                 remainder.copy_from_slice(&buf.as_ref()[..remainder.len()]);
@@ -343,13 +393,11 @@ impl<T: Disk> File<T> {
         }
 
         if len > sofs {
-            let mut chunks = contents[sofs..len].chunks_exact(512);
-            while let Some(chunk) = chunks.next() {
-                buf.copy_from_slice(chunk);
-                self.fs.t.write(Sector(pos), buf.as_ref())?;
-                pos += 1;
+            let (aligned, remainder) = contents[sofs..len].as_chunks::<512>();
+            if !aligned.is_empty() {
+                self.fs.t.write_many(Sector(pos), aligned.as_flattened())?;
+                pos += aligned.len();
             }
-            let remainder = chunks.remainder();
             if remainder.len() != 0 {
                 buf[..remainder.len()].copy_from_slice(remainder);
                 self.fs.t.write(Sector(pos), buf.as_ref())?;
@@ -2,12 +2,236 @@
 #include <string.h>
 #include <syscall.h>
 #include <syscall-nr.h>
+#include <thread.h>
+
+/* A buffered output stream.
+
+   A fully buffered stream is written when its buffer fills up.
+   A line-buffered stream is also written at the end of each call
+   that outputs a new-line character, and an unbuffered stream at
+   the end of each call, so that a single printf() still makes a
+   single write.  All streams are flushed by exit(), exit_group(),
+   fork() and spawn().
+
+   stdout is line-buffered, and it is also flushed before each
+   read() from the standard input, so that a prompt without a
+   new-line is shown before the program waits for the answer.  A
+   program that prints a lot may switch it to full buffering with
+   setvbuf(). */
+struct FILE {
+	int fd;             /* File descriptor. */
+	int mode;           /* _IOFBF, _IOLBF or _IONBF. */
+	char *buf;          /* Buffer. */
+	size_t size;        /* Size of the buffer. */
+	size_t len;         /* Bytes in the buffer. */
+	struct mutex lock;  /* Serializes the users of the stream. */
+};
+
+static char stdout_buf[BUFSIZ];
+static char stderr_buf[BUFSIZ];
+
+static FILE stdout_file = {
+	STDOUT_FILENO, _IOLBF, stdout_buf, BUFSIZ, 0, MUTEX_INITIALIZER
+};
+static FILE stderr_file = {
+	STDERR_FILENO, _IONBF, stderr_buf, BUFSIZ, 0, MUTEX_INITIALIZER
+};
+
+FILE *stdout = &stdout_file;
+FILE *stderr = &stderr_file;
+
+/* Writes out the buffer of STREAM, which must be locked.
+   Returns 0 if successful, EOF on error, in which case the
+   buffered bytes are dropped. */
+static int
+flush_locked (FILE *stream) {
+	size_t ofs = 0;
+	int retval = 0;
+
+	while (ofs < stream->len) {
+		ssize_t n = write (stream->fd, stream->buf + ofs, stream->len - ofs);
+		if (n <= 0) {
+			retval = EOF;
+			break;
+		}
+		ofs += n;
+	}
+	stream->len = 0;
+	return retval;
+}
+
+/* Appends SIZE bytes at BUF to STREAM, which must be locked. */
+static void
+put_locked (FILE *stream, const char *buf, size_t size) {
+	if (size > stream->size - stream->len) {
+		flush_locked (stream);
+		/* Too large to be worth copying. */
+		if (size >= stream->size) {
+			while (size > 0) {
+				ssize_t n = write (stream->fd, buf, size);
+				if (n <= 0)
+					return;
+				buf += n;
+				size -= n;
+			}
+			return;
+		}
+	}
+	memcpy (stream->buf + stream->len, buf, size);
+	stream->len += size;
+}
+
+/* Ends a call that output to STREAM, which must be locked.
+   NEWLINE tells whether the output contained a new-line. */
+static void
+end_locked (FILE *stream, bool newline) {
+	if (stream->mode == _IONBF || (stream->mode == _IOLBF && newline))
+		flush_locked (stream);
+}
+
+/* Writes out the buffered output of STREAM, or of all streams if
+   STREAM is a null pointer.  Returns 0 if successful, EOF on
+   error. */
+int
+fflush (FILE *stream) {
+	int retval;
+
+	if (stream == NULL)
+		return fflush (stdout) | fflush (stderr);
+
+	mutex_lock (&stream->lock);
+	retval = flush_locked (stream);
+	mutex_unlock (&stream->lock);
+	return retval;
+}
+
+/* Locks and flushes all streams before fork(), so that no other
+   thread holds their locks or fills their buffers while the
+   address space is copied. */
+void
+__stdio_fork_prepare (void) {
+	mutex_lock (&stdout->lock);
+	mutex_lock (&stderr->lock);
+	flush_locked (stdout);
+	flush_locked (stderr);
+}
+
+/* Releases the streams locked by __stdio_fork_prepare().  The
+   child only has the forking thread, so it starts the locks over
+   instead of waking the waiters of the parent. */
+void
+__stdio_fork_done (bool child) {
+	if (child) {
+		mutex_init (&stderr->lock);
+		mutex_init (&stdout->lock);
+	} else {
+		mutex_unlock (&stderr->lock);
+		mutex_unlock (&stdout->lock);
+	}
+}
+
+/* Sets the buffering MODE of STREAM, one of _IOFBF, _IOLBF and
+   _IONBF.  If BUF is nonnull, the stream uses the SIZE bytes at
+   BUF as its buffer from now on.  Returns 0 if successful,
+   nonzero if MODE is invalid. */
+int
+setvbuf (FILE *stream, char *buf, int mode, size_t size) {
+	if (mode != _IOFBF && mode != _IOLBF && mode != _IONBF)
+		return EOF;
+
+	mutex_lock (&stream->lock);
+	flush_locked (stream);
+	stream->mode = mode;
+	if (buf != NULL && size > 0) {
+		stream->buf = buf;
+		stream->size = size;
+	}
+	mutex_unlock (&stream->lock);
+	return 0;
+}
+
+/* Writes CNT elements of SIZE bytes each at BUF to STREAM.
+   Returns CNT. */
+size_t
+fwrite (const void *buf, size_t size, size_t cnt, FILE *stream) {
+	size_t total = size * cnt;
+
+	mutex_lock (&stream->lock);
+	put_locked (stream, buf, total);
+	end_locked (stream, memchr (buf, '\n', total) != NULL);
+	mutex_unlock (&stream->lock);
+	return cnt;
+}
+
+/* Writes string S to STREAM. */
+int
+fputs (const char *s, FILE *stream) {
+	fwrite (s, 1, strlen (s), stream);
+	return 0;
+}
+
+/* Writes C to STREAM. */
+int
+fputc (int c, FILE *stream) {
+	char c2 = c;
+	fwrite (&c2, 1, 1, stream);
+	return c;
+}
+
+/* Auxiliary data for vfprintf_helper(). */
+struct vfprintf_aux {
+	FILE *stream;       /* Locked output stream. */
+	int char_cnt;       /* Total characters written so far. */
+	bool newline;       /* Whether a new-line was written. */
+};
+
+/* Adds C to the stream in AUX. */
+static void
+vfprintf_helper (char c, void *aux_) {
+	struct vfprintf_aux *aux = aux_;
+	FILE *stream = aux->stream;
+
+	if (stream->len == stream->size)
+		flush_locked (stream);
+	stream->buf[stream->len++] = c;
+	aux->newline |= c == '\n';
+	aux->char_cnt++;
+}
+
+/* Formats the printf() format specification FORMAT with
+   arguments given in ARGS and writes the output to STREAM. */
+int
+vfprintf (FILE *stream, const char *format, va_list args) {
+	struct vfprintf_aux aux;
+	aux.stream = stream;
+	aux.char_cnt = 0;
+	aux.newline = false;
+
+	mutex_lock (&stream->lock);
+	__vprintf (format, args, vfprintf_helper, &aux);
+	end_locked (stream, aux.newline);
+	mutex_unlock (&stream->lock);
+	return aux.char_cnt;
+}
+
+/* Like printf(), but writes output to STREAM. */
+int
+fprintf (FILE *stream, const char *format, ...) {
+	va_list args;
+	int retval;
+
+	va_start (args, format);
+	retval = vfprintf (stream, format, args);
+	va_end (args);
+
+	return retval;
+}
 
 /* The standard vprintf() function,
    which is like printf() but uses a va_list. */
 int
 vprintf (const char *format, va_list args) {
-	return vhprintf (STDOUT_FILENO, format, args);
+	return vfprintf (stdout, format, args);
 }
 
 /* Like printf(), but writes output to the given HANDLE. */
@@ -27,8 +251,11 @@ hprintf (int handle, const char *format, ...) {
    character. */
 int
 puts (const char *s) {
-	write (STDOUT_FILENO, s, strlen (s));
-	putchar ('\n');
+	mutex_lock (&stdout->lock);
+	put_locked (stdout, s, strlen (s));
+	put_locked (stdout, "\n", 1);
+	end_locked (stdout, true);
+	mutex_unlock (&stdout->lock);
 
 	return 0;
 }
@@ -36,9 +263,7 @@ puts (const char *s) {
 /* Writes C to the console. */
 int
 putchar (int c) {
-	char c2 = c;
-	write (STDOUT_FILENO, &c2, 1);
-	return c;
+	return fputc (c, stdout);
 }
 
 /* Auxiliary data for vhprintf_helper(). */
@@ -58,6 +283,13 @@ static void flush (struct vhprintf_aux *);
 int
 vhprintf (int handle, const char *format, va_list args) {
 	struct vhprintf_aux aux;
+
+	/* Keep the order with the output through the streams. */
+	if (handle == STDOUT_FILENO)
+		return vfprintf (stdout, format, args);
+	if (handle == STDERR_FILENO)
+		return vfprintf (stderr, format, args);
+
 	aux.p = aux.buf;
 	aux.char_cnt = 0;
 	aux.handle = handle;
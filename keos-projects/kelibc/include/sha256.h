@@ -76,45 +76,158 @@ static const WORD k[64] = {
 };
 
 /*********************** FUNCTION DEFINITIONS ***********************/
-void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
+/* The block transforms take NBLOCKS consecutive 64-byte blocks at DATA.
+ *
+ * sha256_transform_sha() uses the SHA extensions (SHA-NI), and
+ * sha256_transform_scalar() is an unrolled fallback that keeps the message
+ * schedule in a ring of 16 words.  sha256_transform() picks one with CPUID on
+ * the first call. */
+#define SHA256_LOAD(p) (((WORD)(p)[0] << 24) | ((WORD)(p)[1] << 16) | ((WORD)(p)[2] << 8) | (WORD)(p)[3])
+#define SHA256_W(i) (w[(i) & 15] += SIG1(w[((i) - 2) & 15]) + w[((i) - 7) & 15] + SIG0(w[((i) - 15) & 15]))
+#define SHA256_ROUND(a,b,c,d,e,f,g,h,i,x) do { \
+	WORD t = (h) + EP1(e) + CH(e,f,g) + k[i] + (x); \
+	(d) += t; \
+	(h) = t + EP0(a) + MAJ(a,b,c); \
+} while (0)
+#define SHA256_ROUNDS8(i,X) do { \
+	SHA256_ROUND(a,b,c,d,e,f,g,h,(i) + 0,X((i) + 0)); \
+	SHA256_ROUND(h,a,b,c,d,e,f,g,(i) + 1,X((i) + 1)); \
+	SHA256_ROUND(g,h,a,b,c,d,e,f,(i) + 2,X((i) + 2)); \
+	SHA256_ROUND(f,g,h,a,b,c,d,e,(i) + 3,X((i) + 3)); \
+	SHA256_ROUND(e,f,g,h,a,b,c,d,(i) + 4,X((i) + 4)); \
+	SHA256_ROUND(d,e,f,g,h,a,b,c,(i) + 5,X((i) + 5)); \
+	SHA256_ROUND(c,d,e,f,g,h,a,b,(i) + 6,X((i) + 6)); \
+	SHA256_ROUND(b,c,d,e,f,g,h,a,(i) + 7,X((i) + 7)); \
+} while (0)
+#define SHA256_M(i) (w[i])
+
+static void sha256_transform_scalar(WORD state[8], const BYTE data[], size_t nblocks)
+{
+	WORD a, b, c, d, e, f, g, h, w[16];
+	int i;
+
+	for (; nblocks > 0; --nblocks, data += 64) {
+		for (i = 0; i < 16; ++i)
+			w[i] = SHA256_LOAD(data + 4 * i);
+
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+		e = state[4];
+		f = state[5];
+		g = state[6];
+		h = state[7];
+
+		SHA256_ROUNDS8(0, SHA256_M);
+		SHA256_ROUNDS8(8, SHA256_M);
+		SHA256_ROUNDS8(16, SHA256_W);
+		SHA256_ROUNDS8(24, SHA256_W);
+		SHA256_ROUNDS8(32, SHA256_W);
+		SHA256_ROUNDS8(40, SHA256_W);
+		SHA256_ROUNDS8(48, SHA256_W);
+		SHA256_ROUNDS8(56, SHA256_W);
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
+}
+
+#include <immintrin.h>
+
+/* Four rounds from the message words MSG, and the schedule of the next ones:
+ * M0 gets the message words four rounds later. */
+#define SHA256_NI_ROUNDS4(i, msg) do { \
+	__m128i wk = _mm_add_epi32(msg, _mm_loadu_si128((const __m128i *)&k[i])); \
+	state1 = _mm_sha256rnds2_epu32(state1, state0, wk); \
+	state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(wk, 0x0e)); \
+} while (0)
+#define SHA256_NI_SCHEDULE(m0, m1, m2, m3) do { \
+	m0 = _mm_sha256msg1_epu32(m0, m1); \
+	m0 = _mm_add_epi32(m0, _mm_alignr_epi8(m3, m2, 4)); \
+	m0 = _mm_sha256msg2_epu32(m0, m3); \
+} while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void sha256_transform_sha(WORD state[8], const BYTE data[], size_t nblocks)
 {
-	WORD a, b, c, d, e, f, g, h, i, j, t1, t2, m[64];
-
-	for (i = 0, j = 0; i < 16; ++i, j += 4)
-		m[i] = (data[j] << 24) | (data[j + 1] << 16) | (data[j + 2] << 8) | (data[j + 3]);
-	for ( ; i < 64; ++i)
-		m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
-
-	a = ctx->state[0];
-	b = ctx->state[1];
-	c = ctx->state[2];
-	d = ctx->state[3];
-	e = ctx->state[4];
-	f = ctx->state[5];
-	g = ctx->state[6];
-	h = ctx->state[7];
-
-	for (i = 0; i < 64; ++i) {
-		t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[i];
-		t2 = EP0(a) + MAJ(a,b,c);
-		h = g;
-		g = f;
-		f = e;
-		e = d + t1;
-		d = c;
-		c = b;
-		b = a;
-		a = t1 + t2;
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, tmp, m0, m1, m2, m3, save0, save1;
+	int i;
+
+	/* Reorder ABCD EFGH into the ABEF CDGH of the instructions. */
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+	for (; nblocks > 0; --nblocks, data += 64) {
+		save0 = state0;
+		save1 = state1;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 0)), bswap);
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), bswap);
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), bswap);
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), bswap);
+
+		for (i = 0; i < 64; i += 16) {
+			SHA256_NI_ROUNDS4(i + 0, m0);
+			SHA256_NI_ROUNDS4(i + 4, m1);
+			SHA256_NI_ROUNDS4(i + 8, m2);
+			SHA256_NI_ROUNDS4(i + 12, m3);
+			if (i < 48) {
+				SHA256_NI_SCHEDULE(m0, m1, m2, m3);
+				SHA256_NI_SCHEDULE(m1, m2, m3, m0);
+				SHA256_NI_SCHEDULE(m2, m3, m0, m1);
+				SHA256_NI_SCHEDULE(m3, m0, m1, m2);
+			}
+		}
+
+		state0 = _mm_add_epi32(state0, save0);
+		state1 = _mm_add_epi32(state1, save1);
 	}
 
-	ctx->state[0] += a;
-	ctx->state[1] += b;
-	ctx->state[2] += c;
-	ctx->state[3] += d;
-	ctx->state[4] += e;
-	ctx->state[5] += f;
-	ctx->state[6] += g;
-	ctx->state[7] += h;
+	/* Back to ABCD EFGH. */
+	tmp = _mm_shuffle_epi32(state0, 0x1b);
+	state1 = _mm_shuffle_epi32(state1, 0xb1);
+	_mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xf0));
+	_mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+/* Returns true if the cpu has the SHA extensions, and the SSSE3 and SSE4.1
+ * instructions used with them. */
+static int sha256_has_sha_ni(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	__asm__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+	if (eax < 7)
+		return 0;
+	__asm__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+	if (!(ecx & (1 << 9)) || !(ecx & (1 << 19)))
+		return 0;
+	__asm__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+	return (ebx >> 29) & 1;
+}
+
+static void sha256_transform_detect(WORD state[8], const BYTE data[], size_t nblocks);
+static void (*sha256_transform_blocks)(WORD state[8], const BYTE data[], size_t nblocks) = sha256_transform_detect;
+
+static void sha256_transform_detect(WORD state[8], const BYTE data[], size_t nblocks)
+{
+	sha256_transform_blocks = sha256_has_sha_ni() ? sha256_transform_sha : sha256_transform_scalar;
+	sha256_transform_blocks(state, data, nblocks);
+}
+
+void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
+{
+	sha256_transform_blocks(ctx->state, data, 1);
 }
 
 void sha256_init(SHA256_CTX *ctx)
@@ -133,17 +246,35 @@ void sha256_init(SHA256_CTX *ctx)
 
 void sha256_update(SHA256_CTX *ctx, const BYTE data[], size_t len)
 {
-	WORD i;
+	size_t n;
 
-	for (i = 0; i < len; ++i) {
-		ctx->data[ctx->datalen] = data[i];
-		ctx->datalen++;
-		if (ctx->datalen == 64) {
-			sha256_transform(ctx, ctx->data);
-			ctx->bitlen += 512;
-			ctx->datalen = 0;
-		}
+	// Top up a partial block first.
+	if (ctx->datalen > 0) {
+		n = 64 - ctx->datalen;
+		if (n > len)
+			n = len;
+		memcpy(ctx->data + ctx->datalen, data, n);
+		ctx->datalen += n;
+		data += n;
+		len -= n;
+		if (ctx->datalen < 64)
+			return;
+		sha256_transform(ctx, ctx->data);
+		ctx->bitlen += 512;
+		ctx->datalen = 0;
+	}
+
+	// Hash the whole blocks in place.
+	n = len / 64;
+	if (n > 0) {
+		sha256_transform_blocks(ctx->state, data, n);
+		ctx->bitlen += 512ULL * n;
+		data += 64 * n;
+		len -= 64 * n;
 	}
+
+	memcpy(ctx->data, data, len);
+	ctx->datalen = len;
 }
 
 void sha256_final(SHA256_CTX *ctx, BYTE hash[])
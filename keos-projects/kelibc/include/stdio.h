@@ -13,6 +13,19 @@ int vhprintf (int, const char *, va_list) PRINTF_FORMAT (2, 0);
 /* Predefined file handles. */
 #define STDIN_FILENO 0
 #define STDOUT_FILENO 1
+#define STDERR_FILENO 2
+
+/* Buffered output streams. */
+typedef struct FILE FILE;
+extern FILE *stdout;
+extern FILE *stderr;
+
+/* Buffering modes for setvbuf(). */
+#define _IOFBF 0            /* Fully buffered. */
+#define _IOLBF 1            /* Line buffered. */
+#define _IONBF 2            /* Unbuffered. */
+
+#define BUFSIZ 4096
 
 #define EOF (-1)
 
@@ -28,6 +41,17 @@ int vprintf (const char *, va_list) PRINTF_FORMAT (1, 0);
 int vsnprintf (char *, size_t, const char *, va_list) PRINTF_FORMAT (3, 0);
 int putchar (int);
 int puts (const char *);
+int fprintf (FILE *, const char *, ...) PRINTF_FORMAT (2, 3);
+int vfprintf (FILE *, const char *, va_list) PRINTF_FORMAT (2, 0);
+int fputc (int, FILE *);
+int fputs (const char *, FILE *);
+size_t fwrite (const void *, size_t, size_t, FILE *);
+int fflush (FILE *);
+int setvbuf (FILE *, char *, int, size_t);
+
+/* Used by fork() to keep the streams consistent in the child. */
+void __stdio_fork_prepare (void);
+void __stdio_fork_done (bool child);
 
 /* Nonstandard functions. */
 void hex_dump (uintptr_t ofs, const void *, size_t size, bool ascii);
@@ -9,8 +9,15 @@ void qsort (void *array, size_t cnt, size_t size,
 		int (*compare) (const void *, const void *));
 void *bsearch (const void *key, const void *array, size_t cnt,
 		size_t size, int (*compare) (const void *, const void *));
+void *malloc (size_t);
+void *calloc (size_t, size_t);
+void *realloc (void *, size_t);
+void free (void *);
 
 /* Nonstandard functions. */
+void qsort_r (void *array, size_t cnt, size_t size,
+		int (*compare) (const void *, const void *, void *aux),
+		void *aux);
 void sort (void *array, size_t cnt, size_t size,
 		int (*compare) (const void *, const void *, void *aux),
 		void *aux);
@@ -22,6 +22,16 @@
 #define SYS_READDIR 18
 #define SYS_STAT 19
 #define SYS_FSYNC 20
+#define SYS_SET_NICE 21
+#define SYS_SET_AFFINITY 22
+#define SYS_FUTEX 23
+#define SYS_URING_ENTER 24
+#define SYS_READV 25
+#define SYS_WRITEV 26
+#define SYS_PREADV 27
+#define SYS_PWRITEV 28
+#define SYS_COPY_FILE_RANGE 29
+#define SYS_SPAWN 30
 
 /* Only used for Project 3 CoW grading */
 #define SYS_GETPHYS 0x81
@@ -65,6 +65,14 @@ syscall(uint64_t num_, uint64_t a1_, uint64_t a2_, uint64_t a3_, uint64_t a4_,
            ((uint64_t)ARG2), ((uint64_t)ARG3), ((uint64_t)ARG4),               \
            ((uint64_t)ARG5)))
 
+/* A buffer of the vectored I/O. */
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+
+#define IOV_MAX 1024
+
 void exit(int exitcode);
 ssize_t open(const char *pathname, int flags);
 ssize_t read(int fd, const void *buf, size_t count);
@@ -87,5 +95,15 @@ int chdir(char *name);
 int readdir(int fd, struct dirent *dirents, int size);
 int stat(const char* pathname, struct stat *stat);
 int fsync(int fd);
+int set_nice(int nice);
+int set_affinity(unsigned long mask);
+int futex(int *uaddr, int op, int val, int *uaddr2, int val2);
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out,
+                        size_t len, unsigned int flags);
+int spawn(const char *path, char *const argv[]);
 
 #endif /* lib/user/syscall.h */
\ No newline at end of file
@@ -1,6 +1,39 @@
 #ifndef __LIB_THREAD_H
 #define __LIB_THREAD_H
 
+#include <stdbool.h>
+
 #define STACK_SIZE 0x4000
 
-#endif /* lib/thread.h */
\ No newline at end of file
+/* Futex operations. */
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+#define FUTEX_REQUEUE 3
+
+/* A mutex that only enters the kernel when contended.
+   STATE is 0 if unlocked, 1 if locked, and 2 if locked with waiters. */
+struct mutex {
+  int state;
+};
+
+#define MUTEX_INITIALIZER {0}
+
+void mutex_init(struct mutex *m);
+void mutex_lock(struct mutex *m);
+bool mutex_trylock(struct mutex *m);
+void mutex_unlock(struct mutex *m);
+
+/* A condition variable. SEQ is bumped on every signal. */
+struct condvar {
+  int seq;
+  struct mutex *mutex;
+};
+
+#define CONDVAR_INITIALIZER {0, 0}
+
+void cond_init(struct condvar *cv);
+void cond_wait(struct condvar *cv, struct mutex *m);
+void cond_signal(struct condvar *cv);
+void cond_broadcast(struct condvar *cv);
+
+#endif /* lib/thread.h */
@@ -0,0 +1,55 @@
+#ifndef __LIB_URING_H
+#define __LIB_URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A submission/completion ring for batching system calls.
+   Fill submissions with uring_get_sqe() or the uring_prep_*() helpers, run
+   them all with a single uring_submit(), then reap the results with
+   uring_peek_cqe(). */
+
+struct uring_header {
+  uint32_t sq_head;
+  uint32_t sq_tail;
+  uint32_t cq_head;
+  uint32_t cq_tail;
+  uint32_t entries;
+};
+
+struct uring_sqe {
+  uint64_t sysno;
+  uint64_t args[6];
+  uint64_t user_data;
+};
+
+struct uring_cqe {
+  uint64_t user_data;
+  int64_t res;
+};
+
+struct uring {
+  struct uring_header *hdr;
+  struct uring_sqe *sqes;
+  struct uring_cqe *cqes;
+};
+
+#define URING_SQES_OFFSET 64
+#define URING_MAX_ENTRIES 4096
+
+/* Bytes of memory needed by a ring of ENTRIES entries. */
+#define URING_SIZE(entries)                                                    \
+  (URING_SQES_OFFSET +                                                         \
+   (entries) * (sizeof(struct uring_sqe) + sizeof(struct uring_cqe)))
+
+int uring_init(struct uring *r, void *mem, uint32_t entries);
+struct uring_sqe *uring_get_sqe(struct uring *r);
+void uring_prep_read(struct uring *r, int fd, void *buf, size_t count,
+                     uint64_t user_data);
+void uring_prep_write(struct uring *r, int fd, const void *buf, size_t count,
+                      uint64_t user_data);
+int uring_submit(struct uring *r);
+bool uring_peek_cqe(struct uring *r, struct uring_cqe *cqe);
+
+#endif /* lib/uring.h */
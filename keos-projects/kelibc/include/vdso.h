@@ -0,0 +1,36 @@
+#ifndef __LIB_VDSO_H
+#define __LIB_VDSO_H
+
+#include <stdint.h>
+
+/* The read-only page that the kernel maps into every process.
+   Must match the layout of keos::mm::vdso::VdsoData. */
+#define VDSO_ADDR 0x47500000UL
+#define VDSO_MAX_CPU 4
+
+struct vdso_cpu {
+  uint32_t seq;
+  uint32_t _pad;
+  uint64_t tid;
+} __attribute__((aligned(64)));
+
+struct vdso_data {
+  uint32_t version;
+  uint32_t _pad;
+  uint64_t tsc_khz;
+  uint64_t boot_tsc;
+  struct vdso_cpu cpus[VDSO_MAX_CPU];
+};
+
+#define CLOCK_MONOTONIC 1
+
+struct timespec {
+  int64_t tv_sec;
+  int64_t tv_nsec;
+};
+
+uint64_t vdso_clock_ns(void);
+int clock_gettime(int clk, struct timespec *ts);
+int64_t gettid(void);
+
+#endif /* lib/vdso.h */
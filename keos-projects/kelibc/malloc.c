@@ -0,0 +1,221 @@
+#include <debug.h>
+#include <mman.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include <thread.h>
+
+/* A size-class allocator on top of mmap.
+
+   A block of up to SMALL_MAX bytes, with its header, is rounded up to one of
+   NR_CLASSES size classes: multiples of 16 up to 128 bytes, then four classes
+   per power of two. Freed blocks are kept in a list per class, and new blocks
+   are cut from a bump region that is refilled CHUNK_SIZE bytes at a time, so
+   a small allocation does not enter the kernel. Larger blocks are mapped and
+   unmapped on their own.
+
+   The lists and the bump region belong to one of NR_ARENAS arenas, each with
+   its own lock. KeOS has no thread-local storage, so a thread picks its home
+   arena from the address of its stack, and moves to another arena only if the
+   home one is contended. A block goes back to the arena it came from, which
+   is recorded in its header.
+
+   KeOS does not choose the address of a mapping, so the heap takes its
+   addresses from [HEAP_BASE, HEAP_END), far from the program, the stack and
+   the addresses that the programs map themselves. */
+
+#define HEAP_BASE 0x100000000000ULL
+#define HEAP_END 0x200000000000ULL
+#define PAGE_SIZE 0x1000
+#define CHUNK_SIZE 0x100000
+
+#define NR_CLASSES 40
+#define SMALL_MAX 32768
+#define NR_ARENAS 8
+
+/* Arena of the blocks that are mapped on their own. */
+#define HUGE NR_ARENAS
+
+/* Precedes every block, and keeps the blocks 16-byte aligned. */
+struct header {
+  uint32_t arena;
+  uint32_t class;
+  /* Length of the mapping of a huge block. */
+  size_t length;
+};
+
+struct free_block {
+  struct free_block *next;
+};
+
+struct arena {
+  struct mutex lock;
+  struct free_block *free[NR_CLASSES];
+  char *bump, *end;
+} __attribute__((aligned(64)));
+
+static struct arena arenas[NR_ARENAS];
+static uintptr_t heap_next = HEAP_BASE;
+
+/* Returns the size of CLASS, header included. */
+static size_t class_size(int class) {
+  if (class < 8)
+    return 16 * (class + 1);
+  size_t base = (size_t)128 << ((class - 8) / 4);
+  return base + base / 4 * ((class - 8) % 4 + 1);
+}
+
+/* Returns the smallest class that holds SIZE bytes, header included. */
+static int size_class(size_t size) {
+  if (size <= 128)
+    return size ? (size + 15) / 16 - 1 : 0;
+  size_t s = size - 1;
+  int msb = 63 - __builtin_clzll(s);
+  size_t base = (size_t)1 << msb;
+  return 8 + (msb - 7) * 4 + (s - base) / (base / 4);
+}
+
+/* Maps LENGTH bytes at fresh heap addresses. Returns NULL on failure. */
+static void *map_pages(size_t length) {
+  /* Skip over the addresses that the program mapped by itself. */
+  for (int tries = 0; tries < 16; tries++) {
+    uintptr_t addr = __atomic_fetch_add(&heap_next, length, __ATOMIC_RELAXED);
+    if (addr + length > HEAP_END)
+      return NULL;
+    if (mmap((void *)addr, length, PROT_READ | PROT_WRITE, -1, 0) ==
+        (void *)addr)
+      return (void *)addr;
+  }
+  return NULL;
+}
+
+/* Locks and returns an arena for the current thread. */
+static struct arena *arena_get(void) {
+  uintptr_t sp = (uintptr_t)__builtin_frame_address(0);
+  int home = sp / STACK_SIZE % NR_ARENAS;
+
+  for (int i = 0; i < NR_ARENAS; i++) {
+    struct arena *a = &arenas[(home + i) % NR_ARENAS];
+    if (mutex_trylock(&a->lock))
+      return a;
+  }
+  mutex_lock(&arenas[home].lock);
+  return &arenas[home];
+}
+
+/* Allocates a block of CLASS from A, which is locked. */
+static struct header *arena_alloc(struct arena *a, int class) {
+  struct free_block *b = a->free[class];
+  if (b) {
+    a->free[class] = b->next;
+    return (struct header *)b;
+  }
+
+  size_t size = class_size(class);
+  if (a->end - a->bump < (ptrdiff_t)size) {
+    /* The rest of the old region is lost; it is smaller than the block. */
+    char *chunk = map_pages(CHUNK_SIZE);
+    if (!chunk)
+      return NULL;
+    a->bump = chunk;
+    a->end = chunk + CHUNK_SIZE;
+  }
+  struct header *h = (struct header *)a->bump;
+  a->bump += size;
+  return h;
+}
+
+/* Obtains and returns a new block of at least SIZE bytes. Returns a null
+   pointer if there is no memory left. */
+void *malloc(size_t size) {
+  struct header *h;
+
+  if (size > SMALL_MAX - sizeof(struct header)) {
+    if (size > HEAP_END - HEAP_BASE)
+      return NULL;
+    size_t length = (size + sizeof(struct header) + PAGE_SIZE - 1) &
+                    ~(size_t)(PAGE_SIZE - 1);
+    h = map_pages(length);
+    if (!h)
+      return NULL;
+    h->arena = HUGE;
+    h->length = length;
+    return h + 1;
+  }
+
+  int class = size_class(size + sizeof(struct header));
+  struct arena *a = arena_get();
+  h = arena_alloc(a, class);
+  if (h) {
+    h->arena = a - arenas;
+    h->class = class;
+  }
+  mutex_unlock(&a->lock);
+  return h ? h + 1 : NULL;
+}
+
+/* Allocates and returns a zeroed block of CNT elements of SIZE bytes each.
+   Returns a null pointer on overflow or if there is no memory left. */
+void *calloc(size_t cnt, size_t size) {
+  size_t total;
+  if (__builtin_mul_overflow(cnt, size, &total))
+    return NULL;
+
+  void *p = malloc(total);
+  if (p)
+    memset(p, 0, total);
+  return p;
+}
+
+/* Returns the number of bytes usable in the block of H. */
+static size_t block_size(struct header *h) {
+  size_t size = h->arena == HUGE ? h->length : class_size(h->class);
+  return size - sizeof(struct header);
+}
+
+/* Changes the size of the block at OLD to NEW_SIZE bytes, possibly moving it.
+   Returns the new block, or a null pointer on failure, in which case OLD is
+   left untouched. A null OLD is the same as malloc(NEW_SIZE), and a zero
+   NEW_SIZE is the same as free(OLD). */
+void *realloc(void *old, size_t new_size) {
+  if (!old)
+    return malloc(new_size);
+  if (new_size == 0) {
+    free(old);
+    return NULL;
+  }
+
+  size_t old_size = block_size((struct header *)old - 1);
+  if (new_size <= old_size)
+    return old;
+
+  void *new = malloc(new_size);
+  if (new) {
+    memcpy(new, old, old_size);
+    free(old);
+  }
+  return new;
+}
+
+/* Frees block P, which must have been allocated with malloc, calloc or
+   realloc. A null P is ignored. */
+void free(void *p) {
+  if (!p)
+    return;
+
+  struct header *h = (struct header *)p - 1;
+  if (h->arena == HUGE) {
+    munmap(h);
+    return;
+  }
+
+  ASSERT(h->arena < NR_ARENAS && h->class < NR_CLASSES);
+  struct arena *a = &arenas[h->arena];
+  int class = h->class;
+  struct free_block *b = (struct free_block *)h;
+  mutex_lock(&a->lock);
+  b->next = a->free[class];
+  a->free[class] = b;
+  mutex_unlock(&a->lock);
+}
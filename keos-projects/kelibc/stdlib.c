@@ -2,6 +2,7 @@
 #include <debug.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /* Converts a string representation of a signed decimal integer
    in S into an `int', which is returned. */
@@ -51,7 +52,7 @@ compare_thunk (const void *a, const void *b, void *aux)
    using COMPARE.  When COMPARE is passed a pair of elements A
    and B, respectively, it must return a strcmp()-type result,
    i.e. less than zero if A < B, zero if A == B, greater than
-   zero if A > B.  Runs in O(n lg n) time and O(1) space in
+   zero if A > B.  Runs in O(n lg n) time and O(lg n) space in
    CNT. */
 void
 qsort (void *array, size_t cnt, size_t size,
@@ -60,42 +61,145 @@ qsort (void *array, size_t cnt, size_t size,
   sort (array, cnt, size, compare_thunk, &compare);
 }
 
-/* Swaps elements with 1-based indexes A_IDX and B_IDX in ARRAY
-   with elements of SIZE bytes each. */
+/* Like qsort(), but passes AUX as auxiliary data to COMPARE. */
+void
+qsort_r (void *array, size_t cnt, size_t size,
+         int (*compare) (const void *, const void *, void *aux),
+         void *aux) 
+{
+  sort (array, cnt, size, compare, aux);
+}
+
+/* sort() is a pattern-defeating quicksort (pdqsort):
+
+   - Runs of up to INSERTION_SORT_MAX elements are insertion
+     sorted.
+   - The pivot is the median of 3 elements, or of 3 medians of 3
+     for runs longer than NINTHER_MIN.  A pivot equal to the
+     element that precedes the run, which is never less than
+     any element of the run, starts a partition that gathers
+     the elements equal to it, so that runs of equal elements
+     take linear time.
+   - A partition that swaps no element suggests that the run is
+     already sorted, and a bounded insertion sort is tried
+     before recursing.
+   - A highly unbalanced partition swaps a few elements around
+     to break the pattern that caused it.  After lg n of them,
+     the run is heapsorted, which bounds the worst case to
+     O(n lg n).
+
+   Elements are swapped a word at a time when their size and
+   alignment allow. */
+
+#define INSERTION_SORT_MAX 24
+#define NINTHER_MIN 128
+#define PARTIAL_INSERTION_LIMIT 8
+
+/* A sort in progress. */
+struct sort_ctx
+  {
+    unsigned char *array;       /* Elements. */
+    size_t size;                /* Size of an element. */
+    size_t words;               /* Size of an element in words, or 0. */
+    int (*compare) (const void *, const void *, void *aux);
+    void *aux;
+  };
+
+/* Returns the address of element I of CTX. */
+static inline unsigned char *
+elem (const struct sort_ctx *ctx, size_t i) 
+{
+  return ctx->array + i * ctx->size;
+}
+
+/* Compares elements A and B of CTX, and returns a strcmp()-type
+   result. */
+static inline int
+cmp (const struct sort_ctx *ctx, size_t a, size_t b) 
+{
+  return ctx->compare (elem (ctx, a), elem (ctx, b), ctx->aux);
+}
+
+/* Swaps elements A and B of CTX. */
 static void
-do_swap (unsigned char *array, size_t a_idx, size_t b_idx, size_t size)
+swap (const struct sort_ctx *ctx, size_t a_idx, size_t b_idx)
 {
-  unsigned char *a = array + (a_idx - 1) * size;
-  unsigned char *b = array + (b_idx - 1) * size;
-  size_t i;
+  if (ctx->words != 0)
+    {
+      uint64_t *a = (uint64_t *) elem (ctx, a_idx);
+      uint64_t *b = (uint64_t *) elem (ctx, b_idx);
+      size_t i;
 
-  for (i = 0; i < size; i++)
+      for (i = 0; i < ctx->words; i++)
+        {
+          uint64_t t = a[i];
+          a[i] = b[i];
+          b[i] = t;
+        }
+    }
+  else
     {
-      unsigned char t = a[i];
-      a[i] = b[i];
-      b[i] = t;
+      unsigned char *a = elem (ctx, a_idx);
+      unsigned char *b = elem (ctx, b_idx);
+      size_t i;
+
+      for (i = 0; i < ctx->size; i++)
+        {
+          unsigned char t = a[i];
+          a[i] = b[i];
+          b[i] = t;
+        }
     }
 }
 
-/* Compares elements with 1-based indexes A_IDX and B_IDX in
-   ARRAY with elements of SIZE bytes each, using COMPARE to
-   compare elements, passing AUX as auxiliary data, and returns a
-   strcmp()-type result. */
-static int
-do_compare (unsigned char *array, size_t a_idx, size_t b_idx, size_t size,
-            int (*compare) (const void *, const void *, void *aux),
-            void *aux) 
+/* Sorts the elements A, B and C of CTX. */
+static void
+sort3 (const struct sort_ctx *ctx, size_t a, size_t b, size_t c) 
 {
-  return compare (array + (a_idx - 1) * size, array + (b_idx - 1) * size, aux);
+  if (cmp (ctx, b, a) < 0)
+    swap (ctx, a, b);
+  if (cmp (ctx, c, b) < 0)
+    {
+      swap (ctx, b, c);
+      if (cmp (ctx, b, a) < 0)
+        swap (ctx, a, b);
+    }
 }
 
-/* "Float down" the element with 1-based index I in ARRAY of CNT
-   elements of SIZE bytes each, using COMPARE to compare
-   elements, passing AUX as auxiliary data. */
+/* Insertion sorts the CNT elements of CTX from FIRST. */
 static void
-heapify (unsigned char *array, size_t i, size_t cnt, size_t size,
-         int (*compare) (const void *, const void *, void *aux),
-         void *aux) 
+insertion_sort (const struct sort_ctx *ctx, size_t first, size_t cnt) 
+{
+  size_t i, j;
+
+  for (i = first + 1; i < first + cnt; i++)
+    for (j = i; j > first && cmp (ctx, j, j - 1) < 0; j--)
+      swap (ctx, j, j - 1);
+}
+
+/* Like insertion_sort(), but gives up and returns false once
+   more than PARTIAL_INSERTION_LIMIT elements have moved. */
+static bool
+partial_insertion_sort (const struct sort_ctx *ctx, size_t first,
+                        size_t cnt) 
+{
+  size_t i, j, moves = 0;
+
+  for (i = first + 1; i < first + cnt; i++)
+    {
+      if (moves > PARTIAL_INSERTION_LIMIT)
+        return false;
+      for (j = i; j > first && cmp (ctx, j, j - 1) < 0; j--)
+        swap (ctx, j, j - 1);
+      moves += i - j;
+    }
+  return true;
+}
+
+/* "Float down" the element with 1-based index I in the heap of
+   CNT elements of CTX from FIRST. */
+static void
+heapify (const struct sort_ctx *ctx, size_t first, size_t i, size_t cnt) 
 {
   for (;;) 
     {
@@ -104,10 +208,9 @@ heapify (unsigned char *array, size_t i, size_t cnt, size_t size,
       size_t left = 2 * i;
       size_t right = 2 * i + 1;
       size_t max = i;
-      if (left <= cnt && do_compare (array, left, max, size, compare, aux) > 0)
+      if (left <= cnt && cmp (ctx, first + left - 1, first + max - 1) > 0)
         max = left;
-      if (right <= cnt
-          && do_compare (array, right, max, size, compare, aux) > 0) 
+      if (right <= cnt && cmp (ctx, first + right - 1, first + max - 1) > 0) 
         max = right;
 
       /* If the maximum value is already in element I, we're
@@ -116,38 +219,219 @@ heapify (unsigned char *array, size_t i, size_t cnt, size_t size,
         break;
 
       /* Swap and continue down the heap. */
-      do_swap (array, i, max, size);
+      swap (ctx, first + i - 1, first + max - 1);
       i = max;
     }
 }
 
+/* Heapsorts the CNT elements of CTX from FIRST. */
+static void
+heap_sort (const struct sort_ctx *ctx, size_t first, size_t cnt) 
+{
+  size_t i;
+
+  /* Build a heap. */
+  for (i = cnt / 2; i > 0; i--)
+    heapify (ctx, first, i, cnt);
+
+  /* Sort the heap. */
+  for (i = cnt; i > 1; i--) 
+    {
+      swap (ctx, first, first + i - 1);
+      heapify (ctx, first, 1, i - 1); 
+    }
+}
+
+/* Partitions the elements [FIRST, LAST) of CTX around the pivot
+   at FIRST, into the elements less than the pivot, the pivot,
+   and the others.  Returns the index of the pivot, and sets
+   *ALREADY_PARTITIONED if no element had to be swapped.
+
+   An element not less than the pivot must follow it. */
+static size_t
+partition_right (const struct sort_ctx *ctx, size_t first, size_t last,
+                 bool *already_partitioned) 
+{
+  size_t begin = first;
+  size_t pivot;
+
+  /* Find the first element not less than the pivot, and the
+     last element less than it. */
+  while (cmp (ctx, ++first, begin) < 0)
+    continue;
+  if (first - 1 == begin)
+    while (first < last && cmp (ctx, --last, begin) >= 0)
+      continue;
+  else
+    while (cmp (ctx, --last, begin) >= 0)
+      continue;
+
+  *already_partitioned = first >= last;
+  while (first < last) 
+    {
+      swap (ctx, first, last);
+      while (cmp (ctx, ++first, begin) < 0)
+        continue;
+      while (cmp (ctx, --last, begin) >= 0)
+        continue;
+    }
+
+  pivot = first - 1;
+  swap (ctx, begin, pivot);
+  return pivot;
+}
+
+/* Partitions the elements [FIRST, LAST) of CTX around the pivot
+   at FIRST, into the pivot with the elements equal to it, and
+   the elements greater than it.  Returns the index of the pivot.
+
+   The caller knows that no element is less than the pivot. */
+static size_t
+partition_left (const struct sort_ctx *ctx, size_t first, size_t last) 
+{
+  size_t begin = first;
+  size_t end = last;
+
+  while (cmp (ctx, begin, --last) < 0)
+    continue;
+  if (last + 1 == end)
+    while (first < last && cmp (ctx, begin, ++first) >= 0)
+      continue;
+  else
+    while (cmp (ctx, begin, ++first) >= 0)
+      continue;
+
+  while (first < last) 
+    {
+      swap (ctx, first, last);
+      while (cmp (ctx, begin, --last) < 0)
+        continue;
+      while (cmp (ctx, begin, ++first) >= 0)
+        continue;
+    }
+
+  swap (ctx, begin, last);
+  return last;
+}
+
+/* Sorts the elements [FIRST, LAST) of CTX.  BAD_ALLOWED is the
+   number of unbalanced partitions left before heapsort.
+   LEFTMOST is false if the element before FIRST is not greater
+   than any element of the run. */
+static void
+pdqsort (const struct sort_ctx *ctx, size_t first, size_t last,
+         int bad_allowed, bool leftmost) 
+{
+  for (;;) 
+    {
+      size_t cnt = last - first;
+      size_t half = cnt / 2;
+      size_t pivot, l_cnt, r_cnt;
+      bool already_partitioned;
+
+      if (cnt <= INSERTION_SORT_MAX)
+        {
+          insertion_sort (ctx, first, cnt);
+          return;
+        }
+
+      /* Move the pivot to FIRST. */
+      if (cnt > NINTHER_MIN)
+        {
+          sort3 (ctx, first, first + half, last - 1);
+          sort3 (ctx, first + 1, first + half - 1, last - 2);
+          sort3 (ctx, first + 2, first + half + 1, last - 3);
+          sort3 (ctx, first + half - 1, first + half, first + half + 1);
+          swap (ctx, first, first + half);
+        }
+      else
+        sort3 (ctx, first + half, first, last - 1);
+
+      /* The pivot equals the element before the run, so no
+         element of the run is less than it.  Put the elements
+         equal to it aside. */
+      if (!leftmost && cmp (ctx, first - 1, first) >= 0)
+        {
+          first = partition_left (ctx, first, last) + 1;
+          continue;
+        }
+
+      pivot = partition_right (ctx, first, last, &already_partitioned);
+      l_cnt = pivot - first;
+      r_cnt = last - (pivot + 1);
+
+      if (l_cnt < cnt / 8 || r_cnt < cnt / 8)
+        {
+          if (--bad_allowed == 0)
+            {
+              heap_sort (ctx, first, cnt);
+              return;
+            }
+          if (l_cnt >= INSERTION_SORT_MAX)
+            {
+              swap (ctx, first, first + l_cnt / 4);
+              swap (ctx, pivot - 1, pivot - l_cnt / 4);
+              if (l_cnt > NINTHER_MIN)
+                {
+                  swap (ctx, first + 1, first + l_cnt / 4 + 1);
+                  swap (ctx, first + 2, first + l_cnt / 4 + 2);
+                  swap (ctx, pivot - 2, pivot - (l_cnt / 4 + 1));
+                  swap (ctx, pivot - 3, pivot - (l_cnt / 4 + 2));
+                }
+            }
+          if (r_cnt >= INSERTION_SORT_MAX)
+            {
+              swap (ctx, pivot + 1, pivot + 1 + r_cnt / 4);
+              swap (ctx, last - 1, last - r_cnt / 4);
+              if (r_cnt > NINTHER_MIN)
+                {
+                  swap (ctx, pivot + 2, pivot + 2 + r_cnt / 4);
+                  swap (ctx, pivot + 3, pivot + 3 + r_cnt / 4);
+                  swap (ctx, last - 2, last - (1 + r_cnt / 4));
+                  swap (ctx, last - 3, last - (2 + r_cnt / 4));
+                }
+            }
+        }
+      else if (already_partitioned
+               && partial_insertion_sort (ctx, first, l_cnt)
+               && partial_insertion_sort (ctx, pivot + 1, r_cnt))
+        return;
+
+      /* Recurse into the left run, and loop on the right one. */
+      pdqsort (ctx, first, pivot, bad_allowed, leftmost);
+      first = pivot + 1;
+      leftmost = false;
+    }
+}
+
 /* Sorts ARRAY, which contains CNT elements of SIZE bytes each,
    using COMPARE to compare elements, passing AUX as auxiliary
    data.  When COMPARE is passed a pair of elements A and B,
    respectively, it must return a strcmp()-type result, i.e. less
    than zero if A < B, zero if A == B, greater than zero if A >
-   B.  Runs in O(n lg n) time and O(1) space in CNT. */
+   B.  Runs in O(n lg n) time and O(lg n) space in CNT. */
 void
 sort (void *array, size_t cnt, size_t size,
       int (*compare) (const void *, const void *, void *aux),
       void *aux) 
 {
-  size_t i;
+  struct sort_ctx ctx;
+  int bad_allowed = 0;
 
   ASSERT (array != NULL || cnt == 0);
   ASSERT (compare != NULL);
   ASSERT (size > 0);
 
-  /* Build a heap. */
-  for (i = cnt / 2; i > 0; i--)
-    heapify (array, i, cnt, size, compare, aux);
+  ctx.array = array;
+  ctx.size = size;
+  ctx.words = size % 8 == 0 && (uintptr_t) array % 8 == 0 ? size / 8 : 0;
+  ctx.compare = compare;
+  ctx.aux = aux;
 
-  /* Sort the heap. */
-  for (i = cnt; i > 1; i--) 
-    {
-      do_swap (array, 1, i, size);
-      heapify (array, 1, i - 1, size, compare, aux); 
-    }
+  while (cnt >> bad_allowed > 1)
+    bad_allowed++;
+  if (cnt > 1)
+    pdqsort (&ctx, 0, cnt, bad_allowed, true);
 }
 
 /* Searches ARRAY, which contains CNT elements of SIZE bytes
@@ -3,8 +3,12 @@
 #include <syscall-nr.h>
 #include <syscall.h>
 #include <stddef.h>
+#include <stdio.h>
 
+/* The buffered output is written out before the process ends, and before a
+   new process is made, so that it is printed once and in order. */
 void exit(int exitcode) {
+  fflush(NULL);
   syscall1(SYS_EXIT, exitcode);
   __builtin_unreachable();
 }
@@ -14,6 +18,9 @@ ssize_t open(const char *pathname, int flags) {
 }
 
 ssize_t read(int fd, const void *buf, size_t count) {
+  /* Show a pending prompt before waiting for the answer. */
+  if (fd == STDIN_FILENO)
+    fflush(stdout);
   return syscall3(SYS_READ, fd, buf, count);
 }
 
@@ -36,7 +43,14 @@ void *mmap(void *addr, size_t length, int prot, int fd, off_t offset) {
 }
 
 int munmap(void *addr) { return syscall1(SYS_MUNMAP, addr); }
-int fork() { return syscall0(SYS_FORK); }
+int fork() {
+  int pid;
+
+  __stdio_fork_prepare();
+  pid = syscall0(SYS_FORK);
+  __stdio_fork_done(pid == 0);
+  return pid;
+}
 
 int thread_create(const char *name, void *stack, int (*fn)(void *), void *arg) {
   return syscall4(SYS_THREAD_CREATE, name, stack, fn, arg);
@@ -47,6 +61,7 @@ int thread_join(int thread_id, int *exitcode) {
 }
 
 void exit_group(int exitcode) {
+  fflush(NULL);
   syscall1(SYS_EXIT_GROUP, exitcode);
   __builtin_unreachable();
 }
@@ -61,6 +76,37 @@ int stat(const char* pathname, struct stat *stat) {
   return syscall2(SYS_STAT, pathname, stat);
 }
 int fsync(int fd) { return syscall1(SYS_FSYNC, fd); }
+int set_nice(int nice) { return syscall1(SYS_SET_NICE, nice); }
+int set_affinity(unsigned long mask) {
+  return syscall1(SYS_SET_AFFINITY, mask);
+}
+int futex(int *uaddr, int op, int val, int *uaddr2, int val2) {
+  return syscall5(SYS_FUTEX, uaddr, op, val, uaddr2, val2);
+}
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
+  if (fd == STDIN_FILENO)
+    fflush(stdout);
+  return syscall3(SYS_READV, fd, iov, iovcnt);
+}
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+  return syscall3(SYS_WRITEV, fd, iov, iovcnt);
+}
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+  return syscall4(SYS_PREADV, fd, iov, iovcnt, offset);
+}
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+  return syscall4(SYS_PWRITEV, fd, iov, iovcnt, offset);
+}
+ssize_t copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out,
+                        size_t len, unsigned int flags) {
+  return syscall6(SYS_COPY_FILE_RANGE, fd_in, off_in, fd_out, off_out, len,
+                  flags);
+}
+
+int spawn(const char *path, char *const argv[]) {
+  fflush(NULL);
+  return syscall2(SYS_SPAWN, path, argv);
+}
 
 /* "virtual" system call */
 ssize_t getrandom(void *buf, size_t buflen, unsigned int flags) {
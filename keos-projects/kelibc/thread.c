@@ -0,0 +1,69 @@
+#include <limits.h>
+#include <stdbool.h>
+#include <syscall.h>
+#include <thread.h>
+
+void mutex_init(struct mutex *m) { m->state = 0; }
+
+static int cmpxchg(int *p, int old, int new) {
+  __atomic_compare_exchange_n(p, &old, new, false, __ATOMIC_ACQUIRE,
+                              __ATOMIC_RELAXED);
+  return old;
+}
+
+/* Acquires M. The fast path is a single compare-and-swap. */
+void mutex_lock(struct mutex *m) {
+  int c = cmpxchg(&m->state, 0, 1);
+  if (c == 0)
+    return;
+  /* Contended. Mark the waiters, and sleep until the owner releases. */
+  if (c != 2)
+    c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+  while (c != 0) {
+    futex(&m->state, FUTEX_WAIT, 2, NULL, 0);
+    c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+  }
+}
+
+bool mutex_trylock(struct mutex *m) { return cmpxchg(&m->state, 0, 1) == 0; }
+
+/* Releases M. Enters the kernel only if there may be waiters. */
+void mutex_unlock(struct mutex *m) {
+  if (__atomic_fetch_sub(&m->state, 1, __ATOMIC_RELEASE) != 1) {
+    __atomic_store_n(&m->state, 0, __ATOMIC_RELEASE);
+    futex(&m->state, FUTEX_WAKE, 1, NULL, 0);
+  }
+}
+
+void cond_init(struct condvar *cv) {
+  cv->seq = 0;
+  cv->mutex = NULL;
+}
+
+/* Atomically releases M and waits for CV to be signaled. M is held again on
+   return. Spurious wakeups are possible. */
+void cond_wait(struct condvar *cv, struct mutex *m) {
+  int seq = __atomic_load_n(&cv->seq, __ATOMIC_RELAXED);
+  __atomic_store_n(&cv->mutex, m, __ATOMIC_RELAXED);
+  mutex_unlock(m);
+  futex(&cv->seq, FUTEX_WAIT, seq, NULL, 0);
+  /* Others may be requeued onto M, so take it as contended. */
+  while (__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0)
+    futex(&m->state, FUTEX_WAIT, 2, NULL, 0);
+}
+
+void cond_signal(struct condvar *cv) {
+  __atomic_fetch_add(&cv->seq, 1, __ATOMIC_RELEASE);
+  futex(&cv->seq, FUTEX_WAKE, 1, NULL, 0);
+}
+
+/* Wakes one waiter, and moves the others onto the mutex so that they are
+   woken one by one on unlock. */
+void cond_broadcast(struct condvar *cv) {
+  struct mutex *m = __atomic_load_n(&cv->mutex, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&cv->seq, 1, __ATOMIC_RELEASE);
+  if (m)
+    futex(&cv->seq, FUTEX_REQUEUE, 1, &m->state, INT_MAX);
+  else
+    futex(&cv->seq, FUTEX_WAKE, INT_MAX, NULL, 0);
+}
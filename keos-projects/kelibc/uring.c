@@ -0,0 +1,74 @@
+#include <string.h>
+#include <syscall-nr.h>
+#include <syscall.h>
+#include <uring.h>
+
+/* Set up a ring of ENTRIES entries, a power of two, in MEM, which must hold
+   URING_SIZE(ENTRIES) bytes. */
+int uring_init(struct uring *r, void *mem, uint32_t entries) {
+  if (entries == 0 || entries > URING_MAX_ENTRIES ||
+      (entries & (entries - 1)) != 0)
+    return -22;
+  memset(mem, 0, URING_SIZE(entries));
+  r->hdr = mem;
+  r->hdr->entries = entries;
+  r->sqes = (struct uring_sqe *)((char *)mem + URING_SQES_OFFSET);
+  r->cqes = (struct uring_cqe *)(r->sqes + entries);
+  return 0;
+}
+
+/* Returns the next free submission slot, or NULL if the queue is full.
+   The slot is queued by the next uring_submit(). */
+struct uring_sqe *uring_get_sqe(struct uring *r) {
+  uint32_t head = __atomic_load_n(&r->hdr->sq_head, __ATOMIC_ACQUIRE);
+  uint32_t tail = r->hdr->sq_tail;
+  if (tail - head >= r->hdr->entries)
+    return NULL;
+  struct uring_sqe *sqe = &r->sqes[tail & (r->hdr->entries - 1)];
+  memset(sqe, 0, sizeof(*sqe));
+  __atomic_store_n(&r->hdr->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+static void prep(struct uring *r, uint64_t sysno, uint64_t a1, uint64_t a2,
+                 uint64_t a3, uint64_t user_data) {
+  struct uring_sqe *sqe = uring_get_sqe(r);
+  if (sqe == NULL) {
+    uring_submit(r);
+    sqe = uring_get_sqe(r);
+  }
+  sqe->sysno = sysno;
+  sqe->args[0] = a1;
+  sqe->args[1] = a2;
+  sqe->args[2] = a3;
+  sqe->user_data = user_data;
+}
+
+/* Queue a read(2). Submits the pending entries first if the queue is full. */
+void uring_prep_read(struct uring *r, int fd, void *buf, size_t count,
+                     uint64_t user_data) {
+  prep(r, SYS_READ, fd, (uint64_t)buf, count, user_data);
+}
+
+/* Queue a write(2). Submits the pending entries first if the queue is full. */
+void uring_prep_write(struct uring *r, int fd, const void *buf, size_t count,
+                      uint64_t user_data) {
+  prep(r, SYS_WRITE, fd, (uint64_t)buf, count, user_data);
+}
+
+/* Run every queued submission with a single system call.
+   Returns the number of the consumed submissions. */
+int uring_submit(struct uring *r) {
+  uint32_t pending = r->hdr->sq_tail - r->hdr->sq_head;
+  return syscall2(SYS_URING_ENTER, r->hdr, pending);
+}
+
+/* Pop a completion into CQE. Returns false if there is none. */
+bool uring_peek_cqe(struct uring *r, struct uring_cqe *cqe) {
+  uint32_t head = r->hdr->cq_head;
+  if (head == __atomic_load_n(&r->hdr->cq_tail, __ATOMIC_ACQUIRE))
+    return false;
+  *cqe = r->cqes[head & (r->hdr->entries - 1)];
+  __atomic_store_n(&r->hdr->cq_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
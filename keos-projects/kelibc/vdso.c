@@ -0,0 +1,50 @@
+#include <vdso.h>
+
+static inline const volatile struct vdso_data *vdso(void) {
+  return (const volatile struct vdso_data *)VDSO_ADDR;
+}
+
+static inline uint64_t rdtscp(uint32_t *cpu) {
+  uint32_t lo, hi, aux;
+  __asm__ volatile("rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux));
+  *cpu = aux;
+  return ((uint64_t)hi << 32) | lo;
+}
+
+/* Nanoseconds since boot, or 0 if the kernel does not expose the clock. */
+uint64_t vdso_clock_ns(void) {
+  uint64_t khz = vdso()->tsc_khz;
+  if (khz == 0)
+    return 0;
+  uint32_t cpu;
+  uint64_t delta = rdtscp(&cpu) - vdso()->boot_tsc;
+  /* Split to avoid overflowing delta * 1000000. */
+  return delta / khz * 1000000 + delta % khz * 1000000 / khz;
+}
+
+int clock_gettime(int clk, struct timespec *ts) {
+  if (clk != CLOCK_MONOTONIC || vdso()->tsc_khz == 0)
+    return -22;
+  uint64_t ns = vdso_clock_ns();
+  ts->tv_sec = ns / 1000000000;
+  ts->tv_nsec = ns % 1000000000;
+  return 0;
+}
+
+/* Tid of the calling thread. Retries if a context switch happens on the cpu
+   while reading. */
+int64_t gettid(void) {
+  for (;;) {
+    uint32_t cpu, cpu2;
+    rdtscp(&cpu);
+    if (cpu >= VDSO_MAX_CPU)
+      return -22;
+    const volatile struct vdso_cpu *pcpu = &vdso()->cpus[cpu];
+    uint32_t seq = __atomic_load_n(&pcpu->seq, __ATOMIC_ACQUIRE);
+    int64_t tid = pcpu->tid;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    rdtscp(&cpu2);
+    if (!(seq & 1) && seq == pcpu->seq && cpu == cpu2)
+      return tid;
+  }
+}
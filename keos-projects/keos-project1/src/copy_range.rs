@@ -0,0 +1,98 @@
+//! In-kernel copy between files.
+//!
+//! `copy_file_range` moves the data between two regular files with
+//! [`RegularFile::copy_range`], without going through the user memory.
+//!
+//! [`RegularFile::copy_range`]: keos::fs::RegularFile::copy_range
+
+use crate::{
+    file_struct::{File, FileDescriptor, FileKind, FileStruct},
+    syscall::SyscallAbi,
+};
+use keos::{
+    KernelError,
+    syscall::{
+        flags::FileMode,
+        uaccess::{UserPtrRO, UserPtrWO},
+    },
+};
+
+impl FileStruct {
+    /// Copies data between two open regular files inside the kernel.
+    ///
+    /// The data moves from the page cache of the source file to the
+    /// destination file without going through the user memory. If an offset
+    /// pointer is null, the copy starts at the file position and advances
+    /// it; otherwise, the copy starts at the pointed offset, which is
+    /// updated, and the file position is untouched.
+    ///
+    /// # Errors
+    /// - Returns [`KernelError::InvalidArgument`] if `flags` is not zero, if
+    ///   either file is not a [`FileKind::RegularFile`], or if the ranges of
+    ///   the same file overlap.
+    /// - Returns [`KernelError::BadFileDescriptor`] if either file descriptor
+    ///   is invalid, or is not opened for the required access.
+    ///
+    /// # Syscall API
+    /// ```c
+    /// ssize_t copy_file_range(int fd_in, off_t *off_in, int fd_out,
+    ///                         off_t *off_out, size_t len, unsigned int flags);
+    /// ```
+    ///
+    /// Returns the number of bytes copied, which is 0 at the end of the
+    /// source file.
+    pub fn copy_file_range(&mut self, abi: &SyscallAbi) -> Result<usize, KernelError> {
+        let (fd_in, off_in, fd_out, off_out) = (
+            FileDescriptor(abi.arg1 as i32),
+            abi.arg2,
+            FileDescriptor(abi.arg3 as i32),
+            abi.arg4,
+        );
+        if abi.arg6 != 0 {
+            return Err(KernelError::InvalidArgument);
+        }
+        let regular = |this: &Self, fd, is_write| match this.files.get(&fd) {
+            None => Err(KernelError::BadFileDescriptor),
+            Some(File { mode, .. })
+                if *mode
+                    == if is_write {
+                        FileMode::Read
+                    } else {
+                        FileMode::Write
+                    } =>
+            {
+                Err(KernelError::BadFileDescriptor)
+            }
+            Some(File {
+                file: FileKind::RegularFile { file, position },
+                ..
+            }) => Ok((file.clone(), *position)),
+            Some(_) => Err(KernelError::InvalidArgument),
+        };
+        let (src, src_pos) = regular(self, fd_in, false)?;
+        let (dst, dst_pos) = regular(self, fd_out, true)?;
+        let offset = |ptr: usize, position| match ptr {
+            0 => Ok(position),
+            ptr => Self::offset(UserPtrRO::<usize>::new(ptr).get()?),
+        };
+        let (pos_in, pos_out) = (offset(off_in, src_pos)?, offset(off_out, dst_pos)?);
+
+        let n = src.copy_range(pos_in, &dst, pos_out, abi.arg5)?;
+        if let Some(account) = keos::acct::current() {
+            account.count_read(n);
+            account.count_write(n);
+        }
+        for (fd, ptr, pos) in [(fd_in, off_in, pos_in), (fd_out, off_out, pos_out)] {
+            if ptr != 0 {
+                UserPtrWO::<usize>::new(ptr).put(pos + n)?;
+            } else if let Some(File {
+                file: FileKind::RegularFile { position, .. },
+                ..
+            }) = self.files.get_mut(&fd)
+            {
+                *position = pos + n;
+            }
+        }
+        Ok(n)
+    }
+}
@@ -107,8 +107,8 @@
 //! calls, you must update these file states accordingly, ensuring the correct
 //! file state is used for each operation. To store the mapping between file
 //! descriptor and [`FileKind`] state, KeOS utilizes `BTreeMap` provided by the
-//! [`alloc::collections`] module. You might refer to [`channel`] and
-//! [`teletype`] module for implementing stdio and channel I/O.
+//! [`alloc::collections`] module. You might refer to [`pipe`](keos::pipe) and
+//! [`teletype`] module for implementing stdio and pipe I/O.
 //!
 //! As mentioned before, kernel requires careful **error handling**. The kernel
 //! must properly ensuring that errors are reported in a stable and reliable
@@ -173,13 +173,13 @@
 
 use crate::syscall::SyscallAbi;
 use alloc::collections::BTreeMap;
+#[cfg(doc)]
+use keos::teletype;
 use keos::{
     KernelError,
     fs::{Directory, RegularFile},
     syscall::flags::FileMode,
 };
-#[cfg(doc)]
-use keos::{channel, teletype};
 
 /// The type of a file in the filesystem.
 ///
@@ -247,7 +247,9 @@ pub enum FileKind {
     ///
     /// This is useful for implementing features like pipes, message queues, or
     /// event notifications.
-    Rx(keos::channel::Receiver<u8>),
+    ///
+    /// The data is queued in page-sized chunks; see [`keos::pipe`].
+    Rx(keos::pipe::PipeReader),
     /// A transmit endpoint for interprocess communication (IPC).
     ///
     /// This variant represents a sending channel in an IPC mechanism. It serves
@@ -261,7 +263,7 @@ pub enum FileKind {
     ///
     /// This is commonly used in pipes, producer-consumer queues, and task
     /// synchronization mechanisms.
-    Tx(keos::channel::Sender<u8>),
+    Tx(keos::pipe::PipeWriter),
 }
 
 /// The [`File`] struct represents an abstraction over a file descriptor in the
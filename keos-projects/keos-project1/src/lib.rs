@@ -57,11 +57,14 @@ extern crate alloc;
 #[macro_use]
 extern crate keos;
 
+pub mod copy_range;
 pub mod file_struct;
 pub mod process;
 pub mod syscall;
+pub mod vectored;
 
-use keos::{KernelError, syscall::Registers, task::Task};
+use alloc::sync::Arc;
+use keos::{KernelError, acct::Account, syscall::Registers, task::Task};
 use syscall::SyscallAbi;
 
 pub use process::Process;
@@ -87,6 +90,16 @@ pub enum SyscallNumber {
     Close = 6,
     /// Create an interprocess communication channel.
     Pipe = 7,
+    /// Reads data from a file descriptor into several buffers.
+    Readv = 25,
+    /// Writes data from several buffers to a file descriptor.
+    Writev = 26,
+    /// Reads data at an offset of a file into several buffers.
+    Preadv = 27,
+    /// Writes data from several buffers at an offset of a file.
+    Pwritev = 28,
+    /// Copies data between two files inside the kernel.
+    CopyFileRange = 29,
 }
 
 impl TryFrom<usize> for SyscallNumber {
@@ -100,6 +113,11 @@ impl TryFrom<usize> for SyscallNumber {
             5 => Ok(SyscallNumber::Tell),
             6 => Ok(SyscallNumber::Close),
             7 => Ok(SyscallNumber::Pipe),
+            25 => Ok(SyscallNumber::Readv),
+            26 => Ok(SyscallNumber::Writev),
+            27 => Ok(SyscallNumber::Preadv),
+            28 => Ok(SyscallNumber::Pwritev),
+            29 => Ok(SyscallNumber::CopyFileRange),
             _ => Err(KernelError::NoSuchSyscall),
         }
     }
@@ -155,9 +173,18 @@ impl Task for Process {
             SyscallNumber::Tell => self.file_struct.tell(&abi),
             SyscallNumber::Close => self.file_struct.close(&abi),
             SyscallNumber::Pipe => self.file_struct.pipe(&abi),
+            SyscallNumber::Readv => self.file_struct.readv(&abi),
+            SyscallNumber::Writev => self.file_struct.writev(&abi),
+            SyscallNumber::Preadv => self.file_struct.preadv(&abi),
+            SyscallNumber::Pwritev => self.file_struct.pwritev(&abi),
+            SyscallNumber::CopyFileRange => self.file_struct.copy_file_range(&abi),
         });
         // Set the return value of the system call (success or error) back into the
         // registers.
         abi.set_return_value(return_val);
     }
+
+    fn account(&self) -> Option<Arc<Account>> {
+        Some(self.account.clone())
+    }
 }
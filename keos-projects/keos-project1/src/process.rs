@@ -3,9 +3,13 @@
 //! This file defines the process model of the project1.
 
 use crate::file_struct::FileStruct;
+use alloc::sync::Arc;
+use keos::acct::Account;
 
 /// A process state of project 1, which contains file state.
 #[derive(Default)]
 pub struct Process {
     pub file_struct: FileStruct,
+    /// The resource account of the process.
+    pub account: Arc<Account>,
 }
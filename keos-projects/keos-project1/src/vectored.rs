@@ -0,0 +1,194 @@
+//! Vectored I/O system calls.
+//!
+//! `readv`, `writev`, `preadv` and `pwritev` move the data of a file from or
+//! into several user buffers at once. They are built on the file states of
+//! [`FileStruct`]: a regular file is read or written with a single call of
+//! [`RegularFile::read_vectored`] or [`RegularFile::write_vectored`], and
+//! the other files with [`FileStruct::read`] and [`FileStruct::write`] for
+//! each buffer.
+//!
+//! [`RegularFile::read_vectored`]: keos::fs::RegularFile::read_vectored
+//! [`RegularFile::write_vectored`]: keos::fs::RegularFile::write_vectored
+
+use crate::{
+    file_struct::{FileDescriptor, FileKind, FileStruct},
+    syscall::SyscallAbi,
+};
+use keos::{
+    KernelError,
+    syscall::{
+        flags::FileMode,
+        uaccess::{IoVec, UserU8SliceRO, UserU8SliceWO},
+    },
+};
+
+/// Count the bytes moved to the account of the current process.
+fn count(is_write: bool, n: usize) {
+    if let Some(account) = keos::acct::current() {
+        if is_write {
+            account.count_write(n);
+        } else {
+            account.count_read(n);
+        }
+    }
+}
+
+impl FileStruct {
+    /// Reads data from an open file into several buffers.
+    ///
+    /// The buffers are filled in order, as if they were a single buffer, and
+    /// the file position is advanced by the bytes read. A regular file is
+    /// read in a single pass over all buffers; other files are read with
+    /// [`FileStruct::read`] for each buffer.
+    ///
+    /// # Syscall API
+    /// ```c
+    /// ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
+    /// ```
+    ///
+    /// Returns the total number of bytes read.
+    pub fn readv(&mut self, abi: &SyscallAbi) -> Result<usize, KernelError> {
+        self.vectored(abi, false, None)
+    }
+
+    /// Writes data from several buffers into an open file.
+    ///
+    /// The buffers are written in order, as if they were a single buffer, and
+    /// the file position is advanced by the bytes written.
+    ///
+    /// # Syscall API
+    /// ```c
+    /// ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
+    /// ```
+    ///
+    /// Returns the total number of bytes written.
+    pub fn writev(&mut self, abi: &SyscallAbi) -> Result<usize, KernelError> {
+        self.vectored(abi, true, None)
+    }
+
+    /// Reads data at the given offset of a regular file into several buffers,
+    /// without moving the file position.
+    ///
+    /// # Errors
+    /// - Returns [`KernelError::InvalidArgument`] if the specified file is not a
+    ///   [`FileKind::RegularFile`].
+    ///
+    /// # Syscall API
+    /// ```c
+    /// ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+    /// ```
+    ///
+    /// Returns the total number of bytes read.
+    pub fn preadv(&mut self, abi: &SyscallAbi) -> Result<usize, KernelError> {
+        self.vectored(abi, false, Some(Self::offset(abi.arg4)?))
+    }
+
+    /// Writes data from several buffers at the given offset of a regular file,
+    /// without moving the file position.
+    ///
+    /// # Errors
+    /// - Returns [`KernelError::InvalidArgument`] if the specified file is not a
+    ///   [`FileKind::RegularFile`].
+    ///
+    /// # Syscall API
+    /// ```c
+    /// ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+    /// ```
+    ///
+    /// Returns the total number of bytes written.
+    pub fn pwritev(&mut self, abi: &SyscallAbi) -> Result<usize, KernelError> {
+        self.vectored(abi, true, Some(Self::offset(abi.arg4)?))
+    }
+
+    pub(crate) fn offset(arg: usize) -> Result<usize, KernelError> {
+        if (arg as isize) < 0 {
+            Err(KernelError::InvalidArgument)
+        } else {
+            Ok(arg)
+        }
+    }
+
+    /// The body of the vectored I/O system calls.
+    ///
+    /// `offset` is the position of the positional variants, or `None` to use
+    /// and advance the file position.
+    fn vectored(
+        &mut self,
+        abi: &SyscallAbi,
+        is_write: bool,
+        offset: Option<usize>,
+    ) -> Result<usize, KernelError> {
+        let fd = FileDescriptor(abi.arg1 as i32);
+        let iovs = IoVec::read_array(abi.arg2, abi.arg3)?;
+        let file = self
+            .files
+            .get_mut(&fd)
+            .ok_or(KernelError::BadFileDescriptor)?;
+        let allowed = match file.mode {
+            FileMode::Read => !is_write,
+            FileMode::Write => is_write,
+            FileMode::ReadWrite => true,
+        };
+        if !allowed {
+            return Err(KernelError::BadFileDescriptor);
+        }
+        match &mut file.file {
+            FileKind::RegularFile { file, position } => {
+                let pos = offset.unwrap_or(*position);
+                let n = if is_write {
+                    file.write_vectored(
+                        pos,
+                        iovs.iter().map(|iov| UserU8SliceRO::new(iov.base, iov.len)),
+                    )?
+                } else {
+                    file.read_vectored(
+                        pos,
+                        iovs.iter().map(|iov| UserU8SliceWO::new(iov.base, iov.len)),
+                    )?
+                };
+                if offset.is_none() {
+                    *position += n;
+                }
+                count(is_write, n);
+                Ok(n)
+            }
+            FileKind::Directory { .. } => Err(KernelError::IsDirectory),
+            _ if offset.is_some() => Err(KernelError::InvalidArgument),
+            _ => {
+                // Streams have no position; move each buffer in turn and stop
+                // at the first short transfer.
+                let mut regs = *abi.regs;
+                let mut done = 0;
+                for iov in iovs.iter().filter(|iov| iov.len != 0) {
+                    let abi = SyscallAbi {
+                        sysno: abi.sysno,
+                        arg1: abi.arg1,
+                        arg2: iov.base,
+                        arg3: iov.len,
+                        arg4: 0,
+                        arg5: 0,
+                        arg6: 0,
+                        regs: &mut regs,
+                    };
+                    let r = if is_write {
+                        self.write(&abi)
+                    } else {
+                        self.read(&abi)
+                    };
+                    match r {
+                        Ok(n) => {
+                            done += n;
+                            if n != iov.len {
+                                break;
+                            }
+                        }
+                        Err(e) if done == 0 => return Err(e),
+                        Err(_) => break,
+                    }
+                }
+                count(is_write, done);
+                Ok(done)
+            }
+        }
+    }
+}
@@ -34,6 +34,8 @@ pub unsafe fn main(_config_builder: SystemConfigurationBuilder) {
         &page_table::complicate,
         &page_table::x86_permission,
         &page_table::x86_permission_advanced,
+        &page_table::huge_page,
+        &page_table::vmalloc_huge,
         // Mmap.
         &mm_struct::do_mmap,
         &mm_struct::access_ok_normal,
@@ -43,8 +45,10 @@ pub unsafe fn main(_config_builder: SystemConfigurationBuilder) {
         // Loader.
         &userprog::arg_parse,
         &userprog::loader_bss_sanity,
+        &userprog::string_ops,
         &userprog::sys_open,
         &userprog::sys_read,
+        &userprog::sys_readv,
         &userprog::sys_read_error,
         &userprog::sys_write,
         &userprog::sys_write_error,
@@ -2,8 +2,11 @@ use keos::{
     addressing::Va,
     mm::page_table::{get_current_pt_pa, load_pt},
     mm::{
-        Page,
-        page_table::{PageTableMappingError, PageTableRoot, Permission, PteFlags},
+        ContigPages, Page,
+        page_table::{
+            HUGE_PAGE_SIZE, PageTableMappingError, PageTableRoot, PdeFlags, Permission, PteFlags,
+        },
+        vmalloc,
     },
 };
 use keos_project2::page_table::PageTable;
@@ -370,3 +373,72 @@ pub fn complicate() {
     // No explicit unmap is performed here—`#[validate_alloc]` ensures all pages
     // are freed at drop.
 }
+
+/// Tests that the page table works together with 2MiB huge pages.
+///
+/// This function maps a huge page, splits it into 4KiB pages, and verifies
+/// that `PageTable::walk()` and `PageTable::unmap()` work on the split pages.
+/// The `#[validate_alloc]` attribute ensures that all allocated pages are freed
+/// when `PageTable` is dropped.
+#[validate_alloc]
+pub fn huge_page() {
+    let mut pgtbl = PageTable(PageTableRoot::new_boxed());
+    let va = Va::new(0x4000_0000).unwrap();
+    let pages = ContigPages::new_with_align(HUGE_PAGE_SIZE, HUGE_PAGE_SIZE).unwrap();
+    let pa = pages.kva().into_pa();
+
+    // The walk on a huge page must not be confused with a page table.
+    assert!(
+        pgtbl
+            .0
+            .map_huge(va, pages, PdeFlags::P | PdeFlags::RW | PdeFlags::US)
+            .is_ok()
+    );
+    assert_eq!(pgtbl.0.walk_huge(va + 0x1000).unwrap().pa(), Some(pa));
+    assert!(matches!(
+        pgtbl.walk(va),
+        Err(PageTableMappingError::HugePage)
+    ));
+
+    // After the split, every 4KiB page maps to the same physical memory.
+    assert!(pgtbl.0.split_huge(va + 0x1234).is_ok());
+    assert!(pgtbl.0.walk_huge(va).is_err());
+    for i in 0..HUGE_PAGE_SIZE / 0x1000 {
+        let pte = pgtbl
+            .walk(va + i * 0x1000)
+            .expect("PageTable::walk() failed.");
+        assert_eq!(pte.pa(), Some(pa + i * 0x1000));
+        assert_eq!(pte.flags(), PteFlags::P | PteFlags::RW | PteFlags::US);
+    }
+
+    // Partially unmap the split pages.
+    for i in 0..16 {
+        check_remove_one(&mut pgtbl, (va + i * 0x1000).into_usize());
+    }
+}
+
+/// Tests that a large allocation of the vmalloc area is backed by huge pages.
+///
+/// Each aligned 2MiB of the allocation must be a huge page of the current
+/// page table, which shares the vmalloc area with the kernel page table, and
+/// the memory must stay usable until it is freed.
+pub fn vmalloc_huge() {
+    let size = 2 * HUGE_PAGE_SIZE;
+    let kva = vmalloc::vmalloc(size).expect("vmalloc failed.");
+    assert_eq!(kva.into_usize() % HUGE_PAGE_SIZE, 0);
+
+    let pgtbl = unsafe { &*(get_current_pt_pa().into_kva().into_usize() as *const PageTableRoot) };
+    let va = Va::new(kva.into_usize()).unwrap();
+    for off in (0..size).step_by(HUGE_PAGE_SIZE) {
+        assert!(
+            pgtbl.walk_huge(va + off).is_ok(),
+            "2MiB at {:?} is not mapped with a huge page.",
+            va + off
+        );
+    }
+
+    let buf = unsafe { core::slice::from_raw_parts_mut(kva.into_usize() as *mut u8, size) };
+    buf.fill(0x5a);
+    assert!(buf.iter().all(|b| *b == 0x5a));
+    unsafe { vmalloc::vfree(kva) };
+}
@@ -53,6 +53,12 @@ pub fn sys_read() {
     run_elf("sys_read");
 }
 
+#[stdin(b"")]
+#[assert_output(b"success ")]
+pub fn sys_readv() {
+    run_elf("sys_readv");
+}
+
 #[stdin(b"")]
 #[assert_output(b"success ")]
 pub fn sys_read_error() {
@@ -203,6 +209,12 @@ pub fn loader_bss_sanity() {
     run_elf("loader_bss_sanity");
 }
 
+#[stdin(b"")]
+#[assert_output(b"success ")]
+pub fn string_ops() {
+    run_elf("string_ops");
+}
+
 pub fn mm_exit_cleanup_stress() {
     for _ in 0..24 {
         assert_eq!(run_elf("mm_exit_cleanup"), 0);
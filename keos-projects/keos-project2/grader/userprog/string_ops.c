@@ -0,0 +1,97 @@
+#include <debug.h>
+#include <mman.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+
+/* Covers the bytewise, word, vector and `rep' paths of the string routines,
+ * at every alignment of the operands. */
+#define LEN 2048
+
+static unsigned char a[LEN + 64], b[LEN + 64], ref[LEN + 64];
+static const size_t sizes[] = {0, 1, 7, 8, 15, 16, 17, 31, 63, 100, 511, 512, 700, LEN};
+
+static uint64_t seed = 42;
+
+static unsigned char rand_byte(void) {
+  seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return seed >> 56;
+}
+
+static void fill(unsigned char *p, size_t size) {
+  for (size_t i = 0; i < size; i++)
+    p[i] = rand_byte() % 4 + 1;
+}
+
+int main(int argc, char *argv[]) {
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size_t n = sizes[s];
+    for (size_t o1 = 0; o1 < 16; o1++) {
+      for (size_t o2 = 0; o2 < 16; o2++) {
+        /* memcpy and memmove in both directions. */
+        fill(a, sizeof(a));
+        fill(b, sizeof(b));
+        ASSERT(memcpy(a + o1, b + o2, n) == a + o1);
+        for (size_t i = 0; i < n; i++)
+          ASSERT(a[o1 + i] == b[o2 + i]);
+
+        fill(a, sizeof(a));
+        for (size_t i = 0; i < sizeof(a); i++)
+          ref[i] = a[i];
+        ASSERT(memmove(a + o1, a + o2 + 32, n) == a + o1);
+        ASSERT(memmove(b, a + o2, n) == b);
+        for (size_t i = 0; i < n; i++)
+          ASSERT(a[o1 + i] == ref[o2 + 32 + i]);
+        fill(a, sizeof(a));
+        for (size_t i = 0; i < sizeof(a); i++)
+          ref[i] = a[i];
+        memmove(a + o1 + 32, a + o2, n);
+        for (size_t i = 0; i < n; i++)
+          ASSERT(a[o1 + 32 + i] == ref[o2 + i]);
+
+        /* memset must not touch the neighbours. */
+        fill(a, sizeof(a));
+        ASSERT(memset(a + o1, 0xa5, n) == a + o1);
+        for (size_t i = 0; i < n; i++)
+          ASSERT(a[o1 + i] == 0xa5);
+        ASSERT(a[o1 + n] != 0xa5);
+
+        /* memcmp with the difference at each position. */
+        fill(a, sizeof(a));
+        for (size_t i = 0; i < n; i++)
+          b[o2 + i] = a[o1 + i];
+        ASSERT(memcmp(a + o1, b + o2, n) == 0);
+        if (n) {
+          size_t at = rand_byte() * n / 256;
+          b[o2 + at] = 0;
+          ASSERT(memcmp(a + o1, b + o2, n) > 0);
+          ASSERT(memcmp(b + o2, a + o1, n) < 0);
+        }
+
+        /* memchr and strlen. */
+        fill(a, sizeof(a));
+        ASSERT(memchr(a + o1, 0, n) == NULL);
+        if (n) {
+          size_t at = rand_byte() * n / 256;
+          a[o1 + at] = 0;
+          ASSERT(memchr(a + o1, 0, n) == a + o1 + at);
+          ASSERT(strlen((char *)a + o1) == at);
+        }
+        a[o1 + n] = 0;
+        ASSERT(memchr(a + o1, 0, n + 1) != NULL);
+      }
+    }
+  }
+
+  /* strlen must not read past the page that holds the terminator. */
+  ASSERT(mmap((void *)0xA000, 0x1000, PROT_READ | PROT_WRITE, -1, 0) == (void *)0xA000);
+  char *page = (char *)0xA000;
+  memset(page, 'x', 0x1000);
+  page[0xfff] = '\0';
+  for (size_t i = 0; i < 32; i++)
+    ASSERT(strlen(page + 0xfff - i) == i);
+
+  printf("success ");
+  return 0;
+}
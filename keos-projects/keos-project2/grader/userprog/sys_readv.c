@@ -0,0 +1,63 @@
+#include <debug.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+
+/* Crosses a page boundary in the middle of a buffer. */
+static char big[8192] __attribute__((aligned(4096)));
+
+int main(int argc, char *argv[]) {
+  char a[8] = {0}, b[4] = {0}, c[16] = {0};
+  struct iovec iov[3] = {{a, 7}, {b, 3}, {c, 14}};
+  int fd, fds[2];
+
+  fd = open("hello", O_RDONLY);
+  ASSERT(fd >= 3);
+
+  /* "Welcome to KeOS Project!" */
+  ASSERT(readv(fd, iov, 3) == 24);
+  ASSERT(strcmp(a, "Welcome") == 0);
+  ASSERT(strcmp(b, " to") == 0);
+  ASSERT(strcmp(c, " KeOS Project!") == 0);
+
+  /* The position moved past the vector. */
+  memset(a, 0, sizeof(a));
+  ASSERT(read(fd, a, 2) == 2 && strcmp(a, "\n\n") == 0);
+
+  /* preadv leaves the position untouched. */
+  memset(b, 0, sizeof(b));
+  struct iovec at = {b, 3};
+  ASSERT(preadv(fd, &at, 1, 11) == 3 && strcmp(b, "KeO") == 0);
+  memset(a, 0, sizeof(a));
+  ASSERT(read(fd, a, 4) == 4 && strcmp(a, "Even") == 0);
+
+  /* A buffer over two pages is filled in one piece. */
+  struct iovec span[2] = {{big + 4090, 12}, {big, 12}};
+  ASSERT(preadv(fd, span, 2, 0) == 24);
+  ASSERT(memcmp(big + 4090, "Welcome to K", 12) == 0);
+  ASSERT(memcmp(big, "eOS Project!", 12) == 0);
+
+  /* Zero-length buffers are skipped. */
+  struct iovec empty[2] = {{a, 0}, {b, 0}};
+  ASSERT(readv(fd, empty, 2) == 0);
+
+  /* The errors. */
+  ASSERT(pwritev(fd, iov, 1, 0) < 0);
+  ASSERT(readv(100, iov, 3) < 0);
+  ASSERT(readv(fd, iov, -1) < 0);
+
+  /* Streams move the buffers in turn. */
+  ASSERT(pipe(fds) == 0);
+  struct iovec out[2] = {{"Hello, ", 7}, {"keos!", 5}};
+  ASSERT(writev(fds[1], out, 2) == 12);
+  memset(a, 0, sizeof(a));
+  memset(b, 0, sizeof(b));
+  struct iovec in[2] = {{a, 7}, {b, 3}};
+  ASSERT(readv(fds[0], in, 2) == 10);
+  ASSERT(strcmp(a, "Hello, ") == 0 && strcmp(b, "keo") == 0);
+  ASSERT(preadv(fds[0], in, 2, 0) < 0);
+
+  printf("success ");
+  return 0;
+}
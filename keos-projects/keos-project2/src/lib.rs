@@ -89,9 +89,11 @@ pub mod page_table;
 pub mod pager;
 pub mod process;
 
+use alloc::sync::Arc;
 use core::ops::Range;
 use keos::{
     KernelError,
+    acct::Account,
     addressing::{Pa, Va},
     syscall::Registers,
     task::Task,
@@ -123,6 +125,16 @@ pub enum SyscallNumber {
     Close = 6,
     /// Create an interprocess communication channel.
     Pipe = 7,
+    /// Reads data from a file descriptor into several buffers.
+    Readv = 25,
+    /// Writes data from several buffers to a file descriptor.
+    Writev = 26,
+    /// Reads data at an offset of a file into several buffers.
+    Preadv = 27,
+    /// Writes data from several buffers at an offset of a file.
+    Pwritev = 28,
+    /// Copies data between two files inside the kernel.
+    CopyFileRange = 29,
     /// Map the memory.
     Mmap = 8,
     /// Unmap the memory.
@@ -141,6 +153,11 @@ impl TryFrom<usize> for SyscallNumber {
             5 => Ok(SyscallNumber::Tell),
             6 => Ok(SyscallNumber::Close),
             7 => Ok(SyscallNumber::Pipe),
+            25 => Ok(SyscallNumber::Readv),
+            26 => Ok(SyscallNumber::Writev),
+            27 => Ok(SyscallNumber::Preadv),
+            28 => Ok(SyscallNumber::Pwritev),
+            29 => Ok(SyscallNumber::CopyFileRange),
             8 => Ok(SyscallNumber::Mmap),
             9 => Ok(SyscallNumber::Munmap),
             _ => Err(KernelError::NoSuchSyscall),
@@ -199,6 +216,11 @@ impl Task for Process {
             SyscallNumber::Tell => self.file_struct.tell(&abi),
             SyscallNumber::Close => self.file_struct.close(&abi),
             SyscallNumber::Pipe => self.file_struct.pipe(&abi),
+            SyscallNumber::Readv => self.file_struct.readv(&abi),
+            SyscallNumber::Writev => self.file_struct.writev(&abi),
+            SyscallNumber::Preadv => self.file_struct.preadv(&abi),
+            SyscallNumber::Pwritev => self.file_struct.pwritev(&abi),
+            SyscallNumber::CopyFileRange => self.file_struct.copy_file_range(&abi),
             SyscallNumber::Mmap => self.mm_struct.mmap(&mut self.file_struct, &abi),
             SyscallNumber::Munmap => self.mm_struct.munmap(&abi),
         });
@@ -231,4 +253,8 @@ impl Task for Process {
     fn with_page_table_pa(&self, f: &fn(Pa)) {
         f(self.mm_struct.page_table.pa())
     }
+
+    fn account(&self) -> Option<Arc<Account>> {
+        Some(self.account.clone())
+    }
 }
@@ -109,6 +109,19 @@
 //! - Flag of each table entry: [`Pml4eFlags`], [`PdpeFlags`], [`PdeFlags`], and
 //!   [`PteFlags`].
 //! - Invalidate a TLB entry: [`StaleTLBEntry::invalidate`].
+//! - Invalidate many TLB entries at once: [`StaleTLBEntry::gather`] and
+//!   [`TlbGather`]. Unmapping a large region (e.g. munmap) should flush all of
+//!   the entries with a single [`TlbGather::flush`], instead of a TLB
+//!   shootdown per page.
+//!
+//! ### Huge Pages
+//! A [`Pde`] with the `PS` flag maps a 2MiB page directly, without a page
+//! table. [`PageTableRoot`] provides the operations on such mappings:
+//! [`PageTableRoot::map_huge`], [`PageTableRoot::unmap_huge`],
+//! [`PageTableRoot::walk_huge`], and [`PageTableRoot::split_huge`], which
+//! breaks a huge page into 512 pages so that each of them can be unmapped
+//! separately. [`Pde::into_pt`] returns [`PageTableMappingError::HugePage`] on
+//! a huge entry; your page table walk should propagate this error.
 //!
 //! ## Implementation Requirements
 //! You need to implement the followings:
@@ -129,6 +142,8 @@
 //! When you finish implementing all tasks, move on to the next [`section`].
 //!
 //! [`StaleTLBEntry`]: StaleTLBEntry
+//! [`TlbGather`]: keos::mm::tlb::TlbGather
+//! [`TlbGather::flush`]: keos::mm::tlb::TlbGather::flush
 //! [`section`]: crate::mm_struct
 
 use alloc::boxed::Box;
@@ -376,6 +391,8 @@ impl PageTable {
     fn clear(&mut self) {
         // TODO: Clear the page table.
         // You must clear the mid-level table.
+        // Huge entries ([`Pde::is_huge`]) own 2MiB of pages; release them with
+        // `ContigPages::from_va(pa.into_kva(), HUGE_PAGE_SIZE)`.
         // You don't need to care about pml4i indices larger than
         // [`PageTableRoot::KBASE`].
         todo!()
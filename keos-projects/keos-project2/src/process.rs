@@ -2,7 +2,8 @@
 //!
 //! This file defines the process model of the project2.
 
-use keos::{KernelError, thread::Current};
+use alloc::sync::Arc;
+use keos::{KernelError, acct::Account, thread::Current};
 use keos_project1::{file_struct::FileStruct, syscall::SyscallAbi};
 
 use crate::{eager_pager::EagerPager, mm_struct::MmStruct};
@@ -11,26 +12,32 @@ use crate::{eager_pager::EagerPager, mm_struct::MmStruct};
 pub struct Process {
     pub file_struct: FileStruct,
     pub mm_struct: MmStruct<EagerPager>,
+    /// The resource account of the process.
+    pub account: Arc<Account>,
 }
 
 impl Default for Process {
     fn default() -> Self {
-        Self {
-            file_struct: FileStruct::new(),
-            mm_struct: MmStruct::new(),
-        }
+        Self::new(FileStruct::new(), MmStruct::new())
     }
 }
 
 impl Process {
-    /// Create a process with given [`MmStruct`].
-    pub fn from_mm_struct(mm_struct: MmStruct<EagerPager>) -> Self {
+    /// Create a process with given [`FileStruct`] and [`MmStruct`], and a
+    /// new [`Account`].
+    pub fn new(file_struct: FileStruct, mm_struct: MmStruct<EagerPager>) -> Self {
         Self {
+            file_struct,
             mm_struct,
-            ..Default::default()
+            account: Account::new(),
         }
     }
 
+    /// Create a process with given [`MmStruct`].
+    pub fn from_mm_struct(mm_struct: MmStruct<EagerPager>) -> Self {
+        Self::new(FileStruct::new(), mm_struct)
+    }
+
     /// Exit a process.
     ///
     /// This function terminates the calling thread by invoking `exit` on the
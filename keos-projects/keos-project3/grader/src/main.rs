@@ -70,6 +70,8 @@ pub unsafe fn main(_config_builder: SystemConfigurationBuilder) {
         &userprog_part_2::cow_cleanup_stress,
         // CoW test
         &userprog_part_2::fork2,
+        &userprog_part_2::spawn,
+        &userprog_part_2::spawn_cache,
     ]);
 }
 
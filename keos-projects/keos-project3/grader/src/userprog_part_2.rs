@@ -21,6 +21,27 @@ pub fn fork2() {
     assert_eq!(run_elf("sys_fork2"), -1);
 }
 
+#[stdin(b"")]
+#[assert_output(
+    b"Hello, parent!
+Hello, child!
+"
+)]
+pub fn spawn() {
+    assert_eq!(run_elf("sys_spawn"), 0);
+}
+
+pub fn spawn_cache() {
+    let before = keos::fs::exec_cache::stat();
+    assert_eq!(run_elf("sys_spawn"), 0);
+    assert_eq!(run_elf("sys_spawn"), 0);
+    let after = keos::fs::exec_cache::stat();
+    assert!(
+        after.hits > before.hits,
+        "Spawning a program again must not read its headers from the file."
+    );
+}
+
 pub fn cow() {
     assert_eq!(run_elf("mm_cow"), 0);
 }
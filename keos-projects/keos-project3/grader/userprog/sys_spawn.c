@@ -0,0 +1,37 @@
+#include <debug.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+
+int value = 0;
+
+int main(int argc, char *argv[]) {
+  int pid;
+  int fds[2] = {0};
+  char buf[1] = {0};
+  char fd_arg[16] = {0};
+  char *child_argv[] = {"sys_spawn", "child", fd_arg, NULL};
+
+  if (argc == 3 && strcmp(argv[1], "child") == 0) {
+    // The child runs a fresh image of the program.
+    ASSERT(value == 0);
+    printf("Hello, parent!\n");
+    ASSERT(write(atoi(argv[2]), "\0", 1) == 1);
+    return 0;
+  }
+
+  ASSERT(spawn("no_such_program", NULL) < 0);
+  ASSERT(spawn("hello", NULL) < 0);
+
+  ASSERT(pipe(fds) == 0);
+  snprintf(fd_arg, sizeof(fd_arg), "%d", fds[1]);
+
+  value = 1;
+  pid = spawn("sys_spawn", child_argv);
+  ASSERT(pid > 0);
+  ASSERT(read(fds[0], buf, 1) == 1);
+  ASSERT(value == 1);
+  printf("Hello, child!\n");
+  return 0;
+}
@@ -52,12 +52,14 @@ pub mod fork;
 pub mod get_phys;
 pub mod lazy_pager;
 pub mod process;
+pub mod spawn;
 
-use alloc::boxed::Box;
+use alloc::{boxed::Box, sync::Arc};
 use core::ops::Range;
 use fork::fork;
 use keos::{
     KernelError,
+    acct::Account,
     addressing::{Pa, Va},
     syscall::Registers,
     task::PFErrorCode,
@@ -70,6 +72,7 @@ use keos_project2::mm_struct::MmStruct;
 use lazy_pager::LazyPager;
 use lazy_pager::PageFaultReason;
 pub use process::Process;
+use spawn::spawn;
 
 /// Represents system call numbers used in project3.
 ///
@@ -95,12 +98,24 @@ pub enum SyscallNumber {
     Close = 6,
     /// Create an interprocess communication channel.
     Pipe = 7,
+    /// Reads data from a file descriptor into several buffers.
+    Readv = 25,
+    /// Writes data from several buffers to a file descriptor.
+    Writev = 26,
+    /// Reads data at an offset of a file into several buffers.
+    Preadv = 27,
+    /// Writes data from several buffers at an offset of a file.
+    Pwritev = 28,
+    /// Copies data between two files inside the kernel.
+    CopyFileRange = 29,
     /// Map the memory.
     Mmap = 8,
     /// Unmap the memory.
     Munmap = 9,
     /// Fork the process.
     Fork = 10,
+    /// Create a process from an executable.
+    Spawn = 30,
     /// Get Physical Address of Page (for grading purposes only)
     GetPhys = 0x81,
 }
@@ -117,9 +132,15 @@ impl TryFrom<usize> for SyscallNumber {
             5 => Ok(SyscallNumber::Tell),
             6 => Ok(SyscallNumber::Close),
             7 => Ok(SyscallNumber::Pipe),
+            25 => Ok(SyscallNumber::Readv),
+            26 => Ok(SyscallNumber::Writev),
+            27 => Ok(SyscallNumber::Preadv),
+            28 => Ok(SyscallNumber::Pwritev),
+            29 => Ok(SyscallNumber::CopyFileRange),
             8 => Ok(SyscallNumber::Mmap),
             9 => Ok(SyscallNumber::Munmap),
             10 => Ok(SyscallNumber::Fork),
+            30 => Ok(SyscallNumber::Spawn),
             0x81 => Ok(SyscallNumber::GetPhys),
             _ => Err(KernelError::NoSuchSyscall),
         }
@@ -177,6 +198,11 @@ impl Task for Process {
             SyscallNumber::Tell => self.file_struct.tell(&abi),
             SyscallNumber::Close => self.file_struct.close(&abi),
             SyscallNumber::Pipe => self.file_struct.pipe(&abi),
+            SyscallNumber::Readv => self.file_struct.readv(&abi),
+            SyscallNumber::Writev => self.file_struct.writev(&abi),
+            SyscallNumber::Preadv => self.file_struct.preadv(&abi),
+            SyscallNumber::Pwritev => self.file_struct.pwritev(&abi),
+            SyscallNumber::CopyFileRange => self.file_struct.copy_file_range(&abi),
             SyscallNumber::Mmap => self.mm_struct.mmap(&mut self.file_struct, &abi),
             SyscallNumber::Munmap => self.mm_struct.munmap(&abi),
             SyscallNumber::Fork => fork(
@@ -185,13 +211,19 @@ impl Task for Process {
                 &abi,
                 |file_struct, mm_struct| {
                     with_current(|th| {
-                        ThreadBuilder::new(&th.name).attach_task(Box::new(Process {
-                            file_struct,
-                            mm_struct,
-                        }))
+                        ThreadBuilder::new(&th.name)
+                            .attach_task(Box::new(Process::new(file_struct, mm_struct)))
                     })
                 },
             ),
+            SyscallNumber::Spawn => spawn(
+                &mut self.file_struct,
+                &abi,
+                |name, file_struct, mm_struct| {
+                    ThreadBuilder::new(name)
+                        .attach_task(Box::new(Process::new(file_struct, mm_struct)))
+                },
+            ),
             SyscallNumber::GetPhys => get_phys::get_phys(&self.mm_struct, &self.file_struct, &abi),
         });
         // Set the return value of the system call (success or error) back into the
@@ -234,6 +266,7 @@ impl Task for Process {
     ///    physical page and update the page table.
     fn page_fault(&mut self, ec: PFErrorCode, cr2: Va) {
         let reason = PageFaultReason::new(ec, cr2);
+        self.account.count_fault();
 
         // Delegate the fault handling to [`LazyPager::handle_page_fault`],
         // which will update the page table and allocate a physical page if necessary.
@@ -246,4 +279,8 @@ impl Task for Process {
     fn with_page_table_pa(&self, f: &fn(Pa)) {
         f(self.mm_struct.page_table.pa())
     }
+
+    fn account(&self) -> Option<Arc<Account>> {
+        Some(self.account.clone())
+    }
 }
@@ -0,0 +1,98 @@
+//! # `Spawn`: creating a process from an executable.
+//!
+//! A process that runs another program usually calls `fork` and then loads
+//! the program in the child. `fork` write-protects the whole address space of
+//! the parent only for the child to throw it away, so its cost grows with the
+//! memory of the parent. [`spawn`] builds the child directly from an
+//! executable instead: the child gets a copy of the [`FileStruct`] of the
+//! parent, as with `fork`, and a fresh [`MmStruct`] filled by the
+//! [`LoadContext`]. The [`MmStruct`] of the parent is never touched, so the
+//! latency of a spawn depends only on the program to be loaded. The
+//! executable is opened through [`exec_cache`], so spawning the same program
+//! again does not read its headers from the file system.
+//!
+//! [`LoadContext`]: keos_project2::loader::LoadContext
+
+use crate::lazy_pager::LazyPager;
+use alloc::{string::String, vec::Vec};
+use keos::{
+    KernelError,
+    fs::exec_cache,
+    syscall::{
+        Registers,
+        uaccess::{UserCString, UserPtrRO},
+    },
+    thread::ThreadBuilder,
+};
+use keos_project1::{file_struct::FileStruct, syscall::SyscallAbi};
+use keos_project2::{loader::LoadContext, mm_struct::MmStruct};
+
+/// Maximum number of the arguments of a spawned program.
+pub const SPAWN_ARG_MAX: usize = 128;
+
+/// Read a null-terminated vector of strings from the user space.
+fn read_argv(mut addr: usize) -> Result<Vec<String>, KernelError> {
+    let mut argv = Vec::new();
+    loop {
+        match UserPtrRO::<usize>::new(addr).get()? {
+            0 => return Ok(argv),
+            _ if argv.len() == SPAWN_ARG_MAX => return Err(KernelError::InvalidArgument),
+            arg => argv.push(UserCString::new(arg).read()?),
+        }
+        addr += core::mem::size_of::<usize>();
+    }
+}
+
+/// Creates a new process that runs the executable at a path.
+///
+/// # Syscall API
+/// ```c
+/// int spawn(const char *path, char *const argv[]);
+/// ```
+/// - `path`: Path to the executable, relative to the current working
+///   directory.
+/// - `argv`: Null-terminated vector of the arguments. If `argv` is null, the
+///   program is run with `path` as its only argument.
+///
+/// ### Behavior
+/// - The child starts at the entry point of the executable, with a copy of
+///   the file descriptor table of the parent.
+/// - The address space of the parent is neither copied nor write-protected.
+///
+/// ### Parameters
+/// - `file_struct`: The parent’s file descriptor table to be duplicated.
+/// - `abi`: The parent’s syscall ABI.
+/// - `create_task`: A closure for creating and spawning the new process.
+///
+/// ### Returns
+/// - `Ok(pid)`: The parent receives the child process ID.
+/// - `Err(KernelError::InvalidArgument)`: If the arguments are invalid, or
+///   the file is not an executable.
+/// - `Err(KernelError)`: If the executable cannot be opened or loaded.
+pub fn spawn(
+    file_struct: &mut FileStruct,
+    abi: &SyscallAbi,
+    create_task: impl FnOnce(&str, FileStruct, MmStruct<LazyPager>) -> ThreadBuilder,
+) -> Result<usize, KernelError> {
+    let path = UserCString::new(abi.arg1).read()?;
+    let argv = if abi.arg2 == 0 {
+        alloc::vec![path.clone()]
+    } else {
+        read_argv(abi.arg2)?
+    };
+    let file = file_struct
+        .cwd
+        .open(&path)?
+        .into_regular_file()
+        .map(exec_cache::open)
+        .ok_or(KernelError::InvalidArgument)?;
+    let args: Vec<&str> = argv.iter().map(String::as_str).collect();
+    let LoadContext { mm_struct, regs } = LoadContext {
+        mm_struct: MmStruct::new(),
+        regs: Registers::new(),
+    }
+    .load(&file, &args)?;
+
+    let handle = create_task(&path, file_struct.clone(), mm_struct).spawn(move || regs.launch());
+    Ok(handle.tid as usize)
+}
@@ -63,6 +63,7 @@ pub unsafe fn main(config_builder: SystemConfigurationBuilder) {
         &userprog::sys_stdout,
         &userprog::sys_stderr,
         &userprog::sys_pipe,
+        &userprog::sys_uring,
         &userprog::mm_mmap,
         &userprog::mm_mmap_error_protection,
         &userprog::mm_mmap_error_protection_exec,
@@ -77,6 +78,9 @@ pub unsafe fn main(config_builder: SystemConfigurationBuilder) {
         &userprog::thread_join_chain,
         &userprog::thread_join_complex,
         &userprog::thread_mm_shared,
+        &userprog::thread_malloc,
+        &userprog::thread_futex,
+        &userprog::thread_sched,
     ]);
 }
 
@@ -205,3 +205,27 @@ pub fn thread_join_complex() {
 pub fn thread_mm_shared() {
     run_elf("thread_mm_shared");
 }
+
+#[stdin(b"")]
+#[assert_output(b"success ")]
+pub fn thread_malloc() {
+    run_elf("thread_malloc");
+}
+
+#[stdin(b"")]
+#[assert_output(b"success ")]
+pub fn thread_futex() {
+    run_elf("thread_futex");
+}
+
+#[stdin(b"")]
+#[assert_output(b"success ")]
+pub fn sys_uring() {
+    run_elf("sys_uring");
+}
+
+#[stdin(b"")]
+#[assert_output(b"success ")]
+pub fn thread_sched() {
+    run_elf("thread_sched");
+}
@@ -0,0 +1,51 @@
+#include <debug.h>
+#include <stdio.h>
+#include <string.h>
+#include <syscall-nr.h>
+#include <syscall.h>
+#include <uring.h>
+
+#define ENTRIES 8
+
+static char ring_mem[URING_SIZE(ENTRIES)] __attribute__((aligned(64)));
+
+static void prep(struct uring *r, uint64_t sysno, uint64_t user_data) {
+  struct uring_sqe *sqe = uring_get_sqe(r);
+  ASSERT(sqe != NULL);
+  sqe->sysno = sysno;
+  sqe->user_data = user_data;
+}
+
+int main(int argc, char *argv[]) {
+  struct uring r;
+  struct uring_cqe cqe;
+  int fds[2];
+  char buf[6] = {0};
+
+  ASSERT(pipe(fds) == 0);
+  ASSERT(uring_init(&r, ring_mem, ENTRIES) == 0);
+
+  /* File I/O runs in the ring. */
+  uring_prep_write(&r, fds[1], "hello", 5, 1);
+  uring_prep_read(&r, fds[0], buf, 5, 2);
+  ASSERT(uring_submit(&r) == 2);
+  ASSERT(uring_peek_cqe(&r, &cqe) && cqe.user_data == 1 && cqe.res == 5);
+  ASSERT(uring_peek_cqe(&r, &cqe) && cqe.user_data == 2 && cqe.res == 5);
+  ASSERT(strcmp(buf, "hello") == 0);
+  ASSERT(!uring_peek_cqe(&r, &cqe));
+
+  /* The calls that change the process are rejected. */
+  prep(&r, SYS_FORK, 3);
+  prep(&r, SYS_EXIT, 4);
+  prep(&r, SYS_EXIT_GROUP, 5);
+  prep(&r, SYS_THREAD_CREATE, 6);
+  prep(&r, SYS_SPAWN, 7);
+  prep(&r, SYS_URING_ENTER, 8);
+  ASSERT(uring_submit(&r) == 6);
+  for (uint64_t i = 3; i <= 8; i++)
+    ASSERT(uring_peek_cqe(&r, &cqe) && cqe.user_data == i && cqe.res < 0);
+  ASSERT(!uring_peek_cqe(&r, &cqe));
+
+  printf("success ");
+  return 0;
+}
@@ -0,0 +1,73 @@
+#include <debug.h>
+#include <mman.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <syscall.h>
+#include <thread.h>
+
+#define NR_THREADS 4
+#define NR_ROUNDS 20000
+
+struct mutex lock = MUTEX_INITIALIZER;
+struct condvar started = CONDVAR_INITIALIZER;
+int counter = 0;
+int nr_ready = 0;
+int go = 0;
+
+int thread_fn(void *arg UNUSED) {
+  /* Wait until every thread is created, so that they contend. */
+  mutex_lock(&lock);
+  nr_ready++;
+  while (!go)
+    cond_wait(&started, &lock);
+  mutex_unlock(&lock);
+
+  for (int i = 0; i < NR_ROUNDS; i++) {
+    mutex_lock(&lock);
+    int v = counter;
+    /* Widen the critical section. */
+    for (volatile int j = 0; j < 10; j++)
+      ;
+    counter = v + 1;
+    mutex_unlock(&lock);
+  }
+  exit(0);
+  __builtin_unreachable();
+}
+
+int main(int argc, char *argv[]) {
+  int tids[NR_THREADS];
+
+  /* A wait on a stale value returns at once. */
+  int word = 1;
+  ASSERT(futex(&word, FUTEX_WAIT, 0, NULL, 0) < 0);
+  ASSERT(futex(&word, FUTEX_WAKE, 1, NULL, 0) == 0);
+  ASSERT(futex((int *)((char *)&word + 1), FUTEX_WAIT, 1, NULL, 0) < 0);
+
+  for (int i = 0; i < NR_THREADS; i++) {
+    void *stack = (void *)(uintptr_t)(0xA000 + i * STACK_SIZE);
+    ASSERT(mmap(stack, STACK_SIZE, PROT_READ | PROT_WRITE, -1, 0) == stack);
+    tids[i] = thread_create("futex", stack + STACK_SIZE, thread_fn, NULL);
+    ASSERT(tids[i] > 0);
+  }
+
+  for (;;) {
+    mutex_lock(&lock);
+    if (nr_ready == NR_THREADS) {
+      go = 1;
+      cond_broadcast(&started);
+      mutex_unlock(&lock);
+      break;
+    }
+    mutex_unlock(&lock);
+  }
+
+  for (int i = 0; i < NR_THREADS; i++) {
+    int exitcode = -1;
+    ASSERT(thread_join(tids[i], &exitcode) == 0 && exitcode == 0);
+  }
+  ASSERT(counter == NR_THREADS * NR_ROUNDS);
+
+  printf("success ");
+  return 0;
+}
@@ -0,0 +1,85 @@
+#include <debug.h>
+#include <mman.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include <thread.h>
+
+#define NR_THREADS 4
+#define NR_BLOCKS 256
+
+/* Blocks that each thread leaves for main to free. */
+unsigned char *leftover[NR_THREADS][NR_BLOCKS];
+
+static int check(unsigned char *p, size_t size, unsigned char v) {
+  for (size_t i = 0; i < size; i++)
+    if (p[i] != v)
+      return 0;
+  return 1;
+}
+
+int thread_fn(void *arg) {
+  int id = (int)(intptr_t)arg;
+  unsigned char *blocks[NR_BLOCKS] = {0};
+  size_t sizes[NR_BLOCKS];
+
+  for (int round = 0; round < 20; round++) {
+    for (int i = 0; i < NR_BLOCKS; i++) {
+      unsigned char v = id * 16 + i % 16;
+      if (blocks[i]) {
+        ASSERT(check(blocks[i], sizes[i], v));
+        free(blocks[i]);
+      }
+      sizes[i] = (round * 131 + i * 37) % 3000;
+      blocks[i] = malloc(sizes[i]);
+      ASSERT(blocks[i] != NULL && (uintptr_t)blocks[i] % 16 == 0);
+      memset(blocks[i], v, sizes[i]);
+    }
+  }
+  for (int i = 0; i < NR_BLOCKS; i++) {
+    unsigned char v = id * 16 + i % 16;
+    blocks[i] = realloc(blocks[i], sizes[i] + 100);
+    ASSERT(check(blocks[i], sizes[i], v));
+    leftover[id][i] = blocks[i];
+  }
+  exit(0);
+  __builtin_unreachable();
+}
+
+int main(int argc, char *argv[]) {
+  int tids[NR_THREADS];
+
+  for (int i = 0; i < NR_THREADS; i++) {
+    void *stack = (void *)(uintptr_t)(0xA000 + i * STACK_SIZE);
+    ASSERT(mmap(stack, STACK_SIZE, PROT_READ | PROT_WRITE, -1, 0) == stack);
+    tids[i] = thread_create("malloc", stack + STACK_SIZE, thread_fn,
+                            (void *)(intptr_t)i);
+    ASSERT(tids[i] > 0);
+  }
+  for (int i = 0; i < NR_THREADS; i++) {
+    int exitcode = -1;
+    ASSERT(thread_join(tids[i], &exitcode) == 0 && exitcode == 0);
+  }
+
+  /* Free the blocks of the other threads, and reuse them. */
+  for (int i = 0; i < NR_THREADS; i++)
+    for (int j = 0; j < NR_BLOCKS; j++)
+      free(leftover[i][j]);
+  int *zeros = calloc(1000, sizeof(int));
+  ASSERT(zeros != NULL);
+  for (int i = 0; i < 1000; i++)
+    ASSERT(zeros[i] == 0);
+  free(zeros);
+
+  /* A block too large for the size classes. */
+  unsigned char *huge = malloc(1 << 20);
+  ASSERT(huge != NULL);
+  memset(huge, 0x5a, 1 << 20);
+  ASSERT(check(huge, 1 << 20, 0x5a));
+  free(huge);
+
+  printf("success ");
+  return 0;
+}
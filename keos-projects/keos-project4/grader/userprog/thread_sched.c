@@ -0,0 +1,54 @@
+#include <debug.h>
+#include <mman.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <syscall.h>
+#include <thread.h>
+
+#define NR_THREADS 4
+#define NR_ROUNDS 100000
+
+int thread_fn(void *arg) {
+  int i = (int)(uintptr_t)arg;
+
+  /* Every thread is pinned to the boot cpu, which is always online. */
+  ASSERT(set_affinity(1) == 0);
+  ASSERT(set_nice(i * 5) == 0);
+  for (volatile int j = 0; j < NR_ROUNDS; j++)
+    ;
+  exit(0);
+  __builtin_unreachable();
+}
+
+int main(int argc, char *argv[]) {
+  int tids[NR_THREADS];
+
+  /* Nice values out of range are rejected. */
+  ASSERT(set_nice(-21) < 0);
+  ASSERT(set_nice(20) < 0);
+  ASSERT(set_nice(-20) == 0);
+  ASSERT(set_nice(19) == 0);
+  ASSERT(set_nice(0) == 0);
+
+  /* A mask without any online cpu is rejected. */
+  ASSERT(set_affinity(0) < 0);
+  ASSERT(set_affinity(1UL << 63) < 0);
+  /* Offline cpus are dropped from the mask. */
+  ASSERT(set_affinity(~0UL) == 0);
+
+  for (int i = 0; i < NR_THREADS; i++) {
+    void *stack = (void *)(uintptr_t)(0xA000 + i * STACK_SIZE);
+    ASSERT(mmap(stack, STACK_SIZE, PROT_READ | PROT_WRITE, -1, 0) == stack);
+    tids[i] = thread_create("sched", stack + STACK_SIZE, thread_fn,
+                            (void *)(uintptr_t)i);
+    ASSERT(tids[i] > 0);
+  }
+
+  for (int i = 0; i < NR_THREADS; i++) {
+    int exitcode = -1;
+    ASSERT(thread_join(tids[i], &exitcode) == 0 && exitcode == 0);
+  }
+
+  printf("success ");
+  return 0;
+}
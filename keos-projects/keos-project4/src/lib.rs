@@ -64,10 +64,11 @@ pub mod process;
 pub mod round_robin;
 pub mod sync;
 
-use alloc::boxed::Box;
+use alloc::{boxed::Box, sync::Arc};
 use core::ops::Range;
 use keos::{
     KernelError,
+    acct::{self, Account},
     addressing::{Pa, Va},
     syscall::Registers,
     task::PFErrorCode,
@@ -76,7 +77,7 @@ use keos::{
 };
 use keos_project1::syscall::SyscallAbi;
 use keos_project2::mm_struct::MmStruct;
-use keos_project3::{fork::fork, get_phys::get_phys, lazy_pager::PageFaultReason};
+use keos_project3::{fork::fork, get_phys::get_phys, lazy_pager::PageFaultReason, spawn::spawn};
 pub use process::Thread;
 
 /// Represents system call numbers used in project4.
@@ -114,10 +115,42 @@ pub enum SyscallNumber {
     ThreadJoin = 12,
     /// Terminates the process, by terminating all threads.
     ExitGroup = 13,
+    /// Set the nice value of the calling thread.
+    SetNice = 21,
+    /// Set the cpu affinity mask of the calling thread.
+    SetAffinity = 22,
+    /// Wait on or wake up a futex.
+    Futex = 23,
+    /// Execute the submissions of a system call ring.
+    UringEnter = 24,
+    /// Reads data from a file descriptor into several buffers.
+    Readv = 25,
+    /// Writes data from several buffers to a file descriptor.
+    Writev = 26,
+    /// Reads data at an offset of a file into several buffers.
+    Preadv = 27,
+    /// Writes data from several buffers at an offset of a file.
+    Pwritev = 28,
+    /// Copies data between two files inside the kernel.
+    CopyFileRange = 29,
+    /// Create a process from an executable.
+    Spawn = 30,
     /// Get Physical Address of Page (for grading purposes only)
     GetPhys = 0x81,
 }
 
+/// System calls that a ring may submit.
+const URING_SYSCALLS: [usize; 8] = [
+    SyscallNumber::Read as usize,
+    SyscallNumber::Write as usize,
+    SyscallNumber::Seek as usize,
+    SyscallNumber::Readv as usize,
+    SyscallNumber::Writev as usize,
+    SyscallNumber::Preadv as usize,
+    SyscallNumber::Pwritev as usize,
+    SyscallNumber::CopyFileRange as usize,
+];
+
 impl TryFrom<usize> for SyscallNumber {
     type Error = KernelError;
     fn try_from(no: usize) -> Result<SyscallNumber, Self::Error> {
@@ -136,6 +169,16 @@ impl TryFrom<usize> for SyscallNumber {
             11 => Ok(SyscallNumber::ThreadCreate),
             12 => Ok(SyscallNumber::ThreadJoin),
             13 => Ok(SyscallNumber::ExitGroup),
+            21 => Ok(SyscallNumber::SetNice),
+            22 => Ok(SyscallNumber::SetAffinity),
+            23 => Ok(SyscallNumber::Futex),
+            24 => Ok(SyscallNumber::UringEnter),
+            25 => Ok(SyscallNumber::Readv),
+            26 => Ok(SyscallNumber::Writev),
+            27 => Ok(SyscallNumber::Preadv),
+            28 => Ok(SyscallNumber::Pwritev),
+            29 => Ok(SyscallNumber::CopyFileRange),
+            30 => Ok(SyscallNumber::Spawn),
             0x81 => Ok(SyscallNumber::GetPhys),
             _ => Err(KernelError::NoSuchSyscall),
         }
@@ -156,6 +199,13 @@ impl Task for Thread {
             SyscallNumber::Tell => self.with_file_struct_mut(|fs, abi| fs.tell(abi), &abi),
             SyscallNumber::Close => self.with_file_struct_mut(|fs, abi| fs.close(abi), &abi),
             SyscallNumber::Pipe => self.with_file_struct_mut(|fs, abi| fs.pipe(abi), &abi),
+            SyscallNumber::Readv => self.with_file_struct_mut(|fs, abi| fs.readv(abi), &abi),
+            SyscallNumber::Writev => self.with_file_struct_mut(|fs, abi| fs.writev(abi), &abi),
+            SyscallNumber::Preadv => self.with_file_struct_mut(|fs, abi| fs.preadv(abi), &abi),
+            SyscallNumber::Pwritev => self.with_file_struct_mut(|fs, abi| fs.pwritev(abi), &abi),
+            SyscallNumber::CopyFileRange => {
+                self.with_file_struct_mut(|fs, abi| fs.copy_file_range(abi), &abi)
+            }
             SyscallNumber::Mmap => {
                 self.with_file_mm_struct_mut(|fs, mm, abi| mm.mmap(fs, abi), &abi)
             }
@@ -176,9 +226,37 @@ impl Task for Thread {
                 },
                 &abi,
             ),
+            SyscallNumber::Spawn => self.with_file_struct_mut(
+                |fs, abi| {
+                    spawn(fs, abi, |name, file_struct, mm_struct| {
+                        let builder = ThreadBuilder::new(name);
+                        let tid = builder.get_tid();
+                        builder.attach_task(Box::new(Thread::from_file_mm_struct(
+                            file_struct,
+                            mm_struct,
+                            tid,
+                        )))
+                    })
+                },
+                &abi,
+            ),
             SyscallNumber::ThreadCreate => self.thread_create(&abi),
             SyscallNumber::ThreadJoin => self.thread_join(&abi),
             SyscallNumber::ExitGroup => self.exit_group(&abi),
+            SyscallNumber::SetNice => with_current(|th| th.set_nice(abi.arg1 as i32)).map(|_| 0),
+            SyscallNumber::SetAffinity => {
+                keos::thread::Current::set_affinity(abi.arg1 as u64).map(|_| 0)
+            }
+            SyscallNumber::Futex => {
+                keos::sync::futex::futex(abi.arg1, abi.arg2, abi.arg3, abi.arg4, abi.arg5)
+            }
+            SyscallNumber::UringEnter => keos::syscall::uring::enter(
+                abi.arg1,
+                abi.arg2,
+                &URING_SYSCALLS,
+                abi.regs,
+                |regs| self.syscall(regs),
+            ),
             SyscallNumber::GetPhys => {
                 self.with_file_mm_struct_mut(|fs, mm, abi| get_phys(mm, fs, abi), &abi)
             }
@@ -198,6 +276,7 @@ impl Task for Thread {
 
     /// Handles a page fault.
     fn page_fault(&mut self, ec: PFErrorCode, cr2: Va) {
+        acct::of_thread(self.tid, self.page_table_pa).count_fault();
         if !self.with_mm_struct_mut(
             |mm_struct, (ec, cr2)| {
                 let reason = PageFaultReason::new(ec, cr2);
@@ -230,4 +309,10 @@ impl Task for Thread {
     fn with_page_table_pa(&self, f: &fn(Pa)) {
         f(self.page_table_pa)
     }
+
+    /// Returns the account of the process, which the threads on its page
+    /// table share.
+    fn account(&self) -> Option<Arc<Account>> {
+        Some(acct::of_thread(self.tid, self.page_table_pa))
+    }
 }
@@ -103,6 +103,11 @@
 //! used efficiently and that no core remains idle while runnable threads exist
 //! elsewhere in the system.
 //!
+//! A thread may restrict the cores that it runs on with an affinity mask
+//! ([`Thread::set_affinity`]). The scheduler must respect the mask both when
+//! queueing and when stealing a thread: check it with [`Thread::can_run_on`],
+//! and use [`select_cpu`] to find the core to queue a thread on.
+//!
 //! Overall, the round-robin scheduler in KeOS offers a simple yet effective
 //! baseline for multicore scheduling, balancing responsiveness, fairness, and
 //! throughput across all available cores.
@@ -125,6 +130,9 @@
 //! [`ThreadBuilder::spawn`]: keos::thread::ThreadBuilder::spawn
 //! [`Scheduler`]: keos::thread::scheduler::Scheduler
 //! [`Scheduler::next_to_run`]: keos::thread::scheduler::Scheduler::next_to_run
+//! [`Thread::set_affinity`]: keos::thread::Thread::set_affinity
+//! [`Thread::can_run_on`]: keos::thread::Thread::can_run_on
+//! [`select_cpu`]: keos::thread::scheduler::select_cpu
 
 use alloc::{boxed::Box, collections::VecDeque};
 use keos::{
@@ -0,0 +1,64 @@
+//! Microbenchmarks of the kernel.
+//!
+//! Each test runs one benchmark of the `bench` program on the
+//! [`FastFileSystem`] with the [`PageCache`], and prints its result line.
+//! The output is not graded.
+//!
+//! [`FastFileSystem`]: keos_project5::ffs::FastFileSystem
+use crate::userprog::run_elf_with_arg;
+use keos::fs::Disk;
+use keos_project5::{ffs, page_cache::PageCache};
+
+/// Install `bench` into the root directory, and run it with `name`.
+fn run_bench(name: &str) {
+    let fs = ffs::FastFileSystem::from_disk(Disk::new(2), false, false).unwrap();
+    keos::fs::FileSystem::register(PageCache::new(fs));
+    let root = keos::fs::FileSystem::root();
+
+    let simple_fs = simple_fs::FileSystem::load(1).unwrap();
+    let simple_fs: &dyn keos::fs::traits::FileSystem = &simple_fs;
+    let org_bench = simple_fs
+        .root()
+        .unwrap()
+        .open("bench")
+        .unwrap()
+        .into_regular_file()
+        .unwrap();
+    let new_bench = root
+        .open("bench")
+        .or_else(|_| root.create("bench", false))
+        .unwrap()
+        .into_regular_file()
+        .unwrap();
+    keos::util::copy_file(&org_bench, &new_bench).unwrap();
+
+    assert_eq!(run_elf_with_arg("bench", &["/bin/bench", name]), 0);
+}
+
+pub fn null_syscall() {
+    run_bench("null_syscall");
+}
+
+pub fn pipe_pingpong() {
+    run_bench("pipe_pingpong");
+}
+
+pub fn fork_exit() {
+    run_bench("fork_exit");
+}
+
+pub fn thread_create_join() {
+    run_bench("thread_create_join");
+}
+
+pub fn anon_fault() {
+    run_bench("anon_fault");
+}
+
+pub fn file_fault() {
+    run_bench("file_fault");
+}
+
+pub fn file_io() {
+    run_bench("file_io");
+}
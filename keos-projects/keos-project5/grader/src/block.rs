@@ -0,0 +1,90 @@
+use alloc::vec;
+use keos::{
+    block::{self, Plug},
+    fs::{Disk, Sector},
+    thread::{ALL_CPUS, Current},
+};
+
+/// Sectors that the test writes to. Their contents are restored at the end.
+const START: usize = 4096;
+const NR_SECTORS: usize = 16;
+
+pub fn plug() {
+    // A plug holds the writes of a single cpu.
+    Current::set_affinity(1).unwrap();
+    let disk = Disk::new(2);
+    let mut saved = [0u8; NR_SECTORS * 512];
+    disk.read_many(Sector(START), &mut saved).unwrap();
+    let before = block::stat(2).unwrap();
+
+    let plug = Plug::new();
+    // Adjacent writes are merged in the plug list.
+    for i in 0..NR_SECTORS {
+        disk.write(Sector(START + i), &[i as u8; 512]).unwrap();
+    }
+    // A write inside a queued one overwrites it in place.
+    disk.write(Sector(START + 3), &[0xaa; 512]).unwrap();
+    // A read of a plugged write flushes the list first.
+    let mut buf = [0u8; 512];
+    disk.read(Sector(START + 3), &mut buf).unwrap();
+    assert_eq!(buf, [0xaa; 512], "A read must see the plugged write.");
+    disk.write(Sector(START + 5), &[0x55; 512]).unwrap();
+    plug.finish().unwrap();
+
+    let mut buf = [0u8; NR_SECTORS * 512];
+    disk.read_many(Sector(START), &mut buf).unwrap();
+    for (i, sector) in buf.as_chunks::<512>().0.iter().enumerate() {
+        let expected = match i {
+            3 => 0xaa,
+            5 => 0x55,
+            i => i as u8,
+        };
+        assert_eq!(
+            sector, &[expected; 512],
+            "Sector {} has a wrong content.",
+            i
+        );
+    }
+
+    let after = block::stat(2).unwrap();
+    assert_eq!(after.plugged - before.plugged, NR_SECTORS as u64 + 2);
+    assert!(
+        after.write_bios - before.write_bios <= 2,
+        "The plugged writes must be merged."
+    );
+
+    disk.write_many(Sector(START), &saved).unwrap();
+    Current::set_affinity(ALL_CPUS).unwrap();
+}
+
+/// Sectors of the buffers of [`large`], which do not fit in the slab.
+const NR_LARGE_SECTORS: usize = 512;
+
+pub fn large() {
+    // The buffers are only virtually contiguous, and the device must see
+    // each of their pages where it is.
+    let disk = Disk::new(2);
+    let mut saved = vec![0u8; NR_LARGE_SECTORS * 512];
+    disk.read_many(Sector(START), &mut saved).unwrap();
+
+    let mut pattern = vec![0u8; NR_LARGE_SECTORS * 512];
+    for (i, sector) in pattern.chunks_mut(512).enumerate() {
+        sector.fill(i as u8 ^ (i >> 8) as u8);
+    }
+    disk.write_many(Sector(START), &pattern).unwrap();
+    let mut buf = [0u8; 512];
+    for (i, sector) in pattern.chunks(512).enumerate() {
+        disk.read(Sector(START + i), &mut buf).unwrap();
+        assert_eq!(&buf, sector, "Sector {} has a wrong content.", i);
+    }
+
+    // A buffer that starts in the middle of a page.
+    let mut buf = vec![0u8; (NR_LARGE_SECTORS + 1) * 512];
+    disk.read_many(Sector(START), &mut buf[512..]).unwrap();
+    assert!(
+        buf[512..] == pattern[..],
+        "A large read must see the large write."
+    );
+
+    disk.write_many(Sector(START), &saved).unwrap();
+}
@@ -1,7 +1,7 @@
 use alloc::{borrow::ToOwned, boxed::Box};
 use keos::{
     KernelError,
-    fs::{Disk, FileSystem, InodeNumber, RegularFile},
+    fs::{Disk, FileBlockNumber, FileSystem, InodeNumber, RegularFile},
     println,
 };
 use keos_project2::loader::LoadContext;
@@ -254,6 +254,56 @@ pub fn remove_file() {
     );
 }
 
+pub fn near_block() {
+    let fs = ffs::FastFileSystem::from_disk(Disk::new(2), true, false).unwrap();
+    let inner = fs.0.clone();
+    let root = keos::fs::traits::FileSystem::root(&fs).unwrap();
+    let lba = |file: &RegularFile, fba| {
+        inner
+            .get_inode(file.ino())
+            .unwrap()
+            .read()
+            .get(&inner, FileBlockNumber(fba))
+            .unwrap()
+            .expect("Written block must be allocated.")
+    };
+    let create = |name| {
+        let file = root
+            .create(name, false)
+            .unwrap()
+            .into_regular_file()
+            .unwrap();
+        file.write(0, &[0x42; 4096]).unwrap();
+        file
+    };
+
+    let a = create("near_a");
+    let b = create("near_b");
+    keos::info!("Removing `near_b' to free its block.");
+    let free = inner.block_space.nr_free();
+    root.unlink("near_b").unwrap();
+    drop(b);
+    inner.sync_journal().unwrap();
+    assert_eq!(
+        inner.block_space.nr_free(),
+        free + 1,
+        "The block of the removed file must be counted as free."
+    );
+
+    let c = create("near_c");
+    keos::info!("Appending a block to `near_a'");
+    a.write(0x1000, &[0x42; 4096]).unwrap();
+    assert_eq!(
+        lba(&a, 1),
+        lba(&a, 0) + 1,
+        "The appended block must follow the last block of the file if it is free."
+    );
+
+    drop(c);
+    root.unlink("near_a").unwrap();
+    root.unlink("near_c").unwrap();
+}
+
 pub fn read_dir() {
     let fs = ffs::FastFileSystem::from_disk(Disk::new(2), true, false).unwrap();
     keos::fs::FileSystem::register(PageCache::new(fs));
@@ -14,6 +14,8 @@ extern crate keos_project3;
 extern crate keos_project4;
 extern crate keos_project5;
 
+pub mod bench;
+pub mod block;
 pub mod ffs;
 pub mod ffs_no_journal;
 pub mod journal;
@@ -36,9 +38,14 @@ pub unsafe fn main(config_builder: SystemConfigurationBuilder) {
         panic!("FFS is not available");
     }
     keos::TestDriver::<Thread>::start([
+        /* Block Request Layer Tests */
+        &block::plug,
+        &block::large,
         /* Page Cache Tests */
         &page_cache::simplefs,
         &page_cache::readahead,
+        &page_cache::reclaim,
+        &page_cache::reclaim_on_alloc,
         /* FFS Functionality Tests */
         &ffs_no_journal::root,
         &ffs_no_journal::root_open_self,
@@ -77,6 +84,7 @@ pub unsafe fn main(config_builder: SystemConfigurationBuilder) {
         &ffs::add_directory,
         &ffs::file_in_dir,
         &ffs::remove_file,
+        &ffs::near_block,
         &ffs::read_dir,
         &ffs::remove_dir,
         &ffs::remove_root,
@@ -86,6 +94,15 @@ pub unsafe fn main(config_builder: SystemConfigurationBuilder) {
         &userprog::ls,
         &userprog::tar,
         &userprog::tar_gen,
+        &userprog::copy_range,
+        /* Microbenchmarks */
+        &bench::null_syscall,
+        &bench::pipe_pingpong,
+        &bench::fork_exit,
+        &bench::thread_create_join,
+        &bench::anon_fault,
+        &bench::file_fault,
+        &bench::file_io,
     ]);
 }
 
@@ -1,5 +1,7 @@
 use keos::{
+    addressing::Kva,
     fs::{Disk, FileBlockNumber, RegularFile, traits::FileSystem},
+    mm::{ContigPages, Page},
     println,
 };
 use keos_project5::{
@@ -253,3 +255,114 @@ pub fn writeback() {
         "After writeback of page cache, the disk content should be reflected"
     );
 }
+
+pub fn reclaim() {
+    println!();
+    let page_cache = PageCache::new(simple_fs::FileSystem::load(1).unwrap());
+    let fs: &dyn keos::fs::traits::FileSystem = &page_cache;
+
+    let root = fs.root().expect("Root directory must be present");
+
+    let f: RegularFile = root
+        .open("os-release")
+        .expect("file `os-release' must be present on the root directory.")
+        .into_regular_file()
+        .expect("file `os-release' must be a RegularFile");
+
+    let mut buffer: [u8; 4096] = [0u8; 4096];
+    f.read(0, &mut buffer)
+        .expect("Reading file `os-release' must succeed");
+
+    let before = keos::mm::reclaim::stat().reclaimed;
+    let mut cached = true;
+    // The shrinker gives up while the readahead thread holds the cache.
+    for _ in 0..100 {
+        keos::mm::reclaim::reclaim(usize::MAX);
+        let mut guard = page_cache.0.inner.lock();
+        cached = cache_exists(&mut guard, f.clone(), FileBlockNumber(0));
+        guard.unlock();
+        if !cached {
+            break;
+        }
+        keos::thread::scheduler::scheduler().reschedule();
+    }
+    assert!(
+        !cached,
+        "A clean slot that no one maps must be released on memory pressure"
+    );
+    assert!(keos::mm::reclaim::stat().reclaimed > before);
+
+    let mut reread: [u8; 4096] = [0u8; 4096];
+    f.read(0, &mut reread)
+        .expect("Reading file `os-release' must succeed");
+    assert_eq!(
+        buffer, reread,
+        "A released slot must be read again from the disk"
+    );
+
+    // Prevent fs drop after the test finish
+    keos::fs::FileSystem::register(page_cache);
+}
+
+pub fn reclaim_on_alloc() {
+    println!();
+    let page_cache = PageCache::new(simple_fs::FileSystem::load(1).unwrap());
+    let fs: &dyn keos::fs::traits::FileSystem = &page_cache;
+
+    let root = fs.root().expect("Root directory must be present");
+
+    let f: RegularFile = root
+        .open("os-release")
+        .expect("file `os-release' must be present on the root directory.")
+        .into_regular_file()
+        .expect("file `os-release' must be a RegularFile");
+
+    let mut buffer: [u8; 4096] = [0u8; 4096];
+    f.read(0, &mut buffer)
+        .expect("Reading file `os-release' must succeed");
+    // The shrinker gives up while the readahead thread holds the cache.
+    for _ in 0..100 {
+        if let Ok(guard) = page_cache.0.inner.try_lock() {
+            guard.unlock();
+            break;
+        }
+        keos::thread::scheduler::scheduler().reschedule();
+    }
+
+    // Take every free page, so that the next `Page::new` runs out of memory.
+    // A vector could not grow, so the blocks are chained through their first
+    // words.
+    let before = keos::mm::reclaim::stat();
+    let mut hogged = 0;
+    for size in [0x200000, 0x1000] {
+        while let Some(pages) = ContigPages::new(size) {
+            let kva = pages.kva().into_usize();
+            core::mem::forget(pages);
+            unsafe { *(kva as *mut [usize; 2]) = [hogged, size] };
+            hogged = kva;
+        }
+    }
+    let page = Page::new();
+    let after = keos::mm::reclaim::stat();
+    while hogged != 0 {
+        let [next, size] = unsafe { *(hogged as *const [usize; 2]) };
+        drop(unsafe { ContigPages::from_va(Kva::new(hogged).unwrap(), size) });
+        hogged = next;
+    }
+    drop(page);
+
+    assert!(
+        after.stalls > before.stalls && after.reclaimed > before.reclaimed,
+        "An allocation that runs out of memory must reclaim the page cache"
+    );
+    let mut reread: [u8; 4096] = [0u8; 4096];
+    f.read(0, &mut reread)
+        .expect("Reading file `os-release' must succeed");
+    assert_eq!(
+        buffer, reread,
+        "A released slot must be read again from the disk"
+    );
+
+    // Prevent fs drop after the test finish
+    keos::fs::FileSystem::register(page_cache);
+}
@@ -314,3 +314,36 @@ pub fn tar_gen() {
         0
     );
 }
+
+/// Mount a [`FastFileSystem`] with the [`PageCache`] as the root, and copy
+/// the program `name` into it from the simple file system.
+///
+/// [`FastFileSystem`]: ffs::FastFileSystem
+fn install(name: &str) {
+    let fs = ffs::FastFileSystem::from_disk(Disk::new(2), false, false).unwrap();
+    keos::fs::FileSystem::register(PageCache::new(fs));
+    let root = keos::fs::FileSystem::root();
+
+    let simple_fs = simple_fs::FileSystem::load(1).unwrap();
+    let simple_fs: &dyn keos::fs::traits::FileSystem = &simple_fs;
+    let org = simple_fs
+        .root()
+        .unwrap()
+        .open(name)
+        .unwrap()
+        .into_regular_file()
+        .unwrap();
+    let new = root
+        .create(name, false)
+        .unwrap()
+        .into_regular_file()
+        .unwrap();
+    keos::util::copy_file(&org, &new).unwrap();
+}
+
+#[stdin(b"")]
+#[assert_output(b"success ")]
+pub fn copy_range() {
+    install("copy_range");
+    run_elf("copy_range");
+}
@@ -0,0 +1,299 @@
+#include <debug.h>
+#include <fcntl.h>
+#include <mman.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include <thread.h>
+#include <vdso.h>
+
+/* Microbenchmarks of the KeOS system calls, page faults and page cache.
+ *
+ * Usage: bench [name...]
+ *
+ * Runs the named benchmarks, or all of them. Each one times every operation
+ * with rdtsc, after WARMUP untimed operations, and prints one line:
+ *   bench <name> ops=<n> bytes=<per op> min=<c> p50=<c> p90=<c> p99=<c>
+ *   max=<c> mean=<c>
+ * where <c> are cycles per operation, the cost of rdtsc included. The first
+ * line is "bench-info tsc_khz=<khz>", to convert the cycles to time; it is 0
+ * if the kernel does not expose the clock.
+ */
+
+#define MAX_SAMPLES 4096
+#define WARMUP 64
+#define PAGE_SIZE 0x1000
+
+/* Addresses of the mappings; away from the program and the malloc heap. */
+#define STACK_ADDR ((void *)0xA000)
+#define ANON_ADDR ((void *)0x30000000)
+#define FILE_ADDR ((void *)0x38000000)
+
+#define FAULT_PAGES 256
+#define FILE_SIZE (4 * 1024 * 1024)
+#define CHUNK_SIZE (64 * 1024)
+
+static uint64_t samples[MAX_SAMPLES];
+static size_t nr_samples;
+static unsigned char buf[CHUNK_SIZE];
+
+static inline uint64_t rdtsc(void) {
+  uint32_t lo, hi;
+  __asm__ volatile("lfence; rdtsc; lfence" : "=a"(lo), "=d"(hi)::"memory");
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static void record(uint64_t start) {
+  uint64_t end = rdtsc();
+  if (nr_samples < MAX_SAMPLES)
+    samples[nr_samples++] = end - start;
+}
+
+static uint64_t seed = 1;
+static uint32_t rand32(void) {
+  seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return seed >> 32;
+}
+
+static int compare(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Prints the statistics of the recorded samples, and clears them. */
+static void report(const char *name, size_t bytes) {
+  uint64_t sum = 0;
+  size_t n = nr_samples;
+
+  ASSERT(n > 0);
+  qsort(samples, n, sizeof samples[0], compare);
+  for (size_t i = 0; i < n; i++)
+    sum += samples[i];
+  printf("bench %s ops=%zu bytes=%zu min=%llu p50=%llu p90=%llu p99=%llu "
+         "max=%llu mean=%llu\n",
+         name, n, bytes, samples[0], samples[n / 2], samples[n * 90 / 100],
+         samples[n * 99 / 100], samples[n - 1], sum / n);
+  nr_samples = 0;
+}
+
+/* A system call that the kernel rejects without doing any work. */
+static void bench_null_syscall(void) {
+  for (int i = 0; i < WARMUP + MAX_SAMPLES; i++) {
+    if (i == WARMUP)
+      nr_samples = 0;
+    uint64_t t = rdtsc();
+    syscall0(0x7f);
+    record(t);
+  }
+  report("null_syscall", 0);
+}
+
+/* One byte sent to a child and back, through two pipes. */
+static void bench_pipe_pingpong(void) {
+  int to_child[2], to_parent[2];
+  char c = 0;
+
+  ASSERT(pipe(to_child) == 0 && pipe(to_parent) == 0);
+  int pid = fork();
+  ASSERT(pid >= 0);
+  if (pid == 0) {
+    close(to_child[1]);
+    close(to_parent[0]);
+    while (read(to_child[0], &c, 1) == 1)
+      ASSERT(write(to_parent[1], &c, 1) == 1);
+    exit(0);
+  }
+  close(to_child[0]);
+  close(to_parent[1]);
+
+  for (int i = 0; i < WARMUP + 1024; i++) {
+    if (i == WARMUP)
+      nr_samples = 0;
+    uint64_t t = rdtsc();
+    ASSERT(write(to_child[1], &c, 1) == 1);
+    ASSERT(read(to_parent[0], &c, 1) == 1);
+    record(t);
+  }
+  close(to_child[1]);
+  close(to_parent[0]);
+  report("pipe_pingpong", 1);
+}
+
+/* A fork whose child exits at once. The parent waits for the exit by reading
+   a pipe until the child end is closed. */
+static void bench_fork_exit(void) {
+  char c;
+
+  for (int i = 0; i < 8 + 256; i++) {
+    int fds[2];
+    if (i == 8)
+      nr_samples = 0;
+    ASSERT(pipe(fds) == 0);
+    uint64_t t = rdtsc();
+    int pid = fork();
+    ASSERT(pid >= 0);
+    if (pid == 0)
+      exit(0);
+    close(fds[1]);
+    ASSERT(read(fds[0], &c, 1) == 0);
+    record(t);
+    close(fds[0]);
+  }
+  report("fork_exit", 0);
+}
+
+static int thread_fn(void *arg) {
+  exit(0);
+  __builtin_unreachable();
+}
+
+/* A thread that exits at once, and the join of it. */
+static void bench_thread_create_join(void) {
+  ASSERT(mmap(STACK_ADDR, STACK_SIZE, PROT_READ | PROT_WRITE, -1, 0) ==
+         STACK_ADDR);
+
+  for (int i = 0; i < WARMUP + 1024; i++) {
+    int code;
+    if (i == WARMUP)
+      nr_samples = 0;
+    uint64_t t = rdtsc();
+    int tid = thread_create("bench", STACK_ADDR + STACK_SIZE, thread_fn, NULL);
+    ASSERT(tid > 0);
+    ASSERT(thread_join(tid, &code) == 0 && code == 0);
+    record(t);
+  }
+  munmap(STACK_ADDR);
+  report("thread_create_join", 0);
+}
+
+/* The first write to each page of an anonymous mapping. */
+static void bench_anon_fault(void) {
+  for (int round = 0; round < 1 + 8; round++) {
+    volatile char *p = mmap(ANON_ADDR, FAULT_PAGES * PAGE_SIZE,
+                            PROT_READ | PROT_WRITE, -1, 0);
+    ASSERT(p == ANON_ADDR);
+    if (round == 1)
+      nr_samples = 0;
+    for (int i = 0; i < FAULT_PAGES; i++) {
+      uint64_t t = rdtsc();
+      p[i * PAGE_SIZE] = 1;
+      record(t);
+    }
+    ASSERT(munmap(ANON_ADDR) == 0);
+  }
+  report("anon_fault", PAGE_SIZE);
+}
+
+/* Creates NAME with SIZE bytes, and returns it opened for reading and
+   writing. */
+static int open_file(char *name, size_t size) {
+  unlink(name);
+  ASSERT(create(name) == 0);
+  int fd = open(name, O_RDWR);
+  ASSERT(fd >= 0);
+  memset(buf, 0x5a, sizeof buf);
+  for (size_t off = 0; off < size; off += CHUNK_SIZE)
+    ASSERT(write(fd, buf, CHUNK_SIZE) == CHUNK_SIZE);
+  return fd;
+}
+
+/* The first read of each page of a file mapping. The pages are in the page
+   cache after the first round, which is not timed. */
+static void bench_file_fault(void) {
+  int fd = open_file("bench.map", FAULT_PAGES * PAGE_SIZE);
+
+  for (int round = 0; round < 1 + 8; round++) {
+    volatile char *p =
+        mmap(FILE_ADDR, FAULT_PAGES * PAGE_SIZE, PROT_READ, fd, 0);
+    ASSERT(p == FILE_ADDR);
+    if (round == 1)
+      nr_samples = 0;
+    for (int i = 0; i < FAULT_PAGES; i++) {
+      uint64_t t = rdtsc();
+      ASSERT(p[i * PAGE_SIZE] == 0x5a);
+      record(t);
+    }
+    ASSERT(munmap(FILE_ADDR) == 0);
+  }
+  close(fd);
+  unlink("bench.map");
+  report("file_fault", PAGE_SIZE);
+}
+
+/* Passes over a file, CHUNK_SIZE bytes at a time. */
+static void bench_file_seq(int fd, bool writing) {
+  for (int pass = 0; pass < 1 + 8; pass++) {
+    ASSERT(seek(fd, 0, SEEK_SET) == 0);
+    if (pass == 1)
+      nr_samples = 0;
+    for (size_t off = 0; off < FILE_SIZE; off += CHUNK_SIZE) {
+      uint64_t t = rdtsc();
+      ssize_t n =
+          writing ? write(fd, buf, CHUNK_SIZE) : read(fd, buf, CHUNK_SIZE);
+      ASSERT(n == CHUNK_SIZE);
+      record(t);
+    }
+  }
+  report(writing ? "file_seq_write" : "file_seq_read", CHUNK_SIZE);
+}
+
+/* Pages of a file at random offsets. */
+static void bench_file_rand(int fd, bool writing) {
+  for (int i = 0; i < WARMUP + 1024; i++) {
+    if (i == WARMUP)
+      nr_samples = 0;
+    off_t off = rand32() % (FILE_SIZE / PAGE_SIZE) * PAGE_SIZE;
+    uint64_t t = rdtsc();
+    ASSERT(seek(fd, off, SEEK_SET) == off);
+    ssize_t n =
+        writing ? write(fd, buf, PAGE_SIZE) : read(fd, buf, PAGE_SIZE);
+    ASSERT(n == PAGE_SIZE);
+    record(t);
+  }
+  report(writing ? "file_rand_write" : "file_rand_read", PAGE_SIZE);
+}
+
+static void bench_file_io(void) {
+  int fd = open_file("bench.dat", FILE_SIZE);
+
+  bench_file_seq(fd, true);
+  bench_file_seq(fd, false);
+  bench_file_rand(fd, true);
+  bench_file_rand(fd, false);
+  close(fd);
+  unlink("bench.dat");
+}
+
+static const struct {
+  const char *name;
+  void (*fn)(void);
+} benches[] = {
+    {"null_syscall", bench_null_syscall},
+    {"pipe_pingpong", bench_pipe_pingpong},
+    {"fork_exit", bench_fork_exit},
+    {"thread_create_join", bench_thread_create_join},
+    {"anon_fault", bench_anon_fault},
+    {"file_fault", bench_file_fault},
+    {"file_io", bench_file_io},
+};
+
+#define NR_BENCHES (sizeof benches / sizeof benches[0])
+
+int main(int argc, char *argv[]) {
+  const volatile struct vdso_data *vdso = (void *)VDSO_ADDR;
+
+  printf("bench-info tsc_khz=%llu\n", (uint64_t)vdso->tsc_khz);
+  for (size_t i = 0; i < NR_BENCHES; i++) {
+    bool run = argc < 2;
+    for (int j = 1; j < argc; j++)
+      run |= !strcmp(argv[j], benches[i].name);
+    if (run) {
+      benches[i].fn();
+      fflush(stdout);
+    }
+  }
+  return 0;
+}
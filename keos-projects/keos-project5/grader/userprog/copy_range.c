@@ -0,0 +1,53 @@
+#include <debug.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+
+#define SIZE 10000
+
+static char data[SIZE], buf[SIZE];
+
+int main(int argc, char *argv[]) {
+  int src, dst;
+  off_t off_in, off_out;
+
+  for (int i = 0; i < SIZE; i++)
+    data[i] = 'a' + i % 23;
+  ASSERT(create("copy_range__src") == 0);
+  ASSERT(create("copy_range__dst") == 0);
+  src = open("copy_range__src", O_RDWR);
+  dst = open("copy_range__dst", O_RDWR);
+  ASSERT(src >= 3 && dst >= 3);
+  ASSERT(write(src, data, SIZE) == SIZE);
+  ASSERT(seek(src, 0, SEEK_SET) == 0);
+
+  /* Without offsets, the file positions move. */
+  ASSERT(copy_file_range(src, NULL, dst, NULL, 5000, 0) == 5000);
+  ASSERT(tell(src) == 5000 && tell(dst) == 5000);
+
+  /* With offsets, the offsets move and the positions do not. */
+  off_in = 5000;
+  off_out = 5000;
+  ASSERT(copy_file_range(src, &off_in, dst, &off_out, SIZE, 0) == 5000);
+  ASSERT(off_in == SIZE && off_out == SIZE);
+  ASSERT(tell(src) == 5000 && tell(dst) == 5000);
+
+  /* Nothing is left at the end of the source. */
+  ASSERT(copy_file_range(src, &off_in, dst, &off_out, SIZE, 0) == 0);
+
+  ASSERT(seek(dst, 0, SEEK_SET) == 0);
+  ASSERT(read(dst, buf, SIZE) == SIZE);
+  ASSERT(memcmp(data, buf, SIZE) == 0);
+
+  /* The errors. */
+  off_in = 0;
+  off_out = 100;
+  ASSERT(copy_file_range(src, &off_in, src, &off_out, 1000, 0) < 0);
+  ASSERT(copy_file_range(src, NULL, dst, NULL, 10, 1) < 0);
+  ASSERT(copy_file_range(src, NULL, 100, NULL, 10, 0) < 0);
+  ASSERT(copy_file_range(0, NULL, dst, NULL, 10, 0) < 0);
+
+  printf("success ");
+  return 0;
+}
@@ -84,6 +84,9 @@ int main(int argc, char *argv[]) {
     int show_all = 0;
     const char *dir_path = ".";
 
+    // A listing prints many short fragments; write them out in one go.
+    setvbuf(stdout, NULL, _IOFBF, 0);
+
     // Parse command line arguments
     for (int i = 1; i < argc; i++) {
         if (argv[i][0] == '-') {
@@ -0,0 +1,143 @@
+#include <debug.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Compares qsort() with the byte-swapping heapsort that it replaced.
+ *
+ * Usage: sortbench [count]
+ *
+ * Prints one line per pattern and element size:
+ *   sortbench <pattern> <size> <count> <heapsort cycles> <qsort cycles>
+ */
+
+#define ROUNDS 3
+
+struct elem16 {
+  uint32_t key;
+  uint32_t pad[3];
+};
+
+static uint64_t rdtsc(void) {
+  uint32_t lo, hi;
+  __asm__ volatile("lfence; rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static uint64_t seed = 1;
+static uint32_t rand32(void) {
+  seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return seed >> 32;
+}
+
+static int compare(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* The previous implementation of qsort(). */
+static void byte_swap(unsigned char *a, unsigned char *b, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    unsigned char t = a[i];
+    a[i] = b[i];
+    b[i] = t;
+  }
+}
+
+static void old_heapify(unsigned char *array, size_t i, size_t cnt,
+                        size_t size) {
+  for (;;) {
+    size_t left = 2 * i, right = 2 * i + 1, max = i;
+    if (left <= cnt &&
+        compare(array + (left - 1) * size, array + (max - 1) * size) > 0)
+      max = left;
+    if (right <= cnt &&
+        compare(array + (right - 1) * size, array + (max - 1) * size) > 0)
+      max = right;
+    if (max == i)
+      break;
+    byte_swap(array + (i - 1) * size, array + (max - 1) * size, size);
+    i = max;
+  }
+}
+
+static void old_sort(void *array, size_t cnt, size_t size) {
+  for (size_t i = cnt / 2; i > 0; i--)
+    old_heapify(array, i, cnt, size);
+  for (size_t i = cnt; i > 1; i--) {
+    byte_swap(array, (unsigned char *)array + (i - 1) * size, size);
+    old_heapify(array, 1, i - 1, size);
+  }
+}
+
+static const char *patterns[] = {"random", "sorted", "reversed", "few_unique",
+                                 "organ_pipe"};
+
+static void fill(void *array, size_t cnt, size_t size, int pattern) {
+  for (size_t i = 0; i < cnt; i++) {
+    uint32_t key;
+    switch (pattern) {
+    case 0:
+      key = rand32();
+      break;
+    case 1:
+      key = i;
+      break;
+    case 2:
+      key = cnt - i;
+      break;
+    case 3:
+      key = rand32() % 8;
+      break;
+    default:
+      key = i < cnt / 2 ? i : cnt - i;
+      break;
+    }
+    memset((char *)array + i * size, 0, size);
+    memcpy((char *)array + i * size, &key, sizeof key);
+  }
+}
+
+static void check(const void *array, size_t cnt, size_t size) {
+  for (size_t i = 1; i < cnt; i++)
+    ASSERT(compare((const char *)array + (i - 1) * size,
+                   (const char *)array + i * size) <= 0);
+}
+
+int main(int argc, char *argv[]) {
+  size_t cnt = argc > 1 ? (size_t)atoi(argv[1]) : 100000;
+  static const size_t sizes[] = {sizeof(uint32_t), sizeof(struct elem16)};
+
+  void *array = malloc(cnt * sizeof(struct elem16));
+  ASSERT(array != NULL);
+  setvbuf(stdout, NULL, _IOFBF, 0);
+
+  for (size_t s = 0; s < sizeof sizes / sizeof sizes[0]; s++) {
+    size_t size = sizes[s];
+    for (int p = 0; p < (int)(sizeof patterns / sizeof patterns[0]); p++) {
+      uint64_t best_old = UINT64_MAX, best_new = UINT64_MAX;
+      for (int round = 0; round < ROUNDS; round++) {
+        fill(array, cnt, size, p);
+        uint64_t start = rdtsc();
+        old_sort(array, cnt, size);
+        uint64_t cycles = rdtsc() - start;
+        check(array, cnt, size);
+        if (cycles < best_old)
+          best_old = cycles;
+
+        fill(array, cnt, size, p);
+        start = rdtsc();
+        qsort(array, cnt, size, compare);
+        cycles = rdtsc() - start;
+        check(array, cnt, size);
+        if (cycles < best_new)
+          best_new = cycles;
+      }
+      printf("sortbench %s %zu %zu %llu %llu\n", patterns[p], size, cnt,
+             best_old, best_new);
+    }
+  }
+  free(array);
+  return 0;
+}
@@ -0,0 +1,81 @@
+//! Charges of the page cache slots to the processes.
+//!
+//! A slot of the page cache is charged to the [`Account`] of the process
+//! that first accesses it through the overlay, which is the process that
+//! brought it in, or the reader that the readahead loaded it for. The
+//! overlay charges the blocks of each access with [`CacheCharges::charge`]
+//! after the page cache served it, as the page cache inserts the slots by
+//! itself.
+//!
+//! A charge outlives its slot until the next time that the charges are
+//! trimmed, i.e., when there are more charges than [`CACHE_SLOTS`], or when
+//! a process goes beyond its memory limit. In the latter case, the clean
+//! slots of the process are evicted first, and then the other shrinkers of
+//! the account are asked to release its pages, rather than pushing out the
+//! slots of the other processes.
+use crate::{
+    page_cache::PageCacheState,
+    writeback::{self, CACHE_SLOTS},
+};
+use alloc::{collections::BTreeMap, sync::Arc};
+use core::ops::Range;
+use keos::{
+    acct::{self, CacheCharge},
+    fs::{FileBlockNumber, InodeNumber},
+    sync::SpinLock,
+};
+use keos_project4::sync::mutex::Mutex;
+
+/// The charges of the slots of a page cache.
+pub struct CacheCharges(SpinLock<BTreeMap<(InodeNumber, FileBlockNumber), CacheCharge>>);
+
+impl CacheCharges {
+    /// Create an empty set of charges.
+    pub const fn new() -> Self {
+        Self(SpinLock::new(BTreeMap::new()))
+    }
+
+    /// Charge the cached blocks in `blocks` of `ino` that are not charged
+    /// yet to the current process, if any, and keep the process within its
+    /// memory limit.
+    pub fn charge(&self, state: &Mutex<PageCacheState>, ino: InodeNumber, blocks: Range<usize>) {
+        let Some(account) = acct::current() else {
+            return;
+        };
+        let mut guard = state.lock();
+        let mut charges = self.0.lock();
+        for fba in blocks.map(FileBlockNumber) {
+            if guard.contains_key(&(ino, fba)) && !charges.contains_key(&(ino, fba)) {
+                charges.insert((ino, fba), account.charge_cache());
+            }
+        }
+        if charges.len() > CACHE_SLOTS || account.excess() > 0 {
+            charges.retain(|id, _| guard.contains_key(id));
+        }
+        let excess = account.excess();
+        let mut released = 0;
+        if excess > 0 {
+            guard.retain(|id, slot| {
+                let own = charges
+                    .get(id)
+                    .is_some_and(|charge| Arc::ptr_eq(charge.account(), &account));
+                if released < excess && own && writeback::is_idle(slot) {
+                    charges.remove(id);
+                    released += 1;
+                    false
+                } else {
+                    true
+                }
+            });
+        }
+        charges.unlock();
+        guard.unlock();
+        account.reclaim(excess - released);
+    }
+}
+
+impl Default for CacheCharges {
+    fn default() -> Self {
+        Self::new()
+    }
+}
@@ -10,7 +10,7 @@
 //!
 //! [`disk_layout`]: super::disk_layout
 use crate::ffs::{
-    FastFileSystemInner, LogicalBlockAddress, RunningTransaction,
+    FastFileSystemInner, FileBlockNumber, LogicalBlockAddress, RunningTransaction,
     disk_layout::{InodeArray, Private, SuperBlock},
     inode::Inode,
 };
@@ -78,12 +78,7 @@ impl SuperBlock {
         let b = Arc::new(SpinLock::new([0; 4096]));
         {
             let mut guard = b.lock();
-            for i in 0..8 {
-                disk.read(
-                    Sector(i),
-                    guard[512 * i..512 * (i + 1)].as_mut_array().unwrap(),
-                )?;
-            }
+            disk.read_many(Sector(0), &mut guard[..])?;
             guard.unlock();
         }
         Ok(BlockPointsTo {
@@ -167,12 +162,7 @@ impl<M: MetaData> BlockPointsTo<M> {
     /// Reload in-memory structure to synchronize with on-disk structure
     pub fn reload(&self, disk: &Disk) -> Result<(), KernelError> {
         let mut guard = self.b.lock();
-        for i in 0..8 {
-            disk.read(
-                self.lba.into_sector() + i,
-                guard[512 * i..512 * (i + 1)].as_mut_array().unwrap(),
-            )?;
-        }
+        disk.read_many(self.lba.into_sector(), &mut guard[..])?;
         guard.unlock();
         Ok(())
     }
@@ -255,12 +245,16 @@ impl<M: MetaData> BlockPointsToWriteGuard<'_, '_, '_, M> {
     /// This function marks the block as dirty and ensures it will be written
     /// to disk as part of the journal. After calling `submit`, the guard is
     /// consumed.
+    ///
+    /// A submitted bitmap block also updates the in-memory summary of the
+    /// free space.
     pub fn submit(mut self) {
-        self.tx.write_meta(
-            self.lba,
-            Box::new(**self.b.as_ref().unwrap()),
-            core::any::type_name::<M>(),
-        );
+        let ty = core::any::type_name::<M>();
+        let b = self.b.as_ref().unwrap();
+        self.tx.ffs.bitmap_submitted(self.lba, b);
+        if let Some(data) = self.tx.ffs.defer_meta(self.lba, Box::new(**b), ty) {
+            self.tx.write_meta(self.lba, data, ty);
+        }
         let _ = unsafe { core::ptr::read(&self.b.as_ref().unwrap()) };
         self.b.take().unwrap().unlock();
         let _ = core::mem::ManuallyDrop::new(self);
@@ -322,7 +316,8 @@ impl Drop for TrackedInode {
                 // There is no way to access this file.
                 let mem_layout = inode.write();
                 if mem_layout.link_count == 0 {
-                    let tx = ffs.open_transaction("File::remove");
+                    // Reclaimed with the next group commit.
+                    let tx = ffs.open_deferred("File::remove");
                     if let Some((lba, index)) = tx.ffs.get_inode_array_lba_index(mem_layout.ino)
                         && let Ok(inode_array) = InodeArray::load(tx.ffs, lba)
                     {
@@ -340,6 +335,10 @@ impl Drop for TrackedInode {
                         sb.submit();
 
                         let ino = guard.ino;
+                        // The inode number may be reused by another directory.
+                        let mut dir_index = ffs.dir_index.lock();
+                        dir_index.remove(&ino);
+                        dir_index.unlock();
 
                         guard.disk_layout[index].ino = None;
                         guard.do_submit();
@@ -426,12 +425,24 @@ impl TrackedInode {
             .get_inode_array_lba_index(mem_layout.ino)
             .ok_or(KernelError::FilesystemCorrupted("Invalid Inode number."))?;
         let inode_array = InodeArray::load(tx.ffs, lba)?;
+        // The blocks allocated by `f` follow the last block of the file.
+        let goal = match mem_layout.size.div_ceil(0x1000) {
+            0 => None,
+            n => mem_layout
+                .get(tx.ffs, FileBlockNumber(n - 1))
+                .ok()
+                .flatten()
+                .map(|lba| lba + 1),
+        };
+        let prev = tx.ffs.set_block_goal(goal);
         let disk_layout = inode_array.write(tx);
-        f(TrackedInodeWriteGuard {
+        let result = f(TrackedInodeWriteGuard {
             mem_layout,
             disk_layout,
             index,
-        })
+        });
+        tx.ffs.set_block_goal(prev);
+        result
     }
 }
 
@@ -0,0 +1,263 @@
+//! Hashed index of the large directories.
+//!
+//! A directory is a flat array of [`DirectoryBlockEntry`]s, so finding a name
+//! reads every block of the directory. For a directory of at least
+//! [`INDEX_MIN_BLOCKS`] blocks, the file system keeps a [`DirIndex`] in
+//! memory: the slot of each entry by the hash of its name, and the free
+//! slots. A lookup then reads only the blocks of the entries whose hashes
+//! collide with the name, which is a single block in the expected case, and
+//! an insertion finds a free slot without scanning.
+//!
+//! The index is built from the directory blocks on the first use. The
+//! [`vfs::Directory`] looks up the names through it, and brings it up to
+//! date after each `create` and `unlink` of the wrapped directory, i.e.,
+//! only once their transaction is committed. An index that does not match
+//! the directory afterwards is dropped, and rebuilt on the next use. The
+//! on-disk format does not change, and smaller directories are scanned as
+//! before.
+//!
+//! [`vfs::Directory`]: crate::ffs::vfs::Directory
+use super::{
+    FastFileSystemInner, FileBlockNumber, InodeNumber,
+    access_control::MetaData,
+    disk_layout::{DirectoryBlock, DirectoryBlockEntry},
+    inode::Inode,
+};
+use alloc::{
+    collections::{BTreeMap, BTreeSet},
+    sync::Arc,
+    vec::Vec,
+};
+use keos::{KernelError, sync::SpinLock};
+
+/// Number of the blocks from which a directory is indexed.
+pub const INDEX_MIN_BLOCKS: usize = 4;
+
+/// Number of the entries of a directory block.
+pub const ENTRIES_PER_BLOCK: usize = 4096 / core::mem::size_of::<DirectoryBlockEntry>();
+
+/// In-memory index of a directory.
+///
+/// A slot is the position of an entry in the directory, i.e., the entry
+/// `slot % ENTRIES_PER_BLOCK` of the block `slot / ENTRIES_PER_BLOCK`.
+pub struct DirIndex {
+    /// (hash of the name, slot) of each entry.
+    entries: BTreeSet<(u64, usize)>,
+    /// The free slots.
+    free: BTreeSet<usize>,
+    /// Size of the directory covered by the index.
+    size: usize,
+}
+
+impl DirIndex {
+    /// Hashes a name with FNV-1a.
+    fn hash(name: &str) -> u64 {
+        name.bytes().fold(0xcbf2_9ce4_8422_2325, |h, b| {
+            (h ^ b as u64).wrapping_mul(0x0100_0000_01b3)
+        })
+    }
+
+    /// Builds the index by reading every block of the directory `inode`.
+    pub fn build(ffs: &FastFileSystemInner, inode: &Inode) -> Result<Self, KernelError> {
+        let mut this = Self {
+            entries: BTreeSet::new(),
+            free: BTreeSet::new(),
+            size: inode.size,
+        };
+        for fba in 0..inode.size.div_ceil(4096) {
+            let lba = inode
+                .get(ffs, FileBlockNumber(fba))?
+                .ok_or(KernelError::FilesystemCorrupted("Directory hole"))?;
+            let blk = DirectoryBlock::load(ffs, lba)?;
+            let guard = blk.read();
+            for (i, en) in guard.iter().enumerate() {
+                let slot = fba * ENTRIES_PER_BLOCK + i;
+                match en.name() {
+                    Some(name) => {
+                        this.entries.insert((Self::hash(name), slot));
+                    }
+                    None if en.inode.is_none() => {
+                        this.free.insert(slot);
+                    }
+                    None => (),
+                }
+            }
+        }
+        Ok(this)
+    }
+
+    /// Returns true if the index covers a directory of `size` bytes.
+    pub fn covers(&self, size: usize) -> bool {
+        self.size == size
+    }
+
+    /// Returns the slots that may hold `name`.
+    pub fn candidates(&self, name: &str) -> Vec<usize> {
+        let h = Self::hash(name);
+        self.entries
+            .range((h, 0)..=(h, usize::MAX))
+            .map(|(_, slot)| *slot)
+            .collect()
+    }
+
+    /// Returns the first free slot.
+    pub fn first_free(&self) -> Option<usize> {
+        self.free.first().copied()
+    }
+
+    /// Records that `name` is stored at `slot`.
+    pub fn insert(&mut self, name: &str, slot: usize) {
+        self.free.remove(&slot);
+        self.entries.insert((Self::hash(name), slot));
+    }
+
+    /// Records that `name` is removed from `slot`.
+    pub fn remove(&mut self, name: &str, slot: usize) {
+        self.entries.remove(&(Self::hash(name), slot));
+        self.free.insert(slot);
+    }
+
+    /// Records that the directory grows by an empty block to `size` bytes.
+    pub fn grow(&mut self, size: usize) {
+        let first = self.size.div_ceil(4096) * ENTRIES_PER_BLOCK;
+        self.free
+            .extend(first..size.div_ceil(4096) * ENTRIES_PER_BLOCK);
+        self.size = size;
+    }
+}
+
+/// Returns the index of the directory `inode`, building it if needed, or
+/// `None` if the directory is too small to be indexed.
+pub fn index(
+    ffs: &FastFileSystemInner,
+    inode: &Inode,
+) -> Result<Option<Arc<SpinLock<DirIndex>>>, KernelError> {
+    if inode.size.div_ceil(4096) < INDEX_MIN_BLOCKS {
+        return Ok(None);
+    }
+    let covering = |map: &BTreeMap<InodeNumber, Arc<SpinLock<DirIndex>>>| {
+        map.get(&inode.ino)
+            .filter(|index| {
+                let guard = index.lock();
+                let covers = guard.covers(inode.size);
+                guard.unlock();
+                covers
+            })
+            .cloned()
+    };
+    let map = ffs.dir_index.lock();
+    let index = covering(&map);
+    map.unlock();
+    if index.is_some() {
+        return Ok(index);
+    }
+    let built = Arc::new(SpinLock::new(DirIndex::build(ffs, inode)?));
+    // Keep the index installed meanwhile, which may already be updated.
+    let mut map = ffs.dir_index.lock();
+    let index = covering(&map).unwrap_or_else(|| {
+        map.insert(inode.ino, built.clone());
+        built
+    });
+    map.unlock();
+    Ok(Some(index))
+}
+
+/// Returns the index of the directory `ino`, if it is already built.
+pub fn installed(ffs: &FastFileSystemInner, ino: InodeNumber) -> Option<Arc<SpinLock<DirIndex>>> {
+    let map = ffs.dir_index.lock();
+    let index = map.get(&ino).cloned();
+    map.unlock();
+    index
+}
+
+/// Drops the index of the directory `ino`, to be rebuilt on the next use.
+pub fn invalidate(ffs: &FastFileSystemInner, ino: InodeNumber) {
+    let mut map = ffs.dir_index.lock();
+    map.remove(&ino);
+    map.unlock();
+}
+
+/// Loads the entry at `slot` of the directory `inode`.
+fn entry_at(
+    ffs: &FastFileSystemInner,
+    inode: &Inode,
+    slot: usize,
+) -> Result<DirectoryBlockEntry, KernelError> {
+    let lba = inode
+        .get(ffs, FileBlockNumber(slot / ENTRIES_PER_BLOCK))?
+        .ok_or(KernelError::FilesystemCorrupted("Directory hole"))?;
+    let blk = DirectoryBlock::load(ffs, lba)?;
+    let en = blk.read()[slot % ENTRIES_PER_BLOCK];
+    Ok(en)
+}
+
+/// Finds the slot and the inode number of the entry named `entry` through
+/// `index`.
+pub fn lookup(
+    ffs: &FastFileSystemInner,
+    inode: &Inode,
+    index: &SpinLock<DirIndex>,
+    entry: &str,
+) -> Result<Option<(usize, InodeNumber)>, KernelError> {
+    let guard = index.lock();
+    let slots = guard.candidates(entry);
+    guard.unlock();
+    for slot in slots {
+        let en = entry_at(ffs, inode, slot)?;
+        if en.name() == Some(entry) {
+            let ino = en
+                .inode
+                .ok_or(KernelError::FilesystemCorrupted("DirectoryEntry"))?;
+            return Ok(Some((slot, ino)));
+        }
+    }
+    Ok(None)
+}
+
+/// Records `entry`, just added to the directory `inode`, in `index`.
+///
+/// A new entry takes the first free slot, or the first slot of the block
+/// that the directory grows by. Returns false if the entry is in neither,
+/// i.e., the index does not match the directory.
+pub fn created(
+    ffs: &FastFileSystemInner,
+    inode: &Inode,
+    index: &SpinLock<DirIndex>,
+    entry: &str,
+) -> Result<bool, KernelError> {
+    let mut guard = index.lock();
+    let mut slots: Vec<usize> = guard.first_free().into_iter().collect();
+    if !guard.covers(inode.size) {
+        slots.push(guard.size.div_ceil(4096) * ENTRIES_PER_BLOCK);
+        guard.grow(inode.size);
+    }
+    guard.unlock();
+    for slot in slots {
+        if entry_at(ffs, inode, slot)?.name() == Some(entry) {
+            let mut guard = index.lock();
+            guard.insert(entry, slot);
+            guard.unlock();
+            return Ok(true);
+        }
+    }
+    Ok(false)
+}
+
+/// Records that `entry` at `slot` was just removed from the directory
+/// `inode`. Returns false if the slot is still in use, i.e., the index does
+/// not match the directory.
+pub fn removed(
+    ffs: &FastFileSystemInner,
+    inode: &Inode,
+    index: &SpinLock<DirIndex>,
+    entry: &str,
+    slot: usize,
+) -> Result<bool, KernelError> {
+    if entry_at(ffs, inode, slot)?.inode.is_some() {
+        return Ok(false);
+    }
+    let mut guard = index.lock();
+    guard.remove(entry, slot);
+    guard.unlock();
+    Ok(true)
+}
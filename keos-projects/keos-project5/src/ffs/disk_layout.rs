@@ -119,6 +119,39 @@ impl Default for BlockBitmap {
     }
 }
 
+/// Finds the first zero bit in `from..limit` of a bitmap whose `i`-th word
+/// is `word(i)`.
+///
+/// The words are copied out, as the bitmaps are packed.
+fn find_free(word: impl Fn(usize) -> u64, from: usize, limit: usize) -> Option<usize> {
+    let mut pos = from;
+    while pos < limit {
+        let (i, off) = (pos / 64, pos % 64);
+        let free = !word(i) & (u64::MAX << off);
+        if free != 0 {
+            let found = i * 64 + free.trailing_zeros() as usize;
+            return (found < limit).then_some(found);
+        }
+        pos = (i + 1) * 64;
+    }
+    None
+}
+
+/// Counts the zero bits in `0..limit` of a bitmap whose `i`-th word is
+/// `word(i)`.
+fn count_free(word: impl Fn(usize) -> u64, limit: usize) -> usize {
+    (0..limit.div_ceil(64))
+        .map(|i| {
+            let valid = if (i + 1) * 64 <= limit {
+                u64::MAX
+            } else {
+                (1 << (limit % 64)) - 1
+            };
+            (!word(i) & valid).count_ones() as usize
+        })
+        .sum()
+}
+
 impl BlockBitmap {
     /// Checks whether a block at the given position is allocated.
     ///
@@ -181,6 +214,16 @@ impl BlockBitmap {
             false
         }
     }
+
+    /// Finds the first free position in `from..limit`.
+    pub fn find_free(&self, from: usize, limit: usize) -> Option<usize> {
+        find_free(|i| self.bits[i], from, limit.min(4096 * 8))
+    }
+
+    /// Counts the free positions in `0..limit`.
+    pub fn count_free(&self, limit: usize) -> usize {
+        count_free(|i| self.bits[i], limit.min(4096 * 8))
+    }
 }
 
 impl MetaData for BlockBitmap {
@@ -255,6 +298,16 @@ impl InodeBitmap {
             false
         }
     }
+
+    /// Finds the first free position in `from..limit`.
+    pub fn find_free(&self, from: usize, limit: usize) -> Option<usize> {
+        find_free(|i| self.bits[i], from, limit.min(4096 * 8))
+    }
+
+    /// Counts the free positions in `0..limit`.
+    pub fn count_free(&self, limit: usize) -> usize {
+        count_free(|i| self.bits[i], limit.min(4096 * 8))
+    }
 }
 
 impl MetaData for InodeBitmap {
@@ -504,8 +557,15 @@ pub struct JournalSb {
     pub commited: u64,
     /// Transaction id.
     pub tx_id: u64,
+    /// [`JournalSb::CSUM_MAGIC`] in the checksum record of a group commit.
+    pub csum_magic: u64,
+    /// Number of the records before the checksum record.
+    pub nr_records: u64,
+    /// Checksum of each record of the group commit, over its LBA and its
+    /// content.
+    pub checksums: [u32; 511],
     /// Padding to fill a full block (4096 bytes).
-    _pad: [u8; 4096 - 24],
+    _pad: [u8; 4096 - 40 - 511 * 4],
 }
 
 impl Default for JournalSb {
@@ -514,12 +574,18 @@ impl Default for JournalSb {
             magic: [0; 8],
             commited: 0,
             tx_id: 0,
-            _pad: [0; 4096 - 24],
+            csum_magic: 0,
+            nr_records: 0,
+            checksums: [0; 511],
+            _pad: [0; 4096 - 40 - 511 * 4],
         }
     }
 }
 
 impl JournalSb {
+    /// Marks a checksum record of a group commit.
+    pub const CSUM_MAGIC: u64 = u64::from_le_bytes(*b"CRC32C\0\0");
+
     /// Loads the journal superblock from disk.
     ///
     /// # Arguments
@@ -535,12 +601,7 @@ impl JournalSb {
         {
             let inner =
                 unsafe { core::slice::from_raw_parts_mut(&mut *b as *mut _ as *mut u8, 4096) };
-            for i in 0..8 {
-                disk.read(
-                    lba.into_sector() + i,
-                    inner[512 * i..512 * (i + 1)].as_mut_array().unwrap(),
-                )?;
-            }
+            disk.read_many(lba.into_sector(), &mut inner[..])?;
         }
         Ok(b)
     }
@@ -0,0 +1,46 @@
+//! Extents of the files.
+//!
+//! The on-disk inode keeps its direct and indirect block pointers, which the
+//! disk image tool and [`Inode::get`] share. An [`Extent`] is derived in
+//! memory on top of [`Inode::get`] instead: a run of file blocks that are
+//! stored in consecutive disk blocks, which is read with a single disk
+//! request no matter how many blocks it covers.
+use crate::ffs::{FastFileSystemInner, FileBlockNumber, inode::Inode, types::LogicalBlockAddress};
+use alloc::vec::Vec;
+use keos::KernelError;
+
+/// A run of file blocks that are stored in consecutive disk blocks.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct Extent {
+    /// The first file block of the run.
+    pub fba: FileBlockNumber,
+    /// The disk block of `fba`.
+    pub lba: LogicalBlockAddress,
+    /// Number of the blocks of the run.
+    pub len: usize,
+}
+
+impl Inode {
+    /// Maps `nr` file blocks starting from `fba` into extents.
+    ///
+    /// Adjacent file blocks whose disk blocks are also adjacent are merged
+    /// into a single [`Extent`]. Blocks that are not allocated are skipped.
+    pub fn extents(
+        &self,
+        ffs: &FastFileSystemInner,
+        fba: FileBlockNumber,
+        nr: usize,
+    ) -> Result<Vec<Extent>, KernelError> {
+        let mut extents: Vec<Extent> = Vec::new();
+        for fba in (fba.0..fba.0 + nr).map(FileBlockNumber) {
+            let Some(lba) = self.get(ffs, fba)? else {
+                continue;
+            };
+            match extents.last_mut() {
+                Some(ext) if ext.fba + ext.len == fba && ext.lba + ext.len == lba => ext.len += 1,
+                _ => extents.push(Extent { fba, lba, len: 1 }),
+            }
+        }
+        Ok(extents)
+    }
+}
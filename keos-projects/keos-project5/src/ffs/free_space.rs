@@ -0,0 +1,297 @@
+//! In-memory summary of the free space.
+//!
+//! Searching the on-disk bitmaps alone loads and scans the bitmap blocks one
+//! by one until a free bit shows up, which gets slower as the disk fills.
+//! [`FreeSpace`] keeps the number of the free bits of each bitmap block, and
+//! on top of them a bitmap of the bitmap blocks that have any free bit. An
+//! allocator finds a bitmap block with a free bit in a few word operations,
+//! and loads only that block.
+//!
+//! Each cpu keeps a next-fit hint, the bit after its last allocation. The
+//! allocations of a cpu stay clustered, while the allocations of the other
+//! cpus start from other bitmap blocks and do not contend on the same one.
+//!
+//! Each bitmap block submitted to a transaction is recounted by
+//! [`BlockPointsToWriteGuard::submit`], so the bits freed anywhere, e.g., by
+//! removing a file, become visible to the allocators without the freeing
+//! path telling the summary. A bit freed by the pending [`CommitGroup`] is
+//! skipped until the group is durable.
+//!
+//! The summary is only a hint: the bitmap block, changed under a
+//! transaction, remains the authority. An allocator always claims the bit in
+//! the bitmap block, and corrects the count of a bitmap block that turns out
+//! to be full.
+//!
+//! [`CommitGroup`]: super::group_commit::CommitGroup
+//! [`BlockPointsToWriteGuard::submit`]: super::access_control::BlockPointsToWriteGuard::submit
+use super::{
+    FastFileSystemInner, LogicalBlockAddress,
+    access_control::MetaData,
+    disk_layout::{BlockBitmap, InodeBitmap},
+    journal::RunningTransaction,
+};
+use alloc::vec::Vec;
+use core::ops::Range;
+use keos::{
+    KernelError, MAX_CPU,
+    intrinsics::cpuid,
+    sync::atomic::{AtomicU64, AtomicUsize},
+};
+
+/// Number of the bits of a bitmap block.
+pub const BITS_PER_BLOCK: usize = 4096 * 8;
+
+/// An on-disk allocation bitmap block.
+pub trait Bitmap: MetaData {
+    /// Finds the first free position in `from..limit`.
+    fn find_free(&self, from: usize, limit: usize) -> Option<usize>;
+    /// Counts the free positions in `0..limit`.
+    fn count_free(&self, limit: usize) -> usize;
+    /// Attempts to allocate the position `pos`.
+    fn try_allocate(&mut self, pos: usize) -> bool;
+}
+
+macro_rules! impl_bitmap {
+    ($t:ty) => {
+        impl Bitmap for $t {
+            fn find_free(&self, from: usize, limit: usize) -> Option<usize> {
+                <$t>::find_free(self, from, limit)
+            }
+            fn count_free(&self, limit: usize) -> usize {
+                <$t>::count_free(self, limit)
+            }
+            fn try_allocate(&mut self, pos: usize) -> bool {
+                <$t>::try_allocate(self, pos)
+            }
+        }
+    };
+}
+impl_bitmap!(BlockBitmap);
+impl_bitmap!(InodeBitmap);
+
+/// Finds the first free position of `bitmap` in `from..limit` that is
+/// `usable`.
+fn find_usable<B: Bitmap>(
+    bitmap: &B,
+    mut from: usize,
+    limit: usize,
+    usable: &impl Fn(usize) -> bool,
+) -> Option<usize> {
+    loop {
+        let pos = bitmap.find_free(from, limit)?;
+        if usable(pos) {
+            return Some(pos);
+        }
+        from = pos + 1;
+    }
+}
+
+/// Free space summary of an allocation bitmap.
+pub struct FreeSpace {
+    /// Free bits of each bitmap block.
+    free: Vec<AtomicUsize>,
+    /// Bit `i` of word `w` is set if bitmap block `64 * w + i` may have a
+    /// free bit.
+    nonfull: Vec<AtomicU64>,
+    /// Next-fit hint of each cpu, as a bit index.
+    hints: [AtomicUsize; MAX_CPU],
+    /// Number of the bits that can be allocated.
+    nr_bits: usize,
+}
+
+impl FreeSpace {
+    /// A summary without any free bit, used until the bitmap is scanned.
+    pub const fn empty() -> Self {
+        Self {
+            free: Vec::new(),
+            nonfull: Vec::new(),
+            hints: [const { AtomicUsize::new(0) }; MAX_CPU],
+            nr_bits: 0,
+        }
+    }
+
+    /// Builds the summary of the first `nr_bits` bits of the bitmap stored
+    /// in `bitmap`.
+    ///
+    /// The hints of the cpus are spread evenly over the bitmap.
+    pub fn scan<B: Bitmap>(
+        ffs: &FastFileSystemInner,
+        bitmap: Range<LogicalBlockAddress>,
+        nr_bits: usize,
+    ) -> Result<Self, KernelError> {
+        let start = bitmap.start;
+        let nr_bits = nr_bits.min(bitmap.count() * BITS_PER_BLOCK);
+        let nr_blocks = nr_bits.div_ceil(BITS_PER_BLOCK);
+        let this = Self {
+            free: (0..nr_blocks).map(|_| AtomicUsize::new(0)).collect(),
+            nonfull: (0..nr_blocks.div_ceil(64))
+                .map(|_| AtomicU64::new(0))
+                .collect(),
+            hints: core::array::from_fn(|cpu| AtomicUsize::new(cpu * nr_bits / MAX_CPU)),
+            nr_bits,
+        };
+        this.rescan::<B>(ffs, start)?;
+        Ok(this)
+    }
+
+    /// Recounts the free bits of every bitmap block.
+    fn rescan<B: Bitmap>(
+        &self,
+        ffs: &FastFileSystemInner,
+        start: LogicalBlockAddress,
+    ) -> Result<(), KernelError> {
+        for idx in 0..self.free.len() {
+            let free = B::load(ffs, start + idx)?
+                .read()
+                .count_free(self.limit(idx));
+            self.set_free(idx, free);
+        }
+        Ok(())
+    }
+
+    /// Number of the valid bits of the bitmap block `idx`.
+    fn limit(&self, idx: usize) -> usize {
+        (self.nr_bits - idx * BITS_PER_BLOCK).min(BITS_PER_BLOCK)
+    }
+
+    /// Total number of the free bits.
+    pub fn nr_free(&self) -> usize {
+        self.free.iter().map(|f| f.load()).sum()
+    }
+
+    fn set_free(&self, idx: usize, free: usize) {
+        self.free[idx].store(free);
+        if free == 0 {
+            self.nonfull[idx / 64].fetch_and(!(1 << (idx % 64)));
+        } else {
+            self.nonfull[idx / 64].fetch_or(1 << (idx % 64));
+        }
+    }
+
+    /// Recounts the free bits of the bitmap block `idx` from its content
+    /// `b`.
+    fn recount(&self, idx: usize, b: &[u8; 4096]) {
+        if idx >= self.free.len() {
+            return;
+        }
+        let limit = self.limit(idx);
+        let (full, rest) = (limit / 8, limit % 8);
+        let mut used: usize = b[..full].iter().map(|w| w.count_ones() as usize).sum();
+        if rest != 0 {
+            used += (b[full] & ((1 << rest) - 1)).count_ones() as usize;
+        }
+        self.set_free(idx, limit - used);
+    }
+
+    /// Finds the next bitmap block in `from..end` that may have a free bit.
+    fn next_nonfull(&self, from: usize, end: usize) -> Option<usize> {
+        let mut idx = from;
+        while idx < end {
+            let (w, off) = (idx / 64, idx % 64);
+            let bits = self.nonfull[w].load() & (u64::MAX << off);
+            if bits != 0 {
+                let found = w * 64 + bits.trailing_zeros() as usize;
+                return (found < end).then_some(found);
+            }
+            idx = (w + 1) * 64;
+        }
+        None
+    }
+
+    /// Allocates a run of up to `max` consecutive free bits, searching from
+    /// `goal`, or from the hint of the current cpu if `goal` is `None`.
+    ///
+    /// The run does not cross a bitmap block. Returns the first bit and the
+    /// length of the run.
+    pub fn allocate<B: Bitmap>(
+        &self,
+        ffs: &FastFileSystemInner,
+        start: LogicalBlockAddress,
+        max: usize,
+        goal: Option<usize>,
+        tx: &RunningTransaction,
+    ) -> Result<(usize, usize), KernelError> {
+        let cpu = cpuid();
+        let goal = goal.unwrap_or_else(|| self.hints[cpu].load()) % self.nr_bits.max(1);
+        let (goal_idx, nr_blocks) = (goal / BITS_PER_BLOCK, self.free.len());
+        for pass in 0..2 {
+            // Search from the block of the goal to the end, then wrap around.
+            let mut idx = goal_idx;
+            let mut wrapped = false;
+            loop {
+                let next = if wrapped {
+                    self.next_nonfull(idx, goal_idx)
+                } else {
+                    self.next_nonfull(idx, nr_blocks)
+                };
+                let Some(i) = next else {
+                    if wrapped || goal_idx == 0 {
+                        break;
+                    }
+                    (idx, wrapped) = (0, true);
+                    continue;
+                };
+                idx = i + 1;
+                let bitmap = B::load(ffs, start + i)?;
+                let mut guard = bitmap.write(tx);
+                let limit = self.limit(i);
+                let from = if i == goal_idx {
+                    goal % BITS_PER_BLOCK
+                } else {
+                    0
+                };
+                // A bit freed by the pending group commit is still allocated
+                // on disk.
+                let group = ffs.commit_group.lock();
+                let durable = group.durable(start + i);
+                group.unlock();
+                let usable = |pos: usize| {
+                    durable
+                        .as_ref()
+                        .is_none_or(|b| b[pos / 8] & (1 << (pos % 8)) == 0)
+                };
+                let found = find_usable(&*guard, from, limit, &usable)
+                    .or_else(|| find_usable(&*guard, 0, from.min(limit), &usable));
+                let Some(pos) = found else {
+                    guard.forget();
+                    self.set_free(i, 0);
+                    continue;
+                };
+                let mut len = 0;
+                while len < max
+                    && pos + len < limit
+                    && usable(pos + len)
+                    && guard.try_allocate(pos + len)
+                {
+                    len += 1;
+                }
+                // The submission recounts the bitmap block.
+                guard.submit();
+                let bit = i * BITS_PER_BLOCK + pos;
+                self.hints[cpu].store(bit + len);
+                return Ok((bit, len));
+            }
+            // The counts may be stale, e.g., after an aborted transaction.
+            if pass == 0 {
+                self.rescan::<B>(ffs, start)?;
+            }
+        }
+        Err(KernelError::NoSpace)
+    }
+}
+
+impl FastFileSystemInner {
+    /// Updates the summary of the bitmap that the block at `lba` belongs
+    /// to, if any, from `b`, the content of the block submitted to a
+    /// transaction.
+    pub(crate) fn bitmap_submitted(&self, lba: LogicalBlockAddress, b: &[u8; 4096]) {
+        for (bitmap, space) in [
+            (self.block_bitmap(), &self.block_space),
+            (self.inode_bitmap(), &self.inode_space),
+        ] {
+            if bitmap.contains(&lba) {
+                space.recount((lba.into_u64() - bitmap.start.into_u64()) as usize, b);
+            }
+        }
+    }
+}
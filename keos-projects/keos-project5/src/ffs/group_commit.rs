@@ -0,0 +1,529 @@
+//! Group commit of the transactions of the file system itself.
+//!
+//! A transaction committed with [`RunningTransaction::commit`] is journaled
+//! and checkpointed on its own. Back-to-back transactions that the file
+//! system opens by itself, e.g., reclaiming the inodes of a storm of removed
+//! files, update the same bitmap and inode array blocks over and over, and
+//! journal each of them again.
+//!
+//! A transaction opened with [`FastFileSystemInner::open_deferred`] is not
+//! journaled on its own. While it runs, its metadata blocks are staged in the
+//! [`CommitGroup`] instead of the transaction, keeping only the latest
+//! content of each block. The group is journaled as a single compound
+//! transaction:
+//! - before any other transaction begins, so that a transaction never makes
+//!   a part of the group durable ahead of the rest,
+//! - when the group reaches [`GROUP_MAX_BLOCKS`] blocks, or when its oldest
+//!   transaction is older than [`GROUP_WINDOW_CYCLES`], and
+//! - when a caller waits for the durability with
+//!   [`FastFileSystemInner::sync_journal`].
+//!
+//! The group is atomic as a whole: a crash loses or keeps all of its
+//! transactions, so the file system stays consistent.
+//!
+//! A group that is full or expired is journaled and checkpointed by the
+//! `[GroupCommit]` thread of the file system, so the deferred transaction
+//! that fills the group does not pay for it. The thread stops when the file
+//! system is dropped.
+//!
+//! The last record of a group commit is a checksum record: a copy of the
+//! journal superblock, written to the LBA of the journal superblock, with the
+//! checksum of each record over its LBA and its content. The checkpoint
+//! copies it home before the journal superblock is written back, so the
+//! record is a valid journal superblock of the committed transaction. Before
+//! the recovery, [`discard_torn`] discards a group commit whose records do
+//! not match the checksums, instead of replaying it.
+//!
+//! A data block freed by the group stays allocated on disk until the group
+//! is durable. The allocator must not hand it out meanwhile, as the data
+//! written to the block would show up in the removed file after a crash. The
+//! group thus keeps the on-disk content of the block bitmap blocks that it
+//! changes, and [`CommitGroup::durable`] tells the allocator which of the
+//! free bits are still allocated on disk.
+use super::{
+    FastFileSystemInner, JournalIO, LogicalBlockAddress,
+    disk_layout::{JournalSb, JournalTxBegin},
+    journal::{Journal, RunningTransaction},
+};
+use alloc::{
+    boxed::Box,
+    collections::BTreeMap,
+    sync::{Arc, Weak},
+    vec::Vec,
+};
+use keos::{
+    KernelError,
+    channel::{Receiver, Sender, TrySendError, channel},
+    thread::ThreadBuilder,
+};
+
+/// Number of the blocks in the group that starts a group commit.
+///
+/// This is well below the 511 slots of a `TxBegin` block, as the last
+/// transaction merged into a group may add blocks beyond it.
+pub const GROUP_MAX_BLOCKS: usize = 256;
+
+/// Cycles that a transaction in the group waits at most for the group
+/// commit.
+pub const GROUP_WINDOW_CYCLES: u64 = 20_000_000;
+
+/// Transactions that are committed in memory but not yet written to the
+/// journal.
+pub struct CommitGroup {
+    /// The latest content of each block, in the order of LBA.
+    pending: BTreeMap<LogicalBlockAddress, Box<[u8; 4096]>>,
+    /// The blocks of the group being journaled.
+    flushing: BTreeMap<LogicalBlockAddress, Box<[u8; 4096]>>,
+    /// The on-disk content of the block bitmap blocks in the group.
+    durable: BTreeMap<LogicalBlockAddress, Box<[u8; 4096]>>,
+    /// Bumped on each group commit.
+    flush_seq: u64,
+    /// Number of the merged transactions.
+    nr_tx: usize,
+    /// Time stamp counter when the first transaction is merged.
+    since: u64,
+    /// Whether the running transaction is a deferred one.
+    deferring: bool,
+    /// Whether the running deferred transaction staged any block.
+    staged: bool,
+    /// Wakes up the `[GroupCommit]` thread, if the file system has one.
+    kick: Option<Sender<()>>,
+}
+
+impl CommitGroup {
+    /// Creates an empty group.
+    pub const fn new() -> Self {
+        Self {
+            pending: BTreeMap::new(),
+            flushing: BTreeMap::new(),
+            durable: BTreeMap::new(),
+            flush_seq: 0,
+            nr_tx: 0,
+            since: 0,
+            deferring: false,
+            staged: false,
+            kick: None,
+        }
+    }
+
+    /// Returns the content of `lba` that is not yet on disk, if any.
+    ///
+    /// The metadata cache may evict a block before the group is journaled,
+    /// so a reload of the block must prefer this over the disk.
+    pub fn get(&self, lba: LogicalBlockAddress) -> Option<&[u8; 4096]> {
+        self.pending
+            .get(&lba)
+            .or_else(|| self.flushing.get(&lba))
+            .map(|b| &**b)
+    }
+
+    /// Returns true if no block of the group waits for the journal.
+    pub fn is_clean(&self) -> bool {
+        self.pending.is_empty() && self.flushing.is_empty()
+    }
+
+    /// Returns the on-disk content of the block bitmap block `lba`, if the
+    /// group changed it.
+    ///
+    /// A bit that is free in memory but allocated here was freed by the
+    /// group, and must not be allocated until the group is durable.
+    pub fn durable(&self, lba: LogicalBlockAddress) -> Option<Box<[u8; 4096]>> {
+        self.durable.get(&lba).cloned()
+    }
+
+    /// Returns true if the group must be journaled now.
+    fn is_full(&self) -> bool {
+        self.pending.len() >= GROUP_MAX_BLOCKS
+            || (self.nr_tx != 0
+                && unsafe { core::arch::x86_64::_rdtsc() }.wrapping_sub(self.since)
+                    >= GROUP_WINDOW_CYCLES)
+    }
+}
+
+impl Default for CommitGroup {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+/// A transaction whose metadata blocks are staged in the [`CommitGroup`].
+///
+/// It is used as a [`RunningTransaction`]. Without a journal, this is just a
+/// [`RunningTransaction`].
+pub struct DeferredTransaction<'a> {
+    tx: Option<RunningTransaction<'a>>,
+}
+
+impl<'a> core::ops::Deref for DeferredTransaction<'a> {
+    type Target = RunningTransaction<'a>;
+
+    fn deref(&self) -> &Self::Target {
+        self.tx.as_ref().unwrap()
+    }
+}
+
+impl DeferredTransaction<'_> {
+    /// Commits the transaction without waiting for the durability.
+    ///
+    /// The transaction is merged into the [`CommitGroup`]. The file system
+    /// sees the changes right away; only a crash before the group commit
+    /// loses them, along with the rest of the group.
+    pub fn commit(mut self) -> Result<(), KernelError> {
+        let tx = self.tx.take().unwrap();
+        let ffs = tx.ffs;
+        let mut group = ffs.commit_group.lock();
+        if !group.deferring {
+            group.unlock();
+            return tx.commit();
+        }
+        group.deferring = false;
+        if core::mem::take(&mut group.staged) {
+            if group.nr_tx == 0 {
+                group.since = unsafe { core::arch::x86_64::_rdtsc() };
+            }
+            group.nr_tx += 1;
+        }
+        let is_full = group.is_full();
+        group.unlock();
+        if ffs.debug_journal {
+            println!("[FFS-Journal]: ] Deferred.");
+        }
+        // Release the journal.
+        drop(tx);
+        if is_full && !ffs.kick_group_commit() {
+            ffs.flush_group()?;
+        }
+        Ok(())
+    }
+}
+
+impl Drop for DeferredTransaction<'_> {
+    fn drop(&mut self) {
+        if let Some(tx) = self.tx.take() {
+            let mut group = tx.ffs.commit_group.lock();
+            group.deferring = false;
+            group.staged = false;
+            group.unlock();
+        }
+    }
+}
+
+impl FastFileSystemInner {
+    /// Opens a transaction that is committed with the next group commit.
+    ///
+    /// See the [module-level documentation](self).
+    pub fn open_deferred(&self, name: &str) -> DeferredTransaction<'_> {
+        let tx = RunningTransaction::begin(name, self, JournalIO { ffs: self }, self.debug_journal);
+        if self.journal.is_some() {
+            // Only a single transaction runs at a time under the journal.
+            let mut group = self.commit_group.lock();
+            group.deferring = true;
+            group.unlock();
+        }
+        DeferredTransaction { tx: Some(tx) }
+    }
+
+    /// Stages a metadata block of the running transaction in the
+    /// [`CommitGroup`], if the transaction is a deferred one.
+    ///
+    /// Returns the block back if it must be written to the transaction
+    /// instead.
+    pub(crate) fn defer_meta(
+        &self,
+        lba: LogicalBlockAddress,
+        data: Box<[u8; 4096]>,
+        ty: &str,
+    ) -> Option<Box<[u8; 4096]>> {
+        let group = self.commit_group.lock();
+        let (deferring, first) = (
+            group.deferring,
+            group.get(lba).is_none() && !group.durable.contains_key(&lba),
+        );
+        group.unlock();
+        if !deferring {
+            return Some(data);
+        }
+        if self.debug_journal {
+            println!(
+                "[FFS-Journal]:      deferred: {:20} - {:?},",
+                ty.split(":").last().unwrap_or("?"),
+                lba
+            );
+        }
+        // Keep the on-disk content of a block bitmap block that the group
+        // changes for the first time.
+        let durable = if first && self.block_bitmap().contains(&lba) {
+            let mut b = Box::new([0; 4096]);
+            self.disk
+                .read_many(lba.into_sector(), &mut b[..])
+                .ok()
+                .map(|_| b)
+        } else {
+            None
+        };
+        let mut group = self.commit_group.lock();
+        if let Some(b) = durable {
+            group.durable.entry(lba).or_insert(b);
+        }
+        group.pending.insert(lba, data);
+        group.staged = true;
+        group.unlock();
+        None
+    }
+
+    /// Makes the transactions of the [`CommitGroup`] durable.
+    pub fn sync_journal(&self) -> Result<(), KernelError> {
+        self.flush_group()
+    }
+
+    /// Returns true if the [`CommitGroup`] has blocks that are not yet
+    /// being journaled.
+    pub(crate) fn has_deferred(&self) -> bool {
+        let group = self.commit_group.lock();
+        let has_deferred = !group.pending.is_empty();
+        group.unlock();
+        has_deferred
+    }
+
+    /// Journals the [`CommitGroup`] as a single transaction, and
+    /// checkpoints it.
+    fn flush_group(&self) -> Result<(), KernelError> {
+        if !self.has_deferred() {
+            return Ok(());
+        }
+        let Some(sb) = self.journal.as_ref().map(|journal| {
+            let guard = journal.lock();
+            let sb = (guard.sb.magic, guard.sb.tx_id);
+            guard.unlock();
+            sb
+        }) else {
+            return Ok(());
+        };
+        let tx = RunningTransaction::begin(
+            "CommitGroup",
+            self,
+            JournalIO { ffs: self },
+            self.debug_journal,
+        );
+        let mut group = self.commit_group.lock();
+        if group.pending.is_empty() {
+            group.unlock();
+            return Ok(());
+        }
+        // A group commit that failed to clean up leaves its blocks to this
+        // one.
+        let mut pending = core::mem::take(&mut group.pending);
+        group.flushing.append(&mut pending);
+        group.flush_seq += 1;
+        let (seq, nr_tx) = (group.flush_seq, core::mem::take(&mut group.nr_tx));
+        let mut blocks: Vec<_> = group
+            .flushing
+            .iter()
+            .map(|(lba, b)| (*lba, b.clone()))
+            .collect();
+        group.unlock();
+        if self.debug_journal {
+            println!(
+                "[FFS-Journal]: Group commit: {} transactions, {} blocks.",
+                nr_tx,
+                blocks.len()
+            );
+        }
+        if blocks.len() < 511 {
+            // The transaction writes back the journal superblock with the
+            // next transaction id.
+            let record = checksum_record(self.journal().start, sb.0, sb.1 + 1, &blocks);
+            blocks.push((self.journal().start, record));
+        }
+        for (lba, b) in blocks {
+            tx.write_meta(lba, b, "CommitGroup");
+        }
+        let result = tx.commit();
+
+        let mut group = self.commit_group.lock();
+        // A later group commit also journals the blocks, and cleans up.
+        if group.flush_seq == seq {
+            let flushing = core::mem::take(&mut group.flushing);
+            if result.is_ok() {
+                for (lba, b) in flushing {
+                    if !group.durable.contains_key(&lba) {
+                        continue;
+                    }
+                    if group.pending.contains_key(&lba) {
+                        group.durable.insert(lba, b);
+                    } else {
+                        group.durable.remove(&lba);
+                    }
+                }
+            } else {
+                // Retry with the next group commit.
+                let mut pending = core::mem::replace(&mut group.pending, flushing);
+                group.pending.append(&mut pending);
+                group.nr_tx += nr_tx;
+            }
+        }
+        group.unlock();
+        result
+    }
+}
+
+impl FastFileSystemInner {
+    /// Starts the `[GroupCommit]` thread of `ffs`.
+    ///
+    /// The thread does not keep the file system alive, and exits when the
+    /// file system drops the sender with [`Self::stop_group_commit`].
+    pub(crate) fn start_group_commit(ffs: &Arc<Self>) {
+        let (kick, rx) = channel(1);
+        let weak = Arc::downgrade(ffs);
+        ThreadBuilder::new("[GroupCommit]").spawn(move || Self::group_committer(weak, rx));
+        let mut group = ffs.commit_group.lock();
+        group.kick = Some(kick);
+        group.unlock();
+    }
+
+    /// Stops the `[GroupCommit]` thread.
+    pub(crate) fn stop_group_commit(&self) {
+        let mut group = self.commit_group.lock();
+        let kick = group.kick.take();
+        group.unlock();
+        drop(kick);
+    }
+
+    /// Wakes up the `[GroupCommit]` thread. Returns false if there is none.
+    fn kick_group_commit(&self) -> bool {
+        let group = self.commit_group.lock();
+        let kicked = group
+            .kick
+            .as_ref()
+            .is_some_and(|kick| !matches!(kick.try_send(()), Err(TrySendError::Disconnected(_))));
+        group.unlock();
+        kicked
+    }
+
+    fn group_committer(ffs: Weak<Self>, rx: Receiver<()>) {
+        while rx.recv().is_ok() {
+            while rx.try_recv().is_ok() {}
+            let Some(ffs) = ffs.upgrade() else {
+                break;
+            };
+            if let Err(e) = ffs.flush_group() {
+                println!("[FFS-Journal]: Group commit failed: {:?}", e);
+            }
+        }
+    }
+}
+
+/// Lookup table of CRC-32C (Castagnoli).
+static CRC32C: [u32; 256] = {
+    let mut table = [0; 256];
+    let mut i = 0;
+    while i < 256 {
+        let mut crc = i as u32;
+        let mut bit = 0;
+        while bit < 8 {
+            crc = if crc & 1 != 0 {
+                (crc >> 1) ^ 0x82f6_3b78
+            } else {
+                crc >> 1
+            };
+            bit += 1;
+        }
+        table[i] = crc;
+        i += 1;
+    }
+    table
+};
+
+fn crc32c(crc: u32, bytes: &[u8]) -> u32 {
+    !bytes.iter().fold(!crc, |crc, b| {
+        CRC32C[((crc ^ *b as u32) & 0xff) as usize] ^ (crc >> 8)
+    })
+}
+
+/// Checksum of a journal record, over its LBA and its content.
+fn record_checksum(lba: LogicalBlockAddress, data: &[u8; 4096]) -> u32 {
+    crc32c(crc32c(0, &lba.into_u64().to_le_bytes()), data)
+}
+
+/// Builds the checksum record of `blocks`, to be written to `lba`, the LBA of
+/// the journal superblock.
+///
+/// The slot of the record itself holds the checksum of the record, computed
+/// with the slot zeroed.
+fn checksum_record(
+    lba: LogicalBlockAddress,
+    magic: [u8; 8],
+    tx_id: u64,
+    blocks: &[(LogicalBlockAddress, Box<[u8; 4096]>)],
+) -> Box<[u8; 4096]> {
+    let mut sb = Box::new(JournalSb::default());
+    let mut checksums = [0; 511];
+    for (checksum, (lba, data)) in checksums.iter_mut().zip(blocks.iter()) {
+        *checksum = record_checksum(*lba, data);
+    }
+    sb.magic = magic;
+    sb.commited = 1;
+    sb.tx_id = tx_id;
+    sb.csum_magic = JournalSb::CSUM_MAGIC;
+    sb.nr_records = blocks.len() as u64;
+    sb.checksums = checksums;
+    // Safety: `JournalSb` is a packed block.
+    let mut record = unsafe { Box::from_raw(Box::into_raw(sb) as *mut [u8; 4096]) };
+    let checksum = record_checksum(lba, &record);
+    checksums[blocks.len()] = checksum;
+    unsafe { (*(record.as_mut_ptr() as *mut JournalSb)).checksums = checksums };
+    record
+}
+
+/// Discards the committed transaction in `journal` if it is a torn group
+/// commit.
+///
+/// The record `i` is the `i`-th LBA of the `TxBegin` block, and the block `i`
+/// after the `TxBegin` block. A transaction without a checksum record is left
+/// to [`Journal::recovery`] as is.
+///
+/// This runs before [`Journal::recovery`], which then finds no committed
+/// transaction to replay.
+pub fn discard_torn(
+    journal: &mut Journal,
+    ffs: &FastFileSystemInner,
+    io: &JournalIO,
+) -> Result<(), KernelError> {
+    if journal.sb.commited == 0 {
+        return Ok(());
+    }
+    let start = ffs.journal().start;
+    let tx_begin = JournalTxBegin::from_io(io, start + 1)?;
+    let Some(nr) = tx_begin.lbas.iter().position(|lba| *lba == Some(start)) else {
+        return Ok(());
+    };
+    let mut record = Box::new([0; 4096]);
+    io.read_journal(start + 2 + nr, &mut record)?;
+    // Safety: `JournalSb` is a packed block.
+    let sb = unsafe { &mut *(record.as_mut_ptr() as *mut JournalSb) };
+    let (csum_magic, nr_records, mut checksums) = (sb.csum_magic, sb.nr_records, sb.checksums);
+    let checksum = checksums[nr];
+    checksums[nr] = 0;
+    sb.checksums = checksums;
+    let mut intact = csum_magic == JournalSb::CSUM_MAGIC
+        && nr_records == nr as u64
+        && record_checksum(start, &record) == checksum;
+    let mut block = Box::new([0; 4096]);
+    for (idx, lba) in tx_begin.lbas.iter().enumerate().take(nr) {
+        let Some(lba) = lba.filter(|_| intact) else {
+            intact = false;
+            break;
+        };
+        io.read_journal(start + 2 + idx, &mut block)?;
+        intact = record_checksum(lba, &block) == checksums[idx];
+    }
+    if !intact {
+        println!(
+            "[FFS-Journal]: Discard the torn transaction #{}.",
+            tx_begin.tx_id
+        );
+        journal.sb.commited = 0;
+        journal.sb.writeback(io, ffs)?;
+    }
+    Ok(())
+}
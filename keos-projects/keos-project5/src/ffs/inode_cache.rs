@@ -0,0 +1,89 @@
+//! Cache of the released inodes.
+//!
+//! [`FastFileSystemInner::inodes`] holds an inode only while a
+//! [`TrackedInode`] refers to it, so that each inode has a unique in-memory
+//! view. Once the last [`TrackedInode`] is dropped, the inode is gone, and
+//! opening the file again parses it from the inode array.
+//!
+//! [`InodeCache`] keeps up to [`INODE_CACHE_SIZE`] of the released inodes,
+//! and evicts the least recently released one first. A released inode is
+//! always clean: an inode changes only through [`TrackedInode::write_with`],
+//! which writes the change to the inode array in the same transaction, so an
+//! evicted inode is simply dropped. An inode released without any link is
+//! freed instead of cached.
+//!
+//! On a miss, the other allocated inodes of the same inode array block are
+//! cached as well, as the inodes created together, e.g., the files of a
+//! directory, are usually allocated next to each other. The prefetch only
+//! fills the free capacity, so that it never evicts an inode that was in
+//! use.
+//!
+//! [`FastFileSystemInner::inodes`]: super::FastFileSystemInner::inodes
+//! [`TrackedInode`]: super::access_control::TrackedInode
+//! [`TrackedInode::write_with`]: super::access_control::TrackedInode::write_with
+use super::inode::Inode;
+use crate::lru::LRUCache;
+use alloc::sync::Arc;
+use keos::{fs::InodeNumber, sync::RwLock};
+
+/// Number of the released inodes kept in memory.
+pub const INODE_CACHE_SIZE: usize = 1024;
+
+/// Counters of the inode cache.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct InodeCacheStat {
+    /// Lookups answered from memory.
+    pub hits: u64,
+    /// Lookups that read the inode array.
+    pub misses: u64,
+    /// Inodes cached by the prefetch of a miss.
+    pub prefetched: u64,
+    /// Inodes dropped to make room.
+    pub evictions: u64,
+}
+
+/// Bounded cache of the released inodes.
+pub struct InodeCache {
+    idle: LRUCache<InodeNumber, Arc<RwLock<Inode>>, INODE_CACHE_SIZE>,
+    /// Counters of the cache.
+    pub stat: InodeCacheStat,
+}
+
+impl InodeCache {
+    /// Makes a new, empty cache.
+    pub const fn new() -> Self {
+        Self {
+            idle: LRUCache::new(),
+            stat: InodeCacheStat {
+                hits: 0,
+                misses: 0,
+                prefetched: 0,
+                evictions: 0,
+            },
+        }
+    }
+
+    /// Takes the inode `ino` out of the cache, to be used again.
+    pub fn take(&mut self, ino: InodeNumber) -> Option<Arc<RwLock<Inode>>> {
+        self.idle.remove(&ino)
+    }
+
+    /// Returns true if the inode `ino` is cached.
+    pub fn contains(&self, ino: InodeNumber) -> bool {
+        self.idle.contains_key(&ino)
+    }
+
+    /// Returns true if an inode can be cached without an eviction.
+    pub fn has_room(&self) -> bool {
+        self.idle.len() < INODE_CACHE_SIZE
+    }
+
+    /// Caches a released inode, evicting the least recently released one if
+    /// the cache is full.
+    pub fn put(&mut self, ino: InodeNumber, inode: Arc<RwLock<Inode>>) {
+        if !self.has_room() && !self.contains(ino) {
+            self.stat.evictions += 1;
+        }
+        self.idle.put(ino, inode);
+    }
+}
@@ -96,17 +96,22 @@
 //! - **Data Blocks** – The actual contents of files and directories.
 //!
 //! Now, start with the implementation of [`inode`].
-use crate::lru::LRUCache;
+use crate::lru::ShardedLRUCache;
 use access_control::{BlockPointsTo, MetaData, TrackedInode};
 use alloc::{
     boxed::Box,
     collections::btree_map::{BTreeMap, Entry},
     sync::Arc,
+    vec::Vec,
 };
 use core::ops::Range;
+use dir_index::DirIndex;
 use disk_layout::{InodeArray, InodeBitmap, JournalSb};
+use free_space::FreeSpace;
 use fs_objects::Directory;
+use group_commit::CommitGroup;
 use inode::Inode;
+use inode_cache::{InodeCache, InodeCacheStat};
 use journal::{Journal, RunningTransaction};
 use keos::{
     KernelError,
@@ -116,11 +121,17 @@ use keos::{
 use types::LogicalBlockAddress;
 
 pub mod access_control;
+pub mod dir_index;
 pub mod disk_layout;
+pub mod extent;
+pub mod free_space;
 pub mod fs_objects;
+pub mod group_commit;
 pub mod inode;
+pub mod inode_cache;
 pub mod journal;
 pub mod types;
+pub mod vfs;
 
 /// A handle for performing journal I/O operations.
 ///
@@ -145,12 +156,7 @@ impl JournalIO<'_> {
         lba: LogicalBlockAddress,
         block: &[u8; 4096],
     ) -> Result<(), KernelError> {
-        for i in 0..8 {
-            self.ffs.disk.write(
-                lba.into_sector() + i,
-                block[512 * i..512 * (i + 1)].as_array().unwrap(),
-            )?;
-        }
+        self.ffs.disk.write_many(lba.into_sector(), &block[..])?;
         Ok(())
     }
 
@@ -165,12 +171,7 @@ impl JournalIO<'_> {
         lba: LogicalBlockAddress,
         b: &mut [u8; 4096],
     ) -> Result<(), KernelError> {
-        for i in 0..8 {
-            self.ffs.disk.read(
-                lba.into_sector() + i,
-                b[512 * i..512 * (i + 1)].as_mut_array().unwrap(),
-            )?;
-        }
+        self.ffs.disk.read_many(lba.into_sector(), &mut b[..])?;
 
         Ok(())
     }
@@ -203,8 +204,10 @@ pub struct FastFileSystemInner {
     ///
     /// This in-memory map reflects the filesystem state after applying
     /// journaled updates, but may differ from the actual disk contents if a
-    /// crash occurred before checkpointing.
-    pub blocks: SpinLock<LRUCache<LogicalBlockAddress, Arc<SpinLock<[u8; 4096]>>, 512>>,
+    /// crash occurred before checkpointing. It is sharded by the address, so
+    /// that a miss that reads the disk holds up only the lookups of its
+    /// shard.
+    pub blocks: ShardedLRUCache<LogicalBlockAddress, Arc<SpinLock<[u8; 4096]>>, 64, 8>,
 
     /// On-disk superblock structure, wrapped in metadata-aware
     /// block access.
@@ -213,12 +216,34 @@ pub struct FastFileSystemInner {
     /// In-memory table mapping inode numbers to their live representations.
     pub inodes: SpinLock<BTreeMap<InodeNumber, Arc<RwLock<Inode>>>>,
 
+    /// Inodes that are no longer in use, kept for the next lookup.
+    pub inode_cache: SpinLock<InodeCache>,
+
+    /// Hashed indices of the large directories.
+    pub dir_index: SpinLock<BTreeMap<InodeNumber, Arc<SpinLock<DirIndex>>>>,
+
     /// The current state of the journal (if present), wrapped in a
     /// lock to allow mutable access during journal operations.
     pub journal: Option<SpinLock<Journal>>,
 
     /// Whether trace the transactions for debugging purpose.
     pub debug_journal: bool,
+
+    /// Transactions committed in memory but not yet journaled.
+    pub commit_group: SpinLock<CommitGroup>,
+
+    /// Summary of the free blocks of the block bitmap.
+    pub block_space: FreeSpace,
+
+    /// Summary of the free inodes of the inode bitmap.
+    pub inode_space: FreeSpace,
+
+    /// Goal of the next block allocation of each thread that modifies an
+    /// inode with [`TrackedInode::write_with`].
+    pub block_goals: SpinLock<BTreeMap<u64, LogicalBlockAddress>>,
+
+    /// Identifier of the mount, unique across the mounts.
+    pub mount_id: u64,
 }
 
 impl FastFileSystemInner {
@@ -244,11 +269,18 @@ impl FastFileSystemInner {
                 block_count,
                 inode_count,
                 has_journal,
-                blocks: SpinLock::new(LRUCache::new()),
+                blocks: ShardedLRUCache::new(),
                 sb,
                 inodes: SpinLock::new(BTreeMap::new()),
+                inode_cache: SpinLock::new(InodeCache::new()),
+                dir_index: SpinLock::new(BTreeMap::new()),
                 journal: None,
                 debug_journal,
+                commit_group: SpinLock::new(CommitGroup::new()),
+                block_space: FreeSpace::empty(),
+                inode_space: FreeSpace::empty(),
+                block_goals: SpinLock::new(BTreeMap::new()),
+                mount_id: keos::fs::new_fs_id(),
             };
 
             if this.has_journal > 0 && !disable_journal {
@@ -256,12 +288,27 @@ impl FastFileSystemInner {
                     sb: JournalSb::from_disk(&this.disk, this.journal().start)?,
                 }));
                 let mut guard = this.journal.as_ref().unwrap().lock();
-                let result = guard.recovery(&this, &JournalIO { ffs: &this });
+                let io = JournalIO { ffs: &this };
+                let result = group_commit::discard_torn(&mut guard, &this, &io)
+                    .and_then(|_| guard.recovery(&this, &io));
                 guard.unlock();
                 result?;
                 this.sb.reload(&this.disk)?;
             }
 
+            // Block `n` is the bit `n` of the block bitmap, and inode `n` is
+            // the bit `n - 1` of the inode bitmap.
+            this.block_space = FreeSpace::scan::<disk_layout::BlockBitmap>(
+                &this,
+                this.block_bitmap(),
+                this.data_block_start().into_u64() as usize + this.block_count,
+            )?;
+            this.inode_space = FreeSpace::scan::<InodeBitmap>(
+                &this,
+                this.inode_bitmap(),
+                this.inode_count.saturating_sub(1),
+            )?;
+
             println!("[FFS] Mounted with superblock: ");
             println!(
                 "  - Inodes: {:?} / {:?}",
@@ -341,8 +388,19 @@ impl FastFileSystemInner {
     /// multiple operations to be grouped together atomically. Transactions
     /// ensure crash consistency by recording updates in the journal before
     /// they are committed to the main file system.
+    ///
+    /// The transactions of the [`CommitGroup`] are journaled first, as the
+    /// new transaction may write their blocks.
     pub fn open_transaction(&self, name: &str) -> RunningTransaction<'_> {
-        RunningTransaction::begin(name, self, JournalIO { ffs: self }, self.debug_journal)
+        loop {
+            let flushed = self.sync_journal();
+            let tx =
+                RunningTransaction::begin(name, self, JournalIO { ffs: self }, self.debug_journal);
+            // A deferred transaction may have run meanwhile.
+            if flushed.is_err() || !self.has_deferred() {
+                return tx;
+            }
+        }
     }
 
     /// Reads a data block from disk.
@@ -359,16 +417,25 @@ impl FastFileSystemInner {
             "[FFS-ERROR] You must cannot directly read the metadata. Use `MetaData::load` or `JournalIO`."
         );
         let mut b = Box::new([0u8; 0x1000]);
-        for i in 0..8 {
-            self.disk.read(
-                lba.into_sector() + i,
-                b[512 * i..512 * (i + 1)].as_mut_array().unwrap(),
-            )?;
-        }
+        self.disk.read_many(lba.into_sector(), &mut b[..])?;
 
         Ok(b)
     }
 
+    /// Reads consecutive data blocks starting from `lba` into `buf`, whose
+    /// length is a multiple of 4 KiB, with a single disk request.
+    pub fn read_data_blocks(
+        &self,
+        lba: LogicalBlockAddress,
+        buf: &mut [u8],
+    ) -> Result<(), KernelError> {
+        assert!(
+            self.data_block_start() <= lba && buf.len() % 0x1000 == 0,
+            "[FFS-ERROR] You must cannot directly read the metadata. Use `MetaData::load` or `JournalIO`."
+        );
+        self.disk.read_many(lba.into_sector(), buf)
+    }
+
     /// Writes a 4 KiB data block to disk.
     ///
     /// This function stores the given buffer at the specified logical block
@@ -383,12 +450,7 @@ impl FastFileSystemInner {
             self.data_block_start() <= lba,
             "[FFS-ERROR] You must cannot directly write to the metadata ({lba:?}). Use `MetaData::load` or `JournalIO`.",
         );
-        for i in 0..8 {
-            self.disk.write(
-                lba.into_sector() + i,
-                b[512 * i..512 * (i + 1)].as_array().unwrap(),
-            )?;
-        }
+        self.disk.write_many(lba.into_sector(), &b[..])?;
 
         Ok(())
     }
@@ -461,19 +523,22 @@ impl FastFileSystemInner {
         &self,
         lba: LogicalBlockAddress,
     ) -> Result<Arc<SpinLock<[u8; 4096]>>, KernelError> {
-        let mut guard = self.blocks.lock();
+        let mut guard = self.blocks.shard(&lba).lock();
         let result = guard
             .get_or_insert_with(lba, || {
                 let b = Arc::new(SpinLock::new([0; 4096]));
                 {
                     let mut guard = b.lock();
-                    for i in 0..8 {
-                        self.disk.read(
-                            lba.into_sector() + i,
-                            guard[512 * i..512 * (i + 1)].as_mut_array().unwrap(),
-                        )?;
-                    }
+                    // The block may be evicted before its group commit.
+                    let group = self.commit_group.lock();
+                    let pending = group.get(lba).map(|data| guard.copy_from_slice(data));
+                    group.unlock();
+                    let result = match pending {
+                        Some(()) => Ok(()),
+                        None => self.disk.read_many(lba.into_sector(), &mut guard[..]),
+                    };
                     guard.unlock();
+                    result?;
                 }
                 Ok(b)
             })
@@ -493,41 +558,58 @@ impl FastFileSystemInner {
         is_dir: bool,
         tx: &RunningTransaction,
     ) -> Result<(InodeNumber, TrackedInode), KernelError> {
-        for (i, lba) in self.inode_bitmap().enumerate() {
-            let bitmap = InodeBitmap::load(self, lba)?;
-            let mut guard = bitmap.write(tx);
-            for pos in 0..4096 * 8 {
-                if guard.try_allocate(pos) {
-                    guard.submit();
-                    let ino = InodeNumber::new((pos + i * 4096 * 8 + 1) as u32).unwrap();
-                    let mut guard = self.inodes.lock();
-                    let result = match guard.entry(ino) {
-                        Entry::Occupied(_) => Err(KernelError::FilesystemCorrupted(
-                            "Allocate to existing inode.",
-                        )),
-                        Entry::Vacant(en) => {
-                            // Lookup inode bitmap.
-                            let (lba, index) = self.get_inode_array_lba_index(ino).unwrap();
-                            let inode_arr = InodeArray::load(self, lba)?;
-                            let inode = Inode::new(ino, is_dir);
-                            let mut guard = inode_arr.write(tx);
-                            guard[index] = inode.into_disk_format();
-                            guard.submit();
-                            let mut sb = self.sb.write(tx);
-                            sb.inode_count_inused += 1;
-                            sb.submit();
-                            let inode = Arc::new(RwLock::new(inode));
-                            en.insert(inode.clone());
-                            Ok((ino, TrackedInode::new(inode, Arc::downgrade(self))))
-                        }
-                    };
-                    guard.unlock();
-                    return result;
-                }
+        let (pos, _) = self.inode_space.allocate::<InodeBitmap>(
+            self,
+            self.inode_bitmap().start,
+            1,
+            None,
+            tx,
+        )?;
+        let ino = InodeNumber::new((pos + 1) as u32).unwrap();
+        let mut guard = self.inodes.lock();
+        let result = match guard.entry(ino) {
+            Entry::Occupied(_) => Err(KernelError::FilesystemCorrupted(
+                "Allocate to existing inode.",
+            )),
+            Entry::Vacant(en) => {
+                // Lookup inode bitmap.
+                let (lba, index) = self.get_inode_array_lba_index(ino).unwrap();
+                let inode_arr = InodeArray::load(self, lba)?;
+                let inode = Inode::new(ino, is_dir);
+                let mut guard = inode_arr.write(tx);
+                guard[index] = inode.into_disk_format();
+                guard.submit();
+                let mut sb = self.sb.write(tx);
+                sb.inode_count_inused += 1;
+                sb.submit();
+                let inode = Arc::new(RwLock::new(inode));
+                en.insert(inode.clone());
+                Ok((ino, TrackedInode::new(inode, Arc::downgrade(self))))
             }
-            guard.forget();
-        }
-        Err(KernelError::NoSpace)
+        };
+        guard.unlock();
+        result
+    }
+
+    /// Allocates a run of up to `max` free blocks, searching from `goal`, or
+    /// from the next-fit hint of the current cpu.
+    fn allocate_run(
+        &self,
+        max: usize,
+        goal: Option<LogicalBlockAddress>,
+        tx: &RunningTransaction,
+    ) -> Result<(LogicalBlockAddress, usize), KernelError> {
+        let (bit, len) = self.block_space.allocate::<disk_layout::BlockBitmap>(
+            self,
+            self.block_bitmap().start,
+            max,
+            goal.map(|lba| lba.into_u64() as usize),
+            tx,
+        )?;
+        let mut sb = self.sb.write(tx);
+        sb.block_count_inused += len as u64;
+        sb.submit();
+        Ok((LogicalBlockAddress::new(bit as u64).unwrap(), len))
     }
 
     /// Allocates a new data block on disk.
@@ -535,73 +617,170 @@ impl FastFileSystemInner {
     /// This function reserves a free block for use in the file system,
     /// recording the allocation in the active transaction. The block is
     /// marked as used in the allocation bitmap and returned to the caller.
+    ///
+    /// While the current thread modifies an inode with
+    /// [`TrackedInode::write_with`], the block is allocated with
+    /// [`Self::allocate_block_near`] after the last block of the file, or
+    /// after the previous block allocated for it. Otherwise, the search
+    /// starts from the block after the last allocation of the current cpu.
+    /// Either search skips the bitmap blocks that have no free block.
     pub fn allocate_block(
         &self,
         tx: &RunningTransaction,
     ) -> Result<LogicalBlockAddress, KernelError> {
-        for (i, lba) in self.block_bitmap().enumerate() {
-            let bitmap = disk_layout::BlockBitmap::load(self, lba)?;
-            let mut bitmap = bitmap.write(tx);
-            for pos in 0..4096 * 8 {
-                if bitmap.try_allocate(pos) {
-                    bitmap.submit();
-                    let mut sb = self.sb.write(tx);
-                    sb.block_count_inused += 1;
-                    sb.submit();
-                    return Ok(LogicalBlockAddress::new((pos + i * 4096 * 8) as u64).unwrap());
-                }
+        let tid = keos::thread::Current::get_tid();
+        let goals = self.block_goals.lock();
+        let goal = goals.get(&tid).copied();
+        goals.unlock();
+        let Some(goal) = goal else {
+            return self.allocate_run(1, None, tx).map(|(lba, _)| lba);
+        };
+        let lba = self.allocate_block_near(goal, tx)?;
+        let mut goals = self.block_goals.lock();
+        goals.insert(tid, lba + 1);
+        goals.unlock();
+        Ok(lba)
+    }
+
+    /// Sets the goal of the next block allocation of the current thread,
+    /// and returns the previous one.
+    pub(crate) fn set_block_goal(
+        &self,
+        goal: Option<LogicalBlockAddress>,
+    ) -> Option<LogicalBlockAddress> {
+        let tid = keos::thread::Current::get_tid();
+        let mut goals = self.block_goals.lock();
+        let prev = match goal {
+            Some(goal) => goals.insert(tid, goal),
+            None => goals.remove(&tid),
+        };
+        goals.unlock();
+        prev
+    }
+
+    /// Allocates a free block, preferring `goal`.
+    ///
+    /// Passing the block that follows the last block of a file as `goal`
+    /// keeps the file contiguous on disk. If `goal` is taken, the next free
+    /// block after it is allocated.
+    pub fn allocate_block_near(
+        &self,
+        goal: LogicalBlockAddress,
+        tx: &RunningTransaction,
+    ) -> Result<LogicalBlockAddress, KernelError> {
+        self.allocate_run(1, Some(goal), tx).map(|(lba, _)| lba)
+    }
+
+    /// Allocates `nr` blocks at once, in as few contiguous runs as possible.
+    ///
+    /// Returns the runs as the first block and the length of each. On
+    /// failure, the blocks allocated so far stay in the transaction.
+    pub fn allocate_blocks(
+        &self,
+        nr: usize,
+        goal: Option<LogicalBlockAddress>,
+        tx: &RunningTransaction,
+    ) -> Result<Vec<(LogicalBlockAddress, usize)>, KernelError> {
+        let mut runs: Vec<(LogicalBlockAddress, usize)> = Vec::new();
+        let mut done = 0;
+        while done < nr {
+            let goal = runs.last().map(|(lba, len)| *lba + *len).or(goal);
+            let (lba, len) = self.allocate_run(nr - done, goal, tx)?;
+            match runs.last_mut() {
+                Some((last, last_len)) if *last + *last_len == lba => *last_len += len,
+                _ => runs.push((lba, len)),
             }
-            bitmap.forget();
+            done += len;
         }
-        Err(KernelError::NoSpace)
+        Ok(runs)
     }
 
     /// Retrieves an inode from disk or cache.
     ///
     /// This function returns a [`TrackedInode`] corresponding to the given
     /// inode number. If the inode is cached in memory, it is returned
-    /// directly; otherwise, it is read from disk and added to the cache.
+    /// directly; otherwise, it is read from disk and added to the cache,
+    /// along with the other inodes of its inode array block.
     ///
     /// This method manages a "unique view" of a single inode.
     pub fn get_inode(self: &Arc<Self>, ino: InodeNumber) -> Result<TrackedInode, KernelError> {
         let mut guard = self.inodes.lock();
-        let result = match guard.entry(ino) {
-            Entry::Occupied(en) => Ok(TrackedInode::new(en.get().clone(), Arc::downgrade(self))),
-            Entry::Vacant(en) => {
-                // Lookup inode bitmap.
-                let (lba, offset) = self.get_inode_bitmap_lba_index(ino).unwrap();
-                let bitmap_block = InodeBitmap::load(self, lba)?;
-                if !bitmap_block.read().is_allocated(offset) {
-                    return Err(KernelError::NoSuchEntry);
-                }
+        let mut cache = self.inode_cache.lock();
+        let result = if let Some(inode) = guard.get(&ino) {
+            cache.stat.hits += 1;
+            Ok(inode.clone())
+        } else if let Some(inode) = cache.take(ino) {
+            cache.stat.hits += 1;
+            guard.insert(ino, inode.clone());
+            Ok(inode)
+        } else {
+            cache.stat.misses += 1;
+            self.load_inode(ino, &guard, &mut cache).inspect(|inode| {
+                guard.insert(ino, inode.clone());
+            })
+        };
+        cache.unlock();
+        guard.unlock();
+        result.map(|inode| TrackedInode::new(inode, Arc::downgrade(self)))
+    }
 
-                let (lba, index) = self.get_inode_array_lba_index(ino).unwrap();
-                let inodes = InodeArray::load(self, lba)?;
-                let inode = Inode::from_disk_layout(&inodes.read()[index])?;
-                if inode.ino != ino {
-                    return Err(KernelError::FilesystemCorrupted("Inode number mismatch"));
-                }
+    /// Reads the inode `ino` from the inode array, and caches the other
+    /// inodes of its block that are not in `live`.
+    fn load_inode(
+        &self,
+        ino: InodeNumber,
+        live: &BTreeMap<InodeNumber, Arc<RwLock<Inode>>>,
+        cache: &mut InodeCache,
+    ) -> Result<Arc<RwLock<Inode>>, KernelError> {
+        // Lookup inode bitmap.
+        let (lba, offset) = self.get_inode_bitmap_lba_index(ino).unwrap();
+        let bitmap_block = InodeBitmap::load(self, lba)?;
+        if !bitmap_block.read().is_allocated(offset) {
+            return Err(KernelError::NoSuchEntry);
+        }
 
-                let inode = Arc::new(RwLock::new(inode));
-                en.insert(inode.clone());
-                Ok(TrackedInode::new(inode, Arc::downgrade(self)))
+        let (lba, index) = self.get_inode_array_lba_index(ino).unwrap();
+        let inodes = InodeArray::load(self, lba)?;
+        let array = inodes.read();
+        let inode = Inode::from_disk_layout(&array[index])?;
+        if inode.ino != ino {
+            return Err(KernelError::FilesystemCorrupted("Inode number mismatch"));
+        }
+        for (i, en) in array.iter().enumerate() {
+            if !cache.has_room() {
+                break;
             }
-        };
-        guard.unlock();
-        result
+            if let Some(other) = en.ino
+                && i != index
+                && other != ino
+                && !live.contains_key(&other)
+                && !cache.contains(other)
+                && let Ok(other_inode) = Inode::from_disk_layout(en)
+            {
+                cache.put(other, Arc::new(RwLock::new(other_inode)));
+                cache.stat.prefetched += 1;
+            }
+        }
+        Ok(Arc::new(RwLock::new(inode)))
     }
 
     /// Removes an inode from the in-memory inode table.
     ///
     /// This function evicts the given inode from the inode cache maintained
     /// by the file system. It does not remove the inode’s contents on disk,
-    /// only its in-memory representation.
+    /// only its in-memory representation. An inode that still has a link is
+    /// kept in the [`InodeCache`] for the next lookup.
     pub fn remove_inode(&self, ino: InodeNumber) -> Option<Arc<RwLock<Inode>>> {
         let mut guard = self.inodes.lock();
         if let Entry::Occupied(en) = guard.entry(ino)
             && Arc::strong_count(en.get()) == 2
         {
             let result = en.remove();
+            if result.read().link_count > 0 {
+                let mut cache = self.inode_cache.lock();
+                cache.put(ino, result.clone());
+                cache.unlock();
+            }
             guard.unlock();
             // This means the caller only has the sole reference to the inode.
             return Some(result);
@@ -609,6 +788,22 @@ impl FastFileSystemInner {
         guard.unlock();
         None
     }
+
+    /// Returns the counters of the inode cache.
+    pub fn inode_cache_stat(&self) -> InodeCacheStat {
+        let cache = self.inode_cache.lock();
+        let stat = cache.stat;
+        cache.unlock();
+        stat
+    }
+}
+
+impl Drop for FastFileSystemInner {
+    fn drop(&mut self) {
+        // Do not lose the pending group on unmount.
+        let _ = self.sync_journal();
+        self.stop_group_commit();
+    }
 }
 
 /// A reference-counted wrapper around [`FastFileSystemInner`].
@@ -640,12 +835,16 @@ impl FastFileSystem {
         disable_journal: bool,
     ) -> Result<Self, KernelError> {
         let sb = disk_layout::SuperBlock::from_disk(&disk)?;
-        Ok(Self(Arc::new(FastFileSystemInner::from_raw_sb(
+        let inner = Arc::new(FastFileSystemInner::from_raw_sb(
             sb,
             disk,
             debug_journal,
             disable_journal,
-        )?)))
+        )?);
+        if inner.journal.is_some() {
+            FastFileSystemInner::start_group_commit(&inner);
+        }
+        Ok(Self(inner))
     }
 
     /// Retrieves an in-memory representation of the inode identified by `ino`.
@@ -659,9 +858,11 @@ impl FastFileSystem {
 
 impl keos::fs::traits::FileSystem for FastFileSystem {
     fn root(&self) -> Option<keos::fs::Directory> {
-        Some(keos::fs::Directory(Arc::new(Directory::new(
+        let ffs = Arc::downgrade(&self.0);
+        let root = keos::fs::Directory(Arc::new(Directory::new(
             self.get_inode(Self::ROOT_INODE_NUMBER).unwrap(),
-            Arc::downgrade(&self.0),
-        )?)))
+            ffs.clone(),
+        )?));
+        Some(keos::fs::Directory::new(vfs::Directory::new(root, &ffs)))
     }
 }
@@ -9,6 +9,7 @@
 //! utility methods to convert between disk layout positions and internal
 //! structures.
 use super::FastFileSystemInner;
+use crate::lru::ShardKey;
 use core::{iter::Step, num::NonZeroU64};
 use keos::{KernelError, fs::Sector};
 
@@ -116,6 +117,12 @@ impl LogicalBlockAddress {
     }
 }
 
+impl ShardKey for LogicalBlockAddress {
+    fn shard_hash(&self) -> u64 {
+        self.into_u64()
+    }
+}
+
 // Sugars for LBA and FBN.
 impl Step for LogicalBlockAddress {
     fn steps_between(start: &Self, end: &Self) -> (usize, Option<usize>) {
@@ -0,0 +1,245 @@
+//! The file objects that the file system hands out.
+//!
+//! [`FastFileSystem::root`] wraps the [`fs_objects`] of the file system, and
+//! every file opened or created through them, into the objects of this
+//! module. They forward each operation to the wrapped object, and add the
+//! parts that do not depend on how the wrapped objects are implemented:
+//! - [`RegularFile::read_blocks`] reads the [`Extent`]s of a file with a
+//!   single disk request each.
+//! - [`Directory`] looks up the names of a large directory through its
+//!   [`DirIndex`], and keeps the index up to date once each `create` and
+//!   `unlink` is committed.
+//!
+//! [`DirIndex`]: crate::ffs::dir_index::DirIndex
+//! [`FastFileSystem::root`]: crate::ffs::FastFileSystem
+//! [`fs_objects`]: crate::ffs::fs_objects
+//! [`Extent`]: crate::ffs::extent::Extent
+//! [`RegularFile::read_blocks`]: keos::fs::traits::RegularFile::read_blocks
+use crate::ffs::{
+    FastFileSystemInner, FileBlockNumber, InodeNumber, dir_index, fs_objects, types::FileType,
+};
+use alloc::{
+    string::String,
+    sync::{Arc, Weak},
+    vec::Vec,
+};
+use keos::{KernelError, mm::Page, sync::atomic::AtomicBool};
+
+/// Wrap a file of the file system.
+pub fn wrap(file: keos::fs::File, ffs: &Weak<FastFileSystemInner>) -> keos::fs::File {
+    match file {
+        keos::fs::File::RegularFile(file) => {
+            keos::fs::File::RegularFile(keos::fs::RegularFile::new(RegularFile {
+                file,
+                ffs: ffs.clone(),
+            }))
+        }
+        keos::fs::File::Directory(dir) => {
+            keos::fs::File::Directory(keos::fs::Directory::new(Directory {
+                dir,
+                ffs: ffs.clone(),
+            }))
+        }
+    }
+}
+
+/// A regular file of the file system.
+pub struct RegularFile {
+    file: keos::fs::RegularFile,
+    ffs: Weak<FastFileSystemInner>,
+}
+
+impl keos::fs::traits::RegularFile for RegularFile {
+    fn ino(&self) -> InodeNumber {
+        self.file.0.ino()
+    }
+
+    fn size(&self) -> usize {
+        self.file.0.size()
+    }
+
+    fn read(&self, fba: FileBlockNumber, buf: &mut [u8; 4096]) -> Result<bool, KernelError> {
+        self.file.0.read(fba, buf)
+    }
+
+    fn write(
+        &self,
+        fba: FileBlockNumber,
+        buf: &[u8; 4096],
+        min_size: usize,
+    ) -> Result<(), KernelError> {
+        self.file.0.write(fba, buf, min_size)
+    }
+
+    /// Reads consecutive file blocks starting at `fba` into `buf`.
+    ///
+    /// The blocks are mapped into extents, and each extent is read with a
+    /// single disk request. Blocks beyond the end of the file are left
+    /// untouched.
+    fn read_blocks(&self, fba: FileBlockNumber, buf: &mut [u8]) -> Result<(), KernelError> {
+        let ffs = self
+            .ffs
+            .upgrade()
+            .ok_or(KernelError::FilesystemCorrupted("File system closed."))?;
+        let inode = ffs.get_inode(self.ino())?;
+        let inode = inode.read();
+        for ext in inode.extents(&ffs, fba, buf.len() / 4096)? {
+            let ofs = (ext.fba.0 - fba.0) * 4096;
+            ffs.read_data_blocks(ext.lba, &mut buf[ofs..ofs + ext.len * 4096])?;
+        }
+        Ok(())
+    }
+
+    fn write_blocks(
+        &self,
+        fba: FileBlockNumber,
+        buf: &[u8],
+        min_size: usize,
+    ) -> Result<(), KernelError> {
+        self.file.0.write_blocks(fba, buf, min_size)
+    }
+
+    fn mmap(&self, fba: FileBlockNumber) -> Result<Page, KernelError> {
+        self.file.0.mmap(fba)
+    }
+
+    /// Also makes the transactions of the [`CommitGroup`] durable.
+    ///
+    /// [`CommitGroup`]: crate::ffs::group_commit::CommitGroup
+    fn writeback(&self) -> Result<(), KernelError> {
+        self.file.0.writeback()?;
+        self.ffs.upgrade().map_or(Ok(()), |ffs| ffs.sync_journal())
+    }
+
+    fn fs_id(&self) -> Option<u64> {
+        self.ffs.upgrade().map(|ffs| ffs.mount_id)
+    }
+}
+
+/// A directory of the file system.
+pub struct Directory {
+    dir: keos::fs::Directory,
+    ffs: Weak<FastFileSystemInner>,
+}
+
+impl Directory {
+    /// Wrap the directory `dir` of `ffs`.
+    pub fn new(dir: keos::fs::Directory, ffs: &Weak<FastFileSystemInner>) -> Self {
+        Self {
+            dir,
+            ffs: ffs.clone(),
+        }
+    }
+
+    /// Opens the file `ino` of `ffs`.
+    fn open(
+        ffs: &Arc<FastFileSystemInner>,
+        ino: InodeNumber,
+    ) -> Result<keos::fs::File, KernelError> {
+        let inode = ffs.get_inode(ino)?;
+        let weak = Arc::downgrade(ffs);
+        let file = if inode.read().ftype == FileType::Directory {
+            fs_objects::Directory::new(inode, weak)
+                .map(|dir| keos::fs::File::Directory(keos::fs::Directory::new(dir)))
+        } else {
+            fs_objects::RegularFile::new(inode, weak)
+                .map(|file| keos::fs::File::RegularFile(keos::fs::RegularFile::new(file)))
+        };
+        file.ok_or(KernelError::FilesystemCorrupted("Unknown file type"))
+    }
+
+    /// Finds `entry` through the index of the directory, if it is large.
+    ///
+    /// Returns `None` for a small directory.
+    fn lookup(
+        &self,
+        ffs: &Arc<FastFileSystemInner>,
+        entry: &str,
+    ) -> Result<Option<Option<(usize, InodeNumber)>>, KernelError> {
+        let dir = ffs.get_inode(self.dir.0.ino())?;
+        let inode = dir.read();
+        match dir_index::index(ffs, &inode)? {
+            Some(index) => dir_index::lookup(ffs, &inode, &index, entry).map(Some),
+            None => Ok(None),
+        }
+    }
+
+    /// Returns the file system of the directory.
+    fn ffs(&self) -> Result<Arc<FastFileSystemInner>, KernelError> {
+        self.ffs
+            .upgrade()
+            .ok_or(KernelError::FilesystemCorrupted("File system closed."))
+    }
+}
+
+impl keos::fs::traits::Directory for Directory {
+    fn ino(&self) -> InodeNumber {
+        self.dir.0.ino()
+    }
+
+    fn size(&self) -> usize {
+        self.dir.0.size()
+    }
+
+    fn link_count(&self) -> usize {
+        self.dir.0.link_count()
+    }
+
+    fn open_entry(&self, entry: &str) -> Result<keos::fs::File, KernelError> {
+        let ffs = self.ffs()?;
+        let file = match self.lookup(&ffs, entry)? {
+            Some(Some((_, ino))) => Self::open(&ffs, ino)?,
+            Some(None) => return Err(KernelError::NoSuchEntry),
+            None => self.dir.0.open_entry(entry)?,
+        };
+        Ok(wrap(file, &self.ffs))
+    }
+
+    fn create_entry(&self, entry: &str, is_dir: bool) -> Result<keos::fs::File, KernelError> {
+        let ffs = self.ffs()?;
+        if let Some(Some(_)) = self.lookup(&ffs, entry)? {
+            return Err(KernelError::FileExist);
+        }
+        let file = self.dir.0.create_entry(entry, is_dir)?;
+        if let Some(index) = dir_index::installed(&ffs, self.dir.0.ino()) {
+            let dir = ffs.get_inode(self.dir.0.ino())?;
+            let inode = dir.read();
+            if !dir_index::created(&ffs, &inode, &index, entry)? {
+                dir_index::invalidate(&ffs, self.dir.0.ino());
+            }
+        }
+        Ok(wrap(file, &self.ffs))
+    }
+
+    fn unlink_entry(&self, entry: &str) -> Result<(), KernelError> {
+        let ffs = self.ffs()?;
+        let found = self.lookup(&ffs, entry)?;
+        self.dir.0.unlink_entry(entry)?;
+        if let Some(index) = dir_index::installed(&ffs, self.dir.0.ino()) {
+            let dir = ffs.get_inode(self.dir.0.ino())?;
+            let inode = dir.read();
+            let updated = match found {
+                Some(Some((slot, _))) => dir_index::removed(&ffs, &inode, &index, entry, slot)?,
+                _ => false,
+            };
+            if !updated {
+                dir_index::invalidate(&ffs, self.dir.0.ino());
+            }
+        }
+        Ok(())
+    }
+
+    fn read_dir(&self) -> Result<Vec<(InodeNumber, String)>, KernelError> {
+        self.dir.0.read_dir()
+    }
+
+    fn removed(&self) -> Result<&AtomicBool, KernelError> {
+        self.dir.0.removed()
+    }
+
+    /// Every entry of the file system is changed through the path walk, so
+    /// the entries can be cached by the mount.
+    fn fs_id(&self) -> Option<u64> {
+        self.ffs.upgrade().map(|ffs| ffs.mount_id)
+    }
+}
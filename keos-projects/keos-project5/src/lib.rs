@@ -54,17 +54,20 @@ macro_rules! const_assert {
 }
 
 pub mod advanced_file_structs;
+pub mod cache_charge;
 pub mod ffs;
 pub mod lru;
 pub mod page_cache;
 pub mod process;
+pub mod writeback;
 
 use core::ops::Range;
 
 use advanced_file_structs::AdvancedFileStructs;
-use alloc::{boxed::Box, collections::btree_set::BTreeSet};
+use alloc::{boxed::Box, collections::btree_set::BTreeSet, sync::Arc};
 use keos::{
     KernelError,
+    acct::Account,
     addressing::{Pa, Va},
     sync::SpinLock,
     syscall::Registers,
@@ -72,7 +75,7 @@ use keos::{
     thread::with_current,
 };
 use keos_project1::syscall::SyscallAbi;
-use keos_project3::{fork::fork, get_phys::get_phys};
+use keos_project3::{fork::fork, get_phys::get_phys, spawn::spawn};
 pub use process::Thread;
 
 #[doc(hidden)]
@@ -132,11 +135,44 @@ pub enum SyscallNumber {
     Stat = 19,
     /// Synchronize a file's in-memory state with disk.
     Fsync = 20,
+    /// Set the nice value of the calling thread.
+    SetNice = 21,
+    /// Set the cpu affinity mask of the calling thread.
+    SetAffinity = 22,
+    /// Wait on or wake up a futex.
+    Futex = 23,
+    /// Execute the submissions of a system call ring.
+    UringEnter = 24,
+    /// Reads data from a file descriptor into several buffers.
+    Readv = 25,
+    /// Writes data from several buffers to a file descriptor.
+    Writev = 26,
+    /// Reads data at an offset of a file into several buffers.
+    Preadv = 27,
+    /// Writes data from several buffers at an offset of a file.
+    Pwritev = 28,
+    /// Copies data between two files inside the kernel.
+    CopyFileRange = 29,
+    /// Create a process from an executable.
+    Spawn = 30,
     // == Grading Only ==
     /// Get Physical Address of Page (for grading purposes only)
     GetPhys = 0x81,
 }
 
+/// System calls that a ring may submit.
+const URING_SYSCALLS: [usize; 9] = [
+    SyscallNumber::Read as usize,
+    SyscallNumber::Write as usize,
+    SyscallNumber::Seek as usize,
+    SyscallNumber::Readv as usize,
+    SyscallNumber::Writev as usize,
+    SyscallNumber::Preadv as usize,
+    SyscallNumber::Pwritev as usize,
+    SyscallNumber::CopyFileRange as usize,
+    SyscallNumber::Fsync as usize,
+];
+
 impl TryFrom<usize> for SyscallNumber {
     type Error = KernelError;
     fn try_from(no: usize) -> Result<SyscallNumber, Self::Error> {
@@ -162,6 +198,16 @@ impl TryFrom<usize> for SyscallNumber {
             18 => Ok(SyscallNumber::Readdir),
             19 => Ok(SyscallNumber::Stat),
             20 => Ok(SyscallNumber::Fsync),
+            21 => Ok(SyscallNumber::SetNice),
+            22 => Ok(SyscallNumber::SetAffinity),
+            23 => Ok(SyscallNumber::Futex),
+            24 => Ok(SyscallNumber::UringEnter),
+            25 => Ok(SyscallNumber::Readv),
+            26 => Ok(SyscallNumber::Writev),
+            27 => Ok(SyscallNumber::Preadv),
+            28 => Ok(SyscallNumber::Pwritev),
+            29 => Ok(SyscallNumber::CopyFileRange),
+            30 => Ok(SyscallNumber::Spawn),
             0x81 => Ok(SyscallNumber::GetPhys),
             _ => Err(KernelError::NoSuchSyscall),
         }
@@ -219,6 +265,13 @@ impl Task for Thread {
             SyscallNumber::Tell => self.with_file_struct_mut(|fs, abi| fs.tell(abi), &abi),
             SyscallNumber::Close => self.with_file_struct_mut(|fs, abi| fs.close(abi), &abi),
             SyscallNumber::Pipe => self.with_file_struct_mut(|fs, abi| fs.pipe(abi), &abi),
+            SyscallNumber::Readv => self.with_file_struct_mut(|fs, abi| fs.readv(abi), &abi),
+            SyscallNumber::Writev => self.with_file_struct_mut(|fs, abi| fs.writev(abi), &abi),
+            SyscallNumber::Preadv => self.with_file_struct_mut(|fs, abi| fs.preadv(abi), &abi),
+            SyscallNumber::Pwritev => self.with_file_struct_mut(|fs, abi| fs.pwritev(abi), &abi),
+            SyscallNumber::CopyFileRange => {
+                self.with_file_struct_mut(|fs, abi| fs.copy_file_range(abi), &abi)
+            }
             SyscallNumber::Mmap => {
                 self.with_file_mm_struct_mut(|fs, mm, abi| mm.mmap(fs, abi), &abi)
             }
@@ -239,6 +292,20 @@ impl Task for Thread {
                 },
                 &abi,
             ),
+            SyscallNumber::Spawn => self.with_file_struct_mut(
+                |fs, abi| {
+                    spawn(fs, abi, |name, file_struct, mm_struct| {
+                        let builder = keos::thread::ThreadBuilder::new(name);
+                        let tid = builder.get_tid();
+                        builder.attach_task(Box::new(Thread::from_fs_mm_struct(
+                            file_struct,
+                            mm_struct,
+                            tid,
+                        )))
+                    })
+                },
+                &abi,
+            ),
             SyscallNumber::ThreadCreate => self.thread_create(&abi),
             SyscallNumber::ThreadJoin => self.thread_join(&abi),
             SyscallNumber::ExitGroup => self.exit_group(&abi),
@@ -249,6 +316,20 @@ impl Task for Thread {
             SyscallNumber::Readdir => self.with_file_struct_mut(|fs, abi| fs.readdir(abi), &abi),
             SyscallNumber::Stat => self.with_file_struct_mut(|fs, abi| fs.stat(abi), &abi),
             SyscallNumber::Fsync => self.with_file_struct_mut(|fs, abi| fs.fsync(abi), &abi),
+            SyscallNumber::SetNice => with_current(|th| th.set_nice(abi.arg1 as i32)).map(|_| 0),
+            SyscallNumber::SetAffinity => {
+                keos::thread::Current::set_affinity(abi.arg1 as u64).map(|_| 0)
+            }
+            SyscallNumber::Futex => {
+                keos::sync::futex::futex(abi.arg1, abi.arg2, abi.arg3, abi.arg4, abi.arg5)
+            }
+            SyscallNumber::UringEnter => keos::syscall::uring::enter(
+                abi.arg1,
+                abi.arg2,
+                &URING_SYSCALLS,
+                abi.regs,
+                |regs| self.syscall(regs),
+            ),
             SyscallNumber::GetPhys => {
                 self.with_file_mm_struct_mut(|fs, mm, abi| get_phys(mm, fs, abi), &abi)
             }
@@ -280,4 +361,9 @@ impl Task for Thread {
     fn with_page_table_pa(&self, f: &fn(Pa)) {
         self.0.with_page_table_pa(f)
     }
+
+    #[inline]
+    fn account(&self) -> Option<Arc<Account>> {
+        self.0.account()
+    }
 }
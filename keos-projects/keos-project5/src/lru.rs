@@ -22,21 +22,37 @@
 //! assert!(cache.get(1).is_some());
 //! assert!(cache.get(3).is_some());
 //! ```
+//!
+//! The entries live in a slab, and the recency list links them by their slab
+//! index, so that a hit costs a single lookup of the key and no clone of it.
+//!
+//! A cache that many cores look up at once can be a [`ShardedLRUCache`]
+//! instead, which splits the entries over `SHARDS` [`LRUCache`]s by the
+//! [`ShardKey`] of their keys, each behind its own lock. Lookups of keys in
+//! different shards do not wait for each other, at the cost that the least
+//! recently used entry is evicted within a shard, not within the whole cache.
 use alloc::{collections::BTreeMap, vec::Vec};
+use keos::sync::SpinLock;
 
-struct Node<K: Clone, V> {
+/// Index of an entry in the slab.
+type Idx = u32;
+
+struct Node<K, V> {
+    k: K,
     v: V,
-    prev: Option<K>,
-    next: Option<K>,
+    prev: Option<Idx>,
+    next: Option<Idx>,
 }
 
 /// An Least Recently Used Cache with capacity `MAX_SIZE`.
 pub struct LRUCache<K: Ord + Clone, V, const MAX_SIZE: usize> {
-    inner: BTreeMap<K, Node<K, V>>,
+    index: BTreeMap<K, Idx>,
+    slab: Vec<Option<Node<K, V>>>,
+    free: Vec<Idx>,
 
     // Access information
-    head: Option<K>,
-    tail: Option<K>,
+    head: Option<Idx>,
+    tail: Option<Idx>,
 }
 
 impl<K: Ord + Clone, V, const MAX_SIZE: usize> Default for LRUCache<K, V, MAX_SIZE> {
@@ -46,43 +62,62 @@ impl<K: Ord + Clone, V, const MAX_SIZE: usize> Default for LRUCache<K, V, MAX_SI
 }
 
 impl<K: Ord + Clone, V, const MAX_SIZE: usize> LRUCache<K, V, MAX_SIZE> {
-    // Attach the access information about key.
-    fn attach(&mut self, k: K) -> &mut Node<K, V> {
-        if let Some(tail) = self.tail.take() {
-            let last = self.inner.get_mut(&tail).unwrap();
-            last.next = Some(k.clone());
+    /// Maximum number of the entries in the cache.
+    pub const CAPACITY: usize = MAX_SIZE;
+
+    fn node(&mut self, idx: Idx) -> &mut Node<K, V> {
+        self.slab[idx as usize].as_mut().unwrap()
+    }
+
+    // Attach the entry at the most recently used end.
+    fn attach(&mut self, idx: Idx) -> &mut Node<K, V> {
+        let ptail = self.tail.replace(idx);
+        if let Some(tail) = ptail {
+            self.node(tail).next = Some(idx);
         } else {
-            self.head = Some(k.clone());
+            self.head = Some(idx);
         }
-        let ptail = self.tail.clone();
-        self.tail = Some(k.clone());
-
-        let node = self.inner.get_mut(&k).unwrap();
+        let node = self.node(idx);
         node.prev = ptail;
+        node.next = None;
         node
     }
 
-    // Detach the access information about key.
-    fn detach(&mut self, prev: Option<K>, next: Option<K>) {
-        if let Some(next) = next.as_ref() {
-            self.inner.get_mut(next).unwrap().prev = prev.clone();
+    // Detach the entry from the recency list.
+    fn detach(&mut self, idx: Idx) {
+        let node = self.node(idx);
+        let (prev, next) = (node.prev.take(), node.next.take());
+        if let Some(next) = next {
+            self.node(next).prev = prev;
         } else {
-            self.tail = prev.clone();
+            self.tail = prev;
         }
 
         if let Some(prev) = prev {
-            self.inner.get_mut(&prev).unwrap().next = next;
+            self.node(prev).next = next;
         } else {
             self.head = next;
         }
     }
 
+    // Mark the entry as the most recently used.
+    fn touch(&mut self, idx: Idx) -> &mut Node<K, V> {
+        if self.tail != Some(idx) {
+            self.detach(idx);
+            self.attach(idx)
+        } else {
+            self.node(idx)
+        }
+    }
+
     /// Makes a new, empty `LRUCache`.
     ///
     /// Does not allocate anything on its own.
     pub const fn new() -> Self {
         Self {
-            inner: BTreeMap::new(),
+            index: BTreeMap::new(),
+            slab: Vec::new(),
+            free: Vec::new(),
             head: None,
             tail: None,
         }
@@ -91,10 +126,8 @@ impl<K: Ord + Clone, V, const MAX_SIZE: usize> LRUCache<K, V, MAX_SIZE> {
     /// Returns a mutable reference to the value corresponding to the key and
     /// update the last access time.
     pub fn get(&mut self, k: K) -> Option<&mut V> {
-        let node = self.inner.get_mut(&k)?;
-        let (prev, next) = (node.prev.take(), node.next.take());
-        self.detach(prev, next);
-        Some(&mut self.attach(k).v)
+        let idx = *self.index.get(&k)?;
+        Some(&mut self.touch(idx).v)
     }
 
     /// Inserts the value computed with `f` into the `LRUCache` if it is not
@@ -104,32 +137,53 @@ impl<K: Ord + Clone, V, const MAX_SIZE: usize> LRUCache<K, V, MAX_SIZE> {
         k: K,
         f: impl FnOnce() -> Result<V, E>,
     ) -> Result<&mut V, E> {
-        Ok(if let Some(node) = self.inner.get_mut(&k) {
-            let (prev, next) = (node.prev.take(), node.next.take());
-            self.detach(prev, next);
-            &mut self.attach(k).v
+        Ok(if let Some(&idx) = self.index.get(&k) {
+            &mut self.touch(idx).v
         } else {
             &mut self.__put(k, f()?).v
         })
     }
 
     fn __put(&mut self, k: K, v: V) -> &mut Node<K, V> {
-        if let Some(node) = self.inner.get_mut(&k) {
-            node.v = v;
-            let (prev, next) = (node.prev.take(), node.next.take());
-            self.detach(prev, next);
-        } else {
-            if MAX_SIZE <= self.inner.len() {
-                self.remove(&self.head.clone().unwrap());
-            }
-            let node = Node {
-                v,
-                prev: self.tail.clone(),
-                next: None,
-            };
-            self.inner.insert(k.clone(), node);
+        if let Some(&idx) = self.index.get(&k) {
+            self.node(idx).v = v;
+            return self.touch(idx);
         }
-        self.attach(k)
+        if MAX_SIZE <= self.index.len() {
+            let head = self.head.unwrap();
+            self.remove_at(head);
+        }
+        let node = Some(Node {
+            k: k.clone(),
+            v,
+            prev: None,
+            next: None,
+        });
+        let idx = if let Some(idx) = self.free.pop() {
+            self.slab[idx as usize] = node;
+            idx
+        } else {
+            self.slab.push(node);
+            (self.slab.len() - 1) as Idx
+        };
+        self.index.insert(k, idx);
+        self.attach(idx)
+    }
+
+    /// Returns the number of the entries.
+    pub fn len(&self) -> usize {
+        self.index.len()
+    }
+
+    /// Returns true if the cache has no entry.
+    pub fn is_empty(&self) -> bool {
+        self.index.is_empty()
+    }
+
+    /// Returns true if the cache has the key, without updating the last
+    /// access time.
+    pub fn contains_key(&self, k: &K) -> bool {
+        self.index.contains_key(k)
     }
 
     /// Inserts a key-value pair into the `LRUCache`.
@@ -144,6 +198,14 @@ impl<K: Ord + Clone, V, const MAX_SIZE: usize> LRUCache<K, V, MAX_SIZE> {
         self.__put(k, v);
     }
 
+    fn remove_at(&mut self, idx: Idx) -> V {
+        self.detach(idx);
+        let node = self.slab[idx as usize].take().unwrap();
+        self.index.remove(&node.k);
+        self.free.push(idx);
+        node.v
+    }
+
     /// Removes a key from the LRUCache, returning the stored value if the
     /// key was previously in the LRUCache.
     ///
@@ -151,9 +213,8 @@ impl<K: Ord + Clone, V, const MAX_SIZE: usize> LRUCache<K, V, MAX_SIZE> {
     /// ordering on the borrowed form must match the ordering on the key
     /// type.
     pub fn remove(&mut self, k: &K) -> Option<V> {
-        let mut node = self.inner.remove(k)?;
-        self.detach(node.prev.take(), node.next.take());
-        Some(node.v)
+        let idx = *self.index.get(k)?;
+        Some(self.remove_at(idx))
     }
 
     /// Retains only the elements specified by the predicate.
@@ -161,23 +222,106 @@ impl<K: Ord + Clone, V, const MAX_SIZE: usize> LRUCache<K, V, MAX_SIZE> {
     /// false.
     pub fn retain(&mut self, mut f: impl FnMut(&K, &mut V) -> bool) {
         let retain_targets = self
-            .inner
+            .slab
             .iter_mut()
-            .filter_map(|(k, v)| {
-                if !f(k, &mut v.v) {
-                    Some(k.clone())
+            .enumerate()
+            .filter_map(|(idx, node)| {
+                let node = node.as_mut()?;
+                if !f(&node.k, &mut node.v) {
+                    Some(idx as Idx)
                 } else {
                     None
                 }
             })
             .collect::<Vec<_>>();
         for target in retain_targets.into_iter() {
-            self.remove(&target);
+            self.remove_at(target);
         }
     }
 
-    /// Iterates over the key-value pairs in the LRUCache.
+    /// Iterates over the key-value pairs in the LRUCache, in the order of
+    /// the keys.
     pub fn iter_mut(&mut self) -> impl Iterator<Item = (&K, &mut V)> {
-        self.inner.iter_mut().map(|(k, v)| (k, &mut v.v))
+        let slab = self.slab.as_mut_ptr();
+        self.index.values().map(move |&idx| {
+            // Safety: each index appears once in the map, so the yielded
+            // references never alias, and both borrows live as long as
+            // `&mut self`.
+            let node = unsafe { (*slab.add(idx as usize)).as_mut().unwrap() };
+            (&node.k, &mut node.v)
+        })
+    }
+}
+
+/// A key that selects the shard of a [`ShardedLRUCache`].
+pub trait ShardKey {
+    /// Returns a hash of the key.
+    ///
+    /// The hash need not be uniform; consecutive integers are fine.
+    fn shard_hash(&self) -> u64;
+}
+
+/// An LRU cache with capacity `SHARD_SIZE * SHARDS`, split into `SHARDS`
+/// independently locked [`LRUCache`]s.
+pub struct ShardedLRUCache<
+    K: Ord + Clone + ShardKey,
+    V,
+    const SHARD_SIZE: usize,
+    const SHARDS: usize,
+> {
+    shards: [SpinLock<LRUCache<K, V, SHARD_SIZE>>; SHARDS],
+}
+
+impl<K: Ord + Clone + ShardKey, V, const SHARD_SIZE: usize, const SHARDS: usize> Default
+    for ShardedLRUCache<K, V, SHARD_SIZE, SHARDS>
+{
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl<K: Ord + Clone + ShardKey, V, const SHARD_SIZE: usize, const SHARDS: usize>
+    ShardedLRUCache<K, V, SHARD_SIZE, SHARDS>
+{
+    /// Maximum number of the entries in the cache.
+    pub const CAPACITY: usize = SHARD_SIZE * SHARDS;
+
+    /// Makes a new, empty `ShardedLRUCache`.
+    ///
+    /// Does not allocate anything on its own.
+    pub const fn new() -> Self {
+        Self {
+            shards: [const { SpinLock::new(LRUCache::new()) }; SHARDS],
+        }
+    }
+
+    /// Returns the shard that holds the key.
+    ///
+    /// All accesses to the key go through the returned [`LRUCache`].
+    pub fn shard(&self, k: &K) -> &SpinLock<LRUCache<K, V, SHARD_SIZE>> {
+        // Fibonacci hashing spreads the runs of consecutive keys.
+        let h = k.shard_hash().wrapping_mul(0x9e37_79b9_7f4a_7c15);
+        &self.shards[(h >> 32) as usize % SHARDS]
+    }
+
+    /// Returns the number of the entries.
+    ///
+    /// The shards are counted one by one, so the result may be stale if the
+    /// cache is accessed concurrently.
+    pub fn len(&self) -> usize {
+        self.shards
+            .iter()
+            .map(|shard| {
+                let guard = shard.lock();
+                let len = guard.len();
+                guard.unlock();
+                len
+            })
+            .sum()
+    }
+
+    /// Returns true if the cache has no entry.
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
     }
 }
@@ -1,15 +1,96 @@
 //! An overlaying mechanism for appling page cache to any file system.
+//!
+//! ## Readahead window
+//!
+//! Each opened file of the overlay scales the readahead of the page cache
+//! with its access pattern (see [`Readahead`]). While the file is read
+//! sequentially, the window doubles up to [`RA_MAX_CHUNKS`] runs of
+//! [`RA_CHUNK`] blocks, and the next window is requested when the reader
+//! crosses the middle of the current one, so that the I/O overlaps with the
+//! reader. A random access halves the window, and stops the readahead of the
+//! file beyond the block that the page cache reads ahead by itself once the
+//! window is empty.
+//!
+//! The window is requested from the readahead thread of the page cache, run
+//! by run, so that its lock is released between the runs.
+//!
+//! ## Accounting
+//!
+//! Each access through a file of the overlay charges the slots of its blocks
+//! to the current process; see [`cache_charge`].
+//!
+//! [`cache_charge`]: crate::cache_charge
 
-use super::PageCache;
-use alloc::{string::String, vec::Vec};
+use super::{PageCache, Slot};
+use crate::writeback::{self, DirtyState};
+use alloc::{string::String, sync::Arc, vec::Vec};
+use core::ops::Range;
 use keos::{
     fs::{FileBlockNumber, InodeNumber, traits::FileSystem},
     mm::Page,
-    sync::atomic::AtomicUsize,
+    sync::{SpinLock, atomic::AtomicUsize},
 };
 
+/// Number of blocks that [`PageCacheState::readahead`] loads.
+///
+/// [`PageCacheState::readahead`]: super::PageCacheState::readahead
+pub const RA_CHUNK: usize = 16;
+
+/// Maximum readahead window, in runs of [`RA_CHUNK`] blocks.
+pub const RA_MAX_CHUNKS: usize = 8;
+
+/// Readahead window of a file.
+///
+/// Tracks the last block read from the file and the blocks already
+/// requested ahead of it.
+#[derive(Clone, Copy, Debug)]
+pub struct Readahead {
+    /// The last block requested by a reader.
+    last: FileBlockNumber,
+    /// Size of the window, in runs of [`RA_CHUNK`] blocks.
+    chunks: usize,
+    /// The first block that is not requested yet.
+    ahead: FileBlockNumber,
+}
+
+impl Readahead {
+    /// The window of a file whose first read is at `fba`.
+    ///
+    /// The first read requests the blocks up to `ahead` by itself.
+    fn new(fba: FileBlockNumber) -> Self {
+        Self {
+            last: fba,
+            chunks: 1,
+            ahead: fba + 1 + RA_CHUNK,
+        }
+    }
+
+    /// Update the window on a read of `fba` of a file with `nr_blocks`
+    /// blocks, and return the blocks to read ahead.
+    fn on_read(&mut self, fba: FileBlockNumber, nr_blocks: usize) -> Range<usize> {
+        let sequential = fba == self.last || fba == self.last + 1;
+        self.last = fba;
+        let start = if sequential {
+            // Request the next window only after crossing the middle of
+            // the current one.
+            let marker = self.ahead.0.saturating_sub(self.chunks * RA_CHUNK / 2);
+            if fba.0 < marker {
+                return 0..0;
+            }
+            self.chunks = (self.chunks * 2).clamp(1, RA_MAX_CHUNKS);
+            self.ahead.0.max(fba.0 + 1)
+        } else {
+            self.chunks /= 2;
+            fba.0 + 1
+        };
+        let end = (start + self.chunks * RA_CHUNK).min(nr_blocks).max(start);
+        self.ahead = FileBlockNumber(end);
+        start..end
+    }
+}
+
 /// An overlay on the Directory.
-pub struct Directory<FS: FileSystem + 'static>(keos::fs::Directory, PageCache<FS>);
+pub struct Directory<FS: FileSystem + 'static>(keos::fs::Directory, PageCache<FS>, Arc<DirtyState>);
 
 impl<FS: FileSystem> keos::fs::traits::Directory for Directory<FS> {
     fn ino(&self) -> InodeNumber {
@@ -31,11 +112,13 @@ impl<FS: FileSystem> keos::fs::traits::Directory for Directory<FS> {
                     size: AtomicUsize::new(r.size()),
                     file: r,
                     cache: self.1.clone(),
+                    dirty: self.2.clone(),
+                    window: SpinLock::new(None),
                 }))
             }
-            keos::fs::File::Directory(d) => {
-                keos::fs::File::Directory(keos::fs::Directory::new(Directory(d, self.1.clone())))
-            }
+            keos::fs::File::Directory(d) => keos::fs::File::Directory(keos::fs::Directory::new(
+                Directory(d, self.1.clone(), self.2.clone()),
+            )),
         })
     }
 
@@ -46,11 +129,13 @@ impl<FS: FileSystem> keos::fs::traits::Directory for Directory<FS> {
                     size: AtomicUsize::new(r.size()),
                     file: r,
                     cache: self.1.clone(),
+                    dirty: self.2.clone(),
+                    window: SpinLock::new(None),
                 }))
             }
-            keos::fs::File::Directory(d) => {
-                keos::fs::File::Directory(keos::fs::Directory::new(Directory(d, self.1.clone())))
-            }
+            keos::fs::File::Directory(d) => keos::fs::File::Directory(keos::fs::Directory::new(
+                Directory(d, self.1.clone(), self.2.clone()),
+            )),
         })
     }
 
@@ -74,6 +159,14 @@ impl<FS: FileSystem> keos::fs::traits::Directory for Directory<FS> {
     fn removed(&self) -> Result<&keos::sync::atomic::AtomicBool, keos::KernelError> {
         self.0.removed()
     }
+
+    /// The overlay is cached apart from the file system below, as its
+    /// entries are files of the overlay. It changes the entries below only
+    /// through the path walk, so it can be cached if the file system below
+    /// can.
+    fn fs_id(&self) -> Option<u64> {
+        self.0.0.fs_id().map(|_| self.2.fs_id)
+    }
 }
 
 /// An overlay on the RegularFile.
@@ -81,6 +174,42 @@ pub struct RegularFile<FS: FileSystem> {
     file: keos::fs::RegularFile,
     size: AtomicUsize,
     cache: PageCache<FS>,
+    dirty: Arc<DirtyState>,
+    window: SpinLock<Option<Readahead>>,
+}
+
+impl<FS: FileSystem> RegularFile<FS> {
+    /// Charge the slots of `nr_blocks` blocks from `fba` to the current
+    /// process.
+    fn charge(&self, fba: FileBlockNumber, nr_blocks: usize) {
+        self.dirty.charges.charge(
+            &self.cache.0.inner,
+            self.file.0.ino(),
+            fba.0..fba.0 + nr_blocks,
+        );
+    }
+
+    /// Update the readahead window on a read of `fba`, and request the
+    /// blocks ahead of it.
+    fn read_ahead(&self, fba: FileBlockNumber) {
+        let mut window = self.window.lock();
+        let ahead = match window.as_mut() {
+            Some(window) => window.on_read(fba, self.size.load().div_ceil(4096)),
+            None => {
+                *window = Some(Readahead::new(fba));
+                0..0
+            }
+        };
+        window.unlock();
+        // The readahead is opportunistic; a full queue drops the request.
+        for start in ahead.step_by(RA_CHUNK) {
+            let _ = self
+                .cache
+                .0
+                .request
+                .try_send((self.file.clone(), FileBlockNumber(start - 1)));
+        }
+    }
 }
 
 impl<FS: FileSystem> keos::fs::traits::RegularFile for RegularFile<FS> {
@@ -93,7 +222,59 @@ impl<FS: FileSystem> keos::fs::traits::RegularFile for RegularFile<FS> {
     }
 
     fn read(&self, fba: FileBlockNumber, buf: &mut [u8; 4096]) -> Result<bool, keos::KernelError> {
-        self.cache.read(&self.file, fba, buf)
+        let result = self.cache.read(&self.file, fba, buf);
+        self.charge(fba, 1);
+        self.read_ahead(fba);
+        result
+    }
+
+    /// Reads consecutive file blocks starting at `fba` into `buf`.
+    ///
+    /// The cached blocks are copied from the cache. Each run of the blocks
+    /// that are not cached is read from the file system at once, and then
+    /// inserted into the cache.
+    fn read_blocks(&self, fba: FileBlockNumber, buf: &mut [u8]) -> Result<(), keos::KernelError> {
+        let ino = self.ino();
+        let blocks = buf.as_chunks_mut::<4096>().0;
+        let mut i = 0;
+        while i < blocks.len() {
+            let mut guard = self.cache.0.inner.lock();
+            let mut end = i;
+            while end < blocks.len() && guard.get((ino, fba + end)).is_none() {
+                end += 1;
+            }
+            if end == i {
+                let result = guard.do_read(self.file.clone(), fba + i, &mut blocks[i]);
+                guard.unlock();
+                result?;
+                i += 1;
+                continue;
+            }
+            guard.unlock();
+
+            self.file
+                .0
+                .read_blocks(fba + i, blocks[i..end].as_flattened_mut())?;
+            let mut guard = self.cache.0.inner.lock();
+            for (j, block) in blocks.iter_mut().enumerate().take(end).skip(i) {
+                // A block written meanwhile is newer than the one read.
+                if guard.get((ino, fba + j)).is_some() {
+                    let _ = guard.do_read(self.file.clone(), fba + j, block);
+                } else {
+                    let mut page = Page::new();
+                    page.inner_mut().copy_from_slice(block);
+                    guard.insert((ino, fba + j), Slot::new(self.file.clone(), fba + j, page));
+                }
+            }
+            guard.unlock();
+            i = end;
+        }
+        self.charge(fba, blocks.len());
+        if let Some(last) = blocks.len().checked_sub(1).map(|n| fba + n) {
+            let _ = self.cache.0.request.try_send((self.file.clone(), last));
+            self.read_ahead(last);
+        }
+        Ok(())
     }
 
     fn write(
@@ -102,40 +283,48 @@ impl<FS: FileSystem> keos::fs::traits::RegularFile for RegularFile<FS> {
         buf: &[u8; 4096],
         min_size: usize,
     ) -> Result<(), keos::KernelError> {
-        if self.size() < min_size {
+        let result = if self.size() < min_size {
             self.size.store(min_size);
-            let mut guard = self.cache.0.inner.lock();
-            let result = guard.do_write(self.file.clone(), fba, buf, min_size);
-            guard.unlock();
-            result
+            self.dirty
+                .write(&self.cache.0.inner, &self.file, fba, buf, min_size)
         } else {
-            let mut guard = self.cache.0.inner.lock();
-            let result = guard.do_write(self.file.clone(), fba, buf, self.size.load());
-            guard.unlock();
-            result
-        }
+            self.dirty
+                .write(&self.cache.0.inner, &self.file, fba, buf, self.size.load())
+        };
+        self.charge(fba, 1);
+        result
     }
 
     fn writeback(&self) -> Result<(), keos::KernelError> {
         let mut guard = self.cache.0.inner.lock();
         let result = guard.do_writeback(self.file.clone());
         guard.unlock();
-        result
+        result.and_then(|_| self.file.writeback())
+    }
+
+    /// A file of the overlay is written through the cache, apart from the
+    /// file below, so it has the identifier of the overlay.
+    fn fs_id(&self) -> Option<u64> {
+        Some(self.dirty.fs_id)
     }
 
     fn mmap(&self, fba: FileBlockNumber) -> Result<Page, keos::KernelError> {
         let mut guard = self.cache.0.inner.lock();
         let result = guard.do_mmap(self.file.clone(), fba);
         guard.unlock();
+        self.charge(fba, 1);
         result
     }
 }
 
 impl<FS: FileSystem + 'static> FileSystem for PageCache<FS> {
     fn root(&self) -> Option<keos::fs::Directory> {
-        self.0
-            .fs
-            .root()
-            .map(|n| keos::fs::Directory::new(Directory(n, Self(self.0.clone()))))
+        self.0.fs.root().map(|n| {
+            keos::fs::Directory::new(Directory(
+                n,
+                Self(self.0.clone()),
+                writeback::dirty_state(self),
+            ))
+        })
     }
 }
@@ -0,0 +1,288 @@
+//! Background writeback, dirty throttling and reclaim of the page cache.
+//!
+//! The dirty slots of a [`PageCache`] are written back by a flusher thread,
+//! in the order of the file blocks, once there are [`DIRTY_BACKGROUND`] of
+//! them or they are older than [`DIRTY_EXPIRE_CYCLES`]. Writers are
+//! throttled above [`DIRTY_THROTTLE`] dirty slots, more often as the count
+//! approaches [`DIRTY_LIMIT`], so that an `fsync` never has too much to
+//! flush. The thresholds are fractions of the [`CACHE_SLOTS`] of the cache.
+//!
+//! The overlay of the page cache writes through [`DirtyState::write`]. Each
+//! page cache gets its [`DirtyState`] and flusher with [`dirty_state`] on
+//! the first use, and the flusher exits when the overlay drops the last
+//! reference to the state.
+//!
+//! The state also registers a shrinker of the cache to [`keos::mm::reclaim`],
+//! so that the page allocator can take back the slots under memory
+//! pressure. The shrinker drops only the clean slots whose page no one else
+//! holds, e.g., a mapping of the block, which costs no I/O. It is
+//! unregistered with the state.
+//!
+//! The state also keeps the [`CacheCharges`] of the cache.
+use crate::{
+    cache_charge::CacheCharges,
+    page_cache::{PageCache, PageCacheState, Slot},
+};
+use alloc::{
+    string::ToString,
+    sync::{Arc, Weak},
+    vec::Vec,
+};
+use core::ops::Deref;
+use keos::{
+    KernelError,
+    channel::{Receiver, Sender, channel},
+    fs::{FileBlockNumber, traits::FileSystem},
+    mm::reclaim::{self, Shrinker},
+    sync::{
+        SpinLock,
+        atomic::{AtomicU64, AtomicUsize},
+    },
+    thread::{Current, ParkHandle, ThreadBuilder},
+};
+use keos_project4::sync::mutex::Mutex;
+
+/// Number of the slots of the page cache.
+pub const CACHE_SLOTS: usize = <<PageCacheState as Deref>::Target>::CAPACITY;
+
+/// Dirty slots above which the flusher is woken up.
+pub const DIRTY_BACKGROUND: usize = CACHE_SLOTS / 10;
+
+/// Dirty slots above which the writers are throttled.
+pub const DIRTY_THROTTLE: usize = CACHE_SLOTS / 5;
+
+/// Dirty slots at which every write waits for the flusher.
+pub const DIRTY_LIMIT: usize = CACHE_SLOTS * 2 / 5;
+
+const_assert!(DIRTY_BACKGROUND < DIRTY_THROTTLE && DIRTY_THROTTLE < DIRTY_LIMIT);
+
+/// Age in TSC cycles after which the dirty slots are written back.
+pub const DIRTY_EXPIRE_CYCLES: u64 = 100_000_000;
+
+/// Number of the slots that the flusher writes back per lock hold.
+const FLUSH_BATCH: usize = 32;
+
+fn now() -> u64 {
+    unsafe { core::arch::x86_64::_rdtsc() }
+}
+
+/// Dirty slot accounting of a page cache.
+pub struct DirtyState {
+    /// Estimated number of the dirty slots. Counted up by the writers, and
+    /// recounted after each flush, which also catches the slots cleaned by
+    /// eviction and `fsync`.
+    pub nr_dirty: AtomicUsize,
+    /// When the cache became dirty.
+    since: AtomicU64,
+    /// Writes seen above [`DIRTY_THROTTLE`], to pace the throttling.
+    throttle_seq: AtomicUsize,
+    /// Channel to wake up the flusher.
+    kick: Sender<()>,
+    /// Writers waiting for the flusher.
+    throttled: SpinLock<Vec<ParkHandle>>,
+    /// The shrinker of the cache, registered to [`keos::mm::reclaim`].
+    shrinker: Arc<dyn Shrinker>,
+    /// Identifier of the overlay of the cache as a file system instance.
+    pub fs_id: u64,
+    /// The charges of the slots to the processes.
+    pub charges: CacheCharges,
+}
+
+/// The dirty states of the page caches, by their shared state.
+static STATES: SpinLock<Vec<(Weak<Mutex<PageCacheState>>, Weak<DirtyState>)>> =
+    SpinLock::new(Vec::new());
+
+/// Get the dirty state of `cache`, and start its flusher if it has none.
+pub fn dirty_state<FS: FileSystem>(cache: &PageCache<FS>) -> Arc<DirtyState> {
+    let mut states = STATES.lock();
+    states.retain(|(state, dirty)| state.strong_count() != 0 && dirty.strong_count() != 0);
+    if let Some(dirty) = states
+        .iter()
+        .find(|(state, _)| core::ptr::eq(state.as_ptr(), Arc::as_ptr(&cache.0.inner)))
+        .and_then(|(_, dirty)| dirty.upgrade())
+    {
+        states.unlock();
+        return dirty;
+    }
+    let (kick, rx) = channel(1);
+    let shrinker: Arc<dyn Shrinker> = Arc::new(CacheShrinker(Arc::downgrade(&cache.0.inner)));
+    reclaim::register(shrinker.clone());
+    let dirty = Arc::new(DirtyState {
+        nr_dirty: AtomicUsize::new(0),
+        since: AtomicU64::new(0),
+        throttle_seq: AtomicUsize::new(0),
+        kick,
+        throttled: SpinLock::new(Vec::new()),
+        shrinker,
+        fs_id: keos::fs::new_fs_id(),
+        charges: CacheCharges::new(),
+    });
+    let (state, weak) = (Arc::downgrade(&cache.0.inner), Arc::downgrade(&dirty));
+    states.push((state.clone(), weak.clone()));
+    states.unlock();
+    ThreadBuilder::new("[Writeback]".to_string()).spawn(move || {
+        println!(
+            "Start [Writeback] (TID: {})",
+            keos::thread::Current::get_tid()
+        );
+        DirtyState::flusher(weak, state, rx);
+        println!(
+            "Stop [Writeback] (TID: {})",
+            keos::thread::Current::get_tid()
+        );
+    });
+    dirty
+}
+
+impl DirtyState {
+    /// Write a page through the cache, and throttle the writer if the cache
+    /// holds too many dirty slots.
+    pub fn write(
+        &self,
+        state: &Mutex<PageCacheState>,
+        file: &keos::fs::RegularFile,
+        fba: FileBlockNumber,
+        buf: &[u8; 4096],
+        min_size: usize,
+    ) -> Result<(), KernelError> {
+        let mut guard = state.lock();
+        let was_dirty = guard
+            .get((file.ino(), fba))
+            .is_some_and(|slot| slot.writeback_size.is_some());
+        let result = guard.do_write(file.clone(), fba, buf, min_size);
+        guard.unlock();
+        if result.is_ok() && !was_dirty {
+            self.dirtied();
+        }
+        self.balance();
+        result
+    }
+
+    /// Account a slot that became dirty.
+    fn dirtied(&self) {
+        if self.nr_dirty.fetch_add(1) == 0 {
+            self.since.store(now());
+        }
+    }
+
+    /// Wake up the flusher if the cache is dirty enough or for too long, and
+    /// throttle the writer in proportion to the dirty slots.
+    ///
+    /// Between [`DIRTY_THROTTLE`] and [`DIRTY_LIMIT`], one write out of 8
+    /// down to one write out of 1 waits for a flush.
+    fn balance(&self) {
+        let nr_dirty = self.nr_dirty.load();
+        let expired = nr_dirty != 0 && now().wrapping_sub(self.since.load()) > DIRTY_EXPIRE_CYCLES;
+        if nr_dirty >= DIRTY_BACKGROUND || expired {
+            let _ = self.kick.try_send(());
+        }
+        if nr_dirty <= DIRTY_THROTTLE {
+            return;
+        }
+        let period =
+            (DIRTY_LIMIT.saturating_sub(nr_dirty) * 8 / (DIRTY_LIMIT - DIRTY_THROTTLE)).max(1);
+        if self.throttle_seq.fetch_add(1) % period != 0 {
+            return;
+        }
+        let mut throttled = self.throttled.lock();
+        // Kick under the lock, so that the flush that follows finds this
+        // writer on the list.
+        let _ = self.kick.try_send(());
+        Current::park_with(move |handle| {
+            throttled.push(handle);
+            throttled.unlock();
+        });
+    }
+
+    /// Write back every dirty slot in the order of the file blocks, then
+    /// wake up the throttled writers.
+    fn flush(&self, state: &Mutex<PageCacheState>) {
+        let mut last = None;
+        loop {
+            let mut guard = state.lock();
+            let mut n = 0;
+            for (id, slot) in guard.iter_mut() {
+                if last.is_some_and(|last| *id <= last) || slot.writeback_size.is_none() {
+                    continue;
+                }
+                let _ = slot.writeback();
+                last = Some(*id);
+                n += 1;
+                if n == FLUSH_BATCH {
+                    break;
+                }
+            }
+            guard.unlock();
+            // Let the other users in between the batches.
+            if n < FLUSH_BATCH {
+                break;
+            }
+        }
+        let mut guard = state.lock();
+        let nr_dirty = guard
+            .iter_mut()
+            .filter(|(_, slot)| slot.writeback_size.is_some())
+            .count();
+        guard.unlock();
+        self.nr_dirty.store(nr_dirty);
+        self.since.store(now());
+
+        let mut throttled = self.throttled.lock();
+        let ths = core::mem::take(&mut *throttled);
+        throttled.unlock();
+        ths.into_iter().for_each(ParkHandle::unpark);
+    }
+
+    /// Body of the flusher thread.
+    ///
+    /// The thread keeps neither the state nor the cache alive while it
+    /// waits, so that the kick channel disconnects once the last user of
+    /// the state is gone.
+    fn flusher(dirty: Weak<Self>, state: Weak<Mutex<PageCacheState>>, rx: Receiver<()>) {
+        while rx.recv().is_ok() {
+            while rx.try_recv().is_ok() {}
+            let (Some(dirty), Some(state)) = (dirty.upgrade(), state.upgrade()) else {
+                break;
+            };
+            dirty.flush(&state);
+        }
+    }
+}
+
+impl Drop for DirtyState {
+    fn drop(&mut self) {
+        reclaim::unregister(&self.shrinker);
+    }
+}
+
+/// Whether `slot` can be dropped without any I/O: it is clean, and no one
+/// else holds its page.
+pub fn is_idle(slot: &Slot) -> bool {
+    slot.writeback_size.is_none() && slot.page.ref_count() == 1
+}
+
+/// Releases the clean slots of a page cache under memory pressure.
+struct CacheShrinker(Weak<Mutex<PageCacheState>>);
+
+impl Shrinker for CacheShrinker {
+    fn shrink(&self, nr_pages: usize) -> usize {
+        let Some(state) = self.0.upgrade() else {
+            return 0;
+        };
+        // The allocating thread may hold the cache.
+        let Ok(mut guard) = state.try_lock() else {
+            return 0;
+        };
+        let mut released = 0;
+        guard.retain(|_, slot| {
+            if released < nr_pages && is_idle(slot) {
+                released += 1;
+                false
+            } else {
+                true
+            }
+        });
+        guard.unlock();
+        released
+    }
+}
@@ -289,6 +289,43 @@ impl Kva {
         Pa(self.0 - VA_TO_PA_OFF)
     }
 
+    /// Translates the virtual address to a physical address through the page
+    /// table.
+    ///
+    /// Unlike [`Kva::into_pa`], this method also works for the kernel
+    /// virtual addresses outside of the direct mapping, e.g., the ones that
+    /// map scattered pages into a contiguous range. The addresses in the
+    /// direct mapping are translated by the fixed offset.
+    ///
+    /// # Returns
+    /// - `Some(Pa)` if the address is mapped in the current page table.
+    /// - `None` otherwise.
+    pub fn translate(self) -> Option<Pa> {
+        const PRESENT: u64 = 1 << 0;
+        const HUGE: u64 = 1 << 7;
+        const ADDR_MASK: u64 = 0x000f_ffff_ffff_f000;
+
+        if (self.0 >> 39) & 0x1ff == 510 {
+            return Some(self.into_pa());
+        }
+        let mut table = Pa((crate::x86_64::Cr3::current().0 & ADDR_MASK) as usize);
+        // The level 4, 3, 2, and 1 indices, from the top.
+        for shift in [39, 30, 21, 12] {
+            let pte =
+                unsafe { *((table.into_kva().0 as *const u64).add((self.0 >> shift) & 0x1ff)) };
+            if pte & PRESENT == 0 {
+                return None;
+            }
+            let pa = (pte & ADDR_MASK) as usize;
+            if shift == 12 || (shift != 39 && pte & HUGE != 0) {
+                let mask = (1 << shift) - 1;
+                return Some(Pa((pa & !mask) | (self.0 & mask)));
+            }
+            table = Pa(pa);
+        }
+        unreachable!()
+    }
+
     /// Aligns the virtual address down to the nearest page boundary.
     ///
     /// This method clears the lower bits of the address to ensure it is
@@ -8,7 +8,7 @@ use crate::{
     dev::x86_64::apic::{IPIDest, Mode},
     syscall::syscall_entry_init,
     x86_64::{
-        Cr0,
+        Cr0, Cr4,
         interrupt::{ExceptionType, IDT, InterruptStackFrame, PFErrorCode},
         kernel_gs::KernelGS,
         msr::Msr,
@@ -57,6 +57,8 @@ unsafe extern "Rust" {
 #[unsafe(naked)]
 unsafe extern "C" fn start() {
     naked_asm!(
+        "cmp rdi, {}",  // Park the cpus beyond MAX_CPU, which have no stack.
+        "jae 2f",
         "lea rax, [rip + IDLE_STACK]", // rax = IDLE_STACK
         "mov rcx, rdi", // rcx = core_id
         "inc rcx",      // rcx = core_id + 1
@@ -64,6 +66,11 @@ unsafe extern "C" fn start() {
         "add rax, rcx", // rax = IDLE_STACK[core_id + 1]. stack is grow downward.
         "mov rsp, rax", // rsp = rax
         "jmp {}",       // jump to rust main
+        "2:",
+        "cli",
+        "hlt",
+        "jmp 2b",
+        const MAX_CPU,
         const 0x100000i32.trailing_zeros(),
         sym bootstrap,
     );
@@ -98,18 +105,17 @@ pub unsafe fn ap_init() {
         core::intrinsics::volatile_store(lo, (MP_ENTRY >> 4) as u16);
         core::intrinsics::volatile_store(hi, (MP_ENTRY as u16) & 0xf);
 
-        // Bootup mps.
-        for mpid in 1..MAX_CPU {
-            crate::dev::x86_64::apic::send_ipi(IPIDest::Cpu(mpid), Mode::Init);
-            crate::dev::x86_64::apic::send_ipi(
-                IPIDest::Cpu(mpid),
-                Mode::StartUp((MP_ENTRY >> 12) as u8),
-            );
-            crate::dev::x86_64::apic::send_ipi(
-                IPIDest::Cpu(mpid),
-                Mode::StartUp((MP_ENTRY >> 12) as u8),
-            );
-        }
+        // Bootup mps at once. Each of them initializes its own states in
+        // parallel.
+        crate::dev::x86_64::apic::send_ipi(IPIDest::AllExcludingSelf, Mode::Init);
+        crate::dev::x86_64::apic::send_ipi(
+            IPIDest::AllExcludingSelf,
+            Mode::StartUp((MP_ENTRY >> 12) as u8),
+        );
+        crate::dev::x86_64::apic::send_ipi(
+            IPIDest::AllExcludingSelf,
+            Mode::StartUp((MP_ENTRY >> 12) as u8),
+        );
     }
     info!("Bootup Application Processors.");
     // spinning until all aps are booted
@@ -182,6 +188,19 @@ unsafe fn per_cpu_init(core_id: usize) {
         // WP: Protect Readonly page from kernel's write.
         // TS: #nm when use the fpu.
         ((Cr0::current() & !(Cr0::CD | Cr0::NW)) | Cr0::WP | Cr0::TS | Cr0::NE).apply();
+        // OSFXSR, OSXMMEXCPT: Allow the SSE instructions on user mode.
+        (Cr4::current() | Cr4::OSFXSR | Cr4::OSXMMEXCPT).apply();
+        // OSXSAVE: Enable the XSAVE instructions and the x87, SSE, and AVX
+        // states on XCR0.
+        if core::arch::x86_64::__cpuid(1).ecx & (1 << 26) != 0 {
+            (Cr4::current() | Cr4::OSXSAVE).apply();
+            let xcr0 = core::arch::x86_64::__cpuid_count(0xd, 0).eax & 0b111;
+            core::arch::asm!("xsetbv", in("ecx") 0, in("eax") xcr0, in("edx") 0, options(nomem, nostack));
+        }
+        // PCIDE: Tag the TLB entries with the PCID on cr3.
+        if core::arch::x86_64::__cpuid(1).ecx & (1 << 17) != 0 {
+            (Cr4::current() | Cr4::PCIDE).apply();
+        }
         // Init EFER
         // bit0: System Call Extensions.
         // bit11: No-Execute Enable.
@@ -62,6 +62,34 @@ pub trait BlockOps {
     fn read(&self, sector: Sector, buf: &mut [u8; 512]) -> bool;
     /// Write 512 bytes to disk starting from sector.
     fn write(&self, sector: Sector, buf: &[u8; 512]) -> bool;
+    /// Read the sector runs of `bios` in a single submission.
+    ///
+    /// Each bio is the first sector of a run and a buffer whose length is a
+    /// multiple of 512. The default reads the sectors one by one.
+    fn read_vectored(&self, bios: &mut dyn Iterator<Item = (Sector, &mut [u8])>) -> bool {
+        for (sector, buf) in bios {
+            for (i, b) in buf.as_chunks_mut::<512>().0.iter_mut().enumerate() {
+                if !self.read(sector + i, b) {
+                    return false;
+                }
+            }
+        }
+        true
+    }
+    /// Write the sector runs of `bios` in a single submission.
+    ///
+    /// Each bio is the first sector of a run and a buffer whose length is a
+    /// multiple of 512. The default writes the sectors one by one.
+    fn write_vectored(&self, bios: &mut dyn Iterator<Item = (Sector, &[u8])>) -> bool {
+        for (sector, buf) in bios {
+            for (i, b) in buf.as_chunks::<512>().0.iter().enumerate() {
+                if !self.write(sector + i, b) {
+                    return false;
+                }
+            }
+        }
+        true
+    }
     #[doc(hidden)]
     fn read_block_many(&self, _offset: usize, _buf: &mut [u8]) -> bool {
         unimplemented!()
@@ -79,3 +79,63 @@ impl MessageControl {
         MsixMessageControl::from_bits_truncate(self.accessor.read_u16())
     }
 }
+
+/// The MSI-X capability of a device.
+///
+/// Each entry of the table maps an interrupt source of the device, such as a
+/// virtqueue, to a message that raises a vector on a local apic.
+pub struct Msix {
+    control: MessageControl,
+    table: crate::dev::mmio::ActiveMmioArea,
+    size: usize,
+}
+
+impl Msix {
+    /// Capability id of MSI-X.
+    const CAP_ID: u8 = 0x11;
+
+    /// Find the MSI-X capability of the device.
+    pub fn find(header: &PciHeader<0>) -> Option<Self> {
+        let cap = header
+            .capabilities()
+            .find(|cap| cap.vendor() == Self::CAP_ID)?;
+        let size = (cap.offset(2).read_u16() & 0x7ff) as usize + 1;
+        let table = cap.offset(4).read_u32();
+        let table = header
+            .bar((table & 7) as u8)?
+            .try_get_memory_bar()?
+            .try_split_mmio_range((table & !7) as usize, 16 * size)?
+            .activate();
+        Some(Self {
+            control: MessageControl {
+                accessor: cap.offset(2),
+            },
+            table,
+            size,
+        })
+    }
+
+    /// Number of the entries.
+    #[inline]
+    pub fn size(&self) -> usize {
+        self.size
+    }
+
+    /// Route the entry `idx` to `vector` of the local apic `apic_id`, and
+    /// unmask it.
+    pub fn set_entry(&self, idx: usize, apic_id: u8, vector: u8) {
+        assert!(idx < self.size);
+        let base = idx * 4;
+        self.table
+            .write_at::<u32>(base, 0xfee0_0000 | ((apic_id as u32) << 12));
+        self.table.write_at::<u32>(base + 1, 0);
+        self.table.write_at::<u32>(base + 2, vector as u32);
+        self.table.write_at::<u32>(base + 3, 0);
+    }
+
+    /// Enable the MSI-X of the device, which also disables the legacy
+    /// interrupt.
+    pub fn enable(&self) {
+        self.control.set(MsixMessageControl::ENABLED);
+    }
+}
@@ -8,7 +8,7 @@ mod x86_config;
 
 use alloc::boxed::Box;
 pub use bar::{Bar, IoSpace, MemorySpace};
-pub use cap::{Capability, CapabilityIterator, MessageControl};
+pub use cap::{Capability, CapabilityIterator, MessageControl, Msix};
 pub use header::*;
 use x86_config::X86Config;
 
@@ -3,17 +3,46 @@
 //! The virtio block device is a simple virtual block device (ie. disk). Read
 //! and write requests (and other exotic requests) are placed in the queue, and
 //! serviced (probably out of order) by the device except where noted.
+//!
+//! A request is a descriptor chain of a header, the data buffers, and a
+//! status byte. Many requests can be in flight on a queue at once; the
+//! submitter waits for each of its requests after notifying the device. If the
+//! device supports `VIRTIO_BLK_F_MQ`, one queue is set up per cpu, and a cpu
+//! submits to its own queue.
+//!
+//! With MSI-X, every queue raises [`IRQ_VECTOR`] on the bootstrap processor
+//! when it uses a chain, and a waiter sleeps in the kernel's
+//! `wait_for_io` until then. Otherwise, or while the waiter holds a lock, it
+//! polls the queue.
 
 // mod adaptor;
 mod tys;
 
+use crate::MAX_CPU;
+use crate::addressing::{PAGE_MASK, PAGE_SIZE};
 use crate::dev::pci::PciDeviceHeader;
-use crate::dev::pci::virtio::{PciTransport, VirtIoDevice, VirtIoFeaturesCommon};
+use crate::dev::pci::virtio::{PciTransport, VirtIoDevice, VirtIoFeaturesCommon, VirtQueue};
 use crate::dev::{BlockOps, Sector};
+use crate::interrupt::InterruptGuard;
+use crate::x86_64::intrinsics::cpuid;
+use alloc::{boxed::Box, collections::VecDeque};
+use core::cell::Cell;
+use core::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
 use tys::*;
 
 use super::VirtIOError;
 
+/// Interrupt vector of the queue completions of every virtio block device.
+pub const IRQ_VECTOR: u8 = 0x40;
+
+unsafe extern "Rust" {
+    /// Wait until `done` returns true.
+    ///
+    /// Provided by the kernel, which parks the current thread until the next
+    /// [`IRQ_VECTOR`] interrupt between the checks.
+    fn wait_for_io(done: &dyn Fn() -> bool);
+}
+
 mmio! {
     /// Device configuration layout
     ///
@@ -52,13 +81,24 @@ mmio! {
         max_write_zeros_sectors @ 44 => RW, u32;
         max_write_zeros_seg @ 48 => RW, u32;
         write_zeros_may_unmap @ 52 => RW, u8;
+        num_queues @ 34 => RW, u16;
 }
 
 pub struct VirtIoBlock {
-    dev: VirtIoDevice<VirtIoBlockCfg, 1>,
+    dev: VirtIoDevice<VirtIoBlockCfg, MAX_CPU>,
     // Cached property.
     block_size: usize,
     block_count: usize,
+    /// Number of the configured queues.
+    nr_queues: AtomicUsize,
+    /// Completions are signaled with [`IRQ_VECTOR`].
+    irq: AtomicBool,
+}
+
+/// The header and the status of an in-flight request.
+struct Request {
+    hdr: VirtIoBlockReq,
+    resp: VirtIoBlockResp,
 }
 
 impl VirtIoBlock {
@@ -74,6 +114,8 @@ impl VirtIoBlock {
                 dev: VirtIoDevice::from_transport(conf),
                 block_size,
                 block_count,
+                nr_queues: AtomicUsize::new(1),
+                irq: AtomicBool::new(false),
             })
         } else {
             Err(VirtIOError)
@@ -84,14 +126,40 @@ impl VirtIoBlock {
         self.dev.init(
             VirtIoFeaturesCommon::empty(),
             VirtIoFeaturesBlock::all(),
-            |dev, _comm_feat, _dev_feat| {
+            |dev, _comm_feat, dev_feat| {
                 // 5.2 Block Device.
+                let nr_queues = if dev_feat.contains(VirtIoFeaturesBlock::MQ) {
+                    (dev.transport.num_queues().read() as usize).clamp(1, MAX_CPU)
+                } else {
+                    1
+                };
+                // Route every queue to the bootstrap processor.
+                let msix = dev
+                    .transport
+                    .msix
+                    .as_ref()
+                    .filter(|m| m.size() >= nr_queues);
+                if let Some(msix) = msix {
+                    for entry in 0..nr_queues {
+                        msix.set_entry(entry, 0, IRQ_VECTOR);
+                    }
+                    msix.enable();
+                }
+                let mut irq = msix.is_some();
                 // 4.1.5.1.3 Virtqueue Configuration
-                dev.configure_queue(0, |scope| {
-                    let queue_max_size = scope.queue_size();
-                    scope.queue_builder().set_size(queue_max_size)?.register();
-                    Ok(())
-                })
+                for qid in 0..nr_queues as u16 {
+                    dev.configure_queue(qid, |scope| {
+                        if msix.is_some() {
+                            irq &= dev.transport.set_queue_vector(qid);
+                        }
+                        let queue_max_size = scope.queue_size();
+                        scope.queue_builder().set_size(queue_max_size)?.register();
+                        Ok::<_, VirtIOError>(())
+                    })?;
+                }
+                self.nr_queues.store(nr_queues, Ordering::Relaxed);
+                self.irq.store(irq, Ordering::Relaxed);
+                Ok(())
             },
         )
     }
@@ -108,54 +176,146 @@ impl VirtIoBlock {
         self.block_size
     }
 
-    /// Flush read bio request to the disk.
-    pub fn read_bios(
+    /// Number of the configured queues.
+    #[inline]
+    pub fn nr_queues(&self) -> usize {
+        self.nr_queues.load(Ordering::Relaxed)
+    }
+
+    /// Wait until `cond` holds on the queue `qid`.
+    fn wait(&self, qid: u16, cond: impl Fn(&VirtQueue) -> bool) {
+        let done = || {
+            let mut virtq = self.dev.get_queue(qid).unwrap();
+            virtq.poll();
+            let r = cond(&virtq);
+            virtq.unlock();
+            r
+        };
+        if self.irq.load(Ordering::Relaxed) && !InterruptGuard::is_guarded() {
+            unsafe { wait_for_io(&done) }
+        } else {
+            while !done() {
+                core::hint::spin_loop();
+            }
+        }
+    }
+
+    /// Wait for the request at `head`, and release it.
+    ///
+    /// Returns true if the request succeeded.
+    fn complete(&self, qid: u16, (head, req): (u16, Box<Request>)) -> bool {
+        self.wait(qid, |virtq| virtq.is_done(head));
+        let mut virtq = self.dev.get_queue(qid).unwrap();
+        virtq.take(head);
+        virtq.unlock();
+        // The device writes the status behind the compiler's back.
+        unsafe { core::ptr::read_volatile(&req.resp as *const _ as *const u8) == 0 }
+    }
+
+    /// Submit the bios as requests of `type_` on the queue of this cpu, and
+    /// wait for all of them.
+    ///
+    /// Contiguous bios are merged into a single request. Each bio is a tuple
+    /// of the device offset, the kernel virtual address and the length of
+    /// the buffer, which must be a non-zero multiple of the block size. The
+    /// buffer needs not be physically contiguous: it takes a descriptor for
+    /// each of its physically contiguous runs.
+    fn do_bios(
         &self,
-        bios: &mut dyn Iterator<Item = (usize, &mut [u8])>,
+        type_: VirtIoBlockType,
+        bios: &mut dyn Iterator<Item = (usize, usize, usize)>,
     ) -> Result<(), VirtIOError> {
-        let (mut virtq, mut req, mut resp) = (
-            self.dev.get_queue(0).unwrap(),
-            VirtIoBlockReq {
-                type_: VirtIoBlockType::In,
-                sector: 0,
-                __reserved: 0,
-            },
-            VirtIoBlockResp::default(),
-        );
-
-        let mut bios = bios.peekable();
-        while let Some((ofs, buf)) = bios.next() {
-            let ofs_sector = if ofs % self.block_size == 0 && buf.len() % self.block_size == 0 {
-                ofs / self.block_size
-            } else {
-                return Err(VirtIOError);
-            };
-            let mut remain = virtq.size() - 3;
+        let qid = (cpuid() % self.nr_queues()) as u16;
+        let writable = matches!(type_, VirtIoBlockType::In);
+        let bs = self.block_size;
+        let mut inflight = VecDeque::new();
+        let mut ok = true;
+
+        // A request must end at a block boundary. Each bio is split at the
+        // first block boundary after each page boundary of its buffer, so that
+        // a piece takes at most `max_runs` descriptors.
+        let max_runs = bs.div_ceil(PAGE_SIZE) + 1;
+        let valid = Cell::new(true);
+        let mut pieces = bios
+            .map_while(|(ofs, addr, len)| {
+                // A zero-length buffer is not a valid descriptor.
+                valid.set(len != 0 && ofs % bs == 0 && len % bs == 0);
+                valid.get().then_some((ofs, addr, len))
+            })
+            .flat_map(|(ofs, addr, len)| {
+                let mut pos = 0;
+                core::iter::from_fn(move || {
+                    (pos < len).then(|| {
+                        let page_end = pos + PAGE_SIZE - ((addr + pos) & PAGE_MASK);
+                        let end = page_end.next_multiple_of(bs).min(len);
+                        let piece = (ofs + pos, addr + pos, end - pos);
+                        pos = end;
+                        piece
+                    })
+                })
+            })
+            .peekable();
+        let mut virtq = self.dev.get_queue(qid).unwrap();
+        while let Some((ofs, addr, len)) = pieces.next() {
+            // A request needs the header, a piece, and the status.
+            while (virtq.nr_free() as usize) < max_runs + 2 {
+                virtq.notify();
+                virtq.unlock();
+                match inflight.pop_front() {
+                    Some(r) => ok &= self.complete(qid, r),
+                    None => self.wait(qid, |virtq| virtq.nr_free() as usize >= max_runs + 2),
+                }
+                virtq = self.dev.get_queue(qid).unwrap();
+            }
+            let mut req = Box::new(Request {
+                hdr: VirtIoBlockReq {
+                    type_,
+                    sector: (ofs / bs) as u64,
+                    __reserved: 0,
+                },
+                resp: VirtIoBlockResp::default(),
+            });
+            // The descriptors left for the pieces, past the header and the
+            // status.
+            let mut remain = virtq.nr_free() as usize - 2;
+            let mut expected = ofs + len;
             let mut tx = virtq.sgl_builder();
-            let mut expected = ofs + buf.len();
-            req.sector = ofs_sector as u64;
-            tx.push(&req);
-            tx.push_mut(buf);
-
-            while let Some((ofs, _)) = bios.peek() {
-                if remain != 0 && *ofs == expected {
-                    let (_, buf) = bios.next().unwrap();
-                    expected += buf.len();
-                    remain -= 1;
-                    tx.push_mut(buf);
+            tx.push(&req.hdr);
+            remain -= unsafe { tx.push_raw(addr, len, writable) };
+            while let Some((ofs, _, _)) = pieces.peek() {
+                if remain >= max_runs && *ofs == expected {
+                    let (_, addr, len) = pieces.next().unwrap();
+                    expected += len;
+                    remain -= unsafe { tx.push_raw(addr, len, writable) };
                 } else {
                     break;
                 }
             }
-            tx.push_mut(&mut resp);
-            tx.finish();
-            if !matches!(resp, VirtIoBlockResp::Ok) {
-                virtq.unlock();
-                return Err(VirtIOError);
-            }
+            tx.push_mut(&mut req.resp);
+            inflight.push_back((tx.submit(), req));
         }
+        virtq.notify();
         virtq.unlock();
-        Ok(())
+
+        for r in inflight {
+            ok &= self.complete(qid, r);
+        }
+        if ok && valid.get() {
+            Ok(())
+        } else {
+            Err(VirtIOError)
+        }
+    }
+
+    /// Flush read bio request to the disk.
+    pub fn read_bios(
+        &self,
+        bios: &mut dyn Iterator<Item = (usize, &mut [u8])>,
+    ) -> Result<(), VirtIOError> {
+        self.do_bios(
+            VirtIoBlockType::In,
+            &mut bios.map(|(ofs, buf)| (ofs, buf.as_mut_ptr() as usize, buf.len())),
+        )
     }
 
     /// Flush write bio request to the disk.
@@ -163,49 +323,10 @@ impl VirtIoBlock {
         &self,
         bios: &mut dyn Iterator<Item = (usize, &[u8])>,
     ) -> Result<(), VirtIOError> {
-        let (mut virtq, mut req, mut resp) = (
-            self.dev.get_queue(0).unwrap(),
-            VirtIoBlockReq {
-                type_: VirtIoBlockType::Out,
-                sector: 0,
-                __reserved: 0,
-            },
-            VirtIoBlockResp::default(),
-        );
-
-        let mut bios = bios.peekable();
-        while let Some((ofs, buf)) = bios.next() {
-            let ofs_sector = if ofs % self.block_size == 0 && buf.len() % self.block_size == 0 {
-                ofs / self.block_size
-            } else {
-                return Err(VirtIOError);
-            };
-            let mut remain = virtq.size() - 3;
-            let mut tx = virtq.sgl_builder();
-            let mut expected = ofs + buf.len();
-            req.sector = ofs_sector as u64;
-            tx.push(&req);
-            tx.push(buf);
-
-            while let Some((ofs, _)) = bios.peek() {
-                if remain != 0 && *ofs == expected {
-                    let (_, buf) = bios.next().unwrap();
-                    expected += buf.len();
-                    remain -= 1;
-                    tx.push(buf);
-                } else {
-                    break;
-                }
-            }
-            tx.push_mut(&mut resp);
-            tx.finish();
-            if !matches!(resp, VirtIoBlockResp::Ok) {
-                virtq.unlock();
-                return Err(VirtIOError);
-            }
-        }
-        virtq.unlock();
-        Ok(())
+        self.do_bios(
+            VirtIoBlockType::Out,
+            &mut bios.map(|(ofs, buf)| (ofs, buf.as_ptr() as usize, buf.len())),
+        )
     }
 }
 
@@ -231,6 +352,16 @@ impl BlockOps for VirtIoBlock {
             .is_ok()
     }
 
+    fn read_vectored(&self, bios: &mut dyn Iterator<Item = (Sector, &mut [u8])>) -> bool {
+        self.read_bios(&mut bios.map(|(sector, buf)| (sector.into_offset(), buf)))
+            .is_ok()
+    }
+
+    fn write_vectored(&self, bios: &mut dyn Iterator<Item = (Sector, &[u8])>) -> bool {
+        self.write_bios(&mut bios.map(|(sector, buf)| (sector.into_offset(), buf)))
+            .is_ok()
+    }
+
     fn read_block_many(&self, offset: usize, buf: &mut [u8]) -> bool {
         self.read_bios(&mut Some((offset, buf)).into_iter()).is_ok()
     }
@@ -20,6 +20,8 @@ bitflags::bitflags! {
         const TOPOLOGY = 1 << 10;
         /// Device can toggle its cache between writeback and writethrough modes.
         const CONFIG_WCE = 1 << 11;
+        /// Device supports multiqueue. The number of queues is in num_queues.
+        const MQ = 1 << 12;
         /// Device can support discard command, maximum discard sectors size in
         /// max_discard_sectors and maximum discard segment number in
         /// max_discard_seg.
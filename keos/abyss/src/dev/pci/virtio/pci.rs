@@ -239,6 +239,8 @@ pub struct PciTransport<V: Send + Sync> {
     pub notify: NotifyCfgTriple,
     pub private: V,
     pub feat: AtomicU64,
+    /// The MSI-X capability, if the device has one.
+    pub msix: Option<pci::Msix>,
 }
 
 impl<V: Send + Sync> PciTransport<V> {
@@ -255,6 +257,7 @@ impl<V: Send + Sync> PciTransport<V> {
             notify,
             private: init_priv(mmio),
             feat: AtomicU64::new(0),
+            msix: pci::Msix::find(&pci),
         }
     }
 
@@ -302,6 +305,14 @@ impl<V: Send + Sync> PciTransport<V> {
         )
     }
 
+    /// Route the interrupt of the selected queue to the MSI-X entry `entry`.
+    ///
+    /// Returns false if the device could not allocate the vector.
+    pub fn set_queue_vector(&self, entry: u16) -> bool {
+        self.common.queue_msix_vector().write(entry);
+        self.common.queue_msix_vector().read() == entry
+    }
+
     pub fn select_queue(&self, idx: u16) {
         self.common.queue_select().write(idx)
     }
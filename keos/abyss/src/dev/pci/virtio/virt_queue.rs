@@ -1,4 +1,4 @@
-use crate::addressing::{Kva, Pa};
+use crate::addressing::{Kva, PAGE_MASK, PAGE_SIZE, Pa};
 use crate::dev::mmio::MmioAccessor;
 use alloc::boxed::Box;
 use core::sync::atomic::{Ordering, fence};
@@ -14,6 +14,20 @@ bitflags::bitflags! {
     }
 }
 
+/// Layout of a ring of `size` bytes, aligned to `align`.
+///
+/// The device accesses a ring by its physical address, so a ring that spans
+/// pages is aligned past a page, for which the allocator hands out physically
+/// contiguous pages.
+fn ring_layout(size: usize, align: usize) -> alloc::alloc::Layout {
+    let align = if size >= 2 * PAGE_SIZE {
+        align.max(2 * PAGE_SIZE)
+    } else {
+        align
+    };
+    alloc::alloc::Layout::from_size_align(size, align).unwrap()
+}
+
 /// The Virtqueue Descriptor Table.
 ///
 /// The descriptor table refers to the buffers the driver is using for the
@@ -51,15 +65,15 @@ pub struct VirtqDescContainer {
 impl VirtqDescContainer {
     pub fn new(size: usize) -> Self {
         let inner = unsafe {
-            Box::from_raw(alloc::alloc::alloc_zeroed(
-                alloc::alloc::Layout::from_size_align(core::mem::size_of::<VirtqDesc>() * size, 16)
-                    .unwrap(),
-            ) as *mut VirtqDescs)
+            Box::from_raw(alloc::alloc::alloc_zeroed(ring_layout(
+                core::mem::size_of::<VirtqDesc>() * size,
+                16,
+            )) as *mut VirtqDescs)
         };
         let mut output = Self { inner, size };
-        // Build the chain
+        // Build the free list.
         (0..size).for_each(|i| {
-            if i != size {
+            if i + 1 != size {
                 output[i].next = (i + 1) as u16;
             } else {
                 output[i].next = 0xffff;
@@ -118,13 +132,10 @@ pub struct VirtqAvailContainer {
 impl VirtqAvailContainer {
     pub fn new(size: usize, has_used_event: bool) -> Self {
         let inner = unsafe {
-            Box::from_raw(alloc::alloc::alloc_zeroed(
-                alloc::alloc::Layout::from_size_align(
-                    core::mem::size_of::<u16>() * (2 + size + if has_used_event { 1 } else { 0 }),
-                    2,
-                )
-                .unwrap(),
-            ) as *mut VirtqAvail)
+            Box::from_raw(alloc::alloc::alloc_zeroed(ring_layout(
+                core::mem::size_of::<u16>() * (2 + size + if has_used_event { 1 } else { 0 }),
+                2,
+            )) as *mut VirtqAvail)
         };
 
         VirtqAvailContainer {
@@ -176,13 +187,10 @@ pub struct VirtqUsedContainer {
 impl VirtqUsedContainer {
     pub fn new(size: usize) -> Self {
         let inner = unsafe {
-            Box::from_raw(alloc::alloc::alloc_zeroed(
-                alloc::alloc::Layout::from_size_align(
-                    core::mem::size_of::<u16>() * 3 + core::mem::size_of::<VirtqUsedElem>() * size,
-                    4,
-                )
-                .unwrap(),
-            ) as *mut VirtqUsed)
+            Box::from_raw(alloc::alloc::alloc_zeroed(ring_layout(
+                core::mem::size_of::<u16>() * 3 + core::mem::size_of::<VirtqUsedElem>() * size,
+                4,
+            )) as *mut VirtqUsed)
         };
 
         VirtqUsedContainer { inner, size }
@@ -195,7 +203,7 @@ impl VirtqUsedContainer {
 
     #[inline]
     pub fn idx(&self) -> u16 {
-        self.inner.idx
+        unsafe { core::ptr::read_volatile(&self.inner.idx) }
     }
 }
 
@@ -243,6 +251,15 @@ pub enum Kick {
     None,
 }
 
+/// A virtqueue.
+///
+/// Several descriptor chains can be in flight at once. The free descriptors
+/// are linked through their `next` fields. A chain is built with
+/// [`VirtQueue::sgl_builder`], made available with
+/// [`VirtqSglBuilder::submit`], and the device is notified with
+/// [`VirtQueue::notify`]. [`VirtQueue::poll`] records the chains that the
+/// device has used, and [`VirtQueue::take`] returns the descriptors of a used
+/// chain to the free list.
 pub struct VirtQueue {
     pub desc: VirtqDescContainer,
     pub avail: VirtqAvailContainer,
@@ -250,18 +267,19 @@ pub struct VirtQueue {
     size: u16,
     pub id: u16,
     kick: Kick,
+    /// Head of the free descriptor list.
+    free_head: u16,
+    /// Number of the free descriptors.
+    nr_free: u16,
+    /// Index of the next used element to be consumed.
+    last_used: u16,
+    /// Written length of the used chains, indexed by the head.
+    done: alloc::vec::Vec<Option<u32>>,
 }
 
 impl VirtQueue {
     pub(crate) fn empty() -> Self {
-        Self {
-            desc: VirtqDescContainer::new(0),
-            avail: VirtqAvailContainer::new(0, false),
-            used: VirtqUsedContainer::new(0),
-            size: 0,
-            id: 0,
-            kick: Kick::None,
-        }
+        Self::new(0, 0, false, Kick::None)
     }
 
     pub(crate) fn new(size: u16, id: u16, has_used_event: bool, kick: Kick) -> Self {
@@ -272,13 +290,19 @@ impl VirtQueue {
             size,
             id,
             kick,
+            free_head: 0,
+            nr_free: size,
+            last_used: 0,
+            done: alloc::vec![None; size as usize],
         }
     }
 
+    /// Notify the device of the new available chains.
     #[inline]
-    fn kick(&self, idx: u16) {
+    pub fn notify(&self) {
+        fence(Ordering::SeqCst);
         match self.kick {
-            Kick::Pci(kick_addr) => kick_addr.write(u16::to_le(idx)),
+            Kick::Pci(kick_addr) => kick_addr.write(u16::to_le(self.id)),
             Kick::None => unreachable!(),
         }
     }
@@ -287,7 +311,8 @@ impl VirtQueue {
     pub fn sgl_builder(&mut self) -> VirtqSglBuilder<'_> {
         VirtqSglBuilder {
             virtq: self,
-            idx: 0,
+            head: None,
+            tail: 0,
         }
     }
 
@@ -295,68 +320,190 @@ impl VirtQueue {
     pub fn size(&self) -> u16 {
         self.size
     }
+
+    /// Number of the free descriptors.
+    #[inline]
+    pub fn nr_free(&self) -> u16 {
+        self.nr_free
+    }
+
+    fn alloc_desc(&mut self) -> u16 {
+        assert!(self.nr_free != 0, "virtqueue: out of descriptors.");
+        let idx = self.free_head;
+        self.free_head = self.desc[idx as usize].next;
+        self.nr_free -= 1;
+        idx
+    }
+
+    /// Record the chains that the device has used since the last poll.
+    ///
+    /// Returns the number of the newly used chains.
+    pub fn poll(&mut self) -> usize {
+        fence(Ordering::SeqCst);
+        let used = self.used.idx();
+        let mut cnt = 0;
+        while self.last_used != used {
+            let elem = &self.used[self.last_used as usize];
+            let (id, len) = (elem.id as usize, elem.len);
+            self.done[id] = Some(len);
+            self.last_used = self.last_used.wrapping_add(1);
+            cnt += 1;
+        }
+        cnt
+    }
+
+    /// Returns true if the chain at `head` has been used.
+    #[inline]
+    pub fn is_done(&self, head: u16) -> bool {
+        self.done[head as usize].is_some()
+    }
+
+    /// Release the used chain at `head`, and returns the length that the
+    /// device has written.
+    ///
+    /// Returns `None` if the chain is not used yet.
+    pub fn take(&mut self, head: u16) -> Option<usize> {
+        let len = self.done[head as usize].take()?;
+        // Return the chain to the free list.
+        let mut idx = head;
+        loop {
+            self.nr_free += 1;
+            let desc = &self.desc[idx as usize];
+            if !desc.flags.contains(VirtqDescFlags::NEXT) {
+                break;
+            }
+            idx = desc.next;
+        }
+        self.desc[idx as usize].next = self.free_head;
+        self.free_head = head;
+        Some(len as usize)
+    }
 }
 
+/// A builder of a descriptor chain.
 pub struct VirtqSglBuilder<'a> {
     virtq: &'a mut VirtQueue,
-    idx: usize,
+    head: Option<u16>,
+    tail: u16,
 }
 
 impl VirtqSglBuilder<'_> {
+    fn push_desc(&mut self, addr: Pa, len: usize, flags: VirtqDescFlags) {
+        let idx = self.virtq.alloc_desc();
+        match self.head {
+            Some(_) => {
+                let tail = &mut self.virtq.desc[self.tail as usize];
+                tail.flags |= VirtqDescFlags::NEXT;
+                tail.next = idx;
+            }
+            None => self.head = Some(idx),
+        }
+        self.tail = idx;
+        let desc = &mut self.virtq.desc[idx as usize];
+        desc.addr = addr;
+        desc.len = len as u32;
+        desc.flags = flags;
+    }
+
+    /// Append the buffer of `len` bytes at `kva`, with a descriptor for each
+    /// physically contiguous run of the buffer.
+    ///
+    /// Returns the number of the descriptors used.
+    fn push_buf(&mut self, kva: usize, len: usize, flags: VirtqDescFlags) -> usize {
+        let mut cnt = 0;
+        for (pa, len) in Self::runs(kva, len) {
+            self.push_desc(pa, len, flags);
+            cnt += 1;
+        }
+        cnt
+    }
+
+    /// Split the buffer of `len` bytes at `kva` into the physically
+    /// contiguous runs.
+    ///
+    /// The buffer is translated page by page, and the physically adjacent
+    /// pages are merged into a single run.
+    fn runs(kva: usize, len: usize) -> impl Iterator<Item = (Pa, usize)> {
+        let mut pos = 0;
+        let mut page = move || {
+            (pos < len).then(|| {
+                let addr = kva + pos;
+                let size = (PAGE_SIZE - (addr & PAGE_MASK)).min(len - pos);
+                pos += size;
+                let pa = Kva::new(addr)
+                    .and_then(Kva::translate)
+                    .expect("virtqueue: unmapped buffer.");
+                (pa, size)
+            })
+        };
+        let mut next = page();
+        core::iter::from_fn(move || {
+            let (pa, mut size) = next?;
+            loop {
+                next = page();
+                match next {
+                    Some((npa, nsize)) if npa == pa + size => size += nsize,
+                    _ => break Some((pa, size)),
+                }
+            }
+        })
+    }
+
+    /// Append the buffer of `len` bytes at the kernel virtual address `kva`.
+    ///
+    /// The buffer takes a descriptor for each of its physically contiguous
+    /// runs, i.e., at most one for each page that it spans. Returns the
+    /// number of the descriptors used.
+    ///
+    /// # Safety
+    /// The buffer must live until the chain is used by the device.
+    #[inline]
+    pub unsafe fn push_raw(&mut self, kva: usize, len: usize, device_writable: bool) -> usize {
+        self.push_buf(
+            kva,
+            len,
+            if device_writable {
+                VirtqDescFlags::WRITE
+            } else {
+                VirtqDescFlags::empty()
+            },
+        )
+    }
+
+    /// Append a device-readable buffer.
     #[inline]
     pub fn push<T>(&mut self, val: &T)
     where
         T: ?Sized,
     {
-        if self.idx != 0 {
-            self.virtq.desc[self.idx - 1].flags |= VirtqDescFlags::NEXT;
-        }
-        // FIXME: handle concurrently.
-        let desc = &mut self.virtq.desc[self.idx];
-        self.idx += 1;
-
-        desc.addr = Kva::new(val as *const _ as *const () as usize)
-            .unwrap()
-            .into_pa();
-        desc.len = core::mem::size_of_val(val) as u32;
-        desc.flags = VirtqDescFlags::empty();
+        self.push_buf(
+            val as *const _ as *const () as usize,
+            core::mem::size_of_val(val),
+            VirtqDescFlags::empty(),
+        );
     }
 
+    /// Append a device-writable buffer.
     #[inline]
     pub fn push_mut<T>(&mut self, val: &mut T)
     where
         T: ?Sized,
     {
-        if self.idx != 0 {
-            self.virtq.desc[self.idx - 1].flags |= VirtqDescFlags::NEXT;
-        }
-        // FIXME: handle concurrently.
-        let desc = &mut self.virtq.desc[self.idx];
-        self.idx += 1;
-
-        desc.addr = Kva::new(val as *const _ as *const () as usize)
-            .unwrap()
-            .into_pa();
-        desc.len = core::mem::size_of_val(val) as u32;
-        desc.flags = VirtqDescFlags::WRITE;
+        self.push_buf(
+            val as *const _ as *const () as usize,
+            core::mem::size_of_val(val),
+            VirtqDescFlags::WRITE,
+        );
     }
 
-    // FIXME: genernalize via trait.
+    /// Make the chain available to the device, and returns its head.
+    ///
+    /// The device is not notified until [`VirtQueue::notify`].
     #[inline]
-    pub fn finish(self) -> usize {
+    pub fn submit(self) -> u16 {
+        let head = self.head.expect("virtqueue: empty chain.");
         fence(Ordering::SeqCst);
-        self.virtq.avail.submit_chain(0);
-        let last_seen = self.virtq.used.idx();
-        // Kick.
-        self.virtq.kick(0);
-        // FIXME: spin for now. When supporting neither I/O apic or msi-x, use
-        // interrupt.
-        loop {
-            fence(Ordering::SeqCst);
-            if last_seen != self.virtq.used.idx() {
-                break;
-            }
-        }
-        self.virtq.used[last_seen as usize].len as usize
+        self.virtq.avail.submit_chain(head);
+        head
     }
 }
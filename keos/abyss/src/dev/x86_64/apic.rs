@@ -70,7 +70,6 @@ impl _8259A {
         Pio::new(0xa1).write_u8((Self::MASK >> 8) as u8);
     }
 
-    #[allow(dead_code)]
     pub(crate) fn enable(ev: u8) -> Result<(), ()> {
         MapDest::try_from(ev).map(|dest| {
             let (port, mask) = match dest {
@@ -1,7 +1,44 @@
 //! Serial device driver.
+//!
+//! The COM1 port is polled until [`enable_interrupt`] is called. From then
+//! on, [`Com1Sink::queue`] appends the bytes to a transmit ring and returns,
+//! and the transmitter holding register empty (THRE) interrupt refills the
+//! FIFO of the UART from the ring. A synchronous write through
+//! [`core::fmt::Write`] first sends out the ring, so that the output keeps
+//! its order.
+//!
+//! The received bytes raise [`IRQ_VECTOR`] as well; its handler reads them
+//! with [`read_byte`].
+use crate::dev::x86_64::apic::_8259A;
 use crate::spinlock::SpinLock;
-
 use crate::x86_64::pio::Pio;
+use core::sync::atomic::{AtomicBool, Ordering};
+
+/// Interrupt vector of the COM1 port, IRQ 4 of the 8259A.
+pub const IRQ_VECTOR: u8 = 32 + 4;
+
+/// Size of the transmit ring.
+pub const TX_SIZE: usize = 0x1000;
+
+const COM1: u16 = 0x3f8;
+/// Interrupt enable register.
+const IER: u16 = COM1 + 1;
+/// Interrupt identification register on read, FIFO control register on write.
+const IIR: u16 = COM1 + 2;
+/// Modem control register.
+const MCR: u16 = COM1 + 4;
+/// Line status register.
+const LSR: u16 = COM1 + 5;
+
+const IER_RX: u8 = 0x01;
+const IER_THRE: u8 = 0x02;
+const LSR_DR: u8 = 0x01;
+const LSR_THRE: u8 = 0x20;
+/// Depth of the transmit FIFO of a 16550A.
+const FIFO_SIZE: usize = 16;
+
+/// Whether the port is driven by interrupts.
+static INTERRUPT: AtomicBool = AtomicBool::new(false);
 
 /// Initialize a serial.
 pub unsafe fn init() {
@@ -16,10 +53,52 @@ pub unsafe fn init() {
     Pio::new(0x3f8).read_u8();
 }
 
+/// Drive the port by interrupts.
+///
+/// The FIFOs are enabled, and the interrupts of the port are routed to
+/// [`IRQ_VECTOR`]. The handler of the vector must be registered beforehand.
+pub fn enable_interrupt() {
+    // Enable and clear the FIFOs, with the receive trigger at 1 byte.
+    Pio::new(IIR).write_u8(0x07);
+    // DTR, RTS and OUT2, which gates the interrupt line.
+    Pio::new(MCR).write_u8(0x0b);
+    Pio::new(IER).write_u8(IER_RX);
+    ack_interrupt();
+    INTERRUPT.store(true, Ordering::SeqCst);
+    let _ = _8259A::enable(IRQ_VECTOR);
+}
+
+/// Whether the port is driven by interrupts.
+pub fn is_interrupt_driven() -> bool {
+    INTERRUPT.load(Ordering::SeqCst)
+}
+
+/// Acknowledge the pending interrupt of the port.
+pub fn ack_interrupt() {
+    Pio::new(IIR).read_u8();
+}
+
+/// Read a received byte, if any.
+pub fn read_byte() -> Option<u8> {
+    if Pio::new(LSR).read_u8() & LSR_DR != 0 {
+        Some(Pio::new(COM1).read_u8())
+    } else {
+        None
+    }
+}
+
+fn tx_empty() -> bool {
+    Pio::new(LSR).read_u8() & LSR_THRE != 0
+}
+
 pub(crate) fn write_str(s: &str) {
-    for b in s.as_bytes() {
+    write_bytes(s.as_bytes())
+}
+
+fn write_bytes(s: &[u8]) {
+    for b in s {
         for _ in 0..12800 {
-            if Pio::new(0x3f8 + 5).read_u8() & 0x20 != 0 {
+            if tx_empty() {
                 break;
             }
             // delay
@@ -71,18 +150,79 @@ pub fn read_bytes_busywait(buffer: &mut [u8]) -> Option<usize> {
 }
 
 pub struct Com1Sink {
-    _p: (),
+    /// Transmit ring.
+    tx: [u8; TX_SIZE],
+    /// Position of the next queued byte. Positions are not wrapped.
+    head: usize,
+    /// Position of the oldest queued byte.
+    tail: usize,
 }
 
 impl Com1Sink {
     /// Create a new serial device interface.
     pub const fn new() -> Self {
-        Com1Sink { _p: () }
+        Com1Sink {
+            tx: [0; TX_SIZE],
+            head: 0,
+            tail: 0,
+        }
+    }
+
+    /// Queue `data` to be transmitted by the interrupts. Returns the number
+    /// of the queued bytes, which is short if the ring is full.
+    ///
+    /// Unless the port is driven by interrupts, `data` is written out at
+    /// once.
+    pub fn queue(&mut self, data: &[u8]) -> usize {
+        if !is_interrupt_driven() {
+            self.flush();
+            write_bytes(data);
+            return data.len();
+        }
+        let n = data.len().min(TX_SIZE - (self.head - self.tail));
+        for b in &data[..n] {
+            self.tx[self.head % TX_SIZE] = *b;
+            self.head += 1;
+        }
+        self.kick();
+        n
+    }
+
+    /// Refill the transmit FIFO from the ring if it is empty, and arm the
+    /// THRE interrupt while the ring has bytes left.
+    pub fn kick(&mut self) {
+        if self.head != self.tail && tx_empty() {
+            for _ in 0..FIFO_SIZE.min(self.head - self.tail) {
+                Pio::new(COM1).write_u8(self.tx[self.tail % TX_SIZE]);
+                self.tail += 1;
+            }
+        }
+        if is_interrupt_driven() {
+            let thre = if self.head != self.tail { IER_THRE } else { 0 };
+            Pio::new(IER).write_u8(IER_RX | thre);
+        }
+    }
+
+    /// Write out the transmit ring synchronously.
+    pub fn flush(&mut self) {
+        if self.tail == self.head {
+            return;
+        }
+        while self.tail != self.head {
+            let start = self.tail % TX_SIZE;
+            let len = (self.head - self.tail).min(TX_SIZE - start);
+            write_bytes(&self.tx[start..start + len]);
+            self.tail += len;
+        }
+        if is_interrupt_driven() {
+            Pio::new(IER).write_u8(IER_RX);
+        }
     }
 }
 
 impl core::fmt::Write for Com1Sink {
     fn write_str(&mut self, s: &str) -> core::fmt::Result {
+        self.flush();
         write_str(s);
         Ok(())
     }
@@ -1,8 +1,14 @@
 //! APIC based timer.
 use crate::addressing::Kva;
 use crate::dev::DeviceError;
-use crate::x86_64::{msr::Msr, pio::Pio};
-use core::arch::x86_64::{__cpuid, _rdtsc, CpuidResult};
+use crate::{
+    MAX_CPU,
+    x86_64::{intrinsics::cpuid, msr::Msr, pio::Pio},
+};
+use core::{
+    arch::x86_64::{__cpuid, _rdtsc, CpuidResult},
+    sync::atomic::{AtomicBool, Ordering},
+};
 
 unsafe fn find_cpu_frequncy_lapic() -> Option<u64> {
     unsafe {
@@ -206,6 +212,10 @@ pub unsafe fn init(core_id: usize) -> Result<(), DeviceError> {
                     find_cpu_frequncy().ok_or(DeviceError("Failed to find cpu frequency."))?;
                 GLOBAL_TIMER_MODE = Some(TimerMode::TSCDeadline);
             }
+            // TSC_AUX: Let `rdtscp` of the user report the core.
+            if core::arch::x86_64::__cpuid(0x8000_0001).edx & (1 << 27) != 0 {
+                Msr::<0xc000_0103>::write(core_id as u64);
+            }
             // Timer
             // Irq #32.
             Msr::<0x832>::write((0b10 << 17) | 32);
@@ -228,19 +238,35 @@ pub unsafe fn init(core_id: usize) -> Result<(), DeviceError> {
     }
 }
 
+/// Frequency of the time stamp counter in kHz, if the tsc is used as the
+/// timer.
+pub fn tsc_khz() -> Option<u64> {
+    unsafe {
+        match GLOBAL_TIMER_MODE {
+            Some(TimerMode::TSCDeadline) => Some(CPU_FREQ),
+            _ => None,
+        }
+    }
+}
+
+/// Whether the tick of each core is stopped.
+static TICK_STOPPED: [AtomicBool; MAX_CPU] = [const { AtomicBool::new(false) }; MAX_CPU];
+
 /// Program the deadline timer.
 pub unsafe fn set_timer() {
-    unsafe {
-        // TscDeadline
-        // 1ms resolution.
+    unsafe { set_timer_after(1) }
+}
 
+/// Program the deadline timer to fire after `ms` milliseconds.
+pub unsafe fn set_timer_after(ms: u64) {
+    unsafe {
         let mode = GLOBAL_TIMER_MODE.unwrap();
         match mode {
             TimerMode::OneShot => {
-                Msr::<0x838>::write(CPU_FREQ);
+                Msr::<0x838>::write(CPU_FREQ.saturating_mul(ms).min(u32::MAX as u64));
             }
             TimerMode::TSCDeadline => {
-                let next = _rdtsc() + CPU_FREQ;
+                let next = _rdtsc() + CPU_FREQ.saturating_mul(ms);
                 Msr::<0x6e0>::write(next);
             }
         }
@@ -248,3 +274,31 @@ pub unsafe fn set_timer() {
         core::sync::atomic::fence(core::sync::atomic::Ordering::SeqCst);
     }
 }
+
+/// Stop the tick of the current core.
+///
+/// No timer interrupt is delivered until [`restart_tick`]. Writing zero to
+/// either the deadline or the initial count disarms the timer.
+pub unsafe fn stop_tick() {
+    unsafe {
+        TICK_STOPPED[cpuid()].store(true, Ordering::SeqCst);
+        match GLOBAL_TIMER_MODE.unwrap() {
+            TimerMode::OneShot => Msr::<0x838>::write(0),
+            TimerMode::TSCDeadline => Msr::<0x6e0>::write(0),
+        }
+    }
+}
+
+/// Restart the tick of the current core if it is stopped.
+pub unsafe fn restart_tick() {
+    unsafe {
+        if TICK_STOPPED[cpuid()].swap(false, Ordering::SeqCst) {
+            set_timer();
+        }
+    }
+}
+
+/// Returns true if the tick of the `core` is stopped.
+pub fn is_tick_stopped(core: usize) -> bool {
+    TICK_STOPPED[core].load(Ordering::SeqCst)
+}
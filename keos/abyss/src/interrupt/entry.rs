@@ -11,6 +11,7 @@ global_asm!(include_str!("entry.s"));
 
 unsafe extern "Rust" {
     fn kill_current_thread() -> !;
+    fn restore_fpu_state();
 }
 
 // Load interrupt descriptor table.
@@ -67,8 +68,9 @@ extern "C" fn handle_simd_floating_point_exception(frame: &mut Registers) {
 #[unsafe(no_mangle)]
 extern "C" fn handle_device_not_available(frame: &mut Registers) {
     if frame.interrupt_stack_frame.cs.dpl() == PrivilegeLevel::Ring3 {
+        // CR0.TS is set: lazily restore the extended states of the thread.
         unsafe {
-            kill_current_thread();
+            restore_fpu_state();
         }
     } else {
         panic!("Device Not Available");
@@ -1,20 +1,294 @@
 //! Kernel print utilities.
+//!
+//! [`print!`] and [`println!`] write to the serial port synchronously, under
+//! the lock of the port. [`info!`], [`warning!`] and [`debug!`] do not wait
+//! for the port: the message is formatted on the stack, and appended to the
+//! log ring of the cpu without any lock. The rings are drained to the port:
+//! - by every synchronous print, before its own message, so that a message
+//!   never overtakes the logs of the same cpu,
+//! - by an idle cpu, with [`drain`], and
+//! - by [`flush`], before a shutdown.
+//!
+//! [`queue_output`] does not wait for the port either: the bytes are
+//! appended to the transmit ring of the port, which the serial interrupt
+//! sends out with [`transmit`].
+//!
+//! Each log record carries a global sequence number, and the drainer merges
+//! the rings in the order of the numbers. A record that does not fit in the
+//! ring is dropped, and counted. A message longer than [`MAX_RECORD`] is
+//! printed synchronously.
 
 use crate::dev::x86_64::serial::Com1Sink;
-use crate::spinlock::SpinLock;
-use core::fmt::Write;
+use crate::interrupt::InterruptGuard;
+use crate::spinlock::{SpinLock, SpinLockGuard};
+use crate::{MAX_CPU, x86_64::intrinsics::cpuid};
+use core::{
+    cell::UnsafeCell,
+    fmt::Write,
+    sync::atomic::{AtomicBool, AtomicU32, AtomicU64, AtomicUsize, Ordering},
+};
 
 // Only mutated when force unlocking is required (i.e. panicking)
 static mut SERIAL: SpinLock<Com1Sink> = SpinLock::new(Com1Sink::new());
 
+/// Size of the log ring of a cpu.
+const RING_SIZE: usize = 0x4000;
+/// Size of a record header. Records are aligned to it.
+const HEADER_SIZE: usize = core::mem::size_of::<Header>();
+/// Maximum length of a log message.
+pub const MAX_RECORD: usize = 512;
+/// Length of a record that pads the ring up to its end.
+const PADDING: u32 = u32::MAX;
+
+#[repr(C, align(16))]
+struct Header {
+    seq: u64,
+    len: u32,
+    /// Non-zero once the message is written.
+    committed: AtomicU32,
+}
+
+#[repr(C, align(16))]
+struct LogRing {
+    buf: UnsafeCell<[u8; RING_SIZE]>,
+    /// Position of the next record. Positions are not wrapped.
+    head: AtomicUsize,
+    /// Position of the oldest record. Only moved by the drainer.
+    tail: AtomicUsize,
+}
+
+unsafe impl Sync for LogRing {}
+
+static RINGS: [LogRing; MAX_CPU] = [const {
+    LogRing {
+        buf: UnsafeCell::new([0; RING_SIZE]),
+        head: AtomicUsize::new(0),
+        tail: AtomicUsize::new(0),
+    }
+}; MAX_CPU];
+
+/// Next sequence number of a record.
+static SEQ: AtomicU64 = AtomicU64::new(0);
+/// Records dropped since the last drain.
+static DROPPED: AtomicU64 = AtomicU64::new(0);
+/// Whether a transmit interrupt found the port locked.
+static TX_PENDING: AtomicBool = AtomicBool::new(false);
+
+impl LogRing {
+    fn header(&self, pos: usize) -> *mut Header {
+        unsafe { (self.buf.get() as *mut u8).add(pos % RING_SIZE) as *mut Header }
+    }
+
+    /// Append `data` as a record. Returns false if the ring is full.
+    fn push(&self, data: &[u8]) -> bool {
+        let size = HEADER_SIZE + data.len().next_multiple_of(HEADER_SIZE);
+        let (pos, pad) = loop {
+            let head = self.head.load(Ordering::Relaxed);
+            // A record does not wrap around the end of the ring.
+            let pad = match head % RING_SIZE {
+                ofs if ofs + size > RING_SIZE => RING_SIZE - ofs,
+                _ => 0,
+            };
+            if head + pad + size - self.tail.load(Ordering::Acquire) > RING_SIZE {
+                return false;
+            }
+            if self
+                .head
+                .compare_exchange_weak(
+                    head,
+                    head + pad + size,
+                    Ordering::Relaxed,
+                    Ordering::Relaxed,
+                )
+                .is_ok()
+            {
+                break (head, pad);
+            }
+        };
+        unsafe {
+            if pad != 0 {
+                let h = self.header(pos);
+                (*h).len = PADDING;
+                (*h).committed.store(1, Ordering::Release);
+            }
+            let h = self.header(pos + pad);
+            (*h).seq = SEQ.fetch_add(1, Ordering::Relaxed);
+            (*h).len = data.len() as u32;
+            core::ptr::copy_nonoverlapping(
+                data.as_ptr(),
+                (h as *mut u8).add(HEADER_SIZE),
+                data.len(),
+            );
+            (*h).committed.store(1, Ordering::Release);
+        }
+        true
+    }
+
+    /// Sequence number of the oldest committed record, skipping the padding.
+    ///
+    /// Must be called by the drainer.
+    fn peek(&self) -> Option<u64> {
+        loop {
+            let tail = self.tail.load(Ordering::Relaxed);
+            if tail == self.head.load(Ordering::Acquire) {
+                return None;
+            }
+            let h = self.header(tail);
+            unsafe {
+                if (*h).committed.load(Ordering::Acquire) == 0 {
+                    return None;
+                }
+                if (*h).len != PADDING {
+                    return Some((*h).seq);
+                }
+                (*h).committed.store(0, Ordering::Relaxed);
+            }
+            self.tail
+                .store(tail + RING_SIZE - tail % RING_SIZE, Ordering::Release);
+        }
+    }
+
+    /// Write the record found by [`LogRing::peek`] to `sink`, and free it.
+    fn pop(&self, sink: &mut Com1Sink) {
+        let tail = self.tail.load(Ordering::Relaxed);
+        let h = self.header(tail);
+        unsafe {
+            let len = (*h).len as usize;
+            let data = core::slice::from_raw_parts((h as *const u8).add(HEADER_SIZE), len);
+            // The record is the output of a formatter.
+            let _ = sink.write_str(core::str::from_utf8_unchecked(data));
+            (*h).committed.store(0, Ordering::Relaxed);
+            self.tail.store(
+                tail + HEADER_SIZE + len.next_multiple_of(HEADER_SIZE),
+                Ordering::Release,
+            );
+        }
+    }
+}
+
+/// Write the records of all rings to `sink`, in the order of the sequence
+/// numbers.
+fn drain_into(sink: &mut Com1Sink) {
+    while let Some((_, ring)) = RINGS
+        .iter()
+        .filter_map(|ring| ring.peek().map(|seq| (seq, ring)))
+        .min_by_key(|(seq, _)| *seq)
+    {
+        ring.pop(sink);
+    }
+    match DROPPED.swap(0, Ordering::Relaxed) {
+        0 => (),
+        n => {
+            let _ = writeln!(sink, "[LOG] {n} messages dropped");
+        }
+    }
+}
+
+/// Unlock the serial port, and serve the transmit interrupts that found it
+/// locked.
+fn release(guard: SpinLockGuard<'_, Com1Sink>) {
+    guard.unlock();
+    serve_pending();
+}
+
+fn serve_pending() {
+    // If the lock is taken again, the new holder checks the flag on its
+    // unlock.
+    while TX_PENDING.load(Ordering::SeqCst) {
+        let Ok(mut guard) = (unsafe { SERIAL.try_lock() }) else {
+            return;
+        };
+        if TX_PENDING.swap(false, Ordering::SeqCst) {
+            guard.kick();
+        }
+        guard.unlock();
+    }
+}
+
+/// Drain the log rings to the serial port, unless the port is busy.
+///
+/// This also refills the transmitter, in case that its interrupt is lost.
+pub fn drain() {
+    if let Ok(mut guard) = unsafe { SERIAL.try_lock() } {
+        drain_into(&mut guard);
+        guard.kick();
+        release(guard);
+    }
+}
+
+/// Drain the log rings and the transmit ring to the serial port, waiting for
+/// the port.
+pub fn flush() {
+    let mut guard = unsafe { SERIAL.lock() };
+    drain_into(&mut guard);
+    guard.flush();
+    release(guard);
+}
+
+/// Queue `data` to the serial port, without waiting for the port to send it
+/// out. Returns the number of the queued bytes, which is short if the
+/// transmit ring is full.
+pub fn queue_output(data: &[u8]) -> usize {
+    let mut guard = unsafe { SERIAL.lock() };
+    drain_into(&mut guard);
+    let n = guard.queue(data);
+    release(guard);
+    n
+}
+
+/// Refill the transmitter from the transmit ring.
+///
+/// Called on the transmit interrupt of the serial port. If the port is
+/// locked, its holder does the work.
+pub fn transmit() {
+    TX_PENDING.store(true, Ordering::SeqCst);
+    serve_pending();
+}
+
 #[doc(hidden)]
 #[unsafe(no_mangle)]
 /// Safety: Serial only mutated when force unlocking is required (i.e.
 /// panicking)
 pub fn _print(fmt: core::fmt::Arguments<'_>) {
     let mut guard = unsafe { SERIAL.lock() };
+    drain_into(&mut guard);
     let _ = write!(&mut *guard, "{fmt}");
-    guard.unlock();
+    release(guard);
+}
+
+/// A message being formatted on the stack.
+struct Record {
+    buf: [u8; MAX_RECORD],
+    len: usize,
+}
+
+impl Write for Record {
+    fn write_str(&mut self, s: &str) -> core::fmt::Result {
+        let end = self.len + s.len();
+        if end > MAX_RECORD {
+            return Err(core::fmt::Error);
+        }
+        self.buf[self.len..end].copy_from_slice(s.as_bytes());
+        self.len = end;
+        Ok(())
+    }
+}
+
+#[doc(hidden)]
+pub fn _log(fmt: core::fmt::Arguments<'_>) {
+    let mut record = Record {
+        buf: [0; MAX_RECORD],
+        len: 0,
+    };
+    if record.write_fmt(fmt).is_err() {
+        return _print(fmt);
+    }
+    // Without interrupts, a record is finished before the next one on the
+    // cpu is started.
+    let _guard = InterruptGuard::new();
+    if !RINGS[cpuid()].push(&record.buf[..record.len]) {
+        DROPPED.fetch_add(1, Ordering::Relaxed);
+    }
 }
 
 /// Force Unlocking Serial.
@@ -49,29 +323,29 @@ macro_rules! println {
 /// Display an information message.
 ///
 /// Use the format! syntax to write data to the standard output.
-/// This first holds the lock for console device.
+/// The message is queued in the log ring of the cpu.
 #[macro_export]
 macro_rules! info {
-    () => (if !$crate::QUITE.load(core::sync::atomic::Ordering::SeqCst) { $crate::print!("[INFO]\n") });
-    ($($arg:tt)*) => (if !$crate::QUITE.load(core::sync::atomic::Ordering::SeqCst) { $crate::print!("[INFO] {}\n", format_args!($($arg)*)) });
+    () => (if !$crate::QUITE.load(core::sync::atomic::Ordering::SeqCst) { $crate::kprint::_log(format_args!("[INFO]\n")) });
+    ($($arg:tt)*) => (if !$crate::QUITE.load(core::sync::atomic::Ordering::SeqCst) { $crate::kprint::_log(format_args!("[INFO] {}\n", format_args!($($arg)*))) });
 }
 
 /// Display a warning message.
 ///
 /// Use the format! syntax to write data to the standard output.
-/// This first holds the lock for console device.
+/// The message is queued in the log ring of the cpu.
 #[macro_export]
 macro_rules! warning {
-    () => (if !$crate::QUITE.load(core::sync::atomic::Ordering::SeqCst) { $crate::print!("[WARN]\n") });
-    ($($arg:tt)*) => (if !$crate::QUITE.load(core::sync::atomic::Ordering::SeqCst) { $crate::print!("[WARN] {}\n", format_args!($($arg)*)) });
+    () => (if !$crate::QUITE.load(core::sync::atomic::Ordering::SeqCst) { $crate::kprint::_log(format_args!("[WARN]\n")) });
+    ($($arg:tt)*) => (if !$crate::QUITE.load(core::sync::atomic::Ordering::SeqCst) { $crate::kprint::_log(format_args!("[WARN] {}\n", format_args!($($arg)*))) });
 }
 
 /// Display a debug message.
 ///
 /// Use the format! syntax to write data to the standard output.
-/// This first holds the lock for console device.
+/// The message is queued in the log ring of the cpu.
 #[macro_export]
 macro_rules! debug {
-    () => (if !$crate::QUITE.load(core::sync::atomic::Ordering::SeqCst) { $crate::print!("[DEBUG]\n") });
-    ($($arg:tt)*) => (if !$crate::QUITE.load(core::sync::atomic::Ordering::SeqCst) { $crate::print!("[DEBUG] {}\n", format_args!($($arg)*))} );
+    () => (if !$crate::QUITE.load(core::sync::atomic::Ordering::SeqCst) { $crate::kprint::_log(format_args!("[DEBUG]\n")) });
+    ($($arg:tt)*) => (if !$crate::QUITE.load(core::sync::atomic::Ordering::SeqCst) { $crate::kprint::_log(format_args!("[DEBUG] {}\n", format_args!($($arg)*)))} );
 }
@@ -53,6 +53,8 @@ pub mod boot;
 pub mod dev;
 #[doc(hidden)]
 pub mod interrupt;
+#[cfg(feature = "lockstat")]
+pub mod lockstat;
 #[doc(hidden)]
 pub mod spinlock;
 #[doc(hidden)]
@@ -0,0 +1,178 @@
+//! Lock contention statistics.
+//!
+//! Enabled with the `lockstat` feature. Every acquisition of a
+//! [`SpinLock`] or a `RwLock` is charged to the source location that takes
+//! the lock, which usually identifies a single lock. For each location, it
+//! records the number of acquisitions and contended acquisitions, and the
+//! total and maximum cycles spent on waiting for and holding the lock.
+//!
+//! The statistics are kept in a fixed table that is updated without any lock,
+//! as the allocator and the console are protected by the spinlocks.
+//!
+//! [`SpinLock`]: crate::spinlock::SpinLock
+use core::{
+    arch::x86_64::_rdtsc,
+    panic::Location,
+    ptr::null_mut,
+    sync::atomic::{AtomicPtr, AtomicU64, Ordering},
+};
+
+/// Number of the locations that can be tracked.
+const NR_ENTRIES: usize = 512;
+
+/// Statistics of a location.
+struct Entry {
+    key: AtomicPtr<Location<'static>>,
+    acquisitions: AtomicU64,
+    contended: AtomicU64,
+    wait_total: AtomicU64,
+    wait_max: AtomicU64,
+    hold_total: AtomicU64,
+    hold_max: AtomicU64,
+}
+
+static ENTRIES: [Entry; NR_ENTRIES] = [const {
+    Entry {
+        key: AtomicPtr::new(null_mut()),
+        acquisitions: AtomicU64::new(0),
+        contended: AtomicU64::new(0),
+        wait_total: AtomicU64::new(0),
+        wait_max: AtomicU64::new(0),
+        hold_total: AtomicU64::new(0),
+        hold_max: AtomicU64::new(0),
+    }
+}; NR_ENTRIES];
+
+/// Acquisitions of the locations that do not fit in the table.
+static DROPPED: AtomicU64 = AtomicU64::new(0);
+
+/// A snapshot of the statistics of a location.
+#[derive(Clone, Copy, Debug)]
+pub struct LockStat {
+    /// The location that takes the lock.
+    pub location: &'static Location<'static>,
+    /// Number of acquisitions.
+    pub acquisitions: u64,
+    /// Number of acquisitions that find the lock held.
+    pub contended: u64,
+    /// Total cycles spent on waiting for the lock.
+    pub wait_total: u64,
+    /// Longest wait in cycles.
+    pub wait_max: u64,
+    /// Total cycles that the lock is held.
+    pub hold_total: u64,
+    /// Longest hold in cycles.
+    pub hold_max: u64,
+}
+
+/// Read the timestamp counter.
+#[inline]
+pub fn now() -> u64 {
+    unsafe { _rdtsc() }
+}
+
+/// Find or insert the entry of `location`.
+fn entry(location: &'static Location<'static>) -> Option<&'static Entry> {
+    let key = location as *const _ as *mut Location<'static>;
+    let hash = (key as usize >> 3).wrapping_mul(0x9e37_79b9_7f4a_7c15) >> 32;
+    (0..NR_ENTRIES)
+        .map(|i| &ENTRIES[(hash + i) % NR_ENTRIES])
+        .find(|entry| {
+            let cur = entry.key.load(Ordering::Acquire);
+            cur == key
+                || (cur.is_null()
+                    && match entry.key.compare_exchange(
+                        null_mut(),
+                        key,
+                        Ordering::AcqRel,
+                        Ordering::Acquire,
+                    ) {
+                        Ok(_) => true,
+                        Err(cur) => cur == key,
+                    })
+        })
+}
+
+/// Charge an acquisition at `location` that waits for `wait` cycles.
+#[inline]
+pub fn on_acquire(location: &'static Location<'static>, contended: bool, wait: u64) {
+    let Some(entry) = entry(location) else {
+        DROPPED.fetch_add(1, Ordering::Relaxed);
+        return;
+    };
+    entry.acquisitions.fetch_add(1, Ordering::Relaxed);
+    if contended {
+        entry.contended.fetch_add(1, Ordering::Relaxed);
+        entry.wait_total.fetch_add(wait, Ordering::Relaxed);
+        entry.wait_max.fetch_max(wait, Ordering::Relaxed);
+    }
+}
+
+/// Charge a release of the lock taken at `location` after holding it for
+/// `hold` cycles.
+#[inline]
+pub fn on_release(location: &'static Location<'static>, hold: u64) {
+    if let Some(entry) = entry(location) {
+        entry.hold_total.fetch_add(hold, Ordering::Relaxed);
+        entry.hold_max.fetch_max(hold, Ordering::Relaxed);
+    }
+}
+
+/// Get the statistics of every tracked location.
+pub fn stats() -> impl Iterator<Item = LockStat> {
+    ENTRIES.iter().filter_map(|entry| {
+        let location = unsafe { entry.key.load(Ordering::Acquire).as_ref()? };
+        Some(LockStat {
+            location,
+            acquisitions: entry.acquisitions.load(Ordering::Relaxed),
+            contended: entry.contended.load(Ordering::Relaxed),
+            wait_total: entry.wait_total.load(Ordering::Relaxed),
+            wait_max: entry.wait_max.load(Ordering::Relaxed),
+            hold_total: entry.hold_total.load(Ordering::Relaxed),
+            hold_max: entry.hold_max.load(Ordering::Relaxed),
+        })
+    })
+}
+
+/// Print the `top` locations that spend the most cycles on waiting.
+pub fn dump(top: usize) {
+    let mut order: [usize; NR_ENTRIES] = core::array::from_fn(|i| i);
+    let wait = |i: &usize| ENTRIES[*i].wait_total.load(Ordering::Relaxed);
+    order.sort_unstable_by_key(|i| core::cmp::Reverse(wait(i)));
+
+    println!("[LOCKSTAT] Top {top} contended locks, in TSC cycles.");
+    println!("  acq      contended  wait-total   wait-max     hold-total   hold-max     location");
+    for idx in order.iter().take(top) {
+        let entry = &ENTRIES[*idx];
+        let Some(location) = (unsafe { entry.key.load(Ordering::Acquire).as_ref() }) else {
+            continue;
+        };
+        println!(
+            "  {:<8} {:<10} {:<12} {:<12} {:<12} {:<12} {}",
+            entry.acquisitions.load(Ordering::Relaxed),
+            entry.contended.load(Ordering::Relaxed),
+            entry.wait_total.load(Ordering::Relaxed),
+            entry.wait_max.load(Ordering::Relaxed),
+            entry.hold_total.load(Ordering::Relaxed),
+            entry.hold_max.load(Ordering::Relaxed),
+            location
+        );
+    }
+    let dropped = DROPPED.load(Ordering::Relaxed);
+    if dropped != 0 {
+        println!("  {dropped} acquisitions are not tracked: the table is full.");
+    }
+}
+
+/// Clear the statistics.
+pub fn reset() {
+    for entry in ENTRIES.iter() {
+        entry.acquisitions.store(0, Ordering::Relaxed);
+        entry.contended.store(0, Ordering::Relaxed);
+        entry.wait_total.store(0, Ordering::Relaxed);
+        entry.wait_max.store(0, Ordering::Relaxed);
+        entry.hold_total.store(0, Ordering::Relaxed);
+        entry.hold_max.store(0, Ordering::Relaxed);
+    }
+    DROPPED.store(0, Ordering::Relaxed);
+}
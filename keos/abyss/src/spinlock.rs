@@ -1,11 +1,47 @@
 //! SMP-supported spinlock.
+//!
+//! A cpu that waits for a lock with interrupts disabled can not be preempted,
+//! and joins an MCS queue of the lock: it spins on its own per-cpu node until
+//! its predecessor hands over the head of the queue, and only the head spins
+//! on the lock word. This keeps the lock word from bouncing between the
+//! waiters, and hands the lock over in the FIFO order.
+//!
+//! A cpu that waits with interrupts enabled opens an interrupt window between
+//! the attempts, so that it can serve the TLB shootdown requests and be
+//! preempted. It can not hold a queue node across the window, so it polls the
+//! lock word and competes with the head of the queue instead.
 
+use crate::{
+    MAX_CPU,
+    interrupt::{InterruptGuard, InterruptState},
+    x86_64::intrinsics::cpuid,
+};
 use core::{
     cell::UnsafeCell,
     ops::{Deref, DerefMut},
-    sync::atomic::{AtomicBool, Ordering},
+    ptr::null_mut,
+    sync::atomic::{AtomicBool, AtomicPtr, AtomicU32, Ordering},
 };
 
+/// A queue node of a cpu that waits for a [`SpinLock`].
+///
+/// A cpu waits for at most one lock at a time, as interrupts are disabled
+/// while it is queued.
+#[repr(align(64))]
+struct McsNode {
+    /// The successor in the queue.
+    next: AtomicPtr<McsNode>,
+    /// Whether this node became the head of the queue.
+    head: AtomicBool,
+}
+
+static NODES: [McsNode; MAX_CPU] = [const {
+    McsNode {
+        next: AtomicPtr::new(null_mut()),
+        head: AtomicBool::new(false),
+    }
+}; MAX_CPU];
+
 /// The lock could not be acquired at this time because the operation would
 /// otherwise block.
 pub struct WouldBlock;
@@ -57,7 +93,9 @@ pub struct WouldBlock;
 /// }
 pub struct SpinLock<T: ?Sized> {
     locked: AtomicBool,
-    _pad: [u8; 15],
+    /// The last queued cpu plus one, or 0 if no cpu is queued.
+    tail: AtomicU32,
+    _pad: [u8; 11],
     data: UnsafeCell<T>,
 }
 
@@ -78,7 +116,8 @@ impl<T> SpinLock<T> {
     pub const fn new(t: T) -> SpinLock<T> {
         SpinLock {
             data: UnsafeCell::new(t),
-            _pad: [0u8; 15],
+            _pad: [0u8; 11],
+            tail: AtomicU32::new(0),
             locked: AtomicBool::new(false),
         }
     }
@@ -119,23 +158,88 @@ impl<T: ?Sized> SpinLock<T> {
     /// ```
     #[track_caller]
     pub fn lock(&self) -> SpinLockGuard<'_, T> {
-        let guard = loop {
-            let guard = crate::interrupt::InterruptGuard::new();
-
-            core::hint::spin_loop();
-            if !self.locked.fetch_or(true, Ordering::SeqCst) {
-                break guard;
+        #[cfg(feature = "lockstat")]
+        let (start, contended) = (
+            crate::lockstat::now(),
+            self.locked.load(Ordering::Relaxed) || self.tail.load(Ordering::Relaxed) != 0,
+        );
+        let guard = if InterruptState::current() == InterruptState::Off {
+            let guard = InterruptGuard::new();
+            self.lock_queued();
+            guard
+        } else {
+            loop {
+                let guard = InterruptGuard::new();
+                if self.try_acquire() {
+                    break guard;
+                }
+                drop(guard);
+                core::hint::spin_loop();
             }
-
-            drop(guard);
         };
 
+        #[cfg(feature = "lockstat")]
+        let acquired = {
+            let now = crate::lockstat::now();
+            crate::lockstat::on_acquire(core::panic::Location::caller(), contended, now - start);
+            now
+        };
         SpinLockGuard {
             caller: core::panic::Location::caller(),
             lock: self,
             guard: Some(guard),
+            #[cfg(feature = "lockstat")]
+            acquired,
+        }
+    }
+    /// Set the lock word if it is clear, reading it first to keep the cache
+    /// line shared while the lock is held.
+    #[inline]
+    fn try_acquire(&self) -> bool {
+        !self.locked.load(Ordering::Relaxed) && !self.locked.swap(true, Ordering::Acquire)
+    }
+
+    /// Acquire the lock through the MCS queue.
+    ///
+    /// Interrupts must be disabled.
+    fn lock_queued(&self) {
+        let me = cpuid();
+        let node = &NODES[me];
+        node.next.store(null_mut(), Ordering::Relaxed);
+        node.head.store(false, Ordering::Relaxed);
+
+        let prev = self.tail.swap(me as u32 + 1, Ordering::AcqRel);
+        if prev != 0 {
+            NODES[prev as usize - 1]
+                .next
+                .store(node as *const _ as *mut _, Ordering::Release);
+            while !node.head.load(Ordering::Acquire) {
+                core::hint::spin_loop();
+            }
+        }
+
+        // The head of the queue.
+        while !self.try_acquire() {
+            core::hint::spin_loop();
+        }
+
+        // Hand the head over to the successor, if any.
+        if self
+            .tail
+            .compare_exchange(me as u32 + 1, 0, Ordering::AcqRel, Ordering::Relaxed)
+            .is_err()
+        {
+            let next = loop {
+                let next = node.next.load(Ordering::Acquire);
+                if !next.is_null() {
+                    break next;
+                }
+                core::hint::spin_loop();
+            };
+            unsafe { (*next).head.store(true, Ordering::Release) };
         }
     }
+
     /// Attempts to acquire this lock.
     ///
     /// If the lock could not be acquired at this time, then [`Err`] is
@@ -173,13 +277,16 @@ impl<T: ?Sized> SpinLock<T> {
     /// ```
     #[track_caller]
     pub fn try_lock(&self) -> Result<SpinLockGuard<'_, T>, WouldBlock> {
-        let guard = crate::interrupt::InterruptGuard::new();
-        let acquired = !self.locked.fetch_or(true, Ordering::SeqCst);
-        if acquired {
+        let guard = InterruptGuard::new();
+        if self.try_acquire() {
+            #[cfg(feature = "lockstat")]
+            crate::lockstat::on_acquire(core::panic::Location::caller(), false, 0);
             Ok(SpinLockGuard {
                 guard: Some(guard),
                 caller: core::panic::Location::caller(),
                 lock: self,
+                #[cfg(feature = "lockstat")]
+                acquired: crate::lockstat::now(),
             })
         } else {
             Err(WouldBlock)
@@ -241,7 +348,10 @@ impl<T: ?Sized> DerefMut for SpinLockGuard<'_, T> {
 pub struct SpinLockGuard<'a, T: ?Sized + 'a> {
     caller: &'static core::panic::Location<'static>,
     lock: &'a SpinLock<T>,
-    guard: Option<crate::interrupt::InterruptGuard>,
+    guard: Option<InterruptGuard>,
+    /// TSC when the lock is acquired.
+    #[cfg(feature = "lockstat")]
+    acquired: u64,
 }
 
 impl<T: ?Sized> !Send for SpinLockGuard<'_, T> {}
@@ -265,7 +375,9 @@ impl<T: ?Sized> SpinLockGuard<'_, T> {
     /// guard.unlock();
     /// ```
     pub fn unlock(mut self) {
-        self.lock.locked.store(false, Ordering::SeqCst);
+        #[cfg(feature = "lockstat")]
+        crate::lockstat::on_release(self.caller, crate::lockstat::now() - self.acquired);
+        self.lock.locked.store(false, Ordering::Release);
         self.guard.take();
         core::mem::forget(self);
     }
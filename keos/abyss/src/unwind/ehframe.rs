@@ -15,6 +15,7 @@
 use super::machine::{ExecutionResult, Operations};
 use super::reader::{Application, DwarfReader, Encoding, Peeker};
 use super::{Register, UnwindError};
+use alloc::vec::Vec;
 
 pub struct EhFrameHeader<T>
 where
@@ -108,6 +109,47 @@ where
     }
 }
 
+/// The FDEs of an `.eh_frame`, parsed once and sorted by their start address.
+///
+/// Looking up a pc is a binary search, without parsing the `.eh_frame_hdr`
+/// and the FDE on every frame.
+pub struct FdeTable {
+    entries: Vec<FrameDescriptionEntry>,
+}
+
+impl FdeTable {
+    /// Parse all FDEs listed in the `.eh_frame_hdr` of `reader`.
+    pub fn new<T>(reader: DwarfReader<T>) -> Self
+    where
+        T: Peeker,
+    {
+        let hdr = EhFrameHeader::parse(reader.clone());
+        let mut entries: Vec<_> = (0..hdr.fde_count)
+            .filter_map(|idx| hdr.get(idx)?.insn.parse(reader.clone()))
+            .collect();
+        entries.sort_unstable_by_key(|fde| fde.pc.start);
+        Self { entries }
+    }
+
+    /// Find the FDE that covers `pc`.
+    pub fn find(&self, pc: usize) -> Option<&FrameDescriptionEntry> {
+        let idx = self.entries.partition_point(|fde| fde.pc.start <= pc);
+        self.entries
+            .get(idx.checked_sub(1)?)
+            .filter(|fde| fde.pc.contains(&pc))
+    }
+
+    /// Number of the FDEs.
+    pub fn len(&self) -> usize {
+        self.entries.len()
+    }
+
+    /// Returns true if there is no FDE.
+    pub fn is_empty(&self) -> bool {
+        self.entries.is_empty()
+    }
+}
+
 pub struct UnwindIndex {
     pub addr_offset: usize,
     pub insn: FrameDescriptionEntryPointer,
@@ -27,7 +27,7 @@ mod x86_64;
 use ehframe::EhFrameHeader;
 use x86_64::Register;
 
-pub use ehframe::FrameDescriptionEntry;
+pub use ehframe::{FdeTable, FrameDescriptionEntry};
 pub use reader::{DwarfReader, Encoding, Peeker};
 pub use x86_64::StackFrame;
 
@@ -156,6 +156,40 @@ where
         Ok(())
     }
 
+    /// Walk the frames with the FDEs of `table`, and call `unwind_fn` on
+    /// each frame until it returns false.
+    ///
+    /// Unlike [`UnwindBacktrace::unwind_frame`], this does not parse the
+    /// `.eh_frame` of the reader, and stops quietly at the first pc that is
+    /// not covered by `table`.
+    pub fn unwind_frame_with<UnwindFn>(
+        mut self,
+        table: &FdeTable,
+        mut unwind_fn: UnwindFn,
+    ) -> Result<(), UnwindError>
+    where
+        UnwindFn: FnMut(&Self) -> bool,
+    {
+        let (mut previous_pc, mut previous_cfa) = (self.frame.pc(), self.cfa);
+        while self.frame.pc() != 0 {
+            let Some(fde) = table.find(self.frame.pc()) else {
+                return Ok(());
+            };
+            if !unwind_fn(&self) {
+                return Ok(());
+            }
+            fde.run(self.frame.pc())?.apply(&mut self)?;
+            if self.frame.pc() == previous_pc && self.cfa == previous_cfa {
+                return Err(UnwindError::UnwindablePc(self.frame.pc()));
+            }
+
+            self.frame.set_pc(self.frame.pc().wrapping_sub(1));
+            previous_pc = self.frame.pc();
+            previous_cfa = self.cfa;
+        }
+        Ok(())
+    }
+
     #[inline]
     pub fn unwind_frame<UnwindFn>(self, mut unwind_fn: UnwindFn) -> Result<(), UnwindError>
     where
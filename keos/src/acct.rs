@@ -0,0 +1,290 @@
+//! Per-process resource accounting.
+//!
+//! An [`Account`] gathers the usage of the resources of a process, which is
+//! shared by its threads:
+//! - the resident pages that its pagers mapped for it,
+//! - its page faults,
+//! - the pages of the page cache that it brought in, and
+//! - the bytes that it read and wrote through its files.
+//!
+//! The [`Task`] of a process returns its account with [`Task::account`], and
+//! the kernel finds the account of the running process with [`current`]. A
+//! task that cannot keep the account by itself, e.g., a thread of a process
+//! whose state is shared with the other threads, gets it with [`of_thread`].
+//!
+//! ## Memory limit
+//!
+//! An account may have a limit on its memory, in pages, which covers both
+//! the resident pages and the page cache pages charged to it. A pager asks
+//! for a page with [`Account::try_charge`] before it allocates the page, and
+//! gives it back with [`Account::uncharge`] when the page is unmapped. A
+//! charge beyond the limit first asks the [`Shrinker`]s added to the account
+//! to release its own pages, and fails with [`KernelError::NoMemory`] only if
+//! they cannot. A process under
+//! its limit thus pages against itself, while the global [`reclaim`] keeps
+//! the working sets of the other processes.
+//!
+//! A page cache page is charged with [`Account::charge_cache`], which never
+//! fails; the page cache makes room among the pages of the account instead,
+//! as long as [`Account::excess`] is not zero.
+//!
+//! [`reclaim`]: crate::mm::reclaim
+#[cfg(doc)]
+use crate::task::Task;
+use crate::{
+    KernelError, addressing::Pa, mm::reclaim::Shrinker, sync::SpinLock, thread::with_current,
+};
+use abyss::interrupt::InterruptGuard;
+use alloc::{
+    collections::BTreeMap,
+    sync::{Arc, Weak},
+    vec::Vec,
+};
+use core::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+
+/// A snapshot of an [`Account`].
+#[derive(Clone, Copy, Debug, Default)]
+pub struct AcctStat {
+    /// Number of the resident pages.
+    pub resident: usize,
+    /// Largest number of the resident pages.
+    pub peak_resident: usize,
+    /// Number of the page cache pages.
+    pub cache_pages: usize,
+    /// Number of the page faults.
+    pub faults: u64,
+    /// Bytes read from the files.
+    pub read_bytes: u64,
+    /// Bytes written to the files.
+    pub written_bytes: u64,
+    /// Pages released by the shrinkers of the account.
+    pub reclaimed: u64,
+    /// Charges that failed at the limit.
+    pub failed: u64,
+}
+
+/// Resource usage of a process.
+pub struct Account {
+    resident: AtomicUsize,
+    peak_resident: AtomicUsize,
+    cache_pages: AtomicUsize,
+    faults: AtomicU64,
+    read_bytes: AtomicU64,
+    written_bytes: AtomicU64,
+    reclaimed: AtomicU64,
+    failed: AtomicU64,
+    /// Limit in pages, or `usize::MAX` if unlimited.
+    limit: AtomicUsize,
+    shrinkers: SpinLock<Vec<Weak<dyn Shrinker>>>,
+}
+
+impl Default for Account {
+    fn default() -> Self {
+        Self {
+            resident: AtomicUsize::new(0),
+            peak_resident: AtomicUsize::new(0),
+            cache_pages: AtomicUsize::new(0),
+            faults: AtomicU64::new(0),
+            read_bytes: AtomicU64::new(0),
+            written_bytes: AtomicU64::new(0),
+            reclaimed: AtomicU64::new(0),
+            failed: AtomicU64::new(0),
+            limit: AtomicUsize::new(usize::MAX),
+            shrinkers: SpinLock::new(Vec::new()),
+        }
+    }
+}
+
+impl Account {
+    /// Create an account without any usage or limit.
+    pub fn new() -> Arc<Self> {
+        Arc::new(Self::default())
+    }
+
+    /// The memory limit in pages, if any.
+    pub fn limit(&self) -> Option<usize> {
+        match self.limit.load(Ordering::Relaxed) {
+            usize::MAX => None,
+            limit => Some(limit),
+        }
+    }
+
+    /// Set the memory limit in pages, or remove it with `None`.
+    ///
+    /// The pages above a new limit are not released at once, but by the next
+    /// charges.
+    pub fn set_limit(&self, limit: Option<usize>) {
+        self.limit
+            .store(limit.unwrap_or(usize::MAX), Ordering::Relaxed);
+    }
+
+    /// Number of the pages charged to the account, including the page cache
+    /// pages.
+    pub fn usage(&self) -> usize {
+        self.resident.load(Ordering::Relaxed) + self.cache_pages.load(Ordering::Relaxed)
+    }
+
+    /// Number of the pages beyond the limit.
+    pub fn excess(&self) -> usize {
+        self.usage()
+            .saturating_sub(self.limit.load(Ordering::Relaxed))
+    }
+
+    /// Add a shrinker that releases the pages of this account.
+    ///
+    /// The account does not keep the shrinker alive; a dropped shrinker is
+    /// forgotten.
+    pub fn add_shrinker(&self, shrinker: &Arc<dyn Shrinker>) {
+        let mut guard = self.shrinkers.lock();
+        guard.retain(|s| s.strong_count() != 0);
+        guard.push(Arc::downgrade(shrinker));
+        guard.unlock();
+    }
+
+    /// Ask the shrinkers of the account to release `nr_pages` of its pages.
+    ///
+    /// Returns the number of the released pages. Like the global reclaim,
+    /// this is skipped while the interrupts are disabled.
+    pub fn reclaim(&self, nr_pages: usize) -> usize {
+        if nr_pages == 0 || InterruptGuard::is_guarded() {
+            return 0;
+        }
+        let guard = self.shrinkers.lock();
+        let shrinkers: Vec<_> = guard.iter().filter_map(Weak::upgrade).collect();
+        guard.unlock();
+        let mut released = 0;
+        for shrinker in shrinkers {
+            if released >= nr_pages {
+                break;
+            }
+            released += shrinker.shrink(nr_pages - released);
+        }
+        self.reclaimed.fetch_add(released as u64, Ordering::Relaxed);
+        released
+    }
+
+    /// Charge `nr_pages` resident pages.
+    ///
+    /// If the charge exceeds the limit, the pages of the account are
+    /// reclaimed first. A shrinker that releases a resident page must
+    /// [`Account::uncharge`] it.
+    ///
+    /// # Errors
+    /// - [`KernelError::NoMemory`] if the account stays beyond the limit.
+    pub fn try_charge(&self, nr_pages: usize) -> Result<(), KernelError> {
+        let limit = self.limit.load(Ordering::Relaxed);
+        if self.usage() + nr_pages > limit {
+            self.reclaim(self.usage() + nr_pages - limit);
+            if self.usage() + nr_pages > limit {
+                self.failed.fetch_add(1, Ordering::Relaxed);
+                return Err(KernelError::NoMemory);
+            }
+        }
+        let resident = self.resident.fetch_add(nr_pages, Ordering::Relaxed) + nr_pages;
+        self.peak_resident.fetch_max(resident, Ordering::Relaxed);
+        Ok(())
+    }
+
+    /// Uncharge `nr_pages` resident pages.
+    pub fn uncharge(&self, nr_pages: usize) {
+        let _ = self
+            .resident
+            .fetch_update(Ordering::Relaxed, Ordering::Relaxed, |n| {
+                Some(n.saturating_sub(nr_pages))
+            });
+    }
+
+    /// Charge a page cache page, which is uncharged when the returned
+    /// [`CacheCharge`] is dropped.
+    pub fn charge_cache(self: &Arc<Self>) -> CacheCharge {
+        self.cache_pages.fetch_add(1, Ordering::Relaxed);
+        CacheCharge(self.clone())
+    }
+
+    /// Count a page fault.
+    pub fn count_fault(&self) {
+        self.faults.fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// Count `bytes` read from a file.
+    pub fn count_read(&self, bytes: usize) {
+        self.read_bytes.fetch_add(bytes as u64, Ordering::Relaxed);
+    }
+
+    /// Count `bytes` written to a file.
+    pub fn count_write(&self, bytes: usize) {
+        self.written_bytes
+            .fetch_add(bytes as u64, Ordering::Relaxed);
+    }
+
+    /// Take a snapshot of the account.
+    pub fn stat(&self) -> AcctStat {
+        AcctStat {
+            resident: self.resident.load(Ordering::Relaxed),
+            peak_resident: self.peak_resident.load(Ordering::Relaxed),
+            cache_pages: self.cache_pages.load(Ordering::Relaxed),
+            faults: self.faults.load(Ordering::Relaxed),
+            read_bytes: self.read_bytes.load(Ordering::Relaxed),
+            written_bytes: self.written_bytes.load(Ordering::Relaxed),
+            reclaimed: self.reclaimed.load(Ordering::Relaxed),
+            failed: self.failed.load(Ordering::Relaxed),
+        }
+    }
+}
+
+/// A page cache page charged to an [`Account`].
+pub struct CacheCharge(Arc<Account>);
+
+impl CacheCharge {
+    /// The account that the page is charged to.
+    pub fn account(&self) -> &Arc<Account> {
+        &self.0
+    }
+}
+
+impl Drop for CacheCharge {
+    fn drop(&mut self) {
+        self.0.cache_pages.fetch_sub(1, Ordering::Relaxed);
+    }
+}
+
+/// Get the account of the running process, if the current thread runs one.
+pub fn current() -> Option<Arc<Account>> {
+    with_current(|th| th.task.as_ref().and_then(|task| task.account()))
+}
+
+/// The accounts of the threads from [`of_thread`], by their tid, with the
+/// page table that they run on.
+static THREADS: SpinLock<BTreeMap<u64, (Pa, Arc<Account>)>> = SpinLock::new(BTreeMap::new());
+
+/// Get the account of the thread `tid`, which runs on the page table at
+/// `page_table_pa`.
+///
+/// The threads on the same page table share the address space, and thus the
+/// account. A thread gets the account on the first call, which lives as
+/// long as one of its threads, and is forgotten when the thread is dropped.
+pub fn of_thread(tid: u64, page_table_pa: Pa) -> Arc<Account> {
+    let mut guard = THREADS.lock();
+    let account = match guard.get(&tid) {
+        Some((_, account)) => account.clone(),
+        None => {
+            let account = guard
+                .values()
+                .find(|(pa, _)| *pa == page_table_pa)
+                .map(|(_, account)| account.clone())
+                .unwrap_or_else(Account::new);
+            guard.insert(tid, (page_table_pa, account.clone()));
+            account
+        }
+    };
+    guard.unlock();
+    account
+}
+
+/// Forget the account of the thread `tid`, if it got one from [`of_thread`].
+pub(crate) fn forget(tid: u64) {
+    let mut guard = THREADS.lock();
+    let account = guard.remove(&tid);
+    guard.unlock();
+    drop(account);
+}
@@ -0,0 +1,691 @@
+//! Block I/O request layer and completion.
+//!
+//! Every [`Disk`] request goes through this layer on the way to the device
+//! driver.
+//!
+//! * **Plugging.** A thread that is about to issue many writes holds a
+//!   [`Plug`]. Its writes are copied into the plug list of the cpu instead of
+//!   being submitted. Writes to adjacent sectors are merged as they are
+//!   queued. When the plug is released, or the list grows beyond
+//!   [`PLUG_MAX_SECTORS`], the list is sorted and submitted as a single batch
+//!   of large bios. A read that overlaps a plugged write flushes the list
+//!   first, and a read that overlaps a flushed write still in flight copies
+//!   its data, so that it never sees stale data.
+//! * **Dispatch.** At most [`QUEUE_DEPTH`] batches are in flight on a device.
+//!   When the queue is full, a waiting read goes before a waiting write,
+//!   unless the writes have waited for longer than [`WRITE_EXPIRE_MS`], so
+//!   that reads do not starve behind writeback, and writeback is not starved
+//!   by reads.
+//! * **Completion.** The driver submits many requests at once and waits for
+//!   each of them. When the device signals the completions with an
+//!   interrupt, a waiter parks instead of spinning, and the interrupt handler
+//!   wakes up all the waiters, which re-check their requests.
+//!
+//! A thread that holds a lock is never parked: it is admitted at once and
+//! spins on its completions.
+//!
+//! [`stat`] reports the counters of a device, including the queue depth and
+//! how well the requests are merged.
+//!
+//! [`Disk`]: crate::fs::Disk
+use crate::{
+    KernelError,
+    fs::Sector,
+    spinlock::SpinLock,
+    thread::{Current, ParkHandle, scheduler::BOOT_DONE, with_current},
+};
+use abyss::{
+    MAX_CPU,
+    dev::{BlockOps, pci::virtio::block::IRQ_VECTOR},
+    interrupt::InterruptGuard,
+    x86_64::intrinsics::cpuid,
+};
+use alloc::{sync::Arc, vec::Vec};
+use core::{
+    arch::x86_64::_rdtsc,
+    sync::atomic::{AtomicBool, AtomicU64, Ordering},
+};
+
+/// Number of the device slots.
+const NR_DEVS: usize = 4;
+
+/// Maximum number of the sectors queued in a plug list before it is
+/// flushed.
+pub const PLUG_MAX_SECTORS: usize = 256;
+
+/// Maximum number of the batches in flight on a device.
+pub const QUEUE_DEPTH: usize = 32;
+
+/// How long the waiting writes may be passed by the reads.
+pub const WRITE_EXPIRE_MS: u64 = 50;
+
+/// Counters of a device.
+#[derive(Default)]
+struct Counters {
+    reads: AtomicU64,
+    writes: AtomicU64,
+    read_bios: AtomicU64,
+    write_bios: AtomicU64,
+    plugged: AtomicU64,
+    expired: AtomicU64,
+    max_depth: AtomicU64,
+}
+
+/// A snapshot of the counters of a device.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct BlockStat {
+    /// Read requests, i.e., sector runs asked by the callers.
+    pub reads: u64,
+    /// Write requests.
+    pub writes: u64,
+    /// Read bios submitted to the device after merging.
+    pub read_bios: u64,
+    /// Write bios submitted to the device after merging.
+    pub write_bios: u64,
+    /// Write requests that were queued in a plug list.
+    pub plugged: u64,
+    /// Times that a write was admitted before a waiting read because its
+    /// deadline had expired.
+    pub expired: u64,
+    /// Batches in flight.
+    pub depth: u64,
+    /// Largest number of the batches in flight.
+    pub max_depth: u64,
+}
+
+impl BlockStat {
+    /// Requests per submitted bio, in percent. 100 means that no request was
+    /// merged.
+    pub fn merge_ratio(&self) -> u64 {
+        let bios = self.read_bios + self.write_bios;
+        if bios == 0 {
+            100
+        } else {
+            (self.reads + self.writes) * 100 / bios
+        }
+    }
+}
+
+/// Dispatch state of a device.
+struct Queue {
+    inflight: usize,
+    reads_waiting: usize,
+    writes_waiting: usize,
+    /// When the waiting writes were last admitted or started to wait.
+    write_since: u64,
+    waiters: Vec<ParkHandle>,
+}
+
+/// A device slot.
+struct Device {
+    queue: SpinLock<Queue>,
+    counters: Counters,
+}
+
+static DEVICES: [Device; NR_DEVS] = [const {
+    Device {
+        queue: SpinLock::new(Queue {
+            inflight: 0,
+            reads_waiting: 0,
+            writes_waiting: 0,
+            write_since: 0,
+            waiters: Vec::new(),
+        }),
+        counters: Counters {
+            reads: AtomicU64::new(0),
+            writes: AtomicU64::new(0),
+            read_bios: AtomicU64::new(0),
+            write_bios: AtomicU64::new(0),
+            plugged: AtomicU64::new(0),
+            expired: AtomicU64::new(0),
+            max_depth: AtomicU64::new(0),
+        },
+    }
+}; NR_DEVS];
+
+/// Get the counters of the device at slot `index`.
+pub fn stat(index: usize) -> Option<BlockStat> {
+    let dev = DEVICES.get(index)?;
+    let c = &dev.counters;
+    let q = dev.queue.lock();
+    let depth = q.inflight as u64;
+    q.unlock();
+    Some(BlockStat {
+        reads: c.reads.load(Ordering::Relaxed),
+        writes: c.writes.load(Ordering::Relaxed),
+        read_bios: c.read_bios.load(Ordering::Relaxed),
+        write_bios: c.write_bios.load(Ordering::Relaxed),
+        plugged: c.plugged.load(Ordering::Relaxed),
+        expired: c.expired.load(Ordering::Relaxed),
+        depth,
+        max_depth: c.max_depth.load(Ordering::Relaxed),
+    })
+}
+
+/// Print the counters of the devices that have served any request.
+pub fn dump() {
+    for index in 0..NR_DEVS {
+        let Some(s) = stat(index) else { continue };
+        if s.reads + s.writes == 0 {
+            continue;
+        }
+        println!(
+            "[BLOCK] disk {index}: {} reads in {} bios, {} writes in {} bios ({} plugged), merge {}%, depth {}/{} (max {}), {} expired writes",
+            s.reads,
+            s.read_bios,
+            s.writes,
+            s.write_bios,
+            s.plugged,
+            s.merge_ratio(),
+            s.depth,
+            QUEUE_DEPTH,
+            s.max_depth,
+            s.expired,
+        );
+    }
+}
+
+/// A batch admitted to the device queue, released on drop.
+struct Admission {
+    index: usize,
+}
+
+impl Admission {
+    /// Wait for a free slot in the queue of the device at `index`.
+    ///
+    /// A read takes any free slot. While reads are waiting, a write takes a
+    /// slot only if the writes have waited for longer than
+    /// [`WRITE_EXPIRE_MS`].
+    fn new(index: usize, is_read: bool) -> Self {
+        let dev = &DEVICES[index];
+        let may_park = BOOT_DONE.load(Ordering::SeqCst) && !InterruptGuard::is_guarded();
+        let expire = abyss::dev::x86_64::timer::tsc_khz().unwrap_or(1_000_000) * WRITE_EXPIRE_MS;
+        let mut waiting = false;
+        loop {
+            let mut q = dev.queue.lock();
+            let now = unsafe { _rdtsc() };
+            let expired = !is_read && waiting && now.wrapping_sub(q.write_since) > expire;
+            let admit = !may_park
+                || (q.inflight < QUEUE_DEPTH && (is_read || q.reads_waiting == 0 || expired));
+            if admit {
+                if waiting && is_read {
+                    q.reads_waiting -= 1;
+                } else if waiting {
+                    q.writes_waiting -= 1;
+                    q.write_since = now;
+                    if q.reads_waiting != 0 {
+                        dev.counters.expired.fetch_add(1, Ordering::Relaxed);
+                    }
+                }
+                q.inflight += 1;
+                dev.counters
+                    .max_depth
+                    .fetch_max(q.inflight as u64, Ordering::Relaxed);
+                q.unlock();
+                return Self { index };
+            }
+            if !waiting {
+                waiting = true;
+                if is_read {
+                    q.reads_waiting += 1;
+                } else {
+                    if q.writes_waiting == 0 {
+                        q.write_since = now;
+                    }
+                    q.writes_waiting += 1;
+                }
+            }
+            // A waiting read implies a full queue, so a release always
+            // follows and wakes this thread up.
+            Current::park_with(move |handle| {
+                q.waiters.push(handle);
+                q.unlock();
+            });
+        }
+    }
+}
+
+impl Drop for Admission {
+    fn drop(&mut self) {
+        let mut q = DEVICES[self.index].queue.lock();
+        q.inflight -= 1;
+        let ths = core::mem::take(&mut q.waiters);
+        q.unlock();
+        ths.into_iter().for_each(ParkHandle::unpark);
+    }
+}
+
+/// A write queued in a plug list.
+struct PendingWrite {
+    index: usize,
+    sector: Sector,
+    data: Vec<u8>,
+}
+
+impl PendingWrite {
+    fn end(&self) -> usize {
+        self.sector.into_usize() + self.data.len() / 512
+    }
+
+    fn overlaps(&self, index: usize, sector: Sector, len: usize) -> bool {
+        self.index == index
+            && sector.into_usize() < self.end()
+            && self.sector.into_usize() < sector.into_usize() + len / 512
+    }
+}
+
+/// Plugged writes of a cpu.
+struct PlugList {
+    /// Thread that plugs the list.
+    owner: Option<u64>,
+    /// Nesting depth of the plugs of the owner.
+    depth: usize,
+    writes: Vec<PendingWrite>,
+    sectors: usize,
+    /// Flushed writes that the device has not completed yet.
+    inflight: Vec<Arc<[PendingWrite]>>,
+    /// A flush of the list failed since the owner plugged it.
+    failed: bool,
+}
+
+#[repr(align(64))]
+struct Plugs {
+    /// The list holds a queued or in-flight write. Lets the readers skip the
+    /// lock.
+    pending: AtomicBool,
+    list: SpinLock<PlugList>,
+}
+
+static PLUGS: [Plugs; MAX_CPU] = [const {
+    Plugs {
+        pending: AtomicBool::new(false),
+        list: SpinLock::new(PlugList {
+            owner: None,
+            depth: 0,
+            writes: Vec::new(),
+            sectors: 0,
+            inflight: Vec::new(),
+            failed: false,
+        }),
+    }
+}; MAX_CPU];
+
+/// A scope in which the writes of the current thread are queued and
+/// submitted together.
+///
+/// The writes are submitted when the outermost plug of the thread is
+/// released. Hooks of the [`Disk`] still see the writes in the order that
+/// they are issued, but the device may complete them in any order, so a plug
+/// must not span a point where the order matters, e.g., a journal commit.
+///
+/// If the cpu is plugged by another thread, or the thread has migrated to
+/// another cpu, the writes are submitted as usual.
+///
+/// [`Disk`]: crate::fs::Disk
+pub struct Plug {
+    cpu: Option<usize>,
+}
+
+impl Plug {
+    /// Start plugging the writes of the current thread.
+    pub fn new() -> Self {
+        if !BOOT_DONE.load(Ordering::SeqCst) {
+            return Self { cpu: None };
+        }
+        let tid = with_current(|th| th.tid);
+        let cpu = cpuid();
+        let mut list = PLUGS[cpu].list.lock();
+        let cpu = match list.owner {
+            None => {
+                list.owner = Some(tid);
+                list.depth = 1;
+                list.failed = false;
+                Some(cpu)
+            }
+            Some(owner) if owner == tid => {
+                list.depth += 1;
+                Some(cpu)
+            }
+            Some(_) => None,
+        };
+        list.unlock();
+        Self { cpu }
+    }
+
+    /// Release the plug, and report whether the plugged writes succeeded.
+    pub fn finish(self) -> Result<(), KernelError> {
+        let this = core::mem::ManuallyDrop::new(self);
+        this.release()
+    }
+
+    fn release(&self) -> Result<(), KernelError> {
+        let Some(cpu) = self.cpu else {
+            return Ok(());
+        };
+        let mut list = PLUGS[cpu].list.lock();
+        list.depth -= 1;
+        if list.depth != 0 {
+            list.unlock();
+            return Ok(());
+        }
+        list.owner = None;
+        let writes = take_writes(&mut list);
+        let failed = core::mem::replace(&mut list.failed, false);
+        list.unlock();
+        match (submit_writes(cpu, writes), failed) {
+            (Ok(()), false) => Ok(()),
+            _ => Err(KernelError::IOError),
+        }
+    }
+}
+
+impl Default for Plug {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl Drop for Plug {
+    fn drop(&mut self) {
+        let _ = self.release();
+    }
+}
+
+/// Take the writes of the list, sorted and merged, and keep them visible to
+/// the readers until [`submit_writes`] completes them.
+fn take_writes(list: &mut PlugList) -> Arc<[PendingWrite]> {
+    list.sectors = 0;
+    let mut writes = core::mem::take(&mut list.writes);
+    // The writes of a list never overlap, so their order does not matter.
+    writes.sort_unstable_by_key(|w| (w.index, w.sector.into_usize()));
+    let mut merged: Vec<PendingWrite> = Vec::with_capacity(writes.len());
+    for w in writes {
+        match merged.last_mut() {
+            Some(last) if last.index == w.index && last.end() == w.sector.into_usize() => {
+                last.data.extend_from_slice(&w.data)
+            }
+            _ => merged.push(w),
+        }
+    }
+    let merged: Arc<[PendingWrite]> = merged.into();
+    if !merged.is_empty() {
+        list.inflight.push(merged.clone());
+    }
+    merged
+}
+
+/// Submit the writes taken from the plug list of `cpu`.
+fn submit_writes(cpu: usize, writes: Arc<[PendingWrite]>) -> Result<(), KernelError> {
+    if writes.is_empty() {
+        return Ok(());
+    }
+    let mut result = Ok(());
+    for batch in writes.chunk_by(|a, b| a.index == b.index) {
+        let index = batch[0].index;
+        let Some(dev) = abyss::dev::get_bdev(index) else {
+            result = Err(KernelError::IOError);
+            continue;
+        };
+        let mut bios = batch.iter().map(|w| (w.sector, w.data.as_slice()));
+        if !dispatch_write(index, dev, &mut bios, batch.len()) {
+            result = Err(KernelError::IOError);
+        }
+    }
+    let plugs = &PLUGS[cpu];
+    let mut list = plugs.list.lock();
+    list.inflight.retain(|w| !Arc::ptr_eq(w, &writes));
+    if list.writes.is_empty() && list.inflight.is_empty() {
+        plugs.pending.store(false, Ordering::Release);
+    }
+    list.unlock();
+    result
+}
+
+fn dispatch_write(
+    index: usize,
+    dev: &dyn BlockOps,
+    bios: &mut dyn Iterator<Item = (Sector, &[u8])>,
+    nr_bios: usize,
+) -> bool {
+    let _admission = Admission::new(index, false);
+    DEVICES[index]
+        .counters
+        .write_bios
+        .fetch_add(nr_bios as u64, Ordering::Relaxed);
+    dev.write_vectored(bios)
+}
+
+/// Number of the runs of adjacent sectors in a batch.
+fn nr_runs(bios: impl Iterator<Item = (Sector, usize)>) -> usize {
+    let mut runs: Vec<(usize, usize)> = bios.map(|(s, len)| (s.into_usize(), len / 512)).collect();
+    runs.sort_unstable();
+    let mut n = 0;
+    let mut end = None;
+    for (start, len) in runs {
+        if end != Some(start) {
+            n += 1;
+        }
+        end = Some(start + len);
+    }
+    n
+}
+
+/// Flush the plug lists that hold a write overlapping the batch.
+fn flush_overlapping(index: usize, bios: &[(Sector, &mut [u8])]) -> Result<(), KernelError> {
+    for (cpu, plugs) in PLUGS.iter().enumerate() {
+        if !plugs.pending.load(Ordering::Acquire) {
+            continue;
+        }
+        let mut list = plugs.list.lock();
+        let hit = list
+            .writes
+            .iter()
+            .any(|w| bios.iter().any(|(s, b)| w.overlaps(index, *s, b.len())));
+        if !hit {
+            list.unlock();
+            continue;
+        }
+        let writes = take_writes(&mut list);
+        list.unlock();
+        if let Err(e) = submit_writes(cpu, writes) {
+            let mut list = plugs.list.lock();
+            list.failed = true;
+            list.unlock();
+            return Err(e);
+        }
+    }
+    Ok(())
+}
+
+/// Read a batch of sector runs from the device at slot `index`.
+pub(crate) fn read(
+    index: usize,
+    dev: &dyn BlockOps,
+    bios: &mut [(Sector, &mut [u8])],
+) -> Result<(), KernelError> {
+    flush_overlapping(index, bios)?;
+    let Some(device) = DEVICES.get(index) else {
+        return ok_or_io(dev.read_vectored(&mut bios.iter_mut().map(|(s, b)| (*s, &mut **b))));
+    };
+    let c = &device.counters;
+    c.reads.fetch_add(bios.len() as u64, Ordering::Relaxed);
+    c.read_bios.fetch_add(
+        nr_runs(bios.iter().map(|(s, b)| (*s, b.len()))) as u64,
+        Ordering::Relaxed,
+    );
+    let _admission = Admission::new(index, true);
+    ok_or_io(dev.read_vectored(&mut bios.iter_mut().map(|(s, b)| (*s, &mut **b))))?;
+    copy_inflight(index, bios);
+    Ok(())
+}
+
+/// Copy the data of the flushed writes that are still in flight into the
+/// batch.
+///
+/// The device may complete such a write after the read, so the read would
+/// see the data from before the write.
+fn copy_inflight(index: usize, bios: &mut [(Sector, &mut [u8])]) {
+    for plugs in PLUGS.iter() {
+        if !plugs.pending.load(Ordering::Acquire) {
+            continue;
+        }
+        let list = plugs.list.lock();
+        for w in list.inflight.iter().flat_map(|writes| writes.iter()) {
+            for (sector, buf) in bios.iter_mut() {
+                if !w.overlaps(index, *sector, buf.len()) {
+                    continue;
+                }
+                let start = sector.into_usize().max(w.sector.into_usize());
+                let end = (sector.into_usize() + buf.len() / 512).min(w.end());
+                let dst = (start - sector.into_usize()) * 512;
+                let src = (start - w.sector.into_usize()) * 512;
+                let len = (end - start) * 512;
+                buf[dst..dst + len].copy_from_slice(&w.data[src..src + len]);
+            }
+        }
+        list.unlock();
+    }
+}
+
+/// Write a batch of sector runs to the device at slot `index`, or queue it
+/// in the plug list of the current thread.
+pub(crate) fn write(
+    index: usize,
+    dev: &dyn BlockOps,
+    bios: &[(Sector, &[u8])],
+) -> Result<(), KernelError> {
+    let Some(device) = DEVICES.get(index) else {
+        return ok_or_io(dev.write_vectored(&mut bios.iter().copied()));
+    };
+    device
+        .counters
+        .writes
+        .fetch_add(bios.len() as u64, Ordering::Relaxed);
+    if BOOT_DONE.load(Ordering::SeqCst) && plug(index, bios)? {
+        return Ok(());
+    }
+    ok_or_io(dispatch_write(
+        index,
+        dev,
+        &mut bios.iter().copied(),
+        nr_runs(bios.iter().map(|(s, b)| (*s, b.len()))),
+    ))
+}
+
+/// Queue the writes in the plug list of the current cpu, if the current
+/// thread plugs it.
+fn plug(index: usize, bios: &[(Sector, &[u8])]) -> Result<bool, KernelError> {
+    let cpu = cpuid();
+    let plugs = &PLUGS[cpu];
+    let mut list = plugs.list.lock();
+    let Some(owner) = list.owner else {
+        list.unlock();
+        return Ok(false);
+    };
+    if owner != with_current(|th| th.tid) {
+        list.unlock();
+        return Ok(false);
+    }
+    for (sector, buf) in bios.iter() {
+        let (sector, buf) = (*sector, *buf);
+        if let Some(w) = list
+            .writes
+            .iter_mut()
+            .find(|w| w.overlaps(index, sector, buf.len()))
+        {
+            if sector.into_usize() >= w.sector.into_usize() {
+                let ofs = (sector.into_usize() - w.sector.into_usize()) * 512;
+                if ofs + buf.len() <= w.data.len() {
+                    // Overwrite the queued data in place.
+                    w.data[ofs..ofs + buf.len()].copy_from_slice(buf);
+                    continue;
+                }
+            }
+            // Keep the writes of the list disjoint.
+            let writes = take_writes(&mut list);
+            list.unlock();
+            let result = submit_writes(cpu, writes);
+            list = plugs.list.lock();
+            if result.is_err() {
+                list.failed = true;
+            }
+        }
+        match list.writes.last_mut() {
+            Some(last) if last.index == index && last.end() == sector.into_usize() => {
+                last.data.extend_from_slice(buf)
+            }
+            _ => list.writes.push(PendingWrite {
+                index,
+                sector,
+                data: buf.to_vec(),
+            }),
+        }
+        list.sectors += buf.len() / 512;
+    }
+    plugs.pending.store(true, Ordering::Release);
+    DEVICES[index]
+        .counters
+        .plugged
+        .fetch_add(bios.len() as u64, Ordering::Relaxed);
+    let result = if list.sectors > PLUG_MAX_SECTORS {
+        let writes = take_writes(&mut list);
+        list.unlock();
+        submit_writes(cpu, writes)
+    } else {
+        list.unlock();
+        Ok(())
+    };
+    result.map(|_| true)
+}
+
+fn ok_or_io(ok: bool) -> Result<(), KernelError> {
+    if ok {
+        Ok(())
+    } else {
+        Err(KernelError::IOError)
+    }
+}
+
+static WAITERS: SpinLock<Vec<ParkHandle>> = SpinLock::new(Vec::new());
+
+/// Wait until `done` returns true. Called by the block device driver.
+#[doc(hidden)]
+#[unsafe(no_mangle)]
+pub fn wait_for_io(done: &dyn Fn() -> bool) {
+    // There is no thread to park until the boot finishes.
+    if !BOOT_DONE.load(Ordering::SeqCst) {
+        while !done() {
+            core::hint::spin_loop();
+        }
+        return;
+    }
+    loop {
+        if done() {
+            return;
+        }
+        let mut waiters = WAITERS.lock();
+        // Re-check under the lock, so that the completion that follows the
+        // check finds this thread on the list.
+        if done() {
+            waiters.unlock();
+            return;
+        }
+        Current::park_with(move |handle| {
+            waiters.push(handle);
+            waiters.unlock();
+        });
+    }
+}
+
+/// Wake up the waiters on a completion interrupt.
+fn handler(_regs: &mut crate::syscall::Registers) {
+    let mut waiters = WAITERS.lock();
+    let ths = core::mem::take(&mut *waiters);
+    waiters.unlock();
+    ths.into_iter().for_each(ParkHandle::unpark);
+}
+
+/// Register the completion interrupt handler.
+pub(crate) fn init() {
+    crate::interrupt::register(IRQ_VECTOR as usize, handler);
+}
@@ -31,17 +31,228 @@ use crate::{
 };
 use alloc::{boxed::Box, vec::Vec};
 use core::{
+    cell::UnsafeCell,
     fmt,
-    sync::atomic::{AtomicUsize, Ordering},
+    mem::MaybeUninit,
+    sync::atomic::{AtomicUsize, Ordering, fence},
 };
-use crossbeam_queue::ArrayQueue;
+
+/// A slot of a [`Ring`].
+struct Slot<T> {
+    /// The position that may use the slot next. `pos` if the slot is free for
+    /// a push at `pos`, and `pos + 1` if it holds the value pushed at `pos`.
+    seq: AtomicUsize,
+    value: UnsafeCell<MaybeUninit<T>>,
+}
+
+/// An atomic on its own cache line.
+#[repr(align(64))]
+struct CachePadded<T>(T);
+
+/// A bounded lock-free multi-producer multi-consumer ring.
+///
+/// Each slot carries a sequence number that tells whether the slot is ready
+/// for the producer or the consumer of the current lap (Vyukov's bounded
+/// queue). A producer and a consumer only contend on the indices of their
+/// own side, and on a slot when the ring is nearly full or empty.
+pub(crate) struct Ring<T> {
+    /// Position of the next pop.
+    head: CachePadded<AtomicUsize>,
+    /// Position of the next push.
+    tail: CachePadded<AtomicUsize>,
+    slots: Box<[Slot<T>]>,
+}
+
+unsafe impl<T: Send> Send for Ring<T> {}
+unsafe impl<T: Send> Sync for Ring<T> {}
+
+impl<T> Ring<T> {
+    pub fn new(capacity: usize) -> Self {
+        assert!(capacity > 0, "capacity must be non-zero");
+        Self {
+            head: CachePadded(AtomicUsize::new(0)),
+            tail: CachePadded(AtomicUsize::new(0)),
+            slots: (0..capacity)
+                .map(|i| Slot {
+                    seq: AtomicUsize::new(i),
+                    value: UnsafeCell::new(MaybeUninit::uninit()),
+                })
+                .collect(),
+        }
+    }
+
+    #[inline]
+    pub fn capacity(&self) -> usize {
+        self.slots.len()
+    }
+
+    pub fn push(&self, value: T) -> Result<(), T> {
+        let mut pos = self.tail.0.load(Ordering::Relaxed);
+        loop {
+            let slot = &self.slots[pos % self.capacity()];
+            let seq = slot.seq.load(Ordering::Acquire);
+            match (seq as isize).wrapping_sub(pos as isize) {
+                0 => match self.tail.0.compare_exchange_weak(
+                    pos,
+                    pos.wrapping_add(1),
+                    Ordering::Relaxed,
+                    Ordering::Relaxed,
+                ) {
+                    Ok(_) => {
+                        unsafe { (*slot.value.get()).write(value) };
+                        slot.seq.store(pos.wrapping_add(1), Ordering::Release);
+                        return Ok(());
+                    }
+                    Err(cur) => pos = cur,
+                },
+                // The slot still holds the value of the previous lap.
+                diff if diff < 0 => return Err(value),
+                _ => pos = self.tail.0.load(Ordering::Relaxed),
+            }
+        }
+    }
+
+    pub fn pop(&self) -> Option<T> {
+        let mut pos = self.head.0.load(Ordering::Relaxed);
+        loop {
+            let slot = &self.slots[pos % self.capacity()];
+            let seq = slot.seq.load(Ordering::Acquire);
+            match (seq as isize).wrapping_sub(pos.wrapping_add(1) as isize) {
+                0 => match self.head.0.compare_exchange_weak(
+                    pos,
+                    pos.wrapping_add(1),
+                    Ordering::Relaxed,
+                    Ordering::Relaxed,
+                ) {
+                    Ok(_) => {
+                        let value = unsafe { (*slot.value.get()).assume_init_read() };
+                        slot.seq
+                            .store(pos.wrapping_add(self.capacity()), Ordering::Release);
+                        return Some(value);
+                    }
+                    Err(cur) => pos = cur,
+                },
+                // The slot is not filled yet.
+                diff if diff < 0 => return None,
+                _ => pos = self.head.0.load(Ordering::Relaxed),
+            }
+        }
+    }
+
+    /// Number of the values in the ring.
+    pub fn len(&self) -> usize {
+        loop {
+            let tail = self.tail.0.load(Ordering::SeqCst);
+            let head = self.head.0.load(Ordering::SeqCst);
+            if self.tail.0.load(Ordering::SeqCst) == tail {
+                return tail.wrapping_sub(head).min(self.capacity());
+            }
+        }
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+}
+
+impl<T> Drop for Ring<T> {
+    fn drop(&mut self) {
+        while self.pop().is_some() {}
+    }
+}
+
+/// Threads parked on one side of a channel.
+struct Waiters {
+    /// Number of the parked threads, including the ones about to park.
+    ///
+    /// The other side checks it after its operation, and takes the lock only
+    /// if there is a waiter.
+    nr: AtomicUsize,
+    list: SpinLock<Vec<ParkHandle>>,
+}
+
+impl Waiters {
+    const fn new() -> Self {
+        Self {
+            nr: AtomicUsize::new(0),
+            list: SpinLock::new(Vec::new()),
+        }
+    }
+
+    /// Park the current thread unless `ready` returns `Some`.
+    ///
+    /// `ready` is retried after announcing the waiter, so that a wake up
+    /// that follows the retry is never lost.
+    fn wait<R>(&self, ready: impl FnOnce() -> Option<R>) -> Option<R> {
+        let mut list = self.list.lock();
+        self.nr.fetch_add(1, Ordering::SeqCst);
+        if let Some(r) = ready() {
+            self.nr.fetch_sub(1, Ordering::Relaxed);
+            list.unlock();
+            return Some(r);
+        }
+        Current::park_with(move |handle| {
+            list.push(handle);
+            list.unlock();
+        });
+        None
+    }
+
+    /// Wake up a parked thread, if any.
+    #[inline]
+    fn wake_one(&self) {
+        // Pairs with the announcement of `wait`.
+        fence(Ordering::SeqCst);
+        if self.nr.load(Ordering::Relaxed) == 0 {
+            return;
+        }
+        let mut list = self.list.lock();
+        let th = list.pop();
+        if th.is_some() {
+            self.nr.fetch_sub(1, Ordering::Relaxed);
+        }
+        list.unlock();
+        if let Some(th) = th {
+            th.unpark();
+        }
+    }
+
+    /// Wake up to `n` parked threads.
+    fn wake_many(&self, n: usize) {
+        fence(Ordering::SeqCst);
+        if self.nr.load(Ordering::Relaxed) == 0 {
+            return;
+        }
+        let mut list = self.list.lock();
+        let at = list.len().saturating_sub(n);
+        let ths = list.split_off(at);
+        self.nr.fetch_sub(ths.len(), Ordering::Relaxed);
+        list.unlock();
+        ths.into_iter().for_each(ParkHandle::unpark);
+    }
+
+    /// Wake up all parked threads.
+    fn wake_all(&self) {
+        fence(Ordering::SeqCst);
+        if self.nr.load(Ordering::Relaxed) == 0 {
+            return;
+        }
+        let mut list = self.list.lock();
+        let ths = core::mem::take(&mut *list);
+        self.nr.fetch_sub(ths.len(), Ordering::Relaxed);
+        list.unlock();
+        ths.into_iter().for_each(ParkHandle::unpark);
+    }
+}
 
 pub(crate) struct ChannelInner<T> {
-    pub q: ArrayQueue<T>,
+    pub q: Ring<T>,
     pub tx_cnt: AtomicUsize,
     pub rx_cnt: AtomicUsize,
-    tx_waiter: SpinLock<Vec<ParkHandle>>,
-    rx_waiter: SpinLock<Vec<ParkHandle>>,
+    /// Number of the halves that are alive. The last half frees the channel.
+    halves: AtomicUsize,
+    tx_waiter: Waiters,
+    rx_waiter: Waiters,
 }
 
 impl<T> ChannelInner<T> {
@@ -60,36 +271,20 @@ impl<T> ChannelInner<T> {
         self.q.capacity()
     }
 
-    pub fn push(
-        &self,
-        value: T,
-        do_unpark: impl Fn(ParkHandle) -> Result<(), ()>,
-    ) -> Result<(), T> {
-        match self.q.push(value) {
-            Ok(_) => {
-                let mut guard = self.rx_waiter.lock();
-                if let Some(th) = guard.pop() {
-                    do_unpark(th).expect("Failed to unpark channel tx waiter.")
-                }
-                guard.unlock();
-                Ok(())
-            }
-            Err(e) => Err(e),
-        }
+    /// Push a value, and wake up a receiver if any.
+    #[inline]
+    pub fn push(&self, value: T) -> Result<(), T> {
+        self.q.push(value)?;
+        self.rx_waiter.wake_one();
+        Ok(())
     }
-    pub fn pop(&self, do_unpark: impl Fn(ParkHandle) -> Result<(), ()>) -> Option<T> {
-        match self.q.pop() {
-            Some(v) => {
-                let mut guard = self.tx_waiter.lock();
 
-                if let Some(th) = guard.pop() {
-                    do_unpark(th).expect("Failed to unpark channel rx waiter.")
-                }
-                guard.unlock();
-                Some(v)
-            }
-            None => None,
-        }
+    /// Pop a value, and wake up a sender if any.
+    #[inline]
+    pub fn pop(&self) -> Option<T> {
+        let v = self.q.pop()?;
+        self.tx_waiter.wake_one();
+        Some(v)
     }
 }
 
@@ -247,11 +442,12 @@ pub enum TryRecvError {
 /// [`recv`]: Receiver::recv
 pub fn channel<T: core::marker::Send + 'static>(bound: usize) -> (Sender<T>, Receiver<T>) {
     let chan = Box::into_raw(Box::new(ChannelInner {
-        q: ArrayQueue::new(bound),
+        q: Ring::new(bound),
         tx_cnt: AtomicUsize::new(1),
         rx_cnt: AtomicUsize::new(1),
-        tx_waiter: SpinLock::new(Vec::new()),
-        rx_waiter: SpinLock::new(Vec::new()),
+        halves: AtomicUsize::new(2),
+        tx_waiter: Waiters::new(),
+        rx_waiter: Waiters::new(),
     }));
     (Sender { inner: chan }, Receiver { inner: chan })
 }
@@ -294,33 +490,97 @@ impl<T: core::marker::Send + 'static> Sender<T> {
     /// information.
     pub fn send(&self, t: T) -> Result<(), SendError<T>> {
         let inner = self.inner();
-        let mut t_ = t;
+        let mut t = t;
         loop {
             if !inner.has_receiver() {
-                break Err(SendError(t_));
-            } else {
-                match inner.push(t_, |th| {
-                    th.unpark();
-                    Ok(())
-                }) {
+                break Err(SendError(t));
+            }
+            match inner.push(t) {
+                Ok(()) => break Ok(()),
+                Err(e) => t = e,
+            }
+            // The ring is full. Retry once more before parking.
+            let mut pending = Some(t);
+            let sent = inner.tx_waiter.wait(|| {
+                if !inner.has_receiver() {
+                    return Some(Err(()));
+                }
+                // Do not wake up the receivers here: it would take their
+                // waiter lock while holding ours.
+                match inner.q.push(pending.take().unwrap()) {
+                    Ok(()) => Some(Ok(())),
                     Err(e) => {
-                        t_ = e;
-                        if inner.q.is_full() {
-                            let mut guard = inner.tx_waiter.lock();
-                            if inner.q.is_full() {
-                                Current::park_with(move |th| {
-                                    guard.push(th);
-                                    drop(guard)
-                                });
-                            }
-                        }
+                        pending = Some(e);
+                        None
                     }
-                    _ => {
-                        break Ok(());
+                }
+            });
+            match sent {
+                Some(Ok(())) => {
+                    inner.rx_waiter.wake_one();
+                    break Ok(());
+                }
+                Some(Err(())) => break Err(SendError(pending.take().unwrap())),
+                None => t = pending.take().unwrap(),
+            }
+        }
+    }
+
+    /// Sends all values of `items` on this channel, blocking while the
+    /// buffer is full.
+    ///
+    /// Compared with calling [`send`] for each value, the receivers are woken
+    /// up once per batch that fills the buffer instead of once per value.
+    ///
+    /// Returns the number of the sent values. If the [`Receiver`] has
+    /// disconnected, returns the first value that could not be sent; the
+    /// remaining values are dropped with `items`.
+    ///
+    /// [`send`]: Self::send
+    pub fn send_many<I: IntoIterator<Item = T>>(&self, items: I) -> Result<usize, SendError<T>> {
+        let inner = self.inner();
+        let mut items = items.into_iter();
+        let mut pending = items.next();
+        let mut sent = 0;
+        while pending.is_some() {
+            if !inner.has_receiver() {
+                return Err(SendError(pending.take().unwrap()));
+            }
+            let batch = sent;
+            while let Some(t) = pending.take() {
+                if let Err(t) = inner.q.push(t) {
+                    pending = Some(t);
+                    break;
+                }
+                sent += 1;
+                pending = items.next();
+            }
+            if sent != batch {
+                inner.rx_waiter.wake_one();
+            }
+            if pending.is_none() {
+                break;
+            }
+            // The ring is full.
+            let pushed = inner.tx_waiter.wait(|| {
+                if !inner.has_receiver() {
+                    return Some(false);
+                }
+                match inner.q.push(pending.take().unwrap()) {
+                    Ok(()) => Some(true),
+                    Err(e) => {
+                        pending = Some(e);
+                        None
                     }
                 }
+            });
+            if pushed == Some(true) {
+                sent += 1;
+                pending = items.next();
+                inner.rx_waiter.wake_one();
             }
         }
+        Ok(sent)
     }
 
     /// Attempts to send a value on this channel without blocking.
@@ -339,13 +599,7 @@ impl<T: core::marker::Send + 'static> Sender<T> {
         if !inner.has_receiver() {
             Err(TrySendError::Disconnected(t))
         } else {
-            match inner.push(t, |th| {
-                th.unpark();
-                Ok(())
-            }) {
-                Err(t) => Err(TrySendError::Full(t)),
-                _ => Ok(()),
-            }
+            inner.push(t).map_err(TrySendError::Full)
         }
     }
 
@@ -367,10 +621,12 @@ impl<T: core::marker::Send + 'static> Clone for Sender<T> {
 impl<T: core::marker::Send + 'static> Drop for Sender<T> {
     fn drop(&mut self) {
         let inner = self.inner();
-        if inner.tx_cnt.fetch_sub(1, Ordering::AcqRel) == 1
-            && inner.rx_cnt.load(Ordering::Relaxed) == 0
-        {
-            unsafe { drop(Box::from_raw(self.inner)) }
+        if inner.tx_cnt.fetch_sub(1, Ordering::AcqRel) == 1 {
+            // Let the parked receivers see the disconnection.
+            inner.rx_waiter.wake_all();
+            if inner.halves.fetch_sub(1, Ordering::AcqRel) == 1 {
+                unsafe { drop(Box::from_raw(self.inner)) }
+            }
         }
     }
 }
@@ -419,37 +675,25 @@ impl<T: core::marker::Send + 'static> Receiver<T> {
     pub fn recv(&self) -> Result<T, RecvError> {
         let inner = self.inner();
         loop {
-            match inner.pop(|th| {
-                th.unpark();
-                Ok(())
-            }) {
-                Some(n) => break Ok(n),
-                None if !inner.has_sender() => {
-                    break inner
-                        .pop(|th| {
-                            th.unpark();
-                            Ok(())
-                        })
-                        .ok_or(RecvError);
-                }
-                None => {
-                    let mut guard = inner.rx_waiter.lock();
-                    match inner.pop(|th| {
-                        th.unpark();
-                        Ok(())
-                    }) {
-                        Some(n) => {
-                            guard.unlock();
-                            break Ok(n);
-                        }
-                        _ => {
-                            Current::park_with(|handle| {
-                                guard.push(handle);
-                                guard.unlock();
-                            });
-                        }
-                    }
+            if let Some(v) = inner.pop() {
+                break Ok(v);
+            }
+            if !inner.has_sender() {
+                // Values sent before the disconnection.
+                break inner.pop().ok_or(RecvError);
+            }
+            let received = inner.rx_waiter.wait(|| match inner.q.pop() {
+                Some(v) => Some(Ok(v)),
+                None if !inner.has_sender() => Some(inner.q.pop().ok_or(RecvError)),
+                None => None,
+            });
+            match received {
+                Some(Ok(v)) => {
+                    inner.tx_waiter.wake_one();
+                    break Ok(v);
                 }
+                Some(Err(e)) => break Err(e),
+                None => (),
             }
         }
     }
@@ -469,21 +713,65 @@ impl<T: core::marker::Send + 'static> Receiver<T> {
     /// [`recv`]: Self::recv
     pub fn try_recv(&self) -> Result<T, TryRecvError> {
         let inner = self.inner();
-        match inner.pop(|th| {
-            th.unpark();
-            Ok(())
-        }) {
+        match inner.pop() {
             Some(n) => Ok(n),
-            None if !inner.has_sender() => inner
-                .pop(|th| {
-                    th.unpark();
-                    Ok(())
-                })
-                .ok_or(TryRecvError::Disconnected),
+            None if !inner.has_sender() => inner.pop().ok_or(TryRecvError::Disconnected),
             None => Err(TryRecvError::Empty),
         }
     }
 
+    /// Receives up to `max` values into `buf`, blocking until at least one
+    /// value is available.
+    ///
+    /// Compared with calling [`recv`] for each value, the senders are woken
+    /// up once per batch instead of once per value, as many as the values
+    /// received.
+    ///
+    /// Returns the number of the received values, which is zero only if `max`
+    /// is zero. Like [`recv`], returns `Err` if the channel is empty and the
+    /// [`Sender`] has disconnected.
+    ///
+    /// [`recv`]: Self::recv
+    pub fn recv_many(&self, buf: &mut Vec<T>, max: usize) -> Result<usize, RecvError> {
+        let inner = self.inner();
+        let drain = |buf: &mut Vec<T>| {
+            let start = buf.len();
+            while buf.len() - start < max {
+                match inner.q.pop() {
+                    Some(v) => buf.push(v),
+                    None => break,
+                }
+            }
+            buf.len() - start
+        };
+        if max == 0 {
+            return Ok(0);
+        }
+        loop {
+            let cnt = match drain(buf) {
+                0 if !inner.has_sender() => match drain(buf) {
+                    0 => return Err(RecvError),
+                    n => Some(n),
+                },
+                0 => inner.rx_waiter.wait(|| match drain(buf) {
+                    0 if !inner.has_sender() => Some(drain(buf)),
+                    0 => None,
+                    n => Some(n),
+                }),
+                n => Some(n),
+            };
+            match cnt {
+                Some(0) => return Err(RecvError),
+                Some(n) => {
+                    // Each freed slot lets a blocked sender progress.
+                    inner.tx_waiter.wake_many(n);
+                    return Ok(n);
+                }
+                None => (),
+            }
+        }
+    }
+
     /// Returns an iterator that will block waiting for messages, but never
     /// panicked. It will return `None` when the channel has hung up.
     pub fn iter(&self) -> Iter<'_, T> {
@@ -557,10 +845,12 @@ impl<T: core::marker::Send + 'static> Clone for Receiver<T> {
 impl<T: core::marker::Send + 'static> Drop for Receiver<T> {
     fn drop(&mut self) {
         let inner = self.inner();
-        if inner.rx_cnt.fetch_sub(1, Ordering::AcqRel) == 1
-            && inner.tx_cnt.load(Ordering::Relaxed) == 0
-        {
-            unsafe { drop(Box::from_raw(self.inner)) }
+        if inner.rx_cnt.fetch_sub(1, Ordering::AcqRel) == 1 {
+            // Let the parked senders see the disconnection.
+            inner.tx_waiter.wake_all();
+            if inner.halves.fetch_sub(1, Ordering::AcqRel) == 1 {
+                unsafe { drop(Box::from_raw(self.inner)) }
+            }
         }
     }
 }
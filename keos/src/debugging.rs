@@ -63,6 +63,96 @@
 //!     plausible contents. In this case, use GDB to inspect the real memory
 //!     state during execution. Treat that as ground truth.
 //!
+//! ### Inspecting the memory allocators
+//! When the kernel runs out of memory, or the memory usage grows unexpectedly,
+//! print the statistics of the allocators with [`crate::mm::stats::dump`]:
+//!
+//! ```ignore
+//! keos::mm::stats::dump();
+//! ```
+//!
+//! It prints, for each size class of the slab allocator, the number of
+//! allocations and deallocations, how many times the class grew, and the bytes
+//! in use. For each physical memory arena, it prints the free pages and the
+//! largest run of free pages. A class whose bytes in use keep growing between
+//! two dumps is a good suspect of a memory leak. To check the numbers in the
+//! code, use [`crate::mm::stats::slab`] and [`crate::mm::stats::arenas`].
+//!
+//! ### Inspecting the scheduling latency
+//! To see how long threads wait on the runqueue and how long they run between
+//! context switches, print the histograms of each core with
+//! [`crate::thread::latency::dump`]. The histograms of a single thread are
+//! available from [`crate::thread::Thread::sched_stat`].
+//!
+//! ### Inspecting the lock contention
+//! Build the kernel with the `lockstat` feature of `keos` to record, for each
+//! source location that takes a [`SpinLock`] or an [`RwLock`], the number of
+//! acquisitions and contended acquisitions, and the cycles spent on waiting
+//! for and holding the lock. Print the worst offenders with
+//! `keos::sync::lockstat::dump`:
+//!
+//! ```ignore
+//! keos::sync::lockstat::dump(10);
+//! ```
+//!
+//! ### Inspecting the system calls
+//! Add `trace=syscall` to the arguments of the test runner to count the system
+//! calls of the run, and to print, at the end, the number of calls, errors,
+//! and the latency of each system call number, and the errors by kind:
+//!
+//! ```bash
+//! $ cargo run -- trace=syscall userprog::tar
+//! ```
+//!
+//! The tracing can also be turned on and off in the code with
+//! [`crate::syscall::trace::set_enabled`], and printed with
+//! [`crate::syscall::trace::dump`].
+//!
+//! ### Inspecting the interrupts
+//! Add `trace=irq` to the arguments of the test runner to print, at the end,
+//! the number of interrupts of each vector on each core, the mean and maximum
+//! cycles of their handlers, and the deepest nesting of the handlers on each
+//! core. It tells whether the timer ticks or the TLB shootdowns (vector 126)
+//! dominate a core:
+//!
+//! ```bash
+//! $ cargo run -- trace=irq userprog::tar
+//! ```
+//!
+//! The statistics are always collected; read them in the code with
+//! [`crate::interrupt::stat::stat`], or print them with
+//! [`crate::interrupt::stat::dump`].
+//!
+//! ### Profiling the kernel
+//! Add `profile` to the arguments of the test runner to sample the call stack
+//! of the interrupted code on every timer tick, or `profile=<n>` to sample on
+//! every `n`-th tick. At the end of the run, the samples are printed as folded
+//! stacks, which `flamegraph.pl` turns into a flame graph:
+//!
+//! ```bash
+//! $ cargo run -- profile userprog::tar | grep -E '^(kernel|user);' | flamegraph.pl > tar.svg
+//! ```
+//!
+//! The profiler can also be driven in the code with [`crate::profile::start`],
+//! [`crate::profile::stop`] and [`crate::profile::dump`].
+//!
+//! ### Inspecting the block I/O
+//! Print the counters of the block request layer with [`crate::block::dump`].
+//! For each disk, it prints the requests and the bios that reached the device
+//! after merging, the queue depth, and how many writes passed the waiting
+//! reads on their deadline. A merge ratio near 100% means that the file
+//! system issues scattered requests; wrap a burst of independent writes in a
+//! [`crate::block::Plug`] to sort and merge them.
+//!
+//! ### Inspecting the path walk
+//! Print the hits and misses of the dentry cache of the path walk with
+//! [`crate::fs::dcache::dump`]. A low hit ratio on a workload that opens the
+//! same paths again and again means that the file system does not opt in
+//! with [`crate::fs::traits::Directory::fs_id`].
+//!
+//! [`SpinLock`]: crate::sync::SpinLock
+//! [`RwLock`]: crate::sync::RwLock
+//!
 //! -----
 //!
 //! ## Debugging with GDB
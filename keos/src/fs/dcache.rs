@@ -0,0 +1,350 @@
+//! Dentry cache of the path walk.
+//!
+//! [`Directory::open`], [`Directory::create`] and [`Directory::unlink`]
+//! resolve a path one component at a time, and a deep path asks the file
+//! system for the same parents on every call. The dentry cache remembers the
+//! result of each component, keyed by the file system instance, the inode
+//! number of the parent directory and the name. A name that does not exist
+//! is cached as well (a negative entry), so that a failing lookup is also
+//! answered without the file system.
+//!
+//! Only the directories whose [`traits::Directory::fs_id`] is `Some` are
+//! cached.
+//!
+//! The table is a fixed array of small buckets, each an immutable array of
+//! entries published through a pointer. A lookup reads its bucket under
+//! [`rcu::read_lock`] and takes no lock. A writer copies the bucket, swaps
+//! in the copy, and retires the old one, which is freed in a batch after a
+//! grace period.
+//!
+//! Each bucket has a generation, bumped whenever a name of the bucket is
+//! created or unlinked. A lookup that misses reads the generation before
+//! asking the file system, and its result is cached only if the generation
+//! did not change in between, so a lookup racing with a change never caches
+//! a stale result. Unlinking a directory bumps a global generation that
+//! invalidates every entry, as its inode number may be reused by another
+//! directory. The entries are dropped at once, so that the unlinked
+//! directory is not kept alive by the cache.
+//!
+//! The cache keeps a directory alive, as the path walk opens the parents
+//! again and again, but not a regular file: its entry holds only a weak
+//! reference, which hits as long as the file is open elsewhere. A cached
+//! handle thus never keeps the inode of an unlinked file from being
+//! reclaimed.
+//!
+//! [`traits::Directory::fs_id`]: super::traits::Directory::fs_id
+use super::{Directory, File, InodeNumber, RegularFile, traits};
+use crate::{
+    KernelError,
+    sync::{SpinLock, rcu},
+};
+use abyss::interrupt::InterruptGuard;
+use alloc::{
+    boxed::Box,
+    string::String,
+    sync::{Arc, Weak},
+    vec::Vec,
+};
+use core::sync::atomic::{AtomicPtr, AtomicU64, Ordering};
+
+/// Number of the buckets of the table.
+const NR_BUCKETS: usize = 256;
+
+/// Number of the entries of a bucket.
+const BUCKET_WAYS: usize = 4;
+
+/// Number of the retired buckets that triggers a grace period.
+const RECLAIM_BATCH: usize = 64;
+
+/// The file that a cached name refers to.
+#[derive(Clone)]
+enum Target {
+    Directory(Directory),
+    RegularFile(Weak<dyn traits::RegularFile>),
+}
+
+impl Target {
+    fn new(file: &File) -> Self {
+        match file {
+            File::Directory(dir) => Target::Directory(dir.clone()),
+            File::RegularFile(file) => Target::RegularFile(Arc::downgrade(&file.0)),
+        }
+    }
+}
+
+/// A cached result of a component of the path walk.
+#[derive(Clone)]
+struct Dentry {
+    fs: u64,
+    parent: InodeNumber,
+    name: String,
+    /// The opened file, or `None` if the name does not exist.
+    target: Option<Target>,
+    /// Generation of the bucket when the entry is filled.
+    generation: u64,
+    /// Value of [`DIR_GEN`] when the entry is filled.
+    dir_gen: u64,
+}
+
+impl Dentry {
+    fn is(&self, fs: u64, parent: InodeNumber, name: &str) -> bool {
+        self.fs == fs && self.parent == parent && self.name == name
+    }
+}
+
+type Bucket = Vec<Dentry>;
+
+static BUCKETS: [AtomicPtr<Bucket>; NR_BUCKETS] =
+    [const { AtomicPtr::new(core::ptr::null_mut()) }; NR_BUCKETS];
+static GENS: [AtomicU64; NR_BUCKETS] = [const { AtomicU64::new(0) }; NR_BUCKETS];
+static DIR_GEN: AtomicU64 = AtomicU64::new(0);
+
+/// Addresses of the buckets that are replaced but may still be read.
+///
+/// The lock also serializes the writers of the table.
+static RETIRED: SpinLock<Vec<usize>> = SpinLock::new(Vec::new());
+
+static HITS: AtomicU64 = AtomicU64::new(0);
+static NEGATIVE_HITS: AtomicU64 = AtomicU64::new(0);
+static MISSES: AtomicU64 = AtomicU64::new(0);
+
+/// Counters of the dentry cache.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct DcacheStat {
+    /// Lookups answered with a file.
+    pub hits: u64,
+    /// Lookups answered with [`KernelError::NoSuchEntry`].
+    pub negative_hits: u64,
+    /// Lookups that asked the file system.
+    pub misses: u64,
+}
+
+/// Returns the counters of the dentry cache.
+pub fn stat() -> DcacheStat {
+    DcacheStat {
+        hits: HITS.load(Ordering::Relaxed),
+        negative_hits: NEGATIVE_HITS.load(Ordering::Relaxed),
+        misses: MISSES.load(Ordering::Relaxed),
+    }
+}
+
+/// Prints the counters of the dentry cache.
+pub fn dump() {
+    let s = stat();
+    let total = (s.hits + s.negative_hits + s.misses).max(1);
+    println!(
+        "dcache: {} hits, {} negative hits, {} misses ({}% hit)",
+        s.hits,
+        s.negative_hits,
+        s.misses,
+        (s.hits + s.negative_hits) * 100 / total
+    );
+}
+
+/// Hashes a key with FNV-1a.
+fn bucket_of(fs: u64, parent: InodeNumber, name: &str) -> usize {
+    fs.to_le_bytes()
+        .into_iter()
+        .chain(parent.into_u32().to_le_bytes())
+        .chain(name.bytes())
+        .fold(0xcbf2_9ce4_8422_2325u64, |h, b| {
+            (h ^ b as u64).wrapping_mul(0x0100_0000_01b3)
+        }) as usize
+        % NR_BUCKETS
+}
+
+/// Generations that an entry of bucket `b` must match.
+fn generations(b: usize) -> (u64, u64) {
+    (
+        GENS[b].load(Ordering::Acquire),
+        DIR_GEN.load(Ordering::Acquire),
+    )
+}
+
+/// Looks up a key, returning `None` on a miss.
+fn find(b: usize, fs: u64, parent: InodeNumber, name: &str) -> Option<Option<File>> {
+    let _guard = rcu::read_lock();
+    let (generation, dir_gen) = generations(b);
+    let bucket = unsafe { BUCKETS[b].load(Ordering::Acquire).as_ref() }?;
+    let d = bucket
+        .iter()
+        .find(|d| d.is(fs, parent, name) && d.generation == generation && d.dir_gen == dir_gen)?;
+    match &d.target {
+        // A directory that is removed behind the cache is not reused.
+        Some(Target::Directory(dir)) if dir.removed().map_or(true, |r| r.load()) => None,
+        Some(Target::Directory(dir)) => Some(Some(File::Directory(dir.clone()))),
+        Some(Target::RegularFile(file)) => {
+            Some(Some(File::RegularFile(RegularFile(file.upgrade()?))))
+        }
+        None => Some(None),
+    }
+}
+
+/// Replaces the entries of bucket `b` for the key with `entry`, or only
+/// removes them if `entry` is `None`.
+///
+/// Returns the removed entry, if any.
+fn update(
+    b: usize,
+    fs: u64,
+    parent: InodeNumber,
+    name: &str,
+    entry: Option<Dentry>,
+) -> Option<Dentry> {
+    let mut retired = RETIRED.lock();
+    let old = BUCKETS[b].load(Ordering::Acquire);
+    let (generation, dir_gen) = generations(b);
+    let (mut bucket, mut removed) = (Vec::with_capacity(BUCKET_WAYS), None);
+    for d in unsafe { old.as_ref() }.into_iter().flatten() {
+        if d.is(fs, parent, name) {
+            removed = Some(d.clone());
+        } else if d.generation == generation && d.dir_gen == dir_gen {
+            bucket.push(d.clone());
+        }
+    }
+    if removed.is_none() && entry.is_none() {
+        retired.unlock();
+        return None;
+    }
+    if let Some(entry) = entry {
+        // Evict the oldest entry.
+        if bucket.len() == BUCKET_WAYS {
+            bucket.remove(0);
+        }
+        bucket.push(entry);
+    }
+    BUCKETS[b].store(Box::into_raw(Box::new(bucket)), Ordering::Release);
+    if !old.is_null() {
+        retired.push(old as usize);
+    }
+    retired.unlock();
+    removed
+}
+
+/// Drops every entry of the table.
+fn purge() {
+    let mut retired = RETIRED.lock();
+    for bucket in BUCKETS.iter() {
+        let old = bucket.swap(core::ptr::null_mut(), Ordering::AcqRel);
+        if !old.is_null() {
+            retired.push(old as usize);
+        }
+    }
+    retired.unlock();
+}
+
+/// Frees the retired buckets after a grace period, if there are at least
+/// [`RECLAIM_BATCH`] of them or `force` is set.
+///
+/// Skipped if the interrupts are disabled, as a grace period can not be
+/// waited for.
+fn reclaim(force: bool) {
+    if InterruptGuard::is_guarded() {
+        return;
+    }
+    let mut retired = RETIRED.lock();
+    if retired.is_empty() || (!force && retired.len() < RECLAIM_BATCH) {
+        retired.unlock();
+        return;
+    }
+    let batch = core::mem::take(&mut *retired);
+    retired.unlock();
+    rcu::synchronize();
+    for old in batch {
+        drop(unsafe { Box::from_raw(old as *mut Bucket) });
+    }
+}
+
+/// Opens `name` in `dir` through the cache.
+pub(super) fn open_entry(dir: &Directory, name: &str) -> Result<File, KernelError> {
+    let Some(fs) = dir.0.fs_id() else {
+        return dir.0.open_entry(name);
+    };
+    let parent = dir.ino();
+    let b = bucket_of(fs, parent, name);
+    match find(b, fs, parent, name) {
+        Some(Some(file)) => {
+            HITS.fetch_add(1, Ordering::Relaxed);
+            return Ok(file);
+        }
+        Some(None) => {
+            NEGATIVE_HITS.fetch_add(1, Ordering::Relaxed);
+            return Err(KernelError::NoSuchEntry);
+        }
+        None => MISSES.fetch_add(1, Ordering::Relaxed),
+    };
+
+    let (generation, dir_gen) = generations(b);
+    let result = dir.0.open_entry(name);
+    let target = match &result {
+        Ok(file) => Some(Target::new(file)),
+        Err(KernelError::NoSuchEntry) => None,
+        Err(_) => return result,
+    };
+    if generations(b) == (generation, dir_gen) {
+        let entry = Dentry {
+            fs,
+            parent,
+            name: String::from(name),
+            target,
+            generation,
+            dir_gen,
+        };
+        update(b, fs, parent, name, Some(entry));
+        reclaim(false);
+    }
+    result
+}
+
+/// Creates `name` in `dir`, and caches the created file.
+pub(super) fn create_entry(dir: &Directory, name: &str, is_dir: bool) -> Result<File, KernelError> {
+    let Some(fs) = dir.0.fs_id() else {
+        return dir.0.create_entry(name, is_dir);
+    };
+    let parent = dir.ino();
+    let b = bucket_of(fs, parent, name);
+    let result = dir.0.create_entry(name, is_dir);
+    // Even a failed creation may have changed the directory.
+    let generation = GENS[b].fetch_add(1, Ordering::AcqRel) + 1;
+    let entry = result.as_ref().ok().map(|file| Dentry {
+        fs,
+        parent,
+        name: String::from(name),
+        target: Some(Target::new(file)),
+        generation,
+        dir_gen: DIR_GEN.load(Ordering::Acquire),
+    });
+    update(b, fs, parent, name, entry);
+    reclaim(false);
+    result
+}
+
+/// Unlinks `name` in `dir`, and drops its entry.
+pub(super) fn unlink_entry(dir: &Directory, name: &str) -> Result<(), KernelError> {
+    let Some(fs) = dir.0.fs_id() else {
+        return dir.0.unlink_entry(name);
+    };
+    let parent = dir.ino();
+    let b = bucket_of(fs, parent, name);
+    let result = dir.0.unlink_entry(name);
+    GENS[b].fetch_add(1, Ordering::AcqRel);
+    let removed = update(b, fs, parent, name, None);
+    if result.is_ok() {
+        // Unless the entry is known to be a regular file, it may be a
+        // directory whose inode number gets reused.
+        if !matches!(
+            removed,
+            Some(Dentry {
+                target: Some(Target::RegularFile(_)),
+                ..
+            })
+        ) {
+            DIR_GEN.fetch_add(1, Ordering::AcqRel);
+            purge();
+        }
+    }
+    drop(removed);
+    // Release the handle of the unlinked file promptly.
+    reclaim(true);
+    result
+}
@@ -0,0 +1,196 @@
+//! Cache of the headers of the recently launched executables.
+//!
+//! Loading a program starts by reading the first block of its file, which
+//! holds the ELF header and the program headers, and launching the same
+//! program again reads the same block. [`open`] wraps an executable into a
+//! [`RegularFile`] that serves the first block from this cache, so that a
+//! program launched again does not ask the file system for it.
+//!
+//! The cache keeps the first blocks of the [`EXEC_CACHE_SIZE`] most recently
+//! launched executables, and evicts the least recently launched one. An entry
+//! is used only while [`RegularFile::write_generation`] and the size of the
+//! file stay the same. A file without [`RegularFile::fs_id`] is never cached,
+//! as its inode number may name a file of another file system.
+//!
+//! The segments themselves are read by the loader through the returned
+//! handle as usual.
+use super::{FileBlockNumber, InodeNumber, RegularFile, traits};
+use crate::{
+    KernelError,
+    mm::Page,
+    sync::{SpinLock, atomic::AtomicBool},
+};
+use alloc::{boxed::Box, collections::VecDeque, sync::Arc};
+use core::sync::atomic::{AtomicU64, Ordering};
+
+/// Number of the executables whose first blocks are cached.
+pub const EXEC_CACHE_SIZE: usize = 16;
+
+/// The first block of an executable.
+struct Entry {
+    generation: u64,
+    size: usize,
+    head: Arc<([u8; 4096], bool)>,
+}
+
+/// The entries, from the most recently launched one.
+static CACHE: SpinLock<VecDeque<((u64, InodeNumber), Entry)>> = SpinLock::new(VecDeque::new());
+static HITS: AtomicU64 = AtomicU64::new(0);
+static MISSES: AtomicU64 = AtomicU64::new(0);
+
+/// Open `file` to load it as an executable.
+///
+/// Returns a handle to the same file, whose first block is served from the
+/// cache.
+pub fn open(file: RegularFile) -> RegularFile {
+    let Some(fs_id) = file.fs_id() else {
+        return file;
+    };
+    let key = (fs_id, file.ino());
+    let (generation, size) = (file.write_generation(), file.size());
+
+    let mut guard = CACHE.lock();
+    let hit = guard
+        .iter()
+        .position(|(k, _)| *k == key)
+        .and_then(|i| guard.remove(i))
+        .filter(|(_, e)| e.generation == generation && e.size == size);
+    let head = if let Some((key, entry)) = hit {
+        let head = entry.head.clone();
+        guard.push_front((key, entry));
+        guard.unlock();
+        HITS.fetch_add(1, Ordering::Relaxed);
+        head
+    } else {
+        guard.unlock();
+        MISSES.fetch_add(1, Ordering::Relaxed);
+        let mut block = Box::new([0; 4096]);
+        let Ok(ok) = file.0.read(FileBlockNumber(0), &mut block) else {
+            return file;
+        };
+        let head = Arc::new((*block, ok));
+        let mut guard = CACHE.lock();
+        // The file may be written during the read.
+        if file.write_generation() == generation {
+            guard.push_front((
+                key,
+                Entry {
+                    generation,
+                    size,
+                    head: head.clone(),
+                },
+            ));
+            guard.truncate(EXEC_CACHE_SIZE);
+        }
+        guard.unlock();
+        head
+    };
+    RegularFile::new(Executable {
+        file,
+        head,
+        stale: AtomicBool::new(false),
+    })
+}
+
+/// Counters of the executable cache.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct ExecCacheStat {
+    /// Launches that found the first block in the cache.
+    pub hits: u64,
+    /// Launches that read the first block from the file.
+    pub misses: u64,
+}
+
+/// Returns the counters of the executable cache.
+pub fn stat() -> ExecCacheStat {
+    ExecCacheStat {
+        hits: HITS.load(Ordering::Relaxed),
+        misses: MISSES.load(Ordering::Relaxed),
+    }
+}
+
+/// An executable opened by [`open`].
+struct Executable {
+    file: RegularFile,
+    head: Arc<([u8; 4096], bool)>,
+    /// Whether the first block is written through this handle.
+    stale: AtomicBool,
+}
+
+impl Executable {
+    /// The cached first block, unless it is written since.
+    fn head(&self, fba: FileBlockNumber) -> Option<&([u8; 4096], bool)> {
+        (fba.0 == 0 && !self.stale.load()).then_some(&*self.head)
+    }
+}
+
+impl traits::RegularFile for Executable {
+    fn ino(&self) -> InodeNumber {
+        self.file.0.ino()
+    }
+
+    fn size(&self) -> usize {
+        self.file.0.size()
+    }
+
+    fn read(&self, fba: FileBlockNumber, buf: &mut [u8; 4096]) -> Result<bool, KernelError> {
+        match self.head(fba) {
+            Some((block, ok)) => {
+                buf.copy_from_slice(block);
+                Ok(*ok)
+            }
+            None => self.file.0.read(fba, buf),
+        }
+    }
+
+    fn write(
+        &self,
+        fba: FileBlockNumber,
+        buf: &[u8; 4096],
+        min_size: usize,
+    ) -> Result<(), KernelError> {
+        if fba.0 == 0 {
+            self.stale.store(true);
+        }
+        self.file.0.write(fba, buf, min_size)
+    }
+
+    fn read_blocks(&self, fba: FileBlockNumber, buf: &mut [u8]) -> Result<(), KernelError> {
+        match self.head(fba) {
+            Some((block, _)) => {
+                let (first, rest) = buf.split_at_mut(4096);
+                first.copy_from_slice(block);
+                if rest.is_empty() {
+                    Ok(())
+                } else {
+                    self.file.0.read_blocks(fba + 1, rest)
+                }
+            }
+            None => self.file.0.read_blocks(fba, buf),
+        }
+    }
+
+    fn write_blocks(
+        &self,
+        fba: FileBlockNumber,
+        buf: &[u8],
+        min_size: usize,
+    ) -> Result<(), KernelError> {
+        if fba.0 == 0 {
+            self.stale.store(true);
+        }
+        self.file.0.write_blocks(fba, buf, min_size)
+    }
+
+    fn mmap(&self, fba: FileBlockNumber) -> Result<Page, KernelError> {
+        self.file.0.mmap(fba)
+    }
+
+    fn writeback(&self) -> Result<(), KernelError> {
+        self.file.0.writeback()
+    }
+
+    fn fs_id(&self) -> Option<u64> {
+        self.file.0.fs_id()
+    }
+}
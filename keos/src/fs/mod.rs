@@ -1,5 +1,8 @@
 //! Filesystem abstraction.
 
+pub mod dcache;
+pub mod exec_cache;
+
 /// Defines traits for file system operations.
 pub mod traits {
     use alloc::{string::String, vec::Vec};
@@ -79,6 +82,44 @@ pub mod traits {
             min_size: usize,
         ) -> Result<(), KernelError>;
 
+        /// Reads consecutive file blocks starting at `fba` into `buf`.
+        ///
+        /// `buf` holds a whole number of blocks. A file system that can serve
+        /// several blocks at once, e.g., with a single multi-sector request,
+        /// overrides this method; the default reads the blocks one by one.
+        ///
+        /// # Returns
+        /// - `Ok(())` if the read is successful.
+        /// - `Err(KernelError)` if any of the reads fails.
+        fn read_blocks(&self, fba: FileBlockNumber, buf: &mut [u8]) -> Result<(), KernelError> {
+            for (i, block) in buf.as_chunks_mut::<4096>().0.iter_mut().enumerate() {
+                self.read(fba + i, block)?;
+            }
+            Ok(())
+        }
+
+        /// Writes consecutive file blocks starting at `fba` from `buf`.
+        ///
+        /// `buf` holds a whole number of blocks, and `min_size` has the same
+        /// meaning as in [`RegularFile::write`]. The default writes the blocks
+        /// one by one.
+        ///
+        /// # Returns
+        /// - `Ok(())` if the write is successful.
+        /// - `Err(KernelError)` if any of the writes fails.
+        fn write_blocks(
+            &self,
+            fba: FileBlockNumber,
+            buf: &[u8],
+            min_size: usize,
+        ) -> Result<(), KernelError> {
+            let start = fba.0 * 4096;
+            for (i, block) in buf.as_chunks::<4096>().0.iter().enumerate() {
+                self.write(fba + i, block, min_size.min(start + (i + 1) * 4096))?;
+            }
+            Ok(())
+        }
+
         /// Maps a file block into memory.
         ///
         /// This method retrieves the contents of the file at the specified file
@@ -106,6 +147,17 @@ pub mod traits {
 
         /// Write back the file to disk.
         fn writeback(&self) -> Result<(), KernelError>;
+
+        /// Returns the identifier of the file system instance of the file.
+        ///
+        /// Together with [`RegularFile::ino`], the identifier names the file
+        /// uniquely, e.g., for a cache of the parsed contents of the file. It
+        /// must not be shared with any other instance. Returns `None` by
+        /// default, in which case the file cannot be named apart from the
+        /// files of the other instances.
+        fn fs_id(&self) -> Option<u64> {
+            None
+        }
     }
 
     /// Trait representing a directory in the filesystem.
@@ -176,13 +228,34 @@ pub mod traits {
         /// - `Ok(())`: If the directory was successfully read.
         /// - `Err(Error)`: An error if the operation fails.
         fn removed(&self) -> Result<&AtomicBool, KernelError>;
+
+        /// Returns the identifier of the file system instance of the
+        /// directory, if the path walk may cache its entries.
+        ///
+        /// The identifier must not be shared with any other instance, and
+        /// every entry created or unlinked in the directory must go through
+        /// [`super::Directory::create`] or [`super::Directory::unlink`] so
+        /// that the cache stays coherent. Returns `None` by default, which
+        /// disables the cache for the directory.
+        fn fs_id(&self) -> Option<u64> {
+            None
+        }
     }
 }
 
-use crate::{KernelError, mm::Page, sync::atomic::AtomicBool};
+use crate::{
+    KernelError,
+    mm::Page,
+    sync::atomic::AtomicBool,
+    syscall::uaccess::{UserPages, UserU8SliceRO, UserU8SliceWO},
+};
 pub use abyss::dev::{BlockOps, Sector};
 use alloc::{boxed::Box, string::String, sync::Arc, vec::Vec};
-use core::{iter::Step, num::NonZeroU32};
+use core::{
+    iter::Step,
+    num::NonZeroU32,
+    sync::atomic::{AtomicU64, Ordering},
+};
 
 /// A global file system abstraction.
 ///
@@ -221,6 +294,40 @@ impl FileSystem {
     }
 }
 
+/// Allocate an identifier of a file system instance, which is never
+/// returned again.
+///
+/// See [`traits::Directory::fs_id`].
+pub fn new_fs_id() -> u64 {
+    static NEXT_FS_ID: AtomicU64 = AtomicU64::new(1);
+    NEXT_FS_ID.fetch_add(1, Ordering::Relaxed)
+}
+
+/// Number of the counters of [`RegularFile::write_generation`].
+const NR_WRITE_GENS: usize = 256;
+
+static WRITE_GENS: [AtomicU64; NR_WRITE_GENS] = [const { AtomicU64::new(0) }; NR_WRITE_GENS];
+
+/// The counter of [`RegularFile::write_generation`] of an inode of a file
+/// system instance.
+fn write_gen(fs_id: Option<u64>, ino: InodeNumber) -> &'static AtomicU64 {
+    let key = fs_id
+        .unwrap_or(0)
+        .wrapping_mul(0x9E37_79B9_7F4A_7C15)
+        .wrapping_add(ino.into_u32() as u64);
+    &WRITE_GENS[key as usize % NR_WRITE_GENS]
+}
+
+/// Bumps the write generation of an inode when dropped, i.e., after the
+/// write, even if it fails halfway.
+struct WriteGenBump(&'static AtomicU64);
+
+impl Drop for WriteGenBump {
+    fn drop(&mut self) {
+        self.0.fetch_add(1, Ordering::Release);
+    }
+}
+
 /// A handle to a regular file.
 ///
 /// This struct provides a reference-counted handle to a file that supports
@@ -234,6 +341,24 @@ impl RegularFile {
         self.0.ino()
     }
 
+    /// Identifier of the file system instance of the file, if any.
+    ///
+    /// See [`traits::RegularFile::fs_id`].
+    pub fn fs_id(&self) -> Option<u64> {
+        self.0.fs_id()
+    }
+
+    /// Returns a counter that changes after every write to this file through
+    /// [`RegularFile::write`].
+    ///
+    /// A cache of the parsed contents of a file is valid as long as the
+    /// counter does not change. The counter is shared by several inodes, so it
+    /// may also change without a write to this file. Writes through a shared
+    /// mapping are not counted.
+    pub fn write_generation(&self) -> u64 {
+        write_gen(self.fs_id(), self.ino()).load(Ordering::Acquire)
+    }
+
     /// Creates a new [`RegularFile`] handle from a given implementation of
     /// [`traits::RegularFile`].
     ///
@@ -267,34 +392,43 @@ impl RegularFile {
     /// - `Ok(usize)`: The number of bytes read.
     /// - `Err(Error)`: An error if the read operation fails.
     #[inline]
-    pub fn read(&self, mut position: usize, buf: &mut [u8]) -> Result<usize, KernelError> {
-        let mut bounce_buffer = alloc::boxed::Box::new([0; 4096]);
+    pub fn read(&self, position: usize, buf: &mut [u8]) -> Result<usize, KernelError> {
         let max_read = self
             .size()
             .min(position + buf.len())
             .saturating_sub(position);
-        let mut read_bytes = 0;
-        let first_segment = position & 0xfff;
-        if first_segment != 0 {
-            self.0.read(
-                FileBlockNumber::from_offset(position & !0xfff),
-                &mut bounce_buffer,
-            )?;
-            read_bytes += (0x1000 - first_segment).min(max_read);
-            buf[..read_bytes]
-                .copy_from_slice(&bounce_buffer[first_segment..first_segment + read_bytes]);
-            position += read_bytes;
-        }
+        let buf = &mut buf[..max_read];
+        let end = position + max_read;
+        // Bytes before the first block boundary, and after the last one.
+        let head = ((0x1000 - (position & 0xfff)) & 0xfff).min(max_read);
+        let tail = if position + head == end {
+            0
+        } else {
+            end & 0xfff
+        };
+        let (head_buf, rest) = buf.split_at_mut(head);
+        let (body, tail_buf) = rest.split_at_mut(rest.len() - tail);
 
-        for i in (read_bytes..max_read).step_by(0x1000) {
+        let mut bounce_buffer = None;
+        if head != 0 {
+            let bounce = bounce_buffer.get_or_insert_with(|| Box::new([0; 4096]));
+            self.0
+                .read(FileBlockNumber::from_offset(position & !0xfff), bounce)?;
+            let ofs = position & 0xfff;
+            head_buf.copy_from_slice(&bounce[ofs..ofs + head]);
+        }
+        if !body.is_empty() {
+            // Full blocks go straight into the caller's buffer.
+            self.0
+                .read_blocks(FileBlockNumber::from_offset(position + head), body)?;
+        }
+        if tail != 0 {
+            let bounce = bounce_buffer.get_or_insert_with(|| Box::new([0; 4096]));
             self.0
-                .read(FileBlockNumber::from_offset(position), &mut bounce_buffer)?;
-            let remainder = (max_read - i).min(0x1000);
-            buf[i..i + remainder].copy_from_slice(&bounce_buffer[..remainder]);
-            position += remainder;
-            read_bytes += remainder;
+                .read(FileBlockNumber::from_offset(end & !0xfff), bounce)?;
+            tail_buf.copy_from_slice(&bounce[..tail]);
         }
-        Ok(read_bytes)
+        Ok(max_read)
     }
 
     /// Writes data from the buffer into the file.
@@ -310,64 +444,212 @@ impl RegularFile {
     /// - `Ok(usize)`: The number of bytes written.
     /// - `Err(Error)`: An error if the write operation fails.
     #[inline]
-    pub fn write(&self, mut position: usize, buf: &[u8]) -> Result<usize, KernelError> {
-        let mut bounce_buffer = alloc::boxed::Box::new([0; 4096]);
-        let mut write_bytes = 0;
-        let first_segment = position & 0xfff;
-        if first_segment != 0 {
-            let r = self.0.read(
-                FileBlockNumber::from_offset(position & !0xfff),
-                &mut bounce_buffer,
-            );
+    pub fn write(&self, position: usize, buf: &[u8]) -> Result<usize, KernelError> {
+        let _bump = WriteGenBump(write_gen(self.fs_id(), self.ino()));
+        let end = position + buf.len();
+        let head = ((0x1000 - (position & 0xfff)) & 0xfff).min(buf.len());
+        let tail = if position + head == end {
+            0
+        } else {
+            end & 0xfff
+        };
+        let (head_buf, rest) = buf.split_at(head);
+        let (body, tail_buf) = rest.split_at(rest.len() - tail);
+
+        // Read-modify-write a partial block through the bounce buffer.
+        let mut bounce_buffer = None;
+        let mut partial = |fba: FileBlockNumber, ofs: usize, data: &[u8], min_size: usize| {
+            let bounce = bounce_buffer.get_or_insert_with(|| Box::new([0; 4096]));
+            let r = self.0.read(fba, bounce);
             if matches!(
                 r,
                 Err(KernelError::IOError) | Err(KernelError::FilesystemCorrupted(_))
             ) {
-                return r.map(|_| 0);
+                return r.map(|_| ());
+            } else if r.is_err() {
+                // The block is past the end of the file.
+                bounce.fill(0);
             }
-            write_bytes += (0x1000 - first_segment).min(buf.len());
-            bounce_buffer[first_segment..first_segment + write_bytes]
-                .copy_from_slice(&buf[..write_bytes]);
-            self.0.write(
+            bounce[ofs..ofs + data.len()].copy_from_slice(data);
+            self.0.write(fba, bounce, min_size)
+        };
+
+        let mut write_bytes = 0;
+        if head != 0 {
+            partial(
                 FileBlockNumber::from_offset(position & !0xfff),
-                &bounce_buffer,
-                position + write_bytes,
+                position & 0xfff,
+                head_buf,
+                position + head,
             )?;
-            position += write_bytes;
+            write_bytes += head;
         }
-        for i in (write_bytes..buf.len()).step_by(0x1000) {
-            if buf.len() - i < 0x1000 {
-                break;
-            }
-            self.0.write(
-                FileBlockNumber::from_offset(position),
-                buf[i..i + 0x1000].as_array().unwrap(),
-                position + 0x1000,
+        if !body.is_empty() {
+            // Full blocks go straight from the caller's buffer.
+            self.0.write_blocks(
+                FileBlockNumber::from_offset(position + head),
+                body,
+                position + head + body.len(),
             )?;
-            position += 0x1000;
-            write_bytes += 0x1000;
+            write_bytes += body.len();
+        }
+        if tail != 0 {
+            partial(FileBlockNumber::from_offset(end & !0xfff), 0, tail_buf, end)?;
+            write_bytes += tail;
         }
-        if write_bytes != buf.len() {
+        Ok(write_bytes)
+    }
+
+    /// Reads data from the file straight into a user buffer.
+    ///
+    /// The pages of the user buffer are pinned and, if the buffer is backed
+    /// by a single page, filled in place.
+    ///
+    /// # Returns
+    /// - `Ok(usize)`: The number of bytes read.
+    /// - `Err(Error)`: An error if the buffer is not accessible or the read
+    ///   operation fails.
+    pub fn read_user(&self, position: usize, buf: UserU8SliceWO) -> Result<usize, KernelError> {
+        self.read_vectored(position, core::iter::once(buf))
+    }
+
+    /// Writes data from a user buffer straight into the file.
+    ///
+    /// The pages of the user buffer are pinned and, if the buffer is backed
+    /// by a single page, read in place.
+    ///
+    /// # Returns
+    /// - `Ok(usize)`: The number of bytes written.
+    /// - `Err(Error)`: An error if the buffer is not accessible or the write
+    ///   operation fails.
+    pub fn write_user(&self, position: usize, buf: UserU8SliceRO) -> Result<usize, KernelError> {
+        self.write_vectored(position, core::iter::once(buf))
+    }
+
+    /// Reads data from the file into several user buffers in order, as if
+    /// they were a single buffer.
+    ///
+    /// All the buffers are pinned before the file is read, so an
+    /// inaccessible buffer fails the whole call without a side effect. The
+    /// file is read with a single [`RegularFile::read`]: straight into the
+    /// buffer if it is backed by a single page, or into a kernel buffer that
+    /// is then scattered over the pages.
+    ///
+    /// # Returns
+    /// - `Ok(usize)`: The number of bytes read.
+    /// - `Err(Error)`: An error if a buffer is not accessible or the read
+    ///   operation fails.
+    pub fn read_vectored(
+        &self,
+        position: usize,
+        bufs: impl IntoIterator<Item = UserU8SliceWO>,
+    ) -> Result<usize, KernelError> {
+        let mut pages = bufs
+            .into_iter()
+            .map(UserU8SliceWO::pin)
+            .collect::<Result<Vec<_>, _>>()?;
+        let mut chunks = pages.iter_mut().flat_map(|p| p.iter_mut());
+        match (chunks.next(), chunks.next()) {
+            (None, _) => Ok(0),
+            (Some(chunk), None) => self.read(position, chunk.as_mut_slice()),
+            _ => {
+                let len = pages.iter().map(UserPages::len).sum();
+                let mut bounce = alloc::vec![0; len];
+                let n = self.read(position, &mut bounce)?;
+                let mut src = &bounce[..n];
+                for chunk in pages.iter_mut().flat_map(|p| p.iter_mut()) {
+                    if src.is_empty() {
+                        break;
+                    }
+                    let k = chunk.len().min(src.len());
+                    chunk.as_mut_slice()[..k].copy_from_slice(&src[..k]);
+                    src = &src[k..];
+                }
+                Ok(n)
+            }
+        }
+    }
+
+    /// Writes data from several user buffers into the file in order, as if
+    /// they were a single buffer.
+    ///
+    /// All the buffers are pinned before the file is written, so an
+    /// inaccessible buffer fails the whole call without a side effect. Like
+    /// [`RegularFile::read_vectored`], the file is written with a single
+    /// [`RegularFile::write`].
+    ///
+    /// # Returns
+    /// - `Ok(usize)`: The number of bytes written.
+    /// - `Err(Error)`: An error if a buffer is not accessible or the write
+    ///   operation fails.
+    pub fn write_vectored(
+        &self,
+        position: usize,
+        bufs: impl IntoIterator<Item = UserU8SliceRO>,
+    ) -> Result<usize, KernelError> {
+        let pages = bufs
+            .into_iter()
+            .map(UserU8SliceRO::pin)
+            .collect::<Result<Vec<_>, _>>()?;
+        let mut chunks = pages.iter().flat_map(|p| p.iter());
+        match (chunks.next(), chunks.next()) {
+            (None, _) => Ok(0),
+            (Some(chunk), None) => self.write(position, chunk.as_slice()),
+            _ => {
+                let mut bounce = Vec::with_capacity(pages.iter().map(UserPages::len).sum());
+                for chunk in pages.iter().flat_map(|p| p.iter()) {
+                    bounce.extend_from_slice(chunk.as_slice());
+                }
+                self.write(position, &bounce)
+            }
+        }
+    }
+
+    /// Copies up to `len` bytes at `pos_in` of this file to `pos_out` of
+    /// `dst` inside the kernel.
+    ///
+    /// Each source block is taken with [`RegularFile::mmap`], which is the
+    /// cached page when the file system has a page cache, and written to
+    /// `dst` straight from that page. The copy stops at the end of this file.
+    ///
+    /// # Returns
+    /// - `Ok(usize)`: The number of bytes copied.
+    /// - `Err(Error)`: [`KernelError::InvalidArgument`] if the source and
+    ///   destination ranges of the same file overlap, or an error of the
+    ///   underlying read or write.
+    pub fn copy_range(
+        &self,
+        mut pos_in: usize,
+        dst: &RegularFile,
+        mut pos_out: usize,
+        len: usize,
+    ) -> Result<usize, KernelError> {
+        let end = self.size().min(pos_in.saturating_add(len));
+        let len = end.saturating_sub(pos_in);
+        if self.ino() == dst.ino() && pos_in < pos_out + len && pos_out < pos_in + len {
+            return Err(KernelError::InvalidArgument);
+        }
+        let mut copied = 0;
+        while pos_in < end {
+            let ofs = pos_in & 0xfff;
+            let n = (0x1000 - ofs).min(end - pos_in);
             let r = self
-                .0
-                .read(FileBlockNumber::from_offset(position), &mut bounce_buffer);
-            if matches!(
-                r,
-                Err(KernelError::IOError) | Err(KernelError::FilesystemCorrupted(_))
-            ) {
-                return r.map(|_| 0);
+                .mmap(FileBlockNumber::from_offset(pos_in & !0xfff))
+                .and_then(|page| dst.write(pos_out, &page.inner()[ofs..ofs + n]));
+            match r {
+                Ok(w) => {
+                    copied += w;
+                    if w != n {
+                        break;
+                    }
+                }
+                Err(e) if copied == 0 => return Err(e),
+                Err(_) => break,
             }
-            let remainder = buf.len() - write_bytes;
-            assert!(remainder < 0x1000);
-            bounce_buffer[..remainder].copy_from_slice(&buf[write_bytes..]);
-            self.0.write(
-                FileBlockNumber::from_offset(position),
-                &bounce_buffer,
-                position + remainder,
-            )?;
-            write_bytes += remainder;
+            pos_in += n;
+            pos_out += n;
         }
-        Ok(write_bytes)
+        Ok(copied)
     }
 
     /// Maps a file block into memory.
@@ -460,7 +742,7 @@ impl Directory {
 
         for part in path.split("/").filter(|&s| !s.is_empty()) {
             match ret {
-                File::Directory(d) => ret = d.0.open_entry(part)?,
+                File::Directory(d) => ret = dcache::open_entry(&d, part)?,
                 File::RegularFile(_) => return Err(KernelError::NotDirectory),
             }
         }
@@ -489,14 +771,12 @@ impl Directory {
         let entry = list.pop().ok_or(KernelError::InvalidArgument)?;
 
         for part in list {
-            dstdir = dstdir
-                .0
-                .open_entry(part)?
+            dstdir = dcache::open_entry(&dstdir, part)?
                 .into_directory()
                 .ok_or(KernelError::NoSuchEntry)?;
         }
 
-        dstdir.0.create_entry(entry, is_dir)
+        dcache::create_entry(&dstdir, entry, is_dir)
     }
 
     /// Unlink an entry in the directory.
@@ -520,14 +800,12 @@ impl Directory {
         let entry = list.pop().ok_or(KernelError::InvalidArgument)?;
 
         for part in list {
-            dstdir = dstdir
-                .0
-                .open_entry(part)?
+            dstdir = dcache::open_entry(&dstdir, part)?
                 .into_directory()
                 .ok_or(KernelError::NoSuchEntry)?;
         }
 
-        dstdir.0.unlink_entry(entry)
+        dcache::unlink_entry(&dstdir, entry)
     }
 
     /// Reads the contents of the directory.
@@ -763,11 +1041,7 @@ impl Disk {
         if let Some(hook) = self.hook.as_ref() {
             hook(sector, buf, false)?;
         }
-        if dev.read(sector, buf) {
-            Ok(())
-        } else {
-            Err(KernelError::IOError)
-        }
+        crate::block::read(self.index, dev, &mut [(sector, &mut buf[..])])
     }
 
     /// Write 512 bytes to disk starting from sector.
@@ -779,11 +1053,62 @@ impl Disk {
             if let Some(hook) = self.hook.as_ref() {
                 hook(sector, buf, true)?;
             }
-            if dev.write(sector, buf) {
-                Ok(())
-            } else {
-                Err(KernelError::IOError)
+            crate::block::write(self.index, dev, &[(sector, &buf[..])])
+        }
+    }
+
+    /// Read the consecutive sectors starting from `sector` into `buf`, whose
+    /// length is a multiple of 512, in a single submission.
+    pub fn read_many(&self, sector: Sector, buf: &mut [u8]) -> Result<(), KernelError> {
+        self.read_vectored(&mut [(sector, buf)])
+    }
+
+    /// Write `buf`, whose length is a multiple of 512, to the consecutive
+    /// sectors starting from `sector` in a single submission.
+    pub fn write_many(&self, sector: Sector, buf: &[u8]) -> Result<(), KernelError> {
+        self.write_vectored(&[(sector, buf)])
+    }
+
+    /// Read a list of sector runs in a single submission.
+    ///
+    /// Each entry is the first sector of a run and a buffer whose length is a
+    /// multiple of 512. The device merges the adjacent runs. The hook is
+    /// called on every sector of the batch before the submission.
+    pub fn read_vectored(&self, bios: &mut [(Sector, &mut [u8])]) -> Result<(), KernelError> {
+        let dev = abyss::dev::get_bdev(self.index).ok_or(KernelError::IOError)?;
+        if bios.iter().any(|(_, buf)| buf.len() % 512 != 0) {
+            return Err(KernelError::InvalidArgument);
+        }
+        if let Some(hook) = self.hook.as_ref() {
+            for (sector, buf) in bios.iter_mut() {
+                for (i, b) in buf.as_chunks_mut::<512>().0.iter_mut().enumerate() {
+                    hook(*sector + i, b, false)?;
+                }
+            }
+        }
+        crate::block::read(self.index, dev, bios)
+    }
+
+    /// Write a list of sector runs in a single submission.
+    ///
+    /// Each entry is the first sector of a run and a buffer whose length is a
+    /// multiple of 512. Nothing is written if the disk is read-only or the
+    /// hook rejects any sector of the batch.
+    pub fn write_vectored(&self, bios: &[(Sector, &[u8])]) -> Result<(), KernelError> {
+        let dev = abyss::dev::get_bdev(self.index).ok_or(KernelError::IOError)?;
+        if self.is_ro {
+            return Err(KernelError::NotSupportedOperation);
+        }
+        if bios.iter().any(|(_, buf)| buf.len() % 512 != 0) {
+            return Err(KernelError::InvalidArgument);
+        }
+        if let Some(hook) = self.hook.as_ref() {
+            for (sector, buf) in bios.iter() {
+                for (i, b) in buf.as_chunks::<512>().0.iter().enumerate() {
+                    hook(*sector + i, b, true)?;
+                }
             }
         }
+        crate::block::write(self.index, dev, bios)
     }
 }
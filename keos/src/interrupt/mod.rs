@@ -6,6 +6,8 @@ use abyss::{
 };
 use alloc::sync::Arc;
 
+pub mod stat;
+
 type Handler = Option<Arc<dyn Fn(&mut Registers) + Send + Sync>>;
 #[allow(clippy::declare_interior_mutable_const)]
 const INIT: SpinLock<Handler> = SpinLock::new(None);
@@ -18,12 +20,14 @@ pub fn do_handle_interrupt(idx: usize, frame: &mut Registers) {
     let handler = guard.clone();
     guard.unlock();
 
+    let span = stat::enter(idx);
     match &handler {
         Some(handler) => handler(frame),
         _ => {
             panic!("Unknown interrupt #{}", idx + 32);
         }
     }
+    stat::exit(span);
 
     if frame.interrupt_stack_frame.cs.dpl() == PrivilegeLevel::Ring3 {
         crate::thread::__check_for_signal();
@@ -46,7 +50,9 @@ pub extern "C" fn handle_page_fault(frame: &mut Registers, ec: PFErrorCode) {
             let cr2 = Va::new(Cr2::current().into_usize()).unwrap();
             // Enable interrupt after resolving the faulting address.
             unsafe { abyss::interrupt::InterruptState::enable() };
-            task.page_fault(ec, cr2);
+            if !crate::mm::vdso::fault(ec, cr2) {
+                task.page_fault(ec, cr2);
+            }
         }
         _ => {
             panic!("Unexpected page fault: {:?} {:#?}", ec, frame);
@@ -0,0 +1,189 @@
+//! Interrupt statistics.
+//!
+//! Every interrupt that goes through the registered handlers is charged to
+//! the core that takes it and to its vector, such as the timer (32), the TLB
+//! shootdown IPI (126) and the virtio completions. For each of them, it
+//! counts the interrupts and the TSC cycles spent in the handler. Each core
+//! also records the deepest nesting of the handlers, which only grows when a
+//! handler runs with the interrupts enabled.
+//!
+//! A handler may switch to another thread, as the timer does on a
+//! preemption. Its cycles would include the run time of the other threads,
+//! so such an interrupt is counted as switched, and its cycles are not
+//! charged. The nesting depth is carried with the thread across the switch.
+//!
+//! The statistics are always collected; they cost two `rdtsc` per interrupt.
+use abyss::{MAX_CPU, x86_64::intrinsics::cpuid};
+use alloc::string::String;
+use core::{
+    arch::x86_64::_rdtsc,
+    fmt::Write,
+    sync::atomic::{AtomicU64, AtomicUsize, Ordering},
+};
+
+/// Number of the vectors that have handlers, from 32 to 255.
+pub const NR_VECTORS: usize = 224;
+
+/// A snapshot of the statistics of a vector on a core.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct IrqStat {
+    /// Number of the interrupts.
+    pub count: u64,
+    /// Total cycles spent in the handler.
+    pub cycles: u64,
+    /// Longest run of the handler in cycles.
+    pub max_cycles: u64,
+    /// Interrupts whose handler switched to another thread. Their cycles are
+    /// not charged.
+    pub switched: u64,
+}
+
+struct Counter {
+    count: AtomicU64,
+    cycles: AtomicU64,
+    max_cycles: AtomicU64,
+    switched: AtomicU64,
+}
+
+/// Statistics of a core.
+struct CoreStat {
+    vectors: [Counter; NR_VECTORS],
+    /// Number of the handlers in progress.
+    depth: AtomicUsize,
+    max_depth: AtomicUsize,
+    /// Number of the context switches, to detect a handler that switched.
+    switches: AtomicU64,
+}
+
+static CORES: [CoreStat; MAX_CPU] = [const {
+    CoreStat {
+        vectors: [const {
+            Counter {
+                count: AtomicU64::new(0),
+                cycles: AtomicU64::new(0),
+                max_cycles: AtomicU64::new(0),
+                switched: AtomicU64::new(0),
+            }
+        }; NR_VECTORS],
+        depth: AtomicUsize::new(0),
+        max_depth: AtomicUsize::new(0),
+        switches: AtomicU64::new(0),
+    }
+}; MAX_CPU];
+
+/// Get the statistics of the vector `vec` on the `core`.
+pub fn stat(core: usize, vec: usize) -> IrqStat {
+    let counter = &CORES[core].vectors[vec - 32];
+    IrqStat {
+        count: counter.count.load(Ordering::Relaxed),
+        cycles: counter.cycles.load(Ordering::Relaxed),
+        max_cycles: counter.max_cycles.load(Ordering::Relaxed),
+        switched: counter.switched.load(Ordering::Relaxed),
+    }
+}
+
+/// Get the deepest nesting of the handlers on the `core`.
+pub fn max_depth(core: usize) -> usize {
+    CORES[core].max_depth.load(Ordering::Relaxed)
+}
+
+/// A handler in progress.
+pub(super) struct Span {
+    core: usize,
+    idx: usize,
+    start: u64,
+    switches: u64,
+}
+
+/// Stamp the entry of the handler of the vector `idx + 32`.
+#[inline]
+pub(super) fn enter(idx: usize) -> Span {
+    let core = cpuid();
+    let stat = &CORES[core];
+    let depth = stat.depth.fetch_add(1, Ordering::Relaxed) + 1;
+    stat.max_depth.fetch_max(depth, Ordering::Relaxed);
+    Span {
+        core,
+        idx,
+        start: unsafe { _rdtsc() },
+        switches: stat.switches.load(Ordering::Relaxed),
+    }
+}
+
+/// Stamp the exit of the handler.
+#[inline]
+pub(super) fn exit(span: Span) {
+    let cycles = unsafe { _rdtsc() }.saturating_sub(span.start);
+    let core = cpuid();
+    let stat = &CORES[core];
+    stat.depth.fetch_sub(1, Ordering::Relaxed);
+    let counter = &CORES[span.core].vectors[span.idx];
+    counter.count.fetch_add(1, Ordering::Relaxed);
+    if core != span.core || stat.switches.load(Ordering::Relaxed) != span.switches {
+        counter.switched.fetch_add(1, Ordering::Relaxed);
+    } else {
+        counter.cycles.fetch_add(cycles, Ordering::Relaxed);
+        counter.max_cycles.fetch_max(cycles, Ordering::Relaxed);
+    }
+}
+
+/// Take the nesting depth of the thread that is switched out.
+///
+/// Must be called with the interrupts disabled.
+pub(crate) fn save_depth() -> usize {
+    let stat = &CORES[cpuid()];
+    stat.switches.fetch_add(1, Ordering::Relaxed);
+    stat.depth.swap(0, Ordering::Relaxed)
+}
+
+/// Give back the nesting depth of the thread that is switched in.
+///
+/// Must be called with the interrupts disabled.
+pub(crate) fn restore_depth(depth: usize) {
+    CORES[cpuid()].depth.store(depth, Ordering::Relaxed);
+}
+
+/// Clear all the statistics.
+pub fn reset() {
+    for core in CORES.iter() {
+        for counter in core.vectors.iter() {
+            counter.count.store(0, Ordering::Relaxed);
+            counter.cycles.store(0, Ordering::Relaxed);
+            counter.max_cycles.store(0, Ordering::Relaxed);
+            counter.switched.store(0, Ordering::Relaxed);
+        }
+        core.max_depth
+            .store(core.depth.load(Ordering::Relaxed), Ordering::Relaxed);
+    }
+}
+
+/// Print the statistics of every vector that has been taken, with the
+/// counts of each core, followed by the deepest nesting of each core.
+pub fn dump() {
+    println!("[IRQ] interrupts per core, and mean/max handler cycles.");
+    for vec in 32..32 + NR_VECTORS {
+        let stats: [IrqStat; MAX_CPU] = core::array::from_fn(|core| stat(core, vec));
+        let count: u64 = stats.iter().map(|s| s.count).sum();
+        if count == 0 {
+            continue;
+        }
+        let switched: u64 = stats.iter().map(|s| s.switched).sum();
+        let cycles: u64 = stats.iter().map(|s| s.cycles).sum();
+        let max = stats.iter().map(|s| s.max_cycles).max().unwrap_or(0);
+        let mut line = String::new();
+        for (core, s) in stats.iter().enumerate() {
+            let _ = write!(line, " cpu{core}={}", s.count);
+        }
+        let charged = count - switched;
+        println!(
+            "  #{vec}: {count} interrupts,{line}, {}/{} cycles, {switched} switched",
+            if charged == 0 { 0 } else { cycles / charged },
+            max,
+        );
+    }
+    let mut line = String::new();
+    for core in 0..MAX_CPU {
+        let _ = write!(line, " cpu{core}={}", max_depth(core));
+    }
+    println!("  max depth:{line}");
+}
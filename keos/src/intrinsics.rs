@@ -0,0 +1,16 @@
+//! Intrinsics of x86_64 not included in [`core::arch::x86_64`].
+//!
+//! These are the intrinsics of [`abyss`], except that [`read_cr3`] returns
+//! the physical address of the page table without the PCID that the kernel
+//! tags it with.
+//!
+//! [`core::arch::x86_64`]: https://doc.rust-lang.org/beta/core/arch/x86_64/index.html
+pub use abyss::x86_64::intrinsics::*;
+
+/// Read the physical address of the current page table from cr3.
+///
+/// The PCID bits of cr3 are masked out, so the value can be compared with
+/// the physical address of a page table.
+pub fn read_cr3() -> usize {
+    abyss::x86_64::intrinsics::read_cr3() & !crate::mm::tlb::PCID_MASK
+}
@@ -12,10 +12,10 @@ use core::mem::ManuallyDrop;
 use core::sync::atomic::Ordering;
 
 #[derive(Clone)]
-struct EhFrameReader;
+pub(crate) struct EhFrameReader;
 
 impl EhFrameReader {
-    fn start() -> usize {
+    pub(crate) fn start() -> usize {
         unsafe extern "C" {
             static __eh_frame_hdr_start: u8;
         }
@@ -256,6 +256,27 @@ fn panic(info: &core::panic::PanicInfo) -> ! {
     panic_internal_poweroff(state.1)
 }
 
+/// Call `f` with the name of each function at `pc`, from the outermost
+/// inlined function to the innermost.
+///
+/// Returns false if the debugging symbols do not cover `pc`.
+pub(crate) fn for_each_function(pc: u64, mut f: impl FnMut(&str)) -> bool {
+    let Some(ctxt) = (unsafe { DEBUG_CONTEXT.as_ref() }) else {
+        return false;
+    };
+    let Ok(mut frames) = ctxt.find_frames(pc) else {
+        return false;
+    };
+    let mut names = alloc::vec::Vec::new();
+    while let Ok(Some(frame)) = frames.next() {
+        if let Some(Ok(name)) = frame.function.as_ref().map(|n| n.demangle()) {
+            names.push(name.into_owned());
+        }
+    }
+    names.iter().rev().for_each(|name| f(name));
+    !names.is_empty()
+}
+
 /// Load debugging symbols from kernel image
 #[allow(clippy::result_unit_err)]
 pub(crate) fn load_debug_infos() -> bool {
@@ -0,0 +1,155 @@
+//! Per-cpu magazine layer in front of the slab allocator.
+//!
+//! Each cpu owns a small stack of free blocks (a "magazine") for every size
+//! class. Allocations and deallocations are served from the core-local
+//! magazine with interrupts disabled, so most alloc/free pairs never touch the
+//! shared treiber stack of the [`SlabAllocator`]. An empty magazine is
+//! refilled with half a magazine of blocks from the slab, and a full magazine
+//! drains half of its blocks back to the slab with a single compare-and-swap.
+//!
+//! The magazines also count the allocations and deallocations of the cpu,
+//! which are summed up on [`MagazineCache::stats`].
+use super::{Palloc, slab_allocator::SlabAllocator};
+use crate::mm::stats::SlabStats;
+use abyss::{MAX_CPU, interrupt::InterruptGuard, x86_64::intrinsics::cpuid};
+use core::{
+    alloc::AllocError,
+    cell::UnsafeCell,
+    ptr::NonNull,
+    sync::atomic::{AtomicU64, Ordering},
+};
+
+/// Maximum number of blocks that a magazine can hold.
+const MAGAZINE_SIZE: usize = 32;
+
+/// Upper bound of bytes that a magazine caches for a size class.
+const MAGAZINE_BYTES: usize = 0x10000;
+
+struct MagazineInner {
+    cnt: usize,
+    rounds: [usize; MAGAZINE_SIZE],
+}
+
+/// A core-local stack of free blocks.
+///
+/// Only accessed by the owning cpu while interrupts are disabled.
+#[repr(align(64))]
+struct Magazine {
+    inner: UnsafeCell<MagazineInner>,
+    /// Number of allocations on this cpu.
+    allocs: AtomicU64,
+    /// Number of deallocations on this cpu.
+    frees: AtomicU64,
+}
+
+unsafe impl Sync for Magazine {}
+
+impl Magazine {
+    const fn new() -> Self {
+        Self {
+            inner: UnsafeCell::new(MagazineInner {
+                cnt: 0,
+                rounds: [0; MAGAZINE_SIZE],
+            }),
+            allocs: AtomicU64::new(0),
+            frees: AtomicU64::new(0),
+        }
+    }
+
+    /// Increase the per-cpu counter.
+    ///
+    /// Only the owner cpu writes the counter, so it does not need a locked
+    /// instruction.
+    #[inline]
+    fn count(counter: &AtomicU64) {
+        counter.store(counter.load(Ordering::Relaxed) + 1, Ordering::Relaxed);
+    }
+}
+
+/// A slab allocator with per-cpu magazines.
+pub struct MagazineCache<const BSIZE: usize, const GROW_SIZE: usize> {
+    slab: SlabAllocator<BSIZE, GROW_SIZE>,
+    magazines: [Magazine; MAX_CPU],
+}
+
+impl<const BSIZE: usize, const GROW_SIZE: usize> MagazineCache<BSIZE, GROW_SIZE> {
+    /// Number of blocks cached per cpu for this size class.
+    ///
+    /// Large classes cache fewer blocks, not to hoard memory on idle cores.
+    const CAPACITY: usize = {
+        let c = MAGAZINE_BYTES / BSIZE;
+        if c < 2 {
+            2
+        } else if c > MAGAZINE_SIZE {
+            MAGAZINE_SIZE
+        } else {
+            c
+        }
+    };
+
+    /// Create a new magazine cache.
+    pub(super) const fn new() -> Self {
+        Self {
+            slab: SlabAllocator::new(),
+            magazines: [const { Magazine::new() }; MAX_CPU],
+        }
+    }
+
+    /// Allocate a Block from the current cpu's magazine.
+    #[inline]
+    pub(super) unsafe fn alloc(&self, allocator: &Palloc) -> Result<NonNull<[u8]>, AllocError> {
+        let _guard = InterruptGuard::new();
+        let magazine = &self.magazines[cpuid()];
+        let mag = unsafe { &mut *magazine.inner.get() };
+        if mag.cnt == 0 {
+            mag.cnt = unsafe {
+                self.slab
+                    .alloc_batch(&mut mag.rounds[..Self::CAPACITY / 2], allocator)?
+            };
+        }
+        mag.cnt -= 1;
+        let ptr = mag.rounds[mag.cnt];
+        self.slab.verify(ptr, "alloc");
+        Magazine::count(&magazine.allocs);
+        Ok(NonNull::slice_from_raw_parts(
+            NonNull::new(ptr as *mut u8).ok_or(AllocError)?,
+            BSIZE,
+        ))
+    }
+
+    /// Deallocate the Block into the current cpu's magazine.
+    #[inline]
+    pub(super) unsafe fn dealloc(&self, ptr: usize, _allocator: &Palloc) {
+        let _guard = InterruptGuard::new();
+        self.slab.verify(ptr, "dealloc");
+        let magazine = &self.magazines[cpuid()];
+        Magazine::count(&magazine.frees);
+        let mag = unsafe { &mut *magazine.inner.get() };
+        if mag.cnt == Self::CAPACITY {
+            let half = Self::CAPACITY / 2;
+            unsafe {
+                self.slab.dealloc_batch(&mag.rounds[half..Self::CAPACITY]);
+            }
+            mag.cnt = half;
+        }
+        mag.rounds[mag.cnt] = ptr;
+        mag.cnt += 1;
+    }
+
+    /// Collect the statistics of this size class.
+    pub(super) fn stats(&self) -> SlabStats {
+        let (allocs, frees) = self.magazines.iter().fold((0, 0), |(a, f), m| {
+            (
+                a + m.allocs.load(Ordering::Relaxed),
+                f + m.frees.load(Ordering::Relaxed),
+            )
+        });
+        SlabStats {
+            size: BSIZE,
+            allocs,
+            frees,
+            grown: self.slab.grown(),
+            bytes_in_use: allocs.saturating_sub(frees) as usize * BSIZE,
+        }
+    }
+}
@@ -1,42 +1,49 @@
 //! Slab allocator.
 #[allow(dead_code)]
 mod atomic128;
+mod magazine;
 mod slab_allocator;
 
-use crate::mm::ContigPages;
+use crate::{
+    addressing::PAGE_SIZE,
+    mm::{ContigPages, stats::SlabStats, vmalloc},
+};
 use abyss::{addressing::Kva, spinlock::SpinLock};
 use core::{
     alloc::{AllocError, Layout},
     ptr::NonNull,
 };
-use slab_allocator::SlabAllocator;
+use magazine::MagazineCache;
 
 /// The array of slab allocators with different sizes.
+///
+/// Each size class is fronted by per-cpu magazines, so that most of the
+/// allocations and deallocations stay on the core-local cache.
 pub struct Allocator {
     /// Slab allocator for Slab64.
-    pub s64: SlabAllocator<0x40, 0x1000>,
+    pub s64: MagazineCache<0x40, 0x1000>,
     /// Slab allocator for Slab128.
-    pub s128: SlabAllocator<0x80, 0x1000>,
+    pub s128: MagazineCache<0x80, 0x1000>,
     /// Slab allocator for Slab256.
-    s256: SlabAllocator<0x100, 0x1000>,
+    s256: MagazineCache<0x100, 0x1000>,
     /// Slab allocator for Slab512.
-    s512: SlabAllocator<0x200, 0x1000>,
+    s512: MagazineCache<0x200, 0x1000>,
     /// Slab allocator for Slab1024.
-    s1024: SlabAllocator<0x400, 0x1000>,
+    s1024: MagazineCache<0x400, 0x1000>,
     /// Slab allocator for Slab2048.
-    s2048: SlabAllocator<0x800, 0x2000>,
+    s2048: MagazineCache<0x800, 0x2000>,
     /// Slab allocator for Slab4096.
-    s4096: SlabAllocator<0x1000, 0x4000>,
+    s4096: MagazineCache<0x1000, 0x4000>,
     /// Slab allocator for Slab8192.
-    s8192: SlabAllocator<0x2000, 0x8000>,
+    s8192: MagazineCache<0x2000, 0x8000>,
     /// Slab allocator for Slab16384.
-    s16384: SlabAllocator<0x4000, 0x10000>,
+    s16384: MagazineCache<0x4000, 0x10000>,
     /// Slab allocator for Slab32768.
-    s32768: SlabAllocator<0x8000, 0x20000>,
+    s32768: MagazineCache<0x8000, 0x20000>,
     /// Slab allocator for Slab65536.
-    s65536: SlabAllocator<0x10000, 0x40000>,
+    s65536: MagazineCache<0x10000, 0x40000>,
     /// Slab allocator for Slab131072.
-    s131072: SlabAllocator<0x20000, 0x80000>,
+    s131072: MagazineCache<0x20000, 0x80000>,
     allocator: Palloc,
 }
 
@@ -109,21 +116,44 @@ impl Allocator {
     /// Create a new Allocator.
     const fn new() -> Self {
         Self {
-            s64: SlabAllocator::new(),
-            s128: SlabAllocator::new(),
-            s256: SlabAllocator::new(),
-            s512: SlabAllocator::new(),
-            s1024: SlabAllocator::new(),
-            s2048: SlabAllocator::new(),
-            s4096: SlabAllocator::new(),
-            s8192: SlabAllocator::new(),
-            s16384: SlabAllocator::new(),
-            s32768: SlabAllocator::new(),
-            s65536: SlabAllocator::new(),
-            s131072: SlabAllocator::new(),
+            s64: MagazineCache::new(),
+            s128: MagazineCache::new(),
+            s256: MagazineCache::new(),
+            s512: MagazineCache::new(),
+            s1024: MagazineCache::new(),
+            s2048: MagazineCache::new(),
+            s4096: MagazineCache::new(),
+            s8192: MagazineCache::new(),
+            s16384: MagazineCache::new(),
+            s32768: MagazineCache::new(),
+            s65536: MagazineCache::new(),
+            s131072: MagazineCache::new(),
             allocator: Palloc,
         }
     }
+
+    /// Collect the statistics of every size class.
+    fn stats(&self) -> [SlabStats; 12] {
+        [
+            self.s64.stats(),
+            self.s128.stats(),
+            self.s256.stats(),
+            self.s512.stats(),
+            self.s1024.stats(),
+            self.s2048.stats(),
+            self.s4096.stats(),
+            self.s8192.stats(),
+            self.s16384.stats(),
+            self.s32768.stats(),
+            self.s65536.stats(),
+            self.s131072.stats(),
+        ]
+    }
+}
+
+/// Collect the statistics of the slab allocator.
+pub fn stats() -> [SlabStats; 12] {
+    ALLOCATOR.stats()
 }
 
 unsafe impl core::alloc::GlobalAlloc for Allocator {
@@ -141,7 +171,7 @@ unsafe impl core::alloc::GlobalAlloc for Allocator {
             unsafe {
                 match dispatch!(self, size, |allocator| allocator.alloc(&self.allocator)) {
                     Ok(o) => o,
-                    Err(size) => self.allocator.allocate(size),
+                    Err(size) => self.allocator.allocate_large(size, layout.align()),
                 }
                 .map(|n| n.as_ptr() as *mut u8)
                 .unwrap_or(core::ptr::null_mut())
@@ -156,7 +186,7 @@ unsafe impl core::alloc::GlobalAlloc for Allocator {
                 if let Err(_size) = dispatch!(self, layout.size(), |allocator| allocator
                     .dealloc(ptr as usize, &self.allocator))
                 {
-                    self.allocator.deallocate(ptr, layout.size());
+                    self.allocator.deallocate_large(ptr, layout.size());
                 }
             }
         }
@@ -186,6 +216,39 @@ impl Palloc {
         }
     }
 
+    /// Allocate a block that does not fit in the slab.
+    ///
+    /// The pages of the block are only virtually contiguous, unless the
+    /// alignment is larger than a page. A driver either translates such a
+    /// block page by page with [`Kva::translate`] before handing it to a
+    /// device, or asks for an alignment larger than a page.
+    unsafe fn allocate_large(
+        &self,
+        size: usize,
+        align: usize,
+    ) -> Result<NonNull<[u8]>, AllocError> {
+        if align <= PAGE_SIZE
+            && let Some(kva) = vmalloc::vmalloc(size)
+        {
+            NonNull::new(unsafe {
+                core::slice::from_raw_parts_mut(kva.into_usize() as *mut u8, size)
+            })
+            .ok_or(AllocError)
+        } else {
+            unsafe { self.allocate(size) }
+        }
+    }
+
+    unsafe fn deallocate_large(&self, ptr: *mut u8, size: usize) {
+        unsafe {
+            if vmalloc::contains(ptr as usize) {
+                vmalloc::vfree(Kva::new(ptr as usize).unwrap());
+            } else {
+                self.deallocate(ptr, size);
+            }
+        }
+    }
+
     fn serialize<F>(&self, aux: &SpinLock<()>, f: F)
     where
         F: FnOnce(),
@@ -32,6 +32,7 @@ pub struct SlabAllocator<const BSIZE: usize, const GROW_SIZE: usize> {
     head: AtomicU128,
     stamp: AtomicU64,
     grow_aux: SpinLock<()>,
+    grown: AtomicU64,
 }
 
 #[doc(hidden)]
@@ -96,13 +97,20 @@ impl<const BSIZE: usize, const GROW_SIZE: usize> SlabAllocator<BSIZE, GROW_SIZE>
             head: AtomicU128::new(0),
             stamp: AtomicU64::new(0),
             grow_aux: SpinLock::new(()),
+            grown: AtomicU64::new(0),
         }
     }
 
+    /// Number of times that the allocator grew.
+    pub(super) fn grown(&self) -> u64 {
+        self.grown.load(Ordering::Relaxed)
+    }
+
     /// Grow the internal blocks by allocating from the physical frame.
     pub(super) unsafe fn grow(&self, allocator: &Palloc) -> Result<(), AllocError> {
         unsafe {
             let base = allocator.allocate(Self::G_SIZE)?.cast::<u8>().as_ptr() as usize;
+            self.grown.fetch_add(1, Ordering::Relaxed);
 
             #[cfg(feature = "redzone")]
             core::slice::from_raw_parts_mut(base as *mut u8, Self::G_SIZE).fill(RZ);
@@ -138,6 +146,102 @@ impl<const BSIZE: usize, const GROW_SIZE: usize> SlabAllocator<BSIZE, GROW_SIZE>
         }
     }
 
+    /// Push the chain of blocks `ptrs` with a single compare-and-swap.
+    ///
+    /// The redzones of the blocks must be verified by the caller.
+    pub(super) unsafe fn dealloc_batch(&self, ptrs: &[usize]) {
+        unsafe {
+            let Some((first, _)) = ptrs.split_first() else {
+                return;
+            };
+            let stamp = self.stamp.fetch_add(ptrs.len() as u64, Ordering::Relaxed);
+            // Link the blocks in advance; only the tail is fixed up in the loop.
+            for (i, w) in ptrs.windows(2).enumerate() {
+                let blk = (w[0] as *mut Block).as_mut().unwrap();
+                blk.next.store(
+                    from_pointer_tag(w[1] as *mut Block, stamp + i as u64 + 1),
+                    Ordering::Relaxed,
+                );
+            }
+            let last = (*ptrs.last().unwrap() as *mut Block).as_mut().unwrap();
+            let next = from_pointer_tag(*first as *mut Block, stamp);
+            loop {
+                let head = self.head.load(Ordering::Relaxed);
+                last.next.store(head, Ordering::Relaxed);
+                if self
+                    .head
+                    .compare_exchange(head, next, Ordering::Release, Ordering::Relaxed)
+                    .is_ok()
+                {
+                    break;
+                }
+            }
+        }
+    }
+
+    /// Allocate up to `out.len()` Blocks into `out`.
+    ///
+    /// The blocks are popped one at a time, each with its own
+    /// compare-and-swap as in [`SlabAllocator::alloc`], since the tag only
+    /// guards the head of the stack, not the chain behind it. Returns the
+    /// number of allocated blocks, which is at least one on success.
+    pub(super) unsafe fn alloc_batch(
+        &self,
+        out: &mut [usize],
+        allocator: &Palloc,
+    ) -> Result<usize, AllocError> {
+        unsafe {
+            if out.is_empty() {
+                return Ok(0);
+            }
+            let mut n = 0;
+            while n < out.len()
+                && let Some(ptr) = self.pop()
+            {
+                self.verify(ptr, "alloc");
+                out[n] = ptr;
+                n += 1;
+            }
+            if n == 0 {
+                // Empty; let `alloc` grow the slab.
+                out[0] = self.alloc(allocator)?.cast::<u8>().as_ptr() as usize;
+                n = 1;
+            }
+            Ok(n)
+        }
+    }
+
+    /// Pop a Block off the stack, without growing the slab.
+    ///
+    /// Returns `None` if the stack is empty.
+    #[inline]
+    unsafe fn pop(&self) -> Option<usize> {
+        unsafe {
+            loop {
+                let head = self.head.load(Ordering::Acquire);
+                let (ptr, _) = into_pointer_tag::<Block>(head);
+                if ptr.is_null() {
+                    return None;
+                }
+                let next = (*ptr).next.load(Ordering::Relaxed);
+                if self
+                    .head
+                    .compare_exchange(head, next, Ordering::Acquire, Ordering::Relaxed)
+                    .is_ok()
+                {
+                    return Some(ptr as usize);
+                }
+            }
+        }
+    }
+
+    /// Verify the redzone of the block `ptr` if the redzone is enabled.
+    #[inline]
+    pub(super) fn verify(&self, _ptr: usize, _where: &str) {
+        #[cfg(feature = "redzone")]
+        verify_redzone(Self::REDZONE_SIZE, BSIZE, _ptr, _where);
+    }
+
     /// Allocate a Block from the allocator.
     #[inline]
     pub(super) unsafe fn alloc(&self, allocator: &Palloc) -> Result<NonNull<[u8]>, AllocError> {
@@ -141,12 +141,17 @@ pub mod debugging;
 #[cfg(doc)]
 pub mod tips;
 
+pub mod acct;
+pub mod block;
 pub mod channel;
 pub mod fs;
 #[doc(hidden)]
 pub mod interrupt;
+pub mod intrinsics;
 mod lang;
 pub mod mm;
+pub mod pipe;
+pub mod profile;
 pub mod sync;
 pub mod syscall;
 pub mod task;
@@ -155,10 +160,7 @@ pub mod thread;
 pub mod util;
 
 use abyss::spinlock;
-pub use abyss::{
-    x86_64::intrinsics,
-    {MAX_CPU, addressing, debug, info, print, println, warning},
-};
+pub use abyss::{MAX_CPU, addressing, debug, info, print, println, warning};
 use alloc::{boxed::Box, collections::btree_set::BTreeSet, ffi::CString, vec::Vec};
 use task::Task;
 use thread::scheduler::{BOOT_DONE, Scheduler, scheduler};
@@ -181,6 +183,8 @@ pub enum KernelError {
     NoExec,
     /// BAD file descriptor. (EBADF)
     BadFileDescriptor,
+    /// Resource temporarily unavailable. (EAGAIN)
+    TryAgain,
     /// Out of memory. (ENOMEM)
     NoMemory,
     /// Permission denied. (EACCES)
@@ -226,6 +230,7 @@ impl KernelError {
             KernelError::IOError => -5,
             KernelError::NoExec => -8,
             KernelError::BadFileDescriptor => -9,
+            KernelError::TryAgain => -11,
             KernelError::NoMemory => -12,
             KernelError::InvalidAccess => -13,
             KernelError::BadAddress => -14,
@@ -263,6 +268,7 @@ impl TryFrom<isize> for KernelError {
             -5 => Ok(Self::IOError),
             -8 => Ok(Self::NoExec),
             -9 => Ok(Self::BadFileDescriptor),
+            -11 => Ok(Self::TryAgain),
             -12 => Ok(Self::NoMemory),
             -13 => Ok(Self::InvalidAccess),
             -14 => Ok(Self::BadAddress),
@@ -337,6 +343,7 @@ Copyright 2025 Computer Architecture and Systems Lab\n"
     unsafe {
         info!("Memory: init memory.");
         crate::mm::init_mm(regions);
+        crate::mm::vdso::init();
         if let Some(cmd) = cmd {
             KERNEL_CMDLINE = CString::from_vec_with_nul(cmd.into()).ok();
         }
@@ -378,10 +385,19 @@ Copyright 2025 Computer Architecture and Systems Lab\n"
                 .unwrap_or("")
         );
     }
+    // Free the rest of the memory, together with the application processors.
+    crate::mm::init_deferred();
 
-    crate::interrupt::register(32, |_| scheduler().timer_tick());
+    crate::interrupt::register(32, |regs| {
+        // Interrupts are disabled in the RCU read-side critical sections.
+        crate::sync::rcu::quiescent();
+        crate::profile::on_tick(regs);
+        scheduler().timer_tick()
+    });
     crate::interrupt::register(126, mm::tlb::handler);
     crate::interrupt::register(127, |_regs| { /* no-op */ });
+    crate::block::init();
+    crate::teletype::init();
     BOOT_DONE.store(true, core::sync::atomic::Ordering::SeqCst);
     // Now kernel is ready to serve task.
     crate::thread::scheduler::idle(core_id);
@@ -394,6 +410,7 @@ pub unsafe fn rust_ap_main(core_id: usize) {
     unsafe extern "Rust" {
         fn ap_main();
     }
+    crate::mm::init_deferred();
     unsafe {
         ap_main();
     }
@@ -443,22 +460,47 @@ impl<T: Task + Default + 'static> TestDriver<T> {
     /// Run the given tests.
     pub fn start<const TC: usize>(tests: [&'static dyn TestCase; TC]) {
         crate::thread::ThreadBuilder::new("test_main").spawn(move || {
-            let tests = match unsafe { KERNEL_CMDLINE.as_ref() } {
-                Some(cmd) if cmd.to_str() != Ok("") => {
-                    let filter = cmd
-                        .to_str()
+            let mut filter = unsafe { KERNEL_CMDLINE.as_ref() }
+                .map(|cmd| {
+                    cmd.to_str()
                         .expect("Failed to parse cmd")
                         .split(" ")
-                        .collect::<BTreeSet<_>>();
-                    tests
-                        .iter()
-                        .filter(|test| {
-                            let name = test.name();
-                            let r = name.split("::").next().map(|n| n.len() + 2).unwrap_or(0);
-                            filter.contains(&name[r..])
-                        })
-                        .collect::<Vec<_>>()
-                }
+                        .filter(|arg| !arg.is_empty())
+                        .collect::<BTreeSet<_>>()
+                })
+                .unwrap_or_default();
+            // `trace=syscall` turns on the system call tracing for the run.
+            let trace = filter.remove("trace=syscall");
+            crate::syscall::trace::set_enabled(trace);
+            // `trace=irq` prints the interrupt statistics of the run.
+            let trace_irq = filter.remove("trace=irq");
+            if trace_irq {
+                crate::interrupt::stat::reset();
+            }
+            // `profile` or `profile=<period>` samples the stacks every
+            // `period` ticks during the run.
+            let profile = filter
+                .iter()
+                .find(|arg| arg.starts_with("profile"))
+                .copied()
+                .and_then(|arg| match arg.strip_prefix("profile") {
+                    Some("") => Some(1),
+                    Some(period) => period.strip_prefix('=')?.parse().ok(),
+                    None => None,
+                });
+            filter.retain(|arg| !arg.starts_with("profile"));
+            if let Some(period) = profile {
+                crate::profile::start(period, true, crate::profile::DEFAULT_CAPACITY);
+            }
+            let tests = match filter {
+                filter if !filter.is_empty() => tests
+                    .iter()
+                    .filter(|test| {
+                        let name = test.name();
+                        let r = name.split("::").next().map(|n| n.len() + 2).unwrap_or(0);
+                        filter.contains(&name[r..])
+                    })
+                    .collect::<Vec<_>>(),
                 _ => tests.iter().collect::<Vec<_>>(),
             };
             let (total, mut succ) = (tests.len(), 0);
@@ -479,6 +521,17 @@ impl<T: Task + Default + 'static> TestDriver<T> {
                 succ,
                 total - succ
             );
+            if trace {
+                crate::syscall::trace::dump();
+            }
+            if trace_irq {
+                crate::interrupt::stat::dump();
+            }
+            if profile.is_some() {
+                crate::profile::stop();
+                crate::profile::dump();
+            }
+            abyss::kprint::flush();
 
             unsafe {
                 abyss::x86_64::power_control::power_off();
@@ -10,14 +10,19 @@
 //! automatically freed, ensuring proper memory management and preventing memory
 //! leaks.
 pub mod page_table;
+pub mod reclaim;
+pub mod stats;
 pub mod tlb;
+pub mod vdso;
+pub mod vmalloc;
+pub(crate) mod zero_pool;
 
 use crate::addressing::{Kva, PAGE_MASK, PAGE_SHIFT, Pa};
 use abyss::{boot::Regions, spinlock::SpinLock};
 use alloc::vec::Vec;
 use core::{
     ops::Range,
-    sync::atomic::{AtomicU64, Ordering},
+    sync::atomic::{AtomicU64, AtomicUsize, Ordering},
 };
 
 /// A reference of a memory page.
@@ -149,19 +154,27 @@ impl Page {
     pub fn new() -> Self {
         let loc = core::panic::Location::caller();
         ContigPages::new(0x1000)
-            .map(|inner| Self { inner })
-            .inspect(|pg| {
-                crate::thread::with_current(|th| {
-                    let mut guard = th.allocations.lock();
-                    if let Some(alloc) = &mut *guard {
-                        assert!(alloc.insert(pg.kva(), loc).is_none())
-                    }
-                    guard.unlock();
-                });
+            .or_else(|| {
+                // Ask the caches to release some memory, and try again.
+                reclaim::reclaim(reclaim::RECLAIM_BATCH);
+                ContigPages::new(0x1000)
             })
+            .map(|inner| Self { inner }.track(loc))
             .expect("Failed to allocate page.")
     }
 
+    /// Record this page to the allocation tracker of the current thread.
+    fn track(self, loc: &'static core::panic::Location<'static>) -> Self {
+        crate::thread::with_current(|th| {
+            let mut guard = th.allocations.lock();
+            if let Some(alloc) = &mut *guard {
+                assert!(alloc.insert(self.kva(), loc).is_none())
+            }
+            guard.unlock();
+        });
+        self
+    }
+
     /// Get the kernel virtual address of this page.
     ///
     /// # Returns
@@ -180,6 +193,15 @@ impl Page {
         self.inner.kva.into_pa()
     }
 
+    /// Get the number of the references to this page.
+    ///
+    /// A page with more than one reference is shared, e.g., by the page tables
+    /// of a parent and its forked child.
+    #[inline]
+    pub fn ref_count(&self) -> usize {
+        self.inner.ref_count()
+    }
+
     /// Consumes the page, returning its physical address.
     ///
     /// This method "consumes" the [`Page`] and returns its physical address.
@@ -297,83 +319,205 @@ pub unsafe fn init_mm(regions: Regions) {
             }
         }
     }
+    vmalloc::init();
 }
 
 // Physical memory allocators.
+
+/// The largest order of the buddy allocator (4MiB block).
+const MAX_ORDER: usize = 10;
+/// Marker of [`Arena::orders`] for a page that does not start a free block.
+const NOT_FREE: u8 = u8::MAX;
+/// Terminator of the free lists.
+const NIL: usize = usize::MAX;
+
+/// Links of a free block, stored at the first bytes of the block itself.
+#[derive(Clone, Copy)]
+#[repr(C)]
+struct FreeLink {
+    prev: usize,
+    next: usize,
+}
+
+/// A buddy allocator over a physically contiguous memory region.
+///
+/// Free memory is kept as naturally aligned blocks of `2^order` pages, one
+/// doubly-linked free list per order. Alignment of a block is based on the page
+/// frame number, so that a block of order 9 is always 2MiB-aligned.
 struct Arena {
     start: Kva,
     end: Kva,
-    // 0: used, 1: unused
-    bitmap: &'static mut [u64],
+    /// Page frame number of `start`.
+    base_pfn: usize,
+    /// Number of pages managed by this arena.
+    npages: usize,
+    /// Order of the free block starting at each page, or [`NOT_FREE`].
+    orders: &'static mut [u8],
+    /// Heads of the free lists for each order.
+    free_lists: [usize; MAX_ORDER + 1],
+    /// Number of free pages.
+    nr_free: usize,
     ref_cnts: &'static [AtomicU64],
+    /// Pages whose reference counts are not cleared yet. They are freed by
+    /// [`init_deferred`].
+    deferred: Range<usize>,
 }
 
 impl Arena {
     const EMPTY: Option<Self> = None;
-    fn set_used(&mut self, index: usize) {
-        let (pos, ofs) = (index / 64, index % 64);
-        debug_assert_ne!(self.bitmap[pos] & (1 << ofs), 0);
-        self.bitmap[pos] &= !(1 << ofs);
-        debug_assert_eq!(self.bitmap[pos] & (1 << ofs), 0);
-    }
-    fn set_unused(&mut self, index: usize) {
-        let (pos, ofs) = (index / 64, index % 64);
-        debug_assert_eq!(self.bitmap[pos] & (1 << ofs), 0);
-        self.bitmap[pos] |= 1 << ofs;
-        debug_assert_ne!(self.bitmap[pos] & (1 << ofs), 0);
+
+    fn link(&self, index: usize) -> &'static mut FreeLink {
+        unsafe { &mut *((self.start + (index << PAGE_SHIFT)).into_usize() as *mut FreeLink) }
     }
-    fn alloc(&mut self, cnt: usize, align: usize) -> Option<(Kva, &'static AtomicU64)> {
-        let mut search = 0;
-        while search < self.bitmap.len() * 64 {
-            let (mut pos, ofs) = (search / 64, search % 64);
-            // search first qword that contains one.
-            if ofs % 64 == 0 {
-                while self.bitmap[pos] == 0 {
-                    pos += 1;
-                }
-                search = pos * 64;
+
+    fn push_free(&mut self, index: usize, order: usize) {
+        debug_assert_eq!(self.orders[index], NOT_FREE);
+        let head = self.free_lists[order];
+        *self.link(index) = FreeLink {
+            prev: NIL,
+            next: head,
+        };
+        if head != NIL {
+            self.link(head).prev = index;
+        }
+        self.free_lists[order] = index;
+        self.orders[index] = order as u8;
+    }
+
+    fn remove_free(&mut self, index: usize, order: usize) {
+        debug_assert_eq!(self.orders[index], order as u8);
+        let FreeLink { prev, next } = *self.link(index);
+        if prev != NIL {
+            self.link(prev).next = next;
+        } else {
+            self.free_lists[order] = next;
+        }
+        if next != NIL {
+            self.link(next).prev = prev;
+        }
+        self.orders[index] = NOT_FREE;
+    }
+
+    /// Get the largest order of a block that starts at `index` and spans at
+    /// most `cnt` pages.
+    fn fit_order(&self, index: usize, cnt: usize) -> usize {
+        let mut order = ((self.base_pfn + index).trailing_zeros() as usize).min(MAX_ORDER);
+        while 1 << order > cnt {
+            order -= 1;
+        }
+        order
+    }
+
+    /// Free a naturally aligned block, merging it with its free buddies.
+    fn free_block(&mut self, mut index: usize, mut order: usize) {
+        while order < MAX_ORDER {
+            let buddy = ((self.base_pfn + index) ^ (1 << order)).wrapping_sub(self.base_pfn);
+            if buddy >= self.npages || self.orders[buddy] != order as u8 {
+                break;
             }
+            self.remove_free(buddy, order);
+            index = index.min(buddy);
+            order += 1;
+        }
+        self.push_free(index, order);
+    }
+
+    /// Free the pages in `index..index + cnt`.
+    fn free_range(&mut self, mut index: usize, cnt: usize) {
+        let end = index + cnt;
+        self.nr_free += cnt;
+        while index < end {
+            let order = self.fit_order(index, end - index);
+            self.free_block(index, order);
+            index += 1 << order;
+        }
+    }
 
-            let mut cont = 0;
-            if align != 0
-                && !((self.start.into_usize() >> PAGE_SHIFT) + search).is_multiple_of(align)
-            {
-                search += 1;
-            } else {
-                let start = search;
-                loop {
-                    // Found!
-                    if cont == cnt {
-                        for i in start..start + cnt {
-                            self.set_used(i);
-                        }
-                        let ref_cnt = &self.ref_cnts[start];
-                        assert_eq!(
-                            ref_cnt.fetch_add(1, core::sync::atomic::Ordering::SeqCst),
-                            0
-                        );
-                        return Some((self.start + (start << PAGE_SHIFT), ref_cnt));
-                    }
-
-                    let (pos, ofs) = (search / 64, search % 64);
-                    search += 1;
-                    if self.bitmap[pos] & (1 << ofs) != 0 {
-                        // usable
-                        cont += 1;
-                    } else {
-                        break;
-                    }
+    /// Take the free block at `index` of `2^order` pages, and give back the
+    /// pages beyond the first `cnt` pages.
+    fn take_block(&mut self, index: usize, order: usize, cnt: usize) {
+        self.remove_free(index, order);
+        self.nr_free -= 1 << order;
+        self.free_range(index + cnt, (1 << order) - cnt);
+    }
+
+    /// Allocate a run larger than the maximum order by finding consecutive free
+    /// blocks of [`MAX_ORDER`].
+    fn alloc_large(&mut self, cnt: usize, align: usize) -> Option<usize> {
+        let blk = 1 << MAX_ORDER;
+        let step = align.next_power_of_two().max(blk);
+        let nblk = cnt.div_ceil(blk);
+        let mut index = self.base_pfn.next_multiple_of(step) - self.base_pfn;
+        while index + nblk * blk <= self.npages {
+            if (0..nblk).all(|i| self.orders[index + i * blk] == MAX_ORDER as u8) {
+                for i in 0..nblk {
+                    self.remove_free(index + i * blk, MAX_ORDER);
                 }
+                self.nr_free -= nblk * blk;
+                self.free_range(index + cnt, nblk * blk - cnt);
+                return Some(index);
             }
+            index += step;
         }
         None
     }
+
+    /// Allocate `cnt` pages aligned to `align` pages, and returns the index of
+    /// the first page.
+    ///
+    /// The `align` is rounded up to the power of two.
+    fn alloc_index(&mut self, cnt: usize, align: usize) -> Option<usize> {
+        let order = cnt.max(align).next_power_of_two().trailing_zeros() as usize;
+        if order <= MAX_ORDER {
+            let found = (order..=MAX_ORDER).find(|&o| self.free_lists[o] != NIL)?;
+            let index = self.free_lists[found];
+            self.take_block(index, found, cnt);
+            Some(index)
+        } else {
+            self.alloc_large(cnt, align)
+        }
+    }
+
+    /// Allocate `cnt` pages aligned to `align` pages, and take the first
+    /// reference of them.
+    fn alloc(&mut self, cnt: usize, align: usize) -> Option<(Kva, &'static AtomicU64)> {
+        let start = self.alloc_index(cnt, align)?;
+        let ref_cnt = &self.ref_cnts[start];
+        assert_eq!(
+            ref_cnt.fetch_add(1, core::sync::atomic::Ordering::SeqCst),
+            0
+        );
+        Some((self.start + (start << PAGE_SHIFT), ref_cnt))
+    }
+
     fn dealloc(&mut self, va: Kva, cnt: usize) {
         let ofs = (va.into_usize() - self.start.into_usize()) >> PAGE_SHIFT;
-        for i in ofs..ofs + cnt {
-            self.set_unused(i);
+        self.free_range(ofs, cnt);
+    }
+
+    /// Get the number of pages in the largest run of free pages.
+    ///
+    /// Adjacent free blocks that are not buddies are not merged, so the free
+    /// blocks are walked in the address order. This scans the whole arena.
+    fn largest_free_run(&self) -> usize {
+        let (mut best, mut run) = (0, 0);
+        let mut index = 0;
+        while index < self.npages {
+            match self.orders[index] {
+                NOT_FREE => {
+                    run = 0;
+                    index += 1;
+                }
+                order => {
+                    run += 1 << order;
+                    best = best.max(run);
+                    index += 1 << order;
+                }
+            }
         }
+        best
     }
+
     fn ref_cnt_for_va(&self, va: Kva) -> &'static AtomicU64 {
         &self.ref_cnts[(va - self.start) >> PAGE_SHIFT]
     }
@@ -382,29 +526,37 @@ impl Arena {
 struct PhysicalAllocator {
     inner: [Option<Arena>; 8],
     max_idx: usize,
+    /// Pages that are left to be freed at the boot.
+    eager: usize,
 }
 
 static PALLOC: SpinLock<PhysicalAllocator> = SpinLock::new(PhysicalAllocator {
     inner: [Arena::EMPTY; 8],
     max_idx: 0,
+    eager: EAGER_PAGES,
 });
 
+/// Number of the pages that are freed at the boot. The rest of the memory is
+/// freed by [`init_deferred`].
+const EAGER_PAGES: usize = 16384;
+/// Number of the deferred pages that are freed at once.
+const DEFERRED_CHUNK: usize = 8 << MAX_ORDER;
+/// Deferred pages that are not freed yet.
+static DEFERRED_PAGES: AtomicUsize = AtomicUsize::new(0);
+
 impl PhysicalAllocator {
     unsafe fn foster(&mut self, start: Kva, end: Kva) {
         unsafe {
+            let start = start.page_up();
             // Calculate usable page of this region.
             let usable_pages = (end.into_usize() - start.into_usize()) >> PAGE_SHIFT;
             let mut meta_end = start;
-            // Each region has alloc bitmap on first N pages.
-            let bitmap = core::slice::from_raw_parts_mut(
-                start.into_usize() as *mut u64,
-                usable_pages.div_ceil(64),
-            );
-            bitmap.fill(u64::MAX);
-            meta_end += 8 * bitmap.len();
-            // Array for reference counts are following to the bitmap.
-            core::slice::from_raw_parts_mut(meta_end.into_usize() as *mut u64, usable_pages)
-                .fill(0);
+            // Each region has the order of free blocks on first N pages.
+            let orders =
+                core::slice::from_raw_parts_mut(start.into_usize() as *mut u8, usable_pages);
+            orders.fill(NOT_FREE);
+            meta_end += usable_pages.next_multiple_of(8);
+            // Array for reference counts are following to the orders.
             let ref_cnts = core::slice::from_raw_parts(
                 meta_end.into_usize() as *const AtomicU64,
                 usable_pages,
@@ -412,26 +564,179 @@ impl PhysicalAllocator {
             meta_end += 8 * ref_cnts.len();
             meta_end = (meta_end + PAGE_MASK) & !PAGE_MASK;
 
+            let meta_pages = (meta_end - start) >> PAGE_SHIFT;
+            if meta_pages >= usable_pages {
+                return;
+            }
+            // Free the first pages up to the eager budget, and defer the rest.
+            // The boundary is aligned to the largest block.
+            let base_pfn = start.into_usize() >> PAGE_SHIFT;
+            let eager_end = ((base_pfn + meta_pages + self.eager).next_multiple_of(1 << MAX_ORDER)
+                - base_pfn)
+                .min(usable_pages);
+            self.eager = self.eager.saturating_sub(eager_end - meta_pages);
+            clear_ref_cnts(&ref_cnts[..eager_end]);
+            DEFERRED_PAGES.fetch_add(usable_pages - eager_end, Ordering::SeqCst);
             let mut arena = Arena {
-                bitmap,
                 start,
                 end,
+                base_pfn,
+                npages: usable_pages,
+                orders,
+                free_lists: [NIL; MAX_ORDER + 1],
+                nr_free: 0,
                 ref_cnts,
+                deferred: eager_end..usable_pages,
             };
-            // Pad front.
-            for i in 0..(meta_end - start) >> PAGE_SHIFT {
-                arena.set_used(i);
-            }
-            // Pad back.
-            for i in usable_pages..((usable_pages + 63) & !63) {
-                arena.set_used(i);
-            }
+            arena.free_range(meta_pages, eager_end - meta_pages);
             self.inner[self.max_idx] = Some(arena);
             self.max_idx += 1;
         }
     }
 }
 
+/// Clear the reference counts, which are not shared yet.
+fn clear_ref_cnts(ref_cnts: &[AtomicU64]) {
+    unsafe {
+        core::ptr::write_bytes(ref_cnts.as_ptr() as *mut AtomicU64, 0, ref_cnts.len());
+    }
+}
+
+/// Free a chunk of the deferred pages. Returns false if no chunk is left.
+fn free_deferred_chunk() -> bool {
+    let mut allocator = PALLOC.lock();
+    let max_idx = allocator.max_idx;
+    let Some((arena_idx, chunk, ref_cnts)) = allocator
+        .inner
+        .iter_mut()
+        .take(max_idx)
+        .enumerate()
+        .find_map(|(arena_idx, arena)| {
+            let arena = arena.as_mut().unwrap();
+            if arena.deferred.is_empty() {
+                return None;
+            }
+            let start = arena.deferred.start;
+            let end = arena.deferred.end.min(start + DEFERRED_CHUNK);
+            arena.deferred.start = end;
+            Some((arena_idx, start..end, arena.ref_cnts))
+        })
+    else {
+        allocator.unlock();
+        return false;
+    };
+    allocator.unlock();
+
+    // No one else touches the pages of the chunk until they are freed.
+    clear_ref_cnts(&ref_cnts[chunk.clone()]);
+    let mut allocator = PALLOC.lock();
+    allocator.inner[arena_idx]
+        .as_mut()
+        .unwrap()
+        .free_range(chunk.start, chunk.len());
+    allocator.unlock();
+    DEFERRED_PAGES.fetch_sub(chunk.len(), Ordering::SeqCst);
+    true
+}
+
+/// Free the memory that is deferred at the boot.
+///
+/// Every cpu calls this once it is online, so that the reference counts
+/// of the pages are cleared in parallel. It returns after all the memory is
+/// freed.
+#[doc(hidden)]
+pub fn init_deferred() {
+    while free_deferred_chunk() {}
+    while DEFERRED_PAGES.load(Ordering::SeqCst) != 0 {
+        core::hint::spin_loop();
+    }
+}
+
+/// Maximum number of pages that a per-cpu page list holds.
+const PCP_HIGH: usize = 64;
+/// Number of pages moved between a per-cpu page list and the arenas at once.
+const PCP_BATCH: usize = 16;
+
+/// A free page cached in a per-cpu page list.
+///
+/// The page is allocated from the view of its arena, but its reference count
+/// stays zero until it is handed out.
+#[derive(Clone, Copy)]
+struct PcpPage {
+    arena_idx: usize,
+    kva: Kva,
+    ref_cnt: &'static AtomicU64,
+}
+
+/// A list of free single pages owned by a cpu.
+struct PageList {
+    cnt: usize,
+    pages: [Option<PcpPage>; PCP_HIGH],
+}
+
+impl PageList {
+    const fn new() -> Self {
+        Self {
+            cnt: 0,
+            pages: [None; PCP_HIGH],
+        }
+    }
+
+    /// Refill the list with up to [`PCP_BATCH`] pages from the arenas.
+    fn refill(&mut self) {
+        let mut allocator = PALLOC.lock();
+        let max_idx = allocator.max_idx;
+        for (arena_idx, arena) in allocator.inner.iter_mut().take(max_idx).enumerate() {
+            let arena = arena.as_mut().unwrap();
+            let ref_cnts = arena.ref_cnts;
+            while self.cnt < PCP_BATCH {
+                let Some(index) = arena.alloc_index(1, 1) else {
+                    break;
+                };
+                self.pages[self.cnt] = Some(PcpPage {
+                    arena_idx,
+                    kva: arena.start + (index << PAGE_SHIFT),
+                    ref_cnt: &ref_cnts[index],
+                });
+                self.cnt += 1;
+            }
+        }
+        allocator.unlock();
+    }
+
+    /// Give back up to `cnt` pages to the arenas.
+    fn drain(&mut self, cnt: usize) {
+        let mut allocator = PALLOC.lock();
+        for _ in 0..cnt.min(self.cnt) {
+            self.cnt -= 1;
+            let PcpPage { arena_idx, kva, .. } = self.pages[self.cnt].take().unwrap();
+            allocator.inner[arena_idx].as_mut().unwrap().dealloc(kva, 1);
+        }
+        allocator.unlock();
+    }
+}
+
+/// A per-cpu page list.
+///
+/// The lock is almost always taken by the owning cpu, so it never bounces
+/// between cores. Other cpus only take it to reclaim the cached pages when the
+/// arenas run out of memory.
+#[repr(align(64))]
+struct PerCpuPages(SpinLock<PageList>);
+
+static PCP: [PerCpuPages; abyss::MAX_CPU] =
+    [const { PerCpuPages(SpinLock::new(PageList::new())) }; abyss::MAX_CPU];
+
+/// Give back all pages cached in the per-cpu page lists to the arenas.
+fn drain_all_pcp() {
+    for pcp in PCP.iter() {
+        let mut list = pcp.0.lock();
+        let cnt = list.cnt;
+        list.drain(cnt);
+        list.unlock();
+    }
+}
+
 /// A contiguous pages representation.
 pub struct ContigPages {
     arena_idx: usize,
@@ -463,34 +768,108 @@ impl ContigPages {
     /// Allocate a page with align
     #[inline]
     pub fn new_with_align(size: usize, align: usize) -> Option<Self> {
-        if size != 0 {
-            // align up to page size.
-            let cnt = (size + PAGE_MASK) >> PAGE_SHIFT;
-            let mut allocator = PALLOC.lock();
-            let max_idx = allocator.max_idx;
-            for (arena_idx, arena) in allocator.inner.iter_mut().take(max_idx).enumerate() {
-                if let Some((kva, ref_cnt)) =
-                    arena.as_mut().unwrap().alloc(cnt, align >> PAGE_SHIFT)
-                {
-                    unsafe {
-                        core::slice::from_raw_parts_mut(
-                            kva.into_usize() as *mut u64,
-                            cnt * 0x1000 / core::mem::size_of::<u64>(),
-                        )
-                        .fill(0);
-                    }
-                    allocator.unlock();
-                    return Some(Self {
+        if size == 0 {
+            return None;
+        }
+        // align up to page size.
+        let cnt = (size + PAGE_MASK) >> PAGE_SHIFT;
+        if cnt == 1
+            && align <= 0x1000
+            && let Some(page) = zero_pool::take()
+        {
+            return Some(page);
+        }
+        let page = Self::alloc_uninit(cnt, align)?;
+        unsafe {
+            core::slice::from_raw_parts_mut(
+                page.kva.into_usize() as *mut u64,
+                cnt * 0x1000 / core::mem::size_of::<u64>(),
+            )
+            .fill(0);
+        }
+        Some(page)
+    }
+
+    /// Allocate `cnt` pages without clearing its contents.
+    fn alloc_uninit(cnt: usize, align: usize) -> Option<Self> {
+        if cnt == 1 && align <= 0x1000 {
+            Self::alloc_from_pcp()
+        } else {
+            None
+        }
+        .or_else(|| Self::alloc_from_arena(cnt, align))
+        .or_else(|| {
+            // Reclaim the pages cached on the per-cpu lists and the zeroed
+            // pages, and try again.
+            zero_pool::drain();
+            drain_all_pcp();
+            Self::alloc_from_arena(cnt, align)
+        })
+        .or_else(|| {
+            // A large allocation at the boot may need the deferred memory.
+            while free_deferred_chunk() {
+                if let Some(page) = Self::alloc_from_arena(cnt, align) {
+                    return Some(page);
+                }
+            }
+            None
+        })
+    }
+
+    /// Allocate a single page from the current cpu's page list.
+    fn alloc_from_pcp() -> Option<Self> {
+        let mut list = PCP[abyss::x86_64::intrinsics::cpuid()].0.lock();
+        if list.cnt == 0 {
+            list.refill();
+        }
+        let page = if list.cnt != 0 {
+            let idx = list.cnt - 1;
+            list.cnt = idx;
+            list.pages[idx].take()
+        } else {
+            None
+        };
+        list.unlock();
+        page.map(
+            |PcpPage {
+                 arena_idx,
+                 kva,
+                 ref_cnt,
+             }| {
+                assert_eq!(ref_cnt.fetch_add(1, Ordering::SeqCst), 0);
+                Self {
+                    arena_idx,
+                    kva,
+                    cnt: 1,
+                    ref_cnt,
+                }
+            },
+        )
+    }
+
+    /// Allocate `cnt` pages from the arenas.
+    fn alloc_from_arena(cnt: usize, align: usize) -> Option<Self> {
+        let mut allocator = PALLOC.lock();
+        let max_idx = allocator.max_idx;
+        let page = allocator
+            .inner
+            .iter_mut()
+            .take(max_idx)
+            .enumerate()
+            .find_map(|(arena_idx, arena)| {
+                arena
+                    .as_mut()
+                    .unwrap()
+                    .alloc(cnt, align >> PAGE_SHIFT)
+                    .map(|(kva, ref_cnt)| Self {
                         arena_idx,
                         kva,
                         cnt,
                         ref_cnt,
-                    });
-                }
-            }
-            allocator.unlock();
-        }
-        None
+                    })
+            });
+        allocator.unlock();
+        page
     }
 
     /// Get virtual address of this page.
@@ -499,6 +878,12 @@ impl ContigPages {
         self.kva
     }
 
+    /// Get the number of the references to these pages.
+    #[inline]
+    pub fn ref_count(&self) -> usize {
+        self.ref_cnt.load(Ordering::SeqCst) as usize
+    }
+
     /// Constructs a page from a kva.
     ///
     /// ## Safety
@@ -508,6 +893,29 @@ impl ContigPages {
     #[inline]
     pub unsafe fn from_va(kva: Kva, size: usize) -> Self {
         let allocator = PALLOC.lock();
+        let page = Self::lookup(&allocator, kva, size);
+        allocator.unlock();
+        page
+    }
+
+    /// Take a new reference of each of the allocated `pages`, given as the
+    /// kva and the size, with a single acquisition of the allocator lock.
+    pub(crate) fn clone_many(pages: &[(Kva, usize)]) -> Vec<Self> {
+        let allocator = PALLOC.lock();
+        let out = pages
+            .iter()
+            .map(|&(kva, size)| {
+                let page = Self::lookup(&allocator, kva, size);
+                page.ref_cnt.fetch_add(1, Ordering::SeqCst);
+                page
+            })
+            .collect();
+        allocator.unlock();
+        out
+    }
+
+    /// Find the allocated pages at `kva` without taking a reference.
+    fn lookup(allocator: &PhysicalAllocator, kva: Kva, size: usize) -> Self {
         let arena_idx = allocator
             .inner
             .iter()
@@ -530,18 +938,18 @@ impl ContigPages {
             ref_cnt.load(Ordering::SeqCst) >= 1,
             "Tried to call `from_va()` on unallocated page."
         );
-        let page = ContigPages {
+        ContigPages {
             arena_idx,
             kva,
             cnt: size / 4096,
             ref_cnt,
-        };
-        allocator.unlock();
-        page
+        }
     }
 
     /// Split the ContigPages into multiple pages.
+    #[track_caller]
     pub fn split(self) -> Vec<Page> {
+        let loc = core::panic::Location::caller();
         let mut out = Vec::new();
         assert_eq!(self.ref_cnt.load(Ordering::SeqCst), 1);
         let this = core::mem::ManuallyDrop::new(self);
@@ -550,16 +958,19 @@ impl ContigPages {
                 &core::slice::from_raw_parts(this.ref_cnt as *const AtomicU64, this.cnt)[i]
             };
             if i != 0 {
-                assert_eq!(ref_cnt.fetch_add(1, Ordering::SeqCst), 1);
+                assert_eq!(ref_cnt.fetch_add(1, Ordering::SeqCst), 0);
             }
-            out.push(Page {
-                inner: ContigPages {
-                    arena_idx: this.arena_idx,
-                    kva: this.kva + i * 0x1000,
-                    cnt: 1,
-                    ref_cnt,
-                },
-            })
+            out.push(
+                Page {
+                    inner: ContigPages {
+                        arena_idx: this.arena_idx,
+                        kva: this.kva + i * 0x1000,
+                        cnt: 1,
+                        ref_cnt,
+                    },
+                }
+                .track(loc),
+            )
         }
         out
     }
@@ -568,6 +979,21 @@ impl ContigPages {
 impl Drop for ContigPages {
     fn drop(&mut self) {
         if self.ref_cnt.fetch_sub(1, Ordering::SeqCst) == 1 {
+            if self.cnt == 1 {
+                let mut list = PCP[abyss::x86_64::intrinsics::cpuid()].0.lock();
+                if list.cnt == PCP_HIGH {
+                    list.drain(PCP_BATCH);
+                }
+                let idx = list.cnt;
+                list.pages[idx] = Some(PcpPage {
+                    arena_idx: self.arena_idx,
+                    kva: self.kva,
+                    ref_cnt: self.ref_cnt,
+                });
+                list.cnt += 1;
+                list.unlock();
+                return;
+            }
             let mut allocator = PALLOC.lock();
             allocator.inner[self.arena_idx]
                 .as_mut()
@@ -1,13 +1,19 @@
 //! Entries of Page Table and thier permissions.
 use crate::{
-    addressing::{Pa, Va},
-    mm::{Page, tlb::TlbIpi},
+    addressing::{PAGE_SIZE, Pa, Va},
+    mm::{
+        ContigPages, Page,
+        tlb::{PCID_MASK, TlbGather, TlbIpi, forget_pcid, tagged_cr3},
+    },
     sync::atomic::AtomicUsize,
 };
 use abyss::{MAX_CPU, x86_64::Cr3};
 use alloc::boxed::Box;
 use core::ops::Deref;
 
+/// Size of a huge page that a [`Pde`] maps directly.
+pub const HUGE_PAGE_SIZE: usize = 0x200000;
+
 bitflags::bitflags! {
     /// Flags for pml4e.
     pub struct Pml4eFlags: usize {
@@ -555,6 +561,39 @@ impl Pde {
         })
     }
 
+    /// Check whether this entry maps a 2MiB page.
+    ///
+    /// A present entry with the "PS" flag maps the [`HUGE_PAGE_SIZE`] bytes of
+    /// physical memory directly, instead of pointing to a page table.
+    #[inline]
+    pub const fn is_huge(&self) -> bool {
+        self.flags().contains(PdeFlags::P) && self.flags().contains(PdeFlags::PS)
+    }
+
+    /// Set the physical address of a 2MiB page for this entry.
+    ///
+    /// Unlike [`Pde::set_pa`], this marks the entry with the "PS" flag, so the
+    /// entry maps the physical memory starting at `pa` directly.
+    ///
+    /// # Returns
+    /// - `Ok(&mut Self)` if the address is valid and the update is successful.
+    /// - `Err(PageTableMappingError::Unaligned)` if the provided physical
+    ///   address is not aligned to [`HUGE_PAGE_SIZE`].
+    ///
+    /// # Warning
+    /// This operation does not modify the other flags of the entry. Keep the
+    /// "PS" flag when calling [`Pde::set_flags`] on a huge entry.
+    #[inline]
+    pub fn set_huge_pa(&mut self, pa: Pa) -> Result<&mut Self, PageTableMappingError> {
+        let pa = pa.into_usize();
+        if pa & (HUGE_PAGE_SIZE - 1) != 0 {
+            Err(PageTableMappingError::Unaligned)
+        } else {
+            self.0 = pa | self.flags().bits() | PdeFlags::P.bits() | PdeFlags::PS.bits();
+            Ok(self)
+        }
+    }
+
     /// Get a mutable reference to the page table pointed to by this entry.
     ///
     /// This method retrieves a mutable reference to the page table that this
@@ -566,6 +605,8 @@ impl Pde {
     ///   slice of `Pte` (page table entries).
     /// - `Err(PageTableMappingError::NotExist)` if the page directory entry is
     ///   not present or invalid.
+    /// - `Err(PageTableMappingError::HugePage)` if the page directory entry
+    ///   maps a 2MiB page.
     ///
     /// # Safety
     /// This operation assumes that the physical address of the page table is
@@ -576,6 +617,9 @@ impl Pde {
         if !self.flags().contains(PdeFlags::P) {
             return Err(PageTableMappingError::NotExist);
         }
+        if self.flags().contains(PdeFlags::PS) {
+            return Err(PageTableMappingError::HugePage);
+        }
         unsafe {
             Ok(core::slice::from_raw_parts_mut(
                 pa.into_kva().into_usize() as *mut Pte,
@@ -595,6 +639,8 @@ impl Pde {
     ///   slice of `Pte` (page table entries).
     /// - `Err(PageTableMappingError::NotExist)` if the page directory entry is
     ///   not present or invalid.
+    /// - `Err(PageTableMappingError::HugePage)` if the page directory entry
+    ///   maps a 2MiB page.
     ///
     /// # Safety
     /// This operation assumes that the physical address of the page table is
@@ -605,6 +651,9 @@ impl Pde {
         if !self.flags().contains(PdeFlags::P) {
             return Err(PageTableMappingError::NotExist);
         }
+        if self.flags().contains(PdeFlags::PS) {
+            return Err(PageTableMappingError::HugePage);
+        }
         unsafe {
             Ok(core::slice::from_raw_parts(
                 pa.into_kva().into_usize() as *const Pte,
@@ -859,18 +908,19 @@ impl StaleTLBEntry {
     pub fn invalidate(self) -> Page {
         let va = self.0;
         let page = unsafe { core::ptr::read(&core::mem::ManuallyDrop::new(self).1) };
-
-        unsafe {
-            core::arch::asm!(
-                "invlpg [{0}]",
-                in(reg) va.into_usize(),
-                options(nostack)
-            );
-        }
-
-        TlbIpi::send(Cr3::current(), Some(va));
+        invalidate_va(va);
         page
     }
+
+    /// Defer the invalidation to the `gather`.
+    ///
+    /// The page is freed when the `gather` is flushed. Use this to invalidate
+    /// many entries with a single TLB shootdown.
+    pub fn gather(self, gather: &mut TlbGather) {
+        let va = self.0;
+        let page = unsafe { core::ptr::read(&core::mem::ManuallyDrop::new(self).1) };
+        gather.push(va, page);
+    }
 }
 
 impl Drop for StaleTLBEntry {
@@ -882,6 +932,80 @@ impl Drop for StaleTLBEntry {
     }
 }
 
+/// Struct for invalidating the TLB entry of a 2MiB page.
+///
+/// This is the counterpart of [`StaleTLBEntry`] for a huge page mapping. It
+/// holds the [`HUGE_PAGE_SIZE`] bytes of pages until the TLB entry is
+/// invalidated.
+pub struct StaleHugeTLBEntry(Va, ContigPages);
+
+impl core::ops::Deref for StaleHugeTLBEntry {
+    type Target = ContigPages;
+    fn deref(&self) -> &Self::Target {
+        &self.1
+    }
+}
+
+impl StaleHugeTLBEntry {
+    /// Create a new StaleHugeTLBEntry.
+    pub fn new(va: Va, pages: ContigPages) -> Self {
+        Self(va, pages)
+    }
+
+    /// Invalidate the underlying virtual address.
+    ///
+    /// A single `invlpg` on any address within a huge page drops the whole
+    /// 2MiB translation.
+    pub fn invalidate(self) -> ContigPages {
+        let va = self.0;
+        let pages = unsafe { core::ptr::read(&core::mem::ManuallyDrop::new(self).1) };
+        invalidate_va(va);
+        pages
+    }
+
+    /// Defer the invalidation to the `gather`.
+    ///
+    /// The pages are freed when the `gather` is flushed.
+    pub fn gather(self, gather: &mut TlbGather) {
+        let va = self.0;
+        let pages = unsafe { core::ptr::read(&core::mem::ManuallyDrop::new(self).1) };
+        gather.push_huge(va, pages);
+    }
+}
+
+impl Drop for StaleHugeTLBEntry {
+    fn drop(&mut self) {
+        panic!(
+            "TLB entry for {:?} is not invalidated. You must call `.invalidate()`.",
+            self.0,
+        );
+    }
+}
+
+/// Invalidate the TLB entry for `va` of the current page table on every cpu.
+fn invalidate_va(va: Va) {
+    invalidate_va_of(Cr3::current().into_usize() & !PCID_MASK, va);
+}
+
+/// Invalidate the TLB entry for `va` of the page table at `pgtbl_pa` on every
+/// cpu.
+///
+/// The page table need not be the current one. The cpus that are not running
+/// it, including this one, forget its PCID instead.
+fn invalidate_va_of(pgtbl_pa: usize, va: Va) {
+    if Cr3::current().into_usize() & !PCID_MASK == pgtbl_pa {
+        unsafe {
+            core::arch::asm!(
+                "invlpg [{0}]",
+                in(reg) va.into_usize(),
+                options(nostack)
+            );
+        }
+    }
+
+    TlbIpi::send(Cr3(pgtbl_pa as u64), Some(va));
+}
+
 /// Shutdown the TLB.
 ///
 /// This method issues an assembly instruction to invalidate all TLB
@@ -892,7 +1016,7 @@ pub fn tlb_shutdown(pgtbl: &PageTableRoot) {
     let pgtbl_pa = pgtbl.pa().into_usize();
     let curr_cr3 = Cr3::current();
 
-    if pgtbl_pa == curr_cr3.into_usize() {
+    if pgtbl_pa == curr_cr3.into_usize() & !PCID_MASK {
         unsafe {
             core::arch::asm! {
                 "mov rax, cr3",
@@ -939,6 +1063,12 @@ pub enum PageTableMappingError {
     /// This error is returned when an attempt is made to create a mapping with
     /// an invalid permission.
     InvalidPermission,
+
+    /// Huge page.
+    ///
+    /// This error is returned when an entry maps a 2MiB page directly, while
+    /// the operation expects the entry to point to a page table.
+    HugePage,
 }
 
 bitflags::bitflags! {
@@ -1055,6 +1185,13 @@ impl core::ops::IndexMut<usize> for PageTableRoot {
     }
 }
 
+impl Drop for PageTableRoot {
+    fn drop(&mut self) {
+        // The physical address can be reused by another page table.
+        forget_pcid(self.pa().into_usize(), true);
+    }
+}
+
 impl PageTableRoot {
     /// Base of pml4 index occupied for kernel address.
     pub const KBASE: usize = 256;
@@ -1091,6 +1228,221 @@ impl PageTableRoot {
             .unwrap()
             .into_pa()
     }
+
+    /// Get the page directory entry covering `va`.
+    ///
+    /// If `create` is true, the missing intermediate tables are allocated.
+    fn pde_mut(&mut self, va: Va, create: bool) -> Result<&mut Pde, PageTableMappingError> {
+        let va = va.into_usize();
+        let pml4e = &mut self[(va >> 39) & 0x1ff];
+        if create && pml4e.pa().is_none() {
+            pml4e
+                .set_pa(Page::new().into_raw())?
+                .set_flags(Pml4eFlags::P | Pml4eFlags::RW | Pml4eFlags::US);
+        }
+        let pdpe = &mut pml4e.into_pdp_mut()?[(va >> 30) & 0x1ff];
+        if create && pdpe.pa().is_none() {
+            pdpe.set_pa(Page::new().into_raw())?
+                .set_flags(PdpeFlags::P | PdpeFlags::RW | PdpeFlags::US);
+        }
+        Ok(&mut pdpe.into_pd_mut()?[(va >> 21) & 0x1ff])
+    }
+
+    /// Map the page `pg` read-only for the user at `va`, allocating the
+    /// intermediate tables on demand.
+    ///
+    /// # Returns
+    /// - `Err(PageTableMappingError::Duplicated)` if `va` is already mapped.
+    pub(crate) fn map_user_ro(&mut self, va: Va, pg: Page) -> Result<(), PageTableMappingError> {
+        let pde = self.pde_mut(va, true)?;
+        if pde.pa().is_none() {
+            pde.set_pa(Page::new().into_raw())?
+                .set_flags(PdeFlags::P | PdeFlags::RW | PdeFlags::US);
+        }
+        let pte = &mut pde.into_pt_mut()?[(va.into_usize() >> 12) & 0x1ff];
+        if pte.pa().is_some() {
+            return Err(PageTableMappingError::Duplicated);
+        }
+        unsafe {
+            pte.set_pa(pg.into_raw())?
+                .set_flags(PteFlags::P | PteFlags::US | PteFlags::XD);
+        }
+        Ok(())
+    }
+
+    /// Map a 2MiB page at `va` with the given `flags`.
+    ///
+    /// `pages` must be [`HUGE_PAGE_SIZE`] bytes of contiguous pages that are
+    /// aligned to [`HUGE_PAGE_SIZE`], e.g., allocated with
+    /// [`ContigPages::new_with_align`]. The intermediate tables are allocated
+    /// on demand.
+    ///
+    /// # Returns
+    /// - `Err(PageTableMappingError::Unaligned)` if either `va` or `pages` is
+    ///   not aligned to [`HUGE_PAGE_SIZE`].
+    /// - `Err(PageTableMappingError::Duplicated)` if any part of the 2MiB
+    ///   region is already mapped.
+    pub fn map_huge(
+        &mut self,
+        va: Va,
+        pages: ContigPages,
+        flags: PdeFlags,
+    ) -> Result<(), PageTableMappingError> {
+        let pa = pages.kva().into_pa();
+        if va.into_usize() & (HUGE_PAGE_SIZE - 1) != 0
+            || pa.into_usize() & (HUGE_PAGE_SIZE - 1) != 0
+            || pages.cnt * 0x1000 != HUGE_PAGE_SIZE
+        {
+            return Err(PageTableMappingError::Unaligned);
+        }
+        let pde = self.pde_mut(va, true)?;
+        if pde.flags().contains(PdeFlags::P) {
+            return Err(PageTableMappingError::Duplicated);
+        }
+        pde.set_huge_pa(pa)?
+            .set_flags(flags | PdeFlags::P | PdeFlags::PS);
+        core::mem::forget(pages);
+        Ok(())
+    }
+
+    /// Find the huge page entry that maps `va`.
+    ///
+    /// `va` can be any address within the 2MiB region.
+    ///
+    /// # Returns
+    /// - `Err(PageTableMappingError::NotExist)` if `va` is not mapped with a
+    ///   huge page.
+    pub fn walk_huge(&self, va: Va) -> Result<&Pde, PageTableMappingError> {
+        let va = va.into_usize();
+        let pde = &self[(va >> 39) & 0x1ff].into_pdp()?[(va >> 30) & 0x1ff].into_pd()?
+            [(va >> 21) & 0x1ff];
+        if pde.is_huge() {
+            Ok(pde)
+        } else {
+            Err(PageTableMappingError::NotExist)
+        }
+    }
+
+    /// Translate `va` into the physical address that it is mapped to.
+    ///
+    /// Both 4KiB and 2MiB mappings are resolved. Returns `None` if `va` is
+    /// not mapped, or the mapping is not accessible from the user mode.
+    pub fn translate_user(&self, va: Va) -> Option<Pa> {
+        self.user_mapping(va, false)
+            .map(|(base, size)| base + (va.into_usize() & (size - 1)))
+    }
+
+    /// Find the user mapping that covers `va`.
+    ///
+    /// Returns the physical address and the size of the page that maps `va`,
+    /// which is either [`PAGE_SIZE`] or [`HUGE_PAGE_SIZE`]. If `write` is set,
+    /// the mapping must also be writable, so that a copy-on-write page is
+    /// reported as `None`.
+    pub fn user_mapping(&self, va: Va, write: bool) -> Option<(Pa, usize)> {
+        let va = va.into_usize();
+        let pml4e = &self[(va >> 39) & 0x1ff];
+        let pdpe = &pml4e.into_pdp().ok()?[(va >> 30) & 0x1ff];
+        let pde = &pdpe.into_pd().ok()?[(va >> 21) & 0x1ff];
+        if !pml4e.flags().contains(Pml4eFlags::US)
+            || !pdpe.flags().contains(PdpeFlags::US)
+            || !pde.flags().contains(PdeFlags::P | PdeFlags::US)
+            || (write
+                && !(pml4e.flags().contains(Pml4eFlags::RW)
+                    && pdpe.flags().contains(PdpeFlags::RW)
+                    && pde.flags().contains(PdeFlags::RW)))
+        {
+            return None;
+        }
+        if pde.is_huge() {
+            return Some((pde.pa()?, HUGE_PAGE_SIZE));
+        }
+        let pte = &pde.into_pt().ok()?[(va >> 12) & 0x1ff];
+        if !pte.flags().contains(PteFlags::P | PteFlags::US)
+            || (write && !pte.flags().contains(PteFlags::RW))
+        {
+            return None;
+        }
+        Some((pte.pa()?, PAGE_SIZE))
+    }
+
+    /// Unmap the 2MiB page at `va`.
+    ///
+    /// The caller must invalidate the returned [`StaleHugeTLBEntry`] to get
+    /// back the pages.
+    ///
+    /// # Returns
+    /// - `Err(PageTableMappingError::Unaligned)` if `va` is not aligned to
+    ///   [`HUGE_PAGE_SIZE`].
+    /// - `Err(PageTableMappingError::NotExist)` if `va` is not mapped with a
+    ///   huge page.
+    pub fn unmap_huge(&mut self, va: Va) -> Result<StaleHugeTLBEntry, PageTableMappingError> {
+        if va.into_usize() & (HUGE_PAGE_SIZE - 1) != 0 {
+            return Err(PageTableMappingError::Unaligned);
+        }
+        let pde = self.pde_mut(va, false)?;
+        if !pde.is_huge() {
+            return Err(PageTableMappingError::NotExist);
+        }
+        let pa = pde.clear().unwrap();
+        Ok(StaleHugeTLBEntry::new(va, unsafe {
+            ContigPages::from_va(pa.into_kva(), HUGE_PAGE_SIZE)
+        }))
+    }
+
+    /// Split the 2MiB page that maps `va` into 512 pages.
+    ///
+    /// The huge entry is replaced with a page table whose entries map the same
+    /// physical pages with the same flags. Afterward, each page can be
+    /// unmapped individually, e.g. on a partial munmap. `va` can be any
+    /// address within the 2MiB region.
+    ///
+    /// The page table need not be the one that is currently loaded. The TLB
+    /// entry of the huge page is invalidated on the cpus that run this page
+    /// table.
+    ///
+    /// # Returns
+    /// - `Err(PageTableMappingError::NotExist)` if `va` is not mapped with a
+    ///   huge page.
+    ///
+    /// # Panics
+    /// Panics if the huge page is shared with another mapping.
+    pub fn split_huge(&mut self, va: Va) -> Result<(), PageTableMappingError> {
+        let va = Va::new(va.into_usize() & !(HUGE_PAGE_SIZE - 1)).unwrap();
+        let pgtbl_pa = self.pa().into_usize();
+        let pde = self.pde_mut(va, false)?;
+        if !pde.is_huge() {
+            return Err(PageTableMappingError::NotExist);
+        }
+        let pa = pde.pa().unwrap();
+        // PAT of the page table entry is at the position of PS.
+        let flags = PteFlags::from_bits_truncate(pde.flags().bits() & !PdeFlags::PS.bits());
+        // Fill the page table before it replaces the huge entry. On an error,
+        // the huge entry is left intact and the table is freed.
+        let mut pt = Page::new();
+        let ptes = unsafe {
+            core::slice::from_raw_parts_mut(pt.inner_mut().as_mut_ptr() as *mut Pte, 512)
+        };
+        for (i, pte) in ptes.iter_mut().enumerate() {
+            unsafe {
+                pte.set_pa(pa + i * PAGE_SIZE)?.set_flags(flags);
+            }
+        }
+        let mut entry = Pde(0);
+        entry
+            .set_pa(pt.pa())?
+            .set_flags(PdeFlags::P | PdeFlags::RW | PdeFlags::US);
+
+        // Each entry of the table owns its page from now on.
+        let pages = unsafe { ContigPages::from_va(pa.into_kva(), HUGE_PAGE_SIZE) };
+        for page in pages.split() {
+            page.into_raw();
+        }
+        pt.into_raw();
+        *pde = entry;
+        // Page size of the translation is changed.
+        invalidate_va_of(pgtbl_pa, va);
+        Ok(())
+    }
 }
 
 #[doc(hidden)]
@@ -1098,19 +1450,23 @@ pub(crate) static ACTIVE_PAGE_TABLES: [AtomicUsize; MAX_CPU] =
     [const { AtomicUsize::new(0) }; MAX_CPU];
 
 /// Load page table by given physical address.
+///
+/// If the cpu supports PCID, the page table is loaded with its PCID, and the
+/// TLB entries of the page table that remain from its last run are reused.
 #[inline]
 pub fn load_pt(pa: Pa) {
-    if abyss::x86_64::Cr3::current().into_usize() != pa.into_usize() {
+    if abyss::x86_64::Cr3::current().into_usize() & !PCID_MASK != pa.into_usize() {
         // println!("RELOAD PT {:?}", pa);
+        let _guard = abyss::interrupt::InterruptGuard::new();
         ACTIVE_PAGE_TABLES[abyss::x86_64::intrinsics::cpuid()].store(pa.into_usize());
-        unsafe { abyss::x86_64::Cr3(pa.into_usize() as u64).apply() }
+        unsafe { tagged_cr3(pa.into_usize()).apply() }
     }
 }
 
 /// Get current page table's physical address.
 #[inline]
 pub fn get_current_pt_pa() -> Pa {
-    let addr = abyss::x86_64::Cr3::current().into_usize();
+    let addr = abyss::x86_64::Cr3::current().into_usize() & !PCID_MASK;
     assert_eq!(
         ACTIVE_PAGE_TABLES[abyss::x86_64::intrinsics::cpuid()].load(),
         addr
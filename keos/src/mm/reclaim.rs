@@ -0,0 +1,90 @@
+//! Reclaim of the physical memory.
+//!
+//! When the page allocator runs out of memory, [`Page::new`] asks the
+//! registered [`Shrinker`]s to release pages before it gives up. A shrinker
+//! owns a cache of pages that can be dropped without losing any data, e.g.,
+//! the clean slots of a page cache, which are read again from the disk on
+//! their next use.
+//!
+//! The shrinkers are asked in the order of their registration until enough
+//! pages are released, so the cheapest ones should be registered first.
+//!
+//! A shrinker is called from the allocating thread, which may hold any lock.
+//! It must not block on a lock that an allocating thread may hold; use a
+//! `try_lock` and give up instead. The reclaim is skipped while the
+//! interrupts are disabled, and is never nested.
+#[cfg(doc)]
+use super::Page;
+use crate::sync::SpinLock;
+use abyss::interrupt::InterruptGuard;
+use alloc::{sync::Arc, vec::Vec};
+use core::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+
+/// Number of the pages that a failed allocation asks to release.
+pub const RECLAIM_BATCH: usize = 32;
+
+/// A cache of pages that can be released under memory pressure.
+pub trait Shrinker: Send + Sync {
+    /// Release up to `nr_pages` pages, and return the number of the released
+    /// pages.
+    fn shrink(&self, nr_pages: usize) -> usize;
+}
+
+static SHRINKERS: SpinLock<Vec<Arc<dyn Shrinker>>> = SpinLock::new(Vec::new());
+static RECLAIMING: AtomicBool = AtomicBool::new(false);
+static RECLAIMED: AtomicU64 = AtomicU64::new(0);
+static STALLS: AtomicU64 = AtomicU64::new(0);
+
+/// Register a shrinker.
+pub fn register(shrinker: Arc<dyn Shrinker>) {
+    let mut guard = SHRINKERS.lock();
+    guard.push(shrinker);
+    guard.unlock();
+}
+
+/// Unregister a shrinker.
+pub fn unregister(shrinker: &Arc<dyn Shrinker>) {
+    let mut guard = SHRINKERS.lock();
+    guard.retain(|s| !Arc::ptr_eq(s, shrinker));
+    guard.unlock();
+}
+
+/// Ask the shrinkers to release `nr_pages` pages.
+///
+/// Returns the number of the released pages.
+pub fn reclaim(nr_pages: usize) -> usize {
+    if InterruptGuard::is_guarded() || RECLAIMING.swap(true, Ordering::Acquire) {
+        return 0;
+    }
+    STALLS.fetch_add(1, Ordering::Relaxed);
+    let guard = SHRINKERS.lock();
+    let shrinkers = guard.clone();
+    guard.unlock();
+    let mut released = 0;
+    for shrinker in shrinkers {
+        if released >= nr_pages {
+            break;
+        }
+        released += shrinker.shrink(nr_pages - released);
+    }
+    RECLAIMED.fetch_add(released as u64, Ordering::Relaxed);
+    RECLAIMING.store(false, Ordering::Release);
+    released
+}
+
+/// Counters of the reclaim.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct ReclaimStat {
+    /// Allocations that ran the shrinkers.
+    pub stalls: u64,
+    /// Pages released by the shrinkers.
+    pub reclaimed: u64,
+}
+
+/// Returns the counters of the reclaim.
+pub fn stat() -> ReclaimStat {
+    ReclaimStat {
+        stalls: STALLS.load(Ordering::Relaxed),
+        reclaimed: RECLAIMED.load(Ordering::Relaxed),
+    }
+}
@@ -0,0 +1,119 @@
+//! Statistics of the memory allocators.
+//!
+//! The counters are always on, and cheap enough to be updated on every
+//! allocation: each cpu counts on its own cache line without a locked
+//! instruction. Use [`slab`] and [`arenas`] to read the statistics, or
+//! [`dump`] to print them on the console.
+use super::{Arena, BytePP, PALLOC, PCP};
+use crate::addressing::{Kva, PAGE_SHIFT};
+use alloc::{string::ToString, vec::Vec};
+
+/// Statistics of a size class of the slab allocator.
+#[derive(Clone, Copy, Debug)]
+pub struct SlabStats {
+    /// Size of a block in this class.
+    pub size: usize,
+    /// Number of allocations.
+    pub allocs: u64,
+    /// Number of deallocations.
+    pub frees: u64,
+    /// Number of times that the class grew by allocating pages.
+    pub grown: u64,
+    /// Bytes of the live allocations.
+    pub bytes_in_use: usize,
+}
+
+/// Statistics of a physical memory arena.
+#[derive(Clone, Copy, Debug)]
+pub struct ArenaStats {
+    /// Start address of the arena.
+    pub start: Kva,
+    /// End address of the arena.
+    pub end: Kva,
+    /// Number of pages managed by the arena.
+    pub total_pages: usize,
+    /// Number of free pages.
+    pub free_pages: usize,
+    /// Number of pages in the largest run of free pages.
+    pub largest_free_run: usize,
+}
+
+/// Collect the statistics of every size class of the slab allocator.
+pub fn slab() -> [SlabStats; 12] {
+    crate::lang::slab::stats()
+}
+
+/// Collect the statistics of every physical memory arena.
+///
+/// Pages cached on the per-cpu page lists are not counted as free.
+pub fn arenas() -> Vec<ArenaStats> {
+    let mut out = Vec::new();
+    let allocator = PALLOC.lock();
+    for arena in allocator.inner.iter().take(allocator.max_idx).flatten() {
+        let Arena {
+            start,
+            end,
+            npages,
+            nr_free,
+            ..
+        } = arena;
+        out.push(ArenaStats {
+            start: *start,
+            end: *end,
+            total_pages: *npages,
+            free_pages: *nr_free,
+            largest_free_run: arena.largest_free_run(),
+        });
+    }
+    allocator.unlock();
+    out
+}
+
+/// Number of pages cached on the per-cpu page lists.
+pub fn pcp_pages() -> usize {
+    PCP.iter()
+        .map(|pcp| {
+            let list = pcp.0.lock();
+            let cnt = list.cnt;
+            list.unlock();
+            cnt
+        })
+        .sum()
+}
+
+/// Number of pre-zeroed pages in the pool.
+pub fn zeroed_pages() -> usize {
+    super::zero_pool::len()
+}
+
+/// Print the statistics of the memory allocators.
+pub fn dump() {
+    println!("[Slab]");
+    println!(
+        "{:>8} {:>12} {:>12} {:>8} {:>12}",
+        "size", "allocs", "frees", "grown", "in use"
+    );
+    for s in slab() {
+        println!(
+            "{:>8} {:>12} {:>12} {:>8} {:>12}",
+            s.size,
+            s.allocs,
+            s.frees,
+            s.grown,
+            BytePP(s.bytes_in_use).to_string()
+        );
+    }
+    println!("[Arena]");
+    for a in arenas() {
+        println!(
+            "0x{:016x}~0x{:016x}: free {} / {}, largest free run {}",
+            a.start.into_usize(),
+            a.end.into_usize(),
+            BytePP(a.free_pages << PAGE_SHIFT),
+            BytePP(a.total_pages << PAGE_SHIFT),
+            BytePP(a.largest_free_run << PAGE_SHIFT),
+        );
+    }
+    println!("[Per-cpu pages] {}", BytePP(pcp_pages() << PAGE_SHIFT));
+    println!("[Zeroed pages] {}", BytePP(zeroed_pages() << PAGE_SHIFT));
+}
@@ -1,121 +1,482 @@
 //! TLB Shootdown helper.
+//!
+//! Each cpu owns a request slot. A sender publishes its request on the slot of
+//! the current cpu, marks the target cpus as pending, and waits until every
+//! target clears its bit. As the slots are per-cpu, shootdowns on unrelated
+//! address spaces are served at the same time. While waiting, the sender also
+//! serves the requests of the other cpus, so two cpus that shoot down each
+//! other do not deadlock.
+//!
+//! A request invalidates the whole TLB, a range of pages, or a small batch of
+//! pages. [`TlbGather`] collects the stale entries of an operation such as
+//! munmap, and invalidates all of them with a single request.
+//!
+//! ## PCID
+//! When the cpu supports PCID, each cpu tags the TLB entries of the recently
+//! used page tables with a small number of PCIDs, so switching between them
+//! does not flush the TLB. A cpu that is not running the page table when a
+//! shootdown is requested forgets its PCID, and flushes the TLB entries of the
+//! PCID on its next use.
 use crate::{
-    mm::page_table::ACTIVE_PAGE_TABLES,
-    sync::{RwLock, atomic::AtomicUsize},
+    addressing::PAGE_SHIFT,
+    mm::{ContigPages, Page, page_table::ACTIVE_PAGE_TABLES},
+    sync::atomic::AtomicUsize,
 };
 use abyss::{
+    MAX_CPU,
     addressing::Va,
     boot::ONLINE_CPU,
     dev::x86_64::apic::{IPIDest, Mode},
-    interrupt::Registers,
-    spinlock::SpinLock,
-    x86_64::Cr3,
+    interrupt::{InterruptGuard, Registers},
+    x86_64::{Cr3, Cr4, intrinsics::cpuid},
+};
+use alloc::vec::Vec;
+use core::{
+    cell::UnsafeCell,
+    sync::atomic::{AtomicU8, Ordering},
 };
-use core::sync::atomic::Ordering;
 
-#[doc(hidden)]
-static IN_PROGRESS: SpinLock<()> = SpinLock::new(());
+/// Maximum number of pages in a batched request.
+pub const TLB_BATCH: usize = 16;
 
-#[doc(hidden)]
-static REQUEST: RwLock<Option<TlbIpi>> = RwLock::new(None);
+/// Ranges longer than this number of pages are flushed as the whole TLB.
+const FLUSH_CEILING: usize = 33;
+
+/// What to invalidate.
+#[derive(Clone, Copy)]
+enum Flush {
+    /// The whole TLB.
+    All,
+    /// Pages in `start..end`.
+    Range(Va, Va),
+    /// The first `len` pages of the batch.
+    Batch([Va; TLB_BATCH], usize),
+    /// The kernel mappings in every address space.
+    Kernel,
+}
+
+impl Flush {
+    /// Invalidate the TLB entries of the current cpu.
+    fn apply(&self) {
+        match self {
+            Flush::All => unsafe {
+                core::arch::asm! {
+                    "mov rax, cr3",
+                    "mov cr3, rax",
+                    out("rax") _,
+                    options(nostack)
+                }
+            },
+            Flush::Range(start, end) => {
+                let mut va = start.into_usize();
+                while va < end.into_usize() {
+                    invlpg(va);
+                    va += 1 << PAGE_SHIFT;
+                }
+            }
+            Flush::Batch(vas, len) => {
+                for va in &vas[..*len] {
+                    invlpg(va.into_usize());
+                }
+            }
+            Flush::Kernel => {
+                if !Cr4::current().contains(Cr4::PCIDE) {
+                    Flush::All.apply();
+                } else if has_invpcid() {
+                    // All PCIDs, including the global entries.
+                    invpcid(2, 0, 0);
+                } else {
+                    // The other PCIDs are flushed on their next load.
+                    let cache = &PCIDS[cpuid()];
+                    for pt in cache.pts.iter() {
+                        pt.store(0);
+                    }
+                    Flush::All.apply();
+                }
+            }
+        }
+    }
+
+    /// Invalidate the TLB entries of `pcid` on the current cpu.
+    fn apply_pcid(&self, pcid: usize) {
+        match self {
+            Flush::All | Flush::Kernel => invpcid(1, pcid, 0),
+            Flush::Range(start, end) => {
+                let mut va = start.into_usize();
+                while va < end.into_usize() {
+                    invpcid(0, pcid, va);
+                    va += 1 << PAGE_SHIFT;
+                }
+            }
+            Flush::Batch(vas, len) => {
+                for va in &vas[..*len] {
+                    invpcid(0, pcid, va.into_usize());
+                }
+            }
+        }
+    }
+}
+
+#[inline]
+fn invpcid(kind: u64, pcid: usize, va: usize) {
+    let desc: [u64; 2] = [pcid as u64, va as u64];
+    unsafe {
+        core::arch::asm!(
+            "invpcid {0}, [{1}]",
+            in(reg) kind,
+            in(reg) &desc,
+            options(nostack)
+        );
+    }
+}
+
+#[inline]
+fn invlpg(va: usize) {
+    unsafe {
+        core::arch::asm!(
+            "invlpg [{0}]",
+            in(reg) va,
+            options(nostack)
+        );
+    }
+}
 
 /// Struct for TLB request
 pub struct TlbIpi {
     /// Destination Cr3
-    cr3: Cr3,
+    cr3: usize,
 
-    /// If va is Some, invalidate only that page. Otherwise, shutdown the whole
-    /// TLB.
-    va: Option<Va>,
+    /// Entries to invalidate.
+    flush: Flush,
+}
+
+/// A per-cpu request slot.
+#[repr(align(64))]
+struct Slot {
+    /// The request. Only the owner cpu writes it, while `pending` is zero.
+    request: UnsafeCell<Option<TlbIpi>>,
 
-    /// Count of CPUs that processed this request.
-    processed: AtomicUsize,
+    /// Bitmask of cpus that have not processed the request yet.
+    pending: AtomicUsize,
 }
 
+unsafe impl Sync for Slot {}
+
+#[doc(hidden)]
+static SLOTS: [Slot; MAX_CPU] = [const {
+    Slot {
+        request: UnsafeCell::new(None),
+        pending: AtomicUsize::new(0),
+    }
+}; MAX_CPU];
+
 impl TlbIpi {
     /// Send the request and wait until the request is done for all CPUs
+    ///
+    /// If va is Some, invalidate only that page. Otherwise, shutdown the whole
+    /// TLB.
     pub fn send(cr3: Cr3, va: Option<Va>) {
-        let cr3_pa = cr3.0 as usize;
-        let guard = IN_PROGRESS.lock();
+        match va {
+            Some(va) => Self::send_batch(cr3, &[va]),
+            None => Self::request(cr3, Flush::All),
+        }
+    }
 
-        // Publish the requests.
-        {
-            let mut request = REQUEST.write();
+    /// Invalidate the pages in `start..end` on the other CPUs.
+    pub fn send_range(cr3: Cr3, start: Va, end: Va) {
+        if (end.into_usize() - start.into_usize()) >> PAGE_SHIFT > FLUSH_CEILING {
+            Self::request(cr3, Flush::All)
+        } else {
+            Self::request(cr3, Flush::Range(start, end))
+        }
+    }
 
-            assert!(
-                request.is_none(),
-                "Before sending TLB Shootdown request, the request queue must be empty."
-            );
+    /// Invalidate the pages of `vas` on the other CPUs.
+    pub fn send_batch(cr3: Cr3, vas: &[Va]) {
+        if vas.len() > TLB_BATCH {
+            Self::request(cr3, Flush::All)
+        } else {
+            let mut batch = [Va::new(0).unwrap(); TLB_BATCH];
+            batch[..vas.len()].copy_from_slice(vas);
+            Self::request(cr3, Flush::Batch(batch, vas.len()))
+        }
+    }
 
-            *request = Some(Self {
-                cr3,
-                va,
-                processed: AtomicUsize::new(0),
-            });
-        }
-
-        // Waiting the requests
-        {
-            let request = REQUEST.read();
-            let self_id = abyss::x86_64::intrinsics::cpuid();
-
-            let online_cpu_cnt = ONLINE_CPU
-                .iter()
-                .enumerate()
-                .filter(|(i, cpu)| {
-                    cpu.load(Ordering::SeqCst)
-                        && *i != self_id
-                        && ACTIVE_PAGE_TABLES[*i].load() == cr3_pa
-                })
-                .map(|(core_id, _)| unsafe {
-                    abyss::dev::x86_64::apic::send_ipi(IPIDest::Cpu(core_id), Mode::Fixed(0x7e));
-                })
-                .count();
-
-            let request_ref = request.as_ref().unwrap();
-
-            while request_ref.processed.load() < online_cpu_cnt {
-                core::hint::spin_loop();
+    fn request(cr3: Cr3, flush: Flush) {
+        let cr3 = cr3.into_usize() & !PCID_MASK;
+        // Stay on this cpu while using its slot.
+        let _guard = InterruptGuard::new();
+        let self_id = cpuid();
+        // The cpus that are not running the page table flush it on the next
+        // load. This must precede the scan of the active page tables, so that
+        // a cpu loading the page table concurrently is either flushed or
+        // targeted.
+        let kernel = matches!(flush, Flush::Kernel);
+        if !kernel {
+            forget_pcid(cr3, false);
+        }
+        let targets = ONLINE_CPU
+            .iter()
+            .enumerate()
+            .filter(|(i, cpu)| {
+                cpu.load(Ordering::SeqCst)
+                    && *i != self_id
+                    && (kernel || ACTIVE_PAGE_TABLES[*i].load() == cr3)
+            })
+            .fold(0, |mask, (i, _)| mask | (1 << i));
+        if targets == 0 {
+            return;
+        }
+
+        // Publish the request.
+        let slot = &SLOTS[self_id];
+        assert_eq!(
+            slot.pending.load(),
+            0,
+            "Before sending TLB Shootdown request, the request slot must be empty."
+        );
+        unsafe {
+            *slot.request.get() = Some(Self { cr3, flush });
+        }
+        slot.pending.store(targets);
+
+        for core_id in (0..MAX_CPU).filter(|i| targets & (1 << i) != 0) {
+            unsafe {
+                abyss::dev::x86_64::apic::send_ipi(IPIDest::Cpu(core_id), Mode::Fixed(0x7e));
             }
         }
 
-        // Clean up the request
-        {
-            let mut request = REQUEST.write();
-            *request = None;
+        // Waiting the request, while serving the others.
+        while slot.pending.load() != 0 {
+            Self::handle();
+            core::hint::spin_loop();
         }
 
-        guard.unlock();
+        unsafe {
+            *slot.request.get() = None;
+        }
     }
 
     fn handle() {
-        let request = REQUEST.read();
-
-        if let Some(request) = &*request {
-            if request.cr3 == Cr3::current() {
-                match request.va {
-                    Some(va) => unsafe {
-                        core::arch::asm!(
-                            "invlpg [{0}]",
-                            in(reg) va.into_usize(),
-                            options(nostack)
-                        )
-                    },
-                    _ => unsafe {
-                        core::arch::asm! {
-                            "mov rax, cr3",
-                            "mov cr3, rax",
-                            out("rax") _,
-                            options(nostack)
-                        }
-                    },
+        let self_id = cpuid();
+        let current = Cr3::current().into_usize() & !PCID_MASK;
+        for slot in SLOTS.iter() {
+            if slot.pending.load() & (1 << self_id) == 0 {
+                continue;
+            }
+            if let Some(request) = unsafe { &*slot.request.get() } {
+                if matches!(request.flush, Flush::Kernel) || request.cr3 == current {
+                    request.flush.apply();
+                } else if let Some(pcid) = PCIDS[self_id].find(request.cr3) {
+                    // This cpu switched away after the request is published.
+                    if has_invpcid() {
+                        request.flush.apply_pcid(pcid);
+                    } else {
+                        PCIDS[self_id].forget(request.cr3);
+                    }
                 }
             }
-            request.processed.fetch_add(1);
+            slot.pending.fetch_and(!(1 << self_id));
         }
     }
 }
 
+/// Number of PCIDs that each cpu uses for user page tables.
+const NR_PCIDS: usize = 6;
+
+/// Bits of cr3 that hold the PCID.
+pub(crate) const PCID_MASK: usize = 0xfff;
+
+/// Do not flush the TLB entries of the PCID on loading the cr3.
+const CR3_NOFLUSH: u64 = 1 << 63;
+
+/// Page tables that own the PCIDs of a cpu.
+///
+/// PCID `i + 1` is tagged to the page table at `pts[i]`. PCID 0 is left for
+/// the untagged loads.
+#[repr(align(64))]
+struct PcidCache {
+    pts: [AtomicUsize; NR_PCIDS],
+    next: AtomicUsize,
+}
+
+impl PcidCache {
+    fn find(&self, pa: usize) -> Option<usize> {
+        self.pts
+            .iter()
+            .position(|pt| pt.load() == pa)
+            .map(|i| i + 1)
+    }
+
+    fn forget(&self, pa: usize) {
+        for pt in self.pts.iter() {
+            let _ = pt.compare_exchange(pa, 0);
+        }
+    }
+}
+
+static PCIDS: [PcidCache; MAX_CPU] = [const {
+    PcidCache {
+        pts: [const { AtomicUsize::new(0) }; NR_PCIDS],
+        next: AtomicUsize::new(0),
+    }
+}; MAX_CPU];
+
+const INVPCID_UNKNOWN: u8 = 0;
+const INVPCID_NO: u8 = 1;
+const INVPCID_YES: u8 = 2;
+
+/// Whether the cpu supports INVPCID, probed on the first use.
+static INVPCID: AtomicU8 = AtomicU8::new(INVPCID_UNKNOWN);
+
+fn has_invpcid() -> bool {
+    match INVPCID.load(Ordering::Relaxed) {
+        INVPCID_UNKNOWN => {
+            let yes = unsafe { core::arch::x86_64::__cpuid_count(7, 0).ebx & (1 << 10) != 0 };
+            INVPCID.store(
+                if yes { INVPCID_YES } else { INVPCID_NO },
+                Ordering::Relaxed,
+            );
+            yes
+        }
+        v => v == INVPCID_YES,
+    }
+}
+
+/// Get the cr3 value to load the page table at `pa` on the current cpu.
+///
+/// The page table must be published on [`ACTIVE_PAGE_TABLES`] before calling
+/// this, and interrupts must be disabled.
+pub(crate) fn tagged_cr3(pa: usize) -> Cr3 {
+    if !Cr4::current().contains(Cr4::PCIDE) {
+        return Cr3(pa as u64);
+    }
+    let cache = &PCIDS[cpuid()];
+    if let Some(pcid) = cache.find(pa) {
+        Cr3((pa | pcid) as u64 | CR3_NOFLUSH)
+    } else {
+        // Recycle the PCIDs in round robin, flushing the entries of the
+        // previous owner.
+        let i = cache.next.load();
+        cache.next.store((i + 1) % NR_PCIDS);
+        cache.pts[i].store(pa);
+        Cr3((pa | (i + 1)) as u64)
+    }
+}
+
+/// Forget the PCIDs tagged to the page table at `pa`.
+///
+/// Unless `all` is set, the cpus that are running the page table keep it.
+pub(crate) fn forget_pcid(pa: usize, all: bool) {
+    for (cache, active) in PCIDS.iter().zip(ACTIVE_PAGE_TABLES.iter()) {
+        if all || active.load() != pa {
+            cache.forget(pa);
+        }
+    }
+}
+
+/// Invalidate the kernel mappings on every cpu.
+///
+/// The kernel mappings are shared by every page table, so this flushes the
+/// TLB entries of all address spaces.
+pub fn flush_kernel() {
+    let _guard = InterruptGuard::new();
+    Flush::Kernel.apply();
+    TlbIpi::request(Cr3(0), Flush::Kernel);
+}
+
+/// Gather of stale TLB entries.
+///
+/// Instead of invalidating the stale entries one by one, an operation that
+/// modifies many entries (e.g. munmap) pushes them into a [`TlbGather`], and
+/// calls [`TlbGather::flush`] once. The pages are freed after the flush.
+///
+/// Dropping the gather flushes the remaining entries.
+pub struct TlbGather {
+    cr3: usize,
+    vas: [Va; TLB_BATCH],
+    len: usize,
+    start: usize,
+    end: usize,
+    pages: Vec<Page>,
+    huge_pages: Vec<ContigPages>,
+}
+
+impl Default for TlbGather {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl TlbGather {
+    /// Create a gather for the current page table.
+    pub fn new() -> Self {
+        Self {
+            cr3: Cr3::current().into_usize() & !PCID_MASK,
+            vas: [Va::new(0).unwrap(); TLB_BATCH],
+            len: 0,
+            start: usize::MAX,
+            end: 0,
+            pages: Vec::new(),
+            huge_pages: Vec::new(),
+        }
+    }
+
+    /// Add the page at `va` that will be freed after the flush.
+    pub fn push(&mut self, va: Va, page: Page) {
+        self.add(va);
+        self.pages.push(page);
+    }
+
+    /// Add the huge page at `va` that will be freed after the flush.
+    pub fn push_huge(&mut self, va: Va, pages: ContigPages) {
+        self.add(va);
+        self.huge_pages.push(pages);
+    }
+
+    /// Add a `va` whose TLB entry is stale, without the page to free.
+    ///
+    /// This is used when the permission of an entry is changed.
+    pub fn add(&mut self, va: Va) {
+        let va = va.into_usize() & !((1 << PAGE_SHIFT) - 1);
+        if self.len < TLB_BATCH {
+            self.vas[self.len] = Va::new(va).unwrap();
+        }
+        self.len += 1;
+        self.start = self.start.min(va);
+        self.end = self.end.max(va + (1 << PAGE_SHIFT));
+    }
+
+    /// Invalidate the gathered entries on every cpu with a single request, and
+    /// free the gathered pages.
+    pub fn flush(&mut self) {
+        if self.len != 0 {
+            let flush = if self.len <= TLB_BATCH {
+                Flush::Batch(self.vas, self.len)
+            } else if (self.end - self.start) >> PAGE_SHIFT <= FLUSH_CEILING {
+                Flush::Range(Va::new(self.start).unwrap(), Va::new(self.end).unwrap())
+            } else {
+                Flush::All
+            };
+            if Cr3::current().into_usize() & !PCID_MASK == self.cr3 {
+                flush.apply();
+            }
+            TlbIpi::request(Cr3(self.cr3 as u64), flush);
+            self.len = 0;
+            self.start = usize::MAX;
+            self.end = 0;
+        }
+        self.pages.clear();
+        self.huge_pages.clear();
+    }
+}
+
+impl Drop for TlbGather {
+    fn drop(&mut self) {
+        self.flush();
+    }
+}
+
 /// Event handler for TLB Shootdown request
 pub fn handler(_regs: &mut Registers) {
     TlbIpi::handle();
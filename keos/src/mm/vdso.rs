@@ -0,0 +1,141 @@
+//! A data page shared read-only with every user process.
+//!
+//! Some information, such as the time and the id of the running thread, is
+//! read often but changes rarely or only on the kernel side. The kernel
+//! keeps it in a single page that every process maps read-only at
+//! [`VDSO_VA`], so that the user program reads it without a system call.
+//!
+//! The layout of the page is [`VdsoData`]. Each part that the kernel updates
+//! is guarded by a sequence counter: the writer makes it odd while updating,
+//! and the reader retries if the counter is odd or changed across the read.
+//!
+//! The time is given by the time stamp counter. `ns = (rdtsc() - boot_tsc) *
+//! 1_000_000 / tsc_khz`. `tsc_khz` is zero if the tsc can not be used as a
+//! clock.
+//!
+//! The id of the running thread is kept per cpu. A reader finds its cpu with
+//! `rdtscp`, which reports the cpu id in `ecx`, and checks that the counter of
+//! the cpu does not change, i.e., no context switch happens on the cpu, while
+//! it reads the id.
+//!
+//! The page is not mapped when a process is created. The first read of the
+//! page faults, and the kernel maps the page into the page table of the
+//! process before the fault reaches the [`Task`]. This covers every way to
+//! create a process, such as the loader and fork.
+//!
+//! [`Task`]: crate::task::Task
+use super::{
+    ContigPages, Page,
+    page_table::{PageTableRoot, get_current_pt_pa},
+};
+use crate::{MAX_CPU, sync::SpinLock};
+use abyss::{addressing::Va, x86_64::interrupt::PFErrorCode};
+use core::{
+    arch::x86_64::_rdtsc,
+    sync::atomic::{AtomicPtr, AtomicU32, AtomicU64, Ordering},
+};
+
+/// User virtual address where the page is mapped.
+pub const VDSO_VA: usize = 0x4750_0000;
+
+/// Data of a cpu.
+#[repr(C, align(64))]
+pub struct VdsoCpu {
+    /// Sequence counter, bumped twice on each update of `tid`.
+    pub seq: AtomicU32,
+    _pad: u32,
+    /// Tid of the thread running on the cpu.
+    pub tid: AtomicU64,
+}
+
+/// Layout of the shared page.
+#[repr(C)]
+pub struct VdsoData {
+    /// Layout version of the page.
+    pub version: u32,
+    _pad: u32,
+    /// Frequency of the time stamp counter in kHz, or zero if unknown.
+    pub tsc_khz: u64,
+    /// Time stamp counter at boot.
+    pub boot_tsc: u64,
+    /// Data of each cpu.
+    pub cpus: [VdsoCpu; MAX_CPU],
+}
+
+const _: () = assert!(core::mem::size_of::<VdsoData>() <= 0x1000);
+
+static DATA: AtomicPtr<VdsoData> = AtomicPtr::new(core::ptr::null_mut());
+
+/// Allocate and fill the shared page.
+///
+/// # Safety
+/// Must be called once on boot, after the memory allocator and the timer are
+/// initialized.
+pub(crate) unsafe fn init() {
+    // Not charged to any thread, as the page lives forever.
+    let page = ContigPages::new(0x1000).expect("Failed to allocate vdso page.");
+    let data = page.kva.into_usize() as *mut VdsoData;
+    unsafe {
+        (*data).version = 1;
+        (*data).tsc_khz = abyss::dev::x86_64::timer::tsc_khz().unwrap_or(0);
+        (*data).boot_tsc = _rdtsc();
+    }
+    core::mem::forget(page);
+    DATA.store(data, Ordering::Release);
+}
+
+/// Get the shared page to map it into a user process.
+pub fn page() -> Page {
+    let data = DATA.load(Ordering::Acquire);
+    assert!(!data.is_null(), "vdso is not initialized.");
+    let page = unsafe {
+        Page::from_pa(
+            crate::addressing::Kva::new(data as usize)
+                .unwrap()
+                .into_pa(),
+        )
+    };
+    // Take a reference for the caller, and keep the one of the kernel.
+    let r = page.clone();
+    core::mem::forget(page);
+    r
+}
+
+/// Serializes the mapping of the page.
+static MAP_LOCK: SpinLock<()> = SpinLock::new(());
+
+/// Map the page into the current process if `cr2` faults on it.
+///
+/// Returns true if the fault is resolved.
+pub(crate) fn fault(ec: PFErrorCode, cr2: Va) -> bool {
+    if cr2.into_usize() & !0xfff != VDSO_VA
+        || !ec.contains(PFErrorCode::USER)
+        || ec.intersects(
+            PFErrorCode::PRESENT | PFErrorCode::WRITE_ACCESS | PFErrorCode::INSTRCUTION_FETCH,
+        )
+    {
+        return false;
+    }
+    let pt = unsafe { &mut *(get_current_pt_pa().into_kva().into_usize() as *mut PageTableRoot) };
+    let guard = MAP_LOCK.lock();
+    // Another thread of the process may have mapped it.
+    let ok = pt.translate_user(Va::new(VDSO_VA).unwrap()).is_some()
+        || pt.map_user_ro(Va::new(VDSO_VA).unwrap(), page()).is_ok();
+    guard.unlock();
+    ok
+}
+
+/// Record that `tid` is running on `cpu`.
+///
+/// Called on the context switch.
+#[inline]
+pub(crate) fn set_running(cpu: usize, tid: u64) {
+    let Some(data) = (unsafe { DATA.load(Ordering::Relaxed).as_ref() }) else {
+        return;
+    };
+    let pcpu = &data.cpus[cpu];
+    pcpu.seq.fetch_add(1, Ordering::Relaxed);
+    core::sync::atomic::fence(Ordering::Release);
+    pcpu.tid.store(tid, Ordering::Relaxed);
+    pcpu.seq.fetch_add(1, Ordering::Release);
+}
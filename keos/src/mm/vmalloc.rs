@@ -0,0 +1,351 @@
+//! Virtually contiguous kernel memory.
+//!
+//! The slab allocator serves the allocations larger than 128KiB with
+//! physically contiguous pages, which become scarce as the memory fragments.
+//! This module maps scattered pages into a contiguous range of the kernel
+//! virtual address, so a large allocation only requires free single pages.
+//!
+//! The area is mapped by a PML4 entry of the kernel page table, which is
+//! shared by every page table. A freed range is unmapped and its pages are
+//! released at once, but the address range is not reused until it is purged:
+//! the freed ranges are batched, and a single TLB shootdown retires all of
+//! them once they grow past [`LAZY_MAX_PAGES`]. Only a use-after-free can
+//! observe the stale entries in between.
+//!
+//! The shootdown spins until every other cpu answers, which a cpu spinning on
+//! a lock with the interrupts disabled never does. [`vfree`] is reached from
+//! any `drop`, so it purges only when the caller holds no spinlock and has
+//! the interrupts enabled. Otherwise, the ranges wait for a later call, or
+//! for the idle loop, which purges them through [`purge_idle`].
+//!
+//! An allocation of [`HUGE_PAGE_SIZE`] bytes or more starts at an address
+//! aligned to [`HUGE_PAGE_SIZE`]. Each of its aligned 2MiB parts is mapped
+//! with [`PageTableRoot::map_huge`] while 2MiB of contiguous pages are free,
+//! so that a large buffer takes a TLB entry per 2MiB instead of per page. The
+//! other parts fall back to single pages.
+//!
+//! The memory of this area is NOT physically contiguous, and
+//! [`Kva::into_pa`] is meaningless for it. Never hand it to a device.
+use super::{
+    ContigPages,
+    page_table::{
+        HUGE_PAGE_SIZE, PageTableRoot, Pde, PdeFlags, Pdpe, PdpeFlags, Pml4e, Pml4eFlags, Pte,
+        PteFlags,
+    },
+    tlb,
+};
+use crate::addressing::{Kva, PAGE_SIZE, Pa, Va};
+use abyss::{interrupt::InterruptGuard, spinlock::SpinLock};
+use alloc::{collections::BTreeMap, vec::Vec};
+
+/// Index of the PML4 entry that maps the area.
+const PML4_INDEX: usize = 509;
+
+/// Start address of the area.
+pub const VMALLOC_START: usize = 0xffff_0000_0000_0000 | (PML4_INDEX << 39);
+
+/// End address of the area.
+pub const VMALLOC_END: usize = VMALLOC_START + (1 << 39);
+
+/// Number of freed pages that are kept before the TLB shootdown.
+const LAZY_MAX_PAGES: usize = 1024;
+
+/// Number of pages of a huge page.
+const HUGE_PAGES: usize = HUGE_PAGE_SIZE / PAGE_SIZE;
+
+struct VmallocArea {
+    /// Kernel virtual address of the kernel page table.
+    root: usize,
+    /// Kernel virtual address of the page directory pointer table.
+    pdp: usize,
+    /// Free ranges, from the start address to the size in bytes.
+    free: BTreeMap<usize, usize>,
+    /// Allocated ranges, from the start address to the number of pages.
+    busy: BTreeMap<usize, usize>,
+    /// Freed ranges that wait for the TLB shootdown.
+    lazy: Vec<(usize, usize)>,
+    /// Number of pages in the lazy ranges.
+    lazy_pages: usize,
+}
+
+static AREA: SpinLock<VmallocArea> = SpinLock::new(VmallocArea {
+    root: 0,
+    pdp: 0,
+    free: BTreeMap::new(),
+    busy: BTreeMap::new(),
+    lazy: Vec::new(),
+    lazy_pages: 0,
+});
+
+/// Allocate a zeroed page for the page table.
+fn table() -> Option<Pa> {
+    let page = ContigPages::new(PAGE_SIZE)?;
+    let pa = page.kva().into_pa();
+    core::mem::forget(page);
+    Some(pa)
+}
+
+impl VmallocArea {
+    /// Reserve a range of `cnt` pages followed by an unmapped guard page,
+    /// starting at an address aligned to `align`.
+    fn reserve(&mut self, cnt: usize, align: usize) -> Option<usize> {
+        let size = (cnt + 1) * PAGE_SIZE;
+        let (&free, &len) = self
+            .free
+            .iter()
+            .find(|(start, len)| start.next_multiple_of(align) + size <= **start + **len)?;
+        let start = free.next_multiple_of(align);
+        self.free.remove(&free);
+        if start > free {
+            self.free.insert(free, start - free);
+        }
+        if free + len > start + size {
+            self.free.insert(start + size, free + len - start - size);
+        }
+        self.busy.insert(start, cnt);
+        Some(start)
+    }
+
+    /// Give back a range to the free ranges, merging with the neighbors.
+    fn release(&mut self, mut start: usize, mut len: usize) {
+        if let Some(next) = self.free.remove(&(start + len)) {
+            len += next;
+        }
+        if let Some((&prev, &prev_len)) = self.free.range(..start).next_back()
+            && prev + prev_len == start
+        {
+            self.free.remove(&prev);
+            start = prev;
+            len += prev_len;
+        }
+        self.free.insert(start, len);
+    }
+
+    /// Get the page directory entry of `va`, allocating the page directory
+    /// if `create`.
+    fn pde(&mut self, va: usize, create: bool) -> Option<&mut Pde> {
+        let pdp = unsafe { &mut *(self.pdp as *mut [Pdpe; 512]) };
+        let pdpe = &mut pdp[(va >> 30) & 0x1ff];
+        if pdpe.pa().is_none() {
+            if !create {
+                return None;
+            }
+            pdpe.set_pa(table()?)
+                .ok()?
+                .set_flags(PdpeFlags::P | PdpeFlags::RW);
+        }
+        Some(&mut pdpe.into_pd_mut().ok()?[(va >> 21) & 0x1ff])
+    }
+
+    /// Get the page table entry of `va`, allocating the tables if `create`.
+    fn pte(&mut self, va: usize, create: bool) -> Option<&mut Pte> {
+        let pde = self.pde(va, create)?;
+        if pde.pa().is_none() {
+            if !create {
+                return None;
+            }
+            pde.set_pa(table()?)
+                .ok()?
+                .set_flags(PdeFlags::P | PdeFlags::RW);
+        }
+        Some(&mut pde.into_pt_mut().ok()?[(va >> 12) & 0x1ff])
+    }
+
+    /// Map the 2MiB at `va` with a huge page, if the page directory entry of
+    /// `va` is unused and 2MiB of contiguous pages are free.
+    fn map_huge(&mut self, va: usize) -> bool {
+        // The page directory is allocated as the other tables of the area,
+        // so that the kernel page table does not allocate it for the user.
+        if self.pde(va, true).is_none_or(|pde| pde.pa().is_some()) {
+            return false;
+        }
+        let Some(pages) = ContigPages::alloc_uninit(HUGE_PAGES, HUGE_PAGE_SIZE) else {
+            return false;
+        };
+        let root = unsafe { &mut *(self.root as *mut PageTableRoot) };
+        root.map_huge(Va::new(va).unwrap(), pages, PdeFlags::RW | PdeFlags::XD)
+            .is_ok()
+    }
+
+    /// Unmap the first `cnt` pages of the range at `start` and free the pages.
+    ///
+    /// The range is kept on the lazy list until the TLB shootdown.
+    fn unmap(&mut self, start: usize, cnt: usize) {
+        let mut i = 0;
+        while i < cnt {
+            let va = start + i * PAGE_SIZE;
+            if let Some(pde) = self.pde(va, false)
+                && pde.is_huge()
+            {
+                let pa = pde.clear().unwrap();
+                unsafe {
+                    ContigPages::from_va(pa.into_kva(), HUGE_PAGE_SIZE);
+                }
+                i += HUGE_PAGES;
+                continue;
+            }
+            if let Some(pa) = self.pte(va, false).and_then(|pte| unsafe { pte.clear() }) {
+                unsafe {
+                    ContigPages::from_va(pa.into_kva(), PAGE_SIZE);
+                }
+            }
+            i += 1;
+        }
+        let total = self.busy.remove(&start).expect("vmalloc: unknown range");
+        self.lazy.push((start, (total + 1) * PAGE_SIZE));
+        self.lazy_pages += total;
+    }
+
+    /// Take the lazy ranges out, if `force` or there are too many of them.
+    fn take_lazy(&mut self, force: bool) -> Vec<(usize, usize)> {
+        if force || self.lazy_pages > LAZY_MAX_PAGES {
+            self.lazy_pages = 0;
+            core::mem::take(&mut self.lazy)
+        } else {
+            Vec::new()
+        }
+    }
+}
+
+/// Flush the TLB for the lazy ranges, if `force` or there are too many of
+/// them, and make them available again.
+///
+/// Returns true if any range is purged. The shootdown waits for the other
+/// cpus, so it is done outside of the lock.
+fn purge(force: bool) -> bool {
+    let mut area = AREA.lock();
+    let lazy = area.take_lazy(force);
+    area.unlock();
+    if lazy.is_empty() {
+        return false;
+    }
+    tlb::flush_kernel();
+    let mut area = AREA.lock();
+    for (start, len) in lazy.iter() {
+        area.release(*start, *len);
+    }
+    area.unlock();
+    true
+}
+
+/// [`purge`], unless the caller holds a spinlock or has the interrupts
+/// disabled.
+fn try_purge(force: bool) -> bool {
+    !InterruptGuard::is_guarded() && purge(force)
+}
+
+/// Purge the lazy ranges that [`vfree`] could not.
+///
+/// Called by the idle loop, which holds no lock. Returns true if any range
+/// is purged.
+pub(crate) fn purge_idle() -> bool {
+    purge(false)
+}
+
+/// Initialize the vmalloc area.
+///
+/// The PML4 entry is installed in the boot page table before any other page
+/// table is created, so every page table shares the area.
+pub(super) fn init() {
+    let pml4 = unsafe {
+        &mut *(Pa::new({
+            unsafe extern "C" {
+                static mut boot_pml4e: u64;
+            }
+            boot_pml4e as usize
+        })
+        .unwrap()
+        .into_kva()
+        .into_usize() as *mut [Pml4e; 512])
+    };
+    let pml4e = &mut pml4[PML4_INDEX];
+    assert!(pml4e.pa().is_none(), "vmalloc: area is already in use.");
+    let pdp = table().expect("vmalloc: out of memory.");
+    pml4e
+        .set_pa(pdp)
+        .unwrap()
+        .set_flags(Pml4eFlags::P | Pml4eFlags::RW);
+
+    let mut area = AREA.lock();
+    area.root = pml4.as_ptr() as usize;
+    area.pdp = pdp.into_kva().into_usize();
+    area.free.insert(VMALLOC_START, VMALLOC_END - VMALLOC_START);
+    area.unlock();
+}
+
+/// Returns true if `kva` is in the vmalloc area.
+#[inline]
+pub fn contains(kva: usize) -> bool {
+    (VMALLOC_START..VMALLOC_END).contains(&kva)
+}
+
+/// Allocate `size` bytes of virtually contiguous memory.
+///
+/// The memory is not zeroed. Returns `None` if the area is not initialized
+/// or runs out of memory.
+pub fn vmalloc(size: usize) -> Option<Kva> {
+    let cnt = size.div_ceil(PAGE_SIZE);
+    let align = if cnt >= HUGE_PAGES {
+        HUGE_PAGE_SIZE
+    } else {
+        PAGE_SIZE
+    };
+    let mut area = AREA.lock();
+    let start = match area.reserve(cnt, align) {
+        Some(start) => start,
+        None => {
+            area.unlock();
+            try_purge(true);
+            area = AREA.lock();
+            match area.reserve(cnt, align) {
+                Some(start) => start,
+                None => {
+                    area.unlock();
+                    return None;
+                }
+            }
+        }
+    };
+    let mut i = 0;
+    while i < cnt {
+        let va = start + i * PAGE_SIZE;
+        if va % HUGE_PAGE_SIZE == 0 && cnt - i >= HUGE_PAGES && area.map_huge(va) {
+            i += HUGE_PAGES;
+            continue;
+        }
+        let mapped = ContigPages::alloc_uninit(1, PAGE_SIZE).and_then(|page| {
+            let pa = page.kva().into_pa();
+            let pte = area.pte(va, true)?;
+            pte.set_pa(pa).ok()?;
+            unsafe {
+                pte.set_flags(PteFlags::P | PteFlags::RW | PteFlags::XD);
+            }
+            core::mem::forget(page);
+            Some(())
+        });
+        if mapped.is_none() {
+            area.unmap(start, i);
+            area.unlock();
+            return None;
+        }
+        i += 1;
+    }
+    area.unlock();
+    Kva::new(start)
+}
+
+/// Free the memory allocated by [`vmalloc`].
+///
+/// The address range is purged here only if the caller can wait for the TLB
+/// shootdown; see the [module documentation](self).
+///
+/// # Safety
+/// `kva` must be returned by [`vmalloc`], and must not be used after.
+pub unsafe fn vfree(kva: Kva) {
+    let start = kva.into_usize();
+    let mut area = AREA.lock();
+    let cnt = *area.busy.get(&start).expect("vfree: unknown address");
+    area.unmap(start, cnt);
+    area.unlock();
+    try_purge(false);
+}
@@ -0,0 +1,119 @@
+//! A pool of pre-zeroed pages.
+//!
+//! [`Page::new`] must return a zeroed page, which costs a 4KiB memset on the
+//! allocation path, e.g. on every anonymous page fault. Idle cpus fill this
+//! pool with zeroed pages in the background, and the single page allocation
+//! takes a page from the pool without clearing. If the pool is empty, the page
+//! is cleared synchronously as before.
+//!
+//! Pages are cleared with the non-temporal stores, so the background zeroing
+//! does not evict the working set from the cache.
+//!
+//! [`Page::new`]: super::Page::new
+use super::ContigPages;
+use abyss::spinlock::SpinLock;
+
+/// Maximum number of pages in the pool.
+const POOL_SIZE: usize = 256;
+
+/// Number of pages that an idle cpu clears at once.
+const REFILL_BATCH: usize = 8;
+
+struct ZeroPool {
+    cnt: usize,
+    pages: [Option<ContigPages>; POOL_SIZE],
+}
+
+static POOL: SpinLock<ZeroPool> = SpinLock::new(ZeroPool {
+    cnt: 0,
+    pages: [const { None }; POOL_SIZE],
+});
+
+/// Take a zeroed page from the pool.
+pub(super) fn take() -> Option<ContigPages> {
+    let mut pool = POOL.lock();
+    let page = if pool.cnt != 0 {
+        let idx = pool.cnt - 1;
+        pool.cnt = idx;
+        pool.pages[idx].take()
+    } else {
+        None
+    };
+    pool.unlock();
+    page
+}
+
+/// Give back all pages in the pool to the allocator.
+pub(super) fn drain() {
+    loop {
+        // Drop the pages outside of the lock, as it takes the allocator lock.
+        let Some(page) = take() else {
+            break;
+        };
+        drop(page);
+    }
+}
+
+/// Number of pages in the pool.
+pub(super) fn len() -> usize {
+    let pool = POOL.lock();
+    let cnt = pool.cnt;
+    pool.unlock();
+    cnt
+}
+
+/// Clear a page with the non-temporal stores.
+fn clear_page_nt(page: &ContigPages) {
+    unsafe {
+        core::arch::asm!(
+            "2:",
+            "movnti [{p}], {z}",
+            "movnti [{p} + 8], {z}",
+            "movnti [{p} + 16], {z}",
+            "movnti [{p} + 24], {z}",
+            "movnti [{p} + 32], {z}",
+            "movnti [{p} + 40], {z}",
+            "movnti [{p} + 48], {z}",
+            "movnti [{p} + 56], {z}",
+            "add {p}, 64",
+            "cmp {p}, {e}",
+            "jne 2b",
+            "sfence",
+            p = inout(reg) page.kva.into_usize() => _,
+            e = in(reg) page.kva.into_usize() + 0x1000,
+            z = in(reg) 0usize,
+            options(nostack)
+        );
+    }
+}
+
+/// Fill the pool with up to [`REFILL_BATCH`] zeroed pages.
+///
+/// Called by the idle loop. Returns true if the pool is not full yet, so the
+/// idle loop can continue zeroing after checking the run queue.
+pub(crate) fn refill() -> bool {
+    for _ in 0..REFILL_BATCH {
+        if len() >= POOL_SIZE {
+            return false;
+        }
+        // Do not reclaim the other caches for the pool.
+        let Some(page) =
+            ContigPages::alloc_from_pcp().or_else(|| ContigPages::alloc_from_arena(1, 0x1000))
+        else {
+            return false;
+        };
+        clear_page_nt(&page);
+        let mut pool = POOL.lock();
+        let page = if pool.cnt < POOL_SIZE {
+            let idx = pool.cnt;
+            pool.pages[idx] = Some(page);
+            pool.cnt += 1;
+            None
+        } else {
+            Some(page)
+        };
+        pool.unlock();
+        drop(page);
+    }
+    true
+}
@@ -0,0 +1,207 @@
+//! Page-granular pipe buffers.
+//!
+//! A pipe built on a [`channel`] of bytes pays a channel operation per byte,
+//! and a copy into an intermediate buffer on every write. The pipe of this
+//! module instead queues [`Chunk`]s:
+//!
+//! * A write of at least [`PAGE_CHUNK`] bytes is copied from the user buffer
+//!   straight into freshly allocated pages, one page per chunk.
+//! * A smaller write keeps the plain copy into a small buffer.
+//! * A caller that owns a whole page, e.g., a page of the page cache or an
+//!   anonymous page that it unmapped from the writer, hands it over with
+//!   [`PipeWriter::write_page`] without any copy. On the other end,
+//!   [`PipeReader::try_read_page`] hands a whole page over to a reader that
+//!   can map it directly.
+//!
+//! [`channel`]: crate::channel
+use crate::{
+    KernelError,
+    addressing::PAGE_SIZE,
+    channel::{Receiver, Sender, channel},
+    mm::Page,
+    spinlock::SpinLock,
+    syscall::uaccess::{UserU8SliceRO, UserU8SliceWO},
+};
+use alloc::{collections::VecDeque, sync::Arc, vec::Vec};
+
+/// Writes shorter than this are copied into a small buffer instead of a page.
+pub const PAGE_CHUNK: usize = PAGE_SIZE / 2;
+
+/// A unit of data queued in a pipe.
+pub enum Chunk {
+    /// Bytes of a small write.
+    Bytes(Vec<u8>),
+    /// The first `len` bytes of a page.
+    Page {
+        /// The page that holds the data.
+        page: Page,
+        /// Number of the valid bytes.
+        len: usize,
+    },
+}
+
+impl Chunk {
+    fn as_slice(&self) -> &[u8] {
+        match self {
+            Chunk::Bytes(b) => b,
+            Chunk::Page { page, len } => &page.inner()[..*len],
+        }
+    }
+}
+
+/// A chunk that is partially consumed by a reader.
+struct Partial {
+    chunk: Chunk,
+    pos: usize,
+}
+
+/// The write end of a [`pipe`].
+#[derive(Clone)]
+pub struct PipeWriter {
+    tx: Sender<Chunk>,
+}
+
+/// The read end of a [`pipe`].
+#[derive(Clone)]
+pub struct PipeReader {
+    rx: Receiver<Chunk>,
+    /// The remainders of the chunks that did not fit in the last reads.
+    /// Shared by the clones, so that the bytes are read in order.
+    partial: Arc<SpinLock<VecDeque<Partial>>>,
+}
+
+/// Create a pipe that buffers up to `nr_chunks` chunks.
+pub fn pipe(nr_chunks: usize) -> (PipeWriter, PipeReader) {
+    let (tx, rx) = channel(nr_chunks);
+    (
+        PipeWriter { tx },
+        PipeReader {
+            rx,
+            partial: Arc::new(SpinLock::new(VecDeque::new())),
+        },
+    )
+}
+
+impl PipeWriter {
+    /// Write `len` bytes at the user address `addr`, blocking while the pipe
+    /// is full.
+    ///
+    /// Returns the number of the written bytes. Returns
+    /// [`KernelError::BrokenPipe`] if the reader has disconnected before any
+    /// byte is written.
+    pub fn write_user(&self, addr: usize, len: usize) -> Result<usize, KernelError> {
+        if len == 0 {
+            return Ok(0);
+        } else if len < PAGE_CHUNK {
+            let mut buf = alloc::vec![0; len];
+            UserU8SliceRO::new(addr, len).get_into(&mut buf)?;
+            return self
+                .tx
+                .send(Chunk::Bytes(buf))
+                .map(|_| len)
+                .map_err(|_| KernelError::BrokenPipe);
+        }
+
+        let mut done = 0;
+        while done < len {
+            let mut page = Page::new();
+            let n = PAGE_SIZE.min(len - done);
+            if let Err(e) = UserU8SliceRO::new(addr + done, n).get_into(&mut page.inner_mut()[..n])
+            {
+                return if done == 0 { Err(e) } else { Ok(done) };
+            }
+            if self.tx.send(Chunk::Page { page, len: n }).is_err() {
+                return if done == 0 {
+                    Err(KernelError::BrokenPipe)
+                } else {
+                    Ok(done)
+                };
+            }
+            done += n;
+        }
+        Ok(done)
+    }
+
+    /// Queue the first `len` bytes of `page` without copying them.
+    ///
+    /// The caller must not write to `page` afterward.
+    pub fn write_page(&self, page: Page, len: usize) -> Result<(), KernelError> {
+        assert!(len <= PAGE_SIZE);
+        self.tx
+            .send(Chunk::Page { page, len })
+            .map_err(|_| KernelError::BrokenPipe)
+    }
+}
+
+impl PipeReader {
+    /// Take the chunk to read next. If `block`, wait until one is available.
+    fn next_chunk(&self, block: bool) -> Option<Partial> {
+        let mut partial = self.partial.lock();
+        let p = partial.pop_front();
+        partial.unlock();
+        p.or_else(|| {
+            if block {
+                self.rx.recv().ok()
+            } else {
+                self.rx.try_recv().ok()
+            }
+            .map(|chunk| Partial { chunk, pos: 0 })
+        })
+    }
+
+    /// Put back the remainder of a chunk.
+    fn put_back(&self, p: Partial) {
+        let mut partial = self.partial.lock();
+        partial.push_front(p);
+        partial.unlock();
+    }
+
+    /// Read up to `len` bytes into the user address `addr`, blocking until
+    /// any byte is available.
+    ///
+    /// Returns the number of the read bytes, which is 0 if the writer has
+    /// disconnected and the pipe is drained.
+    pub fn read_user(&self, addr: usize, len: usize) -> Result<usize, KernelError> {
+        let mut done = 0;
+        while done < len {
+            let Some(mut p) = self.next_chunk(done == 0) else {
+                break;
+            };
+            let data = &p.chunk.as_slice()[p.pos..];
+            let n = data.len().min(len - done);
+            if let Err(e) = UserU8SliceWO::new(addr + done, n).put(&data[..n]) {
+                self.put_back(p);
+                return if done == 0 { Err(e) } else { Ok(done) };
+            }
+            done += n;
+            p.pos += n;
+            if p.pos < p.chunk.as_slice().len() {
+                self.put_back(p);
+                break;
+            }
+        }
+        Ok(done)
+    }
+
+    /// Take the next chunk as a whole page without copying it, if the chunk
+    /// is a full page that is not partially read.
+    ///
+    /// This function does not block.
+    pub fn try_read_page(&self) -> Option<Page> {
+        let p = self.next_chunk(false)?;
+        match p {
+            Partial {
+                chunk:
+                    Chunk::Page {
+                        page,
+                        len: PAGE_SIZE,
+                    },
+                pos: 0,
+            } => Some(page),
+            p => {
+                self.put_back(p);
+                None
+            }
+        }
+    }
+}
@@ -1,6 +1,7 @@
 //! Modules for system power operations.
 /// Restart the machine.
 pub fn restart() -> ! {
+    abyss::kprint::flush();
     unsafe {
         abyss::x86_64::power_control::restart();
     }
@@ -8,6 +9,7 @@ pub fn restart() -> ! {
 
 /// Shutdown the machine.
 pub fn shutdown() -> ! {
+    abyss::kprint::flush();
     unsafe {
         abyss::x86_64::power_control::power_off();
     }
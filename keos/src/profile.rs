@@ -0,0 +1,217 @@
+//! A sampling profiler.
+//!
+//! While the profiler runs, every `period`-th timer tick of a cpu captures
+//! the call stack of the interrupted code into the sample buffer of the cpu:
+//! - A kernel stack is unwound with the `.eh_frame` of the kernel. The FDEs
+//!   are parsed once, when the profiler is first started, into an
+//!   [`FdeTable`].
+//! - A user stack is walked along the frame pointers, if requested. The
+//!   frames are read through the page table without faulting, so the walk
+//!   stops at the first unmapped frame.
+//!
+//! [`dump`] merges the samples of all cpus, and prints them as folded stacks,
+//! one line per distinct stack with its count, from the root to the leaf:
+//! ```text
+//! kernel;keos::thread::scheduler::idle;... 42
+//! ```
+//! The output can be fed to `flamegraph.pl` or a compatible tool.
+//!
+//! An idle cpu stops its tick, so the idle time is not sampled.
+use crate::{
+    lang::panicking::{EhFrameReader, for_each_function},
+    mm::page_table::{PageTableRoot, get_current_pt_pa},
+    spinlock::SpinLock,
+    thread::STACK_SIZE,
+};
+use abyss::{
+    MAX_CPU,
+    addressing::Va,
+    interrupt::Registers,
+    unwind::{DwarfReader, FdeTable, StackFrame, UnwindBacktrace},
+    x86_64::intrinsics::cpuid,
+};
+use alloc::{boxed::Box, collections::BTreeMap, string::String, vec::Vec};
+use core::{
+    fmt::Write,
+    ptr::null_mut,
+    sync::atomic::{AtomicBool, AtomicPtr, AtomicU64, Ordering},
+};
+
+/// Maximum number of frames of a sample.
+pub const MAX_DEPTH: usize = 32;
+
+/// Default number of samples per cpu.
+pub const DEFAULT_CAPACITY: usize = 4096;
+
+/// A captured call stack, from the leaf.
+#[derive(Clone, Copy)]
+struct Sample {
+    user: bool,
+    len: usize,
+    pcs: [usize; MAX_DEPTH],
+}
+
+impl Sample {
+    /// Append `pc`. Returns false if the sample is full.
+    fn push(&mut self, pc: usize) -> bool {
+        if self.len < MAX_DEPTH {
+            self.pcs[self.len] = pc;
+            self.len += 1;
+        }
+        self.len < MAX_DEPTH
+    }
+}
+
+/// Ticks between two samples, or zero if the profiler is stopped.
+static PERIOD: AtomicU64 = AtomicU64::new(0);
+/// Whether to walk the user stacks.
+static USER: AtomicBool = AtomicBool::new(false);
+static TICKS: [AtomicU64; MAX_CPU] = [const { AtomicU64::new(0) }; MAX_CPU];
+/// Samples lost to a full buffer.
+static DROPPED: AtomicU64 = AtomicU64::new(0);
+/// The FDEs of the kernel, built on the first [`start`].
+static TABLE: AtomicPtr<FdeTable> = AtomicPtr::new(null_mut());
+static BUFFERS: [SpinLock<Vec<Sample>>; MAX_CPU] = [const { SpinLock::new(Vec::new()) }; MAX_CPU];
+
+/// Start the profiler, discarding the previous samples.
+///
+/// A sample is taken every `period` timer ticks, and at most `capacity`
+/// samples are kept per cpu. If `user`, the user stacks are walked as well;
+/// otherwise, a tick in the user mode is counted without its stack.
+pub fn start(period: u64, user: bool, capacity: usize) {
+    stop();
+    if TABLE.load(Ordering::Acquire).is_null() {
+        let table = Box::new(FdeTable::new(DwarfReader::from_peeker(
+            EhFrameReader::start(),
+            EhFrameReader,
+        )));
+        TABLE.store(Box::into_raw(table), Ordering::Release);
+    }
+    for buffer in BUFFERS.iter() {
+        // Allocate outside of the lock, which disables the interrupts.
+        let samples = Vec::with_capacity(capacity);
+        let mut guard = buffer.lock();
+        *guard = samples;
+        guard.unlock();
+    }
+    DROPPED.store(0, Ordering::Relaxed);
+    USER.store(user, Ordering::Relaxed);
+    PERIOD.store(period.max(1), Ordering::Release);
+}
+
+/// Stop the profiler. The samples are kept until the next [`start`].
+pub fn stop() {
+    PERIOD.store(0, Ordering::Release);
+}
+
+/// Take a sample of the code interrupted by the timer.
+pub(crate) fn on_tick(regs: &Registers) {
+    let period = PERIOD.load(Ordering::Acquire);
+    if period == 0 {
+        return;
+    }
+    let cpu = cpuid();
+    if TICKS[cpu].fetch_add(1, Ordering::Relaxed) % period != 0 {
+        return;
+    }
+    let Ok(mut buffer) = BUFFERS[cpu].try_lock() else {
+        return;
+    };
+    if buffer.len() == buffer.capacity() {
+        DROPPED.fetch_add(1, Ordering::Relaxed);
+        buffer.unlock();
+        return;
+    }
+
+    let frame = regs.to_stack_frame();
+    let mut sample = Sample {
+        user: frame.pc() >> 48 != 0xffff,
+        len: 0,
+        pcs: [0; MAX_DEPTH],
+    };
+    if !sample.user {
+        let table = unsafe { &*TABLE.load(Ordering::Acquire) };
+        let sp_hi = frame.sp() & !(STACK_SIZE - 1);
+        let _ = UnwindBacktrace::new(
+            frame,
+            sp_hi..sp_hi + STACK_SIZE,
+            DwarfReader::from_peeker(EhFrameReader::start(), EhFrameReader),
+        )
+        .unwind_frame_with(table, |this| sample.push(this.frame.pc()));
+    } else if USER.load(Ordering::Relaxed) {
+        walk_user(&frame, &mut sample);
+    }
+    buffer.push(sample);
+    buffer.unlock();
+}
+
+/// Walk the frame pointers of the user stack of `frame`.
+fn walk_user(frame: &StackFrame, sample: &mut Sample) {
+    let pt = unsafe { &*(get_current_pt_pa().into_kva().into_usize() as *const PageTableRoot) };
+    let read = |addr: usize| -> Option<usize> {
+        if addr % 8 != 0 {
+            return None;
+        }
+        let pa = pt.translate_user(Va::new(addr)?)?;
+        Some(unsafe { (pa.into_kva().into_usize() as *const usize).read() })
+    };
+
+    let mut fp = frame.rbp;
+    if !sample.push(frame.pc()) {
+        return;
+    }
+    while let (Some(next), Some(ret)) = (read(fp), read(fp + 8)) {
+        // The stack grows down, so the frames of the callers are above.
+        if ret == 0 || next <= fp || !sample.push(ret - 1) {
+            break;
+        }
+        fp = next;
+    }
+}
+
+/// Append the name of the function at `pc` to `line`.
+fn push_frame(line: &mut String, pc: usize, user: bool) {
+    let mut found = false;
+    if !user {
+        found = for_each_function(pc as u64, |name| {
+            // `;` separates the frames.
+            let _ = write!(line, ";{}", name.replace(';', ","));
+        });
+    }
+    if !found {
+        let _ = write!(line, ";0x{pc:x}");
+    }
+}
+
+/// Print the samples of all cpus as folded stacks.
+pub fn dump() {
+    let mut stacks: BTreeMap<(bool, Vec<usize>), u64> = BTreeMap::new();
+    let mut total = 0;
+    for buffer in BUFFERS.iter() {
+        let samples = {
+            let mut guard = buffer.lock();
+            let samples = core::mem::take(&mut *guard);
+            guard.unlock();
+            samples
+        };
+        for sample in samples.iter() {
+            *stacks
+                .entry((sample.user, sample.pcs[..sample.len].to_vec()))
+                .or_default() += 1;
+            total += 1;
+        }
+    }
+
+    println!(
+        "# profile: {} samples, {} dropped",
+        total,
+        DROPPED.load(Ordering::Relaxed)
+    );
+    for ((user, pcs), count) in stacks {
+        let mut line = String::from(if user { "user" } else { "kernel" });
+        for pc in pcs.iter().rev() {
+            push_frame(&mut line, *pc, user);
+        }
+        println!("{line} {count}");
+    }
+}
@@ -0,0 +1,254 @@
+//! Adaptive mutex.
+//!
+//! An [`AdaptiveMutex`] spins while its owner runs on another cpu, because
+//! the owner is likely to release the lock soon, and parks only when the owner
+//! is off the cpu or the spin budget runs out. A short critical section then
+//! costs a few hundred cycles of spinning instead of a round trip through the
+//! scheduler.
+//!
+//! On unlock, the mutex is handed over to the first parked waiter directly,
+//! so a woken waiter never loses the lock to a spinner.
+use crate::thread::{Current, ParkHandle, is_running_on};
+use abyss::{
+    spinlock::{SpinLock, WouldBlock},
+    x86_64::intrinsics::cpuid,
+};
+use alloc::collections::VecDeque;
+use core::{
+    cell::UnsafeCell,
+    marker::PhantomData,
+    ops::{Deref, DerefMut},
+    sync::atomic::{AtomicU64, AtomicUsize, Ordering},
+};
+
+/// Owner of an unlocked mutex.
+const UNLOCKED: u64 = u64::MAX;
+
+/// Maximum number of polls while spinning on a running owner.
+const SPIN_LIMIT: usize = 1 << 12;
+
+/// Acquisition counters of an [`AdaptiveMutex`].
+#[derive(Clone, Copy, Debug, Default)]
+pub struct MutexStat {
+    /// Acquisitions without contention.
+    pub uncontended: u64,
+    /// Contended acquisitions that are served by spinning.
+    pub spun: u64,
+    /// Contended acquisitions that park the caller.
+    pub parked: u64,
+    /// Unlocks that hand the mutex over to a parked waiter.
+    pub handoffs: u64,
+}
+
+/// A mutual exclusion primitive that spins before it parks.
+///
+/// The mutex must not be locked with interrupts disabled, as it may park the
+/// caller.
+pub struct AdaptiveMutex<T> {
+    /// Tid of the owner, or [`UNLOCKED`].
+    owner: AtomicU64,
+    /// Cpu that the owner acquires the mutex on.
+    owner_cpu: AtomicUsize,
+    /// Number of the parked waiters, including the ones about to park.
+    nr_waiters: AtomicUsize,
+    waiters: SpinLock<VecDeque<ParkHandle>>,
+    uncontended: AtomicU64,
+    spun: AtomicU64,
+    parked: AtomicU64,
+    handoffs: AtomicU64,
+    data: UnsafeCell<T>,
+}
+
+unsafe impl<T: Send> Send for AdaptiveMutex<T> {}
+unsafe impl<T: Send> Sync for AdaptiveMutex<T> {}
+
+impl<T> AdaptiveMutex<T> {
+    /// Creates a new mutex in an unlocked state ready for use.
+    pub const fn new(t: T) -> Self {
+        Self {
+            owner: AtomicU64::new(UNLOCKED),
+            owner_cpu: AtomicUsize::new(usize::MAX),
+            nr_waiters: AtomicUsize::new(0),
+            waiters: SpinLock::new(VecDeque::new()),
+            uncontended: AtomicU64::new(0),
+            spun: AtomicU64::new(0),
+            parked: AtomicU64::new(0),
+            handoffs: AtomicU64::new(0),
+            data: UnsafeCell::new(t),
+        }
+    }
+
+    #[inline]
+    fn try_acquire(&self, me: u64) -> Result<(), u64> {
+        self.owner
+            .compare_exchange(UNLOCKED, me, Ordering::Acquire, Ordering::Relaxed)
+            .map(|_| ())
+    }
+
+    fn guard(&self) -> AdaptiveMutexGuard<'_, T> {
+        self.owner_cpu.store(cpuid(), Ordering::Relaxed);
+        AdaptiveMutexGuard {
+            lock: self,
+            _not_send: PhantomData,
+        }
+    }
+
+    /// Acquires the mutex, blocking the current thread until it is able to do
+    /// so.
+    ///
+    /// The caller spins while the owner is running on another cpu, and parks
+    /// otherwise.
+    pub fn lock(&self) -> AdaptiveMutexGuard<'_, T> {
+        let me = Current::get_tid();
+        let mut owner = match self.try_acquire(me) {
+            Ok(()) => {
+                self.uncontended.fetch_add(1, Ordering::Relaxed);
+                return self.guard();
+            }
+            Err(owner) => owner,
+        };
+
+        for _ in 0..SPIN_LIMIT {
+            if owner != UNLOCKED && !is_running_on(owner, self.owner_cpu.load(Ordering::Relaxed)) {
+                break;
+            }
+            core::hint::spin_loop();
+            match self.try_acquire(me) {
+                Ok(()) => {
+                    self.spun.fetch_add(1, Ordering::Relaxed);
+                    return self.guard();
+                }
+                Err(o) => owner = o,
+            }
+        }
+
+        let mut waiters = self.waiters.lock();
+        // Announce before the last try, so that an unlock that misses the
+        // acquisition takes the slow path.
+        self.nr_waiters.fetch_add(1, Ordering::SeqCst);
+        if self
+            .owner
+            .compare_exchange(UNLOCKED, me, Ordering::SeqCst, Ordering::SeqCst)
+            .is_ok()
+        {
+            self.nr_waiters.fetch_sub(1, Ordering::Relaxed);
+            waiters.unlock();
+            self.spun.fetch_add(1, Ordering::Relaxed);
+            return self.guard();
+        }
+        self.parked.fetch_add(1, Ordering::Relaxed);
+        Current::park_with(move |handle| {
+            waiters.push_back(handle);
+            waiters.unlock();
+        });
+        // The unlocker hands the mutex over.
+        debug_assert_eq!(self.owner.load(Ordering::Relaxed), me);
+        self.guard()
+    }
+
+    /// Attempts to acquire this lock.
+    ///
+    /// # Errors
+    ///
+    /// If the mutex could not be acquired because it is already locked, then
+    /// this call will return the [`WouldBlock`] error.
+    pub fn try_lock(&self) -> Result<AdaptiveMutexGuard<'_, T>, WouldBlock> {
+        match self.try_acquire(Current::get_tid()) {
+            Ok(()) => {
+                self.uncontended.fetch_add(1, Ordering::Relaxed);
+                Ok(self.guard())
+            }
+            Err(_) => Err(WouldBlock),
+        }
+    }
+
+    /// Get the acquisition counters of this mutex.
+    pub fn stat(&self) -> MutexStat {
+        MutexStat {
+            uncontended: self.uncontended.load(Ordering::Relaxed),
+            spun: self.spun.load(Ordering::Relaxed),
+            parked: self.parked.load(Ordering::Relaxed),
+            handoffs: self.handoffs.load(Ordering::Relaxed),
+        }
+    }
+
+    /// Consumes this mutex, returning the underlying data.
+    pub fn into_inner(self) -> T {
+        self.data.into_inner()
+    }
+
+    fn release(&self) {
+        self.owner.store(UNLOCKED, Ordering::SeqCst);
+        if self.nr_waiters.load(Ordering::SeqCst) == 0 {
+            return;
+        }
+
+        let mut waiters = self.waiters.lock();
+        // A spinner may win the mutex meanwhile. Then, its unlock hands over.
+        let next = match waiters.front().map(|handle| handle.th.tid) {
+            Some(tid)
+                if self
+                    .owner
+                    .compare_exchange(UNLOCKED, tid, Ordering::Acquire, Ordering::Relaxed)
+                    .is_ok() =>
+            {
+                self.nr_waiters.fetch_sub(1, Ordering::Relaxed);
+                waiters.pop_front()
+            }
+            _ => None,
+        };
+        waiters.unlock();
+
+        if let Some(next) = next {
+            self.handoffs.fetch_add(1, Ordering::Relaxed);
+            next.unpark();
+        }
+    }
+}
+
+impl<T: Default> Default for AdaptiveMutex<T> {
+    fn default() -> Self {
+        Self::new(Default::default())
+    }
+}
+
+/// An implementation of a "scoped lock" of an [`AdaptiveMutex`].
+///
+/// The lock must be explicitly unlocked by [`unlock`] method.
+///
+/// [`unlock`]: AdaptiveMutexGuard::unlock
+pub struct AdaptiveMutexGuard<'a, T: 'a> {
+    lock: &'a AdaptiveMutex<T>,
+    /// The guard must be released by the owner thread.
+    _not_send: PhantomData<*const ()>,
+}
+
+unsafe impl<T: Sync> Sync for AdaptiveMutexGuard<'_, T> {}
+
+impl<T> Deref for AdaptiveMutexGuard<'_, T> {
+    type Target = T;
+
+    fn deref(&self) -> &T {
+        unsafe { &*self.lock.data.get() }
+    }
+}
+
+impl<T> DerefMut for AdaptiveMutexGuard<'_, T> {
+    fn deref_mut(&mut self) -> &mut T {
+        unsafe { &mut *self.lock.data.get() }
+    }
+}
+
+impl<T> AdaptiveMutexGuard<'_, T> {
+    /// Releases the underlying [`AdaptiveMutex`].
+    pub fn unlock(self) {
+        self.lock.release();
+        core::mem::forget(self);
+    }
+}
+
+impl<T> Drop for AdaptiveMutexGuard<'_, T> {
+    fn drop(&mut self) {
+        panic!("`.unlock()` must be explicitly called for AdaptiveMutexGuard.");
+    }
+}
@@ -0,0 +1,233 @@
+//! Big-reader lock.
+//!
+//! [`RwLock`] keeps every reader in a single atomic word, so the cache line
+//! of the word bounces between the cpus even if nobody writes. A [`BrLock`]
+//! gives each cpu its own reader counter on its own cache line. A reader only
+//! touches the counter of its cpu, while a writer blocks the new readers and
+//! sweeps all the counters until the readers drain.
+//!
+//! Readers become cheaper and writers become more expensive. Use it for the
+//! data that is read on hot paths and rarely written.
+//!
+//! A reader may migrate to another cpu while holding the lock. It releases
+//! the counter that it incremented, so the counters stay balanced.
+//!
+//! [`RwLock`]: super::RwLock
+use abyss::{MAX_CPU, spinlock::WouldBlock, x86_64::intrinsics::cpuid};
+use core::{
+    cell::UnsafeCell,
+    ops::{Deref, DerefMut},
+    sync::atomic::{AtomicBool, AtomicUsize, Ordering},
+};
+
+/// A reader counter on its own cache line.
+#[repr(align(64))]
+struct ReaderCount(AtomicUsize);
+
+/// A reader-writer lock with per-cpu reader counters.
+///
+/// The API is the same as [`RwLock`].
+///
+/// [`RwLock`]: super::RwLock
+pub struct BrLock<T: Send> {
+    readers: [ReaderCount; MAX_CPU],
+    writer: AtomicBool,
+    /// A reader is upgrading. Writers yield to it, since it can not drain.
+    upgrader: AtomicBool,
+    data: UnsafeCell<T>,
+}
+
+unsafe impl<T: Send> Sync for BrLock<T> {}
+unsafe impl<T: Send> Send for BrLock<T> {}
+
+/// RAII structure used to release the shared read access of a [`BrLock`]
+/// when dropped.
+pub struct BrLockReadGuard<'a, T: Send> {
+    lock: &'a BrLock<T>,
+    /// The cpu whose counter is incremented.
+    cpu: usize,
+}
+
+/// RAII structure used to release the exclusive write access of a [`BrLock`]
+/// when dropped.
+pub struct BrLockWriteGuard<'a, T: Send> {
+    lock: &'a BrLock<T>,
+}
+
+impl<T: Send> BrLock<T> {
+    /// Creates a new instance of a `BrLock<T>` which is unlocked.
+    pub const fn new(data: T) -> Self {
+        Self {
+            readers: [const { ReaderCount(AtomicUsize::new(0)) }; MAX_CPU],
+            writer: AtomicBool::new(false),
+            upgrader: AtomicBool::new(false),
+            data: UnsafeCell::new(data),
+        }
+    }
+
+    /// Number of readers across all cpus.
+    fn nr_readers(&self) -> usize {
+        self.readers
+            .iter()
+            .fold(0, |acc, r| acc.wrapping_add(r.0.load(Ordering::SeqCst)))
+    }
+
+    /// Try to enter as a reader on the current cpu.
+    #[inline]
+    fn try_read_lock(&self) -> Option<usize> {
+        let cpu = cpuid();
+        let count = &self.readers[cpu].0;
+        // Pairs with the writer that sets the flag, then sums the counters.
+        count.fetch_add(1, Ordering::SeqCst);
+        if !self.writer.load(Ordering::SeqCst) {
+            return Some(cpu);
+        }
+        count.fetch_sub(1, Ordering::Release);
+        None
+    }
+
+    /// Locks this lock with shared read access, blocking the current thread
+    /// until it can be acquired.
+    #[inline]
+    pub fn read(&self) -> BrLockReadGuard<'_, T> {
+        loop {
+            if let Some(cpu) = self.try_read_lock() {
+                return BrLockReadGuard { lock: self, cpu };
+            }
+            while self.writer.load(Ordering::Relaxed) {
+                core::hint::spin_loop();
+            }
+        }
+    }
+
+    /// Attempts to acquire this lock with shared read access.
+    ///
+    /// This function does not block.
+    #[inline]
+    pub fn try_read(&self) -> Result<BrLockReadGuard<'_, T>, WouldBlock> {
+        self.try_read_lock()
+            .map(|cpu| BrLockReadGuard { lock: self, cpu })
+            .ok_or(WouldBlock)
+    }
+
+    /// Block the new readers and the other writers.
+    fn lock_writer(&self) {
+        while self
+            .writer
+            .compare_exchange_weak(false, true, Ordering::SeqCst, Ordering::Relaxed)
+            .is_err()
+        {
+            core::hint::spin_loop();
+        }
+    }
+
+    /// Locks this lock with exclusive write access, blocking the current
+    /// thread until it can be acquired.
+    pub fn write(&self) -> BrLockWriteGuard<'_, T> {
+        loop {
+            self.lock_writer();
+            while !self.upgrader.load(Ordering::SeqCst) {
+                if self.nr_readers() == 0 {
+                    return BrLockWriteGuard { lock: self };
+                }
+                core::hint::spin_loop();
+            }
+            // Let the upgrading reader go first.
+            self.writer.store(false, Ordering::Release);
+            while self.upgrader.load(Ordering::Relaxed) {
+                core::hint::spin_loop();
+            }
+        }
+    }
+
+    /// Attempts to lock this lock with exclusive write access.
+    ///
+    /// This function does not block.
+    pub fn try_write(&self) -> Result<BrLockWriteGuard<'_, T>, WouldBlock> {
+        if self
+            .writer
+            .compare_exchange(false, true, Ordering::SeqCst, Ordering::Relaxed)
+            .is_err()
+        {
+            return Err(WouldBlock);
+        }
+        if self.nr_readers() != 0 {
+            self.writer.store(false, Ordering::Release);
+            return Err(WouldBlock);
+        }
+        Ok(BrLockWriteGuard { lock: self })
+    }
+
+    /// Consumes this lock, returning the underlying data.
+    pub fn into_inner(self) -> T {
+        self.data.into_inner()
+    }
+}
+
+impl<'a, T: Send> BrLockReadGuard<'a, T> {
+    /// Upgrade the `BrLockReadGuard` into `BrLockWriteGuard`.
+    ///
+    /// Like [`RwLockReadGuard::upgrade`], two readers that upgrade at the
+    /// same time deadlock.
+    ///
+    /// [`RwLockReadGuard::upgrade`]: super::RwLockReadGuard::upgrade
+    pub fn upgrade(self) -> BrLockWriteGuard<'a, T> {
+        let this = core::mem::ManuallyDrop::new(self);
+        let lock = this.lock;
+        lock.upgrader.store(true, Ordering::SeqCst);
+        lock.lock_writer();
+        // Wait until this guard is the only reader.
+        while lock.nr_readers() != 1 {
+            core::hint::spin_loop();
+        }
+        lock.readers[this.cpu].0.fetch_sub(1, Ordering::Release);
+        lock.upgrader.store(false, Ordering::Release);
+        BrLockWriteGuard { lock }
+    }
+}
+
+impl<'a, T: Send> BrLockWriteGuard<'a, T> {
+    /// Downgrade the `BrLockWriteGuard` into `BrLockReadGuard`.
+    pub fn downgrade(self) -> BrLockReadGuard<'a, T> {
+        let this = core::mem::ManuallyDrop::new(self);
+        let lock = this.lock;
+        let cpu = cpuid();
+        lock.readers[cpu].0.fetch_add(1, Ordering::SeqCst);
+        lock.writer.store(false, Ordering::Release);
+        BrLockReadGuard { lock, cpu }
+    }
+}
+
+impl<T: Send> Deref for BrLockReadGuard<'_, T> {
+    type Target = T;
+    fn deref(&self) -> &T {
+        unsafe { &*self.lock.data.get() }
+    }
+}
+
+impl<T: Send> Deref for BrLockWriteGuard<'_, T> {
+    type Target = T;
+    fn deref(&self) -> &T {
+        unsafe { &*self.lock.data.get() }
+    }
+}
+
+impl<T: Send> DerefMut for BrLockWriteGuard<'_, T> {
+    fn deref_mut(&mut self) -> &mut T {
+        unsafe { &mut *self.lock.data.get() }
+    }
+}
+
+impl<T: Send> Drop for BrLockReadGuard<'_, T> {
+    fn drop(&mut self) {
+        self.lock.readers[self.cpu]
+            .0
+            .fetch_sub(1, Ordering::Release);
+    }
+}
+
+impl<T: Send> Drop for BrLockWriteGuard<'_, T> {
+    fn drop(&mut self) {
+        self.lock.writer.store(false, Ordering::Release);
+    }
+}
@@ -0,0 +1,183 @@
+//! Fast userspace mutexes.
+//!
+//! A futex is a 32-bit word in the user memory. The user program manipulates
+//! the word with atomic instructions on its own, and only enters the kernel
+//! to sleep while the word holds an expected value ([`wait`]), or to wake up
+//! the sleepers ([`wake`]). Therefore, an uncontended lock never enters the
+//! kernel.
+//!
+//! A sleeper is keyed by the physical address of the word, so that threads
+//! that map the same page at different addresses meet at the same futex.
+//! The page of a sleeper is pinned while it sleeps, so that the address is
+//! not reused by another page. Sleepers are kept in a fixed table of hashed
+//! buckets. The value of the word is checked while holding the lock of the
+//! bucket, so a wake up between the check and the sleep is never lost.
+use crate::{
+    KernelError,
+    addressing::{Pa, Va},
+    mm::page_table::{PageTableRoot, get_current_pt_pa},
+    syscall::uaccess::UserU8SliceRO,
+    thread::{Current, ParkHandle},
+};
+use abyss::spinlock::SpinLock;
+use alloc::collections::VecDeque;
+use core::sync::atomic::{AtomicU32, Ordering};
+
+/// Sleep while the futex word holds the expected value.
+pub const FUTEX_WAIT: usize = 0;
+/// Wake up the sleepers of the futex.
+pub const FUTEX_WAKE: usize = 1;
+/// Wake up some sleepers and move the others to another futex.
+pub const FUTEX_REQUEUE: usize = 3;
+
+/// Number of the hashed buckets.
+const NR_BUCKETS: usize = 64;
+
+/// A thread that sleeps on a futex.
+struct Waiter {
+    /// Physical address of the futex word.
+    key: Pa,
+    handle: ParkHandle,
+}
+
+static BUCKETS: [SpinLock<VecDeque<Waiter>>; NR_BUCKETS] =
+    [const { SpinLock::new(VecDeque::new()) }; NR_BUCKETS];
+
+/// Get the index of the bucket for `key`.
+fn bucket_of(key: Pa) -> usize {
+    let key = key.into_usize() >> 2;
+    (key ^ (key >> 6) ^ (key >> 12)) % NR_BUCKETS
+}
+
+/// Translate the user address of a futex word into its key.
+///
+/// Returns [`KernelError::InvalidArgument`] if `uaddr` is not aligned, and
+/// [`KernelError::BadAddress`] if `uaddr` is not mapped.
+fn key_of(uaddr: usize) -> Result<Pa, KernelError> {
+    if uaddr % 4 != 0 {
+        return Err(KernelError::InvalidArgument);
+    }
+    let va = Va::new(uaddr).ok_or(KernelError::BadAddress)?;
+    let pt = unsafe { &*(get_current_pt_pa().into_kva().into_usize() as *const PageTableRoot) };
+    pt.translate_user(va).ok_or(KernelError::BadAddress)
+}
+
+/// Park the current thread on the futex at `uaddr`, if its word still holds
+/// `expected`.
+///
+/// Returns [`KernelError::TryAgain`] if the word holds another value.
+pub fn wait(uaddr: usize, expected: u32) -> Result<usize, KernelError> {
+    if uaddr % 4 != 0 {
+        return Err(KernelError::InvalidArgument);
+    }
+    // Pin the page during the sleep, so that its physical address, which is
+    // the key, is not reused by another page until the sleeper is woken up.
+    let pages = UserU8SliceRO::new(uaddr, 4).pin()?;
+    let key = pages.iter().next().unwrap().kva().into_pa();
+    let mut bucket = BUCKETS[bucket_of(key)].lock();
+    let word = unsafe { &*(key.into_kva().into_usize() as *const AtomicU32) };
+    if word.load(Ordering::SeqCst) != expected {
+        bucket.unlock();
+        return Err(KernelError::TryAgain);
+    }
+    Current::park_with(move |handle| {
+        bucket.push_back(Waiter { key, handle });
+        bucket.unlock();
+    });
+    drop(pages);
+    Ok(0)
+}
+
+/// Remove up to `count` sleepers on `key` from `bucket`, in the FIFO order.
+fn take(bucket: &mut VecDeque<Waiter>, key: Pa, count: usize) -> VecDeque<Waiter> {
+    let mut taken = VecDeque::new();
+    let mut idx = 0;
+    while taken.len() < count && idx < bucket.len() {
+        if bucket[idx].key == key {
+            taken.extend(bucket.remove(idx));
+        } else {
+            idx += 1;
+        }
+    }
+    taken
+}
+
+/// Wake up to `count` sleepers on the futex at `uaddr`.
+///
+/// Returns the number of woken threads.
+pub fn wake(uaddr: usize, count: usize) -> Result<usize, KernelError> {
+    let key = key_of(uaddr)?;
+    let mut bucket = BUCKETS[bucket_of(key)].lock();
+    let woken = take(&mut bucket, key, count);
+    bucket.unlock();
+
+    let n = woken.len();
+    woken.into_iter().for_each(|waiter| waiter.handle.unpark());
+    Ok(n)
+}
+
+/// Wake up to `count` sleepers on the futex at `uaddr`, and move up to
+/// `requeue` of the remaining sleepers to the futex at `uaddr2`.
+///
+/// This avoids the thundering herd of a condition variable broadcast: only
+/// one thread is woken up, and the others are woken up by the unlock of the
+/// mutex at `uaddr2` one by one.
+///
+/// Returns the number of woken threads.
+pub fn requeue(
+    uaddr: usize,
+    count: usize,
+    uaddr2: usize,
+    requeue: usize,
+) -> Result<usize, KernelError> {
+    let (key, key2) = (key_of(uaddr)?, key_of(uaddr2)?);
+    let (b, b2) = (bucket_of(key), bucket_of(key2));
+
+    let woken = if b == b2 {
+        let mut bucket = BUCKETS[b].lock();
+        let woken = take(&mut bucket, key, count);
+        let moved = take(&mut bucket, key, requeue);
+        bucket.extend(moved.into_iter().map(|w| Waiter { key: key2, ..w }));
+        bucket.unlock();
+        woken
+    } else {
+        // Lock the buckets in the order of the index to avoid a deadlock.
+        let (lo, hi) = (BUCKETS[b.min(b2)].lock(), BUCKETS[b.max(b2)].lock());
+        let (mut from, mut to) = if b < b2 { (lo, hi) } else { (hi, lo) };
+        let woken = take(&mut from, key, count);
+        let moved = take(&mut from, key, requeue);
+        to.extend(moved.into_iter().map(|w| Waiter { key: key2, ..w }));
+        if b < b2 {
+            to.unlock();
+            from.unlock();
+        } else {
+            from.unlock();
+            to.unlock();
+        }
+        woken
+    };
+
+    let n = woken.len();
+    woken.into_iter().for_each(|waiter| waiter.handle.unpark());
+    Ok(n)
+}
+
+/// Dispatch a futex operation `op`.
+///
+/// `val` is the expected value for [`FUTEX_WAIT`], and the number of threads
+/// to wake up for [`FUTEX_WAKE`] and [`FUTEX_REQUEUE`]. `val2` is the number
+/// of threads to requeue to `uaddr2`.
+pub fn futex(
+    uaddr: usize,
+    op: usize,
+    val: usize,
+    uaddr2: usize,
+    val2: usize,
+) -> Result<usize, KernelError> {
+    match op {
+        FUTEX_WAIT => wait(uaddr, val as u32),
+        FUTEX_WAKE => wake(uaddr, val),
+        FUTEX_REQUEUE => requeue(uaddr, val, uaddr2, val2),
+        _ => Err(KernelError::InvalidArgument),
+    }
+}
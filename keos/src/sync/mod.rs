@@ -79,9 +79,19 @@
 //! able to reschedule the threads while they are blocked on acquiring
 //! a lock.
 
+pub mod adaptive_mutex;
 pub mod atomic;
+pub mod brlock;
+pub mod futex;
+pub mod rcu;
 pub mod rwlock;
+pub mod seqlock;
 pub mod spinlock;
 
+#[cfg(feature = "lockstat")]
+pub use abyss::lockstat;
+pub use adaptive_mutex::{AdaptiveMutex, AdaptiveMutexGuard};
+pub use brlock::{BrLock, BrLockReadGuard, BrLockWriteGuard};
 pub use rwlock::*;
+pub use seqlock::SeqLock;
 pub use spinlock::*;
@@ -0,0 +1,152 @@
+//! Quiescent-state-based read-copy-update (RCU).
+//!
+//! RCU lets the readers of a read-mostly object run without any write to the
+//! shared memory. A writer publishes a new version of the object with an
+//! atomic pointer update, and frees the old version only after every reader
+//! that might see it has finished, i.e., after a *grace period*.
+//!
+//! A read-side critical section ([`read_lock`]) disables interrupts, so the
+//! cpu can neither switch the context nor take the timer tick inside it. A
+//! cpu reports a quiescent state on every context switch, every timer tick,
+//! and while idle. A grace period ends when every online cpu has reported a
+//! quiescent state after the grace period starts.
+//!
+//! A read-side critical section must not sleep, and [`synchronize`] must not
+//! be called inside one.
+use abyss::{MAX_CPU, boot::ONLINE_CPU, interrupt::InterruptGuard, x86_64::intrinsics::cpuid};
+use alloc::boxed::Box;
+use core::{
+    marker::PhantomData,
+    ptr::null_mut,
+    sync::atomic::{AtomicBool, AtomicPtr, AtomicU64, Ordering},
+};
+
+/// Sequence number of the last started grace period.
+static GP_SEQ: AtomicU64 = AtomicU64::new(0);
+
+/// Per-cpu quiescent state.
+#[repr(align(64))]
+struct RcuData {
+    /// The grace period sequence number that the cpu observed on its last
+    /// quiescent state.
+    seq: AtomicU64,
+    /// Whether the cpu is idle, which is an extended quiescent state.
+    idle: AtomicBool,
+}
+
+static RCU_DATA: [RcuData; MAX_CPU] = [const {
+    RcuData {
+        seq: AtomicU64::new(0),
+        idle: AtomicBool::new(false),
+    }
+}; MAX_CPU];
+
+/// Report a quiescent state of the current cpu.
+///
+/// Called on the context switch and the timer tick.
+#[inline]
+pub(crate) fn quiescent() {
+    RCU_DATA[cpuid()]
+        .seq
+        .store(GP_SEQ.load(Ordering::SeqCst), Ordering::SeqCst);
+}
+
+/// Mark the current cpu entering or leaving the idle state.
+pub(crate) fn set_idle(idle: bool) {
+    let data = &RCU_DATA[cpuid()];
+    if !idle {
+        data.seq
+            .store(GP_SEQ.load(Ordering::SeqCst), Ordering::SeqCst);
+    }
+    data.idle.store(idle, Ordering::SeqCst);
+}
+
+/// A read-side critical section.
+///
+/// The objects read in the critical section are valid until the guard is
+/// dropped.
+pub struct RcuReadGuard {
+    _guard: InterruptGuard,
+    _not_send: PhantomData<*const ()>,
+}
+
+/// Enter a read-side critical section.
+#[inline]
+pub fn read_lock() -> RcuReadGuard {
+    RcuReadGuard {
+        _guard: InterruptGuard::new(),
+        _not_send: PhantomData,
+    }
+}
+
+/// Wait until every read-side critical section that is entered before the
+/// call finishes.
+pub fn synchronize() {
+    assert!(
+        !InterruptGuard::is_guarded(),
+        "Try to wait for a grace period while holding a lock or in an RCU read-side critical section."
+    );
+    let target = GP_SEQ.fetch_add(1, Ordering::SeqCst) + 1;
+    // The caller itself is out of any read-side critical section.
+    quiescent();
+    for (data, online) in RCU_DATA.iter().zip(ONLINE_CPU.iter()) {
+        while online.load(Ordering::SeqCst)
+            && data.seq.load(Ordering::SeqCst) < target
+            && !data.idle.load(Ordering::SeqCst)
+        {
+            core::hint::spin_loop();
+        }
+    }
+}
+
+/// An RCU-protected pointer to a `T`.
+///
+/// Readers get a reference with [`RcuCell::read`] under a [`RcuReadGuard`].
+/// Updaters must be serialized by the caller. [`RcuCell::replace`] publishes
+/// the new version, and frees the old version after a grace period.
+pub struct RcuCell<T> {
+    ptr: AtomicPtr<T>,
+}
+
+unsafe impl<T: Send + Sync> Send for RcuCell<T> {}
+unsafe impl<T: Send + Sync> Sync for RcuCell<T> {}
+
+impl<T> RcuCell<T> {
+    /// Create an empty [`RcuCell`].
+    pub const fn empty() -> Self {
+        Self {
+            ptr: AtomicPtr::new(null_mut()),
+        }
+    }
+
+    /// Create a [`RcuCell`] that holds `t`.
+    pub fn new(t: T) -> Self {
+        Self {
+            ptr: AtomicPtr::new(Box::into_raw(Box::new(t))),
+        }
+    }
+
+    /// Read the current version.
+    #[inline]
+    pub fn read<'a>(&'a self, _guard: &'a RcuReadGuard) -> Option<&'a T> {
+        unsafe { self.ptr.load(Ordering::Acquire).as_ref() }
+    }
+
+    /// Publish `t`, and free the old version after a grace period.
+    pub fn replace(&self, t: T) {
+        let old = self.ptr.swap(Box::into_raw(Box::new(t)), Ordering::AcqRel);
+        if !old.is_null() {
+            synchronize();
+            drop(unsafe { Box::from_raw(old) });
+        }
+    }
+}
+
+impl<T> Drop for RcuCell<T> {
+    fn drop(&mut self) {
+        let ptr = *self.ptr.get_mut();
+        if !ptr.is_null() {
+            drop(unsafe { Box::from_raw(ptr) });
+        }
+    }
+}
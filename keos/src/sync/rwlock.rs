@@ -52,6 +52,49 @@ fn is_write_locked(b: usize) -> bool {
     b & STATE_MASK == STATE_WRITER_LOCKED
 }
 
+/// Lock statistics of a guard. Empty unless the `lockstat` feature is on.
+#[derive(Clone, Copy)]
+struct Stat {
+    #[cfg(feature = "lockstat")]
+    location: &'static core::panic::Location<'static>,
+    #[cfg(feature = "lockstat")]
+    acquired: u64,
+}
+
+impl Stat {
+    /// Get the start time of an acquisition.
+    #[inline]
+    fn start() -> u64 {
+        #[cfg(feature = "lockstat")]
+        return abyss::lockstat::now();
+        #[cfg(not(feature = "lockstat"))]
+        0
+    }
+
+    /// Charge an acquisition that started at `start`.
+    #[inline]
+    #[track_caller]
+    #[allow(unused_variables)]
+    fn acquired(contended: bool, start: u64) -> Self {
+        #[cfg(feature = "lockstat")]
+        {
+            let location = core::panic::Location::caller();
+            let acquired = abyss::lockstat::now();
+            abyss::lockstat::on_acquire(location, contended, acquired - start);
+            Self { location, acquired }
+        }
+        #[cfg(not(feature = "lockstat"))]
+        Self {}
+    }
+
+    /// Charge the release of the lock.
+    #[inline]
+    fn released(self) {
+        #[cfg(feature = "lockstat")]
+        abyss::lockstat::on_release(self.location, abyss::lockstat::now() - self.acquired);
+    }
+}
+
 /// RAII structure used to release the exclusive write access of a lock when
 /// dropped.
 ///
@@ -68,6 +111,7 @@ where
 {
     lock: &'a RwLock<T>,
     data: &'a mut T,
+    stat: Stat,
 }
 
 /// RAII structure used to release the shared read access of a lock when
@@ -86,6 +130,7 @@ where
 {
     lock: &'a RwLock<T>,
     data: &'a T,
+    stat: Stat,
 }
 
 impl<'a, T> RwLockReadGuard<'a, T>
@@ -114,6 +159,7 @@ where
                 break RwLockWriteGuard {
                     lock,
                     data: unsafe { &mut *lock.data.get() },
+                    stat: this.stat,
                 };
             }
             guard.unlock();
@@ -138,6 +184,7 @@ where
         RwLockReadGuard {
             lock,
             data: unsafe { &*lock.data.get() },
+            stat: this.stat,
         }
     }
 }
@@ -208,6 +255,7 @@ where
     #[inline]
     #[track_caller]
     pub fn read(&self) -> RwLockReadGuard<'_, T> {
+        let start = Stat::start();
         if let Ok(guard) = self.try_read() {
             guard
         } else {
@@ -215,6 +263,7 @@ where
             RwLockReadGuard {
                 lock: self,
                 data: unsafe { &*self.data.get() },
+                stat: Stat::acquired(true, start),
             }
         }
     }
@@ -248,6 +297,7 @@ where
                 break Ok(RwLockReadGuard {
                     lock: self,
                     data: unsafe { &*self.data.get() },
+                    stat: Stat::acquired(false, 0),
                 });
             }
             guard.unlock();
@@ -281,6 +331,7 @@ where
     #[inline]
     #[track_caller]
     pub fn write(&self) -> RwLockWriteGuard<'_, T> {
+        let start = Stat::start();
         if let Ok(guard) = self.try_write() {
             guard
         } else {
@@ -294,6 +345,7 @@ where
             RwLockWriteGuard {
                 lock: self,
                 data: unsafe { &mut *self.data.get() },
+                stat: Stat::acquired(true, start),
             }
         }
     }
@@ -336,6 +388,7 @@ where
                 break Ok(RwLockWriteGuard {
                     lock: self,
                     data: unsafe { &mut *self.data.get() },
+                    stat: Stat::acquired(false, 0),
                 });
             }
             guard.unlock();
@@ -405,6 +458,7 @@ where
     #[track_caller]
     fn drop(&mut self) {
         debug_assert_eq!(self.lock.state.load(Ordering::Acquire) & STATE_MASK, 0);
+        self.stat.released();
         self.lock.state.fetch_sub(1, Ordering::Release);
     }
 }
@@ -419,6 +473,7 @@ where
             self.lock.state.load(Ordering::Acquire) & STATE_MASK,
             STATE_WRITER_LOCKED
         );
+        self.stat.released();
         self.lock
             .state
             .fetch_and(!STATE_WRITER_LOCKED, Ordering::Release);
@@ -0,0 +1,66 @@
+//! Sequence lock.
+//!
+//! A [`SeqLock`] protects a small [`Copy`] value that is read far more often
+//! than written. A writer bumps the sequence number to an odd value, updates
+//! the value, and bumps it again to an even value. A reader copies the value
+//! out between two loads of the sequence number, and retries if a writer ran
+//! in between. Readers never write to the shared memory, so they do not
+//! bounce the cache line between the cpus.
+use abyss::spinlock::SpinLock;
+use core::{
+    cell::UnsafeCell,
+    sync::atomic::{AtomicUsize, Ordering, fence},
+};
+
+/// A sequence lock for a [`Copy`] value.
+pub struct SeqLock<T: Copy> {
+    seq: AtomicUsize,
+    /// Serializes the writers.
+    writer: SpinLock<()>,
+    data: UnsafeCell<T>,
+}
+
+unsafe impl<T: Copy + Send> Send for SeqLock<T> {}
+unsafe impl<T: Copy + Send> Sync for SeqLock<T> {}
+
+impl<T: Copy> SeqLock<T> {
+    /// Creates a new [`SeqLock`] that holds `t`.
+    pub const fn new(t: T) -> Self {
+        Self {
+            seq: AtomicUsize::new(0),
+            writer: SpinLock::new(()),
+            data: UnsafeCell::new(t),
+        }
+    }
+
+    /// Read a consistent copy of the value.
+    ///
+    /// Spins while a writer is updating the value.
+    #[inline]
+    pub fn read(&self) -> T {
+        loop {
+            let seq = self.seq.load(Ordering::Acquire);
+            if seq & 1 == 0 {
+                // A torn copy is discarded by the sequence check below.
+                let t = unsafe { core::ptr::read_volatile(self.data.get()) };
+                fence(Ordering::Acquire);
+                if self.seq.load(Ordering::Relaxed) == seq {
+                    return t;
+                }
+            }
+            core::hint::spin_loop();
+        }
+    }
+
+    /// Update the value with `f`.
+    pub fn write<R>(&self, f: impl FnOnce(&mut T) -> R) -> R {
+        let guard = self.writer.lock();
+        let seq = self.seq.load(Ordering::Relaxed);
+        self.seq.store(seq + 1, Ordering::Relaxed);
+        fence(Ordering::Release);
+        let r = f(unsafe { &mut *self.data.get() });
+        self.seq.store(seq + 2, Ordering::Release);
+        guard.unlock();
+        r
+    }
+}
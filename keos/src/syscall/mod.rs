@@ -3,11 +3,14 @@ use crate::thread::with_current;
 pub use abyss::interrupt::Registers;
 use abyss::x86_64::PrivilegeLevel;
 
+pub mod trace;
 pub mod uaccess;
+pub mod uring;
 
 #[doc(hidden)]
 #[unsafe(no_mangle)]
 pub extern "C" fn do_handle_syscall(frame: &mut Registers) {
+    let span = trace::enter(frame);
     with_current(|th| match th.task.as_mut() {
         Some(task) => {
             task.syscall(frame);
@@ -16,6 +19,9 @@ pub extern "C" fn do_handle_syscall(frame: &mut Registers) {
             panic!("Unexpected `syscall` instruction.")
         }
     });
+    if let Some(span) = span {
+        trace::exit(span, frame.gprs.rax);
+    }
 
     if frame.interrupt_stack_frame.cs.dpl() == PrivilegeLevel::Ring3 {
         crate::thread::__check_for_signal();
@@ -0,0 +1,165 @@
+//! System call tracing.
+//!
+//! When enabled with [`set_enabled`], the kernel stamps every system call with
+//! the TSC at entry and at exit, and collects for each system call number and
+//! each core:
+//! - the number of calls,
+//! - the number of calls that returned an error,
+//! - a log2 [`Histogram`] of the latency in TSC cycles.
+//!
+//! It also counts the returned errors by kind. The tracing can be turned on
+//! and off at run time; when it is off, the cost on the system call path is a
+//! single load.
+//!
+//! A system call is charged to the core on which it returns, which may differ
+//! from the one on which it entered if the thread migrated on the way.
+use super::Registers;
+use crate::{KernelError, thread::latency::Histogram};
+use abyss::{MAX_CPU, x86_64::intrinsics::cpuid};
+use core::{
+    arch::x86_64::_rdtsc,
+    sync::atomic::{AtomicBool, AtomicU64, Ordering},
+};
+
+/// Number of the traced system call numbers. Larger numbers are charged to
+/// the last slot.
+pub const NR_SYSCALLS: usize = 64;
+
+/// Number of the traced error codes. Errors with a larger code, such as
+/// [`KernelError::NotSupportedOperation`], are charged to the slot 0.
+const NR_ERRNO: usize = 128;
+
+/// Statistics of a system call number on a core.
+pub struct SyscallStat {
+    /// Number of the calls.
+    pub count: AtomicU64,
+    /// Number of the calls that returned an error.
+    pub errors: AtomicU64,
+    /// Latency of the calls.
+    pub latency: Histogram,
+}
+
+impl SyscallStat {
+    const fn new() -> Self {
+        Self {
+            count: AtomicU64::new(0),
+            errors: AtomicU64::new(0),
+            latency: Histogram::new(),
+        }
+    }
+}
+
+/// Statistics of a core.
+struct CoreStat {
+    syscalls: [SyscallStat; NR_SYSCALLS],
+    errno: [AtomicU64; NR_ERRNO],
+}
+
+static ENABLED: AtomicBool = AtomicBool::new(false);
+
+static CORES: [CoreStat; MAX_CPU] = [const {
+    CoreStat {
+        syscalls: [const { SyscallStat::new() }; NR_SYSCALLS],
+        errno: [const { AtomicU64::new(0) }; NR_ERRNO],
+    }
+}; MAX_CPU];
+
+/// Turn the tracing on or off.
+pub fn set_enabled(on: bool) {
+    ENABLED.store(on, Ordering::Relaxed);
+}
+
+/// Returns true if the tracing is on.
+pub fn is_enabled() -> bool {
+    ENABLED.load(Ordering::Relaxed)
+}
+
+/// Get the statistics of the system call `sysno` on the `core`.
+pub fn stat(core: usize, sysno: usize) -> &'static SyscallStat {
+    &CORES[core].syscalls[sysno.min(NR_SYSCALLS - 1)]
+}
+
+/// A system call in flight.
+pub(super) struct Span {
+    sysno: usize,
+    start: u64,
+}
+
+/// Stamp the entry of the system call in `frame`.
+#[inline]
+pub(super) fn enter(frame: &Registers) -> Option<Span> {
+    is_enabled().then(|| Span {
+        sysno: frame.gprs.rax,
+        start: unsafe { _rdtsc() },
+    })
+}
+
+/// Stamp the exit of the system call that returns `ret`.
+#[inline]
+pub(super) fn exit(span: Span, ret: usize) {
+    let cycles = unsafe { _rdtsc() }.saturating_sub(span.start);
+    let core = &CORES[cpuid()];
+    let stat = &core.syscalls[span.sysno.min(NR_SYSCALLS - 1)];
+    stat.count.fetch_add(1, Ordering::Relaxed);
+    stat.latency.record(cycles);
+    let ret = ret as isize;
+    if (-4095..0).contains(&ret) {
+        stat.errors.fetch_add(1, Ordering::Relaxed);
+        let errno = (-ret) as usize;
+        core.errno[if errno < NR_ERRNO { errno } else { 0 }].fetch_add(1, Ordering::Relaxed);
+    }
+}
+
+/// Clear all the statistics.
+pub fn reset() {
+    for core in CORES.iter() {
+        for stat in core.syscalls.iter() {
+            stat.count.store(0, Ordering::Relaxed);
+            stat.errors.store(0, Ordering::Relaxed);
+            stat.latency.reset();
+        }
+        for cnt in core.errno.iter() {
+            cnt.store(0, Ordering::Relaxed);
+        }
+    }
+}
+
+/// Print the statistics of every system call number that has been called,
+/// summed over the cores, followed by the errors by kind.
+pub fn dump() {
+    println!("[SYSCALL] calls, errors, and p50/p99/max latency in TSC cycles.");
+    for sysno in 0..NR_SYSCALLS {
+        let (mut count, mut errors) = (0, 0);
+        let latency = Histogram::new();
+        for core in CORES.iter() {
+            let stat = &core.syscalls[sysno];
+            count += stat.count.load(Ordering::Relaxed);
+            errors += stat.errors.load(Ordering::Relaxed);
+            latency.merge(&stat.latency);
+        }
+        if count == 0 {
+            continue;
+        }
+        let more = if sysno == NR_SYSCALLS - 1 { "+" } else { "" };
+        println!(
+            "  #{sysno}{more}: {count} calls, {errors} errors, <{}/<{}/<{}",
+            latency.percentile(50).unwrap_or(0),
+            latency.percentile(99).unwrap_or(0),
+            latency.percentile(100).unwrap_or(0),
+        );
+    }
+    for errno in 0..NR_ERRNO {
+        let cnt: u64 = CORES
+            .iter()
+            .map(|core| core.errno[errno].load(Ordering::Relaxed))
+            .sum();
+        if cnt == 0 {
+            continue;
+        }
+        match KernelError::try_from(-(errno as isize)) {
+            Ok(e) if errno != 0 => println!("  {e:?}: {cnt}"),
+            _ if errno == 0 => println!("  other errors: {cnt}"),
+            _ => println!("  errno {errno}: {cnt}"),
+        }
+    }
+}
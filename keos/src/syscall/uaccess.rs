@@ -22,6 +22,9 @@
 //! - [`UserCString`]: A utility to handle C-style null-terminated strings from
 //!   user-space. It provides methods for reading and converting the string into
 //!   a `String` in the kernel.
+//! - [`UserPages`]: A scatter-gather view of a user buffer, made of the pinned
+//!   pages that back it. It lets the kernel copy to and from a large user
+//!   buffer without an intermediate kernel buffer.
 //!
 //! These types use unsafe code to access memory directly. The user-space
 //! addresses must be valid and within bounds to prevent undefined behavior or
@@ -32,10 +35,14 @@
 //! not accessible, the operation will fail gracefully instead of causing
 //! undefined behavior.
 use crate::KernelError;
+use crate::mm::{
+    ContigPages,
+    page_table::{PageTableRoot, get_current_pt_pa},
+};
 #[cfg(doc)]
 use crate::task::Task;
 use crate::thread::with_current;
-use abyss::addressing::Va;
+use abyss::addressing::{Kva, PAGE_SIZE, Va};
 use alloc::string::String;
 use alloc::vec::Vec;
 
@@ -192,6 +199,44 @@ impl UserU8SliceRO {
             }
         })
     }
+
+    /// Reads data from the user-space buffer into `buf`, without an
+    /// intermediate allocation.
+    ///
+    /// Takes ownership of `self` to prevent TOCTOU attacks.
+    ///
+    /// Returns `Ok(usize)` indicating the number of bytes read, which is the
+    /// smaller of the two lengths, or `Err(KernelError::BadAddress)` on
+    /// failure.
+    pub fn get_into(self, buf: &mut [u8]) -> Result<usize, KernelError> {
+        let size = self.len.min(buf.len());
+        let access_range = Va::new(self.addr).ok_or(KernelError::BadAddress)?
+            ..Va::new(self.addr + size).ok_or(KernelError::BadAddress)?;
+        with_current(|th| {
+            let task = th
+                .task
+                .as_ref()
+                .expect("Try to call UserU8SliceRO::get_into() on the kernel thread.");
+            if task.access_ok(access_range, false) {
+                unsafe {
+                    core::ptr::copy_nonoverlapping(self.addr as *const u8, buf.as_mut_ptr(), size);
+                }
+                Ok(size)
+            } else {
+                Err(KernelError::BadAddress)
+            }
+        })
+    }
+}
+
+impl UserU8SliceRO {
+    /// Pins the pages that back the user buffer, and returns them as a
+    /// scatter-gather list.
+    ///
+    /// Takes ownership of `self` to prevent TOCTOU attacks.
+    pub fn pin(self) -> Result<UserPages, KernelError> {
+        UserPages::pin(self.addr, self.len, false)
+    }
 }
 
 /// A one-time, write-only pointer to a slice of `u8` in user-space.
@@ -242,6 +287,18 @@ impl UserU8SliceWO {
     }
 }
 
+impl UserU8SliceWO {
+    /// Pins the pages that back the user buffer, and returns them as a
+    /// scatter-gather list.
+    ///
+    /// Takes ownership of `self` to prevent TOCTOU attacks. The pages are
+    /// faulted in for write, so that the copy-on-write pages are copied
+    /// beforehand.
+    pub fn pin(self) -> Result<UserPages, KernelError> {
+        UserPages::pin(self.addr, self.len, true)
+    }
+}
+
 /// A pointer to a null-terminated C-style string in user-space.
 ///
 /// This struct provides a safe abstraction for reading strings from user-space.
@@ -288,3 +345,217 @@ impl UserCString {
         }
     }
 }
+
+/// A piece of a user buffer within a single page.
+pub struct UserChunk {
+    /// Holds a reference of the page, so that it is not freed by a
+    /// concurrent unmap.
+    _pin: ContigPages,
+    kva: Kva,
+    len: usize,
+}
+
+impl UserChunk {
+    /// Kernel virtual address of the chunk.
+    #[inline]
+    pub fn kva(&self) -> Kva {
+        self.kva
+    }
+
+    /// Length of the chunk in bytes.
+    #[inline]
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    /// Returns true if the chunk is empty.
+    #[inline]
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    /// View the chunk as a byte slice.
+    #[inline]
+    pub fn as_slice(&self) -> &[u8] {
+        unsafe { core::slice::from_raw_parts(self.kva.into_usize() as *const u8, self.len) }
+    }
+
+    /// View the chunk as a mutable byte slice.
+    #[inline]
+    pub fn as_mut_slice(&mut self) -> &mut [u8] {
+        unsafe { core::slice::from_raw_parts_mut(self.kva.into_usize() as *mut u8, self.len) }
+    }
+}
+
+/// The pinned pages that back a user buffer, in order.
+///
+/// The buffer is checked with [`Task::access_ok`] once, and each page is
+/// resolved through the page table of the current process. A page that is
+/// not present yet is faulted in by touching it, as the plain accessors
+/// would.
+pub struct UserPages {
+    chunks: Vec<UserChunk>,
+}
+
+impl UserPages {
+    fn pin(addr: usize, len: usize, is_write: bool) -> Result<Self, KernelError> {
+        let access_range = Va::new(addr).ok_or(KernelError::BadAddress)?
+            ..Va::new(addr + len).ok_or(KernelError::BadAddress)?;
+        if !with_current(|th| {
+            th.task
+                .as_ref()
+                .expect("Try to pin user pages on the kernel thread.")
+                .access_ok(access_range, is_write)
+        }) {
+            return Err(KernelError::BadAddress);
+        }
+
+        let pt = unsafe { &*(get_current_pt_pa().into_kva().into_usize() as *const PageTableRoot) };
+        let nr = len.div_ceil(PAGE_SIZE) + 1;
+        let (mut pages, mut spans) = (Vec::with_capacity(nr), Vec::with_capacity(nr));
+        let mut pos = addr;
+        while pos < addr + len {
+            let va = Va::new(pos).unwrap();
+            let (base, size) = match pt.user_mapping(va, is_write) {
+                Some(m) => m,
+                None => {
+                    Self::fault_in(pos, is_write);
+                    pt.user_mapping(va, is_write)
+                        .ok_or(KernelError::BadAddress)?
+                }
+            };
+            let ofs = pos & (size - 1);
+            let n = (size - ofs).min(addr + len - pos);
+            pages.push((base.into_kva(), size));
+            spans.push((base.into_kva() + ofs, n));
+            pos += n;
+        }
+        // Take the references of all pages at once.
+        let chunks = ContigPages::clone_many(&pages)
+            .into_iter()
+            .zip(spans)
+            .map(|(pin, (kva, len))| UserChunk {
+                _pin: pin,
+                kva,
+                len,
+            })
+            .collect();
+        Ok(Self { chunks })
+    }
+
+    /// Touch the user byte at `addr` to make the page fault handler map it.
+    fn fault_in(addr: usize, is_write: bool) {
+        unsafe {
+            if is_write {
+                // A read-modify-write that never loses a concurrent update.
+                (*(addr as *const core::sync::atomic::AtomicU8))
+                    .fetch_add(0, core::sync::atomic::Ordering::Relaxed);
+            } else {
+                core::ptr::read_volatile(addr as *const u8);
+            }
+        }
+    }
+
+    /// Total length of the buffer.
+    pub fn len(&self) -> usize {
+        self.chunks.iter().map(UserChunk::len).sum()
+    }
+
+    /// Returns true if the buffer is empty.
+    pub fn is_empty(&self) -> bool {
+        self.chunks.is_empty()
+    }
+
+    /// Iterate over the chunks.
+    pub fn iter(&self) -> core::slice::Iter<'_, UserChunk> {
+        self.chunks.iter()
+    }
+
+    /// Iterate over the chunks mutably.
+    pub fn iter_mut(&mut self) -> core::slice::IterMut<'_, UserChunk> {
+        self.chunks.iter_mut()
+    }
+
+    /// Copy `src` into the buffer. Returns the number of the copied bytes.
+    pub fn copy_from(&mut self, mut src: &[u8]) -> usize {
+        let mut done = 0;
+        for chunk in self.chunks.iter_mut() {
+            let n = chunk.len().min(src.len());
+            chunk.as_mut_slice()[..n].copy_from_slice(&src[..n]);
+            src = &src[n..];
+            done += n;
+            if src.is_empty() {
+                break;
+            }
+        }
+        done
+    }
+
+    /// Copy the buffer into `dst`. Returns the number of the copied bytes.
+    pub fn copy_to(&self, mut dst: &mut [u8]) -> usize {
+        let mut done = 0;
+        for chunk in self.chunks.iter() {
+            let n = chunk.len().min(dst.len());
+            dst[..n].copy_from_slice(&chunk.as_slice()[..n]);
+            dst = &mut dst[n..];
+            done += n;
+            if dst.is_empty() {
+                break;
+            }
+        }
+        done
+    }
+}
+
+impl<'a> IntoIterator for &'a UserPages {
+    type Item = &'a UserChunk;
+    type IntoIter = core::slice::Iter<'a, UserChunk>;
+    fn into_iter(self) -> Self::IntoIter {
+        self.iter()
+    }
+}
+
+impl<'a> IntoIterator for &'a mut UserPages {
+    type Item = &'a mut UserChunk;
+    type IntoIter = core::slice::IterMut<'a, UserChunk>;
+    fn into_iter(self) -> Self::IntoIter {
+        self.iter_mut()
+    }
+}
+
+/// Maximum number of the [`IoVec`]s of a vectored I/O.
+pub const IOV_MAX: usize = 1024;
+
+/// A user buffer of a vectored I/O, corresponding to `struct iovec`.
+#[repr(C)]
+#[derive(Clone, Copy, Debug, Default)]
+pub struct IoVec {
+    /// Start address of the buffer.
+    pub base: usize,
+    /// Length of the buffer.
+    pub len: usize,
+}
+
+impl IoVec {
+    /// Read the array of `cnt` [`IoVec`]s at the user address `addr`.
+    ///
+    /// Returns [`KernelError::InvalidArgument`] if `cnt` exceeds [`IOV_MAX`]
+    /// or the total length overflows `isize`.
+    pub fn read_array(addr: usize, cnt: usize) -> Result<Vec<IoVec>, KernelError> {
+        if cnt > IOV_MAX {
+            return Err(KernelError::InvalidArgument);
+        }
+        let mut total = 0usize;
+        (0..cnt)
+            .map(|i| {
+                let iov =
+                    UserPtrRO::<IoVec>::new(addr + i * core::mem::size_of::<IoVec>()).get()?;
+                total = total
+                    .checked_add(iov.len)
+                    .filter(|t| *t <= isize::MAX as usize)
+                    .ok_or(KernelError::InvalidArgument)?;
+                Ok(iov)
+            })
+            .collect()
+    }
+}
@@ -0,0 +1,154 @@
+//! Batched system calls through a submission/completion ring.
+//!
+//! A user program that issues many small system calls pays a user/kernel
+//! transition for each. Instead, it can place the requests in a
+//! submission queue (SQ) in its own memory, and execute all of them with a
+//! single [`enter`] call. The result of each request is posted to the
+//! completion queue (CQ) in the same memory.
+//!
+//! The ring is laid out in user memory as follows, where `entries` is a power
+//! of two:
+//!
+//! ```text
+//! +-------------------+ ring
+//! | RingHeader        |
+//! +-------------------+ ring + SQES_OFFSET
+//! | Sqe[entries]      |
+//! +-------------------+ ring + SQES_OFFSET + entries * size_of::<Sqe>()
+//! | Cqe[entries]      |
+//! +-------------------+
+//! ```
+//!
+//! The user program produces at `sq_tail` and consumes at `cq_head`; the
+//! kernel consumes at `sq_head` and produces at `cq_tail`. The indices run
+//! freely and are masked with `entries - 1`.
+//!
+//! The requests are executed in order, in the context of the calling thread,
+//! through the same dispatcher as the `syscall` instruction.
+use super::uaccess::{UserPtrRO, UserPtrWO};
+use crate::KernelError;
+use abyss::interrupt::Registers;
+use core::mem::{offset_of, size_of};
+
+/// Offset of the submission queue from the start of the ring.
+pub const SQES_OFFSET: usize = 64;
+
+/// Maximum number of the entries of a ring.
+pub const MAX_ENTRIES: u32 = 4096;
+
+/// Header of a ring, shared with the user program.
+#[repr(C)]
+#[derive(Clone, Copy, Debug, Default)]
+pub struct RingHeader {
+    /// Next submission to be consumed by the kernel.
+    pub sq_head: u32,
+    /// Next submission slot to be filled by the user program.
+    pub sq_tail: u32,
+    /// Next completion to be consumed by the user program.
+    pub cq_head: u32,
+    /// Next completion slot to be filled by the kernel.
+    pub cq_tail: u32,
+    /// Number of the entries of each queue.
+    pub entries: u32,
+}
+
+/// A submission queue entry.
+#[repr(C)]
+#[derive(Clone, Copy, Debug, Default)]
+pub struct Sqe {
+    /// The system call number.
+    pub sysno: u64,
+    /// The arguments of the system call.
+    pub args: [u64; 6],
+    /// An opaque value that is copied to the completion.
+    pub user_data: u64,
+}
+
+/// A completion queue entry.
+#[repr(C)]
+#[derive(Clone, Copy, Debug, Default)]
+pub struct Cqe {
+    /// The `user_data` of the submission.
+    pub user_data: u64,
+    /// The return value of the system call.
+    pub res: i64,
+}
+
+const _: () = assert!(size_of::<RingHeader>() <= SQES_OFFSET);
+
+/// Execute up to `to_submit` pending submissions of the ring at `ring`.
+///
+/// Each submission is dispatched with `dispatch` on a copy of `regs`, which
+/// are the registers of the `enter` call, with the system call number and
+/// the arguments replaced. A submission whose number is not in `allowed` is
+/// completed with [`KernelError::InvalidArgument`]. The callers allow only
+/// the file I/O, so that rings do not nest and a submission never changes
+/// the process itself, e.g., by a fork or an exit.
+///
+/// Stops early when the completion queue is full, or when an entry is not
+/// accessible. Returns the number of the consumed submissions.
+pub fn enter(
+    ring: usize,
+    to_submit: usize,
+    allowed: &[usize],
+    regs: &Registers,
+    mut dispatch: impl FnMut(&mut Registers),
+) -> Result<usize, KernelError> {
+    let header = UserPtrRO::<RingHeader>::new(ring).get()?;
+    let entries = header.entries;
+    if entries == 0 || entries > MAX_ENTRIES || !entries.is_power_of_two() {
+        return Err(KernelError::InvalidArgument);
+    }
+    let mask = entries - 1;
+    let sqes = ring + SQES_OFFSET;
+    let cqes = sqes + entries as usize * size_of::<Sqe>();
+
+    let pending = header.sq_tail.wrapping_sub(header.sq_head).min(entries) as usize;
+    let (mut sq_head, mut cq_tail) = (header.sq_head, header.cq_tail);
+    let mut done = 0;
+    let mut error = None;
+    while done < pending.min(to_submit) && cq_tail.wrapping_sub(header.cq_head) < entries {
+        let sqe = match UserPtrRO::<Sqe>::new(sqes + (sq_head & mask) as usize * size_of::<Sqe>())
+            .get()
+        {
+            Ok(sqe) => sqe,
+            Err(e) => {
+                error = Some(e);
+                break;
+            }
+        };
+        let res = if !allowed.contains(&(sqe.sysno as usize)) {
+            KernelError::InvalidArgument.into_usize()
+        } else {
+            let mut regs = *regs;
+            let [a1, a2, a3, a4, a5, a6] = sqe.args.map(|a| a as usize);
+            regs.gprs.rax = sqe.sysno as usize;
+            (regs.gprs.rdi, regs.gprs.rsi, regs.gprs.rdx) = (a1, a2, a3);
+            (regs.gprs.r10, regs.gprs.r8, regs.gprs.r9) = (a4, a5, a6);
+            dispatch(&mut regs);
+            regs.gprs.rax
+        };
+        sq_head = sq_head.wrapping_add(1);
+        done += 1;
+        let cqe = Cqe {
+            user_data: sqe.user_data,
+            res: res as i64,
+        };
+        // The submission is consumed even if its completion is lost.
+        if let Err(e) =
+            UserPtrWO::<Cqe>::new(cqes + (cq_tail & mask) as usize * size_of::<Cqe>()).put(cqe)
+        {
+            error = Some(e);
+            break;
+        }
+        cq_tail = cq_tail.wrapping_add(1);
+    }
+
+    // Publish only the indices that the kernel owns.
+    UserPtrWO::<u32>::new(ring + offset_of!(RingHeader, sq_head)).put(sq_head)?;
+    UserPtrWO::<u32>::new(ring + offset_of!(RingHeader, cq_tail)).put(cq_tail)?;
+    match error {
+        Some(e) if done == 0 => Err(e),
+        _ => Ok(done),
+    }
+}
@@ -1,11 +1,12 @@
 //! Task trait for interact with user process.
 
-use crate::thread::kill_current_thread;
+use crate::{acct::Account, thread::kill_current_thread};
 pub use abyss::x86_64::interrupt::PFErrorCode;
 use abyss::{
     addressing::{Pa, Va},
     interrupt::Registers,
 };
+use alloc::sync::Arc;
 use core::ops::Range;
 
 /// Represents a **task** executed by a thread.
@@ -66,6 +67,11 @@ pub trait Task {
 
     /// Run a closure with physical address of the page table.
     fn with_page_table_pa(&self, _f: &fn(Pa)) {}
+
+    /// Returns the resource [`Account`] of the process, if it keeps one.
+    fn account(&self) -> Option<Arc<Account>> {
+        None
+    }
 }
 
 impl Task for () {
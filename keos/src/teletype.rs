@@ -3,8 +3,29 @@
 //! This module provides a trait [`Teletype`] that defines an interface for
 //! reading from and writing to a teletype device, such as a serial port.
 //! The [`Serial`] struct implements this interface for x86_64 systems.
+//!
+//! Once the kernel is booted, the serial port is driven by interrupts:
+//! - A writer appends its bytes to the transmit ring of the port and
+//!   returns. The transmit interrupt sends the ring out. A writer parks only
+//!   while the ring is full.
+//! - The receive interrupt edits the input a line at a time, echoing it, and
+//!   wakes up the readers when a line is finished. A reader parks until a
+//!   line, or an end of file (Ctrl-D), arrives.
+//!
+//! A caller that runs with the interrupts disabled polls the port instead.
 
-use crate::{KernelError, spinlock::SpinLock, thread::with_current};
+use crate::{
+    KernelError,
+    spinlock::SpinLock,
+    sync::AdaptiveMutex,
+    thread::{Current, ParkHandle, scheduler::BOOT_DONE, with_current},
+};
+use abyss::{
+    dev::x86_64::serial::{self, IRQ_VECTOR},
+    interrupt::InterruptGuard,
+};
+use alloc::vec::Vec;
+use core::sync::atomic::Ordering;
 
 /// The `Teletype` trait represents a generic character-based input/output
 /// device.
@@ -66,30 +87,237 @@ impl Default for Serial {
     }
 }
 
-/// A global serial device protected by a spinlock.
+/// A global serial device protected by a mutex.
 ///
 /// This static instance of [`Serial`] ensures safe concurrent access to the
-/// serial port. It is wrapped in a [`SpinLock`] to provide mutual exclusion,
-/// preventing race conditions when multiple threads attempt to write to or read
-/// from the serial device.
+/// serial port. It is wrapped in an [`AdaptiveMutex`] to provide mutual
+/// exclusion, preventing race conditions when multiple threads attempt to
+/// write to or read from the serial device. A reader may park on the mutex
+/// until its line arrives, so a [`SpinLock`] does not fit.
 ///
 /// The [`Serial`] struct typically represents a UART (Universal Asynchronous
 /// Receiver-Transmitter) device used for debugging, logging, or kernel output.
-///
-/// # Safety
-/// - Accessing this global requires acquiring the spinlock before modifying the
-///   serial state.
-/// - Since [`SpinLock`] is used instead of [`Mutex`], it should **only be used
-///   in environments without preemption**, such as kernel mode, to avoid
-///   deadlocks.
-///
-/// [`Mutex`]: struct.Mutex.html
-static SERIAL: SpinLock<Serial> = SpinLock::new(Serial::new());
+static SERIAL: AdaptiveMutex<Serial> = AdaptiveMutex::new(Serial::new());
+
+/// Size of the input buffer.
+const INPUT_SIZE: usize = 1024;
+
+/// Ctrl-D, which ends the input without a newline.
+const EOT: u8 = 0x04;
+/// Backspace, which erases the last byte of the line.
+const DEL: u8 = 0x7f;
+
+/// Input of the serial port, edited a line at a time.
+struct Input {
+    buf: [u8; INPUT_SIZE],
+    /// Number of the buffered bytes.
+    len: usize,
+    /// Number of the bytes of the finished lines, which can be read. The rest
+    /// is the line being edited.
+    ready: usize,
+    /// Readers waiting for a finished line.
+    waiters: Vec<ParkHandle>,
+}
+
+static INPUT: SpinLock<Input> = SpinLock::new(Input {
+    buf: [0; INPUT_SIZE],
+    len: 0,
+    ready: 0,
+    waiters: Vec::new(),
+});
+
+/// Writers waiting for room in the transmit ring.
+static TX_WAITERS: SpinLock<Vec<ParkHandle>> = SpinLock::new(Vec::new());
+
+/// Bytes to echo, collected while the input is locked.
+struct Echo {
+    buf: [u8; 48],
+    len: usize,
+}
+
+impl Echo {
+    fn push(&mut self, bytes: &[u8]) {
+        self.buf[self.len..self.len + bytes.len()].copy_from_slice(bytes);
+        self.len += bytes.len();
+    }
+}
+
+impl Input {
+    /// Edit the line with a received `byte`.
+    fn receive(&mut self, byte: u8, echo: &mut Echo) {
+        match byte {
+            DEL => {
+                if self.len > self.ready {
+                    self.len -= 1;
+                    echo.push(b"\x08 \x08");
+                }
+            }
+            _ if self.len == INPUT_SIZE => {
+                // Hand the full buffer to the readers, dropping `byte`.
+                self.ready = self.len;
+            }
+            _ => {
+                self.buf[self.len] = byte;
+                self.len += 1;
+                if byte != EOT {
+                    echo.push(&[byte]);
+                }
+                if matches!(byte, b'\n' | b'\r' | EOT) {
+                    self.ready = self.len;
+                }
+            }
+        }
+    }
+
+    /// Read up to the end of the first finished line into `data`. Returns
+    /// `None` if no line is finished.
+    ///
+    /// The end of file is consumed but not read.
+    fn take(&mut self, data: &mut [u8]) -> Option<usize> {
+        if self.ready == 0 {
+            return None;
+        }
+        let (line, eot) = match self.buf[..self.ready]
+            .iter()
+            .position(|b| matches!(*b, b'\n' | b'\r' | EOT))
+        {
+            Some(i) if self.buf[i] == EOT => (i, true),
+            Some(i) => (i + 1, false),
+            None => (self.ready, false),
+        };
+        let n = line.min(data.len());
+        data[..n].copy_from_slice(&self.buf[..n]);
+        let consumed = if eot && n == line { n + 1 } else { n };
+        self.buf.copy_within(consumed..self.len, 0);
+        self.len -= consumed;
+        self.ready -= consumed;
+        Some(n)
+    }
+}
+
+/// Move the received bytes into the input, and wake up the readers of the
+/// finished lines.
+fn poll_input() {
+    loop {
+        let mut echo = Echo {
+            buf: [0; 48],
+            len: 0,
+        };
+        // The port is read under the lock, so that two cpus do not take the
+        // same byte.
+        let mut input = INPUT.lock();
+        let mut n = 0;
+        while n < 16 {
+            let Some(b) = serial::read_byte() else {
+                break;
+            };
+            input.receive(b, &mut echo);
+            n += 1;
+        }
+        let ths = if input.ready != 0 {
+            core::mem::take(&mut input.waiters)
+        } else {
+            Vec::new()
+        };
+        input.unlock();
+        // The echo is dropped if the transmit ring is full.
+        if echo.len != 0 {
+            abyss::kprint::queue_output(&echo.buf[..echo.len]);
+        }
+        ths.into_iter().for_each(ParkHandle::unpark);
+        if n < 16 {
+            return;
+        }
+    }
+}
+
+fn handler(_regs: &mut crate::syscall::Registers) {
+    serial::ack_interrupt();
+    poll_input();
+    abyss::kprint::transmit();
+    let mut waiters = TX_WAITERS.lock();
+    let ths = core::mem::take(&mut *waiters);
+    waiters.unlock();
+    ths.into_iter().for_each(ParkHandle::unpark);
+}
+
+/// Drive the serial port by interrupts.
+pub(crate) fn init() {
+    crate::interrupt::register(IRQ_VECTOR as usize, handler);
+    serial::enable_interrupt();
+}
+
+/// Whether the current thread can park for the port.
+fn may_park() -> bool {
+    serial::is_interrupt_driven()
+        && BOOT_DONE.load(Ordering::SeqCst)
+        && !InterruptGuard::is_guarded()
+}
+
+/// Queue `data` to the serial port, parking while the transmit ring is
+/// full.
+fn output(mut data: &[u8]) {
+    while !data.is_empty() {
+        let n = abyss::kprint::queue_output(data);
+        data = &data[n..];
+        if data.is_empty() {
+            return;
+        }
+        if !may_park() {
+            abyss::kprint::transmit();
+            core::hint::spin_loop();
+            continue;
+        }
+        let mut waiters = TX_WAITERS.lock();
+        // Retry under the lock, so that the wake-up is not missed.
+        let n = abyss::kprint::queue_output(data);
+        data = &data[n..];
+        if n != 0 {
+            waiters.unlock();
+            continue;
+        }
+        Current::park_with(move |handle| {
+            waiters.push(handle);
+            waiters.unlock();
+        });
+    }
+}
+
+/// Read a line of the serial port into `data`, parking until it is
+/// finished.
+fn input(data: &mut [u8]) -> Result<usize, KernelError> {
+    if data.is_empty() {
+        return Ok(0);
+    }
+    if !serial::is_interrupt_driven() {
+        return serial::read_bytes_busywait(data).ok_or(KernelError::IOError);
+    }
+    loop {
+        let park = may_park();
+        if !park {
+            poll_input();
+        }
+        let mut input = INPUT.lock();
+        if let Some(n) = input.take(data) {
+            input.unlock();
+            return Ok(n);
+        }
+        if !park {
+            input.unlock();
+            core::hint::spin_loop();
+            continue;
+        }
+        Current::park_with(move |handle| {
+            input.waiters.push(handle);
+            input.unlock();
+        });
+    }
+}
 
 /// Returns a reference to the global serial device.
 ///
 /// This function provides safe access to the global serial interface wrapped in
-/// a [`SpinLock`]. Users must lock the spinlock before performing any
+/// an [`AdaptiveMutex`]. Users must lock the mutex before performing any
 /// operations on the [`Serial`] instance.
 ///
 /// # Example
@@ -101,12 +329,16 @@ static SERIAL: SpinLock<Serial> = SpinLock::new(Serial::new());
 /// ```
 ///
 /// # Safety
-/// - Since this returns a reference to a global [`SpinLock`], the caller must
-///   **ensure proper locking** before accessing the [`Serial`] device.
+/// - Since this returns a reference to a global [`AdaptiveMutex`], the
+///   caller must **ensure proper locking** before accessing the [`Serial`]
+///   device.
+/// - The mutex may park the caller, so it must not be locked with the
+///   interrupts disabled.
 ///
 /// # Returns
-/// A reference to the [`SpinLock`] wrapping the global [`Serial`] instance.
-pub fn serial() -> &'static SpinLock<Serial> {
+/// A reference to the [`AdaptiveMutex`] wrapping the global [`Serial`]
+/// instance.
+pub fn serial() -> &'static AdaptiveMutex<Serial> {
     &SERIAL
 }
 
@@ -114,9 +346,12 @@ impl Teletype for Serial {
     /// Writes data to the serial teletype (COM1).
     ///
     /// This function attempts to convert the input byte slice into a UTF-8
-    /// string. If the conversion is successful, it prints the string to
-    /// the console. If the data is aligned to a **16-byte boundary**, it
-    /// is printed as a single string; otherwise, it is printed byte by byte.
+    /// string. If the conversion is successful, it queues the string to the
+    /// console. If the data is aligned to a **8-byte boundary**, it must be
+    /// a valid UTF-8 string; otherwise, it is queued as is.
+    ///
+    /// The call returns once the data is queued; it parks only while the
+    /// transmit ring is full.
     ///
     /// # Arguments
     /// - `data`: The byte slice to be written.
@@ -125,20 +360,14 @@ impl Teletype for Serial {
     /// - `Ok(usize)`: The number of bytes written.
     /// - `Err`: If the input data is not valid UTF-8.
     fn write(&mut self, data: &[u8]) -> Result<usize, KernelError> {
+        // Queue outside of the hook lock, which disables the interrupts.
+        let b = if data.as_ptr().is_aligned_to(8) && core::str::from_utf8(data).is_err() {
+            Err(KernelError::InvalidArgument)
+        } else {
+            output(data);
+            Ok(data.len())
+        };
         with_current(|th| {
-            let b = if data.as_ptr().is_aligned_to(8) {
-                if let Ok(b) = core::str::from_utf8(data) {
-                    print!("{}", b);
-                    Ok(data.len())
-                } else {
-                    Err(KernelError::InvalidArgument)
-                }
-            } else {
-                for b in data {
-                    print!("{}", b);
-                }
-                Ok(data.len())
-            };
             let mut tty_hook = th.tty_hook.lock();
             let val = match tty_hook.as_mut() {
                 Some(ttyhook) => {
@@ -157,7 +386,9 @@ impl Teletype for Serial {
     /// Reads data from the serial teletype (COM1).
     ///
     /// This function retrieves data from the serial interface and stores it
-    /// in the provided mutable buffer.
+    /// in the provided mutable buffer. It parks until a line, which is
+    /// returned with its newline, or an end of file arrives; a line longer
+    /// than the buffer is returned over several reads.
     ///
     /// # Arguments
     /// - `data`: A mutable byte slice where the read data will be stored.
@@ -166,21 +397,20 @@ impl Teletype for Serial {
     /// - `Ok(usize)`: The number of bytes successfully read.
     /// - `Err`: If the read operation failed.
     fn read(&mut self, data: &mut [u8]) -> Result<usize, KernelError> {
-        with_current(|th| {
+        let hooked = with_current(|th| {
             let mut tty_guard = th.tty_hook.lock();
 
-            let val = match tty_guard.as_mut() {
-                Some(ttyhook) => {
-                    let mut guard = ttyhook.lock();
-                    let val = guard.read(data);
-                    guard.unlock();
-                    val
-                }
-                _ => abyss::dev::x86_64::serial::read_bytes_busywait(data)
-                    .ok_or(KernelError::IOError),
-            };
+            let val = tty_guard.as_mut().map(|ttyhook| {
+                let mut guard = ttyhook.lock();
+                let val = guard.read(data);
+                guard.unlock();
+                val
+            });
             tty_guard.unlock();
             val
-        })
+        });
+        // Wait for the input outside of the hook lock, which disables the
+        // interrupts.
+        hooked.unwrap_or_else(|| input(data))
     }
 }
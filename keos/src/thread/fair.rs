@@ -0,0 +1,197 @@
+//! Fair-share scheduler.
+//!
+//! The [`Fair`] scheduler tracks the virtual runtime of each thread: the time
+//! that the thread has run, scaled by the inverse of its weight. Each core
+//! keeps its runnable threads ordered by the virtual runtime and always runs
+//! the leftmost one. A thread with a larger weight accumulates the virtual
+//! runtime slower, so it receives a larger share of the cpu.
+//!
+//! The weight of a thread is derived from its nice value ([`Thread::nice`]),
+//! where each nice level changes the share by about 10%.
+//!
+//! On every tick, the running thread is charged, and it is preempted when it
+//! runs ahead of the leftmost queued thread by more than
+//! [`WAKEUP_GRANULARITY`]. A woken up thread is placed near the minimum
+//! virtual runtime of the queue, so that a long sleeper neither starves the
+//! others nor waits behind them.
+use super::{
+    Thread, ThreadState,
+    scheduler::{Scheduler, select_cpu},
+    with_current,
+};
+use abyss::{MAX_CPU, spinlock::SpinLock, x86_64::intrinsics::cpuid};
+use alloc::{boxed::Box, collections::BTreeMap};
+use core::sync::atomic::Ordering;
+
+/// The lowest nice value, which has the highest priority.
+pub const NICE_MIN: i32 = -20;
+
+/// The highest nice value, which has the lowest priority.
+pub const NICE_MAX: i32 = 19;
+
+/// Weight of the nice value 0.
+const NICE_0_WEIGHT: u64 = 1024;
+
+/// Weights of the nice values from [`NICE_MIN`] to [`NICE_MAX`].
+const NICE_TO_WEIGHT: [u64; 40] = [
+    /* -20 */ 88761, 71755, 56483, 46273, 36291, //
+    /* -15 */ 29154, 23254, 18705, 14949, 11916, //
+    /* -10 */ 9548, 7620, 6100, 4904, 3906, //
+    /*  -5 */ 3121, 2501, 1991, 1586, 1277, //
+    /*   0 */ 1024, 820, 655, 526, 423, //
+    /*   5 */ 335, 272, 215, 172, 137, //
+    /*  10 */ 110, 87, 70, 56, 45, //
+    /*  15 */ 36, 29, 23, 18, 15, //
+];
+
+/// Length of a tick in nanoseconds.
+const TICK_NS: u64 = 1_000_000;
+
+/// Period in which every runnable thread is expected to run once.
+const SCHED_LATENCY: u64 = 6_000_000;
+
+/// Virtual runtime that the running thread may lead the queue by.
+pub const WAKEUP_GRANULARITY: u64 = 1_000_000;
+
+/// Get the weight of the nice value.
+pub fn nice_to_weight(nice: i32) -> u64 {
+    NICE_TO_WEIGHT[(nice.clamp(NICE_MIN, NICE_MAX) - NICE_MIN) as usize]
+}
+
+/// Runnable threads of a core.
+struct RunQueue {
+    /// Threads ordered by the virtual runtime and the tid.
+    tree: BTreeMap<(u64, u64), Box<Thread>>,
+    /// Monotonic lower bound of the virtual runtime on this core.
+    min_vruntime: u64,
+}
+
+impl RunQueue {
+    fn enqueue(&mut self, th: Box<Thread>, vruntime: u64) {
+        th.vruntime.store(vruntime, Ordering::Relaxed);
+        self.tree.insert((vruntime, th.tid), th);
+    }
+
+    /// Dequeue the leftmost thread that may run on `cpu`.
+    fn dequeue(&mut self, cpu: usize) -> Option<Box<Thread>> {
+        let key = *self
+            .tree
+            .iter()
+            .find(|(_, th)| th.can_run_on(cpu))
+            .map(|(key, _)| key)?;
+        let th = self.tree.remove(&key)?;
+        self.min_vruntime = self.min_vruntime.max(key.0);
+        Some(th)
+    }
+}
+
+/// A fair-share scheduler with weighted priorities.
+///
+/// Install it with [`SystemConfigurationBuilder::set_scheduler`].
+///
+/// [`SystemConfigurationBuilder::set_scheduler`]: crate::SystemConfigurationBuilder::set_scheduler
+pub struct Fair {
+    runqueues: [SpinLock<RunQueue>; MAX_CPU],
+}
+
+unsafe impl Sync for Fair {}
+
+impl Default for Fair {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl Fair {
+    /// Create a new [`Fair`] scheduler.
+    pub const fn new() -> Self {
+        Self {
+            runqueues: [const {
+                SpinLock::new(RunQueue {
+                    tree: BTreeMap::new(),
+                    min_vruntime: 0,
+                })
+            }; MAX_CPU],
+        }
+    }
+
+    /// Pull the leftmost thread of the busiest core into `me`.
+    ///
+    /// The virtual runtime is rebased onto the queue of `me`.
+    fn pull(&self, me: usize) -> Option<Box<Thread>> {
+        let mut victims: [(usize, usize); MAX_CPU] = core::array::from_fn(|i| {
+            let rq = self.runqueues[i].lock();
+            let len = rq.tree.len();
+            rq.unlock();
+            (len, i)
+        });
+        victims.sort_unstable_by(|a, b| b.cmp(a));
+        let (th, lag) = victims
+            .iter()
+            .filter(|(len, i)| *i != me && *len != 0)
+            .find_map(|(_, i)| {
+                let mut rq = self.runqueues[*i].lock();
+                // The leftmost thread that may run on `me`.
+                let pulled = rq
+                    .tree
+                    .iter()
+                    .find(|(_, th)| th.can_run_on(me))
+                    .map(|(key, _)| *key)
+                    .and_then(|key| rq.tree.remove(&key).map(|th| (th, key.0)))
+                    .map(|(th, vruntime)| (th, vruntime.saturating_sub(rq.min_vruntime)));
+                rq.unlock();
+                pulled
+            })?;
+        let mut rq = self.runqueues[me].lock();
+        let vruntime = rq.min_vruntime + lag;
+        th.vruntime.store(vruntime, Ordering::Relaxed);
+        rq.min_vruntime = rq.min_vruntime.max(vruntime);
+        rq.unlock();
+        Some(th)
+    }
+}
+
+impl Scheduler for Fair {
+    fn next_to_run(&self) -> Option<Box<Thread>> {
+        let me = cpuid();
+        let mut rq = self.runqueues[me].lock();
+        let th = rq.dequeue(me);
+        rq.unlock();
+        th.or_else(|| self.pull(me))
+    }
+
+    fn push_to_queue(&self, th: Box<Thread>) {
+        let mut rq = self.runqueues[select_cpu(&th)].lock();
+        // A thread may come from another core or from a long sleep. Keep it
+        // within a latency period around the queue.
+        let vruntime = th.vruntime.load(Ordering::Relaxed).clamp(
+            rq.min_vruntime.saturating_sub(SCHED_LATENCY / 2),
+            rq.min_vruntime + SCHED_LATENCY,
+        );
+        rq.enqueue(th, vruntime);
+        rq.unlock();
+    }
+
+    fn timer_tick(&self) {
+        let preempt = with_current(|th| {
+            let state = th.state.lock();
+            let is_idle = *state == ThreadState::Idle;
+            state.unlock();
+
+            let rq = self.runqueues[cpuid()].lock();
+            let leftmost = rq.tree.keys().next().map(|(vruntime, _)| *vruntime);
+            rq.unlock();
+            if is_idle {
+                return leftmost.is_some();
+            }
+
+            let delta = TICK_NS * NICE_0_WEIGHT / nice_to_weight(th.nice());
+            let vruntime = th.vruntime.fetch_add(delta, Ordering::Relaxed) + delta;
+            leftmost.is_some_and(|leftmost| vruntime > leftmost + WAKEUP_GRANULARITY)
+        });
+        if preempt {
+            let scheduler: &dyn Scheduler = self;
+            scheduler.reschedule();
+        }
+    }
+}
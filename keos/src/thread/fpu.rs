@@ -0,0 +1,131 @@
+//! Lazy switching of the extended states (x87, SSE, and AVX).
+//!
+//! The kernel never uses the extended registers, so they only hold the state
+//! of a user thread. `CR0.TS` is set whenever a thread is switched in, and the
+//! first use of the extended registers traps with the device-not-available
+//! exception (#NM). The handler clears `CR0.TS` and restores the state of the
+//! current thread from its save area, which is allocated on the first trap.
+//!
+//! When a thread that has restored its state in this slice is switched out,
+//! the state is saved with `XSAVEOPT`, which skips the components that are
+//! not modified since the last restore. A thread that never touches the
+//! extended registers neither traps nor saves.
+//!
+//! If the cpu does not support XSAVE, `FXSAVE` and `FXRSTOR` are used instead,
+//! which only cover the x87 and SSE states.
+use super::{Thread, with_current};
+use abyss::x86_64::{Cr0, Cr4};
+use alloc::boxed::Box;
+use core::{
+    arch::asm,
+    sync::atomic::{AtomicU8, Ordering},
+};
+
+/// Size of the save area.
+///
+/// Large enough for the legacy region, the XSAVE header, and the AVX state.
+const FPU_STATE_SIZE: usize = 1024;
+
+/// A save area of the extended states.
+#[repr(C, align(64))]
+pub(crate) struct FpuState([u8; FPU_STATE_SIZE]);
+
+impl FpuState {
+    /// Create a save area in the initial state.
+    ///
+    /// The XSAVE header is zeroed, so that `XRSTOR` initializes every
+    /// component except MXCSR, which is always loaded from the area.
+    fn new() -> Box<Self> {
+        let mut state = Box::new(FpuState([0; FPU_STATE_SIZE]));
+        // FCW: mask all x87 exceptions, double extended precision.
+        state.0[0..2].copy_from_slice(&0x037fu16.to_le_bytes());
+        // MXCSR: mask all SIMD exceptions.
+        state.0[24..28].copy_from_slice(&0x1f80u32.to_le_bytes());
+        state
+    }
+
+    /// Save the extended states into this area.
+    fn save(&mut self) {
+        let ptr = self.0.as_mut_ptr();
+        unsafe {
+            match mode() {
+                MODE_FXSAVE => asm!("fxsave64 [{}]", in(reg) ptr, options(nostack)),
+                MODE_XSAVEOPT => asm!(
+                    "xsaveopt64 [{}]",
+                    in(reg) ptr, in("eax") u32::MAX, in("edx") u32::MAX, options(nostack)
+                ),
+                _ => asm!(
+                    "xsave64 [{}]",
+                    in(reg) ptr, in("eax") u32::MAX, in("edx") u32::MAX, options(nostack)
+                ),
+            }
+        }
+    }
+
+    /// Load the extended states from this area.
+    fn restore(&self) {
+        let ptr = self.0.as_ptr();
+        unsafe {
+            match mode() {
+                MODE_FXSAVE => asm!("fxrstor64 [{}]", in(reg) ptr, options(nostack)),
+                _ => asm!(
+                    "xrstor64 [{}]",
+                    in(reg) ptr, in("eax") u32::MAX, in("edx") u32::MAX, options(nostack)
+                ),
+            }
+        }
+    }
+}
+
+const MODE_UNKNOWN: u8 = 0;
+const MODE_FXSAVE: u8 = 1;
+const MODE_XSAVE: u8 = 2;
+const MODE_XSAVEOPT: u8 = 3;
+
+/// The instructions to save and restore the states, probed on the first use.
+static MODE: AtomicU8 = AtomicU8::new(MODE_UNKNOWN);
+
+fn mode() -> u8 {
+    match MODE.load(Ordering::Relaxed) {
+        MODE_UNKNOWN => {
+            let mode = if !Cr4::current().contains(Cr4::OSXSAVE) {
+                MODE_FXSAVE
+            } else if unsafe { core::arch::x86_64::__cpuid_count(0xd, 1).eax } & 1 != 0 {
+                MODE_XSAVEOPT
+            } else {
+                MODE_XSAVE
+            };
+            MODE.store(mode, Ordering::Relaxed);
+            mode
+        }
+        mode => mode,
+    }
+}
+
+/// Restore the extended states of the current thread on #NM.
+#[unsafe(no_mangle)]
+#[doc(hidden)]
+pub fn restore_fpu_state() {
+    unsafe {
+        asm!("clts", options(nomem, nostack));
+    }
+    with_current(|th| th.fpu.get_or_insert_with(FpuState::new).restore());
+}
+
+/// Save the extended states of `prev` that is switched out, and arm the trap
+/// for the next thread.
+///
+/// The states are not saved if `prev` exits.
+pub(super) fn switch_out(prev: &mut Thread, exited: bool) {
+    let cr0 = Cr0::current();
+    if cr0.contains(Cr0::TS) {
+        // Not used in this slice.
+        return;
+    }
+    if !exited && let Some(state) = prev.fpu.as_mut() {
+        state.save();
+    }
+    unsafe {
+        (cr0 | Cr0::TS).apply();
+    }
+}
@@ -0,0 +1,160 @@
+//! Scheduling latency tracing.
+//!
+//! The kernel stamps a thread with the TSC when it becomes runnable, when it
+//! is dispatched, and when it is switched out. From the stamps, it collects
+//! two histograms for each thread and each core, independent of the
+//! scheduler in use:
+//! - `wait`: time from being queued to being dispatched.
+//! - `run`: time from being dispatched to being switched out.
+//!
+//! Histograms have log2 buckets of TSC cycles. The bucket `i` counts the
+//! samples in `[2^(i-1), 2^i)`, and the last bucket also counts the larger
+//! samples.
+use super::Thread;
+use abyss::{MAX_CPU, x86_64::intrinsics::cpuid};
+use core::{
+    arch::x86_64::_rdtsc,
+    sync::atomic::{AtomicU64, Ordering},
+};
+
+/// Number of buckets of a [`Histogram`].
+pub const NR_BUCKETS: usize = 40;
+
+/// A log2 histogram of TSC cycles.
+pub struct Histogram {
+    buckets: [AtomicU64; NR_BUCKETS],
+}
+
+impl Histogram {
+    pub(crate) const fn new() -> Self {
+        Self {
+            buckets: [const { AtomicU64::new(0) }; NR_BUCKETS],
+        }
+    }
+
+    /// Record a sample of `cycles`.
+    pub fn record(&self, cycles: u64) {
+        let idx = ((u64::BITS - cycles.leading_zeros()) as usize).min(NR_BUCKETS - 1);
+        self.buckets[idx].fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// Add the samples of `other`.
+    pub fn merge(&self, other: &Histogram) {
+        for (b, o) in self.buckets.iter().zip(other.buckets.iter()) {
+            b.fetch_add(o.load(Ordering::Relaxed), Ordering::Relaxed);
+        }
+    }
+
+    /// Clear the samples.
+    pub fn reset(&self) {
+        for b in self.buckets.iter() {
+            b.store(0, Ordering::Relaxed);
+        }
+    }
+
+    /// Get the counts of each bucket.
+    pub fn buckets(&self) -> [u64; NR_BUCKETS] {
+        core::array::from_fn(|i| self.buckets[i].load(Ordering::Relaxed))
+    }
+
+    /// Number of samples.
+    pub fn count(&self) -> u64 {
+        self.buckets().iter().sum()
+    }
+
+    /// Get the upper bound in cycles of the `pct` percentile sample.
+    ///
+    /// Returns `None` if there is no sample.
+    pub fn percentile(&self, pct: u64) -> Option<u64> {
+        let buckets = self.buckets();
+        let total: u64 = buckets.iter().sum();
+        if total == 0 {
+            return None;
+        }
+        let target = (total * pct.min(100)).div_ceil(100).max(1);
+        let mut acc = 0;
+        buckets.iter().enumerate().find_map(|(i, cnt)| {
+            acc += cnt;
+            (acc >= target).then_some(1 << i)
+        })
+    }
+}
+
+/// Scheduling latency histograms.
+pub struct SchedStat {
+    /// Time that a thread waits on the runqueue.
+    pub wait: Histogram,
+    /// Time that a thread runs between the context switches.
+    pub run: Histogram,
+    /// TSC when the thread is queued, or 0.
+    enqueued: AtomicU64,
+    /// TSC when the thread is dispatched, or 0.
+    dispatched: AtomicU64,
+}
+
+impl SchedStat {
+    pub(crate) const fn new() -> Self {
+        Self {
+            wait: Histogram::new(),
+            run: Histogram::new(),
+            enqueued: AtomicU64::new(0),
+            dispatched: AtomicU64::new(0),
+        }
+    }
+}
+
+static CORES: [SchedStat; MAX_CPU] = [const { SchedStat::new() }; MAX_CPU];
+
+/// Get the scheduling latency histograms of the `core`.
+pub fn core(core: usize) -> &'static SchedStat {
+    &CORES[core]
+}
+
+/// Stamp the thread that is about to be pushed into the runqueue.
+pub(super) fn on_enqueue(th: &Thread) {
+    th.sched_stat
+        .enqueued
+        .store(unsafe { _rdtsc() }, Ordering::Relaxed);
+}
+
+/// Charge the run time of `prev` that is switched out.
+pub(super) fn on_switch_out(prev: &Thread) {
+    let dispatched = prev.sched_stat.dispatched.swap(0, Ordering::Relaxed);
+    if dispatched != 0 {
+        let run = unsafe { _rdtsc() }.saturating_sub(dispatched);
+        prev.sched_stat.run.record(run);
+        CORES[cpuid()].run.record(run);
+    }
+}
+
+/// Charge the wait time of `next` that is dispatched.
+pub(super) fn on_dispatch(next: &Thread) {
+    let now = unsafe { _rdtsc() };
+    let enqueued = next.sched_stat.enqueued.swap(0, Ordering::Relaxed);
+    if enqueued != 0 {
+        let wait = now.saturating_sub(enqueued);
+        next.sched_stat.wait.record(wait);
+        CORES[cpuid()].wait.record(wait);
+    }
+    next.sched_stat.dispatched.store(now, Ordering::Relaxed);
+}
+
+/// Print the scheduling latency of every core.
+pub fn dump() {
+    println!("[SCHED] p50/p99/max of wait and run, in TSC cycles.");
+    for (core, stat) in CORES.iter().enumerate() {
+        let fmt = |h: &Histogram| {
+            (
+                h.count(),
+                h.percentile(50).unwrap_or(0),
+                h.percentile(99).unwrap_or(0),
+                h.percentile(100).unwrap_or(0),
+            )
+        };
+        let (wc, w50, w99, wmax) = fmt(&stat.wait);
+        let (rc, r50, r99, rmax) = fmt(&stat.run);
+        println!(
+            "  cpu{core}: wait {wc} samples <{w50}/<{w99}/<{wmax}, run {rc} samples <{r50}/<{r99}/<{rmax}"
+        );
+    }
+}
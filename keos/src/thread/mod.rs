@@ -5,7 +5,14 @@
 //! An executing kernel consists of a collection of threads,
 //! each with their own stack and local state. Threads can be named, and
 //! provide some built-in support for low-level synchronization.
+pub mod fair;
+mod fpu;
+pub mod latency;
 pub mod scheduler;
+mod stack_cache;
+pub mod work_stealing;
+
+pub use fair::{NICE_MAX, NICE_MIN};
 
 use crate::{KernelError, mm::page_table::load_pt, spinlock::SpinLock, task::Task};
 use abyss::{
@@ -17,10 +24,23 @@ use abyss::{
 use alloc::{boxed::Box, collections::btree_map::BTreeMap, string::String, sync::Arc};
 use core::{
     arch::{asm, naked_asm},
+    mem::ManuallyDrop,
     panic::Location,
     sync::atomic::{AtomicI32, AtomicU64, Ordering},
 };
 
+/// Affinity mask that allows every cpu.
+pub const ALL_CPUS: u64 = (1 << abyss::MAX_CPU) - 1;
+
+/// Get the mask of the online cpus.
+pub fn online_cpus() -> u64 {
+    abyss::boot::ONLINE_CPU
+        .iter()
+        .enumerate()
+        .filter(|(_, online)| online.load(Ordering::SeqCst))
+        .fold(0, |acc, (i, _)| acc | 1 << i)
+}
+
 /// Size of each thread's stack.
 pub const STACK_SIZE: usize = 0x100000;
 /// Thread magic to detect stack overflow.
@@ -182,7 +202,9 @@ pub struct Thread {
     /// You must add your own members **BELOWS** this sp field.
     pub(crate) sp: usize,
     /// Thread Stack
-    pub(crate) stack: Box<ThreadStack>,
+    ///
+    /// Retired to the stack cache on drop.
+    pub(crate) stack: ManuallyDrop<Box<ThreadStack>>,
     /// Thread id
     pub tid: u64,
     /// Thread name
@@ -190,6 +212,16 @@ pub struct Thread {
     /// State of the thread.
     pub state: Arc<SpinLock<ThreadState>>,
     pub(crate) running_cpu: Arc<AtomicI32>,
+    /// Nice value of the thread, from [`NICE_MIN`] to [`NICE_MAX`].
+    pub(crate) nice: AtomicI32,
+    /// Virtual runtime of the thread in nanoseconds, scaled by the weight.
+    pub(crate) vruntime: AtomicU64,
+    /// Mask of the cpus that the thread may run on.
+    pub(crate) affinity: AtomicU64,
+    /// Save area of the extended states, allocated on the first use.
+    pub(crate) fpu: Option<Box<fpu::FpuState>>,
+    /// Scheduling latency of the thread.
+    pub(crate) sched_stat: latency::SchedStat,
     /// Mixture of exit state (63th and 62th bit) and exit code (lower 32 bits).
     pub exit_status: Arc<AtomicU64>,
     /// Interrupt Frame if thread was handling interrupt.
@@ -209,8 +241,7 @@ impl Thread {
     {
         static TID: AtomicU64 = AtomicU64::new(0);
         let tid = TID.fetch_add(1, Ordering::SeqCst);
-        let mut stack: Box<ThreadStack> = unsafe { Box::new_uninit().assume_init() };
-        stack.magic = THREAD_MAGIC;
+        let stack = ManuallyDrop::new(stack_cache::alloc());
 
         let exit_status = Arc::new(AtomicU64::new(0));
         let mut et = EXIT_CODE_TABLE.lock();
@@ -231,6 +262,11 @@ impl Thread {
             exit_status,
             interrupt_frame: SpinLock::new(core::ptr::null()),
             running_cpu: Arc::new(AtomicI32::new(-1)),
+            nice: AtomicI32::new(0),
+            vruntime: AtomicU64::new(0),
+            affinity: AtomicU64::new(ALL_CPUS),
+            fpu: None,
+            sched_stat: latency::SchedStat::new(),
             task: None,
             tty_hook: SpinLock::new(
                 __with_current(|th| {
@@ -245,6 +281,62 @@ impl Thread {
         })
     }
 
+    /// Get the mask of the cpus that the thread may run on.
+    pub fn affinity(&self) -> u64 {
+        self.affinity.load(Ordering::Relaxed)
+    }
+
+    /// Set the mask of the cpus that the thread may run on.
+    ///
+    /// The bit `i` of `mask` allows the thread to run on the cpu `i`. Every
+    /// scheduler queues the thread only on the allowed cpus. The mask takes
+    /// effect on the next scheduling of the thread; use
+    /// [`Current::set_affinity`] to migrate the current thread at once.
+    ///
+    /// The cpus that are not online are dropped from `mask`. Returns
+    /// [`KernelError::InvalidArgument`] if `mask` allows no online cpu.
+    pub fn set_affinity(&self, mask: u64) -> Result<(), KernelError> {
+        let mask = mask & online_cpus();
+        if mask == 0 {
+            return Err(KernelError::InvalidArgument);
+        }
+        self.affinity.store(mask, Ordering::Relaxed);
+        Ok(())
+    }
+
+    /// Returns true if the thread may run on the `cpu`.
+    #[inline]
+    pub fn can_run_on(&self, cpu: usize) -> bool {
+        self.affinity() & (1 << cpu) != 0
+    }
+
+    /// Get the scheduling latency histograms of the thread.
+    pub fn sched_stat(&self) -> &latency::SchedStat {
+        &self.sched_stat
+    }
+
+    /// Get the nice value of the thread.
+    pub fn nice(&self) -> i32 {
+        self.nice.load(Ordering::Relaxed)
+    }
+
+    /// Set the nice value of the thread.
+    ///
+    /// A lower nice value gives a larger share of the cpu to the thread under
+    /// the [`Fair`] scheduler. Other schedulers ignore it.
+    ///
+    /// Returns [`KernelError::InvalidArgument`] if `nice` is out of
+    /// [`NICE_MIN`]..=[`NICE_MAX`].
+    ///
+    /// [`Fair`]: fair::Fair
+    pub fn set_nice(&self, nice: i32) -> Result<(), KernelError> {
+        if !(NICE_MIN..=NICE_MAX).contains(&nice) {
+            return Err(KernelError::InvalidArgument);
+        }
+        self.nice.store(nice, Ordering::Relaxed);
+        Ok(())
+    }
+
     #[doc(hidden)]
     pub fn track_alloc(&self) {
         let mut guard = self.allocations.lock();
@@ -294,7 +386,11 @@ impl Thread {
                         abyss::interrupt::InterruptState::current(),
                         abyss::interrupt::InterruptState::Off
                     );
-                    context_switch_trampoline(current_sp, next_sp)
+                    // The nesting of the interrupt handlers belongs to the
+                    // thread.
+                    let depth = crate::interrupt::stat::save_depth();
+                    context_switch_trampoline(current_sp, next_sp);
+                    crate::interrupt::stat::restore_depth(depth);
                 }
             });
             abyss::interrupt::InterruptState::enable();
@@ -389,6 +485,13 @@ impl JoinHandle {
     }
 }
 
+impl Drop for Thread {
+    fn drop(&mut self) {
+        crate::acct::forget(self.tid);
+        stack_cache::retire(unsafe { ManuallyDrop::take(&mut self.stack) });
+    }
+}
+
 unsafe impl Send for JoinHandle {}
 unsafe impl Sync for JoinHandle {}
 
@@ -411,7 +514,10 @@ impl ParkHandle {
         let mut state = self.th.state.lock();
         *state = ThreadState::Runnable;
         state.unlock();
+        latency::on_enqueue(&self.th);
+        let mask = self.th.affinity();
         scheduler::scheduler().push_to_queue(self.th);
+        scheduler::kick_idle(mask);
     }
 }
 
@@ -470,6 +576,11 @@ unsafe extern "C" fn finish_context_switch(prev: &'static mut Thread) {
         *prev_interrupt_frame = abyss::x86_64::kernel_gs::current().interrupt_frame;
         prev_interrupt_frame.unlock();
 
+        if prev_state != ThreadState::Idle {
+            latency::on_switch_out(prev);
+        }
+        fpu::switch_out(prev, matches!(prev_state, ThreadState::Exited(_)));
+
         let _dropped = match prev_state {
             ThreadState::Exited(_e) => Some(Box::from_raw(prev)),
             ThreadState::Idle => None,
@@ -479,7 +590,13 @@ unsafe extern "C" fn finish_context_switch(prev: &'static mut Thread) {
                 prev_state.unlock();
 
                 let th = Box::from_raw(prev);
+                latency::on_enqueue(&th);
+                // Migrated by the change of the affinity.
+                let kick = (!th.can_run_on(cpuid())).then(|| th.affinity());
                 scheduler::scheduler().push_to_queue(th);
+                if let Some(mask) = kick {
+                    scheduler::kick_idle(mask);
+                }
                 None
             }
             ThreadState::Parked => None,
@@ -488,7 +605,8 @@ unsafe extern "C" fn finish_context_switch(prev: &'static mut Thread) {
         with_current(|th| {
             let mut state = th.state.lock();
             if *state != ThreadState::Idle {
-                *state = ThreadState::Running
+                *state = ThreadState::Running;
+                latency::on_dispatch(th);
             }
             state.unlock();
 
@@ -502,6 +620,9 @@ unsafe extern "C" fn finish_context_switch(prev: &'static mut Thread) {
                 th.stack.as_mut() as *mut _ as usize + STACK_SIZE,
             );
             th.running_cpu.store(cpuid() as i32, Ordering::SeqCst);
+            ON_CPU[cpuid()].store(th.tid, Ordering::Release);
+            crate::mm::vdso::set_running(cpuid(), th.tid);
+            crate::sync::rcu::quiescent();
 
             if let Some(task) = th.task.as_mut() {
                 task.with_page_table_pa(&(load_pt as fn(Pa)));
@@ -565,12 +686,37 @@ impl Current {
         }
     }
 
+    /// Set the affinity mask of the current thread.
+    ///
+    /// If the current cpu is not in `mask`, the thread yields and continues
+    /// on an allowed cpu. See [`Thread::set_affinity`].
+    pub fn set_affinity(mask: u64) -> Result<(), KernelError> {
+        let migrate = with_current(|th| th.set_affinity(mask).map(|_| !th.can_run_on(cpuid())))?;
+        if migrate {
+            scheduler::scheduler().reschedule();
+        }
+        Ok(())
+    }
+
     /// Get the current thread's id.
     pub fn get_tid() -> u64 {
         with_current(|th| th.tid)
     }
 }
 
+/// Tid of the thread that runs on each cpu.
+static ON_CPU: [AtomicU64; abyss::MAX_CPU] = [const { AtomicU64::new(u64::MAX) }; abyss::MAX_CPU];
+
+/// Check whether the thread `tid` is running on the `cpu`.
+///
+/// The result is a hint that might be stale on return.
+#[inline]
+pub fn is_running_on(tid: u64, cpu: usize) -> bool {
+    ON_CPU
+        .get(cpu)
+        .is_some_and(|on_cpu| on_cpu.load(Ordering::Acquire) == tid)
+}
+
 /// Run a function `f` with current thread as an argument.
 #[inline]
 pub fn with_current<R>(f: impl FnOnce(&mut Thread) -> R) -> R {
@@ -628,7 +774,10 @@ impl ThreadBuilder {
     pub fn spawn<F: FnOnce() + Send + 'static>(self, thread_fn: F) -> JoinHandle {
         let th = self.into_thread(thread_fn);
         let handle = JoinHandle::new_for(&th);
+        latency::on_enqueue(&th);
+        let mask = th.affinity();
         scheduler::scheduler().push_to_queue(th);
+        scheduler::kick_idle(mask);
         handle
     }
 
@@ -1,9 +1,15 @@
 //! Thread scheduler
 
 use super::{ParkHandle, STACK_SIZE, THREAD_MAGIC, Thread, ThreadStack, ThreadState};
-use abyss::spinlock::SpinLock;
+use abyss::{
+    dev::x86_64::{
+        apic::{IPIDest, Mode},
+        timer,
+    },
+    spinlock::SpinLock,
+};
 use alloc::boxed::Box;
-use core::{arch::asm, sync::atomic::AtomicBool};
+use core::{arch::asm, mem::ManuallyDrop, sync::atomic::AtomicBool};
 
 /// A trait for a thread scheduler.
 ///
@@ -61,8 +67,12 @@ unsafe impl core::marker::Sync for Fifo {}
 
 impl Scheduler for Fifo {
     fn next_to_run(&self) -> Option<Box<Thread>> {
+        let cpu = abyss::x86_64::intrinsics::cpuid();
         let mut guard = self.runqueue.lock();
-        let val = guard.pop_front();
+        let val = guard
+            .iter()
+            .position(|th| th.can_run_on(cpu))
+            .and_then(|idx| guard.remove(idx));
         guard.unlock();
         val
     }
@@ -137,6 +147,36 @@ pub(crate) static BOOT_DONE: AtomicBool = AtomicBool::new(false);
 const INIT: Option<Box<Thread>> = None;
 static mut IDLE: [Option<Box<Thread>>; abyss::MAX_CPU] = [INIT; abyss::MAX_CPU];
 
+/// Select the cpu to queue `th` on.
+///
+/// Returns the current cpu if the thread may run on it, otherwise the first
+/// online cpu in the affinity mask of the thread. If no online cpu is
+/// allowed, the thread runs on the current cpu.
+pub fn select_cpu(th: &Thread) -> usize {
+    let me = abyss::x86_64::intrinsics::cpuid();
+    match th.affinity() & super::online_cpus() {
+        mask if mask & (1 << me) != 0 => me,
+        0 => me,
+        mask => mask.trailing_zeros() as usize,
+    }
+}
+
+/// Wake up an idle core in `mask` whose tick is stopped, to pick up a new
+/// thread.
+///
+/// An idle core does not poll the scheduler without the tick, so the thread
+/// that is queued on a busy core would wait until the busy core yields.
+pub(crate) fn kick_idle(mask: u64) {
+    let me = abyss::x86_64::intrinsics::cpuid();
+    if let Some(core) =
+        (0..abyss::MAX_CPU).find(|i| *i != me && mask & (1 << i) != 0 && timer::is_tick_stopped(*i))
+    {
+        unsafe {
+            abyss::dev::x86_64::apic::send_ipi(IPIDest::Cpu(core), Mode::Fixed(0x7f));
+        }
+    }
+}
+
 /// Transmute this thread into the idle.
 pub(crate) fn idle(core_id: usize) -> ! {
     let mut sp: usize;
@@ -149,7 +189,11 @@ pub(crate) fn idle(core_id: usize) -> ! {
     *state = ThreadState::Idle;
     state.unlock();
 
-    tcb.stack = unsafe { Box::from_raw((sp & !(STACK_SIZE - 1)) as *mut ThreadStack) };
+    let boot_stack = unsafe { Box::from_raw((sp & !(STACK_SIZE - 1)) as *mut ThreadStack) };
+    super::stack_cache::retire(ManuallyDrop::into_inner(core::mem::replace(
+        &mut tcb.stack,
+        ManuallyDrop::new(boot_stack),
+    )));
     tcb.stack.magic = THREAD_MAGIC;
     tcb.stack.thread = tcb.as_mut() as *mut _;
     unsafe {
@@ -161,12 +205,39 @@ pub(crate) fn idle(core_id: usize) -> ! {
     }
     let scheduler = crate::thread::scheduler::scheduler();
     loop {
+        crate::sync::rcu::quiescent();
         if let Some(th) = scheduler.next_to_run() {
             th.run();
+            continue;
+        } else if crate::mm::zero_pool::refill() {
+            // Keep clearing pages while there is nothing to run.
+            continue;
+        } else if crate::mm::vmalloc::purge_idle() {
+            // The freed vmalloc ranges wait for a context that can wait for
+            // the TLB shootdown.
+            continue;
         }
+        // Push the queued log messages to the serial port while idle.
+        abyss::kprint::drain();
         #[cfg(not(feature = "gkeos"))]
         unsafe {
-            asm!("sti", "hlt", "cli")
+            // Nothing to run. Stop the tick until the next interrupt, e.g., a
+            // device interrupt or the kick from `kick_idle`.
+            timer::stop_tick();
+            crate::sync::rcu::set_idle(true);
+            // A thread queued before the tick is stopped is not kicked; check
+            // the queue again with the interrupts still disabled. A kick after
+            // this point is pending until `sti`, which wakes up the `hlt` in
+            // its shadow.
+            let th = scheduler.next_to_run();
+            if th.is_none() {
+                asm!("sti", "hlt", "cli");
+            }
+            crate::sync::rcu::set_idle(false);
+            timer::restart_tick();
+            if let Some(th) = th {
+                th.run();
+            }
         }
     }
 }
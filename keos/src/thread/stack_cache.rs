@@ -0,0 +1,67 @@
+//! Per-cpu cache of the retired thread stacks.
+//!
+//! A thread stack is [`STACK_SIZE`] bytes of memory aligned to its size,
+//! which is served by the page allocator and cleared on every allocation.
+//! The stack of an exited thread is kept on the cache of the cpu that frees
+//! it, and the next spawn on the cpu reuses it without any allocation.
+//!
+//! The thread control block itself is a small allocation, which is served by
+//! the per-cpu magazines of the slab allocator.
+use super::{STACK_SIZE, THREAD_MAGIC, ThreadStack};
+use abyss::{MAX_CPU, interrupt::InterruptGuard, x86_64::intrinsics::cpuid};
+use alloc::boxed::Box;
+use core::cell::UnsafeCell;
+
+/// Maximum number of stacks cached per cpu.
+const CACHE_SIZE: usize = 4;
+
+#[repr(align(64))]
+struct StackCache {
+    stacks: UnsafeCell<[Option<Box<ThreadStack>>; CACHE_SIZE]>,
+}
+
+unsafe impl Sync for StackCache {}
+
+static CACHES: [StackCache; MAX_CPU] = [const {
+    StackCache {
+        stacks: UnsafeCell::new([const { None }; CACHE_SIZE]),
+    }
+}; MAX_CPU];
+
+/// Get a stack, reusing a retired one if possible.
+///
+/// The magic of the returned stack is stamped.
+pub(super) fn alloc() -> Box<ThreadStack> {
+    let guard = InterruptGuard::new();
+    let stacks = unsafe { &mut *CACHES[cpuid()].stacks.get() };
+    let cached = stacks.iter_mut().find_map(|stack| stack.take());
+    drop(guard);
+
+    let mut stack = cached.unwrap_or_else(|| unsafe { Box::new_uninit().assume_init() });
+    stack.magic = THREAD_MAGIC;
+    stack
+}
+
+/// Retire the stack of an exited thread.
+///
+/// The stack must not be in use. Panics if the magic of the stack is
+/// overwritten, which means that the thread overflowed its stack.
+pub(super) fn retire(stack: Box<ThreadStack>) {
+    if stack.magic != THREAD_MAGIC {
+        panic!(
+            "Stack overflow detected! You might allocate big local variables. Stack: {:x}",
+            stack.as_ref() as *const _ as usize + STACK_SIZE
+        );
+    }
+    let guard = InterruptGuard::new();
+    let stacks = unsafe { &mut *CACHES[cpuid()].stacks.get() };
+    let overflow = match stacks.iter_mut().find(|slot| slot.is_none()) {
+        Some(slot) => {
+            *slot = Some(stack);
+            None
+        }
+        None => Some(stack),
+    };
+    drop(guard);
+    drop(overflow);
+}
@@ -0,0 +1,251 @@
+//! Work-stealing scheduler.
+//!
+//! Each core owns a Chase-Lev deque of runnable threads. The owner pushes and
+//! pops at the bottom of its deque without a lock, while interrupts are
+//! disabled so that the owner operations never interleave on the same core.
+//! A core that runs out of threads steals half of the threads from the
+//! busiest core at the top of its deque, with a compare-and-swap per thread.
+//!
+//! A thread that does not fit in the deque, or is queued for another core by
+//! its affinity mask, goes to the overflow queue of the core, which is
+//! protected by a lock.
+use super::{
+    Thread,
+    scheduler::{Scheduler, select_cpu},
+};
+use abyss::{MAX_CPU, interrupt::InterruptGuard, spinlock::SpinLock, x86_64::intrinsics::cpuid};
+use alloc::{boxed::Box, collections::VecDeque};
+use core::sync::atomic::{AtomicIsize, AtomicUsize, Ordering, fence};
+
+/// Number of threads that a deque can hold.
+const DEQUE_SIZE: usize = 256;
+
+/// Time slice of a thread in ticks (1ms).
+const QUANTUM: isize = 5;
+
+/// A Chase-Lev work-stealing deque of threads.
+#[repr(align(64))]
+struct Deque {
+    /// Index of the next slot to steal. Advanced by the thieves.
+    top: AtomicIsize,
+    /// Index of the next slot to push. Only written by the owner.
+    bottom: AtomicIsize,
+    /// Raw pointers of the boxed threads.
+    slots: [AtomicUsize; DEQUE_SIZE],
+}
+
+impl Deque {
+    const fn new() -> Self {
+        Self {
+            top: AtomicIsize::new(0),
+            bottom: AtomicIsize::new(0),
+            slots: [const { AtomicUsize::new(0) }; DEQUE_SIZE],
+        }
+    }
+
+    /// Approximate number of threads in the deque.
+    fn len(&self) -> usize {
+        let t = self.top.load(Ordering::Relaxed);
+        let b = self.bottom.load(Ordering::Relaxed);
+        (b - t).max(0) as usize
+    }
+
+    /// Push a thread at the bottom. Only called by the owner.
+    ///
+    /// Returns the thread back if the deque is full.
+    fn push(&self, th: Box<Thread>) -> Result<(), Box<Thread>> {
+        let b = self.bottom.load(Ordering::Relaxed);
+        let t = self.top.load(Ordering::Acquire);
+        if b - t >= DEQUE_SIZE as isize {
+            return Err(th);
+        }
+        self.slots[b as usize % DEQUE_SIZE].store(Box::into_raw(th) as usize, Ordering::Relaxed);
+        fence(Ordering::Release);
+        self.bottom.store(b + 1, Ordering::Relaxed);
+        Ok(())
+    }
+
+    /// Pop a thread from the bottom. Only called by the owner.
+    fn pop(&self) -> Option<Box<Thread>> {
+        let b = self.bottom.load(Ordering::Relaxed) - 1;
+        self.bottom.store(b, Ordering::Relaxed);
+        fence(Ordering::SeqCst);
+        let t = self.top.load(Ordering::Relaxed);
+        if t > b {
+            // Empty.
+            self.bottom.store(b + 1, Ordering::Relaxed);
+            return None;
+        }
+        let ptr = self.slots[b as usize % DEQUE_SIZE].load(Ordering::Relaxed);
+        if t == b {
+            // The last thread. Race against the thieves.
+            let won = self
+                .top
+                .compare_exchange(t, t + 1, Ordering::SeqCst, Ordering::Relaxed)
+                .is_ok();
+            self.bottom.store(b + 1, Ordering::Relaxed);
+            if !won {
+                return None;
+            }
+        }
+        Some(unsafe { Box::from_raw(ptr as *mut Thread) })
+    }
+
+    /// Steal a thread from the top. Called by any core.
+    fn steal(&self) -> Option<Box<Thread>> {
+        loop {
+            let t = self.top.load(Ordering::Acquire);
+            fence(Ordering::SeqCst);
+            let b = self.bottom.load(Ordering::Acquire);
+            if t >= b {
+                return None;
+            }
+            let ptr = self.slots[t as usize % DEQUE_SIZE].load(Ordering::Relaxed);
+            if self
+                .top
+                .compare_exchange(t, t + 1, Ordering::SeqCst, Ordering::Relaxed)
+                .is_ok()
+            {
+                return Some(unsafe { Box::from_raw(ptr as *mut Thread) });
+            }
+        }
+    }
+}
+
+/// Per-core state of the [`WorkStealing`] scheduler.
+struct PerCore {
+    deque: Deque,
+    /// Threads that do not fit in the deque, or are queued by other cores.
+    overflow: SpinLock<VecDeque<Box<Thread>>>,
+    /// Remaining time slice of the running thread.
+    remain: AtomicIsize,
+}
+
+/// A work-stealing scheduler.
+///
+/// Threads are queued on the core that makes them runnable, and idle cores
+/// balance the load by stealing from the busiest core. Install it with
+/// [`SystemConfigurationBuilder::set_scheduler`].
+///
+/// [`SystemConfigurationBuilder::set_scheduler`]: crate::SystemConfigurationBuilder::set_scheduler
+pub struct WorkStealing {
+    percores: [PerCore; MAX_CPU],
+}
+
+unsafe impl Sync for WorkStealing {}
+
+impl Default for WorkStealing {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl WorkStealing {
+    /// Create a new [`WorkStealing`] scheduler.
+    pub const fn new() -> Self {
+        Self {
+            percores: [const {
+                PerCore {
+                    deque: Deque::new(),
+                    overflow: SpinLock::new(VecDeque::new()),
+                    remain: AtomicIsize::new(QUANTUM),
+                }
+            }; MAX_CPU],
+        }
+    }
+
+    /// Pop a thread that may run on `me` from the overflow queue of `core`.
+    fn pop_overflow(&self, core: usize, me: usize) -> Option<Box<Thread>> {
+        let mut overflow = self.percores[core].overflow.lock();
+        let th = overflow
+            .iter()
+            .position(|th| th.can_run_on(me))
+            .and_then(|idx| overflow.remove(idx));
+        overflow.unlock();
+        th
+    }
+
+    /// Push a thread into the overflow queue of `core`.
+    fn push_overflow(&self, core: usize, th: Box<Thread>) {
+        let mut overflow = self.percores[core].overflow.lock();
+        overflow.push_back(th);
+        overflow.unlock();
+    }
+
+    /// Steal half of the threads of the busiest core into the deque of `me`.
+    ///
+    /// A stolen thread that may not run on `me` is handed to an allowed core.
+    /// Returns one of the stolen threads to run.
+    fn steal_half(&self, me: usize) -> Option<Box<Thread>> {
+        let (victim, len) = self
+            .percores
+            .iter()
+            .enumerate()
+            .filter(|(i, _)| *i != me)
+            .map(|(i, pc)| (i, pc.deque.len()))
+            .max_by_key(|(_, len)| *len)?;
+        if len == 0 {
+            return (0..MAX_CPU)
+                .filter(|i| *i != me)
+                .find_map(|i| self.pop_overflow(i, me));
+        }
+        let deque = &self.percores[victim].deque;
+        let mut next = None;
+        for _ in 0..len.div_ceil(2) {
+            let Some(stolen) = deque.steal() else {
+                break;
+            };
+            if !stolen.can_run_on(me) {
+                self.push_overflow(select_cpu(&stolen), stolen);
+            } else if next.is_none() {
+                next = Some(stolen);
+            } else if let Err(stolen) = self.percores[me].deque.push(stolen) {
+                self.push_overflow(me, stolen);
+            }
+        }
+        next
+    }
+}
+
+impl Scheduler for WorkStealing {
+    fn next_to_run(&self) -> Option<Box<Thread>> {
+        let _guard = InterruptGuard::new();
+        let me = cpuid();
+        loop {
+            let th = self.percores[me]
+                .deque
+                .pop()
+                .or_else(|| self.pop_overflow(me, me))
+                .or_else(|| self.steal_half(me));
+            match th {
+                // The affinity is changed while the thread is queued.
+                Some(th) if !th.can_run_on(me) => self.push_overflow(select_cpu(&th), th),
+                Some(th) => {
+                    self.percores[me].remain.store(QUANTUM, Ordering::Relaxed);
+                    return Some(th);
+                }
+                None => return None,
+            }
+        }
+    }
+
+    fn push_to_queue(&self, th: Box<Thread>) {
+        let _guard = InterruptGuard::new();
+        let cpu = select_cpu(&th);
+        if cpu != cpuid() {
+            // Only the owner may push into the deque.
+            self.push_overflow(cpu, th);
+        } else if let Err(th) = self.percores[cpu].deque.push(th) {
+            self.push_overflow(cpu, th);
+        }
+    }
+
+    fn timer_tick(&self) {
+        let remain = &self.percores[cpuid()].remain;
+        if remain.fetch_sub(1, Ordering::Relaxed) <= 1 {
+            remain.store(QUANTUM, Ordering::Relaxed);
+            let scheduler: &dyn Scheduler = self;
+            scheduler.reschedule();
+        }
+    }
+}
@@ -0,0 +1,53 @@
+use kev::vm::VmBuilder;
+use kev_project2::simple_ept_vm::SimpleEptVmState;
+
+// Make an empty batch, then a batch that halts the vcpu on its first entry.
+// #[stdin(b"")]
+// #[assert_output(b"")]
+pub fn hypercall_batch() {
+    let vm = VmBuilder::new(
+        SimpleEptVmState::new(&[
+            0x48, 0xC7, 0xC3, 0x34, 0x12, 0x00, 0x00, // mov    rbx,0x1234
+            0x48, 0x8D, 0x3D, 0x72, 0x00, 0x00, 0x00, // lea    rdi,[rip+0x72]
+            0x48, 0x31, 0xF6, // xor    rsi,rsi
+            0x48, 0xC7, 0xC0, 0xFF, 0x00, 0x00, 0x00, // mov    rax,0xff
+            0x0F, 0x01, 0xC1, // vmcall
+            0x48, 0x85, 0xC0, // test   rax,rax
+            0x75, 0x1A, // jne    fail
+            0x48, 0x81, 0xFB, 0x34, 0x12, 0x00, 0x00, // cmp    rbx,0x1234
+            0x75, 0x11, // jne    fail
+            0x48, 0xC7, 0xC6, 0x02, 0x00, 0x00, 0x00, // mov    rsi,0x2
+            0x48, 0xC7, 0xC0, 0xFF, 0x00, 0x00, 0x00, // mov    rax,0xff
+            0x0F, 0x01, 0xC1, // vmcall
+            // fail:
+            0x48, 0xC7, 0xC7, 0x01, 0x00, 0x00, 0x00, // mov    rdi,0x1
+            0x48, 0x31, 0xC0, // xor    rax,rax
+            0x0F, 0x01, 0xC1, // vmcall
+            0xF4, // hlt
+            // .align 0x40
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            // BatchEntry { nr: 0, args: [0, ..], ret: 0 }
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            // BatchEntry { nr: 0, args: [1, ..], ret: 0 }
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        ]),
+        1,
+    )
+    .expect("Failed to create vmbuilder.")
+    .finalize()
+    .expect("Failed to create vm.");
+
+    vm.start_bsp().expect("Failed to start bsp.");
+    assert_eq!(vm.join(), 0);
+}
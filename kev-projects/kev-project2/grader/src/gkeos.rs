@@ -1,5 +1,11 @@
+use alloc::vec::Vec;
+use keos::{
+    KernelError,
+    fs::{FileBlockNumber, InodeNumber, RegularFile},
+    sync::SpinLock,
+};
 use kev::vm::VmBuilder;
-use kev_project2::keos_vm::VmState;
+use kev_project2::keos_vm::{VmState, snapshot};
 
 pub fn run_keos() {
     // VM with 256 MiB memory.
@@ -13,3 +19,93 @@ pub fn run_keos() {
     vm.start_bsp().expect("Failed to start bsp.");
     vm.join();
 }
+
+/// A file in memory, which grows on the writes.
+struct MemFile(SpinLock<Vec<u8>>);
+
+impl keos::fs::traits::RegularFile for MemFile {
+    fn ino(&self) -> InodeNumber {
+        InodeNumber::new(2).unwrap()
+    }
+
+    fn size(&self) -> usize {
+        let guard = self.0.lock();
+        let size = guard.len();
+        guard.unlock();
+        size
+    }
+
+    fn read(&self, fba: FileBlockNumber, buf: &mut [u8; 4096]) -> Result<bool, KernelError> {
+        let guard = self.0.lock();
+        let ofs = fba.0 * 4096;
+        let result = if ofs < guard.len() {
+            let len = (guard.len() - ofs).min(4096);
+            buf[..len].copy_from_slice(&guard[ofs..ofs + len]);
+            buf[len..].fill(0);
+            Ok(true)
+        } else {
+            Err(KernelError::InvalidArgument)
+        };
+        guard.unlock();
+        result
+    }
+
+    fn write(
+        &self,
+        fba: FileBlockNumber,
+        buf: &[u8; 4096],
+        min_size: usize,
+    ) -> Result<(), KernelError> {
+        let mut guard = self.0.lock();
+        let ofs = fba.0 * 4096;
+        let size = guard.len().max(min_size);
+        let result = if ofs < size {
+            guard.resize(size, 0);
+            let len = (size - ofs).min(4096);
+            guard[ofs..ofs + len].copy_from_slice(&buf[..len]);
+            Ok(())
+        } else {
+            Err(KernelError::InvalidArgument)
+        };
+        guard.unlock();
+        result
+    }
+
+    fn writeback(&self) -> Result<(), KernelError> {
+        Ok(())
+    }
+}
+
+pub fn run_keos_from_snapshot() {
+    let vm = VmBuilder::new(
+        VmState::new(256 * 1024).expect("Failed to crate vmstate"),
+        1,
+    )
+    .expect("Failed to create vmbuilder.")
+    .finalize()
+    .expect("Failed to create vm.");
+    let full = RegularFile::new(MemFile(SpinLock::new(Vec::new())));
+    let incremental = RegularFile::new(MemFile(SpinLock::new(Vec::new())));
+    // The guest is saved before it boots, with its kernel image.
+    assert_ne!(snapshot::save(&vm, &full).expect("Failed to save."), 0);
+    // The guest never ran, so it wrote no page.
+    assert_eq!(
+        snapshot::save_incremental(&vm, &incremental).expect("Failed to save."),
+        0
+    );
+    drop(vm);
+
+    let (state, vcpus) =
+        VmState::from_snapshot(&[full, incremental]).expect("Failed to restore the snapshot.");
+    assert_eq!(vcpus.len(), 1);
+    assert!(!vcpus[0].started);
+    let vm = VmBuilder::new(state, 1)
+        .expect("Failed to create vmbuilder.")
+        .finalize()
+        .expect("Failed to create vm.");
+    vm.restore_vcpus(&vcpus)
+        .expect("Failed to restore the vcpus.");
+    // The saved vcpu was not started yet.
+    vm.start_bsp().expect("Failed to start bsp.");
+    assert_eq!(vm.join(), 0);
+}
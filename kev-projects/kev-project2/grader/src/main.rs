@@ -9,6 +9,7 @@ extern crate keos;
 extern crate keos_project4;
 extern crate grading;
 
+mod batch;
 mod ept;
 mod gkeos;
 mod mmio;
@@ -31,7 +32,9 @@ pub unsafe fn main(config_builder: SystemConfigurationBuilder) {
         &ept::complicate,
         &ept::check_huge_translation,
         &mmio::mmio_print,
+        &batch::hypercall_batch,
         &gkeos::run_keos,
+        &gkeos::run_keos_from_snapshot,
     ]);
 }
 
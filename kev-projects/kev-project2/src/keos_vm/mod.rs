@@ -5,6 +5,7 @@ use alloc::sync::Arc;
 use keos::{fs::FileSystem, mm::Page, sync::SpinLock};
 use kev::{
     VmError,
+    batch::Batched,
     vcpu::{Cr0, Cr4, GenericVCpuState, Rflags, VmexitResult},
     vm_control::*,
     vmcs::{ActiveVmcs, Field},
@@ -19,11 +20,16 @@ use pager::KernelVmPager;
 pub use keos_project2::loader::elf;
 pub mod dev;
 pub mod pager;
+pub mod snapshot;
 
 /// The Vmstate of VmBase.
 pub struct VmState {
     pager: Arc<SpinLock<KernelVmPager>>,
     io_bmap: Arc<(Page, Page)>,
+    /// Whether the guest is restored from a snapshot.
+    restored: bool,
+    /// The chain of the snapshots of the guest.
+    chain: SpinLock<snapshot::Chain>,
 }
 
 impl VmState {
@@ -54,7 +60,12 @@ impl VmState {
                 .unwrap(),
             ram_in_kib,
         )?));
-        Some(VmState { pager, io_bmap })
+        Some(VmState {
+            pager,
+            io_bmap,
+            restored: false,
+            chain: SpinLock::new(snapshot::Chain::default()),
+        })
     }
 }
 
@@ -66,7 +77,7 @@ impl kev::vm::VmState for VmState {
         let (mmio_ctl, mut pio_ctl, hypercall_ctl, cpuid_ctl, mut msr_ctl) = (
             mmio::Controller::new(),
             pio::Controller::new(),
-            hypercall::Controller::new(HypercallCtx),
+            Batched(hypercall::Controller::new(HypercallCtx)),
             cpuid::Controller::new(),
             msr::Controller::new(),
         );
@@ -90,6 +101,10 @@ impl kev::vm::VmState for VmState {
         vbsp_generic_state: &mut GenericVCpuState,
         vbsp_vcpu_state: &mut Self::VcpuState,
     ) -> Result<(), Self::Error> {
+        // The state is loaded from the snapshot after the vm is built.
+        if self.restored {
+            return Ok(());
+        }
         let guard = self.pager.lock();
         let entry = guard.entry() as u64;
         guard.unlock();
@@ -177,7 +192,7 @@ pub struct VcpuState {
         (
             pio::Controller,
             (
-                hypercall::Controller<HypercallCtx>,
+                Batched<hypercall::Controller<HypercallCtx>>,
                 (cpuid::Controller, msr::Controller),
             ),
         ),
@@ -210,9 +225,7 @@ impl kev::vcpu::VCpuState for VcpuState {
     }
     fn init_guest_state(&self, vmcs: &ActiveVmcs) -> Result<(), VmError> {
         let guard = self.pager.lock();
-        vmcs.write(Field::Eptptr, {
-            guard.ept_ptr().into_usize() as u64 | (3 << 3) | 6
-        })?;
+        vmcs.write(Field::Eptptr, kev::snapshot::eptp(guard.ept_ptr()))?;
         guard.unlock();
 
         // If the “use I/O bitmaps” VM-execution control is 1, bits 11:0 of each
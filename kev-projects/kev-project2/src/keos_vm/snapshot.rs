@@ -0,0 +1,409 @@
+//! Snapshots of the guest KeOS.
+//!
+//! Booting the guest takes the most of the time to launch it. A snapshot
+//! saves a running guest, so that a new vm resumes from it instead of
+//! booting: [`save`] writes the memory of the guest and the state of its
+//! vcpus into a file, and [`VmState::from_snapshot`] builds a vm that loads
+//! them back. The restored memory is loaded lazily by the [`KernelVmPager`]
+//! on the EPT violations, so restoring a snapshot reads only the headers.
+//!
+//! [`save_incremental`] writes only the pages that the guest wrote since the
+//! previous snapshot, with the dirty flags of the EPT. A guest is restored
+//! from a full snapshot and the incremental ones that follow it, in order.
+//!
+//! ## Format
+//! A snapshot file is a sequence of 4-KByte pages, with the little-endian
+//! integers:
+//! - The header page: [`SNAPSHOT_MAGIC`], the id of the chain that the
+//!   snapshot belongs to, its sequence number in the chain (0 for the full
+//!   snapshot), the number of the vcpus, the number of the ranges of the guest
+//!   RAM, the number of the saved pages, and the kernel entry.
+//! - The state of each vcpu, encoded in [`VCPU_SNAPSHOT_SIZE`] bytes.
+//! - The index: the (start, end) address of each range of the guest RAM,
+//!   which is empty in an incremental snapshot, and the guest physical
+//!   address of each saved page, padded to a page.
+//! - The content of the saved pages, in the order of the index.
+//!
+//! A full snapshot omits the pages of the guest RAM that are filled with
+//! zeros, as a restored RAM starts zero-filled.
+//!
+//! [`VCPU_SNAPSHOT_SIZE`]: kev::snapshot::VCPU_SNAPSHOT_SIZE
+use super::{VmState, pager::PageLoader};
+use crate::keos_vm::pager::KernelVmPager;
+use alloc::{boxed::Box, collections::BTreeMap, sync::Arc, vec, vec::Vec};
+use core::{arch::x86_64::_rdtsc, ops::Range};
+use keos::{KernelError, addressing::Pa, fs::RegularFile, mm::Page, sync::SpinLock};
+use kev::{
+    VmError,
+    snapshot::{EPT_WRITE, VCPU_SNAPSHOT_SIZE, VCpuSnapshot, for_each_ept_page, harvest_dirty},
+    vm::{Gpa, VmHandle},
+};
+
+/// Magic number of a snapshot file.
+pub const SNAPSHOT_MAGIC: u64 = u64::from_le_bytes(*b"KeVsnap\0");
+
+const PAGE_SIZE: usize = 0x1000;
+
+/// Decoded header of a snapshot file.
+struct Header {
+    chain: u64,
+    seq: u64,
+    nr_vcpus: usize,
+    nr_ranges: usize,
+    nr_pages: usize,
+    entry: usize,
+}
+
+impl Header {
+    fn index_offset(&self) -> usize {
+        PAGE_SIZE + self.nr_vcpus * VCPU_SNAPSHOT_SIZE
+    }
+
+    fn data_offset(&self) -> usize {
+        let index = self.index_offset() + 16 * self.nr_ranges + 8 * self.nr_pages;
+        index.next_multiple_of(PAGE_SIZE)
+    }
+
+    fn encode(&self) -> Vec<u8> {
+        let mut page = vec![0; PAGE_SIZE];
+        let words = [
+            SNAPSHOT_MAGIC,
+            self.chain,
+            self.seq,
+            self.nr_vcpus as u64,
+            self.nr_ranges as u64,
+            self.nr_pages as u64,
+            self.entry as u64,
+        ];
+        for (chunk, word) in page.chunks_exact_mut(8).zip(words) {
+            chunk.copy_from_slice(&word.to_le_bytes());
+        }
+        page
+    }
+
+    fn decode(page: &[u8]) -> Option<Self> {
+        let mut words = page
+            .chunks_exact(8)
+            .map(|chunk| u64::from_le_bytes(chunk.try_into().unwrap()));
+        if words.next()? != SNAPSHOT_MAGIC {
+            return None;
+        }
+        Some(Self {
+            chain: words.next()?,
+            seq: words.next()?,
+            nr_vcpus: words.next()? as usize,
+            nr_ranges: words.next()? as usize,
+            nr_pages: words.next()? as usize,
+            entry: words.next()? as usize,
+        })
+    }
+}
+
+/// A page to be saved.
+enum Source {
+    /// A page mapped in the EPT.
+    Mapped(Pa),
+    /// A copy of a page that is not loaded yet, e.g., of the kernel image.
+    Loaded(Page),
+}
+
+/// The chain of the snapshots that the guest memory is saved in.
+///
+/// It is kept in the [`VmState`] to number the next incremental snapshot.
+#[derive(Clone, Copy, Default)]
+pub(crate) struct Chain {
+    id: u64,
+    seq: u64,
+}
+
+fn write_all(file: &RegularFile, position: usize, buf: &[u8]) -> Result<(), VmError> {
+    match file.write(position, buf) {
+        Ok(n) if n == buf.len() => Ok(()),
+        Ok(_) => Err(VmError::ControllerError(Box::new(KernelError::NoSpace))),
+        Err(e) => Err(VmError::ControllerError(Box::new(e))),
+    }
+}
+
+/// Write a full snapshot of the running `vm` into `file`.
+///
+/// The vm is paused while the snapshot is written. Returns the number of
+/// the saved pages.
+pub fn save(vm: &VmHandle<VmState>, file: &RegularFile) -> Result<usize, VmError> {
+    do_save(vm, file, false)
+}
+
+/// Write the pages that the guest wrote since the previous snapshot of the
+/// running `vm` into `file`, with the state of the vcpus.
+///
+/// Returns the number of the saved pages.
+pub fn save_incremental(vm: &VmHandle<VmState>, file: &RegularFile) -> Result<usize, VmError> {
+    do_save(vm, file, true)
+}
+
+fn do_save(
+    vm: &VmHandle<VmState>,
+    file: &RegularFile,
+    incremental: bool,
+) -> Result<usize, VmError> {
+    let paused = vm.pause()?;
+    let result = vm.save_vcpus().and_then(|vcpus| {
+        let (ram, pages, header) = collect(vm, &vcpus, incremental)?;
+        // The vcpus cached the translations before the dirty flags are cleared.
+        vm.flush_ept();
+        write(file, &header, &vcpus, &ram, &pages)?;
+        Ok(pages.len())
+    });
+    vm.resume(&paused);
+    result
+}
+
+/// Collect the pages to be saved, and clear the dirty flags.
+#[allow(clippy::type_complexity)]
+fn collect(
+    vm: &VmHandle<VmState>,
+    vcpus: &[VCpuSnapshot],
+    incremental: bool,
+) -> Result<(Vec<Range<Gpa>>, Vec<(Gpa, Source)>, Header), VmError> {
+    let mut chain = vm.chain.lock();
+    if incremental && chain.id == 0 {
+        chain.unlock();
+        return Err(VmError::ControllerError(Box::new(
+            "No full snapshot to be based on.",
+        )));
+    }
+    let pager = vm.pager.lock();
+    let result = collect_pages(&pager, incremental);
+    let entry = pager.entry();
+    pager.unlock();
+    let result = result.map(|(ram, pages)| {
+        *chain = if incremental {
+            Chain {
+                id: chain.id,
+                seq: chain.seq + 1,
+            }
+        } else {
+            Chain {
+                id: unsafe { _rdtsc() } | 1,
+                seq: 0,
+            }
+        };
+        let header = Header {
+            chain: chain.id,
+            seq: chain.seq,
+            nr_vcpus: vcpus.len(),
+            nr_ranges: ram.len(),
+            nr_pages: pages.len(),
+            entry,
+        };
+        (ram, pages, header)
+    });
+    chain.unlock();
+    result
+}
+
+/// Collect the ranges of the guest RAM and the pages to be saved from the
+/// `pager`, and clear the dirty flags of its EPT.
+///
+/// An incremental snapshot has only the pages written since the previous
+/// one, and no ranges.
+#[allow(clippy::type_complexity)]
+fn collect_pages(
+    pager: &KernelVmPager,
+    incremental: bool,
+) -> Result<(Vec<Range<Gpa>>, Vec<(Gpa, Source)>), VmError> {
+    // The EPT does not change while the lock of the pager is held.
+    let root = pager.ept_ptr();
+    let (mut ram, mut pages) = (Vec::new(), Vec::new());
+    if incremental {
+        unsafe {
+            harvest_dirty(root, |gpa, hpa| pages.push((gpa, Source::Mapped(hpa))));
+        }
+        return Ok((ram, pages));
+    }
+
+    let mut mapped = BTreeMap::new();
+    unsafe {
+        for_each_ept_page(root, |gpa, hpa, entry| {
+            // Skip the mmio pages.
+            if entry & EPT_WRITE != 0 {
+                mapped.insert(gpa, hpa);
+            }
+        });
+        harvest_dirty(root, |_, _| {});
+    }
+    let mut gpas: Vec<Gpa> = pager.loaders.keys().copied().collect();
+    gpas.extend(mapped.keys().copied());
+    gpas.sort_unstable();
+    gpas.dedup();
+    let mut scratch = Page::new();
+    for gpa in gpas {
+        match ram.last_mut() {
+            Some(Range { end, .. }) if *end == gpa => *end = gpa + PAGE_SIZE,
+            _ => ram.push(gpa..gpa + PAGE_SIZE),
+        }
+        match (mapped.get(&gpa), pager.loaders.get(&gpa)) {
+            (Some(hpa), _) => {
+                let content = unsafe {
+                    core::slice::from_raw_parts(hpa.into_kva().into_usize() as *const u8, PAGE_SIZE)
+                };
+                if content.iter().any(|b| *b != 0) {
+                    pages.push((gpa, Source::Mapped(*hpa)));
+                }
+            }
+            (None, Some(loader)) => {
+                if !loader(&mut scratch) {
+                    return Err(VmError::ControllerError(Box::new(
+                        "Failed to load a page of the guest.",
+                    )));
+                }
+                // The scratch page stays zero-filled until a loader fills it.
+                if scratch.inner().iter().any(|b| *b != 0) {
+                    pages.push((
+                        gpa,
+                        Source::Loaded(core::mem::replace(&mut scratch, Page::new())),
+                    ));
+                }
+            }
+            _ => (),
+        }
+    }
+    Ok((ram, pages))
+}
+
+fn write(
+    file: &RegularFile,
+    header: &Header,
+    vcpus: &[VCpuSnapshot],
+    ram: &[Range<Gpa>],
+    pages: &[(Gpa, Source)],
+) -> Result<(), VmError> {
+    write_all(file, 0, &header.encode())?;
+    let mut buf = vec![0; VCPU_SNAPSHOT_SIZE];
+    for (i, vcpu) in vcpus.iter().enumerate() {
+        vcpu.encode(&mut buf);
+        write_all(file, PAGE_SIZE + i * VCPU_SNAPSHOT_SIZE, &buf)?;
+    }
+    let mut index = Vec::new();
+    for range in ram {
+        index.extend_from_slice(&(range.start.into_usize() as u64).to_le_bytes());
+        index.extend_from_slice(&(range.end.into_usize() as u64).to_le_bytes());
+    }
+    for (gpa, _) in pages {
+        index.extend_from_slice(&(gpa.into_usize() as u64).to_le_bytes());
+    }
+    index.resize(header.data_offset() - header.index_offset(), 0);
+    write_all(file, header.index_offset(), &index)?;
+
+    for (i, (_, source)) in pages.iter().enumerate() {
+        let content = match source {
+            Source::Mapped(hpa) => unsafe {
+                core::slice::from_raw_parts(hpa.into_kva().into_usize() as *const u8, PAGE_SIZE)
+            },
+            Source::Loaded(page) => page.inner(),
+        };
+        write_all(file, header.data_offset() + i * PAGE_SIZE, content)?;
+    }
+    Ok(())
+}
+
+fn read_exact(file: &RegularFile, position: usize, len: usize) -> Option<Vec<u8>> {
+    let mut buf = vec![0; len];
+    (file.read(position, &mut buf).ok()? == len).then_some(buf)
+}
+
+fn read_u64s(buf: &[u8]) -> impl Iterator<Item = usize> + '_ {
+    buf.chunks_exact(8)
+        .map(|chunk| u64::from_le_bytes(chunk.try_into().unwrap()) as usize)
+}
+
+impl VmState {
+    /// Create a vm state of the guest saved in the `snapshots`: a full
+    /// snapshot, and the incremental ones that follow it in order.
+    ///
+    /// The pages of the guest are read from the files on their first access.
+    /// Returns the state, and the state of the vcpus in the last snapshot to
+    /// be loaded with [`VmHandle::restore_vcpus`].
+    pub fn from_snapshot(snapshots: &[RegularFile]) -> Option<(Self, Vec<VCpuSnapshot>)> {
+        let mut headers = Vec::new();
+        for (seq, file) in snapshots.iter().enumerate() {
+            let header = Header::decode(&read_exact(file, 0, PAGE_SIZE)?)?;
+            if header.seq != seq as u64
+                || header.chain != headers.first().map_or(header.chain, |h: &Header| h.chain)
+            {
+                return None;
+            }
+            headers.push(header);
+        }
+        let (base, last) = (headers.first()?, headers.last()?);
+
+        let index = read_exact(&snapshots[0], base.index_offset(), 16 * base.nr_ranges)?;
+        let ram: Vec<Range<Gpa>> = read_u64s(&index)
+            .collect::<Vec<_>>()
+            .chunks_exact(2)
+            .map(|r| {
+                Gpa::new(r[0])
+                    .zip(Gpa::new(r[1]))
+                    .map(|(start, end)| start..end)
+            })
+            .collect::<Option<_>>()?;
+        // Every page of the RAM is zero-filled until its loader is replaced.
+        let empty: PageLoader = Arc::new(|_: &mut Page| true);
+        let mut loaders = BTreeMap::new();
+        for range in ram.iter() {
+            for gpa in (range.start.into_usize()..range.end.into_usize()).step_by(PAGE_SIZE) {
+                loaders.insert(Gpa::new(gpa)?, empty.clone());
+            }
+        }
+        // The later snapshots override the pages of the earlier ones.
+        for (file, header) in snapshots.iter().zip(headers.iter()) {
+            let index = read_exact(
+                file,
+                header.index_offset() + 16 * header.nr_ranges,
+                8 * header.nr_pages,
+            )?;
+            for (i, gpa) in read_u64s(&index).enumerate() {
+                let (file, position) = (file.clone(), header.data_offset() + i * PAGE_SIZE);
+                let loader: PageLoader = Arc::new(move |page: &mut Page| {
+                    file.read(position, page.inner_mut())
+                        .is_ok_and(|n| n == PAGE_SIZE)
+                });
+                loaders.insert(Gpa::new(gpa)?, loader);
+            }
+        }
+
+        let vcpus = (0..last.nr_vcpus)
+            .map(|i| {
+                read_exact(
+                    snapshots.last()?,
+                    PAGE_SIZE + i * VCPU_SNAPSHOT_SIZE,
+                    VCPU_SNAPSHOT_SIZE,
+                )
+                .and_then(|buf| VCpuSnapshot::decode(&buf))
+            })
+            .collect::<Option<Vec<_>>>()?;
+
+        // The kernel image is loaded again only to rebuild the pager; all of
+        // its loaders are replaced.
+        let ram_in_kib = ram
+            .iter()
+            .map(|range| range.end.into_usize() - range.start.into_usize())
+            .sum::<usize>()
+            / 1024;
+        let mut state = Self::new(ram_in_kib)?;
+        let mut pager = state.pager.lock();
+        let matched = pager.entry() == base.entry;
+        if matched {
+            pager.loaders = loaders;
+        }
+        pager.unlock();
+        if !matched {
+            return None;
+        }
+        state.restored = true;
+        state.chain = SpinLock::new(Chain {
+            id: last.chain,
+            seq: last.seq,
+        });
+        Some((state, vcpus))
+    }
+}
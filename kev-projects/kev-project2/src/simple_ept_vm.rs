@@ -14,6 +14,7 @@ use keos::{
 use keos_project2::page_table::PageTable;
 use kev::{
     VmError,
+    batch::Batched,
     vcpu::{
         Cr0, Cr4, GenericVCpuState, Rflags, VmexitResult,
         segmentation::{SEGMENT_TABLE, Segment},
@@ -58,7 +59,10 @@ impl kev::vm::VmState for SimpleEptVmState {
         SimpleEptVcpuState {
             ept: ExtendedPageTable::new(),
             page_table: PageTable(PageTableRoot::new_boxed()),
-            vmexit_controller: (hypercall::Controller::new(HypercallCtx), (mmio_controller)),
+            vmexit_controller: (
+                Batched(hypercall::Controller::new(HypercallCtx)),
+                (mmio_controller),
+            ),
         }
     }
 
@@ -293,7 +297,10 @@ impl kev::vm::VmState for SimpleEptVmState {
 pub struct SimpleEptVcpuState {
     ept: ExtendedPageTable,
     page_table: PageTable,
-    vmexit_controller: (hypercall::Controller<HypercallCtx>, mmio::Controller),
+    vmexit_controller: (
+        Batched<hypercall::Controller<HypercallCtx>>,
+        mmio::Controller,
+    ),
 }
 
 impl SimpleEptVcpuState {
@@ -111,10 +111,19 @@
 //! interrupt, and then 3) [`resume`] the vCPU to execute the timer interrupt in
 //! the guest.
 //!
+//! ### Posted interrupts
+//! If the processor supports the APIC virtualization (see [`kev::apicv`]),
+//! the guest reads its x2APIC registers, and acknowledges its interrupts
+//! without a vmexit. An interrupt can then be [`posted`] to a vCPU instead:
+//! the running vCPU takes it without being kicked and resumed, and a vCPU
+//! that is not running takes it on its next VmEntry. The IPIs between the
+//! vCPUs are delivered in this way.
+//!
 //! [`channel`]: keos::thread::channel::channel
 //! [`kick`]: kev::vm::VmOps::kick_vcpu
 //! [`inject`]: kev::vcpu::VCpuOps::inject_interrupt
 //! [`resume`]: kev::vm::VmOps::resume_vcpu
+//! [`posted`]: kev::vm::VmOps::post_interrupt
 
 use alloc::sync::Arc;
 use core::arch::x86_64::_rdtsc;
@@ -243,8 +252,23 @@ impl msr::Msr for X2Apic {
             // ICR
             0x830 => {
                 let icr = ICR::from_bits_truncate(value as u32);
-                let (dst, _ipi) = ((value >> 32) as u32, value as u8);
+                let (dst, ipi) = ((value >> 32) as u32, value as u8);
                 match icr.mode() {
+                    ICRMode::Fixed => {
+                        let vm = generic_vcpu_state.vm.upgrade().unwrap();
+                        let me = generic_vcpu_state.id();
+                        // Destination shorthand.
+                        let dsts = match (value >> 18) & 0b11 {
+                            0b00 => dst as usize..dst as usize + 1,
+                            0b01 => me..me + 1,
+                            _ => 0..(0..).take_while(|id| vm.get_vcpu(*id).is_some()).count(),
+                        };
+                        for id in dsts {
+                            if (value >> 18) & 0b11 != 0b11 || id != me {
+                                let _ = vm.post_interrupt(id, ipi);
+                            }
+                        }
+                    }
                     ICRMode::Init => (),
                     ICRMode::StartUp => {
                         let entry = unsafe {
@@ -260,11 +284,20 @@ impl msr::Msr for X2Apic {
                                         as *const u16,
                                 ) & 0xf)
                         };
-                        let _ = generic_vcpu_state
-                            .vm
-                            .upgrade()
-                            .unwrap()
-                            .start_vcpu(dst as usize, entry);
+                        let vm = generic_vcpu_state.vm.upgrade().unwrap();
+                        let me = generic_vcpu_state.id();
+                        // Destination shorthand; the guest starts all of its
+                        // aps with a broadcast.
+                        let dsts = match (value >> 18) & 0b11 {
+                            0b00 => dst as usize..dst as usize + 1,
+                            0b01 => me..me + 1,
+                            _ => 0..(0..).take_while(|id| vm.get_vcpu(*id).is_some()).count(),
+                        };
+                        for id in dsts {
+                            if (value >> 18) & 0b11 != 0b11 || id != me {
+                                let _ = vm.start_vcpu(id, entry);
+                            }
+                        }
                     }
                     e => unimplemented!("{e:?}"),
                 }
@@ -3,7 +3,7 @@
 use alloc::sync::Arc;
 use keos::{fs::FileSystem, mm::Page, sync::SpinLock};
 use kev::{
-    VmError, vcpu::{Cr0, Cr4, GenericVCpuState, Rflags, VmexitResult}, vm_control::*, vmcs::{ActiveVmcs, Field}, vmexits::VmexitController
+    VmError, apicv::{APICV_PINBASE_CTLS, APICV_PROCBASE_CTLS, APICV_PROCBASE_CTLS2}, batch::Batched, msr_bitmap::{MsrAccess, MsrBitmap}, vcpu::{Cr0, Cr4, GenericVCpuState, Rflags, VmexitResult}, vm_control::*, vmcs::{ActiveVmcs, Field}, vmexits::VmexitController
 };
 use kev_project1::{
     hypercall::HypercallCtx,
@@ -102,7 +102,7 @@ impl kev::vm::VmState for VmState {
         let (mut mmio_ctl, mut pio_ctl, hypercall_ctl, cpuid_ctl, mut msr_ctl) = (
             mmio::Controller::new(),
             pio::Controller::new(),
-            hypercall::Controller::new(HypercallCtx),
+            Batched(hypercall::Controller::new(HypercallCtx)),
             cpuid::Controller::new(),
             msr::Controller::new(),
         );
@@ -128,10 +128,18 @@ impl kev::vm::VmState for VmState {
         assert!(pio_ctl.register(0x604, ExitPio));
         assert!(pio_ctl.register(0xB004, ExitPio));
 
+        // FS_BASE, GS_BASE, KERNEL_GS_BASE, and TSC_AUX. The handlers above
+        // still serve them on a processor without the MSR bitmaps.
+        let mut msr_bitmap = MsrBitmap::new();
+        for index in [0xC000_0100, 0xC000_0101, 0xC000_0102, 0xC000_0103] {
+            assert!(msr_bitmap.passthrough(index, MsrAccess::ReadWrite));
+        }
+
         VcpuState {
             pager: self.pager.clone(),
             vmexit_controller: (mmio_ctl, (pio_ctl, (hypercall_ctl, (cpuid_ctl, msr_ctl)))),
             io_bmap: self.io_bmap.clone(),
+            msr_bitmap,
         }
     }
 
@@ -303,27 +311,31 @@ pub struct VcpuState {
         (
             pio::Controller,
             (
-                hypercall::Controller<HypercallCtx>,
+                Batched<hypercall::Controller<HypercallCtx>>,
                 (cpuid::Controller, msr::Controller),
             ),
         ),
     ),
     io_bmap: Arc<(Page, Page)>,
+    msr_bitmap: MsrBitmap,
 }
 
 impl kev::vcpu::VCpuState for VcpuState {
+    // The APIC virtualization is used if the processor supports it.
     fn pinbase_ctls(&self) -> VmcsPinBasedVmexecCtl {
-        VmcsPinBasedVmexecCtl::EXTERNAL_INTERRUPT_EXITING
+        VmcsPinBasedVmexecCtl::EXTERNAL_INTERRUPT_EXITING | APICV_PINBASE_CTLS
     }
     fn procbase_ctls(&self) -> VmcsProcBasedVmexecCtl {
         VmcsProcBasedVmexecCtl::HLT_EXITING
             | VmcsProcBasedVmexecCtl::UNCONDIOEXIT
             | VmcsProcBasedVmexecCtl::USEIOBMP
+            | APICV_PROCBASE_CTLS
     }
     fn procbase_ctls2(&self) -> VmcsProcBasedSecondaryVmexecCtl {
         VmcsProcBasedSecondaryVmexecCtl::ENABLE_RDTSCP
             | VmcsProcBasedSecondaryVmexecCtl::ENABLE_EPT
             | VmcsProcBasedSecondaryVmexecCtl::UNRESTRICTED_GUEST
+            | APICV_PROCBASE_CTLS2
     }
     fn entry_ctls(&self) -> VmcsEntryCtl {
         VmcsEntryCtl::LOAD_IA32_EFER
@@ -334,6 +346,9 @@ impl kev::vcpu::VCpuState for VcpuState {
             | VmcsExitCtl::SAVE_IA32_EFER
             | VmcsExitCtl::LOAD_IA32_EFER
     }
+    fn msr_bitmap(&mut self) -> Option<&mut MsrBitmap> {
+        Some(&mut self.msr_bitmap)
+    }
     fn init_guest_state(&self, vmcs: &ActiveVmcs) -> Result<(), VmError> {
         let pager = self.pager.lock();
         let ept_ptr = pager.ept_ptr().into_usize() as u64 | (3 << 3) | 6;
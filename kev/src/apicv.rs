@@ -0,0 +1,231 @@
+//! Hardware-assisted virtualization of the local APIC.
+//!
+//! Without it, every access of the guest to its x2APIC is trapped and
+//! emulated, and an interrupt is injected only on a VM entry: to interrupt a
+//! running vcpu, the vcpu must be kicked out of the guest, and resumed. VMX
+//! provides three features that remove most of these exits:
+//!
+//! - APIC-register virtualization: the guest reads its x2APIC registers from
+//!   the virtual-APIC page of the vcpu without an exit.
+//! - Virtual-interrupt delivery: the processor keeps the requested and the
+//!   in-service interrupts of the guest in the virtual-APIC page. It delivers
+//!   a requested interrupt as soon as the guest can take it, and completes the
+//!   EOI of the guest without an exit.
+//! - Posted interrupts: an interrupt is recorded in the [`PostedInterruptDesc`]
+//!   of a vcpu, and the cpu that runs the vcpu is notified with
+//!   [`POSTED_INTR_VECTOR`]. The processor consumes the notification in the
+//!   guest, and moves the interrupt into the virtual-APIC page without an
+//!   exit.
+//!
+//! A vcpu uses these features when its [`VCpuState`] enables all of
+//! [`APICV_PINBASE_CTLS`], [`APICV_PROCBASE_CTLS`] and
+//! [`APICV_PROCBASE_CTLS2`], and the processor supports them. Otherwise, they
+//! are turned off together, and the interrupts are injected on the VM entries.
+//! Either way, [`VmOps::post_interrupt`] delivers an interrupt to a vcpu
+//! without kicking it.
+//!
+//! The guest still traps on the writes to its x2APIC registers, except for
+//! the TPR, the EOI and the SELF IPI, which are virtualized.
+//!
+//! [`VCpuState`]: crate::vcpu::VCpuState
+//! [`VmOps::post_interrupt`]: crate::vm::VmOps::post_interrupt
+use crate::{VmError, msr_bitmap::MsrBitmap, vm_control::*, vmcs::ActiveVmcs, vmcs::Field};
+use core::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+use keos::mm::Page;
+
+/// The host vector that notifies a cpu of posted interrupts.
+pub const POSTED_INTR_VECTOR: u8 = 101;
+
+/// Pin-based controls for the APIC virtualization.
+pub const APICV_PINBASE_CTLS: VmcsPinBasedVmexecCtl = VmcsPinBasedVmexecCtl::from_bits_truncate(
+    VmcsPinBasedVmexecCtl::EXTERNAL_INTERRUPT_EXITING.bits()
+        | VmcsPinBasedVmexecCtl::PROCESS_POSTED_INTERRUPT.bits(),
+);
+/// Proc-based controls for the APIC virtualization.
+pub const APICV_PROCBASE_CTLS: VmcsProcBasedVmexecCtl = VmcsProcBasedVmexecCtl::USETPRSHADOW;
+/// Proc-based secondary controls for the APIC virtualization.
+pub const APICV_PROCBASE_CTLS2: VmcsProcBasedSecondaryVmexecCtl =
+    VmcsProcBasedSecondaryVmexecCtl::from_bits_truncate(
+        VmcsProcBasedSecondaryVmexecCtl::VIRTUALIZED_X2APIC_MODE.bits()
+            | VmcsProcBasedSecondaryVmexecCtl::APIC_REGISTER_VIRTUALIZATION.bits()
+            | VmcsProcBasedSecondaryVmexecCtl::VIRTUAL_INTERRUPT_DELIVERY.bits(),
+    );
+
+/// Offset of the APIC ID register in the virtual-APIC page.
+const APIC_ID: usize = 0x20;
+/// Offset of the version register in the virtual-APIC page.
+const APIC_VERSION: usize = 0x30;
+/// Offset of the logical destination register in the virtual-APIC page.
+const APIC_LDR: usize = 0xd0;
+/// Offset of the interrupt request register in the virtual-APIC page.
+const APIC_IRR: usize = 0x200;
+
+/// The posted-interrupt descriptor.
+///
+/// Bit `n` of `pir` requests vector `n`. The outstanding-notification (ON)
+/// bit of `control` is set when a notification is sent, and cleared when the
+/// requests are taken, so that a burst of posts sends one notification.
+#[repr(C, align(64))]
+pub struct PostedInterruptDesc {
+    pir: [AtomicU64; 4],
+    control: AtomicU64,
+    _rsv: [u64; 3],
+}
+
+impl PostedInterruptDesc {
+    const ON: u64 = 1 << 0;
+
+    /// Request the vector `vec`.
+    ///
+    /// Returns true if the caller must notify the cpu that runs the vcpu.
+    pub fn post(&self, vec: u8) -> bool {
+        self.pir[vec as usize / 64].fetch_or(1 << (vec % 64), Ordering::SeqCst);
+        self.control.fetch_or(Self::ON, Ordering::SeqCst) & Self::ON == 0
+    }
+
+    /// Returns true if a vector is requested.
+    pub fn is_pending(&self) -> bool {
+        self.pir.iter().any(|bits| bits.load(Ordering::SeqCst) != 0)
+    }
+
+    /// Take the requested vectors.
+    pub fn take(&self) -> [u64; 4] {
+        self.control.fetch_and(!Self::ON, Ordering::SeqCst);
+        core::array::from_fn(|i| self.pir[i].swap(0, Ordering::SeqCst))
+    }
+}
+
+/// The virtual APIC of a vcpu.
+///
+/// It is shared between the vcpu and the [`Vm`], so that an interrupt is
+/// posted without the lock of the vcpu.
+///
+/// [`Vm`]: crate::vm::Vm
+pub struct VirtualApic {
+    /// The virtual-APIC page.
+    apic_page: Page,
+    /// The page that holds the [`PostedInterruptDesc`].
+    desc_page: Page,
+    /// The MSR bitmap of a vcpu that has none of its own.
+    msr_bitmap: MsrBitmap,
+}
+
+impl VirtualApic {
+    /// Create a virtual APIC whose x2APIC ID is `apic_id`.
+    pub fn new(apic_id: u32) -> Self {
+        let (mut apic_page, mut desc_page, mut msr_bitmap) =
+            (Page::new(), Page::new(), MsrBitmap::new());
+        apic_page.inner_mut().fill(0);
+        desc_page.inner_mut().fill(0);
+        let regs = apic_page.inner_mut();
+        regs[APIC_ID..APIC_ID + 4].copy_from_slice(&apic_id.to_le_bytes());
+        regs[APIC_VERSION..APIC_VERSION + 4].copy_from_slice(&0x0005_0014u32.to_le_bytes());
+        let ldr = ((apic_id >> 4) << 16) | (1 << (apic_id & 0xf));
+        regs[APIC_LDR..APIC_LDR + 4].copy_from_slice(&ldr.to_le_bytes());
+
+        msr_bitmap.virtualize_x2apic();
+
+        Self {
+            apic_page,
+            desc_page,
+            msr_bitmap,
+        }
+    }
+
+    /// Get the posted-interrupt descriptor.
+    pub fn desc(&self) -> &PostedInterruptDesc {
+        unsafe { &*(self.desc_page.kva().into_usize() as *const PostedInterruptDesc) }
+    }
+
+    /// Post the vector `vec`.
+    ///
+    /// Returns true if the caller must notify the cpu that runs the vcpu.
+    #[inline]
+    pub fn post(&self, vec: u8) -> bool {
+        self.desc().post(vec)
+    }
+
+    fn irr(&self, index: usize) -> &AtomicU32 {
+        unsafe {
+            &*((self.apic_page.kva().into_usize() + APIC_IRR + 0x10 * index) as *const AtomicU32)
+        }
+    }
+
+    /// Get the MSR bitmap for a vcpu that has none of its own.
+    pub(crate) fn msr_bitmap(&self) -> &MsrBitmap {
+        &self.msr_bitmap
+    }
+
+    /// Copy the virtual-APIC page into `buf`.
+    pub(crate) fn save(&self, buf: &mut [u8]) {
+        buf.copy_from_slice(self.apic_page.inner());
+    }
+
+    /// Load the virtual-APIC page from `buf`.
+    ///
+    /// The vcpu must not be running.
+    pub(crate) fn restore(&self, buf: &[u8]) {
+        unsafe {
+            core::ptr::copy_nonoverlapping(
+                buf.as_ptr(),
+                self.apic_page.kva().into_usize() as *mut u8,
+                buf.len().min(0x1000),
+            );
+        }
+    }
+
+    /// Install the virtual APIC into the `vmcs`.
+    pub(crate) fn install(&self, vmcs: &ActiveVmcs) -> Result<(), VmError> {
+        vmcs.write(
+            Field::VirtualApicPageAddr,
+            self.apic_page.pa().into_usize() as u64,
+        )?;
+        vmcs.write(
+            Field::PostedInterruptDescAddr,
+            self.desc_page.pa().into_usize() as u64,
+        )?;
+        vmcs.write(Field::PostedInterruptVector, POSTED_INTR_VECTOR as u64)?;
+        // No EOI of the guest is trapped.
+        for field in [
+            Field::EoiExitBitmap0,
+            Field::EoiExitBitmap1,
+            Field::EoiExitBitmap2,
+            Field::EoiExitBitmap3,
+        ] {
+            vmcs.write(field, 0)?;
+        }
+        vmcs.write(Field::TprThreshold, 0)?;
+        vmcs.write(Field::GuestInterruptStatus, 0)
+    }
+
+    /// Request the vectors of `bitmap` in the virtual-APIC page, and let the
+    /// processor deliver the highest one on the next VM entry.
+    ///
+    /// The vcpu must not be running.
+    pub(crate) fn request(&self, vmcs: &ActiveVmcs, bitmap: [u64; 4]) -> Result<(), VmError> {
+        if bitmap.iter().all(|bits| *bits == 0) {
+            return Ok(());
+        }
+        for (i, bits) in bitmap.iter().enumerate() {
+            self.irr(2 * i).fetch_or(*bits as u32, Ordering::SeqCst);
+            self.irr(2 * i + 1)
+                .fetch_or((*bits >> 32) as u32, Ordering::SeqCst);
+        }
+        // The requesting virtual interrupt (RVI) is the low byte of the
+        // guest interrupt status.
+        let Some(highest) = (0..8)
+            .rev()
+            .find_map(|i| match self.irr(i).load(Ordering::SeqCst) {
+                0 => None,
+                v => Some(i as u64 * 32 + 31 - v.leading_zeros() as u64),
+            })
+        else {
+            return Ok(());
+        };
+        let status = vmcs.read(Field::GuestInterruptStatus)?;
+        if highest > status & 0xff {
+            vmcs.write(Field::GuestInterruptStatus, (status & !0xff) | highest)?;
+        }
+        Ok(())
+    }
+}
@@ -0,0 +1,140 @@
+//! Batched hypercalls.
+//!
+//! A guest that makes many hypercalls in a row, e.g., to print or to set up
+//! a device, pays a vmexit for each of them. Instead, it can place up to
+//! [`BATCH_MAX`] [`BatchEntry`]s in its memory, and make them all with a
+//! single vmcall:
+//! - %rax = [`HYPERCALL_BATCH`].
+//! - %rdi = guest physical address of the first entry, aligned to the size of
+//!   a [`BatchEntry`].
+//! - %rsi = number of the entries.
+//!
+//! The [`Batched`] controller runs the entries in order, as if each of them
+//! were a vmcall with its registers, through the hypercall controller that it
+//! wraps, and writes the %rax after each hypercall into the entry. The batch
+//! stops at the first hypercall that does not continue the vcpu, e.g., that
+//! halts it. On return, %rax holds the number of the hypercalls that ran, and
+//! the other registers are preserved.
+//!
+//! A batch that cannot run, e.g., an entry outside the guest memory or a
+//! hypercall that the wrapped controller fails, is an error of the vcpu, as
+//! a single failed vmcall is. The registers of the vcpu are restored before
+//! the error is returned.
+use crate::{
+    VmError,
+    probe::Probe,
+    vcpu::{GeneralPurposeRegisters, GenericVCpuState, VmexitResult},
+    vm::Gpa,
+    vmcs::{BasicExitReason, ExitReason, Field},
+    vmexits::VmexitController,
+};
+use alloc::boxed::Box;
+
+/// Hypercall number of a batch of hypercalls.
+pub const HYPERCALL_BATCH: usize = 0xff;
+
+/// Maximum number of the hypercalls in a batch.
+pub const BATCH_MAX: usize = 512;
+
+/// A hypercall in a batch.
+#[repr(C, align(64))]
+#[derive(Clone, Copy, Debug, Default)]
+pub struct BatchEntry {
+    /// Hypercall number, as in %rax.
+    pub nr: u64,
+    /// Arguments, as in %rdi, %rsi, %rdx, %r10, %r9 and %r8.
+    pub args: [u64; 6],
+    /// %rax after the hypercall.
+    pub ret: u64,
+}
+
+/// Vmexit controller that runs the batches of hypercalls through the
+/// hypercall controller `C`.
+///
+/// The other vmexits are passed to `C` as is.
+pub struct Batched<C: VmexitController>(pub C);
+
+impl<C: VmexitController> Batched<C> {
+    /// Run the batch of hypercalls requested by the vcpu.
+    ///
+    /// Returns the result of the last hypercall that ran, with the registers
+    /// restored except the %rax.
+    fn handle_batch<P: Probe>(
+        &mut self,
+        reason: ExitReason,
+        p: &mut P,
+        generic_vcpu_state: &mut GenericVCpuState,
+    ) -> Result<VmexitResult, VmError> {
+        let (base, count) = (generic_vcpu_state.gprs.rdi, generic_vcpu_state.gprs.rsi);
+        if base % core::mem::size_of::<BatchEntry>() != 0 || count > BATCH_MAX {
+            return Err(VmError::ControllerError(Box::new(
+                "Invalid hypercall batch",
+            )));
+        }
+        let saved = *generic_vcpu_state.gprs;
+        let rip = generic_vcpu_state.vmcs.read(Field::GuestRip)?;
+        let mut done = 0;
+        let result = loop {
+            if done == count {
+                break Ok(VmexitResult::Ok);
+            }
+            // An entry never crosses a page, as it is aligned to its size.
+            let Some(entry) = Gpa::new(base + done * core::mem::size_of::<BatchEntry>())
+                .and_then(|gpa| p.gpa2hva(&generic_vcpu_state.vmcs, gpa))
+            else {
+                break Err(VmError::ControllerError(Box::new(
+                    "Invalid hypercall batch",
+                )));
+            };
+            let entry = unsafe { &mut *(entry.into_usize() as *mut BatchEntry) };
+            let [rdi, rsi, rdx, r10, r9, r8] = entry.args.map(|arg| arg as usize);
+            *generic_vcpu_state.gprs = GeneralPurposeRegisters {
+                rax: entry.nr as usize,
+                rdi,
+                rsi,
+                rdx,
+                r10,
+                r9,
+                r8,
+                ..saved
+            };
+            let r = self.0.handle(reason, p, generic_vcpu_state);
+            // Each hypercall forwards the rip past the vmcall of the batch.
+            if let Err(e) = generic_vcpu_state.vmcs.write(Field::GuestRip, rip) {
+                break Err(e);
+            }
+            done += 1;
+            match r {
+                Ok(VmexitResult::Ok) => entry.ret = generic_vcpu_state.gprs.rax as u64,
+                r => break r,
+            }
+        };
+        *generic_vcpu_state.gprs = match result {
+            Ok(_) => GeneralPurposeRegisters { rax: done, ..saved },
+            Err(_) => saved,
+        };
+        result
+    }
+}
+
+impl<C: VmexitController> VmexitController for Batched<C> {
+    fn handle<P: Probe>(
+        &mut self,
+        reason: ExitReason,
+        p: &mut P,
+        generic_vcpu_state: &mut GenericVCpuState,
+    ) -> Result<VmexitResult, VmError> {
+        match reason.get_basic_reason() {
+            BasicExitReason::Vmcall if generic_vcpu_state.gprs.rax == HYPERCALL_BATCH => {
+                match self.handle_batch(reason, p, generic_vcpu_state)? {
+                    VmexitResult::Ok => {
+                        generic_vcpu_state.vmcs.forward_rip()?;
+                        Ok(VmexitResult::Ok)
+                    }
+                    r => Ok(r),
+                }
+            }
+            _ => self.0.handle(reason, p, generic_vcpu_state),
+        }
+    }
+}
@@ -71,7 +71,12 @@ extern crate alloc;
 #[macro_use]
 extern crate keos;
 
+pub mod apicv;
+pub mod batch;
+pub mod msr_bitmap;
 mod probe;
+pub mod profile;
+pub mod snapshot;
 pub mod vcpu;
 pub mod vm;
 pub mod vm_control;
@@ -191,6 +196,7 @@ pub unsafe fn start_vmx_on_cpu() -> Result<(), VmxError> {
 
         if cpuid() == 0 {
             register(100, |_| {});
+            register(apicv::POSTED_INTR_VECTOR as usize, |_| {});
         }
 
         core::mem::ManuallyDrop::new(Box::new(Vmcs::new()))
@@ -0,0 +1,186 @@
+//! MSR bitmaps.
+//!
+//! Without an MSR bitmap, every `rdmsr` and `wrmsr` of the guest exits to the
+//! host. An [`MsrBitmap`] lets the guest access the chosen MSRs directly:
+//! - [`MsrAccess::ReadWrite`]: the guest reads and writes the MSR without an
+//!   exit. The MSRs kept in the guest-state area of the VMCS, e.g., the FS
+//!   and GS bases, are saved and restored by the processor. The others, e.g.,
+//!   the KERNEL_GS_BASE and the TSC_AUX, are switched between the guest and
+//!   the host values through the MSR-load and MSR-store areas on every VM
+//!   entry and exit.
+//! - [`MsrAccess::ReadOnly`]: the guest reads the MSR without an exit, and the
+//!   writes are trapped. The guest reads the value of the host, unless the
+//!   MSR is in the guest-state area.
+//!
+//! The MSRs of the x2APIC (0x800-0x8ff) and the EFER are managed by KeV, and
+//! cannot be passed through.
+use crate::{VmError, vmcs::ActiveVmcs, vmcs::Field};
+use alloc::vec::Vec;
+use keos::mm::Page;
+
+/// Offset of the read bitmap of the low MSRs (0x0-0x1fff).
+const READ_LOW: usize = 0;
+/// Offset of the read bitmap of the high MSRs (0xc000_0000-0xc000_1fff).
+const READ_HIGH: usize = 1024;
+/// Offset of the write bitmap of the low MSRs.
+const WRITE_LOW: usize = 2048;
+/// Offset of the write bitmap of the high MSRs.
+const WRITE_HIGH: usize = 3072;
+
+/// Maximum number of the switched MSRs.
+pub const MAX_SWITCHED_MSRS: usize = 32;
+
+/// The MSRs saved and restored with the guest-state area of the VMCS.
+const GUEST_STATE_MSRS: [u32; 5] = [0x174, 0x175, 0x176, 0xc000_0100, 0xc000_0101];
+
+/// How the guest accesses an MSR.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum MsrAccess {
+    /// Both reads and writes exit.
+    Trap,
+    /// Reads are passed through, and writes exit.
+    ReadOnly,
+    /// Both reads and writes are passed through.
+    ReadWrite,
+}
+
+/// An MSR bitmap, and the MSRs switched on VM entries and exits.
+pub struct MsrBitmap {
+    bitmap: Page,
+    /// Guest values of the switched MSRs, loaded on VM entries and stored on
+    /// VM exits.
+    guest: Page,
+    /// Host values of the switched MSRs, loaded on VM exits.
+    host: Page,
+    switched: Vec<u32>,
+}
+
+impl Default for MsrBitmap {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl MsrBitmap {
+    /// Create a bitmap that traps all MSRs.
+    pub fn new() -> Self {
+        let (mut bitmap, mut guest, mut host) = (Page::new(), Page::new(), Page::new());
+        bitmap.inner_mut().fill(0xff);
+        guest.inner_mut().fill(0);
+        host.inner_mut().fill(0);
+        Self {
+            bitmap,
+            guest,
+            host,
+            switched: Vec::new(),
+        }
+    }
+
+    /// Locate the bits of `index` in the read and the write bitmaps.
+    fn bits(index: u32) -> Option<(usize, usize, u8)> {
+        let (read, write, ofs) = match index {
+            0..=0x1fff => (READ_LOW, WRITE_LOW, index as usize),
+            0xc000_0000..=0xc000_1fff => (READ_HIGH, WRITE_HIGH, (index - 0xc000_0000) as usize),
+            _ => return None,
+        };
+        Some((read + ofs / 8, write + ofs / 8, 1 << (ofs % 8)))
+    }
+
+    fn set(&mut self, index: u32, read: bool, write: bool) {
+        let (r, w, bit) = Self::bits(index).unwrap();
+        let bitmap = self.bitmap.inner_mut();
+        for (byte, trap) in [(r, !read), (w, !write)] {
+            if trap {
+                bitmap[byte] |= bit;
+            } else {
+                bitmap[byte] &= !bit;
+            }
+        }
+    }
+
+    /// Set how the guest accesses the MSR `index`.
+    ///
+    /// Returns false if the MSR cannot be passed through, or there are too
+    /// many switched MSRs.
+    pub fn passthrough(&mut self, index: u32, access: MsrAccess) -> bool {
+        if Self::bits(index).is_none() || (0x800..=0x8ff).contains(&index) || index == 0xc000_0080 {
+            return false;
+        }
+        let switched = access == MsrAccess::ReadWrite && !GUEST_STATE_MSRS.contains(&index);
+        match self.switched.iter().position(|i| *i == index) {
+            Some(_) if switched => (),
+            Some(pos) => {
+                self.switched.remove(pos);
+            }
+            None if switched => {
+                if self.switched.len() == MAX_SWITCHED_MSRS {
+                    return false;
+                }
+                self.switched.push(index);
+            }
+            None => (),
+        }
+        self.set(
+            index,
+            access != MsrAccess::Trap,
+            access == MsrAccess::ReadWrite,
+        );
+        true
+    }
+
+    /// Let the processor virtualize the x2APIC: pass the reads of the x2APIC
+    /// registers, and the writes to the TPR, the EOI and the SELF IPI.
+    pub(crate) fn virtualize_x2apic(&mut self) {
+        for index in 0x800..=0x8ff {
+            self.set(index, true, matches!(index, 0x808 | 0x80b | 0x83f));
+        }
+    }
+
+    /// Install the bitmap and the MSR areas into the `vmcs`.
+    pub(crate) fn install(&self, vmcs: &ActiveVmcs) -> Result<(), VmError> {
+        let (guest, host) = (
+            self.guest.pa().into_usize() as u64,
+            self.host.pa().into_usize() as u64,
+        );
+        let count = self.switched.len() as u64;
+        vmcs.write(Field::MsrBitmaps, self.bitmap.pa().into_usize() as u64)?;
+        vmcs.write(Field::VmentryMsrLoadAddr, guest)?;
+        vmcs.write(Field::VmentryMsrLoadCount, count)?;
+        vmcs.write(Field::VmexitMsrStoreAddr, guest)?;
+        vmcs.write(Field::VmexitMsrStoreCount, count)?;
+        vmcs.write(Field::VmexitMsrLoadAddr, host)?;
+        vmcs.write(Field::VmexitMsrLoadCount, count)?;
+        // Lay out the entries. The guest values start from zero.
+        for (i, index) in self.switched.iter().enumerate() {
+            for area in [&self.guest, &self.host] {
+                unsafe {
+                    let entry = (area.kva().into_usize() + 16 * i) as *mut u32;
+                    entry.write_volatile(*index);
+                }
+            }
+        }
+        Ok(())
+    }
+
+    /// Reload the host values of the switched MSRs of this cpu.
+    ///
+    /// This must be called before every VM entry, as the vcpu may move
+    /// between the cpus.
+    pub(crate) fn refresh_host(&self) {
+        for (i, index) in self.switched.iter().enumerate() {
+            unsafe {
+                let value = (self.host.kva().into_usize() + 16 * i + 8) as *mut u64;
+                value.write_volatile(read_msr(*index));
+            }
+        }
+    }
+}
+
+/// Read the MSR `index` of this cpu.
+fn read_msr(index: u32) -> u64 {
+    let (hi, lo): (u32, u32);
+    unsafe {
+        core::arch::asm!("rdmsr", out("edx") hi, out("eax") lo, in("ecx") index, options(nomem, nostack));
+    }
+    ((hi as u64) << 32) | lo as u64
+}
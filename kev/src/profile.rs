@@ -0,0 +1,277 @@
+//! Vmexit profiling.
+//!
+//! Every vmexit of a vcpu is charged to its [`ExitProfile`], which collects:
+//! - the number of the exits and the TSC cycles spent in [`vcpu_loop`] to
+//!   handle them, for each basic exit reason,
+//! - the same for each MSR of the `rdmsr` and `wrmsr` exits, each port of the
+//!   I/O instruction exits, and each guest page of the EPT violations, i.e.,
+//!   the MMIO accesses, up to [`NR_DETAILS`] of them,
+//! - when enabled with [`set_tracing`], a ring of the last [`TRACE_LEN`]
+//!   exits with their reason, guest rip and duration.
+//!
+//! The cycles of an exit run from the vmexit to the next VM entry, or to the
+//! return from [`vcpu_loop`], e.g., on an external interrupt; the host
+//! interrupt handlers that run after the return are not charged.
+//! [`VmHandle::dump_exits`] prints the profiles of all vcpus of a vm.
+//!
+//! [`vcpu_loop`]: crate::vcpu
+//! [`VmHandle::dump_exits`]: crate::vm::VmHandle::dump_exits
+use crate::{
+    vcpu::GenericVCpuState,
+    vmcs::{BasicExitReason, Field},
+};
+use alloc::{vec, vec::Vec};
+use core::{
+    arch::x86_64::_rdtsc,
+    sync::atomic::{AtomicBool, Ordering},
+};
+use keos::sync::SpinLock;
+
+/// Number of the profiled basic exit reasons. Larger reasons are charged to
+/// the last slot.
+pub const NR_EXIT_REASONS: usize = 0x40;
+
+/// Number of the profiled MSRs, ports and MMIO pages of a vcpu.
+pub const NR_DETAILS: usize = 32;
+
+/// Number of the exits in the trace ring of a vcpu.
+pub const TRACE_LEN: usize = 256;
+
+static TRACING: AtomicBool = AtomicBool::new(false);
+
+/// Turn the trace ring on or off.
+pub fn set_tracing(on: bool) {
+    TRACING.store(on, Ordering::Relaxed);
+}
+
+/// Count and cycles of the exits of a kind.
+#[derive(Clone, Copy, Default, Debug)]
+pub struct ExitCount {
+    /// Number of the exits.
+    pub count: u64,
+    /// TSC cycles spent to handle the exits.
+    pub cycles: u64,
+}
+
+impl ExitCount {
+    fn add(&mut self, cycles: u64) {
+        self.count += 1;
+        self.cycles += cycles;
+    }
+}
+
+/// An exit in the trace ring.
+#[derive(Clone, Copy, Default, Debug)]
+pub struct ExitTrace {
+    /// Basic exit reason.
+    pub reason: u16,
+    /// Guest rip of the exit.
+    pub rip: u64,
+    /// TSC cycles spent to handle the exit.
+    pub cycles: u64,
+}
+
+struct Inner {
+    reasons: [ExitCount; NR_EXIT_REASONS],
+    names: [&'static str; NR_EXIT_REASONS],
+    /// (reason, MSR, port, or guest page) of each detail slot.
+    keys: [(u16, u64); NR_DETAILS],
+    details: [ExitCount; NR_DETAILS],
+    /// Exits of the details that did not fit in the slots.
+    overflow: ExitCount,
+    trace: Vec<ExitTrace>,
+    /// Number of the exits ever traced.
+    traced: usize,
+}
+
+/// Vmexit profile of a vcpu.
+pub struct ExitProfile {
+    inner: SpinLock<Inner>,
+}
+
+impl Default for ExitProfile {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl ExitProfile {
+    /// Create an empty profile.
+    pub fn new() -> Self {
+        Self {
+            inner: SpinLock::new(Inner {
+                reasons: [ExitCount::default(); NR_EXIT_REASONS],
+                names: [""; NR_EXIT_REASONS],
+                keys: [(0, 0); NR_DETAILS],
+                details: [ExitCount::default(); NR_DETAILS],
+                overflow: ExitCount::default(),
+                trace: vec![ExitTrace::default(); TRACE_LEN],
+                traced: 0,
+            }),
+        }
+    }
+
+    /// Start to handle the exit of `reason` at the guest `rip`.
+    ///
+    /// The exit is charged when the returned [`Span`] is dropped.
+    pub(crate) fn enter(
+        &self,
+        generic_state: &GenericVCpuState,
+        reason: &BasicExitReason,
+        rip: u64,
+    ) -> Span<'_> {
+        let start = unsafe { _rdtsc() };
+        let vmcs = &generic_state.vmcs;
+        let number = vmcs.read(Field::VmexitReason).unwrap_or(0) as usize & 0xffff;
+        let key = match reason {
+            BasicExitReason::Rdmsr | BasicExitReason::Wrmsr => {
+                Some(generic_state.gprs.rcx as u64 & 0xffff_ffff)
+            }
+            BasicExitReason::IoInstruction => vmcs
+                .read(Field::VmexitQualification)
+                .ok()
+                .map(|q| (q >> 16) & 0xffff),
+            BasicExitReason::EptViolation {
+                fault_addr: Some(gpa),
+                ..
+            } => Some(gpa.into_usize() as u64 & !0xfff),
+            _ => None,
+        };
+        Span {
+            profile: self,
+            reason: number.min(NR_EXIT_REASONS - 1),
+            name: reason.name(),
+            key,
+            rip,
+            start,
+        }
+    }
+
+    fn record(&self, span: &Span, cycles: u64) {
+        let mut guard = self.inner.lock();
+        let inner = &mut *guard;
+        inner.reasons[span.reason].add(cycles);
+        inner.names[span.reason] = span.name;
+        if let Some(key) = span.key {
+            let key = (span.reason as u16, key);
+            match inner
+                .keys
+                .iter()
+                .zip(inner.details.iter())
+                .position(|(k, d)| *k == key || d.count == 0)
+            {
+                Some(slot) => {
+                    inner.keys[slot] = key;
+                    inner.details[slot].add(cycles);
+                }
+                None => inner.overflow.add(cycles),
+            }
+        }
+        if TRACING.load(Ordering::Relaxed) {
+            inner.trace[inner.traced % TRACE_LEN] = ExitTrace {
+                reason: span.reason as u16,
+                rip: span.rip,
+                cycles,
+            };
+            inner.traced += 1;
+        }
+        guard.unlock();
+    }
+
+    /// Get the exits of the basic exit `reason`.
+    pub fn reason(&self, reason: usize) -> ExitCount {
+        let guard = self.inner.lock();
+        let count = guard.reasons[reason.min(NR_EXIT_REASONS - 1)];
+        guard.unlock();
+        count
+    }
+
+    /// Clear the profile.
+    pub fn reset(&self) {
+        let mut guard = self.inner.lock();
+        guard.reasons = [ExitCount::default(); NR_EXIT_REASONS];
+        guard.details = [ExitCount::default(); NR_DETAILS];
+        guard.overflow = ExitCount::default();
+        guard.traced = 0;
+        guard.unlock();
+    }
+
+    /// Print the profile, with the exit reasons of the most cycles first.
+    pub fn dump(&self, vcpu_id: usize) {
+        let guard = self.inner.lock();
+        let (reasons, names, keys, details, overflow) = (
+            guard.reasons,
+            guard.names,
+            guard.keys,
+            guard.details,
+            guard.overflow,
+        );
+        let trace: Vec<ExitTrace> = (guard.traced.saturating_sub(TRACE_LEN)..guard.traced)
+            .map(|i| guard.trace[i % TRACE_LEN])
+            .collect();
+        guard.unlock();
+
+        let total: ExitCount = reasons
+            .iter()
+            .fold(ExitCount::default(), |acc, c| ExitCount {
+                count: acc.count + c.count,
+                cycles: acc.cycles + c.cycles,
+            });
+        println!(
+            "[VMEXIT] vcpu#{vcpu_id}: {} exits, {} cycles.",
+            total.count, total.cycles
+        );
+        let mut order: [usize; NR_EXIT_REASONS] = core::array::from_fn(|i| i);
+        order.sort_unstable_by_key(|i| core::cmp::Reverse(reasons[*i].cycles));
+        for i in order.into_iter().filter(|i| reasons[*i].count != 0) {
+            let ExitCount { count, cycles } = reasons[i];
+            println!(
+                "  {}(#{i:x}): {count} exits, {cycles} cycles, {} cycles/exit",
+                names[i],
+                cycles / count
+            );
+            for (key, detail) in keys.iter().zip(details.iter()) {
+                if key.0 as usize == i && detail.count != 0 {
+                    println!(
+                        "    0x{:x}: {} exits, {} cycles",
+                        key.1, detail.count, detail.cycles
+                    );
+                }
+            }
+        }
+        if overflow.count != 0 {
+            println!(
+                "  untracked MSRs, ports and pages: {} exits, {} cycles",
+                overflow.count, overflow.cycles
+            );
+        }
+        for ExitTrace {
+            reason,
+            rip,
+            cycles,
+        } in trace
+        {
+            println!(
+                "  {}(#{reason:x}) at rip 0x{rip:x}: {cycles} cycles",
+                names[reason as usize]
+            );
+        }
+    }
+}
+
+/// An exit in handling.
+pub(crate) struct Span<'a> {
+    profile: &'a ExitProfile,
+    reason: usize,
+    name: &'static str,
+    key: Option<u64>,
+    rip: u64,
+    start: u64,
+}
+
+impl Drop for Span<'_> {
+    fn drop(&mut self) {
+        let cycles = unsafe { _rdtsc() }.saturating_sub(self.start);
+        self.profile.record(self, cycles);
+    }
+}
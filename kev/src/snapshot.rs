@@ -0,0 +1,326 @@
+//! Snapshots of the vcpus, and the EPT dirty tracking.
+//!
+//! A snapshot of a vm is the memory of the guest and a [`VCpuSnapshot`] of
+//! each vcpu. The memory is saved by the pager of the vm, which owns the
+//! extended page table; KeV provides the rest:
+//! - [`eptp`] builds the EPT pointer of a table, and [`for_each_ept_page`]
+//!   and [`harvest_dirty`] walk the table from its root. They follow the
+//!   layout of the EPT defined by the processor, so they work on any table
+//!   that the VMCS points to.
+//! - [`VmHandle::pause`] kicks all started vcpus out of the guest, and
+//!   [`VmHandle::resume`] lets them run again.
+//! - [`VmHandle::save_vcpus`] saves the registers, the guest-state area of
+//!   the VMCS, the pending interrupts and the virtual-APIC page of each vcpu
+//!   of a paused vm. [`VmHandle::restore_vcpus`] loads them into a new vm, and
+//!   starts the vcpus that were started.
+//! - With [`EPTP_ACCESSED_DIRTY`] in the EPT pointer, the processor sets the
+//!   dirty flag of an EPT entry on a write of the guest. The pager clears the
+//!   flags of the pages it saves, and then calls [`VmHandle::flush_ept`]: the
+//!   translations cached before the clear would not set the flags again, so
+//!   each vcpu invalidates them with [`invept`] on its next VM entry on each
+//!   cpu.
+//!
+//! [`VmHandle::pause`]: crate::vm::VmHandle::pause
+//! [`VmHandle::resume`]: crate::vm::VmHandle::resume
+//! [`VmHandle::save_vcpus`]: crate::vm::VmHandle::save_vcpus
+//! [`VmHandle::restore_vcpus`]: crate::vm::VmHandle::restore_vcpus
+//! [`VmHandle::flush_ept`]: crate::vm::VmHandle::flush_ept
+use crate::{
+    VmError,
+    vcpu::GeneralPurposeRegisters,
+    vm::Gpa,
+    vm_control::IA32_VMX_EPT_VPID_CAP,
+    vmcs::{Field, Vmcs},
+};
+use abyss::x86_64::msr::Msr;
+use alloc::{vec, vec::Vec};
+use core::{
+    arch::asm,
+    sync::atomic::{AtomicU64, Ordering},
+};
+use keos::addressing::Pa;
+
+/// Bit 6 of the EPT pointer, which enables the accessed and dirty flags.
+pub const EPTP_ACCESSED_DIRTY: u64 = 1 << 6;
+
+/// The read, write and execute permissions of an EPT entry. An entry without
+/// any of them is not present.
+const EPT_PRESENT: u64 = 0b111;
+/// The write permission of an EPT entry.
+pub const EPT_WRITE: u64 = 1 << 1;
+/// Bit 7 of an EPT PDPT or PD entry, set if the entry maps a 1-GByte or a
+/// 2-MByte page.
+const EPT_PAGE_SIZE: u64 = 1 << 7;
+/// Bit 9 of an EPT entry that maps a page, set on a write of the guest.
+const EPT_DIRTY: u64 = 1 << 9;
+/// Bits 51:12 of an EPT entry, the physical address that it references.
+const EPT_ADDR_MASK: u64 = 0x000f_ffff_ffff_f000;
+
+/// Returns true if the processor supports the accessed and dirty flags of
+/// the EPT.
+pub fn accessed_dirty_supported() -> bool {
+    Msr::<IA32_VMX_EPT_VPID_CAP>::read() & (1 << 21) != 0
+}
+
+/// Build the EPT pointer of the 4-level EPT at `root`, of the write-back
+/// memory, with [`EPTP_ACCESSED_DIRTY`] if the processor supports it.
+pub fn eptp(root: Pa) -> u64 {
+    let ad = if accessed_dirty_supported() {
+        EPTP_ACCESSED_DIRTY
+    } else {
+        0
+    };
+    root.into_usize() as u64 | (3 << 3) | 6 | ad
+}
+
+/// Visit the entries of the EPT table at `table` of `level` that map a page,
+/// with the guest physical address and the size of the page.
+///
+/// # Safety
+/// `table` must be an EPT table of `level`, which is not freed meanwhile.
+unsafe fn for_each_leaf(
+    table: Pa,
+    level: usize,
+    base: usize,
+    f: &mut impl FnMut(Gpa, &AtomicU64, usize),
+) {
+    let entries = unsafe {
+        core::slice::from_raw_parts(table.into_kva().into_usize() as *const AtomicU64, 512)
+    };
+    let shift = 12 + 9 * (level - 1);
+    for (i, entry) in entries.iter().enumerate() {
+        let value = entry.load(Ordering::Relaxed);
+        if value & EPT_PRESENT == 0 {
+            continue;
+        }
+        let gpa = base | (i << shift);
+        if level == 1 || (level < 4 && value & EPT_PAGE_SIZE != 0) {
+            f(Gpa::new(gpa).unwrap(), entry, 1 << shift);
+        } else {
+            let next = Pa::new((value & EPT_ADDR_MASK) as usize).unwrap();
+            unsafe { for_each_leaf(next, level - 1, gpa, f) };
+        }
+    }
+}
+
+/// Get the host physical address of the page of `size` bytes mapped by an
+/// EPT entry of `value`.
+fn leaf_hpa(value: u64, size: usize) -> usize {
+    (value & EPT_ADDR_MASK) as usize & !(size - 1)
+}
+
+/// Call `f` with the guest physical address, the host physical address and
+/// the entry of every 4-KByte page mapped by the 4-level EPT at `root`,
+/// including the pages inside of the large pages.
+///
+/// # Safety
+/// `root` must be the root of a 4-level EPT, which is not changed meanwhile,
+/// e.g., with the lock of its pager held.
+pub unsafe fn for_each_ept_page(root: Pa, mut f: impl FnMut(Gpa, Pa, u64)) {
+    let mut visit = |gpa: Gpa, entry: &AtomicU64, size: usize| {
+        let value = entry.load(Ordering::Relaxed);
+        let hpa = leaf_hpa(value, size);
+        for ofs in (0..size).step_by(0x1000) {
+            f(gpa + ofs, Pa::new(hpa + ofs).unwrap(), value);
+        }
+    };
+    unsafe { for_each_leaf(root, 4, 0, &mut visit) }
+}
+
+/// Call `f` with the guest and the host physical address of every page
+/// written since the last harvest in the 4-level EPT at `root`, and clear
+/// their dirty flags.
+///
+/// A large page is reported as all of its 4-KByte pages. The processor keeps
+/// setting the flags meanwhile, so the guest may run; the cached translations
+/// must be invalidated afterward (see [`VmHandle::flush_ept`]), or the later
+/// writes through them are missed.
+///
+/// # Safety
+/// Same as [`for_each_ept_page`].
+///
+/// [`VmHandle::flush_ept`]: crate::vm::VmHandle::flush_ept
+pub unsafe fn harvest_dirty(root: Pa, mut f: impl FnMut(Gpa, Pa)) {
+    let mut visit = |gpa: Gpa, entry: &AtomicU64, size: usize| {
+        let old = entry.fetch_and(!EPT_DIRTY, Ordering::SeqCst);
+        if old & EPT_DIRTY != 0 {
+            let hpa = leaf_hpa(old, size);
+            for ofs in (0..size).step_by(0x1000) {
+                f(gpa + ofs, Pa::new(hpa + ofs).unwrap());
+            }
+        }
+    };
+    unsafe { for_each_leaf(root, 4, 0, &mut visit) }
+}
+
+/// Invalidate the translations of the EPT pointer `eptp` cached on this cpu.
+pub fn invept(eptp: u64) -> Result<(), VmError> {
+    let cap = Msr::<IA32_VMX_EPT_VPID_CAP>::read();
+    // Single-context if supported, all-context otherwise.
+    let ty: u64 = if cap & (1 << 25) != 0 { 1 } else { 2 };
+    let desc: [u64; 2] = [eptp, 0];
+    let err: i8;
+    unsafe {
+        asm!(
+            "clc",
+            "invept {}, [{}]",
+            "setna {}",
+            in(reg) ty,
+            in(reg) &desc,
+            out(reg_byte) err
+        );
+    }
+    if err != 0 {
+        Err(VmError::VmxOperationError(Vmcs::instruction_error()))
+    } else {
+        Ok(())
+    }
+}
+
+/// The fields of the guest-state area saved in a [`VCpuSnapshot`].
+pub const GUEST_STATE_FIELDS: [Field; 60] = [
+    Field::GuestEsSelector,
+    Field::GuestCsSelector,
+    Field::GuestSsSelector,
+    Field::GuestDsSelector,
+    Field::GuestFsSelector,
+    Field::GuestGsSelector,
+    Field::GuestLdtrSelector,
+    Field::GuestTrSelector,
+    Field::GuestInterruptStatus,
+    Field::GuestLinkPointer,
+    Field::GuestIa32Debugctl,
+    Field::GuestIa32Pat,
+    Field::GuestIa32Efer,
+    Field::GuestIa32Pdpte0,
+    Field::GuestIa32Pdpte1,
+    Field::GuestIa32Pdpte2,
+    Field::GuestIa32Pdpte3,
+    Field::GuestEsLimit,
+    Field::GuestCsLimit,
+    Field::GuestSsLimit,
+    Field::GuestDsLimit,
+    Field::GuestFsLimit,
+    Field::GuestGsLimit,
+    Field::GuestLdtrLimit,
+    Field::GuestTrLimit,
+    Field::GuestGdtrLimit,
+    Field::GuestIdtrLimit,
+    Field::GuestEsAccessRights,
+    Field::GuestCsAccessRights,
+    Field::GuestSsAccessRights,
+    Field::GuestDsAccessRights,
+    Field::GuestFsAccessRights,
+    Field::GuestGsAccessRights,
+    Field::GuestLdtrAccessRights,
+    Field::GuestTrAccessRights,
+    Field::GuestInterruptibilityState,
+    Field::GuestActivityState,
+    Field::GuestIa32SysenterCsMsr,
+    Field::Cr0ReadShadow,
+    Field::Cr4ReadShadow,
+    Field::GuestCr0,
+    Field::GuestCr3,
+    Field::GuestCr4,
+    Field::GuestEsBase,
+    Field::GuestCsBase,
+    Field::GuestSsBase,
+    Field::GuestDsBase,
+    Field::GuestFsBase,
+    Field::GuestGsBase,
+    Field::GuestLdtrBase,
+    Field::GuestTrBase,
+    Field::GuestGdtrBase,
+    Field::GuestIdtrBase,
+    Field::GuestDr7,
+    Field::GuestRsp,
+    Field::GuestRip,
+    Field::GuestRflags,
+    Field::GuestPendingDbgExceptions,
+    Field::GuestIa32SysenterEspMsr,
+    Field::GuestIa32SysenterEipMsr,
+];
+
+/// Size of an encoded [`VCpuSnapshot`].
+pub const VCPU_SNAPSHOT_SIZE: usize = 0x2000;
+
+const VCPU_MAGIC: u64 = u64::from_le_bytes(*b"KeVvcpu\0");
+const NR_GPRS: usize = core::mem::size_of::<GeneralPurposeRegisters>() / 8;
+/// Offset of the virtual-APIC page in an encoded [`VCpuSnapshot`].
+const APIC_OFFSET: usize = 0x1000;
+
+/// The state of a vcpu.
+#[derive(Clone)]
+pub struct VCpuSnapshot {
+    /// Whether the vcpu was started.
+    pub started: bool,
+    /// General purpose registers.
+    pub gprs: GeneralPurposeRegisters,
+    /// Values of the [`GUEST_STATE_FIELDS`], or `None` if the processor does
+    /// not support the field.
+    pub fields: [Option<u64>; GUEST_STATE_FIELDS.len()],
+    /// Pending interrupts.
+    pub pending: [u64; 4],
+    /// Content of the virtual-APIC page.
+    pub apic: Vec<u8>,
+}
+
+impl VCpuSnapshot {
+    pub(crate) fn new() -> Self {
+        Self {
+            started: false,
+            gprs: GeneralPurposeRegisters::default(),
+            fields: [None; GUEST_STATE_FIELDS.len()],
+            pending: [0; 4],
+            apic: vec![0; 0x1000],
+        }
+    }
+
+    /// Encode the snapshot into the first [`VCPU_SNAPSHOT_SIZE`] bytes of
+    /// `buf`.
+    pub fn encode(&self, buf: &mut [u8]) {
+        let buf = &mut buf[..VCPU_SNAPSHOT_SIZE];
+        buf.fill(0);
+        let valid = self
+            .fields
+            .iter()
+            .enumerate()
+            .fold(0u64, |acc, (i, v)| acc | ((v.is_some() as u64) << i));
+        let gprs: [u64; NR_GPRS] = unsafe { core::mem::transmute(self.gprs) };
+        let words = [VCPU_MAGIC, self.started as u64, valid]
+            .into_iter()
+            .chain(self.pending)
+            .chain(gprs)
+            .chain(self.fields.iter().map(|v| v.unwrap_or(0)));
+        for (chunk, word) in buf.chunks_exact_mut(8).zip(words) {
+            chunk.copy_from_slice(&word.to_le_bytes());
+        }
+        buf[APIC_OFFSET..].copy_from_slice(&self.apic);
+    }
+
+    /// Decode a snapshot encoded with [`VCpuSnapshot::encode`].
+    pub fn decode(buf: &[u8]) -> Option<Self> {
+        let buf = buf.get(..VCPU_SNAPSHOT_SIZE)?;
+        let mut words = buf
+            .chunks_exact(8)
+            .map(|chunk| u64::from_le_bytes(chunk.try_into().unwrap()));
+        if words.next()? != VCPU_MAGIC {
+            return None;
+        }
+        let started = words.next()? != 0;
+        let valid = words.next()?;
+        let pending = core::array::from_fn(|_| words.next().unwrap());
+        let gprs: [u64; NR_GPRS] = core::array::from_fn(|_| words.next().unwrap());
+        let fields = core::array::from_fn(|i| {
+            let v = words.next().unwrap();
+            (valid & (1 << i) != 0).then_some(v)
+        });
+        Some(Self {
+            started,
+            gprs: unsafe { core::mem::transmute::<[u64; NR_GPRS], GeneralPurposeRegisters>(gprs) },
+            fields,
+            pending,
+            apic: buf[APIC_OFFSET..].to_vec(),
+        })
+    }
+}
@@ -1,12 +1,16 @@
 //! Virtual CPU implementation.
 use crate::{
     VmError,
+    apicv::{APICV_PINBASE_CTLS, APICV_PROCBASE_CTLS, APICV_PROCBASE_CTLS2, VirtualApic},
+    msr_bitmap::MsrBitmap,
+    profile::ExitProfile,
+    snapshot::{GUEST_STATE_FIELDS, VCpuSnapshot, invept},
     vm::{Vm, VmOps, VmState},
     vm_control::*,
     vmcs::{ActiveVmcs, BasicExitReason, ExternalIntInfo, Field, Vmcs},
 };
 pub use abyss::{interrupt::GeneralPurposeRegisters, x86_64::*};
-use alloc::sync::Weak;
+use alloc::sync::{Arc, Weak};
 use core::{
     arch::naked_asm,
     sync::atomic::{AtomicBool, AtomicU64, Ordering},
@@ -124,6 +128,13 @@ where
     fn exit_ctls(&self) -> VmcsExitCtl;
     /// Get enabled entry control fields.
     fn entry_ctls(&self) -> VmcsEntryCtl;
+    /// Get the MSR bitmap of this vcpu.
+    ///
+    /// The MSRs that are passed through in the bitmap do not exit, if the
+    /// processor supports the MSR bitmaps. By default, all MSRs exit.
+    fn msr_bitmap(&mut self) -> Option<&mut MsrBitmap> {
+        None
+    }
     /// Initialize the guest state.
     fn init_guest_state(&self, vmcs: &ActiveVmcs) -> Result<(), VmError>;
     /// Handle the vmexit on this vcpu.
@@ -145,6 +156,10 @@ pub struct GenericVCpuState<'a> {
     id: usize,
     // Pending interrupts.
     pending_interrupts: &'a [AtomicU64; 4],
+    // Virtual APIC of this vcpu.
+    vapic: &'a VirtualApic,
+    // Vmexit profile of this vcpu.
+    profile: &'a ExitProfile,
 }
 
 impl<'a> GenericVCpuState<'a> {
@@ -179,10 +194,26 @@ pub struct VCpu<S: VmState + 'static> {
     vm: Weak<Vm<S>>,
     /// pending interrupt bitmask
     pending_interrupts: [AtomicU64; 4],
+    /// Virtual APIC of this vcpu, shared with the vm.
+    vapic: Arc<VirtualApic>,
+    /// Whether the APIC virtualization is enabled on this vcpu.
+    apicv: bool,
+    /// Vmexit profile of this vcpu, shared with the vm.
+    profile: Arc<ExitProfile>,
+    /// Cpus that may cache the EPT translations of this vcpu from before the
+    /// dirty flags are cleared, shared with the vm.
+    stale_ept: Arc<AtomicU64>,
 }
 
 impl<S: VmState + 'static> VCpu<S> {
-    pub(crate) fn new(vcpu_id: usize, state: S::VcpuState, vm: Weak<Vm<S>>) -> Self {
+    pub(crate) fn new(
+        vcpu_id: usize,
+        state: S::VcpuState,
+        vm: Weak<Vm<S>>,
+        vapic: Arc<VirtualApic>,
+        profile: Arc<ExitProfile>,
+        stale_ept: Arc<AtomicU64>,
+    ) -> Self {
         Self {
             vmcs: Vmcs::new(),
             gprs: GeneralPurposeRegisters::default(),
@@ -196,7 +227,58 @@ impl<S: VmState + 'static> VCpu<S> {
                 AtomicU64::new(0),
                 AtomicU64::new(0),
             ],
+            vapic,
+            apicv: false,
+            profile,
+            stale_ept,
+        }
+    }
+
+    /// Returns true if an interrupt is pending on this vcpu.
+    pub(crate) fn has_pending_interrupt(&self) -> bool {
+        self.vapic.desc().is_pending()
+            || self
+                .pending_interrupts
+                .iter()
+                .any(|bits| bits.load(Ordering::SeqCst) != 0)
+    }
+
+    /// Save the state of this vcpu, which must not be running.
+    pub(crate) fn save(&mut self, started: bool) -> Result<VCpuSnapshot, VmError> {
+        let mut snapshot = VCpuSnapshot::new();
+        snapshot.started = started;
+        // Take the posted interrupts, as the vcpu does on the next VM entry.
+        let posted = self.vapic.desc().take();
+        for (i, bits) in self.pending_interrupts.iter().enumerate() {
+            snapshot.pending[i] = bits.fetch_or(posted[i], Ordering::SeqCst) | posted[i];
+        }
+        self.vapic.save(&mut snapshot.apic);
+        let activated = self.unpack_activate()?;
+        let vmcs = &activated.generic_state.vmcs;
+        for (value, field) in snapshot.fields.iter_mut().zip(GUEST_STATE_FIELDS) {
+            *value = vmcs.read(field).ok();
+        }
+        snapshot.gprs = *activated.generic_state.gprs;
+        Ok(snapshot)
+    }
+
+    /// Load the state of this vcpu from the `snapshot`.
+    ///
+    /// The vcpu must be initialized and not started.
+    pub(crate) fn restore(&mut self, snapshot: &VCpuSnapshot) -> Result<(), VmError> {
+        for (bits, pending) in self.pending_interrupts.iter().zip(snapshot.pending) {
+            bits.store(pending, Ordering::SeqCst);
         }
+        self.vapic.restore(&snapshot.apic);
+        let activated = self.unpack_activate()?;
+        let vmcs = &activated.generic_state.vmcs;
+        for (value, field) in snapshot.fields.iter().zip(GUEST_STATE_FIELDS) {
+            if let Some(value) = value {
+                vmcs.write(field, *value)?;
+            }
+        }
+        *activated.generic_state.gprs = snapshot.gprs;
+        Ok(())
     }
 
     pub(crate) fn unpack_activate(&mut self) -> Result<Activated<'_, S>, VmError> {
@@ -208,6 +290,10 @@ impl<S: VmState + 'static> VCpu<S> {
             launched,
             vm,
             pending_interrupts,
+            vapic,
+            apicv,
+            profile,
+            stale_ept,
         } = self;
         Ok(Activated {
             generic_state: GenericVCpuState {
@@ -216,10 +302,14 @@ impl<S: VmState + 'static> VCpu<S> {
                 id: *vcpu_id,
                 vm: vm.clone(),
                 pending_interrupts,
+                vapic,
+                profile,
             },
             vcpu_state: state,
             launched,
             vmcs,
+            apicv,
+            stale_ept,
         })
     }
 }
@@ -247,14 +337,17 @@ pub(crate) struct Activated<'a, S: VmState + 'static> {
     pub(crate) vcpu_state: &'a mut S::VcpuState,
     vmcs: &'a mut Vmcs,
     launched: &'a mut bool,
+    apicv: &'a mut bool,
+    stale_ept: &'a AtomicU64,
 }
 
 impl<'a, S: VmState + 'static> Activated<'a, S> {
     pub(crate) unsafe fn init_vcpu(&mut self, exception_bitmap: u32) -> Result<(), VmError> {
         unsafe {
             let Self {
-                generic_state: GenericVCpuState { vmcs, .. },
+                generic_state: GenericVCpuState { vmcs, vapic, .. },
                 vcpu_state,
+                apicv,
                 ..
             } = self;
             // 26.2.1.1 VM-Execution Control Fields
@@ -345,6 +438,76 @@ impl<'a, S: VmState + 'static> Activated<'a, S> {
                     enabled |= vcpu_state.entry_ctls();
                     vmcs.write(Field::VmentryControls, (supported & enabled).bits() as u64)?;
                 }
+                // 29 APIC VIRTUALIZATION AND VIRTUAL INTERRUPTS
+                //
+                // The controls depend on each other, e.g., the virtual-interrupt delivery
+                // requires the external-interrupt exiting, and the posted interrupts require
+                // the virtual-interrupt delivery and acknowledging the interrupts on exit.
+                // Enable them all, or none of them.
+                {
+                    let (pinbase, procbase, procbase2, exit) = (
+                        VmcsPinBasedVmexecCtl::from_bits_unchecked(
+                            vmcs.read(Field::PinBasedExecControls)? as u32,
+                        ),
+                        VmcsProcBasedVmexecCtl::from_bits_unchecked(
+                            vmcs.read(Field::ProcessorBasedVmexecControls)? as u32,
+                        ),
+                        VmcsProcBasedSecondaryVmexecCtl::from_bits_unchecked(
+                            vmcs.read(Field::SecondaryVmexecControls)? as u32,
+                        ),
+                        VmcsExitCtl::from_bits_unchecked(vmcs.read(Field::VmexitControls)? as u32),
+                    );
+                    let usemsrbmp = VmcsProcBasedVmexecCtl::from_bits_unchecked(
+                        (Msr::<IA32_VMX_PROC_BASED_CTLS>::read() >> 32) as u32,
+                    ) & VmcsProcBasedVmexecCtl::USEMSRBMP;
+                    **apicv = pinbase.contains(APICV_PINBASE_CTLS)
+                        && procbase.contains(APICV_PROCBASE_CTLS)
+                        && procbase2.contains(APICV_PROCBASE_CTLS2)
+                        && exit.contains(VmcsExitCtl::ACK_INTR_ON_EXIT)
+                        && !usemsrbmp.is_empty();
+                    if **apicv {
+                        vapic.install(vmcs)?;
+                    } else {
+                        vmcs.write(
+                            Field::PinBasedExecControls,
+                            (pinbase & !VmcsPinBasedVmexecCtl::PROCESS_POSTED_INTERRUPT).bits()
+                                as u64,
+                        )?;
+                        vmcs.write(
+                            Field::ProcessorBasedVmexecControls,
+                            (procbase & !APICV_PROCBASE_CTLS).bits() as u64,
+                        )?;
+                        vmcs.write(
+                            Field::SecondaryVmexecControls,
+                            (procbase2 & !APICV_PROCBASE_CTLS2).bits() as u64,
+                        )?;
+                    }
+
+                    // 25.6.9 MSR-Bitmap Address
+                    //
+                    // The virtualized x2APIC is accessed through the MSR bitmap. A vcpu
+                    // without a bitmap of its own gets the one of its virtual APIC.
+                    let bitmap = match vcpu_state.msr_bitmap() {
+                        Some(bitmap) => {
+                            if **apicv {
+                                bitmap.virtualize_x2apic();
+                            }
+                            Some(&*bitmap)
+                        }
+                        None if **apicv => Some(vapic.msr_bitmap()),
+                        None => None,
+                    };
+                    if let Some(bitmap) = bitmap.filter(|_| !usemsrbmp.is_empty()) {
+                        bitmap.install(vmcs)?;
+                        let procbase = VmcsProcBasedVmexecCtl::from_bits_unchecked(
+                            vmcs.read(Field::ProcessorBasedVmexecControls)? as u32,
+                        );
+                        vmcs.write(
+                            Field::ProcessorBasedVmexecControls,
+                            (procbase | usemsrbmp).bits() as u64,
+                        )?;
+                    }
+                }
                 vmcs.write(Field::ExceptionBitmap, exception_bitmap as u64)?;
             }
             // 26.2.2 Checks on Host Control Registers, MSRs, and SSP
@@ -426,6 +589,8 @@ impl<'a, S: VmState + 'static> Activated<'a, S> {
             generic_state,
             vcpu_state,
             launched,
+            apicv,
+            stale_ept,
             ..
         } = self;
         unsafe {
@@ -467,6 +632,21 @@ impl<'a, S: VmState + 'static> Activated<'a, S> {
                 // indicating the cause of the failure is stored in the
                 // VM-instruction error field. See Chapter 30 for the error numbers.
 
+                // Take the posted interrupts. With the APIC virtualization, the processor
+                // delivers them from the virtual-APIC page on its own. Otherwise, they are
+                // injected as the other pending interrupts.
+                let posted = generic_state.vapic.desc().take();
+                if **apicv {
+                    let pending = core::array::from_fn(|i| {
+                        posted[i] | generic_state.pending_interrupts[i].swap(0, Ordering::SeqCst)
+                    });
+                    generic_state.vapic.request(&generic_state.vmcs, pending)?;
+                } else {
+                    for (intr_bitmap, bits) in generic_state.pending_interrupts.iter().zip(posted) {
+                        intr_bitmap.fetch_or(bits, Ordering::SeqCst);
+                    }
+                }
+
                 // Inject pending interrupt if exists.
                 for (index, intr_bitmap) in generic_state.pending_interrupts.iter().enumerate() {
                     let v = intr_bitmap.load(Ordering::SeqCst);
@@ -507,11 +687,29 @@ impl<'a, S: VmState + 'static> Activated<'a, S> {
                     }
                 }
 
+                // The vcpu may have moved to another cpu.
+                if let Some(bitmap) = vcpu_state.msr_bitmap() {
+                    bitmap.refresh_host();
+                }
+                // Drop the EPT translations that this cpu cached before the dirty flags
+                // were cleared.
+                let cpu = 1u64 << intrinsics::cpuid();
+                if stale_ept.load(Ordering::SeqCst) & cpu != 0 {
+                    stale_ept.fetch_and(!cpu, Ordering::SeqCst);
+                    invept(generic_state.vmcs.read(Field::Eptptr)?)?;
+                }
+
                 // Check whether this vcpu is kicked.
                 if have_kicked.load(Ordering::SeqCst) {
                     return Ok(VmexitResult::Kicked);
                 }
 
+                // The pcids are recycled, so the tag of the host page table may have
+                // changed since the last entry. The vm exit loads the cr3 that this cpu
+                // runs right now.
+                generic_state
+                    .vmcs
+                    .write(Field::HostCr3, read_cr3() as u64)?;
                 generic_state.vmcs.write(
                     Field::HostGsBase,
                     &mut kernel_gs::KERNEL_GS_BASES[intrinsics::cpuid()] as *mut kernel_gs::KernelGS
@@ -544,14 +742,36 @@ impl<'a, S: VmState + 'static> Activated<'a, S> {
                 match result {
                     0 => {
                         let rip = generic_state.vmcs.read(Field::GuestRip)?;
-                        if let Err(err) = match generic_state.vmcs.exit_reason()?.get_basic_reason()
-                        {
+                        let exit_reason = generic_state.vmcs.exit_reason()?;
+                        // Charge the exit when it is handled.
+                        let profile = generic_state.profile;
+                        let _span =
+                            profile.enter(generic_state, exit_reason.get_basic_reason(), rip);
+                        if let Err(err) = match exit_reason.get_basic_reason() {
                             BasicExitReason::ExternalInt(Some(ExternalIntInfo {
                                 host_int,
                                 ..
                             })) => {
                                 return Ok(VmexitResult::ExtInt(*host_int));
                             }
+                            // Skip the hlt, and let the vcpu thread wait for an interrupt
+                            // unless one is already pending.
+                            BasicExitReason::Hlt => {
+                                generic_state.vmcs.forward_rip()?;
+                                let requested = **apicv
+                                    && generic_state.vmcs.read(Field::GuestInterruptStatus)? & 0xff
+                                        != 0;
+                                if !requested
+                                    && !generic_state.vapic.desc().is_pending()
+                                    && generic_state
+                                        .pending_interrupts
+                                        .iter()
+                                        .all(|bits| bits.load(Ordering::SeqCst) == 0)
+                                {
+                                    return Ok(VmexitResult::Halted);
+                                }
+                                Ok(())
+                            }
                             BasicExitReason::InterruptWindow => {
                                 let proc_based_ctls = VmcsProcBasedVmexecCtl::from_bits_unchecked(
                                     generic_state
@@ -610,4 +830,8 @@ pub enum VmexitResult {
     ///
     /// This is for internal-control uses.
     Kicked,
+    /// VCpu is halted until an interrupt comes.
+    ///
+    /// This is for internal-control uses.
+    Halted,
 }
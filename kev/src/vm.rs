@@ -1,12 +1,18 @@
 //! Virtual machine interface.
 use crate::{
     VmError,
+    apicv::{POSTED_INTR_VECTOR, VirtualApic},
+    profile::ExitProfile,
+    snapshot::VCpuSnapshot,
     vcpu::{GenericVCpuState, VCpu, VCpuOps, VCpuState},
     vmcs::Field,
 };
 use abyss::dev::x86_64::apic::{IPIDest, Mode, send_ipi};
 use alloc::{boxed::Box, sync::Arc, vec::Vec};
-use core::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use core::{
+    arch::x86_64::_rdtsc,
+    sync::atomic::{AtomicBool, AtomicU64, Ordering},
+};
 use keos::{
     sync::SpinLock,
     syscall::Registers,
@@ -183,6 +189,85 @@ pub enum VCpuRunningState {
         have_kicked: Arc<AtomicBool>,
     },
     Kicked(ParkHandle),
+    Idle {
+        handle: JoinHandle,
+        have_kicked: Arc<AtomicBool>,
+        park: ParkHandle,
+    },
+}
+
+impl VCpuRunningState {
+    /// Wake up the vcpu thread if it waits for an interrupt.
+    fn wake(&mut self) {
+        if matches!(self, VCpuRunningState::Idle { .. }) {
+            if let VCpuRunningState::Idle {
+                handle,
+                have_kicked,
+                park,
+            } = core::mem::replace(self, VCpuRunningState::Halted)
+            {
+                *self = VCpuRunningState::Running {
+                    handle,
+                    have_kicked,
+                };
+                park.unpark();
+            }
+        }
+    }
+}
+
+/// Initial polling window of a halted vcpu in TSC cycles.
+pub const HALT_POLL_START: u64 = 10_000;
+/// Maximum polling window of a halted vcpu in TSC cycles.
+pub const HALT_POLL_MAX: u64 = 500_000;
+
+/// Adaptive halt-polling of a vcpu.
+///
+/// A halted vcpu polls for an interrupt for a window before its thread
+/// parks, as parking and waking the thread costs more than a short poll. A
+/// wakeup that comes within [`HALT_POLL_MAX`] after the park would have been
+/// caught by a longer window, so the window doubles; a longer sleep halves
+/// the window, as the polling only wasted the cpu.
+#[derive(Default)]
+pub struct HaltPoll {
+    window: AtomicU64,
+    hits: AtomicU64,
+    misses: AtomicU64,
+}
+
+/// Counters of the halt-polling of a vcpu.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct HaltPollStat {
+    /// Halts that ended by an interrupt within the polling window.
+    pub hits: u64,
+    /// Halts that parked the vcpu thread.
+    pub misses: u64,
+    /// Current polling window in TSC cycles.
+    pub window: u64,
+}
+
+impl HaltPoll {
+    /// Get the counters.
+    pub fn stat(&self) -> HaltPollStat {
+        HaltPollStat {
+            hits: self.hits.load(Ordering::Relaxed),
+            misses: self.misses.load(Ordering::Relaxed),
+            window: self.window.load(Ordering::Relaxed),
+        }
+    }
+
+    /// Adjust the window after the vcpu thread slept for `slept` cycles.
+    fn adapt(&self, slept: u64) {
+        let window = self.window.load(Ordering::Relaxed);
+        let window = if slept < HALT_POLL_MAX {
+            (window * 2).clamp(HALT_POLL_START, HALT_POLL_MAX)
+        } else if window / 2 < HALT_POLL_START {
+            0
+        } else {
+            window / 2
+        };
+        self.window.store(window, Ordering::Relaxed);
+    }
 }
 
 /// The virtual machine.
@@ -191,6 +276,10 @@ pub struct Vm<S: VmState + 'static> {
     pub(crate) state: S,
     pub(crate) exit_code: AtomicU64,
     vcpu_states: Vec<Arc<SpinLock<VCpuRunningState>>>,
+    vapics: Vec<Arc<VirtualApic>>,
+    profiles: Vec<Arc<ExitProfile>>,
+    halt_polls: Vec<Arc<HaltPoll>>,
+    stale_epts: Vec<Arc<AtomicU64>>,
 }
 
 /// Handle for maintaining a VM.
@@ -209,6 +298,12 @@ impl<S: VmState + 'static> VmHandle<S> {
             vcpu_states: (0..vcpu)
                 .map(|_| Arc::new(SpinLock::new(VCpuRunningState::Halted)))
                 .collect(),
+            vapics: (0..vcpu)
+                .map(|id| Arc::new(VirtualApic::new(id as u32)))
+                .collect(),
+            profiles: (0..vcpu).map(|_| Arc::new(ExitProfile::new())).collect(),
+            halt_polls: (0..vcpu).map(|_| Arc::new(HaltPoll::default())).collect(),
+            stale_epts: (0..vcpu).map(|_| Arc::new(AtomicU64::new(0))).collect(),
         });
         let mut this = VmHandle {
             vcpu_threads: vm.vcpu_states.to_vec(),
@@ -220,6 +315,9 @@ impl<S: VmState + 'static> VmHandle<S> {
                 id,
                 this.vm.state.vcpu_state(),
                 Arc::downgrade(&this.vm),
+                this.vm.vapics[id].clone(),
+                this.vm.profiles[id].clone(),
+                this.vm.stale_epts[id].clone(),
             ))))
         }
         // SAFETY:
@@ -255,6 +353,104 @@ impl<S: VmState + 'static> VmHandle<S> {
         self.vm.vcpu.get(idx)
     }
 
+    /// Get the vmexit profile of vcpu #idx.
+    #[inline]
+    pub fn exit_profile(&self, idx: usize) -> Option<&ExitProfile> {
+        self.vm.profiles.get(idx).map(|profile| &**profile)
+    }
+
+    /// Get the halt-polling counters of vcpu #idx.
+    #[inline]
+    pub fn halt_poll(&self, idx: usize) -> Option<HaltPollStat> {
+        self.vm.halt_polls.get(idx).map(|poll| poll.stat())
+    }
+
+    /// Print the vmexit profiles of all vcpus.
+    pub fn dump_exits(&self) {
+        for (id, profile) in self.vm.profiles.iter().enumerate() {
+            profile.dump(id);
+        }
+    }
+
+    /// Kick all started vcpus out of the guest, and keep them out until
+    /// [`VmHandle::resume`].
+    ///
+    /// Returns the ids of the paused vcpus.
+    pub fn pause(&self) -> Result<Vec<usize>, VmError> {
+        let mut paused = Vec::new();
+        for (id, state) in self.vm.vcpu_states.iter().enumerate() {
+            let guard = state.lock();
+            let started = matches!(
+                &*guard,
+                VCpuRunningState::Running { .. } | VCpuRunningState::Idle { .. }
+            );
+            guard.unlock();
+            if started {
+                self.vm.kick_vcpu(id)?;
+                paused.push(id);
+            }
+        }
+        Ok(paused)
+    }
+
+    /// Resume the vcpus paused by [`VmHandle::pause`].
+    pub fn resume(&self, paused: &[usize]) {
+        for id in paused {
+            self.vm.resume_vcpu(*id);
+        }
+    }
+
+    /// Save the state of all vcpus of the paused vm.
+    pub fn save_vcpus(&self) -> Result<Vec<VCpuSnapshot>, VmError> {
+        let mut snapshots = Vec::new();
+        for (vcpu, state) in self.vm.vcpu.iter().zip(self.vm.vcpu_states.iter()) {
+            let guard = state.lock();
+            let started = !matches!(&*guard, VCpuRunningState::Halted);
+            guard.unlock();
+            let mut guard = vcpu.lock();
+            let snapshot = guard.save(started);
+            guard.unlock();
+            snapshots.push(snapshot?);
+        }
+        Ok(snapshots)
+    }
+
+    /// Load the state of the vcpus from the `snapshots`, and start the vcpus
+    /// that were started.
+    ///
+    /// This replaces [`VmHandle::start_bsp`] for a vm whose memory is
+    /// restored from the same snapshot.
+    pub fn restore_vcpus(&self, snapshots: &[VCpuSnapshot]) -> Result<(), VmError> {
+        if snapshots.len() != self.vm.vcpu.len() {
+            return Err(VmError::VCpuError(Box::new(
+                "The number of the vcpus does not match.",
+            )));
+        }
+        for (vcpu, snapshot) in self.vm.vcpu.iter().zip(snapshots) {
+            let mut guard = vcpu.lock();
+            let result = guard.restore(snapshot);
+            guard.unlock();
+            result?;
+        }
+        for (id, snapshot) in snapshots.iter().enumerate() {
+            if snapshot.started {
+                self.vm.start_vcpu(id, |_| {})?;
+            }
+        }
+        Ok(())
+    }
+
+    /// Invalidate the EPT translations cached on all cpus, after the pager
+    /// cleared the dirty flags of the EPT.
+    ///
+    /// Each vcpu invalidates the translations on its next VM entry on each
+    /// cpu.
+    pub fn flush_ept(&self) {
+        for stale in self.vm.stale_epts.iter() {
+            stale.store(u64::MAX, Ordering::SeqCst);
+        }
+    }
+
     /// Join the vm.
     pub fn join(&self) -> i32 {
         loop {
@@ -300,6 +496,7 @@ impl<S: VmState + 'static> Vm<S> {
     pub fn vcpu_thread_work(
         vcpu: Arc<SpinLock<VCpu<S>>>,
         state: Arc<SpinLock<VCpuRunningState>>,
+        halt_poll: Arc<HaltPoll>,
         init: impl FnOnce(&SpinLock<VCpu<S>>),
     ) {
         use crate::vcpu::VmexitResult;
@@ -338,6 +535,11 @@ impl<S: VmState + 'static> Vm<S> {
                             continue;
                         }
                     }
+                    VmexitResult::Halted => {
+                        unsafe { abyss::interrupt::InterruptState::enable() };
+                        Self::halt(&vcpu, &state, &have_kicked, &halt_poll);
+                        continue;
+                    }
                     VmexitResult::Kicked => (),
                     VmexitResult::Ok => unreachable!(),
                 }
@@ -373,6 +575,61 @@ impl<S: VmState + 'static> Vm<S> {
         Current::exit(exit_code);
     }
 
+    /// Wait for an interrupt on a halted vcpu.
+    ///
+    /// Poll for the window of `halt_poll`, and then park the thread until an
+    /// interrupt is posted, or the vcpu is kicked.
+    fn halt(
+        vcpu: &SpinLock<VCpu<S>>,
+        state: &SpinLock<VCpuRunningState>,
+        have_kicked: &AtomicBool,
+        halt_poll: &HaltPoll,
+    ) {
+        let is_woken = || {
+            let guard = vcpu.lock();
+            let pending = guard.has_pending_interrupt();
+            guard.unlock();
+            pending || have_kicked.load(Ordering::SeqCst)
+        };
+        let start = unsafe { _rdtsc() };
+        let window = halt_poll.window.load(Ordering::Relaxed);
+        while unsafe { _rdtsc() } - start < window {
+            if is_woken() {
+                halt_poll.hits.fetch_add(1, Ordering::Relaxed);
+                return;
+            }
+            core::hint::spin_loop();
+        }
+
+        // An interrupt is posted before the waker takes the state lock, so the
+        // check under the lock does not miss a wakeup.
+        let mut guard = state.lock();
+        if is_woken() {
+            guard.unlock();
+            halt_poll.hits.fetch_add(1, Ordering::Relaxed);
+            return;
+        }
+        halt_poll.misses.fetch_add(1, Ordering::Relaxed);
+        let parked = unsafe { _rdtsc() };
+        match core::mem::replace(&mut *guard, VCpuRunningState::Halted) {
+            VCpuRunningState::Running {
+                handle,
+                have_kicked,
+            } => {
+                Current::park_with(move |park| {
+                    *guard = VCpuRunningState::Idle {
+                        handle,
+                        have_kicked,
+                        park,
+                    };
+                    guard.unlock();
+                });
+            }
+            _ => unreachable!(),
+        }
+        halt_poll.adapt(unsafe { _rdtsc() } - parked);
+    }
+
     fn start_vcpu(
         &self,
         id: usize,
@@ -386,11 +643,12 @@ impl<S: VmState + 'static> Vm<S> {
 
         let mut vcpu_slot = self.vcpu_states[id].lock();
         let slot = self.vcpu_states[id].clone();
+        let halt_poll = self.halt_polls[id].clone();
         let have_kicked = Arc::new(AtomicBool::new(false));
         let ret = if matches!(&*vcpu_slot, VCpuRunningState::Halted) {
             *vcpu_slot = VCpuRunningState::Running {
                 handle: ThreadBuilder::new(alloc::format!("vcpu#{}", id))
-                    .spawn(move || Self::vcpu_thread_work(vcpu, slot, init)),
+                    .spawn(move || Self::vcpu_thread_work(vcpu, slot, halt_poll, init)),
                 have_kicked,
             };
             Ok(())
@@ -417,14 +675,25 @@ where
     fn get_vcpu(&self, id: usize) -> Option<&dyn VCpuOps>;
     /// Resum the vcpu.
     fn resume_vcpu(&self, id: usize);
+    /// Post the interrupt `vec` to the vcpu.
+    ///
+    /// Unlike [`VCpuOps::inject_interrupt`], the vcpu needs not to be kicked:
+    /// the interrupt is delivered to a running vcpu without a vmexit if the
+    /// APIC virtualization is enabled, or on its next VM entry otherwise. A
+    /// vcpu that is halted is woken up.
+    fn post_interrupt(&self, id: usize, vec: u8) -> Result<(), VmError>;
 }
 
 impl<S: VmState + 'static> VmOps for Vm<S> {
     fn kick_vcpu(&self, id: usize) -> Result<(), VmError> {
         if let Some(vcpu) = self.vcpu_states.get(id) {
             {
-                let guard = vcpu.lock();
+                let mut guard = vcpu.lock();
                 match &*guard {
+                    VCpuRunningState::Idle { have_kicked, .. } => {
+                        have_kicked.store(true, Ordering::SeqCst);
+                        guard.wake();
+                    }
                     VCpuRunningState::Running {
                         handle,
                         have_kicked,
@@ -501,6 +770,30 @@ impl<S: VmState + 'static> VmOps for Vm<S> {
     fn get_vcpu(&self, id: usize) -> Option<&dyn VCpuOps> {
         self.vcpu.get(id).map(|cpu| &**cpu as &dyn VCpuOps)
     }
+
+    fn post_interrupt(&self, id: usize, vec: u8) -> Result<(), VmError> {
+        let vapic = self
+            .vapics
+            .get(id)
+            .ok_or_else(|| VmError::VCpuError(Box::new(alloc::format!("vcpu#{id:} not exists"))))?;
+        // Only the first post after the vcpu takes the interrupts notifies it.
+        let notify = vapic.post(vec);
+        let mut guard = self.vcpu_states[id].lock();
+        match &*guard {
+            VCpuRunningState::Running { handle, .. } if notify => {
+                if let Some(cpuid) = handle.try_get_running_cpu() {
+                    unsafe {
+                        send_ipi(IPIDest::Cpu(cpuid), Mode::Fixed(POSTED_INTR_VECTOR));
+                    }
+                }
+            }
+            // A halted vcpu is woken up regardless: it parks only when nothing is posted.
+            VCpuRunningState::Idle { .. } => guard.wake(),
+            _ => (),
+        }
+        guard.unlock();
+        Ok(())
+    }
 }
 
 impl<S: VmState> core::ops::Deref for Vm<S> {
@@ -510,6 +803,13 @@ impl<S: VmState> core::ops::Deref for Vm<S> {
     }
 }
 
+impl<S: VmState> core::ops::Deref for VmHandle<S> {
+    type Target = S;
+    fn deref(&self) -> &Self::Target {
+        &self.vm.state
+    }
+}
+
 /// Builder factory to build a virtual machine.
 pub struct VmBuilder<S: VmState + 'static> {
     pub(crate) vm_handle: VmHandle<S>,
@@ -99,7 +99,7 @@ pub enum InstructionError {
 /// Vmcs field.
 #[allow(missing_docs)]
 #[repr(i32)]
-#[derive(Debug)]
+#[derive(Clone, Copy, Debug)]
 pub enum Field {
     // 16bit fields
     Vpid = 0x00000000,
@@ -884,3 +884,62 @@ impl ExitReason {
         }
     }
 }
+
+impl BasicExitReason {
+    /// Get the name of the exit reason.
+    pub fn name(&self) -> &'static str {
+        match self {
+            Self::ExceptionOrNmi => "ExceptionOrNmi",
+            Self::ExternalInt(_) => "ExternalInt",
+            Self::TripleFault => "TripleFault",
+            Self::InitSignal => "InitSignal",
+            Self::StartupIpi => "StartupIpi",
+            Self::IoSmi => "IoSmi",
+            Self::OtherSmi => "OtherSmi",
+            Self::InterruptWindow => "InterruptWindow",
+            Self::TaskSwitch => "TaskSwitch",
+            Self::Cpuid => "Cpuid",
+            Self::Hlt => "Hlt",
+            Self::Invd => "Invd",
+            Self::Invlpg => "Invlpg",
+            Self::Rdpmc => "Rdpmc",
+            Self::Rdtsc => "Rdtsc",
+            Self::Rsm => "Rsm",
+            Self::Vmcall => "Vmcall",
+            Self::Vmclear => "Vmclear",
+            Self::Vmlaunch => "Vmlaunch",
+            Self::Vmptrld => "Vmptrld",
+            Self::Vmptrst => "Vmptrst",
+            Self::Vmread => "Vmread",
+            Self::Vmresume => "Vmresume",
+            Self::Vmwrite => "Vmwrite",
+            Self::Vmxoff => "Vmxoff",
+            Self::Vmxon => "Vmxon",
+            Self::MovCr => "MovCr",
+            Self::MovDr => "MovDr",
+            Self::IoInstruction => "IoInstruction",
+            Self::Rdmsr => "Rdmsr",
+            Self::Wrmsr => "Wrmsr",
+            Self::EntfailGuestState => "EntfailGuestState",
+            Self::EntfailMsrLoading => "EntfailMsrLoading",
+            Self::Mwait => "Mwait",
+            Self::Mtf => "Mtf",
+            Self::Monitor => "Monitor",
+            Self::Pause => "Pause",
+            Self::EntfailMachineChk => "EntfailMachineChk",
+            Self::TprBelowThreshold => "TprBelowThreshold",
+            Self::ApicAccess => "ApicAccess",
+            Self::AccessGdtrOrIdtr => "AccessGdtrOrIdtr",
+            Self::AccessLdtrOrTr => "AccessLdtrOrTr",
+            Self::EptViolation { .. } => "EptViolation",
+            Self::EptMisconfig => "EptMisconfig",
+            Self::Invept => "Invept",
+            Self::Rdtscp => "Rdtscp",
+            Self::VmxPreemptTimer => "VmxPreemptTimer",
+            Self::Invvpid => "Invvpid",
+            Self::Wbinvd => "Wbinvd",
+            Self::Xsetbv => "Xsetbv",
+            Self::Unknown => "Unknown",
+        }
+    }
+}